@@ -0,0 +1,158 @@
+// Benchmark of the host client library against the ATCI simulator (or a
+// modem on a serial port). It sends the same query a number of times, first
+// waiting for each response before sending the next command, then with the
+// commands pipelined, and reports the time taken by each run:
+//
+//   make sim host
+//   build/sim/lora-modem-sim -l /tmp/lora &
+//   build/host/lora-atci-bench -p /tmp/lora -n 500 "+DR?"
+
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <time.h>
+#include "lora_atci.h"
+
+
+static int fd;
+static unsigned long completed, failed;
+
+
+static uint32_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+static void uart_write(void *user, const void *data, size_t length)
+{
+    (void)user;
+    const char *p = data;
+    ssize_t n;
+
+    while (length) {
+        n = write(fd, p, length);
+        if (n < 0) {
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+        p += n;
+        length -= n;
+    }
+}
+
+
+static void on_response(void *ctx, lora_atci_result_t result, int err, const char *value)
+{
+    (void)ctx;
+    (void)value;
+    if (result == LORA_ATCI_OK) {
+        completed++;
+    } else {
+        fprintf(stderr, "Command failed: result %d, error %d\n", result, err);
+        failed++;
+    }
+}
+
+
+// Read whatever the modem has sent, waiting at most timeout ms
+static void receive(lora_atci_t *c, int timeout)
+{
+    struct pollfd p = { .fd = fd, .events = POLLIN };
+    char buf[256];
+    ssize_t n;
+
+    if (poll(&p, 1, timeout) <= 0) return;
+    n = read(fd, buf, sizeof(buf));
+    if (n > 0) lora_atci_input(c, buf, n);
+}
+
+
+static double run(lora_atci_t *c, const char *command, unsigned long count, unsigned int depth)
+{
+    unsigned long sent = 0;
+    uint32_t start = now_ms();
+
+    completed = failed = 0;
+    while (completed + failed < count) {
+        while (sent < count && lora_atci_pending(c) < depth
+            && lora_atci_send(c, command, NULL, 0, on_response, NULL, now_ms(), 5000) >= 0)
+            sent++;
+        receive(c, 100);
+        lora_atci_tick(c, now_ms());
+    }
+    return (now_ms() - start) / 1000.0;
+}
+
+
+static int open_port(const char *path, speed_t speed)
+{
+    struct termios t;
+
+    if ((fd = open(path, O_RDWR | O_NOCTTY)) < 0) {
+        perror(path);
+        return -1;
+    }
+
+    if (tcgetattr(fd, &t) == 0) {
+        cfmakeraw(&t);
+        cfsetispeed(&t, speed);
+        cfsetospeed(&t, speed);
+        tcsetattr(fd, TCSANOW, &t);
+    }
+    tcflush(fd, TCIOFLUSH);
+    return 0;
+}
+
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s -p <port> [-n <count>] [-d <depth>] [<command>]\n", name);
+}
+
+
+int main(int argc, char *argv[])
+{
+    const char *port = NULL, *command = "+DR?";
+    unsigned long count = 200;
+    unsigned int depth = LORA_ATCI_PIPELINE;
+    lora_atci_io_t io = { .write = uart_write };
+    lora_atci_t client;
+    double t1, tn;
+    int c;
+
+    while ((c = getopt(argc, argv, "p:n:d:h")) != -1) {
+        switch (c) {
+            case 'p': port = optarg; break;
+            case 'n': count = strtoul(optarg, NULL, 10); break;
+            case 'd': depth = strtoul(optarg, NULL, 10); break;
+            default: usage(argv[0]); return EXIT_FAILURE;
+        }
+    }
+    if (port == NULL || count == 0 || depth == 0 || depth > LORA_ATCI_PIPELINE) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (optind < argc) command = argv[optind];
+
+    if (open_port(port, B19200) < 0) return EXIT_FAILURE;
+    lora_atci_init(&client, &io);
+
+    t1 = run(&client, command, count, 1);
+    printf("Lockstep:  %lu x AT%s in %.3f s, %.1f commands/s\n", count, command, t1, count / t1);
+
+    tn = run(&client, command, count, depth);
+    printf("Pipelined: %lu x AT%s in %.3f s, %.1f commands/s (depth %u)\n", count, command, tn,
+        count / tn, depth);
+
+    printf("Failed: %lu, unmatched responses: %lu\n", failed, (unsigned long)client.unmatched);
+    close(fd);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,460 @@
+#include "lora_atci.h"
+#include <string.h>
+#include <stdlib.h>
+
+// Special characters used by the SLIP encoding of frames in the framed mode
+#define SLIP_END     0xc0
+#define SLIP_ESC     0xdb
+#define SLIP_ESC_END 0xdc
+#define SLIP_ESC_ESC 0xdd
+
+enum parser_state {
+    STATE_LINE = 0,     // Collecting a line
+    STATE_RECV_BLANK,   // Waiting for the blank line after the +RECV header
+    STATE_RECV_DATA,    // Collecting the +RECV payload
+    STATE_RECV_END      // Waiting for the CRLF after the payload
+};
+
+
+// CRC-16/CCITT (polynomial 0x1021), initialized to 0xffff by the caller. The
+// same as in the modem's atci.c.
+static uint16_t crc16(uint16_t crc, const uint8_t *data, size_t length)
+{
+    while (length--) {
+        crc ^= (uint16_t)*data++ << 8;
+        for (int i = 0; i < 8; i++)
+            crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+}
+
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+
+void lora_atci_init(lora_atci_t *c, const lora_atci_io_t *io)
+{
+    memset(c, 0, sizeof(*c));
+    c->io = *io;
+    c->next_tag = 1;
+}
+
+
+static lora_atci_cmd_t *oldest(lora_atci_t *c)
+{
+    return c->count ? &c->cmd[c->head] : NULL;
+}
+
+
+// Remove the given pending command and invoke its callback. Commands are
+// answered in order, thus the command is normally the oldest one.
+static void complete(lora_atci_t *c, lora_atci_cmd_t *cmd, lora_atci_result_t result,
+    int err, const char *value)
+{
+    lora_atci_cmd_t done = *cmd;
+    unsigned int i = cmd - c->cmd, next, last;
+
+    if (i == c->head) {
+        c->head = (c->head + 1) % LORA_ATCI_PIPELINE;
+    } else {
+        // Close the gap, keeping the order of the remaining commands
+        last = (c->head + c->count - 1) % LORA_ATCI_PIPELINE;
+        for (; i != last; i = next) {
+            next = (i + 1) % LORA_ATCI_PIPELINE;
+            c->cmd[i] = c->cmd[next];
+        }
+    }
+    c->count--;
+    c->in_flight -= done.size;
+
+    if (done.cb != NULL) done.cb(done.ctx, result, err, value);
+}
+
+
+void lora_atci_reset(lora_atci_t *c)
+{
+    while (c->count) complete(c, oldest(c), LORA_ATCI_CANCELLED, 0, "");
+
+    c->state = STATE_LINE;
+    c->length = 0;
+    c->frame_length = 0;
+    c->escape = false;
+    c->frame_error = false;
+}
+
+
+void lora_atci_set_framed(lora_atci_t *c, bool framed)
+{
+    c->framed = framed;
+    c->frame_length = 0;
+    c->escape = false;
+    c->frame_error = false;
+}
+
+
+void lora_atci_set_hex(lora_atci_t *c, bool hex)
+{
+    c->hex = hex;
+}
+
+
+// Output of lora_atci_send. In the framed mode, the data is SLIP-escaped and
+// added to the CRC of the frame. Small pieces are collected in buf so that the
+// UART driver is not called for every character.
+typedef struct {
+    lora_atci_t *c;
+    uint16_t crc;
+    size_t n;
+    uint8_t buf[32];
+} writer_t;
+
+
+static void writer_flush(writer_t *w)
+{
+    if (w->n) w->c->io.write(w->c->io.user, w->buf, w->n);
+    w->n = 0;
+}
+
+
+static void writer_raw(writer_t *w, uint8_t b)
+{
+    if (w->n == sizeof(w->buf)) writer_flush(w);
+    w->buf[w->n++] = b;
+}
+
+
+static void writer_put(writer_t *w, const void *data, size_t length)
+{
+    const uint8_t *p = data;
+
+    if (!w->c->framed) {
+        while (length--) writer_raw(w, *p++);
+        return;
+    }
+
+    w->crc = crc16(w->crc, p, length);
+    for (; length; length--, p++) {
+        if (*p == SLIP_END) {
+            writer_raw(w, SLIP_ESC);
+            writer_raw(w, SLIP_ESC_END);
+        } else if (*p == SLIP_ESC) {
+            writer_raw(w, SLIP_ESC);
+            writer_raw(w, SLIP_ESC_ESC);
+        } else {
+            writer_raw(w, *p);
+        }
+    }
+}
+
+
+int lora_atci_send(lora_atci_t *c, const char *command, const void *payload,
+    size_t length, lora_atci_response_cb_t cb, void *ctx, uint32_t now,
+    uint32_t timeout)
+{
+    lora_atci_cmd_t *cmd;
+    char prefix[10];
+    size_t n, cmd_len = strlen(command), size;
+    uint16_t tag = c->next_tag;
+    writer_t w = { .c = c, .crc = 0xffff };
+    uint8_t b;
+    int i;
+
+    // AT, # and up to five digits
+    n = 0;
+    prefix[n++] = 'A';
+    prefix[n++] = 'T';
+    prefix[n++] = '#';
+    for (i = 10000; i > tag; i /= 10);
+    for (; i; i /= 10) prefix[n++] = '0' + tag / i % 10;
+
+    size = n + cmd_len + length + (c->framed ? 4 : 1);
+    if (c->count == LORA_ATCI_PIPELINE || c->in_flight + size > LORA_ATCI_WINDOW)
+        return -1;
+    if (c->framed && n + cmd_len > UINT8_MAX) return -1;
+
+    cmd = &c->cmd[(c->head + c->count) % LORA_ATCI_PIPELINE];
+    cmd->cb = cb;
+    cmd->ctx = ctx;
+    cmd->deadline = timeout ? now + timeout : 0;
+    cmd->size = size;
+    cmd->tag = tag;
+    c->count++;
+    c->in_flight += size;
+    c->next_tag = tag == UINT16_MAX ? 1 : tag + 1;
+
+    if (c->framed) {
+        // | id | len | command | payload | crc16 |, the id is the low byte of
+        // the tag. Matching is done with the tag in the response text.
+        writer_raw(&w, SLIP_END);
+        b = tag & 0xff;
+        writer_put(&w, &b, 1);
+        b = n + cmd_len;
+        writer_put(&w, &b, 1);
+        writer_put(&w, prefix, n);
+        writer_put(&w, command, cmd_len);
+        if (length) writer_put(&w, payload, length);
+        uint8_t crc[2] = { w.crc & 0xff, w.crc >> 8 };
+        writer_put(&w, crc, sizeof(crc));
+        writer_raw(&w, SLIP_END);
+    } else {
+        writer_put(&w, prefix, n);
+        writer_put(&w, command, cmd_len);
+        writer_put(&w, "\r", 1);
+        if (length) writer_put(&w, payload, length);
+    }
+    writer_flush(&w);
+    return tag;
+}
+
+
+void lora_atci_tick(lora_atci_t *c, uint32_t now)
+{
+    lora_atci_cmd_t *cmd;
+
+    // The modem answers in order. Once the oldest command times out, the
+    // responses of the ones behind it are still matched by their tags.
+    while ((cmd = oldest(c)) != NULL && cmd->deadline
+        && (int32_t)(now - cmd->deadline) >= 0)
+        complete(c, cmd, LORA_ATCI_TIMEOUT, 0, "");
+}
+
+
+// Split a response, +OK[#tag][=value] or +ERR[#tag]=err. Returns the tag, zero
+// if there is none. The value points into the line.
+static unsigned int parse_tag(char **p)
+{
+    unsigned int tag = 0;
+
+    if (**p != '#') return 0;
+    for ((*p)++; **p >= '0' && **p <= '9'; (*p)++)
+        tag = tag * 10 + (**p - '0');
+    return tag;
+}
+
+
+static void response(lora_atci_t *c, char *p, bool ok)
+{
+    lora_atci_cmd_t *cmd = NULL;
+    unsigned int tag = parse_tag(&p), i;
+    const char *value = "";
+
+    if (*p == '=') value = p + 1;
+
+    if (tag == 0) {
+        // A response without a tag, e.g., +ERR=-1 for a line the modem could
+        // not parse, belongs to the oldest command
+        cmd = oldest(c);
+    } else {
+        for (i = 0; i < c->count; i++) {
+            if (c->cmd[(c->head + i) % LORA_ATCI_PIPELINE].tag == tag) {
+                cmd = &c->cmd[(c->head + i) % LORA_ATCI_PIPELINE];
+                break;
+            }
+        }
+    }
+
+    if (cmd == NULL) {
+        c->unmatched++;
+        return;
+    }
+
+    if (ok) complete(c, cmd, LORA_ATCI_OK, 0, value);
+    else complete(c, cmd, LORA_ATCI_ERROR, atoi(value), "");
+}
+
+
+// Parse the +RECV header: port,length[,rssi,snr,dr,frequency,fcnt,multicast,timestamp,group]
+static bool parse_recv(lora_atci_t *c, const char *p)
+{
+    long v[10];
+    char *end;
+    int n = 0;
+
+    while (n < 10) {
+        v[n++] = strtol(p, &end, 10);
+        if (end == p) return false;
+        if (*end != ',') break;
+        p = end + 1;
+    }
+    if ((n != 2 && n != 10) || v[1] < 0 || v[1] > LORA_ATCI_PAYLOAD_MAX) return false;
+
+    memset(&c->recv, 0, sizeof(c->recv));
+    c->recv.port = v[0];
+    c->recv.length = v[1];
+    if (n == 10) {
+        c->recv.extended = true;
+        c->recv.rssi = v[2];
+        c->recv.snr = v[3];
+        c->recv.dr = v[4];
+        c->recv.frequency = v[5];
+        c->recv.fcnt = v[6];
+        c->recv.multicast = v[7];
+        c->recv.timestamp = v[8];
+        c->recv.group = v[9];
+    }
+    return true;
+}
+
+
+static void process_line(lora_atci_t *c)
+{
+    char *p = c->line;
+    int type, subtype;
+
+    if (c->length == 0) return;
+
+    if (strncmp(p, "+OK", 3) == 0) {
+        response(c, p + 3, true);
+    } else if (strncmp(p, "+ERR", 4) == 0) {
+        response(c, p + 4, false);
+    } else if (strncmp(p, "+EVENT=", 7) == 0) {
+        type = strtol(p + 7, &p, 10);
+        subtype = *p == ',' ? strtol(p + 1, NULL, 10) : 0;
+        if (c->io.event != NULL) c->io.event(c->io.user, type, subtype);
+    } else if (strncmp(p, "+RECV=", 6) == 0) {
+        if (parse_recv(c, p + 6)) {
+            c->received = 0;
+            c->state = STATE_RECV_BLANK;
+        }
+    } else if (strncmp(p, "+ACK", 4) == 0 || strncmp(p, "+NOACK", 6) == 0) {
+        bool ack = p[1] == 'A';
+        p += ack ? 4 : 6;
+        if (c->io.ack != NULL) c->io.ack(c->io.user, ack, *p == '=' ? atoi(p + 1) : -1);
+    } else if (c->io.line != NULL) {
+        c->io.line(c->io.user, p);
+    }
+}
+
+
+static void recv_done(lora_atci_t *c)
+{
+    c->state = STATE_RECV_END;
+    if (c->io.recv != NULL) c->io.recv(c->io.user, &c->recv, c->payload);
+}
+
+
+static void parse_char(lora_atci_t *c, char ch)
+{
+    int v;
+
+    switch (c->state) {
+        case STATE_RECV_DATA:
+            if (!c->hex) {
+                c->payload[c->received++] = ch;
+                if (c->received == c->recv.length) recv_done(c);
+                return;
+            }
+            if ((v = hex_value(ch)) < 0) {
+                // Malformed payload, resynchronize on the next line
+                c->state = STATE_LINE;
+                c->length = 0;
+                return;
+            }
+            if (c->received & 1) c->payload[c->received / 2] |= v;
+            else c->payload[c->received / 2] = v << 4;
+            if (++c->received == 2 * (size_t)c->recv.length) recv_done(c);
+            return;
+
+        case STATE_RECV_BLANK:
+            // The header is followed by \r\n\r\n, the first CRLF has ended the
+            // header line
+            if (ch == '\n') {
+                c->state = STATE_RECV_DATA;
+                if (c->recv.length == 0) recv_done(c);
+            }
+            return;
+
+        case STATE_RECV_END:
+            if (ch == '\n') c->state = STATE_LINE;
+            return;
+
+        default:
+            break;
+    }
+
+    if (ch == '\r') return;
+    if (ch == '\n') {
+        c->line[c->length] = '\0';
+        process_line(c);
+        c->length = 0;
+        return;
+    }
+    if (c->length < sizeof(c->line) - 1) c->line[c->length++] = ch;
+}
+
+
+// A frame from the modem: | id | data | crc16 |. The data is text in the same
+// format as in the text mode.
+static void process_frame(lora_atci_t *c)
+{
+    size_t len = c->frame_length;
+
+    if (len < 3) return;
+    if (crc16(0xffff, c->frame, len - 2) != (c->frame[len - 2] | c->frame[len - 1] << 8)) {
+        c->crc_errors++;
+        return;
+    }
+
+    for (size_t i = 1; i < len - 2; i++)
+        parse_char(c, c->frame[i]);
+}
+
+
+static void frame_char(lora_atci_t *c, uint8_t ch)
+{
+    if (ch == SLIP_END) {
+        if (c->frame_length && !c->frame_error) process_frame(c);
+        c->frame_length = 0;
+        c->frame_error = false;
+        c->escape = false;
+        return;
+    }
+
+    if (ch == SLIP_ESC) {
+        c->escape = true;
+        return;
+    }
+
+    if (c->escape) {
+        c->escape = false;
+        if (ch == SLIP_ESC_END) ch = SLIP_END;
+        else if (ch == SLIP_ESC_ESC) ch = SLIP_ESC;
+        else c->frame_error = true;
+    }
+
+    if (c->frame_length < sizeof(c->frame)) c->frame[c->frame_length++] = ch;
+    else c->frame_error = true;
+}
+
+
+void lora_atci_input(lora_atci_t *c, const void *data, size_t length)
+{
+    const uint8_t *p = data;
+
+    if (c->framed) {
+        while (length--) frame_char(c, *p++);
+        return;
+    }
+
+    // Copy runs of binary payload in one step
+    while (length) {
+        if (c->state == STATE_RECV_DATA && !c->hex) {
+            size_t n = c->recv.length - c->received;
+            if (n > length) n = length;
+            memcpy(c->payload + c->received, p, n);
+            c->received += n;
+            p += n;
+            length -= n;
+            if (c->received == c->recv.length) recv_done(c);
+            continue;
+        }
+        parse_char(c, *p++);
+        length--;
+    }
+}
@@ -0,0 +1,201 @@
+#ifndef _LORA_ATCI_H
+#define _LORA_ATCI_H
+
+/*! @brief Portable client for the AT command interface of the modem
+ *
+ * The client runs on the host MCU. It does not allocate memory, never blocks,
+ * and does not depend on an operating system. The application provides a
+ * function that writes to the UART and feeds everything the UART receives to
+ * lora_atci_input, from the main loop or from a receive callback. Responses,
+ * downlinks, and events are reported through callbacks.
+ *
+ * Commands are pipelined: lora_atci_send writes the command and returns right
+ * away, without waiting for the response of the commands sent before. Each
+ * command carries a sequence tag (AT#12+DR?), which the modem repeats in the
+ * response (+OK#12=5), so responses are matched to commands even when they
+ * are interleaved with events and downlinks. The modem processes the lines in
+ * order, holding them in its receive FIFO in the meantime. The client keeps
+ * the number of bytes in flight within LORA_ATCI_WINDOW, which must not exceed
+ * the FIFO size of the modem (LPUART_BUFFER_SIZE, 512 bytes by default).
+ *
+ * The client optionally talks to the modem in the framed mode (AT$FRAMED),
+ * where each command and response travels in a SLIP frame protected with a
+ * CRC. Switch the client with lora_atci_set_framed once the modem has
+ * answered the AT$FRAMED=1 command.
+ *
+ * All buffers are part of lora_atci_t. Their sizes can be changed by defining
+ * the macros below when compiling lora_atci.c and the application.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The longest line the client parses. Longer lines are truncated.
+#ifndef LORA_ATCI_LINE_MAX
+#define LORA_ATCI_LINE_MAX 256
+#endif
+
+// The largest downlink payload, see the recv callback
+#ifndef LORA_ATCI_PAYLOAD_MAX
+#define LORA_ATCI_PAYLOAD_MAX 242
+#endif
+
+// The number of commands that can wait for a response at the same time
+#ifndef LORA_ATCI_PIPELINE
+#define LORA_ATCI_PIPELINE 8
+#endif
+
+// The number of bytes of commands and payload that may be in flight, i.e.,
+// sent but not answered yet
+#ifndef LORA_ATCI_WINDOW
+#define LORA_ATCI_WINDOW 512
+#endif
+
+typedef enum {
+    LORA_ATCI_OK = 0,       // +OK, possibly with a value
+    LORA_ATCI_ERROR,        // +ERR, the error code is passed in err
+    LORA_ATCI_TIMEOUT,      // No response within the timeout, see lora_atci_tick
+    LORA_ATCI_CANCELLED     // Dropped by lora_atci_reset
+} lora_atci_result_t;
+
+/*! @brief Called with the response to a command
+ *
+ * @param[in] ctx The context passed to lora_atci_send
+ * @param[in] result How the command completed
+ * @param[in] err The error code of +ERR, zero otherwise
+ * @param[in] value The value after +OK=, NUL-terminated. Empty for +OK
+ *                  without a value. Only valid during the call.
+ */
+typedef void (*lora_atci_response_cb_t)(void *ctx, lora_atci_result_t result,
+    int err, const char *value);
+
+//! @brief The header of a downlink (+RECV), with the metadata of AT$RECVEXT=1
+typedef struct {
+    uint8_t port;
+    uint8_t length;
+    bool extended;      // The fields below are valid
+    int16_t rssi;
+    int8_t snr;
+    uint8_t dr;
+    uint32_t frequency;
+    uint32_t fcnt;
+    bool multicast;
+    uint32_t timestamp;
+    int8_t group;
+} lora_atci_recv_t;
+
+typedef struct {
+    //! @brief Write data to the UART. Must not block for long; a buffered or
+    //! DMA-driven UART driver is expected. Mandatory.
+    void (*write)(void *user, const void *data, size_t length);
+
+    //! @brief +EVENT=type,subtype
+    void (*event)(void *user, int type, int subtype);
+
+    //! @brief +RECV followed by the payload
+    void (*recv)(void *user, const lora_atci_recv_t *header, const uint8_t *payload);
+
+    //! @brief +ACK or +NOACK. Transmissions are -1 if the modem did not
+    //! report them (AT$RTXBACKOFF=0).
+    void (*ack)(void *user, bool ack, int transmissions);
+
+    //! @brief Any other line, e.g., +ANS=... or the lines of AT+CLAC
+    void (*line)(void *user, const char *line);
+
+    void *user;
+} lora_atci_io_t;
+
+typedef struct {
+    lora_atci_response_cb_t cb;
+    void *ctx;
+    uint32_t deadline;
+    uint16_t size;      // Bytes sent, returned to the window on completion
+    uint16_t tag;
+} lora_atci_cmd_t;
+
+typedef struct {
+    lora_atci_io_t io;
+    bool framed;
+    bool hex;               // Downlinks are hex-encoded (AT+DFORMAT=1)
+
+    lora_atci_cmd_t cmd[LORA_ATCI_PIPELINE];
+    uint8_t head;
+    uint8_t count;
+    uint16_t next_tag;
+    size_t in_flight;
+
+    // Text parser
+    uint8_t state;
+    char line[LORA_ATCI_LINE_MAX];
+    size_t length;
+    lora_atci_recv_t recv;
+    uint8_t payload[LORA_ATCI_PAYLOAD_MAX];
+    size_t received;        // Payload bytes (binary) or digits (hex) so far
+
+    // SLIP decoder of the framed mode
+    uint8_t frame[LORA_ATCI_LINE_MAX + LORA_ATCI_PAYLOAD_MAX * 2 + 4];
+    size_t frame_length;
+    bool escape;
+    bool frame_error;
+
+    // Statistics
+    uint32_t crc_errors;
+    uint32_t unmatched;     // Responses that matched no pending command
+} lora_atci_t;
+
+
+void lora_atci_init(lora_atci_t *c, const lora_atci_io_t *io);
+
+/*! @brief Drop all pending commands and the parser state
+ *
+ * The callbacks of the pending commands are invoked with LORA_ATCI_CANCELLED.
+ * Use after resetting the modem.
+ */
+void lora_atci_reset(lora_atci_t *c);
+
+/*! @brief Send a command
+ *
+ * @param[in] c The client
+ * @param[in] command The command without the AT prefix, e.g., "+DR?" or "+UTX 5"
+ * @param[in] payload Payload data sent after the command line, or NULL. It
+ *                    must already be encoded the way the command expects it.
+ * @param[in] length Length of the payload
+ * @param[in] cb Response callback, may be NULL
+ * @param[in] ctx Passed to the callback
+ * @param[in] now The current time (ms), see lora_atci_tick
+ * @param[in] timeout Time (ms) to wait for the response, 0 waits forever
+ * @return The sequence tag of the command, or -1 if the pipeline or the
+ *         window is full. Call lora_atci_input and retry later.
+ */
+int lora_atci_send(lora_atci_t *c, const char *command, const void *payload,
+    size_t length, lora_atci_response_cb_t cb, void *ctx, uint32_t now,
+    uint32_t timeout);
+
+/*! @brief Process data received from the modem
+ *
+ * Invokes the callbacks of the responses, downlinks, and events contained in
+ * the data. Partial lines and frames are kept for the next call.
+ */
+void lora_atci_input(lora_atci_t *c, const void *data, size_t length);
+
+//! @brief Complete commands whose timeout has expired. Call periodically.
+
+void lora_atci_tick(lora_atci_t *c, uint32_t now);
+
+//! @brief The number of commands waiting for a response
+
+static inline unsigned int lora_atci_pending(const lora_atci_t *c)
+{
+    return c->count;
+}
+
+//! @brief Select the framed or the text mode (AT$FRAMED)
+
+void lora_atci_set_framed(lora_atci_t *c, bool framed);
+
+//! @brief Tell the client that downlinks are hex-encoded (AT+DFORMAT=1)
+
+void lora_atci_set_hex(lora_atci_t *c, bool hex);
+
+#endif // _LORA_ATCI_H
@@ -30,9 +30,11 @@ Maintainer: Miguel Luis, Gregory Cristian and Wael Guibene
   ******************************************************************************
   */
 
+
 /* Includes ------------------------------------------------------------------*/
 #include <time.h>
 #include "rtc.h"
+#include "halt.h"
 #include "timeServer.h"
 //#include "low_power.h"
 
@@ -53,58 +55,199 @@ Maintainer: Miguel Luis, Gregory Cristian and Wael Guibene
   } while(0);
 
 
-
 /*!
- * Timers list head pointer
+ * Maximum number of timers that can be started at the same time
  */
-static TimerEvent_t *TimerListHead = NULL;
+#ifndef TIMER_HEAP_SIZE
+#define TIMER_HEAP_SIZE 32
+#endif
 
 /*!
- * \brief Adds or replace the head timer of the list.
- *
- * \remark The list is automatically sorted. The list head always contains the
- *         next timer to expire.
+ * Started timers are kept in a binary min-heap ordered by their deadline, i.e.,
+ * the expiration time plus the slack. Each timer object keeps its own position
+ * in the heap (HeapIndex, 1 is the root, 0 means not started) so that it can be
+ * found and removed without a search. Expiration times are absolute RTC ticks
+ * and are compared with wrap-around arithmetic, so they never have to be
+ * rebased.
  *
- * \param [IN]  obj Timer object to be become the new head
- * \param [IN]  remainingTime Remaining time of the previous head to be replaced
+ * The RTC alarm is programmed for the earliest deadline. When it fires, all
+ * timers that have reached their expiration time are executed, which merges
+ * timers with slack into wakeups scheduled for other timers.
  */
-static void TimerInsertNewHeadTimer( TimerEvent_t *obj );
+static TimerEvent_t *TimerHeap[TIMER_HEAP_SIZE];
+static uint8_t TimerHeapCount = 0;
 
 /*!
- * \brief Adds a timer to the list.
- *
- * \remark The list is automatically sorted. The list head always contains the
- *         next timer to expire.
- *
- * \param [IN]  obj Timer object to be added to the list
- * \param [IN]  remainingTime Remaining time of the running head after which the object may be added
+ * Number of started timers with a non-zero slack
  */
-static void TimerInsertTimer( TimerEvent_t *obj );
+static uint8_t TimerSlackCount = 0;
 
 /*!
- * \brief Sets a timeout with the duration "timestamp"
- *
- * \param [IN] timestamp Delay duration
+ * The timer the RTC alarm has been programmed for, NULL if the alarm is off
  */
-static void TimerSetTimeout( TimerEvent_t *obj );
+static TimerEvent_t *TimerArmed = NULL;
 
 /*!
- * \brief Check if the Object to be added is not already in the list
- *
- * \param [IN] timestamp Delay duration
- * \retval true (the object is already in the list) or false
+ * \brief Returns the latest time at which the timer must be executed
+ */
+static inline uint32_t TimerDeadline( TimerEvent_t *obj )
+{
+  return obj->Timestamp + obj->Slack;
+}
+
+/*!
+ * \brief Returns true if the deadline of timer a comes before that of timer b
+ */
+static inline bool TimerBefore( TimerEvent_t *a, TimerEvent_t *b )
+{
+  return ( int32_t )( TimerDeadline( a ) - TimerDeadline( b ) ) < 0;
+}
+
+/*!
+ * \brief Places the object at the given heap position (0-based)
+ */
+static inline void TimerHeapPlace( TimerEvent_t *obj, unsigned pos )
+{
+  TimerHeap[pos] = obj;
+  obj->HeapIndex = pos + 1;
+}
+
+/*!
+ * \brief Moves the object at the given heap position towards the root
+ */
+static void TimerHeapSiftUp( unsigned pos )
+{
+  TimerEvent_t *obj = TimerHeap[pos];
+  unsigned parent;
+
+  while( pos > 0 )
+  {
+    parent = ( pos - 1 ) / 2;
+    if( !TimerBefore( obj, TimerHeap[parent] ) ) break;
+    TimerHeapPlace( TimerHeap[parent], pos );
+    pos = parent;
+  }
+  TimerHeapPlace( obj, pos );
+}
+
+/*!
+ * \brief Moves the object at the given heap position towards the leaves
+ */
+static void TimerHeapSiftDown( unsigned pos )
+{
+  TimerEvent_t *obj = TimerHeap[pos];
+  unsigned child;
+
+  while( ( child = 2 * pos + 1 ) < TimerHeapCount )
+  {
+    if( child + 1 < TimerHeapCount && TimerBefore( TimerHeap[child + 1], TimerHeap[child] ) ) child++;
+    if( !TimerBefore( TimerHeap[child], obj ) ) break;
+    TimerHeapPlace( TimerHeap[child], pos );
+    pos = child;
+  }
+  TimerHeapPlace( obj, pos );
+}
+
+/*!
+ * \brief Adds the object to the heap
+ */
+static void TimerHeapInsert( TimerEvent_t *obj )
+{
+  if( TimerHeapCount == TIMER_HEAP_SIZE ) halt( "Too many timers" );
+  if( obj->Slack != 0 ) TimerSlackCount++;
+  TimerHeap[TimerHeapCount++] = obj;
+  TimerHeapSiftUp( TimerHeapCount - 1 );
+}
+
+/*!
+ * \brief Removes the object from the heap
+ */
+static void TimerHeapRemove( TimerEvent_t *obj )
+{
+  unsigned pos = obj->HeapIndex - 1;
+  TimerEvent_t *last = TimerHeap[--TimerHeapCount];
+
+  obj->HeapIndex = 0;
+  if( obj->Slack != 0 ) TimerSlackCount--;
+  if( pos == TimerHeapCount ) return;
+
+  TimerHeap[pos] = last;
+  if( pos > 0 && TimerBefore( last, TimerHeap[( pos - 1 ) / 2] ) )
+  {
+    TimerHeapSiftUp( pos );
+  }
+  else
+  {
+    TimerHeapSiftDown( pos );
+  }
+}
+
+/*!
+ * \brief Returns a timer that has reached its expiration time, or NULL
+ */
+static TimerEvent_t *TimerNextExpired( void )
+{
+  uint32_t now;
+  unsigned i;
+
+  if( TimerHeapCount == 0 ) return NULL;
+  now = rtc_get_timer_value( );
+
+  // Without slack, the root is the only candidate
+  if( TimerSlackCount == 0 )
+  {
+    return ( int32_t )( TimerHeap[0]->Timestamp - now ) <= 0 ? TimerHeap[0] : NULL;
+  }
+
+  for( i = 0; i < TimerHeapCount; i++ )
+  {
+    if( ( int32_t )( TimerHeap[i]->Timestamp - now ) <= 0 ) return TimerHeap[i];
+  }
+  return NULL;
+}
+
+/*!
+ * \brief Programs the RTC alarm for the timer at the root of the heap, or
+ *        stops the alarm if no timer is started
  */
-static bool TimerExists( TimerEvent_t *obj );
+static void TimerSetTimeout( void )
+{
+  TimerEvent_t *obj;
+  int32_t timeout;
+  int32_t minTicks;
+
+  if( TimerHeapCount == 0 )
+  {
+    if( TimerArmed != NULL ) rtc_stop_alarm( );
+    TimerArmed = NULL;
+    return;
+  }
+
+  obj = TimerHeap[0];
+  if( obj == TimerArmed ) return;
+  TimerArmed = obj;
+
+  // rtc_set_alarm takes the timeout relative to the timer context
+  minTicks = rtc_get_min_timeout( );
+  timeout = ( int32_t )( TimerDeadline( obj ) - rtc_set_timer_context( ) );
+
+  // In case deadline too soon
+  if( timeout < minTicks )
+  {
+    timeout = minTicks;
+  }
+  rtc_set_alarm( timeout );
+}
 
 void TimerInit( TimerEvent_t *obj, void ( *callback )( void *context ) )
 {
   obj->Timestamp = 0;
   obj->ReloadValue = 0;
   obj->IsStarted = false;
-  obj->IsNext2Expire = false;
+  obj->Slack = 0;
+  obj->HeapIndex = 0;
   obj->Callback = callback;
   obj->Context = NULL;
-  obj->Next = NULL;
 }
 
 void TimerSetContext( TimerEvent_t *obj, void* context )
@@ -114,104 +257,64 @@ void TimerSetContext( TimerEvent_t *obj, void* context )
 
 void TimerStart( TimerEvent_t *obj )
 {
-  uint32_t elapsedTime = 0;
-
   BACKUP_PRIMASK();
 
   DISABLE_IRQ( );
 
-
-  if( ( obj == NULL ) || ( TimerExists( obj ) == true ) )
+  if( ( obj == NULL ) || ( obj->HeapIndex != 0 ) )
   {
     RESTORE_PRIMASK( );
     return;
   }
-  obj->Timestamp = obj->ReloadValue;
+  obj->Timestamp = rtc_get_timer_value( ) + obj->ReloadValue;
   obj->IsStarted = true;
-  obj->IsNext2Expire = false;
 
-  if( TimerListHead == NULL )
-  {
-    rtc_set_timer_context( );
-    TimerInsertNewHeadTimer( obj ); // insert a timeout at now+obj->Timestamp
-  }
-  else
-  {
-    elapsedTime = rtc_get_timer_elapsed_time( );
-    obj->Timestamp += elapsedTime;
-
-    if( obj->Timestamp < TimerListHead->Timestamp )
-    {
-      TimerInsertNewHeadTimer( obj);
-    }
-    else
-    {
-      TimerInsertTimer( obj);
-    }
-  }
+  TimerHeapInsert( obj );
+  TimerSetTimeout( );
+
   RESTORE_PRIMASK( );
 }
 
-
-
 bool TimerIsStarted( TimerEvent_t *obj )
 {
   return obj->IsStarted;
 }
 
+bool TimerIsIdle( void )
+{
+  return TimerHeapCount == 0;
+}
+
 void TimerIrqHandler( void )
 {
   TimerEvent_t* cur;
-  TimerEvent_t* next;
-
-
+  BACKUP_PRIMASK();
 
-  uint32_t old =  rtc_get_timer_context( );
-  uint32_t now =  rtc_set_timer_context( );
-  uint32_t DeltaContext = now - old; //intentionnal wrap around
+  DISABLE_IRQ( );
 
-  /* Update timeStamp based upon new Time Reference*/
-  /* because delta context should never exceed 2^32*/
-  if ( TimerListHead != NULL )
-  {
-    for (cur=TimerListHead; cur->Next != NULL; cur= cur->Next)
-    {
-      next =cur->Next;
-      if (next->Timestamp > DeltaContext)
-      {
-        next->Timestamp -= DeltaContext;
-      }
-      else
-      {
-        next->Timestamp = 0 ;
-      }
-    }
-  }
+  // The alarm was programmed for the armed timer. Execute it even if the alarm
+  // fired slightly early to compensate for the MCU wakeup time.
+  cur = TimerArmed;
+  TimerArmed = NULL;
 
-  /* execute imediately the alarm callback */
-  if ( TimerListHead != NULL )
+  while( cur != NULL )
   {
-    cur = TimerListHead;
-    TimerListHead = TimerListHead->Next;
+    TimerHeapRemove( cur );
     cur->IsStarted = false;
-    exec_cb( cur->Callback, cur->Context );
-  }
 
+    // Callbacks run with interrupts enabled; they may start or stop timers
+    RESTORE_PRIMASK( );
+    exec_cb( cur->Callback, cur->Context );
+    DISABLE_IRQ( );
 
-  // remove all the expired object from the list
-  while( ( TimerListHead != NULL ) && ( TimerListHead->Timestamp < rtc_get_timer_elapsed_time(  )  ))
-  {
-   cur = TimerListHead;
-   TimerListHead = TimerListHead->Next;
-   cur->IsStarted = false;
-   exec_cb( cur->Callback, cur->Context );
+    // Execute all the timers that have expired in the meantime
+    cur = TimerNextExpired( );
+    if( cur != NULL && cur == TimerArmed ) TimerArmed = NULL;
   }
 
-  /* start the next TimerListHead if it exists AND NOT running */
-  if( ( TimerListHead != NULL ) && ( TimerListHead->IsNext2Expire == false ) )
-  {
-    TimerSetTimeout( TimerListHead );
-  }
+  TimerSetTimeout( );
+
+  RESTORE_PRIMASK( );
 }
 
 void TimerStop( TimerEvent_t *obj )
@@ -220,78 +323,27 @@ void TimerStop( TimerEvent_t *obj )
 
   DISABLE_IRQ( );
 
-  TimerEvent_t* prev = TimerListHead;
-  TimerEvent_t* cur = TimerListHead;
-
-  // List is empty or the Obj to stop does not exist
-  if( ( TimerListHead == NULL ) || ( obj == NULL ) )
+  // The object to stop has not been started
+  if( ( obj == NULL ) || ( obj->HeapIndex == 0 ) )
   {
     RESTORE_PRIMASK( );
     return;
   }
 
   obj->IsStarted = false;
+  TimerHeapRemove( obj );
 
-  if( TimerListHead == obj ) // Stop the Head
-  {
-    if( TimerListHead->IsNext2Expire == true ) // The head is already running
-    {
-
-      TimerListHead->IsNext2Expire = false;
-      if( TimerListHead->Next != NULL )
-      {
-        TimerListHead = TimerListHead->Next;
-        TimerSetTimeout( TimerListHead );
-      }
-      else
-      {
-        rtc_stop_alarm( );
-        TimerListHead = NULL;
-      }
-    }
-    else // Stop the head before it is started
-    {
-      if( TimerListHead->Next != NULL )
-      {
-        TimerListHead = TimerListHead->Next;
-      }
-      else
-      {
-        TimerListHead = NULL;
-      }
-    }
-  }
-  else // Stop an object within the list
+  // If the alarm was programmed for the stopped timer, reprogram it for the
+  // next timer to expire
+  if( TimerArmed == obj )
   {
-    while( cur != NULL )
-    {
-      if( cur == obj )
-      {
-        if( cur->Next != NULL )
-        {
-          cur = cur->Next;
-          prev->Next = cur;
-        }
-        else
-        {
-          cur = NULL;
-          prev->Next = cur;
-        }
-        break;
-      }
-      else
-      {
-        prev = cur;
-        cur = cur->Next;
-      }
-    }
+    TimerArmed = NULL;
+    TimerSetTimeout( );
   }
 
   RESTORE_PRIMASK( );
 }
 
-
-
 void TimerReset( TimerEvent_t *obj )
 {
   TimerStop( obj );
@@ -316,6 +368,12 @@ void TimerSetValue( TimerEvent_t *obj, uint32_t value )
   obj->ReloadValue = ticks;
 }
 
+void TimerSetSlack( TimerEvent_t *obj, uint32_t slack )
+{
+  TimerStop( obj );
+  obj->Slack = rtc_ms2tick( slack );
+}
+
 TimerTime_t TimerGetCurrentTime( void )
 {
   uint32_t now = rtc_get_timer_value( );
@@ -334,74 +392,8 @@ TimerTime_t TimerGetElapsedTime( TimerTime_t past )
   return rtc_tick2ms( nowInTicks- pastInTicks );
 }
 
-static bool TimerExists( TimerEvent_t *obj )
-{
-  TimerEvent_t* cur = TimerListHead;
-
-  while( cur != NULL )
-  {
-    if( cur == obj )
-    {
-      return true;
-    }
-    cur = cur->Next;
-  }
-  return false;
-}
-static void TimerSetTimeout( TimerEvent_t *obj )
-{
-  int32_t minTicks= rtc_get_min_timeout( );
-  obj->IsNext2Expire = true;
-
-  // In case deadline too soon
-  if(obj->Timestamp  < (rtc_get_timer_elapsed_time(  ) + minTicks) )
-  {
-    obj->Timestamp = rtc_get_timer_elapsed_time(  ) + minTicks;
-  }
-  rtc_set_alarm( obj->Timestamp );
-}
-
 TimerTime_t TimerTempCompensation( TimerTime_t period, float temperature )
 {
     return rtc_temperature_compensation( period, temperature );
 }
-
-
-static void TimerInsertTimer( TimerEvent_t *obj)
-{
-  TimerEvent_t* cur = TimerListHead;
-  TimerEvent_t* next = TimerListHead->Next;
-
-  while (cur->Next != NULL )
-  {
-    if( obj->Timestamp  > next->Timestamp )
-    {
-        cur = next;
-        next = next->Next;
-    }
-    else
-    {
-        cur->Next = obj;
-        obj->Next = next;
-        return;
-
-    }
-  }
-  cur->Next = obj;
-  obj->Next = NULL;
-}
-
-static void TimerInsertNewHeadTimer( TimerEvent_t *obj )
-{
-  TimerEvent_t* cur = TimerListHead;
-
-  if( cur != NULL )
-  {
-    cur->IsNext2Expire = false;
-  }
-
-  obj->Next = cur;
-  TimerListHead = obj;
-  TimerSetTimeout( TimerListHead );
-}
 /************************ (C) COPYRIGHT STMicroelectronics *****END OF FILE****/
@@ -0,0 +1,706 @@
+// Host-native benchmark of cbuf.c, the AT command parser in atci.c, and
+// part.c. See perf/Makefile. Each benchmark also checks the result of the
+// operations it times, so a benchmark run doubles as a quick check that a
+// performance change kept the module working:
+//
+//   make perf
+//   build/perf/lora-modem-perf -n 100000 -s 1
+//
+// The random input run feeds the parser with random lines, including overlong
+// ones and broken parameters, and then checks that it still executes a valid
+// command. A different seed (-s) gives a different input.
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "atci.h"
+#include "cbuf.h"
+#include "cmd.h"
+#include "evlog.h"
+#include "lpuart.h"
+#include "nvm.h"
+#include "part.h"
+#include "system.h"
+
+// The firmware's system configuration is called sysconf, which clashes with
+// the POSIX function declared in unistd.h
+#define sysconf posix_sysconf
+#include <unistd.h>
+#undef sysconf
+
+// The size of the RAM-backed partitioned block, the size of the data EEPROM
+#define BLOCK_SIZE 6144
+
+// A typical LoRaWAN payload (the maximum at DR5 and above) and its hex form
+#define PAYLOAD_SIZE 242
+
+// The size of the log sectors, a flash page
+#define LOG_SECTOR_SIZE 128
+
+#define JOURNAL_RECORD_SIZE 32
+#define SHADOW_RECORD_SIZE 64
+#define LOG_RECORD_SIZE 24
+
+// The line parsed by the parameter benchmarks, AT$P2P-like
+#define PARAMS "868100000,7,125,5,14"
+
+
+// Stubs of the firmware modules that the benchmarked modules call into
+
+sysconf_t sysconf;
+
+void cmd_event(unsigned int type, unsigned subtype)
+{
+    (void)type;
+    (void)subtype;
+}
+
+void system_post(unsigned tasks)
+{
+    (void)tasks;
+}
+
+unsigned int system_coalesce_window(void)
+{
+    return 0;
+}
+
+void evlog_record(unsigned int event, uint16_t a, uint32_t b)
+{
+    (void)event;
+    (void)a;
+    (void)b;
+}
+
+void evlog_flush(void)
+{
+}
+
+
+static unsigned long iterations = 100000;
+static unsigned int failures;
+
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static void report(const char *name, unsigned long ops, size_t bytes, double t)
+{
+    printf("%-30s %9.1f ns/op", name, t * 1e9 / ops);
+    if (bytes) printf(" %9.1f MB/s", bytes * (double)ops / t / 1e6);
+    printf("\n");
+}
+
+
+static void check(bool condition, const char *name)
+{
+    if (condition) return;
+    fprintf(stderr, "%s: Unexpected result\n", name);
+    failures++;
+}
+
+
+// Discard the output of the parser, nobody reads the pseudo-terminal
+static void drain_output(void)
+{
+    cbuf_consume(&lpuart_tx_fifo, cbuf_length(&lpuart_tx_fifo));
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// cbuf
+
+static void bench_cbuf_copy(size_t chunk)
+{
+    static char buffer[LPUART_BUFFER_SIZE];
+    char in[256], out[256], name[32];
+    volatile cbuf_t c;
+    size_t total = 0;
+    double t;
+
+    for (size_t i = 0; i < sizeof(in); i++) in[i] = i;
+    cbuf_init(&c, buffer, sizeof(buffer));
+
+    // Keep the FIFO partially full so that the copies wrap around
+    cbuf_put(&c, in, sizeof(buffer) / 3);
+
+    t = now();
+    for (unsigned long i = 0; i < iterations; i++) {
+        total += cbuf_put(&c, in, chunk);
+        total -= cbuf_get(&c, out, chunk);
+    }
+    t = now() - t;
+
+    snprintf(name, sizeof(name), "cbuf put/get %zu B", chunk);
+    check(total == 0 && cbuf_length(&c) == sizeof(buffer) / 3, name);
+    report(name, iterations, chunk, t);
+}
+
+
+static void bench_cbuf_views(size_t chunk)
+{
+    static char buffer[LPUART_BUFFER_SIZE];
+    char in[256], out[256], name[32];
+    volatile cbuf_t c;
+    cbuf_view_t v;
+    size_t total = 0;
+    double t;
+
+    for (size_t i = 0; i < sizeof(in); i++) in[i] = i;
+    cbuf_init(&c, buffer, sizeof(buffer));
+    cbuf_put(&c, in, sizeof(buffer) / 3);
+
+    t = now();
+    for (unsigned long i = 0; i < iterations; i++) {
+        total += cbuf_produce(&c, cbuf_copy_in(cbuf_tail(&c, &v), in, chunk));
+        total -= cbuf_consume(&c, cbuf_copy_out(out, cbuf_head(&c, &v), chunk));
+    }
+    t = now() - t;
+
+    snprintf(name, sizeof(name), "cbuf views %zu B", chunk);
+    check(total == 0 && cbuf_length(&c) == sizeof(buffer) / 3, name);
+    report(name, iterations, chunk, t);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Hex codecs and parameter helpers
+
+static void bench_hex_encode(void)
+{
+    uint8_t data[PAYLOAD_SIZE];
+    char hex[2 * PAYLOAD_SIZE];
+    double t;
+
+    for (size_t i = 0; i < sizeof(data); i++) data[i] = i * 7;
+
+    t = now();
+    for (unsigned long i = 0; i < iterations; i++) {
+        atci_print_buffer_as_hex(data, sizeof(data));
+        if (i + 1 < iterations) drain_output();
+    }
+    t = now() - t;
+
+    check(cbuf_get(&lpuart_tx_fifo, hex, sizeof(hex)) == sizeof(hex)
+        && !memcmp(hex, "00070E15", 8) && cbuf_length(&lpuart_tx_fifo) == 0, "hex encode");
+    drain_output();
+    report("hex encode 242 B", iterations, sizeof(data), t);
+}
+
+
+static void bench_hex_decode(void)
+{
+    static const char digits[] = "0123456789abcdef";
+    uint8_t data[PAYLOAD_SIZE];
+    char hex[2 * PAYLOAD_SIZE];
+    atci_param_t p;
+    size_t n = 0;
+    double t;
+
+    for (size_t i = 0; i < PAYLOAD_SIZE; i++) {
+        hex[2 * i] = digits[(i >> 4) & 0xf];
+        hex[2 * i + 1] = digits[i & 0xf];
+    }
+
+    t = now();
+    for (unsigned long i = 0; i < iterations; i++) {
+        p = (atci_param_t){ .txt = hex, .length = sizeof(hex), .offset = 0 };
+        n = atci_param_get_buffer_from_hex(&p, data, sizeof(data), sizeof(hex));
+    }
+    t = now() - t;
+
+    check(n == PAYLOAD_SIZE && data[0] == 0 && data[PAYLOAD_SIZE - 1] == PAYLOAD_SIZE - 1,
+        "hex decode");
+    report("hex decode 242 B", iterations, sizeof(data), t);
+}
+
+
+static void bench_param_uint(void)
+{
+    char line[] = PARAMS;
+    uint32_t v, sum = 0;
+    atci_param_t p;
+    double t;
+
+    t = now();
+    for (unsigned long i = 0; i < iterations; i++) {
+        p = (atci_param_t){ .txt = line, .length = sizeof(line) - 1, .offset = 0 };
+        sum = 0;
+        do {
+            if (!atci_param_get_uint(&p, &v)) break;
+            sum += v;
+        } while (atci_param_is_comma(&p));
+    }
+    t = now() - t;
+
+    check(sum == 868100000 + 7 + 125 + 5 + 14 && p.offset == p.length, "param uint");
+    report("param get_uint 5 fields", iterations, 0, t);
+}
+
+
+static void bench_param_tokenize(void)
+{
+    char line[] = PARAMS ",0123456789abcdef,,x";
+    atci_token_t tokens[8];
+    atci_param_t p;
+    int n = 0;
+    double t;
+
+    t = now();
+    for (unsigned long i = 0; i < iterations; i++) {
+        p = (atci_param_t){ .txt = line, .length = sizeof(line) - 1, .offset = 0 };
+        n = atci_param_tokenize(&p, tokens, sizeof(tokens) / sizeof(tokens[0]));
+    }
+    t = now() - t;
+
+    check(n == 8 && tokens[0].value == 868100000 && (tokens[5].flags & ATCI_TOKEN_HEX)
+        && tokens[6].flags == 0, "param tokenize");
+    report("param tokenize 8 fields", iterations, 0, t);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Command dispatch
+
+static unsigned long executed, queried;
+
+
+static void set_perf(atci_param_t *param)
+{
+    uint32_t v;
+
+    do {
+        if (!atci_param_get_uint(param, &v)) {
+            atci_print("+ERR=-3\r\n\r\n");
+            return;
+        }
+    } while (atci_param_is_comma(param));
+
+    executed++;
+    atci_print("+OK\r\n\r\n");
+}
+
+
+static void get_perf(void)
+{
+    queried++;
+    atci_printf("+OK=%lu\r\n\r\n", executed);
+}
+
+
+static void action(atci_param_t *param)
+{
+    (void)param;
+    atci_print("+OK\r\n\r\n");
+}
+
+
+// Enough commands for the index lookup to take a few steps
+static const atci_command_t commands[] = {
+    {"+BAND",  NULL,   set_perf, get_perf, NULL, ""},
+    {"+DR",    NULL,   set_perf, get_perf, NULL, ""},
+    {"+MODE",  NULL,   set_perf, get_perf, NULL, ""},
+    {"+PORT",  NULL,   set_perf, get_perf, NULL, ""},
+    {"+REBOOT", action, NULL,    NULL,     NULL, ""},
+    {"+VER",   NULL,   NULL,     get_perf, NULL, ""},
+    {"$CERT",  NULL,   set_perf, get_perf, NULL, ""},
+    {"$PERF",  action, set_perf, get_perf, NULL, ""},
+    {"$P2P",   NULL,   set_perf, get_perf, NULL, ""},
+    {"$TPL",   NULL,   set_perf, get_perf, NULL, ""},
+    ATCI_COMMAND_CLAC,
+    ATCI_COMMAND_HELP
+};
+
+
+static void feed(const char *data, size_t length)
+{
+    size_t n;
+
+    while (length) {
+        n = cbuf_put(&lpuart_rx_fifo, data, length);
+        data += n;
+        length -= n;
+        atci_process();
+        drain_output();
+    }
+}
+
+
+static void bench_dispatch(void)
+{
+    static const char line[] = "AT$PERF=" PARAMS "\r\n";
+    double t;
+
+    executed = 0;
+    t = now();
+    for (unsigned long i = 0; i < iterations; i++) feed(line, sizeof(line) - 1);
+    t = now() - t;
+
+    check(executed == iterations, "dispatch");
+    report("dispatch AT$PERF=<5 fields>", iterations, sizeof(line) - 1, t);
+}
+
+
+static void bench_dispatch_query(void)
+{
+    static const char line[] = "AT$PERF?\r\n";
+    double t;
+
+    queried = 0;
+    t = now();
+    for (unsigned long i = 0; i < iterations; i++) feed(line, sizeof(line) - 1);
+    t = now() - t;
+
+    check(queried == iterations, "dispatch query");
+    report("dispatch query, 12 commands", iterations, 0, t);
+}
+
+
+static void bench_random_input(void)
+{
+    static const char alphabet[] = "AT+$=?,;\"0123456789ABCDEFabcdef PERF\r\n";
+    static const char probe[] = "\r\nAT$PERF?\r\n";
+    char line[ATCI_RX_BUFFER_SIZE + 64];
+    size_t length, bytes = 0;
+    unsigned long lines = iterations / 10 + 1;
+    double t;
+
+    t = now();
+    for (unsigned long i = 0; i < lines; i++) {
+        // Mostly short lines, some longer than the receive buffer
+        length = rand() % 8 ? (size_t)rand() % 40 : (size_t)rand() % sizeof(line);
+
+        for (size_t j = 0; j < length; j++) {
+            // Mostly characters that the parser acts upon, some arbitrary bytes
+            if (rand() % 16) line[j] = alphabet[rand() % (sizeof(alphabet) - 1)];
+            else line[j] = rand();
+        }
+
+        // Half of the lines look like commands
+        if (length >= 3 && rand() % 2) memcpy(line, "AT", 2);
+
+        feed(line, length);
+        bytes += length;
+    }
+    t = now() - t;
+
+    // Whatever state the input left the parser in, a new command line must be
+    // executed once the pending line has been terminated
+    queried = 0;
+    feed(probe, sizeof(probe) - 1);
+    check(queried == 1, "random input");
+
+    report("random input lines", lines, bytes / lines, t);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Command lookup
+
+// About the size of the firmware's command table in cmd.c
+#define LOOKUP_COMMANDS 160
+
+static_assert(LOOKUP_COMMANDS <= ATCI_MAX_COMMANDS, "LOOKUP_COMMANDS too large");
+
+static char lookup_names[LOOKUP_COMMANDS][8];
+static char lookup_lines[LOOKUP_COMMANDS][16];
+static atci_command_t lookup_commands[LOOKUP_COMMANDS];
+
+
+static void init_lookup(void)
+{
+    for (unsigned int i = 0; i < LOOKUP_COMMANDS; i++) {
+        snprintf(lookup_names[i], sizeof(lookup_names[i]), "%c%c%03u", "+$"[i % 2], 'A' + i % 26, i);
+        snprintf(lookup_lines[i], sizeof(lookup_lines[i]), "AT%s?\r\n", lookup_names[i]);
+        lookup_commands[i] = (atci_command_t){lookup_names[i], NULL, set_perf, get_perf, NULL, ""};
+    }
+}
+
+
+// The linear search of the command table that atci.c did before it had the
+// sorted index, as the reference for the binary search
+static const atci_command_t *find_linear(const char *name, size_t name_len)
+{
+    const atci_command_t *cmd;
+    size_t cmd_len;
+
+    for (size_t i = 0; i < LOOKUP_COMMANDS; i++) {
+        cmd = lookup_commands + i;
+        cmd_len = strlen(cmd->command);
+
+        if (name_len < cmd_len) continue;
+        if (strncmp(name, cmd->command, cmd_len) != 0) continue;
+        if (cmd_len == name_len || name[cmd_len] == '=' || name[cmd_len] == '?') return cmd;
+    }
+    return NULL;
+}
+
+
+static void bench_lookup_linear(void)
+{
+    volatile size_t found = 0;
+    double t;
+
+    t = now();
+    for (unsigned long i = 0; i < iterations; i++) {
+        const char *line = lookup_lines[i % LOOKUP_COMMANDS];
+        found += find_linear(line + 2, strlen(line) - 4) != NULL;
+    }
+    t = now() - t;
+
+    check(found == iterations, "lookup linear");
+    report("lookup linear, 160 commands", iterations, 0, t);
+}
+
+
+// Dispatch through atci_process, which finds the command with a binary search
+// over its sorted index. Compare with the linear lookup above plus the
+// dispatch of a command from the small table.
+static void bench_lookup_dispatch(void)
+{
+    double t;
+
+    atci_init(19200, lookup_commands, LOOKUP_COMMANDS);
+
+    queried = 0;
+    t = now();
+    for (unsigned long i = 0; i < iterations; i++) {
+        const char *line = lookup_lines[i % LOOKUP_COMMANDS];
+        feed(line, strlen(line));
+    }
+    t = now() - t;
+
+    check(queried == iterations, "lookup dispatch");
+    report("dispatch query, 160 commands", iterations, 0, t);
+
+    atci_init(19200, commands, sizeof(commands) / sizeof(commands[0]));
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// part
+
+static uint8_t memory[BLOCK_SIZE];
+static size_t written;
+
+
+static bool ram_write(uint32_t address, const void *buffer, size_t length)
+{
+    if (address + length > sizeof(memory)) return false;
+    memcpy(memory + address, buffer, length);
+    written += length;
+    return true;
+}
+
+
+static bool ram_erase(uint32_t address, size_t length)
+{
+    if (address + length > sizeof(memory)) return false;
+    memset(memory + address, 0, length);
+    return true;
+}
+
+
+static const void *ram_mmap(uint32_t address, size_t length)
+{
+    if (address + length > sizeof(memory)) return NULL;
+    return memory + address;
+}
+
+
+static part_block_t block = {
+    .size = BLOCK_SIZE,
+    .write = ram_write,
+    .erase = ram_erase,
+    .mmap = ram_mmap
+};
+
+static part_t journal_part, shadow_part, log_part;
+
+
+static void report_part(const char *name, unsigned long ops, double t)
+{
+    printf("%-30s %9.1f ns/op %9.1f B written/op\n", name, t * 1e9 / ops,
+        (double)written / ops);
+}
+
+
+static bool open_block(void)
+{
+    part_layout_t layout[] = {
+        { "journal", 16 * PART_JOURNAL_SLOT_SIZE(JOURNAL_RECORD_SIZE), &journal_part },
+        { "shadow",  PART_SHADOW_SIZE(SHADOW_RECORD_SIZE),             &shadow_part  },
+        { "log",     16 * LOG_SECTOR_SIZE,                             &log_part     }
+    };
+
+    memset(memory, 0, sizeof(memory));
+    if (part_format_block(&block, 8) != 0) return false;
+    if (part_open_block(&block) != 0) return false;
+    return part_migrate_layout(&block, layout, sizeof(layout) / sizeof(layout[0])) == 0;
+}
+
+
+static void reopen_block(void)
+{
+    part_close_block(&block);
+    check(part_open_block(&block) == 0
+        && part_find(&journal_part, &block, "journal") == 0
+        && part_find(&shadow_part, &block, "shadow") == 0
+        && part_find(&log_part, &block, "log") == 0, "part reopen");
+}
+
+
+static void bench_part_journal(void)
+{
+    static part_journal_t journal;
+    uint8_t record[JOURNAL_RECORD_SIZE];
+    const uint8_t *latest;
+    double t;
+
+    check(part_journal_open(&journal, &journal_part, sizeof(record)) == 0, "journal open");
+    memset(record, 0, sizeof(record));
+
+    written = 0;
+    t = now();
+    for (unsigned long i = 0; i < iterations; i++) {
+        memcpy(record, &i, sizeof(i));
+        if (!part_journal_append(&journal, record)) break;
+    }
+    t = now() - t;
+    report_part("part journal append 32 B", iterations, t);
+
+    // The most recent record must survive a reboot
+    reopen_block();
+    check(part_journal_open(&journal, &journal_part, sizeof(record)) == 0
+        && (latest = part_journal_read(&journal)) != NULL
+        && !memcmp(latest, record, sizeof(record)), "journal");
+}
+
+
+static void bench_part_shadow(void)
+{
+    static part_shadow_t shadow;
+    uint8_t record[SHADOW_RECORD_SIZE];
+    const uint8_t *latest;
+    double t;
+
+    check(part_shadow_open(&shadow, &shadow_part, sizeof(record)) == 0, "shadow open");
+
+    // Successive versions differ in a few bytes only, like most NVM updates
+    memset(record, 0x55, sizeof(record));
+
+    written = 0;
+    t = now();
+    for (unsigned long i = 0; i < iterations; i++) {
+        memcpy(record, &i, sizeof(i));
+        if (!part_shadow_write(&shadow, record)) break;
+    }
+    t = now() - t;
+    report_part("part shadow write 64 B", iterations, t);
+
+    reopen_block();
+    check(part_shadow_open(&shadow, &shadow_part, sizeof(record)) == 0
+        && (latest = part_shadow_read(&shadow)) != NULL
+        && !memcmp(latest, record, sizeof(record)), "shadow");
+}
+
+
+static void bench_part_log(void)
+{
+    static part_log_t log;
+    uint8_t record[LOG_RECORD_SIZE];
+    const uint8_t *r;
+    unsigned long next = 0, bad = 0;
+    size_t n;
+    double t;
+
+    check(part_log_open(&log, &log_part, LOG_SECTOR_SIZE) == 0, "log open");
+    memset(record, 0, sizeof(record));
+
+    // Keep a few records queued, as the store does while the network is down
+    written = 0;
+    t = now();
+    for (unsigned long i = 0; i < iterations; i++) {
+        memcpy(record, &i, sizeof(i));
+        if (!part_log_append(&log, record, sizeof(record))) break;
+        if (i < 8) continue;
+
+        r = part_log_peek(&log, &n);
+        if (r == NULL || n != sizeof(record) || memcmp(r, &next, sizeof(next))) bad++;
+        next++;
+        part_log_consume(&log);
+    }
+    t = now() - t;
+    report_part("part log append+consume 24 B", iterations, t);
+
+    check(bad == 0, "log order");
+    reopen_block();
+    check(part_log_open(&log, &log_part, LOG_SECTOR_SIZE) == 0 && log.count == 8
+        && (r = part_log_peek(&log, &n)) != NULL && !memcmp(r, &next, sizeof(next)), "log");
+}
+
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-n <iterations>] [-s <seed>]\n", name);
+}
+
+
+int main(int argc, char *argv[])
+{
+    unsigned int seed = 1;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:s:h")) != -1) {
+        switch (c) {
+            case 'n': iterations = strtoul(optarg, NULL, 10); break;
+            case 's': seed = strtoul(optarg, NULL, 10); break;
+            default: usage(argv[0]); return EXIT_FAILURE;
+        }
+    }
+    if (iterations == 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    srand(seed);
+
+    atci_init(19200, commands, sizeof(commands) / sizeof(commands[0]));
+
+    bench_cbuf_copy(1);
+    bench_cbuf_copy(4);
+    bench_cbuf_copy(5);
+    bench_cbuf_copy(16);
+    bench_cbuf_copy(64);
+    bench_cbuf_copy(256);
+    bench_cbuf_views(16);
+    bench_cbuf_views(256);
+
+    bench_hex_encode();
+    bench_hex_decode();
+    bench_param_uint();
+    bench_param_tokenize();
+    bench_dispatch();
+    bench_dispatch_query();
+    init_lookup();
+    bench_lookup_linear();
+    bench_lookup_dispatch();
+    bench_random_input();
+
+    if (open_block()) {
+        bench_part_journal();
+        bench_part_shadow();
+        bench_part_log();
+    } else {
+        check(false, "part format");
+    }
+
+    printf("Failed checks: %u\n", failures);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
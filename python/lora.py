@@ -34,7 +34,12 @@ import sys
 import re
 import serial
 import binascii
+import struct
 import select
+import asyncio
+import socket
+import socketserver
+import json
 from abc import ABC
 from functools import lru_cache
 from collections import namedtuple
@@ -44,7 +49,8 @@ from datetime import datetime, timedelta
 from enum import Enum, unique, auto
 from threading import Thread, RLock
 from queue import Queue, Empty
-from time import sleep
+from concurrent.futures import Future
+from time import sleep, perf_counter
 from pymitter import EventEmitter # type: ignore
 
 # The following imports are needed for the command line interface
@@ -71,6 +77,9 @@ class EventType(Enum):
     MODULE  = 0
     JOIN    = 1
     NETWORK = 2
+    TX      = 6
+    P2P     = 11
+    TPC     = 12
 
 @unique
 class ModuleEventSubtype(Enum):
@@ -78,25 +87,67 @@ class ModuleEventSubtype(Enum):
     FACNEW     = 1
     BOOTLOADER = 2
     HALT       = 3
+    RESUME     = 4
 
 @unique
 class JoinEventSubtype(Enum):
     FAILED    = 0
     SUCCEEDED = 1
+    REJOIN_FAILED    = 2
+    REJOIN_SUCCEEDED = 3
 
 @unique
 class NetworkEventSubtype(Enum):
     NO_ANSWER      = 0
     ANSWER         = 1
     RETRANSMISSION = 2
+    RX_DROPPED     = 3
+    LINK_DR_DOWN   = 4
+    LINK_CHECK     = 5
+    LINK_REJOIN    = 6
+    ADR_DR_UP      = 7
+    ADR_DR_DOWN    = 8
 
-EventSubtype = Union[ModuleEventSubtype, JoinEventSubtype, NetworkEventSubtype]
+@unique
+class TxEventSubtype(Enum):
+    DONE      = 0
+    RX_CLOSED = 1
+
+@unique
+class P2PEventSubtype(Enum):
+    TX_DONE    = 0
+    TX_TIMEOUT = 1
+    RX_DROPPED = 2
+    BULK_TX_DONE   = 3
+    BULK_TX_FAILED = 4
+    BULK_RX_DONE   = 5
+    PING_DONE      = 6
+    PING_FAILED    = 7
+
+@unique
+class TpcEventSubtype(Enum):
+    LOWERED = 0
+    RAISED  = 1
+
+EventSubtype = Union[ModuleEventSubtype, JoinEventSubtype, NetworkEventSubtype, TxEventSubtype, P2PEventSubtype, TpcEventSubtype]
+
+
+@unique
+class EventLogEvent(Enum):
+    BOOT = 1
+    HALT = 2
+    NVM  = 3
+    JOIN = 4
+
+EventLogRecord = namedtuple('EventLogRecord', 'time event a b')
 
 
 UARTConfig = namedtuple('UARTConfig', 'baudrate data_bits stop_bits parity flow_control')
 RFConfig   = namedtuple('RFConfig',   'id frequency min_dr max_dr')
 Delay      = namedtuple('Delay',      'join_accept_1 join_accept_2 rx_window_1 rx_window_2')
 McastAddr  = namedtuple('McastAddr',  'id addr nwkskey appskey')
+McastSlot  = namedtuple('McastSlot',  'slot addr group')
+CadRx      = namedtuple('CadRx',      'period cycles detections packets')
 
 
 @unique
@@ -189,6 +240,10 @@ def raise_for_error(errno):
     raise cls(f'Command failed: {errstr} ({errno})', errno)
 
 
+class ProbeAbort(Exception):
+    pass
+
+
 class MissingValue(Exception):
     def __init__(self, message):
         super().__init__(message)
@@ -428,11 +483,184 @@ class EventSubscription(EventEmitter):
             raise TimeoutError('Timed out')
 
 
+# A downlink message received with +RECV. The fields after data are only
+# present if the extended metadata is enabled with AT$RECVEXT. The timestamp is
+# the modem's RTC timer value in milliseconds and group is -1 for unicast.
+Downlink = namedtuple('Downlink', 'port data rssi snr dr frequency fcnt multicast timestamp group',
+    defaults=(None,) * 8)
+
+
+class ATCIStream:
+    '''Incremental parser of the byte stream sent by the modem's ATCI.
+
+    The stream consists of CRLF-terminated lines, except for the payload of
+    +RECV messages, which may contain arbitrary bytes in the binary data format.
+    The parser buffers the stream in a bytearray and hands complete lines to
+    on_line. Upon a +RECV header, the line handler calls expect_payload and the
+    parser collects the payload without looking for line terminators. feed()
+    never blocks; incomplete data stays in the buffer until more arrives.
+    '''
+    def __init__(self, on_line: Callable[[bytes], None]):
+        self.buf = bytearray()
+        self.on_line = on_line
+        self.skip = 0
+        self.want: Optional[int] = None
+        self.on_payload: Optional[Callable[[bytes], None]] = None
+
+    def expect_payload(self, length: int, callback: Callable[[bytes], None]):
+        # The +RECV header is followed by an empty line, the payload, and CRLF.
+        # The trailing CRLF is consumed as an empty line.
+        self.skip = 2
+        self.want = length
+        self.on_payload = callback
+
+    def feed(self, data: bytes):
+        self.buf += data
+        while len(self.buf):
+            if self.want is not None:
+                if self.skip:
+                    n = min(self.skip, len(self.buf))
+                    del self.buf[:n]
+                    self.skip -= n
+                    continue
+
+                if len(self.buf) < self.want:
+                    break
+
+                payload = bytes(self.buf[:self.want])
+                del self.buf[:self.want]
+                callback = self.on_payload
+                self.want = None
+                self.on_payload = None
+                if callback is not None:
+                    callback(payload)
+            else:
+                i = self.buf.find(b'\n')
+                if i < 0:
+                    break
+                line = bytes(self.buf[:i]).replace(b'\r', b'')
+                del self.buf[:i + 1]
+                if len(line):
+                    self.on_line(line)
+
+
+def recv_handler(emit: Callable, header: bytes, hex_payload: bool):
+    '''Parse a +RECV header and return the payload length and a callback that
+    emits the message and downlink events once the payload has arrived.'''
+    params = tuple(map(int, header[6:].split(b',')))
+    port, size = params[:2]
+
+    def done(payload: bytes):
+        if hex_payload:
+            payload = binascii.unhexlify(payload)
+        # The message is passed to the event callback as bytes
+        emit('message', port, payload)
+        emit('downlink', Downlink(port, payload, *params[2:]))
+
+    return size * 2 if hex_payload else size, done
+
+
+class ATFuture(Future):
+    '''The pending result of an AT command submitted to a Pipeline.
+
+    Calling result() or exception() collects responses from the modem until
+    the response to this command has arrived.
+    '''
+    def __init__(self, pipeline: Pipeline):
+        super().__init__()
+        self.pipeline = pipeline
+
+    def result(self, timeout=None):
+        self.pipeline.wait(self)
+        return super().result(timeout)
+
+    def exception(self, timeout=None):
+        self.pipeline.wait(self)
+        return super().exception(timeout)
+
+
+class Pipeline:
+    '''Keep several AT commands in flight.
+
+    The firmware executes AT commands in the order in which they were received
+    and sends exactly one response per command. Thus, commands can be sent
+    without waiting for the previous response, and responses can be matched to
+    commands by their order. A pipeline keeps up to window commands, and up to
+    max_bytes bytes of commands, in flight so that the ATCI receive buffer on
+    the modem does not overflow.
+
+    Use TypeABZ.pipeline to create a pipeline. The pipeline holds the modem
+    lock, so no other thread can send AT commands while it exists.
+    '''
+    def __init__(self, modem: TypeABZ, window: int = 8, max_bytes: int = 192):
+        self.modem = modem
+        self.window = window
+        self.max_bytes = max_bytes
+        self.in_flight: List[Tuple[ATFuture, int, bool, Optional[float], str]] = []
+
+    def AT(self, cmd: str = '', timeout: Optional[float] = 5, inline=True, encoding='ascii') -> ATFuture:
+        data = self.modem.at_prefix + cmd.encode(encoding)
+        while len(self.in_flight) >= self.window or \
+            (len(self.in_flight) and sum(v[1] for v in self.in_flight) + len(data) + 1 > self.max_bytes):
+            self.collect()
+
+        future = ATFuture(self)
+        self.modem.write(data)
+        self.in_flight.append((future, len(data) + 1, inline, timeout, encoding))
+        return future
+
+    def collect(self):
+        '''Wait for the response to the oldest command in flight.'''
+        future, _, inline, timeout, encoding = self.in_flight.pop(0)
+        try:
+            if inline:
+                rv = self.modem.read_inline_response(timeout=timeout)
+            else:
+                rv = self.modem.read_multiline_response(timeout=timeout)
+        except TimeoutError as error:
+            # A lost response makes the responses of all later commands
+            # ambiguous, so fail them all
+            future.set_exception(error)
+            for f, *_ in self.in_flight:
+                f.set_exception(TimeoutError('Pipeline aborted'))
+            self.in_flight.clear()
+        except Exception as error:
+            future.set_exception(error)
+        else:
+            future.set_result(None if rv is None else rv.decode(encoding, errors='replace'))
+
+    def wait(self, future: ATFuture):
+        while not future.done():
+            self.collect()
+
+    def drain(self):
+        while len(self.in_flight):
+            self.collect()
+        self.modem.prev_at = datetime.now()
+
+
 class TypeABZ:
     port: Optional[serial.Serial]
     subscriptions: Set[EventSubscription]
     prev_at: datetime | None
 
+    # The prefix sent before each AT command
+    at_prefix = b'AT'
+
+    # Queries whose responses only change when the application changes the
+    # setting, or when the modem reboots or joins. Their responses are cached
+    # until a command with the same name is sent, or until a module or join
+    # event arrives. See ATCI.refresh.
+    CACHEABLE = frozenset([
+        '+VER?', '$VER?', '+DEV?', '$MCUID?', '+DEVEUI?', '+APPEUI?', '$JOINEUI?',
+        '+BAND?', '+MODE?', '+NWK?', '+PORT?', '+DFORMAT?', '+UART?', '+TO?',
+        '+SLEEP?', '+DUTYCYCLE?', '+JOINDC?', '+RTYNUM?', '+DEVADDR?', '+NETID?',
+        '$SESSION?', '$CERT?', '$LOGLEVEL?'
+    ])
+
+    # Commands that may change any setting
+    RESETTING = frozenset([b'+REBOOT', b'+FACNEW', b'+BAND', b'$NVMLOAD', b'$DFU'])
+
     def __init__(self, pathname: str, verbose: bool = False, guard: Optional[float] = None, rts: bool | None = None, dtr: bool | None = None):
         self.pathname = pathname
         self.verbose = verbose
@@ -443,6 +671,12 @@ class TypeABZ:
         self.prev_at = None
         self.rts = rts
         self.dtr = dtr
+        self.probing: Optional[List[Tuple[str, bool]]] = None
+        self.defer_writes = False
+        self.hex_payload = False
+        self.prefetched: dict[Tuple[str, bool], ATFuture] = {}
+        self.cacheable: frozenset[str] = self.CACHEABLE
+        self.cache: dict[str, str] = {}
 
     def __str__(self):
         return self.pathname
@@ -467,7 +701,7 @@ class TypeABZ:
             self.subscriptions.remove(sub)
             sub.off_all()
 
-    def detect_baud_rate(self, speeds=[9600, 19200, 38400, 4800], response=b'+OK\r', timeout=0.3) -> Optional[int]:
+    def detect_baud_rate(self, speeds=[9600, 19200, 38400, 115200, 57600, 4800], response=b'+OK\r', timeout=0.3) -> Optional[int]:
         if self.port is not None:
             raise Exception('Baud rate detection must be performed before the device is open')
 
@@ -547,6 +781,7 @@ class TypeABZ:
 
         self.response: "Queue[bytes]" = Queue()
         self.lock = RLock()
+        self.stream = ATCIStream(self.receive_line)
         self.thread = Thread(target=self.reader)
         self.thread.daemon = True
         self.thread.start()
@@ -556,49 +791,49 @@ class TypeABZ:
         self.port.flush()
         self.port.close()
 
-    def read_line(self) -> bytes:
-        assert self.port is not None
-
-        line: bytes = b''
-        while True:
-            select.select([self.port.fd], [], [])
-            c = self.port.read()
-            if len(c) == 0:
-                raise Exception('No data')
-            if c == b'\r':
-                continue
-            if c == b'\n':
-                if len(line) == 0:
-                    continue
-                return line
-            line += c
-
     def reader(self):
+        assert self.port is not None
         try:
             while True:
+                # Consume whatever is available so that the parser never waits
+                # for a specific number of bytes
+                select.select([self.port.fd], [], [])
                 try:
-                    data = self.read_line()
+                    data = self.port.read(max(1, self.port.in_waiting))
                 except:
                     break
-
-                if self.verbose:
-                    if self.hide_value:
-                        msg = re.sub(b'^(.*)([= ]).+$', b'\\1\\2<redacted>', data)
-                    else:
-                        msg = data
-                    print(f'> {msg.decode("ascii", errors="replace")}')
-
-                try:
-                    self.receive(data)
-                except Exception as error:
-                    print(f'Ignoring reader thread error: {error}')
+                if len(data) == 0:
+                    break
+                self.stream.feed(data)
         finally:
             if self.verbose:
                 print('Terminating reader thread')
 
+    def receive_line(self, data: bytes):
+        if self.verbose:
+            if self.hide_value:
+                msg = re.sub(b'^(.*)([= ]).+$', b'\\1\\2<redacted>', data)
+            else:
+                msg = data
+            print(f'> {msg.decode("ascii", errors="replace")}')
+
+        try:
+            self.receive(data)
+        except Exception as error:
+            print(f'Ignoring reader thread error: {error}')
+
     def write(self, cmd: bytes, flush=True):
         assert self.port is not None
 
+        # Invalidate the cached response to the query of the setting, or the
+        # whole cache if the command may change more than one setting
+        if cmd.startswith(self.at_prefix) and not cmd.endswith(b'?'):
+            name = re.split(b'[= ]', cmd[len(self.at_prefix):], maxsplit=1)[0]
+            if name in self.RESETTING:
+                self.cache.clear()
+            else:
+                self.cache.pop(name.decode('ascii', errors='replace') + '?', None)
+
         if self.verbose:
             if self.hide_value:
                 msg = re.sub(b'^(.*)([= ]).+$', b'\\1\\2<redacted>', cmd)
@@ -620,7 +855,7 @@ class TypeABZ:
                 self.emit('event')
             else:
                 params = tuple(map(int, payload.split(b',')))
-                if len(params) != 2:
+                if len(params) < 2:
                     raise Exception('Unsupported event parameters')
 
                 # For each event received from the LoRa module, we generate
@@ -628,22 +863,22 @@ class TypeABZ:
                 # subscribe to all event, event "event=x" allows the application
                 # to subscribe to all events from a specific subsystem, and
                 # event=x,y allows the application to subscribe to one specific
-                # event.
+                # event. Any fields after the subtype, e.g., the time on air
+                # in +EVENT=6,0, are passed as additional arguments.
+                if params[0] in (EventType.MODULE.value, EventType.JOIN.value):
+                    self.cache.clear()
+
                 self.emit('event', *params)
-                self.emit(f'event={params[0]}', params[1])
-                self.emit(f'event={params[0]},{params[1]}')
+                self.emit(f'event={params[0]}', *params[1:])
+                self.emit(f'event={params[0]},{params[1]}', *params[2:])
         elif data.startswith(b'+ANS'):
             self.emit('answer', *tuple(map(int, data[5:].split(b','))))
         elif data.startswith(b'+ACK'):
-            self.emit('ack', True)
+            self.emit('ack', True, *(tuple(map(int, data[5:].split(b','))) if len(data) > 5 else ()))
         elif data.startswith(b'+NOACK'):
-            self.emit('ack', False)
+            self.emit('ack', False, *(tuple(map(int, data[7:].split(b','))) if len(data) > 7 else ()))
         elif data.startswith(b'+RECV'):
-            port, size = tuple(map(int, data[6:].split(b',')))
-            # We use +2 here to skip an empty line sent by the modem
-            data = self.port.read(size + 2)
-            # The message is passed to the event callback as bytes
-            self.emit('message', port, data[2:])
+            self.stream.expect_payload(*recv_handler(self.emit, data, self.hex_payload))
         else:
             self.response.put_nowait(data)
 
@@ -682,7 +917,64 @@ class TypeABZ:
                 finally:
                     self.response.task_done()
 
+    @contextmanager
+    def pipeline(self, window: int = 8):
+        '''Create a Pipeline to send several AT commands without waiting.
+
+        All responses are collected when the context manager exits. If the
+        guard is enabled, the modem cannot accept back-to-back commands and the
+        pipeline only keeps one command in flight.
+        '''
+        with self.lock:
+            p = Pipeline(self, window=1 if self.guard is not None else window)
+            try:
+                yield p
+            finally:
+                p.drain()
+
+    @contextmanager
+    def probe(self, defer_writes=False):
+        '''Record the AT commands attempted instead of sending them.
+
+        Each AT command that is not served from a prefetch is appended to the
+        yielded list and then aborted with ProbeAbort. Used to find out which
+        command a property getter sends. If defer_writes is True, commands that
+        are not queries (do not end with '?') return None instead of aborting,
+        so that a setter can run to completion and all of its writes can be
+        collected.
+        '''
+        with self.lock:
+            self.probing = []
+            self.defer_writes = defer_writes
+            try:
+                yield self.probing
+            finally:
+                self.probing = None
+                self.defer_writes = False
+
+    def remember(self, cmd: str, rv: Optional[str]):
+        if cmd in self.cacheable and rv is not None:
+            self.cache[cmd] = rv
+        return rv
+
     def AT(self, cmd: str = '', timeout: Optional[float] = 5, wait=True, inline=True, flush=True, encoding='ascii', prefix=b'AT'):
+        # Serve the response from the cache or from a pipelined prefetch if
+        # there is one, see ATCI.refresh, ATCI.read_settings, and AsyncATCI
+        if prefix == self.at_prefix and wait and inline:
+            if cmd in self.cache:
+                return self.cache[cmd]
+
+        if prefix == self.at_prefix and wait:
+            future = self.prefetched.get((cmd, inline))
+            if future is not None:
+                return self.remember(cmd, future.result()) if inline else future.result()
+
+        if self.probing is not None:
+            self.probing.append((cmd, inline))
+            if self.defer_writes and not cmd.endswith('?'):
+                return None
+            raise ProbeAbort()
+
         # Implement rudimentary throttling of AT commands send to the device. It
         # appears the original modem firmware cannot properly interpret AT
         # commands that come quickly after a previous response. Thus, if the
@@ -714,12 +1006,15 @@ class TypeABZ:
                 # the errors keyword argument.
                 if rv is not None:
                     rv = rv.decode(encoding, errors='replace')
+                    if prefix == self.at_prefix and inline:
+                        self.remember(cmd, rv)
             self.prev_at = datetime.now()
             return rv
 
 
 class TowerSDK(TypeABZ):
     prefix = b'$LORA: '
+    at_prefix = b'AT$LORA AT'
 
     def open(self, speed: int):
         super().open(speed)
@@ -757,7 +1052,7 @@ class TowerSDK(TypeABZ):
             self.read_sdk_response()
 
     def AT(self, cmd: str = '', timeout: Optional[float] = 5, wait = True, inline = True, flush = True, encoding = 'ascii'): # type: ignore
-        return super().AT(cmd, timeout=timeout, wait=wait, inline=inline, flush=flush, encoding=encoding, prefix=b'AT$LORA AT')
+        return super().AT(cmd, timeout=timeout, wait=wait, inline=inline, flush=flush, encoding=encoding, prefix=self.at_prefix)
 
     def receive(self, data: bytes):
         if data.startswith(self.prefix):
@@ -766,22 +1061,967 @@ class TowerSDK(TypeABZ):
             self.sdk_response.put_nowait(data)
 
 
-def parse_data_rate(region: LoRaRegion | str | int, value: str | LoRaDataRate | int) -> int:
-    if isinstance(value, LoRaDataRate):
-        rv = value.value
-    elif isinstance(value, str):
-        try:
-            rv = getattr(region_to_LoRaDataRate(region), value.upper())
-        except AttributeError:
-            try:
-                rv = int(value)
-            except ValueError:
-                raise Exception(f'Unsupported data rate "{value}"')
-    else:
-        rv = value
+# Asynchronous messages that the daemon forwards to its subscribers as they
+# are. +RECV is forwarded as a decoded downlink event instead.
+ASYNC_PREFIXES = (b'+EVENT', b'+ANS', b'+ACK', b'+NOACK')
+
+
+class DaemonSession(socketserver.StreamRequestHandler):
+    '''A client connection to ModemDaemon.
+
+    The client sends newline-delimited JSON-RPC 2.0 requests. The following
+    methods are supported:
+
+      at          {"cmd", "inline", "timeout"} sends one AT command and returns
+                  the response, or an error with the modem's error code
+      lock        acquires exclusive access to the modem (reentrant)
+      unlock      releases the lock
+      write       {"data"} writes base64-encoded bytes to the serial port,
+                  the lock must be held
+      flush_atci  {"timeout"} discards pending input on both sides
+      subscribe   starts the delivery of asynchronous messages
+      unsubscribe stops it
+
+    While the client holds the lock, the modem's responses are sent to it as
+    "response" notifications. Subscribers receive +EVENT, +ANS, +ACK, and
+    +NOACK as "line" notifications, and +RECV as "downlink" notifications.
+    '''
+    server: ModemDaemon
+
+    def setup(self):
+        super().setup()
+        self.write_lock = RLock()
+        self.locks = 0
+        self.subscribed = False
+
+    def send(self, msg: dict):
+        msg['jsonrpc'] = '2.0'
+        data = json.dumps(msg).encode('utf-8') + b'\n'
+        try:
+            with self.write_lock:
+                self.wfile.write(data)
+                self.wfile.flush()
+        except OSError:
+            pass
+
+    def notify(self, method: str, *params):
+        self.send({'method': method, 'params': params})
+
+    def handle(self):
+        self.server.attach(self)
+        try:
+            for line in self.rfile:
+                req = None
+                try:
+                    req = json.loads(line)
+                    rv = self.dispatch(req['method'], req.get('params') or {})
+                except ModemError as error:
+                    rv = None
+                    err = {'code': error.errno, 'message': str(error)}
+                except Exception as error:
+                    rv = None
+                    err = {'code': -32000, 'message': str(error)}
+                else:
+                    err = None
+
+                if isinstance(req, dict) and 'id' in req:
+                    if err is None:
+                        self.send({'id': req['id'], 'result': rv})
+                    else:
+                        self.send({'id': req['id'], 'error': err})
+        finally:
+            self.server.detach(self)
+
+    def dispatch(self, method: str, params: dict):
+        modem = self.server.modem
+
+        if method == 'at':
+            with modem.lock:
+                owner = self.server.owner
+                self.server.owner = None
+                try:
+                    self.server.track_format(params['cmd'].encode('ascii'))
+                    return modem.AT(params['cmd'], timeout=params.get('timeout', 5),
+                        inline=params.get('inline', True))
+                finally:
+                    self.server.owner = owner
+        elif method == 'lock':
+            modem.lock.acquire()
+            self.locks += 1
+            self.server.owner = self
+        elif method == 'unlock':
+            if self.locks == 0:
+                raise Exception('Lock not held')
+            self.locks -= 1
+            if self.locks == 0:
+                self.server.owner = None
+            modem.lock.release()
+        elif method == 'write':
+            if self.server.owner is not self:
+                raise Exception('Lock not held')
+            data = b64decode(params['data'])
+            self.server.track_format(data)
+            # Raw writes bypass the cache invalidation in TypeABZ.write
+            modem.cache.clear()
+            assert modem.port is not None
+            modem.port.write(data)
+            modem.flush()
+        elif method == 'flush_atci':
+            with modem.lock:
+                assert modem.port is not None
+                modem.port.write(b'\r\n')
+                modem.flush()
+                sleep(params.get('timeout', 0.1))
+                while True:
+                    try:
+                        modem.response.get_nowait()
+                        modem.response.task_done()
+                    except Empty:
+                        break
+        elif method == 'subscribe':
+            self.subscribed = True
+        elif method == 'unsubscribe':
+            self.subscribed = False
+        else:
+            raise Exception(f'Unsupported method {method}')
+
+
+class ModemDaemon(socketserver.ThreadingMixIn, socketserver.UnixStreamServer):
+    '''Share one open modem among several clients over a Unix domain socket.
+
+    Opening the serial port and detecting the baud rate takes about a second,
+    which dominates the run time of most lora CLI invocations. The daemon does
+    it once and keeps the port open. Clients connect with RemoteTypeABZ or
+    speak the JSON-RPC protocol described in DaemonSession directly. AT
+    commands from different clients are serialized with the modem lock, and
+    asynchronous messages are delivered to every subscribed client.
+
+    The daemon does not follow baud rate changes made with AT+UART; restart it
+    after changing the baud rate.
+    '''
+    daemon_threads = True
+
+    def __init__(self, modem: OpenLoRaModem, path: str):
+        self.modem = modem.modem
+        self.sessions: Set[DaemonSession] = set()
+        self.owner: Optional[DaemonSession] = None
+
+        # Learn the data format so that +RECV payloads can be decoded
+        modem.dformat
+
+        self.on_line = self.modem.stream.on_line
+        self.modem.stream.on_line = self.receive_line
+        self.modem.subscriptions.add(self.downlinks())
+
+        if os.path.exists(path):
+            os.unlink(path)
+        super().__init__(path, DaemonSession)
+
+    def downlinks(self):
+        sub = EventSubscription()
+
+        def on_downlink(msg: Downlink):
+            d = msg._asdict()
+            d['data'] = b64encode(msg.data).decode('ascii')
+            for s in list(self.sessions):
+                if s.subscribed: s.notify('downlink', d)
+
+        sub.on('downlink', on_downlink)
+        return sub
+
+    def track_format(self, cmd: bytes):
+        # Keep decoding +RECV correctly when a client changes the data format
+        m = re.match(rb'^AT\+DFORMAT=(\d)', cmd)
+        if m is not None:
+            self.modem.hex_payload = int(m.group(1)) == DataFormat.HEXADECIMAL.value
+
+    def receive_line(self, line: bytes):
+        if line.startswith(ASYNC_PREFIXES):
+            text = line.decode('ascii', errors='replace')
+            for s in list(self.sessions):
+                if s.subscribed: s.notify('line', text)
+        elif not line.startswith(b'+RECV') and self.owner is not None:
+            self.owner.notify('response', line.decode('ascii', errors='replace'))
+            return
+        self.on_line(line)
+
+    def attach(self, session: DaemonSession):
+        self.sessions.add(session)
+
+    def detach(self, session: DaemonSession):
+        self.sessions.discard(session)
+        if self.owner is session:
+            self.owner = None
+        while session.locks:
+            session.locks -= 1
+            self.modem.lock.release()
+
+
+class RemoteLock:
+    '''A reentrant lock held on the daemon. Only the outermost acquire and
+    release talk to the daemon.'''
+    def __init__(self, modem: RemoteTypeABZ):
+        self.modem = modem
+        self.local = RLock()
+        self.depth = 0
+
+    def acquire(self):
+        self.local.acquire()
+        self.depth += 1
+        if self.depth == 1:
+            try:
+                self.modem.call('lock')
+            except:
+                self.depth -= 1
+                self.local.release()
+                raise
+
+    def release(self):
+        try:
+            if self.depth == 1:
+                self.modem.call('unlock')
+        finally:
+            self.depth -= 1
+            self.local.release()
+
+    def __enter__(self):
+        self.acquire()
+        return self
+
+    def __exit__(self, *args):
+        self.release()
+
+
+class RemotePort:
+    '''Stands in for the serial port of a RemoteTypeABZ'''
+    def __init__(self, modem: RemoteTypeABZ):
+        self.modem = modem
+
+    def write(self, data: bytes):
+        self.modem.call('write', data=b64encode(data).decode('ascii'))
+
+    def flush(self):
+        pass
+
+
+class RemoteTypeABZ(TypeABZ):
+    '''A TypeABZ modem owned by a ModemDaemon.
+
+    It can be used with OpenLoRaModem and MurataModem like a local TypeABZ.
+    The lock is held on the daemon, so other clients cannot interleave their
+    AT commands with a multi-command operation of this client. Asynchronous
+    messages received by the modem are delivered to the events subscriptions
+    of every connected client.
+    '''
+    def __init__(self, path: str, verbose: bool = False, guard: Optional[float] = None):
+        super().__init__(path, verbose=verbose, guard=guard)
+        # Other clients may change settings behind our back. The daemon
+        # caches responses itself.
+        self.cacheable = frozenset()
+        self.ids = 0
+        self.pending: dict[int, Future] = {}
+
+    def detect_baud_rate(self, *args, **kwargs) -> Optional[int]:
+        # The daemon has already done that
+        return 0
+
+    def open(self, speed: int = 0):
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.sock.connect(self.pathname)
+        self.rfile = self.sock.makefile('rb')
+        self.wlock = RLock()
+        self.response = Queue()
+        self.lock = RemoteLock(self) # type: ignore
+        self.port = RemotePort(self) # type: ignore
+        self.thread = Thread(target=self.reader)
+        self.thread.daemon = True
+        self.thread.start()
+        self.call('subscribe')
+
+    def close(self):
+        self.sock.close()
+
+    def call(self, method: str, timeout: Optional[float] = None, **params):
+        future: Future = Future()
+        with self.wlock:
+            self.ids += 1
+            self.pending[self.ids] = future
+            msg = {'jsonrpc': '2.0', 'id': self.ids, 'method': method, 'params': params}
+            self.sock.sendall(json.dumps(msg).encode('utf-8') + b'\n')
+        return future.result(timeout)
+
+    def reader(self):
+        try:
+            for line in self.rfile:
+                msg = json.loads(line)
+                if 'id' in msg:
+                    future = self.pending.pop(msg['id'])
+                    if 'error' in msg:
+                        err = msg['error']
+                        future.set_exception(ModemError(err['message'], err['code']))
+                    else:
+                        future.set_result(msg.get('result'))
+                elif msg['method'] in ('line', 'response'):
+                    self.receive_line(msg['params'][0].encode('ascii'))
+                elif msg['method'] == 'downlink':
+                    d = msg['params'][0]
+                    d['data'] = b64decode(d['data'])
+                    self.emit('message', d['port'], d['data'])
+                    self.emit('downlink', Downlink(**d))
+        finally:
+            for future in self.pending.values():
+                future.set_exception(ConnectionError('Connection to the daemon lost'))
+            self.pending.clear()
+            if self.verbose:
+                print('Terminating reader thread')
+
+    def flush_atci(self, timeout=0.1, port=None):
+        self.call('flush_atci', timeout=timeout)
+        while True:
+            try:
+                self.response.get_nowait()
+                self.response.task_done()
+            except Empty:
+                break
+
+
+class AsyncTypeABZ:
+    '''An asyncio transport for the TypeABZ modem.
+
+    Unlike TypeABZ, which runs a reader thread per serial port, this class
+    reads the port from a task on the running event loop, so that a single
+    event loop can serve many modems. It requires the pyserial-asyncio
+    package. Use AsyncATCI for access to modem settings by name.
+    '''
+    at_prefix = b'AT'
+
+    def __init__(self, pathname: str, verbose: bool = False):
+        self.pathname = pathname
+        self.verbose = verbose
+        self.consumers: "Set[asyncio.Queue]" = set()
+        self.task: "Optional[asyncio.Task]" = None
+        self.hex_payload = False
+        self.stream = ATCIStream(self.receive_line)
+
+    def __str__(self):
+        return self.pathname
+
+    async def open(self, speed: int):
+        import serial_asyncio # type: ignore
+        self.reader, self.writer = await serial_asyncio.open_serial_connection(url=self.pathname, baudrate=speed)
+        self.response: "asyncio.Queue[bytes]" = asyncio.Queue()
+        self.lock = asyncio.Lock()
+        self.task = asyncio.create_task(self.read_loop())
+
+    async def close(self):
+        if self.task is not None:
+            self.task.cancel()
+            self.task = None
+        self.writer.close()
+
+    async def read_loop(self):
+        while True:
+            data = await self.reader.read(4096)
+            if len(data) == 0:
+                break
+            self.stream.feed(data)
+
+    def receive_line(self, line: bytes):
+        if self.verbose:
+            print(f'> {line.decode("ascii", errors="replace")}')
+
+        if line.startswith(b'+EVENT'):
+            payload = line[7:]
+            self.publish('event', *(tuple(map(int, payload.split(b','))) if len(payload) else ()))
+        elif line.startswith(b'+ANS'):
+            self.publish('answer', *tuple(map(int, line[5:].split(b','))))
+        elif line.startswith(b'+ACK'):
+            self.publish('ack', True, *(tuple(map(int, line[5:].split(b','))) if len(line) > 5 else ()))
+        elif line.startswith(b'+NOACK'):
+            self.publish('ack', False, *(tuple(map(int, line[7:].split(b','))) if len(line) > 7 else ()))
+        elif line.startswith(b'+RECV'):
+            self.stream.expect_payload(*recv_handler(self.publish, line, self.hex_payload))
+        else:
+            self.response.put_nowait(line)
+
+    def publish(self, *event):
+        for q in self.consumers:
+            q.put_nowait(event)
+
+    async def events(self):
+        '''Iterate over asynchronous messages from the modem.
+
+        Yields tuples such as ('event', 1, 1) for +EVENT=1,1, ('message',
+        port, data) and ('downlink', Downlink) for +RECV, ('ack', True) for
+        +ACK (followed by the number of transmissions with AT$RTXBACKOFF
+        enabled), and ('answer', ...) for +ANS. Each iterator receives all messages that arrive while it exists.
+        '''
+        q: "asyncio.Queue[tuple]" = asyncio.Queue()
+        self.consumers.add(q)
+        try:
+            while True:
+                yield await q.get()
+        finally:
+            self.consumers.discard(q)
+
+    async def read_response(self, inline: bool):
+        body: List[bytes] = []
+        while True:
+            line = await self.response.get()
+            if len(body) == 0 and line.startswith(b'+ERR=') and len(line) > 6:
+                raise_for_error(int(line[5:]))
+            elif line == b'+OK':
+                return b'\n'.join(body) if not inline else None
+            elif inline and line.startswith(b'+OK=') and len(line) > 4:
+                return line[4:]
+            elif inline:
+                raise Exception('Invalid response')
+            body.append(line)
+
+    async def AT(self, cmd: str = '', timeout: Optional[float] = 5, wait=True, inline=True, encoding='ascii'):
+        async with self.lock:
+            data = self.at_prefix + cmd.encode(encoding)
+            if self.verbose:
+                print(f'< {data.decode("ascii", errors="replace")}')
+            self.writer.write(data + b'\r')
+            await self.writer.drain()
+            if not wait:
+                return None
+
+            try:
+                rv = await asyncio.wait_for(self.read_response(inline), timeout)
+            except asyncio.TimeoutError:
+                raise TimeoutError('No response received')
+            return None if rv is None else rv.decode(encoding, errors='replace')
+
+    async def batch(self, cmds: List[Tuple[str, bool]], window: int = 8, max_bytes: int = 192, timeout: Optional[float] = 5, encoding='ascii') -> List[Any]:
+        '''Send several AT commands without waiting for each response.
+
+        The asyncio counterpart of Pipeline: up to window commands, and up to
+        max_bytes bytes of commands, are kept in flight. Each command is a
+        tuple of the command and the inline flag. Returns the responses in
+        order; a command rejected by the modem is represented by the
+        ModemError it raised. A timeout aborts the whole batch.
+        '''
+        rv: List[Any] = []
+        in_flight: List[Tuple[int, bool]] = []
+
+        async def collect():
+            _, inline = in_flight.pop(0)
+            try:
+                r = await asyncio.wait_for(self.read_response(inline), timeout)
+            except asyncio.TimeoutError:
+                raise TimeoutError('No response received')
+            except ModemError as error:
+                rv.append(error)
+            else:
+                rv.append(None if r is None else r.decode(encoding, errors='replace'))
+
+        async with self.lock:
+            for cmd, inline in cmds:
+                data = self.at_prefix + cmd.encode(encoding)
+                while len(in_flight) >= window or \
+                    (len(in_flight) and sum(v[0] for v in in_flight) + len(data) + 1 > max_bytes):
+                    await collect()
+
+                if self.verbose:
+                    print(f'< {data.decode("ascii", errors="replace")}')
+                self.writer.write(data + b'\r')
+                await self.writer.drain()
+                in_flight.append((len(data) + 1, inline))
+
+            while len(in_flight):
+                await collect()
+        return rv
+
+
+class AsyncATCI:
+    '''Access modem settings by name over an AsyncTypeABZ transport.
+
+    The settings are implemented by the synchronous ATCI classes. Each getter
+    or setter is first run against a stub modem that records the AT commands
+    it would send. The commands are then sent with AsyncTypeABZ.AT and the
+    getter is run again with the responses served from a prefetch. Setters run
+    to completion with their writes deferred; queries they make are answered
+    in the same way.
+
+        value = await modem.get('deveui')
+        await modem.set('adr', True)
+    '''
+    def __init__(self, modem: AsyncTypeABZ, cls: Optional[Type[ATCI]] = None):
+        self.modem = modem
+        self.stub = TypeABZ(modem.pathname)
+        self.stub.at_prefix = modem.at_prefix
+        self.stub.lock = RLock()
+        self.facade = (cls or OpenLoRaModem)(self.stub)
+
+    def __str__(self):
+        return str(self.modem)
+
+    def __dir__(self):
+        return dir(self.facade)
+
+    async def prefetch(self, cmd: str, inline: bool):
+        future: Future = Future()
+        try:
+            future.set_result(await self.modem.AT(cmd, inline=inline))
+        except ModemError as error:
+            future.set_exception(error)
+        self.stub.prefetched[(cmd, inline)] = future
+
+    async def get(self, name: str):
+        try:
+            while True:
+                with self.stub.probe() as attempted:
+                    try:
+                        return getattr(self.facade, name)
+                    except ProbeAbort:
+                        pass
+                await self.prefetch(*attempted[-1])
+        finally:
+            self.stub.prefetched.clear()
+            self.modem.hex_payload = self.stub.hex_payload
+
+    async def set(self, name: str, value):
+        try:
+            while True:
+                with self.stub.probe(defer_writes=True) as attempted:
+                    try:
+                        setattr(self.facade, name, value)
+                        break
+                    except ProbeAbort:
+                        pass
+                await self.prefetch(*attempted[-1])
+        finally:
+            self.stub.prefetched.clear()
+
+        for cmd, inline in attempted:
+            if not cmd.endswith('?'):
+                await self.modem.AT(cmd, inline=inline)
+        self.modem.hex_payload = self.stub.hex_payload
+
+    async def set_many(self, values: dict[str, Any], window: int = 8):
+        '''Update several settings with pipelined AT commands.
+
+        Like set, but the writes of all setters are collected first and then
+        sent in one AsyncTypeABZ.batch. The queries made by the setters are
+        still answered one at a time. Raises the first error reported by the
+        modem. Setters that wait for an event, e.g., band, cannot be used.
+        '''
+        writes: List[Tuple[str, bool]] = []
+        try:
+            for name, value in values.items():
+                while True:
+                    with self.stub.probe(defer_writes=True) as attempted:
+                        try:
+                            setattr(self.facade, name, value)
+                            break
+                        except ProbeAbort:
+                            pass
+                    await self.prefetch(*attempted[-1])
+                writes += [(cmd, inline) for cmd, inline in attempted if not cmd.endswith('?')]
+        finally:
+            self.stub.prefetched.clear()
+
+        for rv in await self.modem.batch(writes, window):
+            if isinstance(rv, Exception):
+                raise rv
+        self.modem.hex_payload = self.stub.hex_payload
+
+
+class STM32Bootloader:
+    '''Client of the STM32 system bootloader over a USART (ST AN3155).
+
+    The modem enters the bootloader with AT$DFU. The bootloader listens on the
+    pins of the AT command UART, uses 8E1 framing, and detects the baud rate
+    from the 0x7F byte sent by sync(). The protocol is strictly one command at
+    a time: each phase of a command must be acknowledged before the next one
+    is sent. The flasher keeps the number of round trips low instead: each
+    phase is sent with a single write, blocks that are still blank after the
+    erase are not written, and memory is read back in the largest blocks the
+    protocol allows.
+    '''
+    ACK  = 0x79
+    NACK = 0x1F
+
+    CMD_GET            = 0x00
+    CMD_GET_ID         = 0x02
+    CMD_READ_MEMORY    = 0x11
+    CMD_GO             = 0x21
+    CMD_WRITE_MEMORY   = 0x31
+    CMD_ERASE          = 0x43
+    CMD_EXTENDED_ERASE = 0x44
+
+    # STM32L072: erased flash reads as zeroes
+    FLASH_BASE  = 0x08000000
+    FLASH_SIZE  = 192 * 1024
+    PAGE_SIZE   = 128
+    BLOCK_SIZE  = 256
+    ERASED_BYTE = 0x00
+
+    # The number of pages erased with one extended erase command
+    ERASE_BATCH = 64
+
+    def __init__(self, pathname: str, speed: int = 115200, verbose: bool = False):
+        self.pathname = pathname
+        self.speed = speed
+        self.verbose = verbose
+        self.port: Optional[serial.Serial] = None
+        self.commands: bytes = b''
+
+    def open(self):
+        self.port = serial.Serial(self.pathname, self.speed, parity=serial.PARITY_EVEN, timeout=1)
+
+    def close(self):
+        assert self.port is not None
+        self.port.close()
+        self.port = None
+
+    def write(self, data: bytes):
+        assert self.port is not None
+        if self.verbose:
+            print(f'< {binascii.hexlify(data[:16]).decode()}{"..." if len(data) > 16 else ""}')
+        self.port.write(data)
+        self.port.flush()
+
+    def read(self, length: int, timeout: float = 1) -> bytes:
+        assert self.port is not None
+        self.port.timeout = timeout
+        data = self.port.read(length)
+        if len(data) != length:
+            raise TimeoutError('No response from the bootloader')
+        return data
+
+    def wait_ack(self, timeout: float = 1):
+        c = self.read(1, timeout)[0]
+        if c == self.NACK:
+            raise Exception('The bootloader refused the command (NACK)')
+        if c != self.ACK:
+            raise Exception(f'Unexpected response 0x{c:02x} from the bootloader')
+
+    @staticmethod
+    def frame(data: bytes) -> bytes:
+        '''Append the XOR checksum to data'''
+        xor = 0
+        for c in data:
+            xor ^= c
+        return data + bytes([xor])
+
+    def command(self, code: int):
+        self.write(bytes([code, code ^ 0xFF]))
+        self.wait_ack()
+
+    def sync(self, attempts: int = 10):
+        '''Let the bootloader detect the baud rate'''
+        assert self.port is not None
+        for _ in range(attempts):
+            self.port.reset_input_buffer()
+            self.write(b'\x7f')
+            try:
+                c = self.read(1, 0.5)[0]
+            except TimeoutError:
+                continue
+            # A NACK means the baud rate has been detected before
+            if c in (self.ACK, self.NACK):
+                return
+        raise TimeoutError('The bootloader did not respond')
+
+    def get(self) -> int:
+        '''Return the bootloader version and learn the supported commands'''
+        self.command(self.CMD_GET)
+        n = self.read(1)[0]
+        data = self.read(n + 1)
+        self.wait_ack()
+        self.commands = data[1:]
+        return data[0]
+
+    def get_id(self) -> int:
+        self.command(self.CMD_GET_ID)
+        n = self.read(1)[0]
+        data = self.read(n + 1)
+        self.wait_ack()
+        return int.from_bytes(data, 'big')
+
+    def address(self, addr: int):
+        self.write(self.frame(addr.to_bytes(4, 'big')))
+        self.wait_ack()
+
+    def erase(self, first: int, count: int):
+        '''Erase count pages starting with page number first'''
+        if self.CMD_EXTENDED_ERASE in self.commands:
+            for start in range(first, first + count, self.ERASE_BATCH):
+                pages = range(start, min(start + self.ERASE_BATCH, first + count))
+                self.command(self.CMD_EXTENDED_ERASE)
+                data = (len(pages) - 1).to_bytes(2, 'big') + b''.join(p.to_bytes(2, 'big') for p in pages)
+                self.write(self.frame(data))
+                self.wait_ack(timeout=len(pages) * 0.01 + 1)
+        else:
+            # The legacy erase command can only address 256 pages, erase all
+            self.command(self.CMD_ERASE)
+            self.write(b'\xff\x00')
+            self.wait_ack(timeout=30)
+
+    def write_memory(self, addr: int, data: bytes):
+        self.command(self.CMD_WRITE_MEMORY)
+        self.address(addr)
+        self.write(self.frame(bytes([len(data) - 1]) + data))
+        self.wait_ack()
+
+    def read_memory(self, addr: int, length: int) -> bytes:
+        self.command(self.CMD_READ_MEMORY)
+        self.address(addr)
+        self.write(bytes([length - 1, (length - 1) ^ 0xFF]))
+        self.wait_ack()
+        return self.read(length)
+
+    def go(self, addr: int):
+        self.command(self.CMD_GO)
+        self.address(addr)
+
+    def flash(self, image: bytes, verify=True, progress: Optional[Callable[[str, int, int], None]] = None) -> dict[str, float]:
+        '''Erase, write, and verify a firmware image at the start of flash.
+
+        Returns the duration of each phase in seconds. The optional progress
+        callback is invoked with the phase, the number of bytes done, and the
+        total number of bytes.
+        '''
+        if len(image) > self.FLASH_SIZE:
+            raise Exception('The firmware image does not fit in flash')
+
+        # Pad the image to whole blocks with the erased value
+        image = image + bytes([self.ERASED_BYTE]) * (-len(image) % self.BLOCK_SIZE)
+        blank = bytes([self.ERASED_BYTE]) * self.BLOCK_SIZE
+        blocks = [(off, image[off:off + self.BLOCK_SIZE]) for off in range(0, len(image), self.BLOCK_SIZE)]
+        rv = {}
+
+        t = perf_counter()
+        self.erase(0, len(image) // self.PAGE_SIZE)
+        rv['erase'] = perf_counter() - t
+
+        t = perf_counter()
+        for off, block in blocks:
+            if block != blank:
+                self.write_memory(self.FLASH_BASE + off, block)
+            if progress: progress('write', off + len(block), len(image))
+        rv['write'] = perf_counter() - t
+
+        if verify:
+            t = perf_counter()
+            for off, block in blocks:
+                if self.read_memory(self.FLASH_BASE + off, len(block)) != block:
+                    raise Exception(f'Verification failed at 0x{self.FLASH_BASE + off:08x}')
+                if progress: progress('verify', off + len(block), len(image))
+            rv['verify'] = perf_counter() - t
+
+        return rv
+
+
+def parse_data_rate(region: LoRaRegion | str | int, value: str | LoRaDataRate | int) -> int:
+    if isinstance(value, LoRaDataRate):
+        rv = value.value
+    elif isinstance(value, str):
+        try:
+            rv = getattr(region_to_LoRaDataRate(region), value.upper())
+        except AttributeError:
+            try:
+                rv = int(value)
+            except ValueError:
+                raise Exception(f'Unsupported data rate "{value}"')
+    else:
+        rv = value
+
+    assert type(rv) == int
+    return rv
+
+
+def decode_state(data: str | bytes) -> dict[str, Any]:
+    '''Decode the packed state snapshot returned by AT$STATE?.
+
+    The argument is the hex-encoded response (without the +OK= prefix) or the
+    decoded binary data. Fields appended by newer firmware versions are
+    ignored.
+    '''
+    if isinstance(data, str):
+        data = binascii.unhexlify(data)
+
+    if len(data) < 1 or data[0] != 1:
+        raise Exception('Unsupported AT$STATE layout version')
+
+    fields = struct.unpack_from('<BBBBIIBBhbIIHB', data)
+    flags = fields[1]
+    return {
+        'version'           : fields[0],
+        'public_network'    : bool(flags & 1),
+        'adr'               : bool(flags & 2),
+        'busy'              : bool(flags & 4),
+        'activation_mode'   : ['None', 'ABP', 'OTAA'][fields[2]] if fields[2] < 3 else '?',
+        'device_class'      : 'ABC'[fields[3]] if fields[3] < 3 else '?',
+        'uplink_frmcnt'     : fields[4],
+        'downlink_frmcnt'   : fields[5],
+        'dr'                : fields[6],
+        'tx_power'          : fields[7],
+        'rssi'              : fields[8],
+        'snr'               : fields[9],
+        'backoff'           : fields[10],
+        'dev_addr'          : f'{fields[11]:08X}',
+        'nvm_pending'       : fields[12],
+        'tx_queue_length'   : fields[13]
+    }
+
+
+def decode_snapshot(data: str | bytes) -> dict[str, bytes]:
+    '''Decode an NVM configuration snapshot returned by AT$NVMDUMP?.
+
+    The argument is the hex-encoded response (without the +OK= prefix) or the
+    decoded binary data. The function verifies the checksum and returns a
+    dictionary that maps the label of each part in the snapshot to its raw
+    contents.
+    '''
+    if isinstance(data, str):
+        data = binascii.unhexlify(data)
+
+    if len(data) < 12 or binascii.crc32(data[:-4]) != struct.unpack_from('<I', data, len(data) - 4)[0]:
+        raise Exception('Invalid NVM snapshot checksum')
+
+    magic, version, count = struct.unpack_from('<4sBB', data)
+    if magic != b'NVMS' or version != 1:
+        raise Exception('Unsupported NVM snapshot format')
+
+    rv: dict[str, bytes] = {}
+    offset = 8
+    for _ in range(count):
+        label, size = struct.unpack_from('<16sI', data, offset)
+        offset += 20
+        rv[label.rstrip(b'\0').decode('ascii')] = data[offset:offset + size]
+        offset += size
+    return rv
+
+
+class Reassembler:
+    '''Reassemble uplinks split by the modem with AT$SPLIT.
+
+    Feed the payload of every uplink received on the split port to add(). Each
+    fragment starts with the message number and the fragment index, with bit 7
+    set in the last fragment. The first fragment also carries the port of the
+    original message. Once all fragments of a message have arrived, add()
+    returns a (port, payload) tuple; otherwise it returns None.
+
+    Fragments are sent in order and a new message number abandons any
+    incomplete message, so only one message is tracked per device.
+    '''
+    def __init__(self):
+        self.reset()
+
+    def reset(self):
+        self.id: int | None = None
+        self.port: int | None = None
+        self.fragments: dict[int, bytes] = {}
+        self.count: int | None = None
+
+    def add(self, data: bytes) -> tuple[int, bytes] | None:
+        if len(data) < 2:
+            raise Exception('Fragment too short')
+
+        id, index = data[0], data[1] & 0x7f
+        last = bool(data[1] & 0x80)
+
+        if id != self.id:
+            self.reset()
+            self.id = id
+
+        if index == 0:
+            if len(data) < 3:
+                raise Exception('Fragment too short')
+            self.port = data[2]
+            self.fragments[0] = data[3:]
+        else:
+            self.fragments[index] = data[2:]
+
+        if last:
+            self.count = index + 1
+
+        if self.count is None or self.port is None or len(self.fragments) < self.count:
+            return None
+
+        rv = (self.port, b''.join(self.fragments[i] for i in range(self.count)))
+        self.reset()
+        return rv
+
+
+class DeltaDecoder:
+    '''Decode uplinks encoded by the modem's delta codec (AT$DELTA).
+
+    Create the decoder with the field widths configured on the modem and feed
+    the payload of every uplink received on the codec's port to decode(). A
+    keyframe (bit 7 of the first byte set) carries the frame as is. A delta
+    frame carries the sequence number of its reference frame followed by a
+    zigzag-encoded varint for each field, holding the difference to the
+    reference modulo the width of the field. decode() returns the frame as
+    submitted to AT$DELTATX, or raises an exception if the reference has not
+    been received.
+
+    The modem never refers to a frame more than 127 frames old, so keeping the
+    most recent frame for each sequence number suffices.
+    '''
+    def __init__(self, widths: List[int]):
+        for width in widths:
+            if width not in (1, 2, 4):
+                raise ValueError(f'Unsupported field width {width}')
+        self.widths = widths
+        self.size = sum(widths)
+        self.reset()
+
+    def reset(self):
+        self.frames: dict[int, bytes] = {}
+
+    def _varint(self, data: bytes, offset: int) -> tuple[int, int]:
+        value = shift = 0
+        while True:
+            if offset >= len(data):
+                raise Exception('Truncated delta frame')
+            b = data[offset]
+            offset += 1
+            value |= (b & 0x7f) << shift
+            shift += 7
+            if not b & 0x80:
+                return value, offset
+
+    def decode(self, data: bytes) -> bytes:
+        if len(data) < 1:
+            raise Exception('Frame too short')
+
+        seq = data[0] & 0x7f
+        if data[0] & 0x80:
+            frame = bytes(data[1:])
+            if len(frame) != self.size:
+                raise Exception('Invalid keyframe size')
+            self.frames[seq] = frame
+            return frame
+
+        if len(data) < 2:
+            raise Exception('Frame too short')
+
+        try:
+            ref = self.frames[data[1] & 0x7f]
+        except KeyError:
+            raise Exception(f'Missing reference frame {data[1] & 0x7f}')
+
+        out = bytearray()
+        offset, pos = 2, 0
+        for width in self.widths:
+            z, offset = self._varint(data, offset)
+            diff = (z >> 1) ^ -(z & 1)
+            value = int.from_bytes(ref[pos:pos + width], 'little') + diff
+            out += (value % (1 << (8 * width))).to_bytes(width, 'little')
+            pos += width
+
+        if offset != len(data):
+            raise Exception('Trailing data in delta frame')
+
+        frame = bytes(out)
+        self.frames[seq] = frame
+        return frame
 
-    assert type(rv) == int
-    return rv
 
 
 class ATCI(ABC):
@@ -814,6 +2054,71 @@ class ATCI(ABC):
 
         return props
 
+    def read_settings(self, names: List[str], window: int = 8) -> dict[str, Any]:
+        '''Read the values of several settings with pipelined AT commands.
+
+        The query command of each setting is found by probing the setting's
+        getter. All queries are then sent through a pipeline and the getters
+        are invoked again to parse the prefetched responses. This saves one
+        round trip per setting. Settings whose getter sends anything other than
+        a query command are read one at a time as usual. The returned
+        dictionary maps each name to its value, or to the exception raised by
+        the getter.
+        '''
+        rv: "dict[str, Any]" = {}
+        queries: "dict[Tuple[str, bool], None]" = {}
+
+        with self.modem.lock:
+            for name in names:
+                with self.modem.probe() as attempted:
+                    try:
+                        getattr(self, name)
+                    except ProbeAbort:
+                        pass
+                    except Exception:
+                        continue
+                if len(attempted) and attempted[0][0].endswith('?'):
+                    queries[attempted[0]] = None
+
+            try:
+                with self.modem.pipeline(window) as p:
+                    for cmd, inline in queries:
+                        self.modem.prefetched[(cmd, inline)] = p.AT(cmd, inline=inline)
+
+                for name in names:
+                    try:
+                        rv[name] = getattr(self, name)
+                    except Exception as error:
+                        rv[name] = error
+            finally:
+                self.modem.prefetched.clear()
+
+        return rv
+
+    def refresh(self, window: int = 8):
+        '''Reload the cached settings with pipelined AT commands.
+
+        Responses to queries of settings that rarely change, such as the
+        DevEUI, firmware version, or region, are cached by the modem object
+        (see TypeABZ.CACHEABLE). The cache is updated when the application
+        changes a setting and cleared when the modem reboots or joins. This
+        method reloads all cacheable settings in one pipeline, e.g., after
+        another program has used the modem's serial port.
+        '''
+        with self.modem.lock:
+            self.modem.cache.clear()
+            with self.modem.pipeline(window) as p:
+                futures = [(cmd, p.AT(cmd)) for cmd in sorted(self.modem.cacheable)]
+
+            for cmd, future in futures:
+                # Some of the queries are not supported by all firmware versions
+                if future.exception() is None:
+                    self.modem.remember(cmd, future.result())
+
+    def invalidate(self):
+        '''Drop all cached responses, see refresh'''
+        self.modem.cache.clear()
+
     def __dir__(self):
         return self.settings(case=True).keys()
 
@@ -892,7 +2197,7 @@ class MurataModem(ATCI):
         This property can only be used to configure the baud rate of the port.
         Other parameters such as data bits, parity, or stop bits cannot be
         configured. Only the following baud rate values are supported: 4800,
-        9600, 19200, 38400. The configured value is permanently stored in NVM
+        9600, 19200, 38400, 57600, 115200. The configured value is permanently stored in NVM
         (EEPROM). The modem will switch to the newly configured baud rate after
         reboot.
 
@@ -1435,7 +2740,7 @@ class MurataModem(ATCI):
     join_dc = joindc
     join_duty_cycle = joindc
 
-    def lncheck(self, piggyback = False, timeout: float = 10):
+    def lncheck(self, piggyback = False, timeout: float = 10, deadline: int = 0):
         '''Perform a link check between the modem and the network.
 
         This command sends a LoRaWAN LinkCheckReq MAC command to the network
@@ -1444,7 +2749,9 @@ class MurataModem(ATCI):
         invoked with piggyback=False, the modem sends the LinkCheckReq MAC
         command immediately in a dedicated unconfirmed uplink to port 0 with no
         payload. If you wish to send the request as part of the next regular
-        uplink instead, invoke the command with piggyback=True.
+        uplink instead, invoke the command with piggyback=True. With a non-zero
+        deadline (in seconds), the modem sends the request in a dedicated uplink
+        if no regular uplink has carried it by then.
 
         The method block until a LinkCheckAns message is received from the
         network server. The method returns a tuple of two integers. The first
@@ -1474,7 +2781,10 @@ class MurataModem(ATCI):
             events.once('event', cb)
             events.once('answer', cb)
             with self.modem.lock:
-                self.modem.AT(f'+LNCHECK={1 if piggyback is True else 0}')
+                if piggyback is True and deadline:
+                    self.modem.AT(f'+LNCHECK=1,{deadline}')
+                else:
+                    self.modem.AT(f'+LNCHECK={1 if piggyback is True else 0}')
                 while True:
                     event = q.get(timeout=timeout)
                     if event[1] == 1:
@@ -1522,6 +2832,22 @@ class MurataModem(ATCI):
 
     rf_param = rfparam
 
+    def load_chplan(self, channels: list[RFConfig], mask: str | None = None):
+        '''Configure a set of RF channels and the channel mask at once.
+
+        The channels are configured in the order given, as if with the rfparam
+        setter. A channel with zero frequency is removed. The optional channel
+        mask, in the format of the chmask property, replaces both the current
+        and the default channel mask. The modem applies either the whole plan
+        or, if any part of it is invalid, nothing, and updates its NVM only
+        once.
+        '''
+        blob = bytes([len(channels)])
+        for c in channels:
+            blob += bytes([c.id]) + (c.frequency // 100).to_bytes(3, 'little')
+            blob += bytes([c.max_dr << 4 | c.min_dr])
+        self.modem.AT(f'$CHPLAN={blob.hex().upper()}{(mask or "").upper()}')
+
     @property
     def rfpower(self):
         '''Return the currently configured RF output power.
@@ -2009,6 +3335,7 @@ class MurataModem(ATCI):
         The default value is 0 (binary format).
         '''
         value: DataFormat | int = int(assert_response(self.modem.AT('+DFORMAT?')))
+        self.modem.hex_payload = value == DataFormat.HEXADECIMAL.value
         try:
             value = DataFormat(value)
         except ValueError:
@@ -2041,6 +3368,7 @@ class MurataModem(ATCI):
             value = value.value
 
         self.modem.AT(f'+DFORMAT={value}')
+        self.modem.hex_payload = int(value) == DataFormat.HEXADECIMAL.value
 
     data_encoding = dformat
 
@@ -2159,8 +3487,8 @@ class MurataModem(ATCI):
                 self.modem.flush()
                 self.modem.read_inline_response()
                 if confirmed:
-                    # The +ACK +NOACK events carry one boolean value (True for +ACK,
-                    # False for +NOACK)
+                    # The +ACK +NOACK events carry a boolean value (True for +ACK,
+                    # False for +NOACK), possibly followed by the transmission count
                     return events.wait_for('ack', timeout=timeout)[0]
                 else:
                     return None
@@ -2202,6 +3530,44 @@ class MurataModem(ATCI):
 
     multicast = mcast
 
+    def mcast_slots(self) -> List[McastSlot]:
+        '''Return the slots in use of the modem's multicast group table.
+
+        Each slot holds a multicast address and its session keys. The group is
+        the LoRaMac multicast context the slot is loaded into, or -1.
+        '''
+        items = assert_response(self.modem.AT('$MCSLOT?')).split(';')
+        rv = []
+        for item in items[1:]:
+            slot, addr, group = item.split(',')
+            rv.append(McastSlot(int(slot), addr, int(group)))
+        return rv
+
+    def set_mcast_slot(self, slot: int, addr: Optional[str] = None, nwkskey: Optional[str] = None,
+                       appskey: Optional[str] = None, mckey: Optional[str] = None):
+        '''Store a multicast group in a slot of the group table, or clear the
+        slot if no address is given.
+
+        Pass either the session keys, or the McKey to have the modem derive
+        the session keys once and store them.
+        '''
+        if addr is None:
+            self.modem.AT(f'$MCSLOT={slot}')
+        elif mckey is not None:
+            self.modem.AT(f'$MCSLOT={slot},{addr},{mckey}')
+        else:
+            self.modem.AT(f'$MCSLOT={slot},{addr},{nwkskey},{appskey}')
+
+    def mcast_activate(self, slot: int, group: Optional[int] = None) -> int:
+        '''Load a slot of the multicast group table into a LoRaMac multicast
+        context and return the context's group ID.
+
+        Without a group, the modem picks a free context or the one activated
+        least recently. A slot loaded already is not written again.
+        '''
+        cmd = f'$MCACT={slot}' if group is None else f'$MCACT={slot},{group}'
+        return int(assert_response(self.modem.AT(cmd)))
+
     def putx(self, port: int, data: bytes, timeout: Optional[float] = None, hex = False):
         '''Send unconfirmed uplink message to the LoRaWAN network.
 
@@ -2268,8 +3634,8 @@ class MurataModem(ATCI):
                 self.modem.flush()
                 self.modem.read_inline_response()
                 if confirmed:
-                    # The +ACK +NOACK events carry one boolean value (True for +ACK,
-                    # False for +NOACK)
+                    # The +ACK +NOACK events carry a boolean value (True for +ACK,
+                    # False for +NOACK), possibly followed by the transmission count
                     return events.wait_for('ack', timeout=timeout)[0]
                 else:
                     return None
@@ -3382,6 +4748,18 @@ class OpenLoRaModem(MurataModem):
             rv['dev_addr'] = data[4]
         return rv
 
+    @property
+    def state(self):
+        '''Return a snapshot of the session and radio state in one query.
+
+        This property queries AT$STATE? which returns the information provided
+        by AT$SESSION?, AT+FRMCNT?, AT+RFQ?, AT+DR?, AT+RFPOWER? and
+        AT+BACKOFF? in a single packed hex-encoded response. The response is
+        decoded with decode_state(). See decode_state() for the description of
+        the returned dictionary.
+        '''
+        return decode_state(assert_response(self.modem.AT('$STATE?')))
+
     def cw(self, freq: int, power: int, timeout: int):
         '''Start continuous carrier wave (CW) transmission.
 
@@ -3441,7 +4819,63 @@ class OpenLoRaModem(MurataModem):
 
     lock_keys = lockkeys
 
-    def devtime(self, piggyback = False, timeout: float = 10):
+    def nvmdump(self) -> bytes:
+        '''Return a snapshot of the configuration stored in the modem's NVM.
+
+        The snapshot is a single binary blob with a checksum that can be loaded
+        into other modems with nvmload, e.g., to clone a golden configuration on
+        a production line. It does not include the frame counters and DevNonce.
+        The security keys are omitted if they have been locked with lockkeys.
+        Use decode_snapshot() to inspect the snapshot.
+        '''
+        return binascii.unhexlify(assert_response(self.modem.AT('$NVMDUMP?', timeout=30)))
+
+    def nvmload(self, snapshot: bytes, hex = False):
+        '''Load a snapshot created by nvmdump into the modem's NVM.
+
+        The snapshot is transferred in a single command. The modem reboots to
+        apply the configuration, and the method blocks until it has restarted.
+        Parts of the configuration that are not included in the snapshot, e.g.,
+        the security keys, remain unchanged. If the modem has its keys locked,
+        the snapshot is rejected.
+
+        If `dformat` is set to 1, the parameter hex must be set to True.
+        '''
+        assert self.modem.port is not None
+        with self.modem.lock:
+            with self.modem.events as events:
+                self.modem.AT(f'$NVMLOAD={len(snapshot)}', wait=False, flush=False)
+                self.modem.port.write(binascii.hexlify(snapshot) if hex else snapshot)
+                self.modem.flush()
+                self.modem.read_inline_response(timeout=30)
+                events.wait_for('event=0,0')
+
+    def evlog(self) -> List[EventLogRecord]:
+        '''Return the records of the modem's persistent event log.
+
+        The modem records boots (a: the RCC_CSR reset flags, b: the seconds run
+        by the previous boot), halts (b: the caller's address), NVM checksum
+        failures and migrations (a: the kind), and OTAA Join attempts (a: the
+        LoRaMac status, 0 if accepted, b: the data rate) in a log in flash that
+        survives resets. Each record carries the RTC time in seconds since the
+        last power-on. The records are returned from the oldest.
+        '''
+        items = assert_response(self.modem.AT('$EVLOG?', timeout=10)).split(';')
+        rv = []
+        for item in items[1:]:
+            time, event, a, b = (int(v) for v in item.split(','))
+            try:
+                event = EventLogEvent(event)
+            except ValueError:
+                pass
+            rv.append(EventLogRecord(time, event, a, b))
+        return rv
+
+    def evlog_clear(self):
+        '''Erase the modem's persistent event log.'''
+        self.modem.AT('$EVLOG')
+
+    def devtime(self, piggyback = False, timeout: float = 10, deadline: int = 0):
         '''Request time synchronization from the LoRaWAN network server.
 
         This command issues a DeviceTimeReq MAC request to the LoRaWAN network
@@ -3456,7 +4890,9 @@ class OpenLoRaModem(MurataModem):
         request is sent immediately or piggy-backed on top of the next regular
         uplink message sent by the application. If set to False, the command
         returns the obtained GPS time. If set to True, the command returns None
-        immediately and does not wait for the response from the server.
+        immediately and does not wait for the response from the server. With a
+        non-zero deadline (in seconds), a piggy-backed request is sent in a
+        dedicated uplink if no regular uplink has carried it by then.
 
         A note on GPS time: All time-related commands expect and return GPS
         time. That is the time scale used in LoRaWAN. GPS time differs from UTC
@@ -3478,7 +4914,7 @@ class OpenLoRaModem(MurataModem):
                 events.once('event', cb)
                 events.once('answer', cb)
                 with self.modem.lock:
-                    self.modem.AT('$DEVTIME 1')
+                    self.modem.AT(f'$DEVTIME=1,{deadline}' if deadline else '$DEVTIME 1')
                     while True:
                         event = q.get(timeout=timeout)
                         if event[1] == 1:
@@ -3550,6 +4986,38 @@ class OpenLoRaModem(MurataModem):
 
     dev_nonce = devnonce
 
+    @property
+    def cadrx(self):
+        '''Return the CAD duty-cycled reception configuration and statistics.
+
+        Returns a CadRx tuple with the CAD period in milliseconds (0 if the
+        mode is disabled), the number of channel activity detections run, the
+        number of detections that found a preamble, and the number of packets
+        received after a detection.
+        '''
+        v = assert_response(self.modem.AT('$CADRX?')).split(',')
+        return CadRx(*[int(x) for x in v])
+
+    @cadrx.setter
+    def cadrx(self, period: int):
+        '''Enable or disable CAD duty-cycled reception in class C.
+
+        With a non-zero period (20-10000 ms), the modem does not keep the
+        receiver on in class C. Instead, the radio sleeps and wakes up every
+        period milliseconds to detect a LoRa preamble with channel activity
+        detection (CAD). The receiver is only switched on when a preamble has
+        been detected. The average receive current drops roughly in proportion
+        to the CAD duty cycle. In exchange, the network server must send class
+        C downlinks with a preamble longer than the period, and the downlink
+        latency grows by up to one period. Set to 0 to disable.
+
+        The setting is not saved in NVM. See tools/cad-energy.py for the
+        estimated energy savings.
+        '''
+        self.modem.AT(f'$CADRX={period}')
+
+    cad_rx = cadrx
+
     @property
     def mcuid(self):
         '''Return the unique identifier of the modem's microcontroller.
@@ -3698,8 +5166,9 @@ def random_key():
 @click.option('--guard', '-g', type=int, default=None, help='AT command guard interval [s]')
 @click.option('--machine', '-m', default=False, is_flag=True, help='Produce machine-readable output.')
 @click.option('--show-keys', '-k', 'with_keys', default=False, is_flag=True, help='Show security keys.')
+@click.option('--socket', '-s', 'sock', type=str, default=None, envvar='LORA_SOCKET', help='Use the modem through a lora daemon listening on this Unix socket.')
 @click.pass_context
-def cli(ctx, port, baudrate, twr, reset, verbose, guard, machine, with_keys, rts, dtr):
+def cli(ctx, port, baudrate, twr, reset, verbose, guard, machine, with_keys, rts, dtr, sock):
     '''Command line interface to the Murata TypeABZ LoRaWAN modem.
 
     This tool provides a number of commands for managing Murata TypeABZ
@@ -3711,8 +5180,11 @@ def cli(ctx, port, baudrate, twr, reset, verbose, guard, machine, with_keys, rts
     \b
     * Obtain modem information: device, network, state
     * Configure the modem: get, set, reset, reboot
+    * Update the firmware: dfu
     * Manage security keys: keys, keygen
     * Perform network operations: join, link, trx
+    * Measure AT command latency and throughput: bench
+    * Run long-term uplink tests: soak
 
     Configure the modem's serial port filename with the command line option
     -p or via the environment variable PORT. The tool tries to auto-detect
@@ -3728,6 +5200,11 @@ def cli(ctx, port, baudrate, twr, reset, verbose, guard, machine, with_keys, rts
     Use the command line option -k to also include LoRaWAN security keys in
     the output of the commands device and network. They keys are ommited
     from the output by default for security reasons.
+
+    Opening the serial port and detecting the baud rate takes about a second.
+    To avoid that on every invocation, start "lora daemon" once and point
+    other invocations to its socket with -s or the environment variable
+    LORA_SOCKET.
     '''
     global machine_readable, show_keys, twr_sdk
     machine_readable = machine
@@ -3737,6 +5214,21 @@ def cli(ctx, port, baudrate, twr, reset, verbose, guard, machine, with_keys, rts
     @lru_cache(maxsize=None)
     def get_modem():
         nonlocal port, baudrate
+        if sock is not None:
+            remote = RemoteTypeABZ(sock, verbose=verbose, guard=guard)
+            try:
+                remote.open()
+            except OSError as error:
+                click.echo(f'Error: Could not connect to {sock}: {error}', err=True)
+                sys.exit(1)
+
+            modem = OpenLoRaModem(remote)
+            if reset:
+                modem.reset()
+
+            ctx.call_on_close(remote.close)
+            return modem
+
         port = port or os.environ.get('PORT', None)
         if port is None:
             click.echo('Error: Please specify a serial port', err=True)
@@ -4285,6 +5777,43 @@ def trx(get_modem: Callable[[], OpenLoRaModem], encoding, delimiter: str, messag
                 send(line.rstrip(b'\n'))
 
 
+@cli.command()
+@click.option('--listen', '-l', 'path', type=str, default=None, help='Pathname of the Unix socket [default: $LORA_SOCKET or /tmp/lora-modem.sock]')
+@click.pass_context
+def daemon(ctx, path):
+    '''Keep the modem open and share it with other lora invocations.
+
+    The daemon opens the serial port once and then serves AT commands over
+    a Unix domain socket. Point other lora invocations to the socket with -s
+    or LORA_SOCKET. Services can also use the socket directly with
+    newline-delimited JSON-RPC 2.0, e.g.:
+
+    \b
+    {"jsonrpc": "2.0", "id": 1, "method": "at", "params": {"cmd": "$MCUID?"}}
+    {"jsonrpc": "2.0", "id": 2, "method": "subscribe"}
+
+    Subscribed clients receive +EVENT, +ANS, +ACK, and +NOACK messages as
+    "line" notifications and downlinks as "downlink" notifications. AT
+    commands from different clients are executed one at a time. Restart
+    the daemon after changing the modem's baud rate.
+    '''
+    if ctx.parent.params['sock'] is not None:
+        click.echo('Error: The daemon needs a serial port, not a socket', err=True)
+        sys.exit(1)
+
+    path = path or os.environ.get('LORA_SOCKET', '/tmp/lora-modem.sock')
+    server = ModemDaemon(ctx.obj(), path)
+    if not machine_readable:
+        click.echo(f'Listening on {path}')
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+    finally:
+        server.server_close()
+        os.unlink(path)
+
+
 @cli.command()
 @click.option('--hard', '-r', default=False, is_flag=True, help='Perform hard reboot.')
 @click.pass_obj
@@ -4308,6 +5837,83 @@ def reboot(get_modem: Callable[[], OpenLoRaModem], hard):
         click.echo(f"done")
 
 
+@cli.command()
+@click.argument('firmware', type=click.File('rb'))
+@click.option('--speed', '-S', type=int, default=115200, help='Bootloader baud rate.', show_default=True)
+@click.option('--in-bootloader', '-B', default=False, is_flag=True, help='The modem is already in the bootloader, do not send AT$DFU.')
+@click.option('--verify/--no-verify', default=True, help='Read the firmware back after writing it.', show_default=True)
+@click.pass_context
+def dfu(ctx, firmware, speed, in_bootloader, verify):
+    '''Update the modem's firmware over the AT command UART.
+
+    FIRMWARE is the binary firmware image (the .bin file) produced by the
+    build. The command sends AT$DFU, which flushes the modem's NVM and
+    restarts it into the STM32 system bootloader on the same UART. It then
+    erases the flash, writes the image, reads it back for verification, and
+    starts the new firmware. The configuration kept in the EEPROM is
+    preserved. No reset or boot pin access is needed.
+
+    AT$DFU requires firmware built with DFU=1 and is refused once the keys
+    have been locked with AT$LOCKKEYS. The modem stays in the bootloader until
+    the new firmware has been started or the modem is reset. If the update is
+    interrupted before that, rerun the command with -B to retry.
+    '''
+    if ctx.parent.params['sock'] is not None:
+        click.echo('Error: The firmware update needs a serial port, not a socket', err=True)
+        sys.exit(1)
+
+    image = firmware.read()
+    if len(image) < 8 or int.from_bytes(image[:4], 'little') >> 24 != 0x20:
+        click.echo(f'Error: {firmware.name} does not look like a firmware image (.bin)', err=True)
+        sys.exit(1)
+
+    dev = None
+    if not in_bootloader:
+        modem = ctx.obj()
+        dev = modem.modem
+        with dev.events as events:
+            dev.AT('$DFU')
+            try:
+                events.wait_for('event=0,2', timeout=2)
+            except TimeoutError:
+                pass
+        dev.close()
+        sleep(0.5)
+        port = dev.pathname
+    else:
+        port = ctx.parent.params['port'] or os.environ.get('PORT', None)
+        if port is None:
+            click.echo('Error: Please specify a serial port', err=True)
+            sys.exit(1)
+
+    def progress(phase, done, total):
+        if not machine_readable:
+            click.echo(f'\r{phase.capitalize()}: {done * 100 // total:3d} %', nl=done == total)
+
+    bl = STM32Bootloader(port, speed=speed, verbose=ctx.parent.params['verbose'])
+    bl.open()
+    try:
+        bl.sync()
+        version = bl.get()
+        pid = bl.get_id()
+        if not machine_readable:
+            click.echo(f'Bootloader {version >> 4}.{version & 0xf}, product ID 0x{pid:03x}')
+            click.echo(f'Erasing {len(image)} bytes...')
+        times = bl.flash(image, verify=verify, progress=progress)
+        bl.go(bl.FLASH_BASE)
+    finally:
+        bl.close()
+
+    render([[k.capitalize(), f'{v:.2f}'] for k, v in times.items()], headers=['Phase', 'Time [s]'])
+
+    # The baud rate is kept in the EEPROM, so the new firmware talks at the
+    # same speed as the old one
+    if dev is not None:
+        wait_for_modem(dev, dev.speed)
+        if not machine_readable:
+            click.echo(f'Modem {dev} is running firmware {OpenLoRaModem(dev).version.get("firmware_version", "?")}')
+
+
 @cli.command()
 @click.option('--region', '-r', type=str, default=None, help='Switch to the region (band) if necessary.')
 @click.option('--data-rate', '-R', type=str, default=None, help='Specify Join data rate (data rate 0 by default).')
@@ -4561,13 +6167,20 @@ def get(get_modem: Callable[[], OpenLoRaModem], names, all, long, names_only):
             click.echo("Please either provide a setting name or use --all", err=True)
             sys.exit(1)
 
+    def strip(name):
+        n = name.lower()
+        return name[3:] if n.startswith('at+') or n.startswith('at$') else name
+
+    # Fetch all values with pipelined AT commands first
+    values = modem.read_settings([strip(name) for name in names])
+
     for name in names:
         orig_name = name
-        n = name.lower()
-        if n.startswith('at+') or n.startswith('at$'):
-            name = name[3:]
+        name = strip(name)
         try:
-            value = getattr(modem, name)
+            value = values[name]
+            if isinstance(value, Exception):
+                raise value
         except AttributeError as e:
             click.echo(f'Error while getting "{orig_name}": {e}', err=True)
             sys.exit(1)
@@ -4873,6 +6486,542 @@ def keygen(get_modem: Callable[[], OpenLoRaModem], protocol, silent, old):
         render(data)
 
 
+SOAK_FIELDS = ['time', 'seq', 'backoff', 'stall', 'result', 'ok_latency', 'done_latency',
+    'time_on_air', 'channel', 'dr', 'retransmissions', 'ack', 'downlinks', 'rssi', 'snr']
+
+
+def soak_uplink(modem: OpenLoRaModem, events: EventSubscription, seq: int, port: int, size: int,
+    confirmed: bool, hex: bool, timeout: float) -> dict[str, Any]:
+    '''Send one soak test uplink and collect what the modem reports about it.
+
+    The uplink is held back while the modem enforces a duty cycle quiet
+    period. The time spent waiting is reported as a stall. Latencies are in
+    milliseconds, stalls in seconds.
+    '''
+    dev = modem.modem
+    rec: dict[str, Any] = dict.fromkeys(SOAK_FIELDS, '')
+    rec['time'] = datetime.now().isoformat(timespec='seconds')
+    rec['seq'] = seq
+
+    start = perf_counter()
+    rec['backoff'] = backoff = modem.backoff
+    while backoff > 0:
+        sleep(backoff / 1000)
+        backoff = modem.backoff
+    rec['stall'] = round(perf_counter() - start, 3)
+
+    done: "Queue[tuple]" = Queue()
+    retransmissions = [0]
+    acks: "Queue[bool]" = Queue()
+    downlinks: List[Downlink] = []
+    on_downlink = downlinks.append
+
+    def on_ack(ack, *args):
+        acks.put_nowait(ack)
+
+    def on_done(*args):
+        done.put_nowait(args)
+
+    def on_retransmission(*args):
+        retransmissions[0] += 1
+
+    events.on('event=6,0', on_done)
+    events.on('event=2,2', on_retransmission)
+    events.on('ack', on_ack)
+    events.on('downlink', on_downlink)
+
+    payload = seq.to_bytes(4, 'big') + secrets.token_bytes(max(0, size - 4))
+    payload = payload[:size]
+    try:
+        start = perf_counter()
+        try:
+            with dev.lock:
+                assert dev.port is not None
+                dev.AT(f'+P{"C" if confirmed else "U"}TX {port},{len(payload)}', wait=False, flush=False)
+                dev.port.write(binascii.hexlify(payload) if hex else payload)
+                dev.flush()
+                dev.read_inline_response(timeout=timeout)
+        except ModemError as error:
+            rec['result'] = f'error {error.errno}'
+            return rec
+        except TimeoutError:
+            rec['result'] = 'timeout'
+            return rec
+
+        rec['ok_latency'] = round((perf_counter() - start) * 1000, 1)
+
+        try:
+            args = done.get(timeout=timeout)
+        except Empty:
+            rec['result'] = 'timeout'
+            return rec
+
+        rec['done_latency'] = round((perf_counter() - start) * 1000, 1)
+        rec['result'] = 'sent'
+        if len(args) >= 3:
+            rec['time_on_air'], rec['channel'], rec['dr'] = args[:3]
+
+        if confirmed:
+            try:
+                rec['ack'] = int(acks.get(timeout=1))
+            except Empty:
+                rec['ack'] = 0
+
+        # A downlink received in the RX windows is reported shortly after the
+        # TX-done event
+        sleep(0.1)
+        rec['downlinks'] = len(downlinks)
+        if len(downlinks) and downlinks[-1].rssi is not None:
+            rec['rssi'], rec['snr'] = downlinks[-1].rssi, downlinks[-1].snr
+        return rec
+    finally:
+        rec['retransmissions'] = retransmissions[0]
+        events.off('event=6,0', on_done)
+        events.off('event=2,2', on_retransmission)
+        events.off('ack', on_ack)
+        events.off('downlink', on_downlink)
+
+
+def soak_summary(records: List[dict[str, Any]], confirmed: bool) -> dict[str, Any]:
+    '''Compute the KPIs of a soak test from its time series'''
+    sent = [r for r in records if r['result'] == 'sent']
+    ok = [r['ok_latency'] / 1000 for r in records if r['ok_latency'] != '']
+    stalls = [r['stall'] for r in records if r['stall']]
+    delivered = sum(r['ack'] == 1 for r in sent) if confirmed else len(sent)
+
+    return {
+        'uplinks'         : len(records),
+        'sent'            : len(sent),
+        'errors'          : len(records) - len(sent),
+        'delivery_ratio'  : delivered / len(records) if len(records) else 0,
+        'ok_latency'      : latency_stats(ok) if len(ok) else None,
+        'retransmissions' : sum(r['retransmissions'] or 0 for r in records),
+        'stalls'          : len(stalls),
+        'stall_time'      : round(sum(stalls), 3),
+        'downlinks'       : sum(r['downlinks'] or 0 for r in records)
+    }
+
+
+@cli.command()
+@click.option('--interval', '-i', type=float, default=60, help='Uplink interval [s].', show_default=True)
+@click.option('--duration', '-T', type=float, default=3600, help='Test duration [s], 0 to run until interrupted.', show_default=True)
+@click.option('--size', '-S', type=click.IntRange(1, 242), default=12, help='Uplink payload size [B].', show_default=True)
+@click.option('--port', '-P', 'lora_port', type=click.IntRange(1, 223), default=None, help='LoRaWAN port [default: the modem\'s default port]')
+@click.option('--confirmed', '-c', default=False, is_flag=True, help='Send confirmed uplinks.')
+@click.option('--timeout', '-t', type=float, default=60, help='Time limit for the completion of each uplink [s].', show_default=True)
+@click.option('--output', '-o', type=click.File('w'), default='-', help='Write the time series as CSV to this file.', show_default=True)
+@click.option('--json', '-j', 'as_json', default=False, is_flag=True, help='Print the summary as JSON.')
+@click.pass_obj
+def soak(get_modem: Callable[[], OpenLoRaModem], interval, duration, size, lora_port, confirmed, timeout, output, as_json):
+    '''Send uplinks at a fixed rate and record delivery KPIs.
+
+    The modem must have joined a network. The command sends an uplink every
+    INTERVAL seconds for DURATION seconds and writes a CSV time series with
+    one row per uplink: the duty cycle backoff reported by AT+BACKOFF before
+    the uplink and the time spent waiting for it (stall, in seconds), the
+    result, the latency to +OK and to the TX-done event (in milliseconds),
+    the time on air, channel, and data rate, the number of retransmissions,
+    the acknowledgement for confirmed uplinks, and the number of downlinks
+    with the RSSI and SNR of the last one.
+
+    Each payload starts with the 32-bit big-endian sequence number of the
+    uplink so that the application server can correlate messages. At the end
+    (or on Ctrl-C), the command prints a summary with the delivery ratio,
+    latency percentiles, retransmissions, and duty cycle stalls to standard
+    error. The delivery ratio counts acknowledged uplinks if -c is given and
+    uplinks the modem reported as sent otherwise.
+    '''
+    import csv
+
+    if twr_sdk:
+        click.echo('Error: This functionality is unavailable through the Tower SDK', err=True)
+        sys.exit(1)
+
+    modem = get_modem()
+    hex = modem.dformat == DataFormat.HEXADECIMAL
+    if lora_port is None:
+        lora_port = modem.port
+
+    writer = csv.DictWriter(output, fieldnames=SOAK_FIELDS)
+    writer.writeheader()
+    output.flush()
+
+    records: List[dict[str, Any]] = []
+    start = perf_counter()
+    try:
+        with modem.modem.events as events:
+            while duration == 0 or perf_counter() - start < duration:
+                rec = soak_uplink(modem, events, len(records), lora_port, size, confirmed, hex, timeout)
+                records.append(rec)
+                writer.writerow(rec)
+                output.flush()
+
+                delay = start + len(records) * interval - perf_counter()
+                if delay > 0:
+                    sleep(delay)
+    except KeyboardInterrupt:
+        pass
+
+    summary = soak_summary(records, confirmed)
+    if as_json:
+        click.echo(json.dumps(summary, indent=2), err=True)
+        return
+
+    lat = summary['ok_latency']
+    click.echo(dedent(f'''\
+        Uplinks: {summary["uplinks"]} ({summary["sent"]} sent, {summary["errors"]} failed)
+        Delivery ratio: {summary["delivery_ratio"] * 100:.1f} %
+        Latency to +OK [ms]: {f'p50 {lat["p50"]:.1f}, p99 {lat["p99"]:.1f}, max {lat["max"]:.1f}' if lat else '-'}
+        Retransmissions: {summary["retransmissions"]}
+        Duty cycle stalls: {summary["stalls"]} ({summary["stall_time"]:.1f} s)
+        Downlinks: {summary["downlinks"]}'''), err=True)
+
+
+def parse_manifest_value(value: str):
+    '''Convert a manifest cell to the value passed to a setter. Keys and EUIs
+    stay strings even if they only consist of decimal digits.'''
+    if re.match(r'^([0-9a-fA-F]{16}|[0-9a-fA-F]{32})$', value):
+        return value
+    if value.lower() in ('true', 'false'):
+        return value.lower() == 'true'
+    if re.match(r'^-?\d+$', value):
+        return int(value)
+    return value
+
+
+def same_setting(expected, actual) -> bool:
+    def norm(v):
+        if isinstance(v, Enum): return v.name.upper()
+        if isinstance(v, bool): return str(int(v))
+        return str(v).upper()
+
+    if isinstance(actual, Enum) and norm(expected) == str(actual.value):
+        return True
+    return norm(expected) == norm(actual)
+
+
+async def wait_for_event(modem: AsyncTypeABZ, cmd: str, event: tuple, timeout: float):
+    '''Send an AT command and wait for the given event, e.g., ('event', 0, 0)'''
+    q: "asyncio.Queue[tuple]" = asyncio.Queue()
+    modem.consumers.add(q)
+    try:
+        await modem.AT(cmd)
+        while (await asyncio.wait_for(q.get(), timeout))[:len(event)] != event:
+            pass
+    finally:
+        modem.consumers.discard(q)
+
+
+async def provision_device(port: str, settings: dict[str, Any], baudrate: Optional[int], verbose: bool, timeout: float):
+    '''Configure one modem and verify the configuration after a reboot.
+    Returns the duration of each phase in seconds.'''
+    loop = asyncio.get_running_loop()
+    t = [loop.time()]
+
+    speed = baudrate or await loop.run_in_executor(None, TypeABZ(port).detect_baud_rate)
+    if speed is None:
+        raise Exception('Could not detect serial port speed')
+    t.append(loop.time())
+
+    modem = AsyncTypeABZ(port, verbose=verbose)
+    await modem.open(speed)
+    try:
+        atci = AsyncATCI(modem)
+        settings = dict(settings)
+
+        # A region change reboots the modem and resets most LoRaWAN settings,
+        # so it goes first and its event is awaited here
+        band = next((settings.pop(k) for k in list(settings) if k.lower() in ('band', 'region')), None)
+        if band is not None:
+            value = LoRaRegion[band.upper()].value if isinstance(band, str) else band
+            old = await atci.get('band')
+            if not same_setting(value, old):
+                await wait_for_event(modem, f'+BAND={value}', ('event', 0, 0), timeout)
+
+        await atci.set_many(settings)
+        t.append(loop.time())
+
+        # Configuration changes are saved to NVM at the latest upon reboot.
+        # Verifying after the reboot also checks that they were saved.
+        await wait_for_event(modem, '+REBOOT', ('event', 0, 0), timeout)
+        t.append(loop.time())
+
+        if band is not None:
+            settings['band'] = band
+        failed = []
+        for name, value in settings.items():
+            try:
+                if not same_setting(value, await atci.get(name)):
+                    failed.append(name)
+            except AccessDenied:
+                # Keys cannot be read back after AT$LOCKKEYS
+                pass
+        if len(failed):
+            raise Exception(f'Verification failed: {", ".join(failed)}')
+        t.append(loop.time())
+    finally:
+        await modem.close()
+
+    return [b - a for a, b in zip(t, t[1:])]
+
+
+@cli.command()
+@click.argument('manifest', type=click.File('r'))
+@click.option('--jobs', '-j', type=int, default=8, help='Number of modems provisioned at the same time.', show_default=True)
+@click.option('--timeout', '-t', type=float, default=30, help='Time limit for each reboot [s].', show_default=True)
+@click.pass_context
+def provision(ctx, manifest, jobs, timeout):
+    '''Configure many modems in parallel from a CSV manifest.
+
+    The first line of the manifest names the columns. The column "port" holds
+    the pathname of the modem's serial port, and the other columns name the
+    settings to configure, as accepted by the set command, e.g.:
+
+    \b
+    port,band,deveui,joineui,appkey,nwkkey
+    /dev/ttyUSB0,EU868,0011223344556677,...
+    /dev/ttyUSB1,EU868,0011223344556678,...
+
+    Empty cells are skipped. The region is configured first, since changing
+    it resets most other settings. The remaining settings are written with
+    pipelined AT commands, the modem is rebooted to save the configuration,
+    and every setting is read back. Keys that cannot be read back are not
+    verified.
+
+    The modems are driven concurrently with the asyncio transport, which
+    requires the pyserial-asyncio package. The command prints the result and
+    the duration of each phase for every modem, and fails if any modem could
+    not be provisioned.
+    '''
+    import csv
+
+    baudrate = ctx.parent.params['baudrate']
+    verbose = ctx.parent.params['verbose']
+
+    devices = []
+    for row in csv.DictReader(manifest):
+        row = {k.strip(): v.strip() for k, v in row.items() if k is not None and v is not None and len(v.strip())}
+        port = row.pop('port', None)
+        if port is None:
+            click.echo('Error: Each row of the manifest must have a port', err=True)
+            sys.exit(1)
+        devices.append((port, {k: parse_manifest_value(v) for k, v in row.items()}))
+
+    async def run():
+        sem = asyncio.Semaphore(jobs)
+
+        async def one(port, settings):
+            async with sem:
+                try:
+                    return await provision_device(port, settings, baudrate, verbose, timeout)
+                except Exception as error:
+                    return error
+
+        return await asyncio.gather(*[one(*d) for d in devices])
+
+    start = datetime.now()
+    results = asyncio.run(run())
+    elapsed = (datetime.now() - start).total_seconds()
+
+    data = []
+    for (port, _), rv in zip(devices, results):
+        if isinstance(rv, Exception):
+            data.append([port, f'Failed: {rv}', '', '', '', '', ''])
+        else:
+            data.append([port, 'OK', *[f'{v:.2f}' for v in rv], f'{sum(rv):.2f}'])
+    render(data, headers=['Port', 'Result', 'Detect [s]', 'Configure [s]', 'Reboot [s]', 'Verify [s]', 'Total [s]'])
+
+    if not machine_readable:
+        click.echo(f'Provisioned {sum(not isinstance(r, Exception) for r in results)} of {len(devices)} modems in {elapsed:.2f} s')
+
+    if any(isinstance(r, Exception) for r in results):
+        sys.exit(1)
+
+
+def latency_stats(samples: List[float]) -> dict[str, float]:
+    '''Summarize round-trip times in seconds as percentiles in milliseconds'''
+    s = sorted(samples)
+
+    def rank(p):
+        return s[min(len(s) - 1, max(0, -(-p * len(s) // 100) - 1))] * 1000
+
+    return {
+        'count': len(s),
+        'mean' : sum(s) / len(s) * 1000,
+        'p50'  : rank(50),
+        'p90'  : rank(90),
+        'p99'  : rank(99),
+        'max'  : s[-1] * 1000
+    }
+
+
+def bench_latency(modem: OpenLoRaModem, count: int) -> dict[str, dict[str, float]]:
+    '''Measure the round-trip time of representative AT commands.
+
+    The setters write back the values they currently have, so the benchmark
+    leaves the modem's configuration unchanged.
+    '''
+    cmds = ['', '+FRMCNT?', '$SESSION?', '+DR?']
+    cmds.append(f'+PORT={assert_response(modem.modem.AT("+PORT?"))}')
+    cmds.append(f'+REP={assert_response(modem.modem.AT("+REP?"))}')
+
+    rv = {}
+    for cmd in cmds:
+        samples = []
+        for _ in range(count):
+            start = perf_counter()
+            modem.modem.AT(cmd)
+            samples.append(perf_counter() - start)
+        rv[f'AT{cmd}'] = latency_stats(samples)
+    return rv
+
+
+def bench_uplink(modem: OpenLoRaModem, count: int, size: int) -> dict[str, dict[str, Any]]:
+    '''Measure the rate at which +UTX accepts payloads in binary and hex format.
+
+    Without a network session the modem receives the whole payload and then
+    rejects it with ERR_NO_JOIN, so nothing is transmitted. The rejected
+    submissions are counted and included in the rate.
+    '''
+    original = modem.dformat
+    payload = secrets.token_bytes(size)
+
+    rv = {}
+    try:
+        for fmt in (DataFormat.BINARY, DataFormat.HEXADECIMAL):
+            modem.dformat = fmt
+            hex = fmt == DataFormat.HEXADECIMAL
+            samples, rejected = [], 0
+            for _ in range(count):
+                start = perf_counter()
+                try:
+                    modem.utx(payload, hex=hex)
+                except ModemError:
+                    rejected += 1
+                samples.append(perf_counter() - start)
+
+            elapsed = sum(samples)
+            rv[str(fmt).lower()] = {
+                'latency'    : latency_stats(samples),
+                'rejected'   : rejected,
+                'rate'       : count / elapsed,
+                'goodput'    : count * size / elapsed,
+                'wire_bytes' : count * (size * (2 if hex else 1) + len(f'AT+UTX {size}\r'))
+            }
+    finally:
+        modem.dformat = original
+    return rv
+
+
+def wait_for_modem(dev: TypeABZ, speed: int, timeout: float = 10):
+    '''Reopen the port of a restarting modem and wait until it responds to AT'''
+    deadline = perf_counter() + timeout
+    sleep(0.5)
+    dev.open(speed)
+    while True:
+        try:
+            dev.AT(timeout=0.5)
+            return
+        except TimeoutError:
+            if perf_counter() > deadline:
+                raise
+
+
+def switch_baud_rate(modem: OpenLoRaModem, speed: int, timeout: float = 10):
+    '''Reconfigure the modem's UART, reboot it, and reopen the port at the new speed'''
+    dev = modem.modem
+    modem.uart = speed
+    dev.AT('+REBOOT')
+    dev.close()
+    wait_for_modem(dev, speed, timeout)
+
+
+@cli.command()
+@click.option('--count', '-c', type=int, default=100, help='Number of iterations of each measurement.', show_default=True)
+@click.option('--size', '-S', type=click.IntRange(1, 120), default=64, help='Uplink payload size [B].', show_default=True)
+@click.option('--baud', '-B', 'bauds', type=str, default=None, help='Comma-separated baud rates to benchmark, or "all" [default: current]')
+@click.option('--transmit', default=False, is_flag=True, help='Benchmark +UTX even if the modem has joined a network.')
+@click.option('--json', '-j', 'as_json', default=False, is_flag=True, help='Print the results as JSON.')
+@click.pass_obj
+def bench(get_modem: Callable[[], OpenLoRaModem], count, size, bauds, transmit, as_json):
+    '''Measure AT command latency and UART throughput.
+
+    The benchmark measures the round-trip time of AT, representative getters
+    such as AT+FRMCNT? and AT$SESSION?, and setters, and reports the mean,
+    50th, 90th, and 99th percentile, and maximum in milliseconds. It then
+    submits payloads with AT+UTX in binary and in hexadecimal format and
+    reports the submission rate [1/s] and the payload goodput [B/s].
+
+    The uplink benchmark only runs when the modem has no network session,
+    in which case the modem rejects each payload after receiving it and
+    nothing is transmitted. Use --transmit to run it on a joined modem; the
+    modem will then attempt to transmit every payload.
+
+    Use -B to repeat the benchmark at other baud rates, e.g., -B 9600,115200,
+    or -B all for every supported baud rate. The modem is reconfigured and
+    rebooted for each baud rate and its original baud rate is restored at the
+    end. The sweep needs a direct serial connection and cannot be performed
+    through the lora daemon. Use --json to obtain results suitable for
+    tracking across firmware releases.
+    '''
+    modem = get_modem()
+    original = current = modem.uart.baudrate
+
+    if bauds is None:
+        speeds = [current]
+    elif bauds == 'all':
+        speeds = [4800, 9600, 19200, 38400, 57600, 115200]
+    else:
+        speeds = [int(v) for v in bauds.split(',')]
+
+    if speeds != [current] and isinstance(modem.modem, RemoteTypeABZ):
+        click.echo('Error: The baud rate sweep needs a serial port, not a socket', err=True)
+        sys.exit(1)
+
+    uplink = transmit or modem.session['activation_mode'] == 'None'
+
+    results: dict[str, Any] = {
+        'version': modem.version,
+        'count'  : count,
+        'size'   : size,
+        'bauds'  : {}
+    }
+
+    try:
+        for speed in speeds:
+            if speed != current:
+                switch_baud_rate(modem, speed)
+                current = speed
+
+            r = results['bauds'][str(speed)] = { 'latency': bench_latency(modem, count) }
+            if uplink:
+                r['uplink'] = bench_uplink(modem, count, size)
+    finally:
+        if current != original:
+            switch_baud_rate(modem, original)
+
+    if as_json:
+        click.echo(json.dumps(results, indent=2, default=str))
+        return
+
+    for speed, r in results['bauds'].items():
+        if not machine_readable:
+            click.echo(f'Baud rate {speed}:')
+
+        data = []
+        for cmd, s in r['latency'].items():
+            data.append([cmd, *[f'{s[k]:.1f}' for k in ('mean', 'p50', 'p90', 'p99', 'max')]])
+        render(data, headers=['Command', 'Mean [ms]', 'p50 [ms]', 'p90 [ms]', 'p99 [ms]', 'Max [ms]'])
+
+        if 'uplink' in r:
+            data = []
+            for fmt, s in r['uplink'].items():
+                data.append([f'+UTX {size} ({fmt})', f'{s["rate"]:.1f}', f'{s["goodput"]:.0f}', f'{s["latency"]["p99"]:.1f}', s['rejected']])
+            render(data, headers=['Command', 'Rate [1/s]', 'Goodput [B/s]', 'p99 [ms]', 'Rejected'])
+        elif not machine_readable:
+            click.echo('Skipped the uplink benchmark, the modem has joined a network (see --transmit)')
+
+
 @cli.group(invoke_without_command=True)
 @click.pass_context
 def multicast(ctx):
@@ -5208,6 +7357,50 @@ def update_channel(get_modem: Callable[[], OpenLoRaModem], channel, frequency, m
     modem.rfparam = RFConfig(channel, frequency, min_dr, max_dr)
 
 
+@cli.group()
+def snapshot():
+    '''Clone modem configuration with NVM snapshots.
+    '''
+
+
+@snapshot.command('dump')
+@click.argument('file', type=click.File('wb'))
+@click.pass_obj
+def dump_snapshot(get_modem: Callable[[], OpenLoRaModem], file):
+    '''Save a snapshot of the modem's NVM configuration into a file.
+
+    The snapshot contains all configuration stored in the modem's NVM except for
+    the frame counters and DevNonce. The security keys are only included if
+    they have not been locked.
+    '''
+    modem = get_modem()
+    data = modem.nvmdump()
+    file.write(data)
+
+    if not machine_readable:
+        parts = decode_snapshot(data)
+        click.echo(f"Saved {len(data)} B snapshot of modem {modem} ({', '.join(parts)})")
+
+
+@snapshot.command('load')
+@click.argument('file', type=click.File('rb'))
+@click.pass_obj
+def load_snapshot(get_modem: Callable[[], OpenLoRaModem], file):
+    '''Load a snapshot saved with "snapshot dump" into the modem.
+
+    The modem reboots to apply the configuration.
+    '''
+    modem = get_modem()
+    data = file.read()
+    decode_snapshot(data)
+
+    if not machine_readable:
+        click.echo(f"Loading snapshot into modem {modem}...", nl=False)
+    modem.nvmload(data, hex=modem.dformat == DataFormat.HEXADECIMAL)
+    if not machine_readable:
+        click.echo("done.")
+
+
 @cli.command()
 @click.argument('time', type=str, nargs=-1)
 @click.option('--sync-lorawan', '-s', default=False, is_flag=True, help="Synchronize the modem's clock over the LoRaWAN network")
@@ -0,0 +1,47 @@
+// The ADC of the simulator reports a fixed supply voltage and temperature
+
+#include "adc.h"
+
+// Supply voltage (mV) and MCU temperature (degC)
+#define BATTERY_LEVEL 3300
+#define TEMPERATURE 25.0f
+
+
+void adc_init(void)
+{
+}
+
+
+void adc_before_stop(void)
+{
+}
+
+
+void adc_deinit(void)
+{
+}
+
+
+uint16_t adc_get_value(uint32_t channel)
+{
+    (void)channel;
+    return 0;
+}
+
+
+uint16_t adc_get_battery_level(void)
+{
+    return BATTERY_LEVEL;
+}
+
+
+uint16_t adc_get_temperature_level(void)
+{
+    return 0;
+}
+
+
+float adc_get_temperature_celsius(void)
+{
+    return TEMPERATURE;
+}
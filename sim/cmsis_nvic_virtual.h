@@ -0,0 +1,22 @@
+#ifndef _CMSIS_NVIC_VIRTUAL_H
+#define _CMSIS_NVIC_VIRTUAL_H
+
+// Included by core_cm0plus.h in the simulator build (CMSIS_NVIC_VIRTUAL). The
+// NVIC functions keep their CMSIS implementations, except for the system
+// reset, which restarts the simulator process instead of writing to SCB.
+
+void sim_reset(void) __attribute__ ((noreturn));
+
+#define NVIC_SetPriorityGrouping    __NVIC_SetPriorityGrouping
+#define NVIC_GetPriorityGrouping    __NVIC_GetPriorityGrouping
+#define NVIC_EnableIRQ              __NVIC_EnableIRQ
+#define NVIC_GetEnableIRQ           __NVIC_GetEnableIRQ
+#define NVIC_DisableIRQ             __NVIC_DisableIRQ
+#define NVIC_GetPendingIRQ          __NVIC_GetPendingIRQ
+#define NVIC_SetPendingIRQ          __NVIC_SetPendingIRQ
+#define NVIC_ClearPendingIRQ        __NVIC_ClearPendingIRQ
+#define NVIC_SetPriority            __NVIC_SetPriority
+#define NVIC_GetPriority            __NVIC_GetPriority
+#define NVIC_SystemReset            sim_reset
+
+#endif // _CMSIS_NVIC_VIRTUAL_H
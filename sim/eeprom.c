@@ -0,0 +1,117 @@
+// The data EEPROM, backed by a file on the host. The whole image is kept in
+// memory so that eeprom_mmap can return pointers into it; every write is also
+// written through to the file, so the image survives restarts of the
+// simulator just like the EEPROM survives a reset.
+
+#include "eeprom.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stm/include/stm32l072xx.h>
+#include "system.h"
+
+#define EEPROM_SIZE (DATA_EEPROM_BANK2_END - DATA_EEPROM_BASE + 1)
+
+
+static uint8_t image[EEPROM_SIZE];
+volatile uint32_t eeprom_writes;
+static int fd = -1;
+
+
+int sim_eeprom_open(const char *path)
+{
+    ssize_t n;
+
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+
+    // An erased EEPROM reads as zeroes. A missing or short image file is
+    // treated as partially erased memory.
+    memset(image, 0, sizeof(image));
+    n = pread(fd, image, sizeof(image), 0);
+    if (n < 0) {
+        perror(path);
+        return -1;
+    }
+
+    if (ftruncate(fd, sizeof(image)) < 0) {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+
+bool eeprom_write(uint32_t address, const void *buffer, size_t length)
+{
+    if (address + length > sizeof(image)) return false;
+    if (memcmp(image + address, buffer, length) == 0) return true;
+
+    memcpy(image + address, buffer, length);
+    eeprom_writes += (length + 3) / 4;
+    if (fd < 0) return true;
+    return pwrite(fd, buffer, length, address) == (ssize_t)length;
+}
+
+
+// As on hardware, erased EEPROM reads as zeroes
+bool eeprom_erase(uint32_t address, size_t length)
+{
+    static const uint8_t zero[64];
+
+    if (address + length > sizeof(image)) return false;
+
+    for (size_t i = 0; i < length; i += sizeof(zero)) {
+        size_t n = length - i < sizeof(zero) ? length - i : sizeof(zero);
+        if (!eeprom_write(address + i, zero, n)) return false;
+    }
+    return true;
+}
+
+
+// The write completes synchronously. As on hardware, the main loop is woken
+// up so that the owner of the write can pick up the result.
+static int async_status;
+
+bool eeprom_write_async(uint32_t address, const void *buffer, size_t length)
+{
+    if (address + length > sizeof(image)) return false;
+
+    async_status = eeprom_write(address, buffer, length) ? 0 : -1;
+    system_post(SYSTEM_TASK_NVM);
+    return true;
+}
+
+
+int eeprom_async_status(void)
+{
+    int status = async_status;
+    if (status < 0) async_status = 0;
+    return status;
+}
+
+
+const void *eeprom_mmap(uint32_t address, size_t length)
+{
+    if (address + length > sizeof(image)) return NULL;
+    return image + address;
+}
+
+
+bool eeprom_read(uint32_t address, void *buffer, size_t length)
+{
+    const void *mem = eeprom_mmap(address, length);
+    if (mem == NULL) return false;
+    memcpy(buffer, mem, length);
+    return true;
+}
+
+
+size_t eeprom_get_size(void)
+{
+    return sizeof(image);
+}
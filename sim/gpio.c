@@ -0,0 +1,50 @@
+// GPIO stubs for the simulator. There are no pins; inputs read as high, which
+// is the idle level of the pulled-up pins the firmware watches.
+
+#include "gpio.h"
+
+
+void gpio_init(GPIO_TypeDef *port, uint16_t pin, GPIO_InitTypeDef *init_struct)
+{
+    (void)port;
+    (void)pin;
+    (void)init_struct;
+}
+
+
+void gpio_set_irq(GPIO_TypeDef *port, uint16_t pin, uint32_t prio, gpio_irq_handler_t *irqHandler)
+{
+    (void)port;
+    (void)pin;
+    (void)prio;
+    (void)irqHandler;
+}
+
+
+void gpio_hal_msp_irq_handler(uint16_t pin)
+{
+    (void)pin;
+}
+
+
+void gpio_write(GPIO_TypeDef *port, uint16_t pin, uint32_t value)
+{
+    (void)port;
+    (void)pin;
+    (void)value;
+}
+
+
+uint32_t gpio_read(GPIO_TypeDef *port, uint16_t pin)
+{
+    (void)port;
+    (void)pin;
+    return 1;
+}
+
+
+void GpioWrite(Gpio_t *obj, uint32_t value)
+{
+    (void)obj;
+    (void)value;
+}
@@ -0,0 +1,20 @@
+#include "halt.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include "lpuart.h"
+#include "cmd.h"
+#include "evlog.h"
+
+
+// The hardware sleeps until the reset pin is pulled. The simulator exits, so
+// that a test harness notices.
+__attribute__((noreturn)) void halt(const char *msg)
+{
+    cmd_event(CMD_EVENT_MODULE, CMD_MODULE_HALT);
+    evlog_record(EVLOG_HALT, 0, (uint32_t)(uintptr_t)__builtin_return_address(0));
+    evlog_flush();
+    lpuart_flush();
+
+    fprintf(stderr, "Halted%s%s\n", msg ? ": " : "", msg ? msg : "");
+    exit(EXIT_FAILURE);
+}
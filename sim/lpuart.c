@@ -0,0 +1,260 @@
+// LPUART1 on a host pseudo-terminal. Data written by the firmware goes straight
+// to the terminal, data from the terminal is moved into the RX FIFO from
+// system_idle, which is where the DMA interrupt would deliver it on hardware.
+
+#include "lpuart.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pty.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include "system.h"
+#include "nvm.h"
+
+// The firmware's system configuration is called sysconf, which clashes with
+// the POSIX function declared in unistd.h
+#define sysconf posix_sysconf
+#include <unistd.h>
+#undef sysconf
+
+#ifndef LPUART_BUFFER_SIZE
+#define LPUART_BUFFER_SIZE 512
+#endif
+
+// Passes the terminal to the new process image on sim_reset
+#define PTY_ENV "LORA_SIM_PTY"
+
+
+static unsigned char tx_buffer[LPUART_BUFFER_SIZE];
+static unsigned char rx_buffer[LPUART_BUFFER_SIZE];
+static bool tx_paused;
+static int fd = -1;
+
+volatile cbuf_t lpuart_tx_fifo;
+volatile cbuf_t lpuart_rx_fifo;
+volatile uint32_t lpuart_overruns;
+volatile uint32_t lpuart_rx_dropped;
+uint32_t lpuart_tx_stalls;
+uint32_t lpuart_tx_stall_time;
+
+
+int sim_lpuart_open(const char *link)
+{
+    struct termios tio;
+    char name[64];
+    const char *env;
+    int slave;
+
+    env = getenv(PTY_ENV);
+    if (env != NULL) {
+        fd = atoi(env);
+        return 0;
+    }
+
+    if (openpty(&fd, &slave, name, NULL, NULL) < 0) {
+        perror("openpty");
+        return -1;
+    }
+
+    // The ATCI expects a raw byte stream, no echo or line editing
+    tcgetattr(slave, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(slave, TCSANOW, &tio);
+
+    // The slave stays open so that the master does not report a hangup
+    // between client connections. Both descriptors must survive the exec in
+    // sim_reset.
+    fcntl(fd, F_SETFD, 0);
+    fcntl(slave, F_SETFD, 0);
+
+    if (link != NULL) {
+        unlink(link);
+        if (symlink(name, link) < 0) {
+            perror("symlink");
+            return -1;
+        }
+        fprintf(stderr, "ATCI on %s (%s)\n", link, name);
+    } else {
+        fprintf(stderr, "ATCI on %s\n", name);
+    }
+
+    snprintf(name, sizeof(name), "%d", fd);
+    setenv(PTY_ENV, name, 1);
+    return 0;
+}
+
+
+int sim_lpuart_fd(void)
+{
+    return fd;
+}
+
+
+void sim_lpuart_receive(void)
+{
+    char buf[64];
+    ssize_t n;
+    size_t stored;
+
+    n = read(fd, buf, sizeof(buf));
+    if (n <= 0) return;
+
+    stored = cbuf_put(&lpuart_rx_fifo, buf, n);
+    if (stored != (size_t)n) {
+        lpuart_overruns++;
+        lpuart_rx_dropped += n - stored;
+        fprintf(stderr, "lpuart: Read overrun, %zu bytes discarded\n", n - stored);
+    }
+
+    system_post(SYSTEM_TASK_ATCI);
+}
+
+
+static void transmit(void)
+{
+    cbuf_view_t v;
+    ssize_t n;
+    int i;
+
+    // Notifications are not coalesced (AT$COALESCE) in the simulator. In the
+    // asynchronous mode, data is written out right away.
+    if (tx_paused && !sysconf.async_uart) return;
+
+    cbuf_head(&lpuart_tx_fifo, &v);
+    for (i = 0; i < 2; i++) {
+        while (v.len[i]) {
+            n = write(fd, v.ptr[i], v.len[i]);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                // Nobody is reading the terminal, the data is lost as it
+                // would be on a disconnected UART
+                cbuf_consume(&lpuart_tx_fifo, cbuf_length(&lpuart_tx_fifo));
+                return;
+            }
+            cbuf_consume(&lpuart_tx_fifo, n);
+            v.ptr[i] += n;
+            v.len[i] -= n;
+        }
+    }
+}
+
+
+void lpuart_init(unsigned int baudrate)
+{
+    (void)baudrate;
+    cbuf_init(&lpuart_tx_fifo, tx_buffer, sizeof(tx_buffer));
+    cbuf_init(&lpuart_rx_fifo, rx_buffer, sizeof(rx_buffer));
+    tx_paused = sysconf.async_uart ? false : true;
+}
+
+
+cbuf_view_t *lpuart_tail(cbuf_view_t *tail)
+{
+    return cbuf_tail(&lpuart_tx_fifo, tail);
+}
+
+
+void lpuart_produce(size_t length)
+{
+    cbuf_produce(&lpuart_tx_fifo, length);
+    transmit();
+}
+
+
+size_t lpuart_write(const char *buffer, size_t length)
+{
+    cbuf_view_t v;
+
+    size_t written = cbuf_copy_in(lpuart_tail(&v), buffer, length);
+    lpuart_produce(written);
+    return written;
+}
+
+
+void lpuart_wait_for_space(size_t length)
+{
+    // With transmissions paused, the FIFO only drains on lpuart_resume_tx.
+    // The hardware would sleep forever here, so do not bother waiting.
+    if (cbuf_space(&lpuart_tx_fifo) < length) {
+        lpuart_tx_stalls++;
+        transmit();
+    }
+}
+
+
+void lpuart_write_blocking(const char *buffer, size_t length)
+{
+    size_t written;
+    while (length) {
+        written = lpuart_write(buffer, length);
+        buffer += written;
+        length -= written;
+
+        if (written == 0) {
+            if (tx_paused) return;
+            lpuart_wait_for_space(1);
+        }
+    }
+}
+
+
+size_t lpuart_read(char *buffer, size_t length)
+{
+    cbuf_view_t v;
+
+    cbuf_head(&lpuart_rx_fifo, &v);
+    size_t rv = cbuf_copy_out(buffer, &v, length);
+    lpuart_consume(rv);
+    return rv;
+}
+
+
+void lpuart_consume(size_t length)
+{
+    cbuf_consume(&lpuart_rx_fifo, length);
+}
+
+
+// The simulator wakes the ATCI up on every read from the terminal
+void lpuart_set_rx_threshold(size_t length)
+{
+    (void)length;
+}
+
+
+void lpuart_flush(void)
+{
+    transmit();
+}
+
+
+void lpuart_before_stop(void)
+{
+}
+
+
+void lpuart_after_stop(void)
+{
+}
+
+
+void lpuart_resume_tx(void)
+{
+    tx_paused = false;
+    transmit();
+}
+
+
+void lpuart_pause_tx(void)
+{
+    tx_paused = true;
+}
+
+
+// There is no host wake-up output in the simulator
+void lpuart_set_pending(bool pending)
+{
+    (void)pending;
+}
@@ -0,0 +1,93 @@
+// The main loop of the ATCI simulator. It mirrors src/main.c without the
+// hardware initialization. See sim/Makefile and README.md for usage.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <loramac-node/src/mac/LoRaMac.h>
+#include "cmd.h"
+#include "lrw.h"
+#include "lpuart.h"
+#include "system.h"
+#include "nvm.h"
+#include "store.h"
+#include "evlog.h"
+
+
+static char **args;
+
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-e <eeprom image>] [-l <pty symlink>]\n", name);
+}
+
+
+void sim_reset(void)
+{
+    lpuart_flush();
+    fprintf(stderr, "Reset\n");
+    execv("/proc/self/exe", args);
+    perror("execv");
+    exit(EXIT_FAILURE);
+}
+
+
+int main(int argc, char *argv[])
+{
+    const char *eeprom = "eeprom.bin", *link = NULL;
+    unsigned tasks;
+    int busy, c;
+
+    args = argv;
+    while ((c = getopt(argc, argv, "e:l:h")) != -1) {
+        switch (c) {
+            case 'e': eeprom = optarg; break;
+            case 'l': link = optarg; break;
+            default: usage(argv[0]); return EXIT_FAILURE;
+        }
+    }
+
+    if (sim_eeprom_open(eeprom) < 0) return EXIT_FAILURE;
+    if (sim_lpuart_open(link) < 0) return EXIT_FAILURE;
+
+    system_init();
+
+    nvm_init();
+    store_init();
+    evlog_init();
+    cmd_init(sysconf.uart_baudrate);
+
+    lrw_init();
+    LoRaMacStart();
+    cmd_event(CMD_EVENT_MODULE, CMD_MODULE_BOOT);
+
+    system_post(SYSTEM_TASK_ALL);
+
+    while (1) {
+        tasks = system_take_tasks();
+
+        if (tasks & (SYSTEM_TASK_LORA | SYSTEM_TASK_NVM))
+            lrw_process();
+
+        if (tasks & SYSTEM_TASK_ATCI) {
+            cmd_process();
+            system_post(SYSTEM_TASK_LORA);
+        }
+
+        sysconf_process();
+        evlog_process();
+        cmd_update_data_ready();
+        if (schedule_reset) {
+            sysconf_flush();
+            evlog_flush();
+        }
+
+        busy = system_tasks | system_sleep_lock | (system_stop_lock & ~SYSTEM_MODULE_RADIO) | LoRaMacIsBusy();
+        if (schedule_reset && !busy) {
+            NVIC_SystemReset();
+        } else {
+            system_idle();
+        }
+    }
+}
@@ -0,0 +1,380 @@
+// A radio without a network. Transmissions complete after their time on air
+// and receive windows time out as if no downlink had been sent, so that
+// LoRaMac runs through its state machine, duty cycle, and retransmissions
+// with realistic timing. Nothing is ever received.
+
+#include <stdlib.h>
+#include <loramac-node/src/radio/radio.h>
+#include <LoRaWAN/Utilities/timeServer.h>
+
+
+// The radio statistics reported by AT commands, see src/radio.c
+int16_t radio_rssi;
+int8_t radio_snr;
+uint32_t radio_rx_frequency;
+uint32_t radio_rx_time;
+volatile uint32_t radio_tx_count;
+uint32_t radio_lbt_checks;
+uint32_t radio_lbt_busy;
+int16_t radio_lbt_rssi;
+uint32_t radio_lbt_samples;
+uint32_t radio_lbt_time;
+uint32_t radio_cad_cycles;
+uint32_t radio_cad_detections;
+uint32_t radio_cad_packets;
+
+// The noise floor reported by Rssi and IsChannelFree
+#define NOISE_RSSI -120
+
+static RadioEvents_t *events;
+
+// See radio_set_events in src/radio.c
+static const RadioEvents_t *override;
+static RadioState_t state;
+static TimerEvent_t timer;
+static uint32_t cad_period;
+
+static struct {
+    RadioModems_t modem;
+    uint32_t bandwidth;
+    uint32_t datarate;
+    uint8_t coderate;
+    uint16_t preamble;
+    bool fix_len;
+    bool crc;
+    uint16_t symb_timeout;
+    bool continuous;
+} tx, rx;
+
+
+void radio_cad_rx_set(uint32_t period)
+{
+    cad_period = period;
+}
+
+
+uint32_t radio_cad_rx_get(void)
+{
+    return cad_period;
+}
+
+
+void sx1276_tcxo_prepare(void)
+{
+}
+
+
+// Symbol time in microseconds
+static uint32_t symbol_time(uint32_t bandwidth, uint32_t sf)
+{
+    static const uint32_t khz[] = { 125, 250, 500 };
+    return ((1000UL << sf) / khz[bandwidth > 2 ? 2 : bandwidth]);
+}
+
+
+static uint32_t TimeOnAir(RadioModems_t modem, uint32_t bandwidth, uint32_t datarate,
+    uint8_t coderate, uint16_t preambleLen, bool fixLen, uint8_t payloadLen, bool crcOn)
+{
+    uint32_t ts, payload;
+    int32_t n, de;
+
+    if (modem == MODEM_FSK) {
+        // Preamble, 3 sync word bytes, length byte, payload, and CRC
+        return ((preambleLen + 3 + (fixLen ? 0 : 1) + payloadLen + (crcOn ? 2 : 0)) * 8 * 1000UL
+            + datarate - 1) / datarate;
+    }
+
+    ts = symbol_time(bandwidth, datarate);
+    de = ts > 16000 ? 1 : 0;
+
+    n = 8 * payloadLen - 4 * datarate + 28 + (crcOn ? 16 : 0) - (fixLen ? 20 : 0);
+    if (n < 0) n = 0;
+    payload = 8 + (n + 4 * (datarate - 2 * de) - 1) / (4 * (datarate - 2 * de)) * (coderate + 4);
+
+    // The preamble has 4.25 more symbols than programmed
+    return ((preambleLen * 4 + 17) * ts / 4 + payload * ts + 999) / 1000;
+}
+
+
+void radio_set_events(const RadioEvents_t *e)
+{
+    override = e;
+}
+
+
+static void on_timer(void *ctx)
+{
+    (void)ctx;
+    RadioState_t s = state;
+    const RadioEvents_t *ev = override ? override : events;
+
+    state = RF_IDLE;
+    switch (s) {
+        case RF_TX_RUNNING:
+            radio_tx_count++;
+            if (ev && ev->TxDone) ev->TxDone();
+            break;
+
+        case RF_RX_RUNNING:
+            if (ev && ev->RxTimeout) ev->RxTimeout();
+            break;
+
+        case RF_CAD:
+            if (events && events->CadDone) events->CadDone(false);
+            break;
+
+        default:
+            break;
+    }
+}
+
+
+static void start(RadioState_t s, uint32_t ms)
+{
+    TimerStop(&timer);
+    state = s;
+    TimerSetValue(&timer, ms ? ms : 1);
+    TimerStart(&timer);
+}
+
+
+static void Init(RadioEvents_t *e)
+{
+    events = e;
+    state = RF_IDLE;
+    TimerInit(&timer, on_timer);
+}
+
+
+static RadioState_t GetStatus(void)
+{
+    return state;
+}
+
+
+static void SetModem(RadioModems_t modem)
+{
+    tx.modem = rx.modem = modem;
+}
+
+
+static void SetChannel(uint32_t freq)
+{
+    (void)freq;
+}
+
+
+static bool IsChannelFree(uint32_t freq, uint32_t rxBandwidth, int16_t rssiThresh,
+    uint32_t maxCarrierSenseTime)
+{
+    (void)freq;
+    (void)rxBandwidth;
+    (void)maxCarrierSenseTime;
+    radio_lbt_checks++;
+    radio_lbt_rssi = NOISE_RSSI;
+    return NOISE_RSSI <= rssiThresh;
+}
+
+
+static uint32_t Random(void)
+{
+    return ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+}
+
+
+void radio_scan(uint32_t freq, uint32_t bandwidth, unsigned int samples,
+    int16_t *min, int16_t *avg, int16_t *max)
+{
+    (void)freq;
+    (void)bandwidth;
+    (void)samples;
+    *min = *avg = *max = NOISE_RSSI;
+}
+
+
+static void SetRxConfig(RadioModems_t modem, uint32_t bandwidth, uint32_t datarate,
+    uint8_t coderate, uint32_t bandwidthAfc, uint16_t preambleLen, uint16_t symbTimeout,
+    bool fixLen, uint8_t payloadLen, bool crcOn, bool freqHopOn, uint8_t hopPeriod,
+    bool iqInverted, bool rxContinuous)
+{
+    (void)bandwidthAfc;
+    (void)payloadLen;
+    (void)freqHopOn;
+    (void)hopPeriod;
+    (void)iqInverted;
+
+    rx.modem = modem;
+    rx.bandwidth = bandwidth;
+    rx.datarate = datarate;
+    rx.coderate = coderate;
+    rx.preamble = preambleLen;
+    rx.symb_timeout = symbTimeout;
+    rx.fix_len = fixLen;
+    rx.crc = crcOn;
+    rx.continuous = rxContinuous;
+}
+
+
+static void SetTxConfig(RadioModems_t modem, int8_t power, uint32_t fdev,
+    uint32_t bandwidth, uint32_t datarate, uint8_t coderate, uint16_t preambleLen,
+    bool fixLen, bool crcOn, bool freqHopOn, uint8_t hopPeriod, bool iqInverted,
+    uint32_t timeout)
+{
+    (void)power;
+    (void)fdev;
+    (void)freqHopOn;
+    (void)hopPeriod;
+    (void)iqInverted;
+    (void)timeout;
+
+    tx.modem = modem;
+    tx.bandwidth = bandwidth;
+    tx.datarate = datarate;
+    tx.coderate = coderate;
+    tx.preamble = preambleLen;
+    tx.fix_len = fixLen;
+    tx.crc = crcOn;
+}
+
+
+static bool CheckRfFrequency(uint32_t frequency)
+{
+    (void)frequency;
+    return true;
+}
+
+
+static void Send(uint8_t *buffer, uint8_t size)
+{
+    (void)buffer;
+    start(RF_TX_RUNNING, TimeOnAir(tx.modem, tx.bandwidth, tx.datarate, tx.coderate,
+        tx.preamble, tx.fix_len, size, tx.crc));
+}
+
+
+static void Sleep(void)
+{
+    TimerStop(&timer);
+    state = RF_IDLE;
+}
+
+
+static void Rx(uint32_t timeout)
+{
+    uint32_t ms = timeout;
+
+    // In single reception mode, the SX1276 gives up after symb_timeout
+    // symbols without a preamble
+    if (!rx.continuous && rx.modem == MODEM_LORA)
+        ms = (rx.symb_timeout * symbol_time(rx.bandwidth, rx.datarate) + 999) / 1000;
+
+    if (ms == 0) {
+        TimerStop(&timer);
+        state = RF_RX_RUNNING;
+        return;
+    }
+
+    start(RF_RX_RUNNING, ms);
+}
+
+
+static void StartCad(void)
+{
+    radio_cad_cycles++;
+    start(RF_CAD, 1);
+}
+
+
+static void SetTxContinuousWave(uint32_t freq, int8_t power, uint16_t time)
+{
+    (void)freq;
+    (void)power;
+    start(RF_TX_RUNNING, time * 1000UL);
+}
+
+
+static int16_t Rssi(RadioModems_t modem)
+{
+    (void)modem;
+    return NOISE_RSSI;
+}
+
+
+static void Write(uint32_t addr, uint8_t data)
+{
+    (void)addr;
+    (void)data;
+}
+
+
+static uint8_t Read(uint32_t addr)
+{
+    (void)addr;
+    return 0;
+}
+
+
+static void WriteBuffer(uint32_t addr, uint8_t *buffer, uint8_t size)
+{
+    (void)addr;
+    (void)buffer;
+    (void)size;
+}
+
+
+static void ReadBuffer(uint32_t addr, uint8_t *buffer, uint8_t size)
+{
+    (void)addr;
+    (void)buffer;
+    (void)size;
+}
+
+
+static void SetMaxPayloadLength(RadioModems_t modem, uint8_t max)
+{
+    (void)modem;
+    (void)max;
+}
+
+
+static void SetPublicNetwork(bool enable)
+{
+    (void)enable;
+}
+
+
+static uint32_t GetWakeupTime(void)
+{
+    return 1;
+}
+
+
+const struct Radio_s Radio = {
+    .Init = Init,
+    .GetStatus = GetStatus,
+    .SetModem = SetModem,
+    .SetChannel = SetChannel,
+    .IsChannelFree = IsChannelFree,
+    .Random = Random,
+    .SetRxConfig = SetRxConfig,
+    .SetTxConfig = SetTxConfig,
+    .CheckRfFrequency = CheckRfFrequency,
+    .TimeOnAir = TimeOnAir,
+    .Send = Send,
+    .Sleep = Sleep,
+    .Standby = Sleep,
+    .Rx = Rx,
+    .StartCad = StartCad,
+    .SetTxContinuousWave = SetTxContinuousWave,
+    .Rssi = Rssi,
+    .Write = Write,
+    .Read = Read,
+    .WriteBuffer = WriteBuffer,
+    .ReadBuffer = ReadBuffer,
+    .SetMaxPayloadLength = SetMaxPayloadLength,
+    .SetPublicNetwork = SetPublicNetwork,
+    .GetWakeupTime = GetWakeupTime,
+    .IrqProcess = NULL,
+    .RxBoosted = NULL,
+    .SetRxDutyCycle = NULL
+};
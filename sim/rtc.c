@@ -0,0 +1,243 @@
+// The RTC on the host clock. Ticks run at 1024 Hz like on hardware, see
+// src/rtc.c, and are derived from CLOCK_MONOTONIC. The calendar follows the
+// host's wall clock. The alarm is polled from system_idle.
+
+#include "rtc.h"
+#include <time.h>
+#include <LoRaWAN/Utilities/timeServer.h>
+
+#define N_PREDIV_S 10
+#define PREDIV_S ((1 << N_PREDIV_S) - 1)
+#define MIN_ALARM_DELAY 3
+
+
+static uint32_t context;
+static uint32_t alarm;
+static bool alarm_armed;
+static int32_t calibration;
+static int32_t temperature_calibration;
+static uint32_t backup[2];
+static TimerTime_t now_ms;
+
+
+static uint32_t now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)ts.tv_sec * 1024 + (uint32_t)(((uint64_t)ts.tv_nsec << N_PREDIV_S) / 1000000000);
+}
+
+
+void rtc_init(void)
+{
+    rtc_update_now();
+}
+
+
+uint32_t rtc_ms2tick(TimerTime_t timeMilliSec)
+{
+    return ((uint64_t)timeMilliSec << N_PREDIV_S) / 1000;
+}
+
+
+TimerTime_t rtc_tick2ms(uint32_t tick)
+{
+    uint32_t seconds = tick >> N_PREDIV_S;
+    tick = tick & PREDIV_S;
+    return ((seconds * 1000) + ((tick * 1000) >> N_PREDIV_S));
+}
+
+
+uint32_t rtc_get_min_timeout(void)
+{
+    return MIN_ALARM_DELAY;
+}
+
+
+void rtc_set_alarm(uint32_t timeout)
+{
+    alarm = context + timeout;
+    alarm_armed = true;
+}
+
+
+void rtc_stop_alarm(void)
+{
+    alarm_armed = false;
+}
+
+
+uint32_t rtc_get_timer_elapsed_time(void)
+{
+    return now() - context;
+}
+
+
+uint32_t rtc_get_timer_value(void)
+{
+    return now();
+}
+
+
+uint64_t rtc_get_ticks64(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1024 + (((uint64_t)ts.tv_nsec << N_PREDIV_S) / 1000000000);
+}
+
+
+// The simulator always starts cold
+uint64_t rtc_previous_ticks(void)
+{
+    return 0;
+}
+
+
+uint64_t rtc_ticks64_to_ms(uint64_t ticks)
+{
+    return (ticks >> N_PREDIV_S) * 1000 + rtc_tick2ms((uint32_t)ticks & PREDIV_S);
+}
+
+
+void rtc_update_now(void)
+{
+    now_ms = rtc_tick2ms(now());
+}
+
+
+TimerTime_t rtc_now(void)
+{
+    return now_ms;
+}
+
+
+uint32_t rtc_set_timer_context(void)
+{
+    context = now();
+    return context;
+}
+
+
+uint32_t rtc_get_timer_context(void)
+{
+    return context;
+}
+
+
+void rtc_delay_ms(uint32_t delay)
+{
+    struct timespec ts = {
+        .tv_sec = delay / 1000,
+        .tv_nsec = (delay % 1000) * 1000000L
+    };
+    nanosleep(&ts, NULL);
+}
+
+
+int sim_rtc_timeout(void)
+{
+    int32_t left;
+
+    if (!alarm_armed) return -1;
+
+    left = alarm - now();
+    if (left <= 0) return 0;
+    return rtc_tick2ms(left) + 1;
+}
+
+
+void sim_rtc_process(void)
+{
+    if (!alarm_armed || (int32_t)(alarm - now()) > 0) return;
+
+    alarm_armed = false;
+    TimerIrqHandler();
+}
+
+
+// The host clock needs no wake-up compensation or calibration. The values are
+// kept so that the AT commands that report them behave as on hardware.
+
+void rtc_set_mcu_wake_up_time(void)
+{
+}
+
+
+int16_t rtc_get_mcu_wake_up_time(void)
+{
+    return 0;
+}
+
+
+int32_t rtc_get_mcu_wake_up_error(void)
+{
+    return 0;
+}
+
+
+void rtc_set_calibration(int32_t pulses)
+{
+    if (pulses < RTC_CALIBRATION_MIN) pulses = RTC_CALIBRATION_MIN;
+    if (pulses > RTC_CALIBRATION_MAX) pulses = RTC_CALIBRATION_MAX;
+    calibration = pulses;
+}
+
+
+int32_t rtc_get_calibration(void)
+{
+    return calibration;
+}
+
+
+int32_t rtc_compensate_temperature(float temperature)
+{
+    (void)temperature;
+    temperature_calibration = 0;
+    return temperature_calibration;
+}
+
+
+void rtc_clear_temperature_compensation(void)
+{
+    temperature_calibration = 0;
+}
+
+
+int32_t rtc_get_temperature_compensation(void)
+{
+    return temperature_calibration;
+}
+
+
+TimerTime_t rtc_temperature_compensation(TimerTime_t period, float temperature)
+{
+    (void)temperature;
+    return period;
+}
+
+
+uint32_t rtc_get_calendar_time(uint16_t *subSeconds)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    *subSeconds = ts.tv_nsec / 1000000;
+    return ts.tv_sec;
+}
+
+
+void rtc_read_backup_registers(uint32_t *Data0, uint32_t *Data1)
+{
+    *Data0 = backup[0];
+    *Data1 = backup[1];
+}
+
+
+void rtc_write_backup_registers(uint32_t Data0, uint32_t Data1)
+{
+    backup[0] = Data0;
+    backup[1] = Data1;
+}
@@ -0,0 +1,57 @@
+#ifndef _SIM_H
+#define _SIM_H
+
+// This header is force-included (-include) into every translation unit of the
+// host-side simulator build, see sim/Makefile. It replaces the parts of the
+// firmware headers that can only be compiled for the Cortex-M0+.
+
+#include <stdint.h>
+#include <stm/include/cmsis_compiler.h>
+
+// The simulator is single-threaded. Everything the firmware runs from
+// interrupt handlers (LPUART reception, RTC alarms, background EEPROM writes,
+// radio events) is run synchronously from system_idle, so masking interrupts
+// has nothing to protect. Replace the PRIMASK intrinsics used by irq.h and by
+// the critical sections in LoRaMac-node with no-ops; cmsis_compiler.h has been
+// included above, so its definitions are not affected.
+#define __get_PRIMASK()     0U
+#define __set_PRIMASK(mask) ((void)(mask))
+#define __disable_irq()     ((void)0)
+#define __enable_irq()      ((void)0)
+#undef __NOP
+#define __NOP()             ((void)0)
+
+//! @brief Open the pseudo-terminal that stands in for LPUART1
+//! @param[in] link If not NULL, create a symlink to the terminal at this path
+//! @retval 0 on success, -1 on error
+
+int sim_lpuart_open(const char *link);
+
+//! @brief Return the file descriptor of the pseudo-terminal master
+
+int sim_lpuart_fd(void);
+
+//! @brief Move data received on the pseudo-terminal into the LPUART RX FIFO
+
+void sim_lpuart_receive(void);
+
+//! @brief Load the EEPROM image from the given file, creating it if needed
+//! @retval 0 on success, -1 on error
+
+int sim_eeprom_open(const char *path);
+
+//! @brief Return the number of milliseconds until the next RTC alarm
+//! @retval -1 if no alarm is armed
+
+int sim_rtc_timeout(void);
+
+//! @brief Fire the RTC alarm if it has expired
+
+void sim_rtc_process(void);
+
+//! @brief Restart the simulator process, keeping the EEPROM image and the
+//! pseudo-terminal
+
+void sim_reset(void) __attribute__ ((noreturn));
+
+#endif // _SIM_H
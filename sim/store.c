@@ -0,0 +1,61 @@
+// The flash-backed store, kept in memory only. Messages in the uplink store
+// and other data in the store are thus lost when the simulator restarts.
+
+#include "store.h"
+#include <string.h>
+#include "log.h"
+
+
+static uint8_t image[STORE_SIZE];
+
+
+static bool store_write(uint32_t address, const void *buffer, size_t length)
+{
+    if (address + length > sizeof(image)) return false;
+    memcpy(image + address, buffer, length);
+    return true;
+}
+
+
+// As on hardware, erased flash memory reads as zeroes
+static bool store_erase(uint32_t address, size_t length)
+{
+    if (address + length > sizeof(image)) return false;
+    memset(image + address, 0, length);
+    return true;
+}
+
+
+static const void *store_mmap(uint32_t address, size_t length)
+{
+    if (address + length > sizeof(image)) return NULL;
+    return image + address;
+}
+
+
+static part_block_t store = {
+    .size = sizeof(image),
+    .mmap = store_mmap,
+    .write = store_write,
+    .erase = store_erase
+};
+
+static bool store_ok;
+
+
+void store_init(void)
+{
+    if (part_format_block(&store, STORE_MAX_PARTS) != 0 || part_open_block(&store) != 0) {
+        log_error("store: Could not format the store");
+        return;
+    }
+    store_ok = true;
+}
+
+
+int store_open(part_t *part, const char *label, size_t size)
+{
+    if (!store_ok) return -1;
+    if (part_find(part, &store, label) == 0) return 0;
+    return part_create(part, &store, label, size) == 0 ? 0 : -2;
+}
@@ -0,0 +1,132 @@
+// The system module of the simulator. There are no low-power modes; the main
+// loop blocks in poll on the pseudo-terminal until data arrives or the RTC
+// alarm expires and then runs the work the interrupt handlers would run.
+
+#include "system.h"
+#include <poll.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "rtc.h"
+
+
+volatile unsigned system_stop_lock;
+volatile unsigned system_sleep_lock;
+volatile unsigned system_tasks;
+volatile uint32_t system_stop_generation;
+uint8_t system_reset_flags;
+
+static uint32_t started;
+
+
+void system_init(void)
+{
+    started = rtc_get_timer_value();
+}
+
+
+// The simulator runs on the host stack and has no linker symbols to report
+void system_get_ram(system_ram_t *ram)
+{
+    memset(ram, 0, sizeof(*ram));
+}
+
+
+// A fixed identifier; the DevEUI derived from it can be changed with AT+DEVEUI
+static const uint8_t unique_id[8] = { 0x51, 0x4d, 0x49, 0x53, 0x00, 0x00, 0x00, 0x01 };
+
+uint32_t system_get_random_seed(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_nsec ^ ts.tv_sec ^ getpid();
+}
+
+
+void system_get_unique_id(uint8_t *id)
+{
+    memcpy(id, unique_id, sizeof(unique_id));
+}
+
+
+void system_wait_hsi(void)
+{
+}
+
+
+void system_enable_pll(void)
+{
+}
+
+
+void system_lock(volatile unsigned *lock, unsigned module)
+{
+    *lock |= module;
+}
+
+
+void system_unlock(volatile unsigned *lock, unsigned module)
+{
+    *lock &= ~module;
+}
+
+
+void system_post(unsigned tasks)
+{
+    system_tasks |= tasks;
+}
+
+
+unsigned system_take_tasks(void)
+{
+    unsigned tasks = system_tasks;
+    system_tasks = 0;
+    return tasks;
+}
+
+
+// The simulator is always running, all time is reported as run time
+
+void system_reset_pwrstat(void)
+{
+    started = rtc_get_timer_value();
+}
+
+
+void system_get_pwrstat(system_pwrstat_t *stat)
+{
+    memset(stat, 0, sizeof(*stat));
+    stat->total = rtc_tick2ms(rtc_get_timer_value() - started);
+    stat->run = stat->total;
+}
+
+
+void system_idle(void)
+{
+    struct pollfd pfd = {
+        .fd = sim_lpuart_fd(),
+        .events = POLLIN
+    };
+    int timeout;
+
+    // Pending tasks only get a non-blocking check for new input, like an
+    // interrupt arriving while the main loop is busy
+    timeout = system_tasks ? 0 : sim_rtc_timeout();
+
+    if (poll(&pfd, 1, timeout) > 0 && (pfd.revents & POLLIN))
+        sim_lpuart_receive();
+
+    sim_rtc_process();
+}
+
+
+void system_before_stop(void)
+{
+}
+
+
+void system_after_stop(void)
+{
+}
@@ -1,6 +1,11 @@
 #include "adc.h"
+#include <string.h>
+#include <stdbool.h>
+#include <stm/STM32L0xx_HAL_Driver/Inc/stm32l0xx_ll_adc.h>
 #include <stm/STM32L0xx_HAL_Driver/Inc/stm32l0xx_hal.h>
 #include "log.h"
+#include "rtc.h"
+#include "system.h"
 
 #define VDDA_VREFINT_CAL ((uint32_t)3000)
 
@@ -28,26 +33,136 @@
     (int32_t)(*TEMP110_CAL_ADDR - *TEMP30_CAL_ADDR)) + (30 << 8))
 
 
-static ADC_HandleTypeDef adc = {
-    .Init = {
-        .OversamplingMode = DISABLE,
-
-        .ClockPrescaler = ADC_CLOCK_SYNC_PCLK_DIV4,
-        .LowPowerAutoPowerOff = DISABLE,
-        .LowPowerFrequencyMode = ENABLE,
-        .LowPowerAutoWait = DISABLE,
-
-        .Resolution = ADC_RESOLUTION_12B,
-        .SamplingTime = ADC_SAMPLETIME_160CYCLES_5,
-        .ScanConvMode = ADC_SCAN_DIRECTION_FORWARD,
-        .DataAlign = ADC_DATAALIGN_RIGHT,
-        .ContinuousConvMode = DISABLE,
-        .DiscontinuousConvMode = DISABLE,
-        .ExternalTrigConvEdge = ADC_EXTERNALTRIGCONVEDGE_NONE,
-        .EOCSelection = ADC_EOC_SINGLE_CONV,
-        .DMAContinuousRequests = DISABLE
+// Timeout for the ADC to become ready, finish calibration, or convert (ms)
+#define ADC_TIMEOUT 10
+
+// True if the ADC has been initialized, see generation
+static bool initialized;
+
+// The value of system_stop_generation when the ADC was initialized
+static uint32_t generation;
+
+// The ADC calibration factor depends on temperature (and VDDA). The factors
+// obtained by calibration are saved per temperature band and written back when
+// the ADC is re-initialized after Stop mode, which saves the calibration cycle
+// on most wake-ups. The band is selected by the most recently measured
+// temperature, 25 degC until the first measurement.
+#define CALFACT_BAND_MIN   (-40)  // Lower bound of the first band (degC)
+#define CALFACT_BAND_WIDTH 16     // Band width (degC)
+#define CALFACT_BANDS      8
+#define CALFACT_INVALID    0xff
+
+static uint8_t calfact[CALFACT_BANDS];
+
+static int temperature = 25;
+
+
+static unsigned int calfact_band(int t)
+{
+    t = (t - CALFACT_BAND_MIN) / CALFACT_BAND_WIDTH;
+    if (t < 0) return 0;
+    if (t >= CALFACT_BANDS) return CALFACT_BANDS - 1;
+    return t;
+}
+
+
+// Busy-wait, used for the analog stabilization delays that are too short for
+// a timer
+static void delay_us(uint32_t us)
+{
+    volatile uint32_t n = us * (SystemCoreClock / 1000000U);
+    while (n) n--;
+}
+
+
+// Wait until the bits in mask of the register reg read as value
+static bool wait_for(volatile uint32_t *reg, uint32_t mask, uint32_t value)
+{
+    uint32_t start = rtc_get_timer_value();
+    while ((*reg & mask) != value) {
+        if (rtc_tick2ms(rtc_get_timer_value() - start) > ADC_TIMEOUT) return false;
+    }
+    return true;
+}
+
+
+static bool enable(void)
+{
+    if (LL_ADC_IsEnabled(ADC1)) return true;
+
+    LL_ADC_ClearFlag_ADRDY(ADC1);
+    LL_ADC_Enable(ADC1);
+    delay_us(1);
+    return wait_for(&ADC1->ISR, ADC_ISR_ADRDY, ADC_ISR_ADRDY);
+}
+
+
+static void disable(void)
+{
+    if (!LL_ADC_IsEnabled(ADC1)) return;
+
+    if (LL_ADC_REG_IsConversionOngoing(ADC1)) {
+        LL_ADC_REG_StopConversion(ADC1);
+        wait_for(&ADC1->CR, ADC_CR_ADSTP, 0);
+    }
+    LL_ADC_Disable(ADC1);
+    wait_for(&ADC1->CR, ADC_CR_ADEN, 0);
+}
+
+
+// Return the ADC into its reset state, with the voltage regulator and the
+// internal measurement paths off
+static void deinit(void)
+{
+    disable();
+    LL_ADC_SetCommonPathInternalCh(__LL_ADC_COMMON_INSTANCE(ADC1), LL_ADC_PATH_INTERNAL_NONE);
+    LL_ADC_DisableInternalRegulator(ADC1);
+    initialized = false;
+}
+
+
+// Calibrate the ADC or restore a previously saved calibration factor. The ADC
+// must be initialized and disabled.
+static bool calibrate(void)
+{
+    unsigned int band = calfact_band(temperature);
+
+    if (calfact[band] == CALFACT_INVALID) {
+        LL_ADC_StartCalibration(ADC1);
+        if (!wait_for(&ADC1->CR, ADC_CR_ADCAL, 0)) return false;
+        calfact[band] = LL_ADC_GetCalibrationFactor(ADC1);
+        log_debug("ADC calibrated: band %d factor %d", band, calfact[band]);
+        return true;
     }
-};
+
+    // The calibration factor can only be written while the ADC is enabled
+    if (!enable()) return false;
+    LL_ADC_SetCalibrationFactor(ADC1, calfact[band]);
+    return true;
+}
+
+
+static bool init(void)
+{
+    // Wait for the Vrefint to stabilize if we're waking up from Stop mode
+    __HAL_RCC_PWR_CLK_ENABLE();
+    while (__HAL_PWR_GET_FLAG(PWR_FLAG_VREFINTRDY) == RESET);
+    __HAL_RCC_PWR_CLK_DISABLE();
+
+    disable();
+
+    // PCLK/4 in the low frequency mode, 12-bit right-aligned single
+    // conversions started by software, all channels sampled for 160.5 cycles
+    LL_ADC_SetClock(ADC1, LL_ADC_CLOCK_SYNC_PCLK_DIV4);
+    LL_ADC_SetCommonFrequencyMode(__LL_ADC_COMMON_INSTANCE(ADC1), LL_ADC_CLOCK_FREQ_MODE_LOW);
+    LL_ADC_EnableInternalRegulator(ADC1);
+    WRITE_REG(ADC1->CFGR1, 0);
+    CLEAR_BIT(ADC1->CFGR2, ADC_CFGR2_OVSE);
+    LL_ADC_SetSamplingTimeCommonChannels(ADC1, LL_ADC_SAMPLINGTIME_160CYCLES_5);
+    initialized = true;
+
+    return calibrate();
+}
 
 
 void adc_init(void)
@@ -55,15 +170,15 @@ void adc_init(void)
     // We do not initialize ADC when the system boots up. Instead, the ADC
     // peripheral is initialized on first use, e.g., when the LoRa MAC attempts
     // to measure batter or temperature levels.
+    memset(calfact, CALFACT_INVALID, sizeof(calfact));
 }
 
 
 void adc_deinit(void)
 {
-    if (adc.Instance != NULL) {
+    if (initialized) {
         __HAL_RCC_ADC1_CLK_ENABLE();
-        HAL_ADC_DeInit(&adc);
-        adc.Instance = NULL;
+        deinit();
     }
     __HAL_RCC_ADC1_CLK_DISABLE();
 }
@@ -71,95 +186,72 @@ void adc_deinit(void)
 
 void adc_before_stop(void)
 {
-    // Disable ADC entirely before going to Stop mode
-    if (adc.Instance != NULL) {
+    // Disable ADC entirely before going to Stop mode. Skip this if the ADC has
+    // not been used since the previous Stop.
+    if (initialized && generation == system_stop_generation) {
         __HAL_RCC_ADC1_CLK_ENABLE();
-        HAL_ADC_DeInit(&adc);
-        adc.Instance = NULL;
+        deinit();
+        __HAL_RCC_ADC1_CLK_DISABLE();
     }
 }
 
 
-void adc_after_stop(void)
-{
-    // Do nothing when waking up from Stop mode. We will instead initialize the
-    // ADC on first use.
-}
-
-
 uint16_t adc_get_value(uint32_t channel)
 {
-    HAL_StatusTypeDef rc;
-    ADC_ChannelConfTypeDef cfg = { 0 };
+    uint32_t path, paths;
+    uint16_t v;
 
     __HAL_RCC_ADC1_CLK_ENABLE();
 
-    if (adc.Instance == NULL) {
+    if (!initialized || generation != system_stop_generation) {
         // This branch will execute if ADC has not been initialized yet. This
         // happens the first time ADC is used after boot or the first time the
         // ADC is used after waking up from the Stop mode.
-
-        // Wait for the Vrefint to stabilize if we're waking up from Stop mode
-        __HAL_RCC_PWR_CLK_ENABLE();
-        while (__HAL_PWR_GET_FLAG(PWR_FLAG_VREFINTRDY) == RESET);
-        __HAL_RCC_PWR_CLK_DISABLE();
-
-        adc.Instance = ADC1;
-        rc = HAL_ADC_Init(&adc);
-        if (rc != HAL_OK) {
-            log_error("Error while initializing ADC: %d", rc);
-            goto error;
-        }
-
-        rc = HAL_ADCEx_Calibration_Start(&adc, ADC_SINGLE_ENDED);
-        if (rc != HAL_OK) {
-            log_error("Error while calibrating ADC: %d", rc);
+        generation = system_stop_generation;
+        if (!init()) {
+            log_error("Error while initializing ADC");
             goto error;
         }
     }
 
-    // Deselect all channels
-    cfg.Channel = ADC_CHANNEL_MASK;
-    cfg.Rank = ADC_RANK_NONE;
-    rc = HAL_ADC_ConfigChannel(&adc, &cfg);
-    if (rc != HAL_OK) {
-        log_error("Error in HAL_ADC_ConfigChannel: %d", rc);
-        goto error;
-    }
+    // Select the channel and enable only the internal measurement path it
+    // needs. The temperature sensor needs some time to stabilize.
+    channel &= ADC_CHANNEL_MASK;
+    path = LL_ADC_PATH_INTERNAL_NONE;
+    if (channel == (ADC_CHANNEL_VREFINT & ADC_CHANNEL_MASK))
+        path = LL_ADC_PATH_INTERNAL_VREFINT;
+    else if (channel == (ADC_CHANNEL_TEMPSENSOR & ADC_CHANNEL_MASK))
+        path = LL_ADC_PATH_INTERNAL_TEMPSENSOR;
 
-    // Configure ADC channel
-    cfg.Channel = channel;
-    cfg.Rank = ADC_RANK_CHANNEL_NUMBER;
-    rc = HAL_ADC_ConfigChannel(&adc, &cfg);
-    if (rc != HAL_OK) {
-        log_error("Error in HAL_ADC_ConfigChannel: %d", rc);
-        goto error;
-    }
+    paths = LL_ADC_GetCommonPathInternalCh(__LL_ADC_COMMON_INSTANCE(ADC1));
+    LL_ADC_SetCommonPathInternalCh(__LL_ADC_COMMON_INSTANCE(ADC1), path);
+    if (path == LL_ADC_PATH_INTERNAL_TEMPSENSOR && !(paths & path))
+        delay_us(LL_ADC_DELAY_TEMPSENSOR_STAB_US);
 
-    rc = HAL_ADC_Start(&adc);
-    if (rc != HAL_OK) {
-        log_error("Error in HAL_ADC_Start: %d", rc);
+    WRITE_REG(ADC1->CHSELR, channel);
+
+    if (!enable()) {
+        log_error("Error while enabling ADC");
         goto error;
     }
 
-    rc = HAL_ADC_PollForConversion(&adc, HAL_MAX_DELAY);
-    if (rc != HAL_OK) {
-        log_error("Error in HAL_ADC_PollForConversion: %d", rc);
-        goto error2;
+    LL_ADC_ClearFlag_EOC(ADC1);
+    LL_ADC_ClearFlag_EOS(ADC1);
+    LL_ADC_ClearFlag_OVR(ADC1);
+    LL_ADC_REG_StartConversion(ADC1);
+
+    if (!wait_for(&ADC1->ISR, ADC_ISR_EOC, ADC_ISR_EOC)) {
+        log_error("ADC conversion timed out");
+        goto error;
     }
 
-    uint16_t v = HAL_ADC_GetValue(&adc);
-    HAL_ADC_Stop(&adc);
+    v = LL_ADC_REG_ReadConversionData12(ADC1);
+    disable();
     __HAL_RCC_ADC1_CLK_DISABLE();
     return v;
 
-error2:
-    HAL_ADC_Stop(&adc);
 error:
-    if (adc.Instance != NULL) {
-        HAL_ADC_DeInit(&adc);
-        adc.Instance = NULL;
-    }
+    deinit();
     __HAL_RCC_ADC1_CLK_DISABLE();
     return 0;
 }
@@ -177,7 +269,11 @@ uint16_t adc_get_temperature_level(void)
 {
     uint32_t v = adc_get_battery_level();
     uint16_t t = adc_get_value(ADC_CHANNEL_TEMPSENSOR);
-    return COMPUTE_TEMPERATURE(t, v);
+    int16_t c = COMPUTE_TEMPERATURE(t, v);
+
+    // Select the calibration factor for the next initialization of the ADC
+    if (v != 0 && t != 0) temperature = c / 256;
+    return c;
 }
 
 
@@ -187,6 +283,6 @@ float adc_get_temperature_celsius(void)
     uint16_t i = t >> 8;
     uint16_t f = ((t - (i << 8)) * 100) >> 8;
     float v = (float)i + (float)f / 100.f;
-    log_debug("adc_get_temperature_celsius: %f", v);
+    log_debug("adc_get_temperature_celsius: %d.%02d", i, f);
     return v;
 }
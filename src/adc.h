@@ -9,8 +9,6 @@ void adc_init(void);
 
 void adc_before_stop(void);
 
-void adc_after_stop(void);
-
 //! @brief DeInitializes the ADC
 
 void adc_deinit(void);
@@ -0,0 +1,203 @@
+#include "agg.h"
+#include <string.h>
+#include <LoRaWAN/Utilities/timeServer.h>
+#include "lrw.h"
+#include "rtc.h"
+#include "system.h"
+#include "log.h"
+
+
+// The interval between attempts to send readings while the MAC rejects
+// uplinks for a reason other than the duty cycle, e.g., before join (ms)
+#define RETRY_INTERVAL 30000
+
+#define MAX_TIMEOUT 3600000
+
+#define AGG_TIMER_SLACK 500
+
+static agg_config_t config = {
+    .port = 0,
+    .confirmed = false,
+    .timeout = 60000
+};
+
+// Buffered readings, each prefixed with its length in one byte. The buffer is
+// sent as is, up to the largest whole reading that fits into the payload.
+static struct {
+    uint8_t data[AGG_BUFFER_SIZE];
+    uint16_t length;
+    uint8_t count;
+    bool flushed;
+    volatile bool due;
+} buffer;
+
+static agg_stats_t stats;
+static TimerEvent_t timer;
+
+
+static void on_timer(void *ctx)
+{
+    (void)ctx;
+    buffer.due = true;
+    system_post(SYSTEM_TASK_LORA);
+}
+
+
+static void start_timer(uint32_t timeout)
+{
+    TimerStop(&timer);
+    TimerSetValue(&timer, timeout);
+    TimerStart(&timer);
+}
+
+
+static size_t max_payload(void)
+{
+    return lrw_get_msize();
+}
+
+
+// Remove the first count readings occupying length bytes from the buffer
+static void consume(unsigned int count, size_t length)
+{
+    memmove(buffer.data, buffer.data + length, buffer.length - length);
+    buffer.length -= length;
+    buffer.count -= count;
+    buffer.flushed = false;
+
+    if (buffer.count == 0) {
+        buffer.due = false;
+        TimerStop(&timer);
+    }
+}
+
+
+void agg_init(void)
+{
+    TimerInit(&timer, on_timer);
+    TimerSetSlack(&timer, AGG_TIMER_SLACK);
+}
+
+
+void agg_get_config(agg_config_t *dst)
+{
+    *dst = config;
+}
+
+
+int agg_set_config(const agg_config_t *src)
+{
+    if (src->port > 223) return LORAMAC_STATUS_PARAMETER_INVALID;
+    if (src->timeout > MAX_TIMEOUT) return LORAMAC_STATUS_PARAMETER_INVALID;
+
+    // Readings buffered for the previous port must be flushed first
+    if (buffer.count) return LORAMAC_STATUS_BUSY;
+
+    config = *src;
+    return LORAMAC_STATUS_OK;
+}
+
+
+int agg_add(const void *data, size_t length)
+{
+    if (config.port == 0) return LORAMAC_STATUS_PARAMETER_INVALID;
+    if (length == 0 || length > AGG_BUFFER_SIZE - 1) return LORAMAC_STATUS_LENGTH_ERROR;
+    if (buffer.length + 1 + length > AGG_BUFFER_SIZE) return LORAMAC_STATUS_BUSY;
+
+    buffer.data[buffer.length] = length;
+    memcpy(buffer.data + buffer.length + 1, data, length);
+    buffer.length += 1 + length;
+
+    // The timeout runs from the oldest reading in the buffer
+    if (buffer.count++ == 0) {
+        if (config.timeout) start_timer(config.timeout);
+        else buffer.due = true;
+    }
+
+    // Send as soon as the buffer holds more than one uplink can carry, i.e.,
+    // once the next reading would not fit
+    if (buffer.length >= max_payload()) buffer.due = true;
+
+    if (buffer.due) system_post(SYSTEM_TASK_LORA);
+    return LORAMAC_STATUS_OK;
+}
+
+
+void agg_flush(void)
+{
+    if (buffer.count == 0) return;
+    buffer.due = true;
+    system_post(SYSTEM_TASK_LORA);
+}
+
+
+void agg_get_stats(agg_stats_t *dst)
+{
+    *dst = stats;
+    dst->pending = buffer.count;
+    dst->bytes = buffer.length;
+}
+
+
+void agg_process(void)
+{
+    TimerTime_t now;
+    size_t max, n = 0;
+    unsigned int k = 0;
+    int rc;
+
+    if (!buffer.due || buffer.count == 0) return;
+
+    // Invoked again from lrw_process once the MAC completes the current uplink
+    if (LoRaMacIsBusy()) return;
+
+    now = rtc_now();
+    if (lrw_dutycycle_deadline > now) {
+        start_timer(lrw_dutycycle_deadline - now);
+        return;
+    }
+
+    max = max_payload();
+    while (k < buffer.count && n + 1 + buffer.data[n] <= max) {
+        n += 1 + buffer.data[n];
+        k++;
+    }
+
+    // If the first reading does not fit, lrw_send fails with a length error
+    // and flushes pending MAC commands with an empty frame
+    if (k == 0) {
+        n = 1 + buffer.data[0];
+        k = 1;
+    }
+
+    rc = lrw_send(config.port, buffer.data, n, config.confirmed, NULL);
+    switch (rc) {
+        case LORAMAC_STATUS_OK:
+            log_debug("agg: Sent %d readings (%d bytes)", k, (int)n);
+            stats.frames++;
+            stats.readings += k;
+            consume(k, n);
+            break;
+
+        case LORAMAC_STATUS_BUSY:
+        case LORAMAC_STATUS_DUTYCYCLE_RESTRICTED:
+            start_timer(lrw_dutycycle_deadline > now ? lrw_dutycycle_deadline - now : 1000);
+            break;
+
+        case LORAMAC_STATUS_LENGTH_ERROR:
+            // Try once more after the flush. If the first reading still does
+            // not fit, it is too long for the current data rate.
+            if (!buffer.flushed) {
+                buffer.flushed = true;
+                break;
+            }
+            log_debug("agg: Dropping reading of %d bytes", (int)n - 1);
+            stats.dropped++;
+            consume(1, 1 + buffer.data[0]);
+            break;
+
+        default:
+            start_timer(RETRY_INTERVAL);
+            break;
+    }
+}
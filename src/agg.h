@@ -0,0 +1,78 @@
+#ifndef _AGG_H
+#define _AGG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+//! @brief The number of bytes of readings buffered until they have been sent
+#ifndef AGG_BUFFER_SIZE
+#define AGG_BUFFER_SIZE 242
+#endif
+
+//! @brief Uplink aggregation parameters
+typedef struct
+{
+    uint8_t port;        // LoRaWAN port of aggregated uplinks, 0 if disabled
+    bool confirmed;      // Send aggregated uplinks as confirmed
+    uint32_t timeout;    // Maximum time a reading waits for an uplink in ms
+} agg_config_t;
+
+//! @brief Aggregation state and statistics since boot
+typedef struct
+{
+    uint32_t pending;    // Readings waiting in the buffer
+    uint32_t bytes;      // Bytes used in the buffer, including length prefixes
+    uint32_t readings;   // Readings sent
+    uint32_t frames;     // Uplinks sent
+    uint32_t dropped;    // Readings dropped because they could not be sent
+} agg_stats_t;
+
+/*! @brief Uplink aggregation
+ *
+ * Hosts that send small readings frequently can submit them with AT$AGGTX
+ * instead of AT+UTX. The readings are buffered on the modem and packed into a
+ * single uplink, each prefixed with its length in one byte. The uplink is sent
+ * with lrw_send once the buffered readings fill the largest payload permitted
+ * by the current data rate, or once the oldest reading has waited for the
+ * configured timeout, whichever comes first.
+ *
+ * The payload size is re-evaluated whenever an uplink is built, so a data rate
+ * change in the meantime only results in fewer readings per uplink. Readings
+ * that do not fit into the buffer are rejected with LORAMAC_STATUS_BUSY.
+ */
+
+//! @brief Initialize uplink aggregation. Invoked from lrw_init.
+
+void agg_init(void);
+
+//! @brief Get the aggregation parameters
+//! @param[out] config Destination
+
+void agg_get_config(agg_config_t *config);
+
+//! @brief Set the aggregation parameters. Readings buffered under the previous
+//! parameters are sent right away.
+//! @return Zero on success, a @c LoRaMacStatus_t value on error
+
+int agg_set_config(const agg_config_t *config);
+
+//! @brief Buffer a reading
+//! @return Zero on success, a @c LoRaMacStatus_t value on error
+
+int agg_add(const void *buffer, size_t length);
+
+//! @brief Send all buffered readings without waiting for the timeout
+
+void agg_flush(void);
+
+//! @brief Get the aggregation state and statistics
+//! @param[out] stats Destination
+
+void agg_get_stats(agg_stats_t *stats);
+
+//! @brief Send buffered readings that are due. Invoked from lrw_process.
+
+void agg_process(void);
+
+#endif // _AGG_H
@@ -1,14 +1,38 @@
+#define LOG_MODULE_THRESHOLD LOG_THRESHOLD_ATCI
 #include "atci.h"
 #include <string.h>
+#include <stdlib.h>
 #include <stdarg.h>
 #include <ctype.h>
-#include <stdio.h>
 #include "lpuart.h"
 #include "log.h"
 #include "halt.h"
 #include "system.h"
 #include "irq.h"
 #include "nvm.h"
+#if ATCI_PROF == 1
+#include <stm/STM32L0xx_HAL_Driver/Inc/stm32l0xx_hal.h>
+#include "rtc.h"
+#endif
+
+// The size of the buffer for AT command lines and payload data. This limits the
+// maximum length of a command line and of payload read with
+// atci_set_read_next_data.
+#ifndef ATCI_RX_BUFFER_SIZE
+#define ATCI_RX_BUFFER_SIZE 256
+#endif
+
+// The size of the buffer for output produced while the main context yields to
+// the MAC, see atci_defer_begin. The MAC only produces short notifications.
+#ifndef ATCI_DEFER_BUFFER_SIZE
+#define ATCI_DEFER_BUFFER_SIZE 128
+#endif
+
+// Special characters used by the SLIP encoding of frames in the framed mode
+#define SLIP_END     0xc0
+#define SLIP_ESC     0xdb
+#define SLIP_ESC_END 0xdc
+#define SLIP_ESC_ESC 0xdd
 
 enum parser_state
 {
@@ -22,14 +46,14 @@ static struct
 {
     const atci_command_t *commands;
     size_t commands_length;
-    char rx_buffer[256];
+    uint8_t index[ATCI_MAX_COMMANDS];
+    char rx_buffer[ATCI_RX_BUFFER_SIZE];
     size_t rx_length;
     bool rx_error;
+    bool rx_half;   // The high nibble of a hex payload byte has been received
     bool aborted;
     enum parser_state parser_state;
 
-    char tmp[256];
-
     struct
     {
         size_t length;
@@ -37,24 +61,481 @@ static struct
         void (*callback)(atci_data_status_t status, atci_param_t *param);
     } read_next_data;
 
+    // A stream started with atci_set_read_stream is read as a series of
+    // read_next_data chunks. Data beyond the window granted by the consumer
+    // is left in the LPUART RX FIFO.
+    struct
+    {
+        size_t remaining;   // Bytes of the stream not received yet
+        size_t window;      // Bytes granted with atci_stream_grant, not received yet
+        size_t chunk;
+        atci_encoding_t encoding;
+    } stream;
+
+    struct
+    {
+        bool enabled;
+        bool next;
+        bool escape;
+        unsigned int depth;
+        uint16_t crc;
+    } frame;
+
+    // Output held back while the output it would interrupt waits for room in
+    // the TX FIFO. The frame state of the interrupted output is kept aside.
+    struct
+    {
+        bool active;
+        bool flushing;
+        unsigned int depth;
+        uint16_t crc;
+        size_t length;
+        unsigned int dropped;
+        char buf[ATCI_DEFER_BUFFER_SIZE];
+    } defer;
+
+    // The beginning of the response of a command run with atci_execute, which
+    // is not sent to the host
+    struct
+    {
+        bool active;
+        size_t length;
+        char buf[16];
+    } capture;
+
+    // The sequence tag of the command line being processed, e.g., "#12", and
+    // whether it still has to be inserted into the command's response
+    struct
+    {
+        bool pending;
+        size_t length;
+        char txt[ATCI_TAG_MAX_LENGTH + 2];
+    } tag;
+
 } state;
 
 
+#if ATCI_PROF == 1
+
+// The execution profile of each command in the table, see atci_prof_read
+typedef struct {
+    uint32_t count;
+    uint32_t total;  // us
+    uint32_t max;    // us
+    uint32_t bytes;
+} prof_t;
+
+static prof_t prof[ATCI_MAX_COMMANDS];
+
+// Bytes written to the LPUART TX queue
+static uint32_t tx_bytes;
+
+#define count_tx(n) (tx_bytes += (n))
+
+#else
+
+#define count_tx(n) ((void)0)
+
+#endif
+
+
+// CRC-16/CCITT (polynomial 0x1021), initialized to 0xffff by the caller
+static uint16_t crc16(uint16_t crc, const uint8_t *data, size_t length)
+{
+    while (length--) {
+        crc ^= (uint16_t)*data++ << 8;
+        for (int i = 0; i < 8; i++)
+            crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+}
+
+
+// Write output that has been encoded for the current transport mode. Between
+// atci_defer_begin and atci_defer_end, the output is appended to the deferral
+// buffer instead.
+static void emit(const void *buffer, size_t length)
+{
+    size_t n;
+
+    if (state.capture.active) return;
+
+    if (!state.defer.active) {
+        lpuart_write_blocking(buffer, length);
+        count_tx(length);
+        return;
+    }
+
+    n = sizeof(state.defer.buf) - state.defer.length;
+    if (n > length) n = length;
+    memcpy(state.defer.buf + state.defer.length, buffer, n);
+    state.defer.length += n;
+    state.defer.dropped += length - n;
+}
+
+
+// True if output can be encoded directly into the free space of the LPUART TX
+// queue, i.e., in the text mode outside of atci_defer_begin and atci_execute,
+// and once the sequence tag, if any, has been inserted into the response
+#define direct_output() (!state.frame.enabled && !state.defer.active \
+    && !state.capture.active && !state.tag.pending)
+
+
+static void write_escaped(const uint8_t *data, size_t length)
+{
+    char buf[32];
+    size_t n = 0;
+
+    for (size_t i = 0; i < length; i++) {
+        if (n > sizeof(buf) - 2) {
+            emit(buf, n);
+            n = 0;
+        }
+
+        switch(data[i]) {
+            case SLIP_END:
+                buf[n++] = SLIP_ESC;
+                buf[n++] = SLIP_ESC_END;
+                break;
+
+            case SLIP_ESC:
+                buf[n++] = SLIP_ESC;
+                buf[n++] = SLIP_ESC_ESC;
+                break;
+
+            default:
+                buf[n++] = data[i];
+                break;
+        }
+    }
+
+    if (n) emit(buf, n);
+}
+
+
+// Transmissions are paused between commands in the polling mode and with
+// notification coalescing (AT$COALESCE) in the asynchronous mode
+#define hold_tx() (!sysconf.async_uart || system_coalesce_window())
+
+
+// Switch to the transport mode requested via atci_set_framed, once there are no
+// open frames. Output deferred with atci_defer_begin was encoded for the
+// current mode, thus the mode does not change while it is being produced.
+static void apply_mode(void)
+{
+    if (state.frame.depth == 0 && !state.defer.active && state.frame.enabled != state.frame.next) {
+        log_debug("ATCI: Switching to %s mode", state.frame.next ? "framed" : "text");
+        state.frame.enabled = state.frame.next;
+        state.frame.escape = false;
+    }
+}
+
+
+void atci_frame_open(uint8_t id)
+{
+    if (!state.frame.enabled) return;
+    if (state.frame.depth++ != 0) return;
+
+    const char end = SLIP_END;
+    emit(&end, 1);
+    state.frame.crc = crc16(0xffff, &id, 1);
+    write_escaped(&id, 1);
+}
+
+
+void atci_frame_close(void)
+{
+    if (state.frame.depth == 0) return;
+    if (--state.frame.depth != 0) return;
+
+    uint8_t crc[2] = { state.frame.crc & 0xff, state.frame.crc >> 8 };
+    write_escaped(crc, sizeof(crc));
+
+    const char end = SLIP_END;
+    emit(&end, 1);
+    apply_mode();
+}
+
+
+// Return the length of the +OK or +ERR at the beginning of the buffer, or zero
+static size_t response_prefix(const char *buffer, size_t length)
+{
+    if (length >= 3 && memcmp(buffer, "+OK", 3) == 0) return 3;
+    if (length >= 4 && memcmp(buffer, "+ERR", 4) == 0) return 4;
+    return 0;
+}
+
+
+// All output of the AT command interface must go through this function. In the
+// framed mode, the data is appended to the currently open frame. Data written
+// outside of an open frame is sent in a frame of its own with id 0.
+static void output(const void *buffer, size_t length)
+{
+    size_t n;
+
+    // Responses start with +OK or +ERR at the beginning of a write. Anything
+    // else written before them, such as the lines of AT+CLAC or asynchronous
+    // events, passes through untagged.
+    if (state.tag.pending && (n = response_prefix(buffer, length)) != 0) {
+        state.tag.pending = false;
+        output(buffer, n);
+        output(state.tag.txt, state.tag.length);
+        buffer = (const char *)buffer + n;
+        length -= n;
+    }
+
+    if (state.capture.active) {
+        n = sizeof(state.capture.buf) - 1 - state.capture.length;
+        if (n > length) n = length;
+        memcpy(state.capture.buf + state.capture.length, buffer, n);
+        state.capture.length += n;
+        return;
+    }
+
+    if (!state.frame.enabled) {
+        emit(buffer, length);
+        return;
+    }
+
+    bool single = state.frame.depth == 0;
+    if (single) atci_frame_open(0);
+
+    state.frame.crc = crc16(state.frame.crc, buffer, length);
+    write_escaped(buffer, length);
+
+    if (single) atci_frame_close();
+}
+
+
+void atci_set_framed(bool enabled)
+{
+    // The new mode is applied by process_command once the response has been
+    // sent.
+    state.frame.next = enabled;
+}
+
+
+bool atci_is_framed(void)
+{
+    return state.frame.enabled;
+}
+
+
+// Build an index of the command table sorted by command name so that
+// process_command can find commands with a binary search. We keep a separate
+// index rather than requiring the table to be sorted, since the order of the
+// table determines the output of AT+CLAC and AT$HELP. The table is small and
+// this runs only once, so a simple insertion sort is sufficient.
+static void build_index(void)
+{
+    size_t i, j;
+    uint8_t v;
+
+    for (i = 0; i < state.commands_length; i++) {
+        v = i;
+        for (j = i; j > 0; j--) {
+            if (strcmp(state.commands[state.index[j - 1]].command, state.commands[v].command) <= 0)
+                break;
+            state.index[j] = state.index[j - 1];
+        }
+        state.index[j] = v;
+    }
+}
+
+
 void atci_init(unsigned int baudrate, const atci_command_t *commands, int length)
 {
     memset(&state, 0, sizeof(state));
 
+    if (length > ATCI_MAX_COMMANDS)
+        halt("Too many ATCI commands");
+
     lpuart_init(baudrate);
 
     state.commands = commands;
     state.commands_length = length;
+    build_index();
+
+#if ATCI_PROF == 1
+    // The Cortex-M0+ has no DWT cycle counter. Run SysTick as a free-running
+    // 24-bit down counter clocked from HCLK, as in trace_irq_init.
+    SysTick->LOAD = SysTick_LOAD_RELOAD_Msk;
+    SysTick->VAL = 0;
+    SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_ENABLE_Msk;
+#endif
 }
 
 
 size_t atci_print(const char *message)
 {
     size_t len = strlen(message);
-    lpuart_write_blocking(message, len);
+    output(message, len);
+    return len;
+}
+
+
+// The destination of formatted output. In the text mode, characters are
+// written directly into the free space at the tail of the LPUART TX queue and
+// committed in one step when the view fills up or the output ends. In the
+// framed mode, the output needs to be included in the frame's CRC, thus it is
+// collected in small chunks and passed to output. The same applies to deferred
+// output.
+// The mode is chosen once, since inserting the sequence tag into the output
+// changes what direct_output returns.
+typedef struct sink {
+    bool direct;
+    cbuf_view_t view;
+    size_t n;
+    char buf[32];
+} sink_t;
+
+
+static void sink_init(sink_t *sink)
+{
+    sink->n = 0;
+    sink->direct = direct_output();
+    if (sink->direct) lpuart_tail(&sink->view);
+}
+
+
+static void sink_flush(sink_t *sink)
+{
+    if (!sink->direct) output(sink->buf, sink->n);
+    else if (sink->n) {
+        lpuart_produce(sink->n);
+        count_tx(sink->n);
+    }
+    sink->n = 0;
+}
+
+
+static void sink_put(sink_t *sink, char c)
+{
+    if (!sink->direct) {
+        if (sink->n == sizeof(sink->buf)) sink_flush(sink);
+        sink->buf[sink->n++] = c;
+        return;
+    }
+
+    // If the TX queue is full, commit what we have and wait for the DMA
+    // transfer to make some room.
+    while (sink->n == sink->view.len[0] + sink->view.len[1]) {
+        sink_flush(sink);
+        lpuart_wait_for_space(1);
+        lpuart_tail(&sink->view);
+    }
+
+    if (sink->n < sink->view.len[0]) sink->view.ptr[0][sink->n] = c;
+    else sink->view.ptr[1][sink->n - sink->view.len[0]] = c;
+    sink->n++;
+}
+
+
+// A minimal replacement for vsnprintf used by atci_printf. It supports the
+// conversions d, i, u, x, X, c, s and %%, the flags 0 and -, a field width and
+// the l length modifier (a no-op on this 32-bit platform). Floating point
+// conversions are deliberately not supported so that newlib's printf core,
+// including its float support, does not get linked in. The output is streamed
+// into sink, thus there is no limit on its length. Returns the number of
+// characters written.
+static size_t vformat(sink_t *sink, const char *fmt, va_list ap)
+{
+    static const char digits[] = "0123456789abcdef0123456789ABCDEF";
+    char num[11], *str;
+    size_t len = 0, n, total;
+    unsigned width, base;
+    uint32_t v;
+    bool left, neg;
+    char pad, c;
+
+    while ((c = *fmt++) != '\0') {
+        if (c != '%') {
+            sink_put(sink, c);
+            len++;
+            continue;
+        }
+
+        left = false;
+        pad = ' ';
+        for (;; fmt++) {
+            if (*fmt == '-') left = true;
+            else if (*fmt == '0') pad = '0';
+            else break;
+        }
+
+        width = 0;
+        while (*fmt >= '0' && *fmt <= '9')
+            width = width * 10 + (*fmt++ - '0');
+
+        while (*fmt == 'l') fmt++;
+
+        neg = false;
+        switch (c = *fmt++) {
+            case 'd':
+            case 'i':
+            case 'u':
+            case 'x':
+            case 'X':
+                v = va_arg(ap, uint32_t);
+                if ((c == 'd' || c == 'i') && (int32_t)v < 0) {
+                    neg = true;
+                    v = -v;
+                }
+
+                base = (c == 'x' || c == 'X') ? 16 : 10;
+                str = num + sizeof(num);
+                n = 0;
+                do {
+                    *--str = digits[(c == 'X' ? 16 : 0) + v % base];
+                    v /= base;
+                    n++;
+                } while (v);
+                break;
+
+            case 'c':
+                num[0] = va_arg(ap, int);
+                str = num;
+                n = 1;
+                break;
+
+            case 's':
+                str = va_arg(ap, char *);
+                n = strlen(str);
+                break;
+
+            case '\0':
+                fmt--;
+                // fall through
+            default:
+                // Emit %% and unsupported conversions verbatim
+                num[0] = c == '\0' ? '%' : c;
+                str = num;
+                n = 1;
+                width = 0;
+                break;
+        }
+
+        // The sign counts towards the field width. It goes before zero
+        // padding but after space padding.
+        total = n + neg;
+        len += width > total ? width : total;
+
+        if (neg && pad == '0') sink_put(sink, '-');
+
+        if (!left) {
+            for (; width > total; width--)
+                sink_put(sink, pad);
+        }
+
+        if (neg && pad != '0') sink_put(sink, '-');
+
+        for (size_t i = 0; i < n; i++)
+            sink_put(sink, str[i]);
+
+        for (; width > total; width--)
+            sink_put(sink, ' ');
+    }
+
     return len;
 }
 
@@ -63,59 +544,198 @@ size_t atci_printf(const char *format, ...)
 {
     va_list ap;
     size_t length;
+    sink_t sink;
+
+    sink_init(&sink);
     va_start(ap, format);
-    length = vsnprintf(state.tmp, sizeof(state.tmp), format, ap);
+    length = vformat(&sink, format, ap);
     va_end(ap);
+    sink_flush(&sink);
 
-    if (length > sizeof(state.tmp))
-        length = sizeof(state.tmp);
-
-    lpuart_write_blocking(state.tmp, length);
     return length;
 }
 
 
-size_t atci_print_buffer_as_hex(const void *buffer, size_t length)
+static const char hex_digits[16] = "0123456789ABCDEF";
+
+// The values of hexadecimal digits indexed by character - '0'. Characters that
+// are not hexadecimal digits map to 0xff.
+static const uint8_t hex_values['f' - '0' + 1] = {
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    10, 11, 12, 13, 14, 15,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    10, 11, 12, 13, 14, 15
+};
+
+
+static inline unsigned hex_value(char c)
 {
-    char byte;
-    size_t on_write = 0;
+    unsigned i = (unsigned char)c - '0';
+    return i < sizeof(hex_values) ? hex_values[i] : 0xff;
+}
 
-    for (size_t i = 0; i < length; i++) {
-        byte = ((char *)buffer)[i];
 
-        char upper = (byte >> 4) & 0xf;
-        char lower = byte & 0x0f;
+// Encode length bytes from src into 2 * length hexadecimal characters in dst.
+// The main loop converts four bytes per iteration. The Cortex-M0+ core does
+// not support unaligned memory access, so the output is written byte by byte.
+static void hex_encode(char *dst, const uint8_t *src, size_t length)
+{
+    for (; length >= 4; length -= 4, src += 4, dst += 8) {
+        dst[0] = hex_digits[src[0] >> 4];
+        dst[1] = hex_digits[src[0] & 0xf];
+        dst[2] = hex_digits[src[1] >> 4];
+        dst[3] = hex_digits[src[1] & 0xf];
+        dst[4] = hex_digits[src[2] >> 4];
+        dst[5] = hex_digits[src[2] & 0xf];
+        dst[6] = hex_digits[src[3] >> 4];
+        dst[7] = hex_digits[src[3] & 0xf];
+    }
 
-        state.tmp[on_write++] = upper < 10 ? upper + '0' : upper - 10 + 'A';
-        state.tmp[on_write++] = lower < 10 ? lower + '0' : lower - 10 + 'A';
+    for (; length; length--, src++) {
+        *dst++ = hex_digits[*src >> 4];
+        *dst++ = hex_digits[*src & 0xf];
+    }
+}
+
+
+// Decode up to length bytes from 2 * length hexadecimal characters in src.
+// Returns the number of bytes decoded before the first invalid character.
+static size_t hex_decode(uint8_t *dst, const char *src, size_t length)
+{
+    unsigned v[8];
+    size_t i = 0;
+
+    for (; i + 4 <= length; i += 4, src += 8) {
+        for (int j = 0; j < 8; j++) v[j] = hex_value(src[j]);
+        if ((v[0] | v[1] | v[2] | v[3] | v[4] | v[5] | v[6] | v[7]) & 0xf0) break;
+
+        dst[i]     = v[0] << 4 | v[1];
+        dst[i + 1] = v[2] << 4 | v[3];
+        dst[i + 2] = v[4] << 4 | v[5];
+        dst[i + 3] = v[6] << 4 | v[7];
     }
 
-    lpuart_write_blocking(state.tmp, on_write);
-    return on_write;
+    // Finish the remainder, or locate the invalid character within the last
+    // block of four bytes, one byte at a time.
+    for (; i < length; i++, src += 2) {
+        v[0] = hex_value(src[0]);
+        v[1] = hex_value(src[1]);
+        if ((v[0] | v[1]) & 0xf0) break;
+        dst[i] = v[0] << 4 | v[1];
+    }
+
+    return i;
+}
+
+
+size_t atci_print_buffer_as_hex(const void *buffer, size_t length)
+{
+    const uint8_t *src = buffer;
+    size_t rv = length * 2, n, k;
+    cbuf_view_t v;
+    char buf[32];
+
+    // In the framed mode, the output needs to be included in the frame's CRC
+    // and thus has to go through output in small chunks. So does deferred
+    // output.
+    if (!direct_output()) {
+        for (; length; length -= n, src += n) {
+            n = length < sizeof(buf) / 2 ? length : sizeof(buf) / 2;
+            hex_encode(buf, src, n);
+            output(buf, n * 2);
+        }
+        return rv;
+    }
+
+    // In the text mode, encode the data directly into the free space of the
+    // LPUART TX queue, which may wrap around the end of the queue.
+    while (length) {
+        lpuart_tail(&v);
+        n = (v.len[0] + v.len[1]) / 2;
+        if (n == 0) {
+            lpuart_wait_for_space(2);
+            continue;
+        }
+        if (n > length) n = length;
+
+        k = v.len[0] / 2;
+        if (k > n) k = n;
+        hex_encode(v.ptr[0], src, k);
+
+        if (k < n) {
+            char *dst = v.ptr[1];
+            // A byte whose two digits straddle the wrap-around point
+            if (v.len[0] & 1) {
+                v.ptr[0][k * 2] = hex_digits[src[k] >> 4];
+                *dst++ = hex_digits[src[k] & 0xf];
+                k++;
+            }
+            hex_encode(dst, src + k, n - k);
+        }
+
+        lpuart_produce(n * 2);
+        count_tx(n * 2);
+        src += n;
+        length -= n;
+    }
+
+    return rv;
 }
 
 
 size_t atci_write(const char *buffer, size_t length)
 {
-    lpuart_write_blocking(buffer, length);
+    output(buffer, length);
     return length;
 }
 
 
-static int hex2bin(char c)
+bool atci_defer_begin(void)
+{
+    if (state.defer.active || state.defer.flushing) return false;
+
+    // The deferred output starts outside of any frame
+    state.defer.depth = state.frame.depth;
+    state.defer.crc = state.frame.crc;
+    state.frame.depth = 0;
+    state.defer.active = true;
+    return true;
+}
+
+
+void atci_defer_end(void)
 {
-    if ((c >= '0') && (c <= '9')) return c - '0';
-    else if ((c >= 'A') && (c <= 'F')) return c - 'A' + 10;
-    else if ((c >= 'a') && (c <= 'f')) return c - 'a' + 10;
-    else return -1;
+    if (!state.defer.active) return;
+
+    state.defer.active = false;
+    state.frame.depth = state.defer.depth;
+    state.frame.crc = state.defer.crc;
+}
+
+
+void atci_flush_deferred(void)
+{
+    if (state.defer.active || !state.defer.length) return;
+
+    // The write may wait for room in the TX FIFO and yield again. Nothing is
+    // deferred until the buffer has been written out.
+    state.defer.flushing = true;
+    lpuart_write_blocking(state.defer.buf, state.defer.length);
+    state.defer.flushing = false;
+
+    if (state.defer.dropped)
+        log_warning("ATCI: %u bytes of deferred output dropped", state.defer.dropped);
+    state.defer.length = 0;
+    state.defer.dropped = 0;
 }
 
 
 size_t atci_param_get_buffer_from_hex(atci_param_t *param, void *buffer, size_t length, size_t param_length)
 {
-    char c;
-    size_t i, max_i = length * 2, l = 0;
-    int temp;
+    size_t n;
+    unsigned v;
 
     if (param_length == 0) {
         param_length = param->length - param->offset;
@@ -126,20 +746,20 @@ size_t atci_param_get_buffer_from_hex(atci_param_t *param, void *buffer, size_t
     if ((buffer == NULL) || (length < param_length / 2))
         return 0;
 
-    for (i = 0; (i < max_i) && (param_length - i); i++) {
-        c = param->txt[param->offset++];
-
-        temp = hex2bin(c);
-        if (temp < 0) return 0;
-
-        if (i % 2 == 0) {
-            ((uint8_t *)buffer)[l] = temp << 4;
-        } else {
-            ((uint8_t *)buffer)[l++] |= temp;
-        }
+    n = param_length / 2;
+    if (hex_decode(buffer, param->txt + param->offset, n) != n)
+        return 0;
+    param->offset += n * 2;
+
+    // An odd trailing digit is stored as the high nibble of the next byte, if
+    // there is room for it, but is not counted in the returned length.
+    if ((param_length & 1) && n < length) {
+        v = hex_value(param->txt[param->offset++]);
+        if (v > 0xf) return 0;
+        ((uint8_t *)buffer)[n] = v << 4;
     }
 
-    return l;
+    return n;
 }
 
 
@@ -186,10 +806,60 @@ bool atci_param_get_int(atci_param_t *param, int32_t *value)
 
 bool atci_param_is_comma(atci_param_t *param)
 {
+    // Optional trailing parameters are probed with this function, so the
+    // cursor must stay at the end of the parameter if there is nothing left
+    if (param->offset >= param->length) return false;
     return param->txt[param->offset++] == ',';
 }
 
 
+int atci_param_tokenize(atci_param_t *param, atci_token_t *tokens, size_t max)
+{
+    const char *p = param->txt + param->offset;
+    const char *end = param->txt + param->length;
+    atci_token_t *t;
+    size_t n = 0;
+    unsigned d;
+
+    if (p >= end) return 0;
+
+    for (;;) {
+        if (n == max) return -1;
+        t = tokens + n++;
+        t->txt = p;
+        t->flags = ATCI_TOKEN_DEC | ATCI_TOKEN_HEX;
+        t->value = 0;
+
+        for (; p < end && *p != ','; p++) {
+            d = hex_value(*p);
+            if (d > 0xf) {
+                t->flags = 0;
+            } else if (d > 9 || t->value > (UINT32_MAX - d) / 10) {
+                t->flags &= ~ATCI_TOKEN_DEC;
+            } else {
+                t->value = t->value * 10 + d;
+            }
+        }
+
+        t->length = p - t->txt;
+        if (t->length == 0) t->flags = 0;
+
+        if (p == end) break;
+        p++;
+    }
+
+    param->offset = param->length;
+    return n;
+}
+
+
+bool atci_token_get_hex(const atci_token_t *token, void *buffer, size_t length)
+{
+    if (!(token->flags & ATCI_TOKEN_HEX) || token->length != length * 2) return false;
+    return hex_decode(buffer, token->txt, length) == length;
+}
+
+
 bool atci_set_read_next_data(size_t length, atci_encoding_t encoding, void (*callback)(atci_data_status_t status, atci_param_t *param))
 {
     if (sizeof(state.rx_buffer) <= length)
@@ -207,6 +877,11 @@ bool atci_set_read_next_data(size_t length, atci_encoding_t encoding, void (*cal
     state.read_next_data.encoding = encoding;
     state.read_next_data.callback = callback;
 
+    // The payload is not terminated, wake up once all of it has arrived. Data
+    // in the framed mode is part of the frame.
+    if (!state.frame.enabled)
+        lpuart_set_rx_threshold(encoding == ATCI_ENCODING_HEX ? 2 * length : length);
+
     return true;
 }
 
@@ -214,37 +889,143 @@ bool atci_set_read_next_data(size_t length, atci_encoding_t encoding, void (*cal
 void atci_abort_read_next_data(void)
 {
     state.aborted = true;
-    uint32_t mask = disable_irq();
-    system_sleep_lock |= SYSTEM_MODULE_ATCI;
-    reenable_irq(mask);
+    system_post(SYSTEM_TASK_ATCI);
 }
 
 
+// Arm the reader for the next chunk of the stream, if the window allows
+static void next_chunk(void)
+{
+    size_t n = state.stream.remaining;
+
+    if (state.read_next_data.length) return;
+    if (n > state.stream.window) n = state.stream.window;
+    if (n > state.stream.chunk) n = state.stream.chunk;
+    if (n == 0) return;
+
+    state.read_next_data.length = n;
+    state.read_next_data.encoding = state.stream.encoding;
+    lpuart_set_rx_threshold(state.stream.encoding == ATCI_ENCODING_HEX ? 2 * n : n);
+    system_post(SYSTEM_TASK_ATCI);
+}
+
+
+bool atci_set_read_stream(size_t length, size_t chunk, atci_encoding_t encoding, void (*callback)(atci_data_status_t status, atci_param_t *param))
+{
+    if (state.frame.enabled || length == 0) return false;
+
+    if (chunk == 0 || chunk >= sizeof(state.rx_buffer))
+        chunk = sizeof(state.rx_buffer) - 1;
+
+    state.stream.remaining = length;
+    state.stream.window = 0;
+    state.stream.chunk = chunk;
+    state.stream.encoding = encoding;
+    state.read_next_data.callback = callback;
+    return true;
+}
+
+
+void atci_stream_grant(size_t length)
+{
+    if (!state.stream.remaining) return;
+    state.stream.window += length;
+    next_chunk();
+}
+
+
+void atci_stream_end(void)
+{
+    if (!state.stream.remaining) return;
+
+    state.stream.remaining = 0;
+    state.stream.window = 0;
+    state.read_next_data.length = 0;
+    state.rx_length = 0;
+    state.rx_half = false;
+    lpuart_set_rx_threshold(0);
+}
+
+
+// The command names and hints are constant strings in flash. Write them out
+// piece by piece rather than formatting each line with atci_printf, which
+// would run the formatter over the whole table.
 void atci_clac_action(atci_param_t *param)
 {
     (void)param;
-    for (size_t i = 0; i < state.commands_length; i++)
-        atci_printf("AT%s\r\n", state.commands[i].command);
+    for (size_t i = 0; i < state.commands_length; i++) {
+        output("AT", 2);
+        atci_print(state.commands[i].command);
+        output("\r\n", 2);
+    }
 
-    lpuart_write_blocking(ATCI_OK, ATCI_OK_LEN);
+    output(ATCI_OK, ATCI_OK_LEN);
 }
 
 
 void atci_help_action(atci_param_t *param)
 {
     (void)param;
-    for (size_t i = 0; i < state.commands_length; i++)
-        atci_printf("AT%s %s\r\n", state.commands[i].command, state.commands[i].hint);
+    for (size_t i = 0; i < state.commands_length; i++) {
+        output("AT", 2);
+        atci_print(state.commands[i].command);
+        output(" ", 1);
+        atci_print(state.commands[i].hint);
+        output("\r\n", 2);
+    }
+
+    output(ATCI_OK, ATCI_OK_LEN);
+}
+
+
+#if ATCI_PROF == 1
+
+void atci_prof_read(void)
+{
+    unsigned int n = 0;
+    size_t i;
+
+    for (i = 0; i < state.commands_length; i++)
+        if (prof[i].count) n++;
 
-    lpuart_write_blocking(ATCI_OK, ATCI_OK_LEN);
+    atci_printf("+OK=%u", n);
+    for (i = 0; i < state.commands_length; i++) {
+        if (!prof[i].count) continue;
+        atci_printf(";%s,%lu,%lu,%lu,%lu", state.commands[i].command,
+            prof[i].count, prof[i].total, prof[i].max, prof[i].bytes);
+    }
+    output(ATCI_EOL, sizeof(ATCI_EOL) - 1);
+}
+
+
+void atci_prof_clear_action(atci_param_t *param)
+{
+    (void)param;
+    memset(prof, 0, sizeof(prof));
+    output(ATCI_OK, ATCI_OK_LEN);
 }
 
+#endif
+
 
 static void finish_next_data(atci_data_status_t status)
 {
+    lpuart_set_rx_threshold(0);
     state.read_next_data.length = 0;
     state.read_next_data.encoding = ATCI_ENCODING_BIN;
     state.rx_buffer[state.rx_length] = 0;
+    state.rx_half = false;
+
+    if (state.stream.remaining) {
+        state.stream.remaining -= state.rx_length;
+        state.stream.window -= state.rx_length;
+        if (status == ATCI_DATA_OK && state.stream.remaining) {
+            status = ATCI_DATA_PARTIAL;
+        } else {
+            state.stream.remaining = 0;
+            state.stream.window = 0;
+        }
+    }
 
     if (state.read_next_data.callback != NULL) {
         atci_param_t param = {
@@ -256,101 +1037,285 @@ static void finish_next_data(atci_data_status_t status)
     }
 
     state.rx_length = 0;
+    if (!state.stream.remaining) state.tag.pending = false;
 
-    if (!sysconf.async_uart) lpuart_pause_tx();
+    if (state.stream.remaining) {
+        next_chunk();
+        return;
+    }
+
+    if (hold_tx() && !state.frame.depth) lpuart_pause_tx();
 }
 
 
-static void process_command(void)
+// Find the command whose name is exactly the first len characters of name
+static const atci_command_t *find_command(const char *name, size_t len)
 {
-    log_debug("ATCI: %s", state.rx_buffer);
+    const atci_command_t *cmd;
+    size_t lo = 0, hi = state.commands_length, mid;
+    int rv;
 
-    if (state.rx_length < 2) return;
-    if (state.rx_buffer[0] != 'A' && state.rx_buffer[0] != 'a') return;
-    if (state.rx_buffer[1] != 'T' && state.rx_buffer[1] != 't') return;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        cmd = state.commands + state.index[mid];
 
-    if (!sysconf.async_uart) lpuart_resume_tx();
+        rv = strncmp(name, cmd->command, len);
+        // If the command name is longer, the name we are looking for sorts
+        // before it.
+        if (rv == 0 && cmd->command[len] != '\0') rv = -1;
 
-    if (state.rx_length == 2) {
-        lpuart_write_blocking(ATCI_OK, ATCI_OK_LEN);
-        goto done;
+        if (rv == 0) return cmd;
+        if (rv < 0) hi = mid;
+        else lo = mid + 1;
     }
+    return NULL;
+}
 
-    state.rx_buffer[state.rx_length] = 0;
 
-    for(size_t i = 2; i < state.rx_length; i++)
-        switch(state.rx_buffer[i]) {
-            case '=':
-            case '?':
-            case ' ':
-                break;
+// Invoke the handler of cmd for the form of the command in name (action, set,
+// read, or help). Returns false if the command has no such handler.
+static bool dispatch(const atci_command_t *cmd, char *name, size_t cmd_len, size_t name_len)
+{
+    if (cmd_len == name_len) {
+        if (cmd->action != NULL) {
+            cmd->action(NULL);
+            return true;
+        }
+    } else if (name[cmd_len] == '=') {
+        if (name[cmd_len + 1] == '?' && (cmd_len + 2 == name_len) && cmd->help) {
+            cmd->help();
+            return true;
+        }
 
-            default:
-                state.rx_buffer[i] = toupper(state.rx_buffer[i]);
-                break;
+        if (cmd->set != NULL) {
+            atci_param_t param = {
+                .txt    = name + cmd_len + 1,
+                .length = name_len - cmd_len - 1,
+                .offset = 0
+            };
+            cmd->set(&param);
+            return true;
+        }
+    } else if (name[cmd_len] == '?' && cmd_len + 1 == name_len) {
+        if (cmd->read != NULL) {
+            cmd->read();
+            return true;
         }
+    } else if (name[cmd_len] == ' ' && cmd_len + 1 < name_len) {
+        if (cmd->action != NULL) {
+            atci_param_t param = {
+                .txt    = name + cmd_len + 1,
+                .length = name_len - cmd_len - 1,
+                .offset = 0
+            };
+            cmd->action(&param);
+            return true;
+        }
+    }
+    return false;
+}
 
-    char *name = state.rx_buffer + 2;
-    size_t name_len = state.rx_length - 2;
 
-    const atci_command_t *cmd;
-    size_t cmd_len;
-    for (size_t i = 0; i < state.commands_length; i++) {
-        cmd = state.commands + i;
-        cmd_len = strlen(cmd->command);
+#if ATCI_PROF == 1
 
-        if (name_len < cmd_len) continue;
-        if (strncmp(name, cmd->command, cmd_len) != 0) continue;
+// SysTick wraps around after 2^24 HCLK cycles, about 0.5 s at 32 MHz. Longer
+// run times are measured with the RTC in ticks of 1/1024 s.
+#define PROF_RTC_THRESHOLD 256
 
-        if (cmd_len == name_len) {
-            if (cmd->action != NULL) {
-                cmd->action(NULL);
-                goto done;
-            }
-        } else if (name[cmd_len] == '=') {
-            if (name[cmd_len + 1] == '?' && (cmd_len + 2 == name_len) && cmd->help) {
-                cmd->help();
-                goto done;
-            }
+static void profile(const atci_command_t *cmd, uint32_t start, uint64_t start_ticks, uint32_t start_bytes)
+{
+    uint32_t cycles = (start - SysTick->VAL) & SysTick_LOAD_RELOAD_Msk;
+    uint64_t ticks = rtc_get_ticks64() - start_ticks;
+    prof_t *p = &prof[cmd - state.commands];
+    uint32_t us;
+
+    if (ticks > PROF_RTC_THRESHOLD) us = ticks * 15625 / 16;
+    else us = cycles / (SystemCoreClock / 1000000);
+
+    p->count++;
+    p->total += us;
+    if (us > p->max) p->max = us;
+    p->bytes += tx_bytes - start_bytes;
+}
 
-            if (cmd->set != NULL) {
-                atci_param_t param = {
-                    .txt    = name + cmd_len + 1,
-                    .length = name_len - cmd_len - 1,
-                    .offset = 0
-                };
-                cmd->set(&param);
-                goto done;
-            }
-        } else if (name[cmd_len] == '?' && cmd_len + 1 == name_len) {
-            if (cmd->read != NULL) {
-                cmd->read();
-                goto done;
-            }
-        } else if (name[cmd_len] == ' ' && cmd_len + 1 < name_len) {
-            if (cmd->action != NULL) {
-                atci_param_t param = {
-                    .txt    = name + cmd_len + 1,
-                    .length = name_len - cmd_len - 1,
-                    .offset = 0
-                };
-                cmd->action(&param);
-                goto done;
-            }
-        }
+#endif
+
+
+// Execute a single command. The command name (without the AT prefix) and its
+// parameters are in name, which must be NUL-terminated at name[name_len].
+static void execute(char *name, size_t name_len)
+{
+    // Command names never contain any of the separator characters below, thus
+    // the name of the command ends at the first separator, or at the end of
+    // the line. This gives the same result as matching each command in the
+    // table as a prefix of the line.
+    size_t cmd_len = strcspn(name, "=? ");
+    const atci_command_t *cmd = find_command(name, cmd_len);
+
+    if (cmd == NULL) {
+        output(ATCI_UNKNOWN_CMD, ATCI_UKNOWN_CMD_LEN);
+        return;
     }
 
-    lpuart_write_blocking(ATCI_UNKNOWN_CMD, ATCI_UKNOWN_CMD_LEN);
+#if ATCI_PROF == 1
+    uint32_t start_bytes = tx_bytes;
+    uint64_t start_ticks = rtc_get_ticks64();
+    uint32_t start = SysTick->VAL;
+#endif
+
+    if (!dispatch(cmd, name, cmd_len, name_len))
+        output(ATCI_UNKNOWN_CMD, ATCI_UKNOWN_CMD_LEN);
+
+#if ATCI_PROF == 1
+    profile(cmd, start, start_ticks, start_bytes);
+#endif
+}
+
+
+// Parse the optional sequence tag that follows the AT prefix, e.g., AT#12+DR?.
+// Returns the number of characters taken by the tag, or -1 if it is invalid.
+static int parse_tag(const char *txt, size_t length)
+{
+    size_t n = 1;
+
+    state.tag.length = 0;
+    state.tag.pending = false;
+    if (length == 0 || txt[0] != '#') return 0;
+
+    while (n < length && n <= ATCI_TAG_MAX_LENGTH && isdigit((unsigned char)txt[n])) n++;
+    if (n == 1 || (n < length && isdigit((unsigned char)txt[n]))) return -1;
+
+    memcpy(state.tag.txt, txt, n);
+    state.tag.length = n;
+    return n;
+}
+
+
+// Process the AT command line in line. The buffer must have room for a
+// terminating NUL at line[length].
+//
+// A line can carry a batch of several commands separated with semicolons, e.g.,
+// AT+DR?;+ADR?;+FRMCNT? . The commands are executed in order and each produces
+// its own response, but the whole batch is answered in one block, with the TX
+// path resumed only once. A command that asks for payload data ends the batch,
+// since the data follows the line. The rest of the line is ignored.
+//
+// A sequence tag after the prefix, e.g., AT#12+DR?, is repeated in the
+// response of each command of the line: +OK#12=5 or +ERR#12=-3. See atci.h for
+// pipelining commands.
+static void process_command(char *line, size_t length)
+{
+    char *name, *end;
+    int tag;
+
+    log_debug("ATCI: %s", line);
+
+    if (length < 2) return;
+    if (line[0] != 'A' && line[0] != 'a') return;
+    if (line[1] != 'T' && line[1] != 't') return;
+
+    if (hold_tx()) lpuart_resume_tx();
+
+    tag = parse_tag(line + 2, length - 2);
+    if (tag < 0) {
+        output(ATCI_UNKNOWN_CMD, ATCI_UKNOWN_CMD_LEN);
+        goto done;
+    }
+
+    if (length == 2 + (size_t)tag) {
+        state.tag.pending = tag != 0;
+        output(ATCI_OK, ATCI_OK_LEN);
+        goto done;
+    }
+
+    line[length] = 0;
+
+    for (name = line + 2 + tag; name < line + length; name = end + 1) {
+        end = memchr(name, ';', line + length - name);
+        if (end == NULL) end = line + length;
+        // Skip empty commands, e.g., after a trailing semicolon
+        if (end == name) continue;
+
+        *end = 0;
+
+        // Only the command name is folded to upper case for the lookup. The
+        // parameters are passed on as received; hexadecimal fields are
+        // decoded in either case.
+        for (char *c = name; c < end && *c != '=' && *c != '?' && *c != ' '; c++)
+            *c = toupper(*c);
+
+        state.tag.pending = tag != 0;
+        execute(name, end - name);
+        // The response of a command that reads payload data comes once the
+        // data has been received, see finish_next_data
+        if (state.read_next_data.length || state.stream.remaining) break;
+        state.tag.pending = false;
+    }
 
 done:
-    if (!sysconf.async_uart && !state.read_next_data.length) lpuart_pause_tx();
+    if (hold_tx() && !state.read_next_data.length && !state.stream.remaining
+        && !state.frame.depth)
+        lpuart_pause_tx();
+    apply_mode();
+}
+
+
+int atci_execute(unsigned int index, char *params, size_t length)
+{
+    const atci_command_t *cmd;
+
+    if (index >= state.commands_length) return ATCI_EXEC_UNKNOWN;
+    cmd = &state.commands[index];
+    if (cmd->set == NULL) return ATCI_EXEC_UNKNOWN;
+
+    // A command must not take over payload data meant for the host's command
+    if (state.read_next_data.length || state.stream.remaining) return ATCI_EXEC_BUSY;
+
+    atci_param_t param = {
+        .txt    = params,
+        .length = length,
+        .offset = 0
+    };
+
+    log_debug("ATCI: Executing AT%s=...", cmd->command);
+
+    state.capture.length = 0;
+    state.capture.active = true;
+    cmd->set(&param);
+
+    // Commands that read payload data from the host cannot be executed this
+    // way. The reader is cancelled before it receives anything.
+    if (state.read_next_data.length || state.stream.remaining)
+        finish_next_data(ATCI_DATA_ABORTED);
+    state.capture.active = false;
+
+    state.capture.buf[state.capture.length] = 0;
+    if (strncmp(state.capture.buf, "+ERR=", 5) == 0)
+        return strtol(state.capture.buf + 5, NULL, 10);
+    return 0;
+}
+
+
+#if BENCH == 1
+void atci_bench_execute(char *name, size_t name_len)
+{
+    execute(name, name_len);
+}
+#endif
+
+
+static void check_data_done(void)
+{
+    if (state.read_next_data.length == state.rx_length || state.rx_error) {
+        finish_next_data(state.rx_error ? ATCI_DATA_ENCODING_ERROR : ATCI_DATA_OK);
+        state.rx_error = false;
+    }
 }
 
 
 static void process_data(char character)
 {
-    int c;
-    static bool even = true;
+    unsigned c;
 
     switch(state.read_next_data.encoding) {
         case ATCI_ENCODING_BIN:
@@ -358,17 +1323,17 @@ static void process_data(char character)
             break;
 
         case ATCI_ENCODING_HEX:
-            c = hex2bin(character);
-            if (c < 0) {
+            c = hex_value(character);
+            if (c > 0xf) {
                 state.rx_error = true;
                 break;
             }
-            if (even) {
+            if (!state.rx_half) {
                 state.rx_buffer[state.rx_length] = c << 4;
-                even = false;
+                state.rx_half = true;
             } else {
                 state.rx_buffer[state.rx_length++] |= c;
-                even = true;
+                state.rx_half = false;
             }
             break;
 
@@ -377,11 +1342,27 @@ static void process_data(char character)
             break;
     }
 
-    if (state.read_next_data.length == state.rx_length || state.rx_error) {
-        even = true;
-        finish_next_data(state.rx_error ? ATCI_DATA_ENCODING_ERROR : ATCI_DATA_OK);
-        state.rx_error = false;
-    }
+    check_data_done();
+}
+
+
+// Decode a run of hex payload data from the RX FIFO in bulk, directly into
+// rx_buffer. Returns the number of characters consumed, which may be zero if
+// the run does not begin on a byte boundary or starts with an invalid digit.
+// Anything that cannot be decoded here is left to process_data.
+static size_t process_hex_data(const char *ptr, size_t len)
+{
+    size_t n;
+
+    if (state.rx_half) return 0;
+
+    n = state.read_next_data.length - state.rx_length;
+    if (n > len / 2) n = len / 2;
+
+    n = hex_decode((uint8_t *)state.rx_buffer + state.rx_length, ptr, n);
+    state.rx_length += n;
+    check_data_done();
+    return n * 2;
 }
 
 
@@ -400,8 +1381,105 @@ static int append_to_buffer(char c)
 }
 
 
+// A frame received in the framed mode has the following format:
+//
+//   | id (1) | len (1) | command (len) | payload (0-n) | crc16 (2) |
+//
+// The command is an AT command line without the terminating CR. The payload, if
+// present, is passed to the command as if it was received via
+// atci_set_read_next_data. The CRC16 is computed over all preceding fields and
+// is sent LSB first. The whole frame is SLIP-encoded and must fit into the
+// receive buffer. The response is sent in a frame with the same id.
+static void process_frame(void)
+{
+    uint8_t *buf = (uint8_t *)state.rx_buffer;
+    size_t len = state.rx_length;
+
+    if (len < 4) {
+        log_debug("ATCI: Frame too short");
+        return;
+    }
+
+    if (crc16(0xffff, buf, len - 2) != (buf[len - 2] | buf[len - 1] << 8)) {
+        log_debug("ATCI: Invalid frame CRC");
+        return;
+    }
+
+    uint8_t id = buf[0];
+    size_t cmd_len = buf[1];
+    if (cmd_len + 4 > len) {
+        log_debug("ATCI: Invalid frame length");
+        return;
+    }
+
+    uint8_t *payload = buf + 2 + cmd_len;
+    size_t payload_len = len - 4 - cmd_len;
+
+    if (hold_tx()) lpuart_resume_tx();
+    atci_frame_open(id);
+
+    // Move the command to the beginning of the buffer where process_command
+    // expects it. The payload stays where it is. The terminating NUL written
+    // by process_command falls before the payload.
+    memmove(state.rx_buffer, buf + 2, cmd_len);
+    state.rx_buffer[cmd_len] = 0;
+    process_command(state.rx_buffer, cmd_len);
+
+    // If the command asked for more data, feed it from the payload. The data
+    // is written to the beginning of rx_buffer, i.e., always behind the
+    // position being read. There is no other way to deliver the data in the
+    // framed mode, thus if the payload is too short, we finish immediately,
+    // just like when the timeout fires in the text mode.
+    state.rx_length = 0;
+    for (size_t i = 0; i < payload_len && state.read_next_data.length != 0; i++)
+        process_data(payload[i]);
+
+    if (state.read_next_data.length != 0)
+        finish_next_data(ATCI_DATA_ABORTED);
+
+    atci_frame_close();
+    if (hold_tx()) lpuart_pause_tx();
+}
+
+
+static void process_frame_character(uint8_t character)
+{
+    switch(character) {
+        case SLIP_END:
+            if (state.rx_length != 0 && !state.rx_error)
+                process_frame();
+            state.rx_error = false;
+            state.frame.escape = false;
+            reset();
+            return;
+
+        case SLIP_ESC:
+            state.frame.escape = true;
+            return;
+
+        default:
+            break;
+    }
+
+    if (state.frame.escape) {
+        state.frame.escape = false;
+        if (character == SLIP_ESC_END) character = SLIP_END;
+        else if (character == SLIP_ESC_ESC) character = SLIP_ESC;
+        else state.rx_error = true;
+    }
+
+    if (append_to_buffer(character) < 0)
+        state.rx_error = true;
+}
+
+
 static void process_character(char character)
 {
+    if (state.frame.enabled) {
+        process_frame_character(character);
+        return;
+    }
+
     if (state.read_next_data.length != 0) {
         process_data(character);
         return;
@@ -436,10 +1514,10 @@ static void process_character(char character)
         case ATCI_ATTENTION_STATE:
             if (character == '\r') {
                 state.rx_buffer[state.rx_length] = 0;
-                process_command();
+                process_command(state.rx_buffer, state.rx_length);
                 reset();
             } else if (append_to_buffer(character) < 0) {
-                lpuart_write_blocking(ATCI_UNKNOWN_CMD, sizeof(ATCI_UNKNOWN_CMD) - 1);
+                output(ATCI_UNKNOWN_CMD, ATCI_UKNOWN_CMD_LEN);
                 reset();
             }
             break;
@@ -451,14 +1529,73 @@ static void process_character(char character)
 }
 
 
+// Process a contiguous segment of the RX FIFO. Complete AT command lines that
+// do not wrap around the end of the FIFO are passed to process_command in
+// place, without copying them into rx_buffer first. Everything else (payload
+// data, frames, lines that wrap or need to be cleaned up) goes through
+// process_character. If last is true and the segment ends with an incomplete
+// line, the line is left in the FIFO until the rest arrives. Returns the number
+// of bytes that can be consumed from the FIFO.
+static size_t process_segment(char *ptr, size_t len, bool last)
+{
+    size_t i = 0, n;
+    char *end;
+
+    while (i < len) {
+        // Stream data beyond the granted window stays in the FIFO until the
+        // consumer grants more
+        if (state.stream.remaining && !state.read_next_data.length) return i;
+
+        if (!state.frame.enabled
+            && state.read_next_data.length != 0
+            && state.read_next_data.encoding == ATCI_ENCODING_HEX) {
+            n = process_hex_data(ptr + i, len - i);
+            if (n == 0) process_character(ptr[i++]);
+            else i += n;
+            continue;
+        }
+
+        if (state.frame.enabled
+            || state.read_next_data.length != 0
+            || state.parser_state != ATCI_START_STATE) {
+            process_character(ptr[i++]);
+            continue;
+        }
+
+        // In the start state, the parser skips everything up to the first
+        // character of the AT prefix.
+        if (ptr[i] != 'A' && ptr[i] != 'a') {
+            i++;
+            continue;
+        }
+
+        end = memchr(ptr + i, '\r', len - i);
+        if (end == NULL) {
+            if (last && len - i <= sizeof(state.rx_buffer) - 1) return i;
+            process_character(ptr[i++]);
+            continue;
+        }
+
+        n = end - (ptr + i);
+        if (n < 2 || n > sizeof(state.rx_buffer) - 1
+            || (ptr[i + 1] != 'T' && ptr[i + 1] != 't')
+            || memchr(ptr + i, '\n', n) != NULL
+            || memchr(ptr + i, '\x1b', n) != NULL) {
+            process_character(ptr[i++]);
+            continue;
+        }
+
+        process_command(ptr + i, n);
+        i += n + 1;
+    }
+    return i;
+}
+
+
 void atci_process(void)
 {
-    uint32_t masked;
     cbuf_view_t data;
-
-    masked = disable_irq();
-    system_sleep_lock &= ~SYSTEM_MODULE_ATCI;
-    reenable_irq(masked);
+    size_t n;
 
     while (true) {
         if (state.aborted) {
@@ -466,20 +1603,17 @@ void atci_process(void)
             state.aborted = false;
         }
 
-        masked = disable_irq();
         cbuf_head(&lpuart_rx_fifo, &data);
-        reenable_irq(masked);
 
         if ((data.len[0] + data.len[1]) == 0) break;
 
-        for (size_t i = 0; i < data.len[0]; i++)
-            process_character((char)data.ptr[0][i]);
+        n = process_segment(data.ptr[0], data.len[0], data.len[1] == 0);
+        if (n == data.len[0])
+            n += process_segment(data.ptr[1], data.len[1], true);
 
-        for (size_t i = 0; i < data.len[1]; i++)
-            process_character((char)data.ptr[1][i]);
+        lpuart_consume(n);
 
-        masked = disable_irq();
-        cbuf_consume(&lpuart_rx_fifo, data.len[0] + data.len[1]);
-        reenable_irq(masked);
+        // Stop if we are waiting for the rest of an incomplete line
+        if (n != data.len[0] + data.len[1]) break;
     }
 }
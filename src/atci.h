@@ -15,11 +15,42 @@
 
 #define ATCI_COMMANDS_LENGTH(COMMANDS) (sizeof(COMMANDS) / sizeof(COMMANDS[0]))
 
+// The maximum number of commands that can be registered with atci_init. The
+// value determines the size of the sorted command index kept in RAM, whose
+// entries are eight bits wide.
+#ifndef ATCI_MAX_COMMANDS
+#define ATCI_MAX_COMMANDS 192
+#endif
+
 #define ATCI_COMMAND_CLAC {"+CLAC", atci_clac_action, NULL, NULL, NULL, "List all supported AT commands"}
 #define ATCI_COMMAND_HELP {"$HELP", atci_help_action, NULL, NULL, NULL, "This help"}
+#define ATCI_COMMAND_PROF {"$PROF", atci_prof_clear_action, NULL, atci_prof_read, NULL, "Get the execution profile of AT commands (count,total us,max us,bytes), clear"}
 
 #define atci_flush lpuart_flush
 
+/* Pipelining
+ *
+ * The host does not have to wait for the response of a command line before it
+ * sends the next one. Received data waits in the LPUART RX FIFO and is
+ * processed strictly in the order of arrival, one line at a time. Payload data
+ * read with atci_set_read_next_data is taken from the FIFO before the lines
+ * that follow it, thus a line queued behind the payload of AT+UTX or a similar
+ * command runs once the command has been answered.
+ *
+ * The FIFO bounds the pipeline: the host may have up to LPUART_BUFFER_SIZE
+ * bytes of command lines and payload in flight, i.e., at least
+ * ATCI_PIPELINE_DEPTH lines of the maximum length. Without flow control, data
+ * beyond that is dropped and counted as an overrun (AT$STATS).
+ *
+ * To match responses to commands, a line can carry a sequence tag of up to
+ * ATCI_TAG_MAX_LENGTH decimal digits after the AT prefix, e.g., AT#12+DR?. The
+ * tag is repeated after the +OK or +ERR of each response to the line, e.g.,
+ * +OK#12=5, so that the responses can be told apart from asynchronous events
+ * and from each other.
+ */
+#define ATCI_TAG_MAX_LENGTH 5
+#define ATCI_PIPELINE_DEPTH (LPUART_BUFFER_SIZE / ATCI_RX_BUFFER_SIZE)
+
 
 //! @brief AT param struct
 typedef struct
@@ -31,9 +62,26 @@ typedef struct
 } atci_param_t;
 
 
+//! @brief The field is a decimal number that fits in 32 bits
+#define ATCI_TOKEN_DEC 0x01
+//! @brief The field consists of hexadecimal digits only
+#define ATCI_TOKEN_HEX 0x02
+
+//! @brief A comma-separated field of an AT command parameter
+typedef struct
+{
+    const char *txt;
+    uint16_t length;
+    uint8_t flags;   // ATCI_TOKEN_* classes, zero for empty fields
+    uint32_t value;  // Valid if ATCI_TOKEN_DEC is set
+
+} atci_token_t;
+
+
 typedef enum
 {
     ATCI_DATA_OK = 0,
+    ATCI_DATA_PARTIAL = 1,
     ATCI_DATA_ABORTED = -1,
     ATCI_DATA_ENCODING_ERROR = -2
 } atci_data_status_t;
@@ -123,12 +171,35 @@ bool atci_param_get_int(atci_param_t *param, int32_t *value);
 
 
 //! @brief Check if the character at the cursor is a comma and move the parsing cursor forward
+//! The cursor does not move at the end of the parameter.
 //! @param[in] param Param instance
 //! @return true Is comma
 //! @return false No comma
 bool atci_param_is_comma(atci_param_t *param);
 
 
+//! @brief Split the rest of the parameter into comma-separated fields
+//!
+//! The parameter is scanned once. Each field is classified as a decimal
+//! number, a hexadecimal string, or neither, and decimal fields are converted
+//! along the way. The parsing cursor is moved to the end of the parameter.
+//! @param[in] param Param instance
+//! @param[out] tokens Destination array
+//! @param[in] max Number of elements in tokens
+//! @return Number of fields (0 for an empty parameter), or -1 if there are
+//! more than max fields
+int atci_param_tokenize(atci_param_t *param, atci_token_t *tokens, size_t max);
+
+
+//! @brief Decode a field consisting of exactly 2 * length hexadecimal digits
+//! @param[in] token Token instance
+//! @param[out] buffer Pointer to destination buffer
+//! @param[in] length Number of bytes to be decoded
+//! @return true On success
+//! @return false On failure
+bool atci_token_get_hex(const atci_token_t *token, void *buffer, size_t length);
+
+
 //! @brief Set callback for next data
 bool atci_set_read_next_data(size_t length, atci_encoding_t encoding, void (*callback)(atci_data_status_t status, atci_param_t *param));
 
@@ -137,10 +208,124 @@ bool atci_set_read_next_data(size_t length, atci_encoding_t encoding, void (*cal
 void atci_abort_read_next_data(void);
 
 
+//! @brief Read a stream of data that may be larger than the receive buffer
+//!
+//! The stream is delivered to callback in chunks of up to chunk bytes. All
+//! chunks but the last are passed with ATCI_DATA_PARTIAL, the last one with
+//! ATCI_DATA_OK. The reader only consumes as many bytes as the consumer has
+//! granted with atci_stream_grant; anything beyond is left in the LPUART RX
+//! FIFO. The TX path stays resumed while the stream is active. Not available
+//! in the framed mode.
+//! @param[in] length Total number of (decoded) bytes in the stream
+//! @param[in] chunk Maximum chunk size, 0 for the size of the receive buffer
+//! @param[in] encoding Encoding of the data
+//! @param[in] callback Chunk consumer
+//! @return true On success
+//! @return false On failure
+bool atci_set_read_stream(size_t length, size_t chunk, atci_encoding_t encoding, void (*callback)(atci_data_status_t status, atci_param_t *param));
+
+
+//! @brief Allow the reader to consume another length bytes of the stream
+void atci_stream_grant(size_t length);
+
+
+//! @brief Stop reading the stream without invoking the callback
+void atci_stream_end(void);
+
+
+//! @brief Switch between the text (default) and the framed transport mode
+//!
+//! The switch takes effect once the response to the current command has been
+//! sent. In the framed mode, commands and responses are exchanged in
+//! SLIP-encoded frames protected with a CRC16. See process_frame in atci.c for
+//! the format.
+//! @param[in] enabled Use the framed mode if true
+void atci_set_framed(bool enabled);
+
+
+//! @brief Return true if the framed transport mode is active
+bool atci_is_framed(void);
+
+
+//! @brief Hold back the output that follows, until atci_defer_end, in a small
+//! buffer. Used while the main context yields in the middle of a write, so that
+//! notifications produced meanwhile do not end up inside the output that is
+//! waiting for room in the TX FIFO. Each piece of deferred output must be
+//! complete, i.e., close the frames it opens.
+//! @return false if output is already being deferred or flushed
+bool atci_defer_begin(void);
+
+
+//! @brief Resume writing output to the host. The deferred output is kept until
+//! atci_flush_deferred.
+void atci_defer_end(void);
+
+
+#define ATCI_EXEC_UNKNOWN (-128)
+#define ATCI_EXEC_BUSY    (-127)
+
+
+//! @brief Execute the setter of a command on behalf of the modem rather than
+//! the host, e.g., received in a downlink. The response is not sent to the
+//! host. Commands that read payload data are aborted.
+//! @param[in] index Position of the command in the table passed to atci_init,
+//! i.e., in the output of AT+CLAC
+//! @param[in] params The parameters, as they would follow '=' on the line
+//! @param[in] length The length of params
+//! @return 0 if the command succeeded, the error number of its +ERR response,
+//! ATCI_EXEC_UNKNOWN if there is no such setter, or ATCI_EXEC_BUSY if the host
+//! is in the middle of sending payload data
+int atci_execute(unsigned int index, char *params, size_t length);
+
+
+//! @brief Write the deferred output to the host. Invoke from the main loop,
+//! where no other output is in progress. Output that did not fit into the
+//! buffer is dropped.
+void atci_flush_deferred(void);
+
+
+//! @brief Start a new output frame in the framed mode
+//!
+//! All output written until the matching atci_frame_close is sent in a single
+//! frame. The calls can be nested; only the outermost pair has effect. Does
+//! nothing in the text mode.
+//! @param[in] id Frame id. Use 0 for unsolicited messages.
+void atci_frame_open(uint8_t id);
+
+
+//! @brief Finish the output frame started with atci_frame_open
+void atci_frame_close(void);
+
+
 //! @brief Helper for clac action
 void atci_clac_action(atci_param_t *param);
 
 //! @brief Helper for help action
 void atci_help_action(atci_param_t *param);
 
+#if ATCI_PROF == 1
+
+//! @brief Write the execution profile of the commands that have run since the
+//! profile was cleared: +OK=<n>;<command>,<count>,<total us>,<max us>,<bytes>...
+//!
+//! The time is measured from the dispatch of a command to the return of its
+//! handler, the bytes are those written to the LPUART meanwhile. Payload data
+//! that a command reads after its line, e.g., with AT+UTX, is not included.
+void atci_prof_read(void);
+
+//! @brief Clear the execution profile of the commands
+void atci_prof_clear_action(atci_param_t *param);
+
+#endif
+
+#if BENCH == 1
+//! @brief Execute a single command from the command table, see bench.c
+//!
+//! Unlike a command received over the LPUART, the TX path is neither resumed
+//! nor paused around the command.
+//! @param[in] name Upper-case command name without the AT prefix, followed by
+//! its parameters. Must be NUL-terminated at name[name_len].
+void atci_bench_execute(char *name, size_t name_len);
+#endif
+
 #endif //_ATCI_H
@@ -0,0 +1,414 @@
+#include "bench.h"
+
+#if BENCH == 1
+
+#include <string.h>
+#include <stm/STM32L0xx_HAL_Driver/Inc/stm32l0xx_hal.h>
+#include <LoRaWAN/Utilities/timeServer.h>
+#include <loramac-node/src/mac/secure-element.h>
+#include "adc.h"
+#include "atci.h"
+#include "cbuf.h"
+#include "eeprom.h"
+#include "irq.h"
+#include "lpuart.h"
+#include "nvm.h"
+#include "part.h"
+#include "rtc.h"
+#include "spi.h"
+#include "sx1276-board.h"
+#include "utils.h"
+
+// The Cortex-M0+ has no DWT cycle counter. SysTick is not used by the firmware
+// (see HAL_InitTick), so the benchmarks run it as a free-running 24-bit down
+// counter clocked from HCLK with its interrupt disabled. A single measurement
+// must take less than 2^24 cycles, i.e., about 0.5 s at 32 MHz.
+#define SYSTICK_MAX 0xffffffUL
+
+// EEPROM writes wear the memory, keep the number of iterations low
+#define EEPROM_ITERATIONS 8
+#define ITERATIONS 32
+
+// The benchmarked AT command. It is dispatched through the command table and
+// its response is discarded, see lpuart_mute.
+#define DISPATCH_COMMAND "+VER?"
+
+static uint32_t overhead;
+
+
+static inline uint32_t cycles(void)
+{
+    return SysTick->VAL;
+}
+
+
+static inline uint32_t since(uint32_t start)
+{
+    uint32_t d = (start - SysTick->VAL) & SYSTICK_MAX;
+    return d > overhead ? d - overhead : 0;
+}
+
+
+static uint32_t bench_empty(unsigned i)
+{
+    (void)i;
+    uint32_t start = cycles();
+    return since(start);
+}
+
+
+static uint32_t bench_dispatch(unsigned i)
+{
+    (void)i;
+    char line[] = DISPATCH_COMMAND;
+    uint32_t start = cycles();
+    atci_bench_execute(line, sizeof(line) - 1);
+    return since(start);
+}
+
+
+static uint32_t bench_printf(unsigned i)
+{
+    uint32_t start = cycles();
+    atci_printf("+EVENT=%d,%d" ATCI_EOL, 1, i);
+    return since(start);
+}
+
+
+static uint8_t data[64];
+static char hex[sizeof(data) * 2];
+
+static uint32_t bench_hex_encode(unsigned i)
+{
+    (void)i;
+    uint32_t start = cycles();
+    atci_print_buffer_as_hex(data, sizeof(data));
+    return since(start);
+}
+
+
+static uint32_t bench_hex_decode(unsigned i)
+{
+    (void)i;
+    atci_param_t param = { .txt = hex, .length = sizeof(hex), .offset = 0 };
+    uint32_t start = cycles();
+    atci_param_get_buffer_from_hex(&param, data, sizeof(data), 0);
+    return since(start);
+}
+
+
+static char cbuf_buffer[256];
+static cbuf_t cbuf;
+
+static uint32_t bench_cbuf_put(unsigned i)
+{
+    uint32_t start;
+
+    // Let the indices wrap around over the iterations
+    if (cbuf_space(&cbuf) < 16) cbuf_consume(&cbuf, cbuf_length(&cbuf));
+    (void)i;
+    start = cycles();
+    cbuf_put(&cbuf, data, 16);
+    return since(start);
+}
+
+
+static uint32_t bench_cbuf_get(unsigned i)
+{
+    uint8_t buf[16];
+    uint32_t start;
+
+    (void)i;
+    cbuf_put(&cbuf, data, sizeof(buf));
+    start = cycles();
+    cbuf_get(&cbuf, buf, sizeof(buf));
+    return since(start);
+}
+
+
+// A single-byte read, as done by the debug USART TXE interrupt for every
+// character. Copies of up to four bytes are done inline in cbuf.c.
+static uint32_t bench_cbuf_get_1(unsigned i)
+{
+    uint8_t c;
+    uint32_t start;
+
+    (void)i;
+    cbuf_put(&cbuf, data, 1);
+    start = cycles();
+    cbuf_get(&cbuf, &c, 1);
+    return since(start);
+}
+
+
+// A read of the SX1276 version register, which is not shadowed, so every
+// access goes to the bus
+static uint32_t bench_spi_reg(unsigned i)
+{
+    (void)i;
+    uint32_t start = cycles();
+    SX1276Read(REG_VERSION);
+    return since(start);
+}
+
+
+// A FIFO-sized block clocked out with NSS high, so the radio ignores it. The
+// block is moved by DMA in spi_transfer and, for comparison, byte by byte with
+// SpiInOut, which is what the radio driver used to do for the FIFO.
+static uint8_t spi_block[64];
+
+static uint32_t bench_spi_dma(unsigned i)
+{
+    (void)i;
+    uint32_t start = cycles();
+    spi_transfer(&SX1276.Spi, spi_block, NULL, sizeof(spi_block));
+    return since(start);
+}
+
+
+static uint32_t bench_spi_bytes(unsigned i)
+{
+    (void)i;
+    uint32_t start = cycles();
+    for (unsigned j = 0; j < sizeof(spi_block); j++) SpiInOut(&SX1276.Spi, spi_block[j]);
+    return since(start);
+}
+
+
+// The EEPROM benchmarks write into the last word of the EEPROM and restore its
+// original content afterwards. Every iteration writes a different value,
+// since eeprom_write skips writes that would not change the memory.
+static uint32_t eeprom_address;
+static uint8_t eeprom_saved[4];
+
+static uint32_t bench_eeprom_byte(unsigned i)
+{
+    uint8_t v = eeprom_saved[0] ^ (i + 1);
+    uint32_t start = cycles();
+    eeprom_write(eeprom_address, &v, sizeof(v));
+    return since(start);
+}
+
+
+static uint32_t bench_eeprom_word(unsigned i)
+{
+    uint32_t v, start;
+
+    memcpy(&v, eeprom_saved, sizeof(v));
+    v ^= 0x01010101UL * (i + 1);
+    start = cycles();
+    eeprom_write(eeprom_address, &v, sizeof(v));
+    return since(start);
+}
+
+
+static uint32_t bench_part_find(unsigned i)
+{
+    part_t part;
+    uint32_t start;
+
+    (void)i;
+    if (nvm_parts.journal.block == NULL) return 0;
+
+    // The journal is the last partition created by nvm_init, i.e., the worst
+    // case for the linear search through the partition table
+    start = cycles();
+    part_find(&part, nvm_parts.journal.block, "journal");
+    return since(start);
+}
+
+
+// Programs the RTC alarm directly, bypassing the timer server. The alarm of
+// the timer server is restored by the timer benchmarks that follow, since
+// starting and stopping a timer reprograms it.
+static uint32_t bench_rtc_alarm(unsigned i)
+{
+    uint32_t start;
+
+    (void)i;
+    rtc_set_timer_context();
+    start = cycles();
+    rtc_set_alarm(rtc_ms2tick(60000));
+    return since(start);
+}
+
+
+static TimerEvent_t timer;
+
+static void on_timer(void *ctx)
+{
+    (void)ctx;
+}
+
+
+static uint32_t bench_timer_start(unsigned i)
+{
+    (void)i;
+    uint32_t start = cycles();
+    TimerStart(&timer);
+    start = since(start);
+    TimerStop(&timer);
+    return start;
+}
+
+
+static uint32_t bench_timer_stop(unsigned i)
+{
+    (void)i;
+    TimerStart(&timer);
+    uint32_t start = cycles();
+    TimerStop(&timer);
+    return since(start);
+}
+
+
+// The largest LoRaWAN frame payload. FRMPayload encryption runs AES over whole
+// blocks, so the encryption benchmark processes 16 blocks (256 bytes).
+#define FRAME_SIZE 242
+static uint8_t frame[256];
+
+static uint32_t bench_cmac_frame(unsigned i)
+{
+    uint32_t cmac, start;
+
+    (void)i;
+    start = cycles();
+    SecureElementComputeAesCmac(NULL, frame, FRAME_SIZE, F_NWK_S_INT_KEY, &cmac);
+    return since(start);
+}
+
+
+static uint32_t bench_encrypt_frame(unsigned i)
+{
+    uint32_t start;
+
+    (void)i;
+    start = cycles();
+    SecureElementAesEncrypt(frame, sizeof(frame), APP_S_KEY, frame);
+    return since(start);
+}
+
+
+// The checksum of an NVM block, computed in software or by the CRC unit
+// (CRC_HW)
+static uint32_t bench_block_crc(unsigned i)
+{
+    uint32_t start;
+
+    (void)i;
+    start = cycles();
+    check_block_crc(frame, sizeof(frame));
+    return since(start);
+}
+
+
+static uint32_t bench_aes_cmac(unsigned i)
+{
+    uint32_t cmac, start;
+
+    (void)i;
+    start = cycles();
+    SecureElementComputeAesCmac(NULL, data, 32, F_NWK_S_INT_KEY, &cmac);
+    return since(start);
+}
+
+
+// A single conversion of the internal voltage reference, including the
+// sampling time
+static uint32_t bench_adc_read(unsigned i)
+{
+    (void)i;
+    uint32_t start = cycles();
+    adc_get_value(ADC_CHANNEL_VREFINT);
+    return since(start);
+}
+
+
+static const struct {
+    const char *name;
+    uint16_t iterations;
+    uint32_t (*run)(unsigned i);
+    bool mute;
+} suite[BENCH_COUNT] = {
+    { "dispatch",    ITERATIONS,        bench_dispatch,      true  },
+    { "printf",      ITERATIONS,        bench_printf,        true  },
+    { "hex_encode",  ITERATIONS,        bench_hex_encode,    true  },
+    { "hex_decode",  ITERATIONS,        bench_hex_decode,    false },
+    { "cbuf_put",    ITERATIONS,        bench_cbuf_put,      false },
+    { "cbuf_get",    ITERATIONS,        bench_cbuf_get,      false },
+    { "cbuf_get_1",  ITERATIONS,        bench_cbuf_get_1,    false },
+    { "eeprom_byte", EEPROM_ITERATIONS, bench_eeprom_byte,   false },
+    { "eeprom_word", EEPROM_ITERATIONS, bench_eeprom_word,   false },
+    { "part_find",   ITERATIONS,        bench_part_find,     false },
+    { "rtc_alarm",   ITERATIONS,        bench_rtc_alarm,     false },
+    { "timer_start", ITERATIONS,        bench_timer_start,   false },
+    { "timer_stop",  ITERATIONS,        bench_timer_stop,    false },
+    { "aes_cmac",    ITERATIONS,        bench_aes_cmac,      false },
+    { "cmac_242",    ITERATIONS,        bench_cmac_frame,    false },
+    { "encrypt_242", ITERATIONS,        bench_encrypt_frame, false },
+    { "crc_256",     ITERATIONS,        bench_block_crc,     false },
+    { "adc_read",    ITERATIONS,        bench_adc_read,      false },
+    { "spi_reg",     ITERATIONS,        bench_spi_reg,       false },
+    { "spi_dma_64",  ITERATIONS,        bench_spi_dma,       false },
+    { "spi_byte_64", ITERATIONS,        bench_spi_bytes,     false }
+};
+
+
+static void measure(bench_result_t *r, uint32_t (*run)(unsigned i), unsigned iterations)
+{
+    uint32_t v;
+
+    r->iterations = iterations;
+    r->min = UINT32_MAX;
+    r->max = 0;
+    r->total = 0;
+
+    for (unsigned i = 0; i < iterations; i++) {
+        v = run(i);
+        if (v < r->min) r->min = v;
+        if (v > r->max) r->max = v;
+        r->total += v;
+    }
+}
+
+
+unsigned bench_run(bench_result_t *results)
+{
+    bench_result_t empty;
+    uint32_t ctrl, load;
+    unsigned i;
+
+    ctrl = SysTick->CTRL;
+    load = SysTick->LOAD;
+    SysTick->LOAD = SYSTICK_MAX;
+    SysTick->VAL = 0;
+    SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_ENABLE_Msk;
+
+    // The cost of reading the counter twice is subtracted from all results
+    overhead = 0;
+    measure(&empty, bench_empty, ITERATIONS);
+    overhead = empty.min;
+
+    for (i = 0; i < sizeof(data); i++) data[i] = i * 37;
+    memset(hex, 'A', sizeof(hex));
+    cbuf_init(&cbuf, cbuf_buffer, sizeof(cbuf_buffer));
+    TimerInit(&timer, on_timer);
+    TimerSetValue(&timer, 1000);
+    eeprom_address = eeprom_get_size() - sizeof(eeprom_saved);
+    eeprom_read(eeprom_address, eeprom_saved, sizeof(eeprom_saved));
+
+    for (i = 0; i < BENCH_COUNT; i++) {
+        results[i].name = suite[i].name;
+        lpuart_mute = suite[i].mute;
+        measure(&results[i], suite[i].run, suite[i].iterations);
+        lpuart_mute = false;
+    }
+
+    eeprom_write(eeprom_address, eeprom_saved, sizeof(eeprom_saved));
+
+    SysTick->CTRL = ctrl;
+    SysTick->LOAD = load;
+    return BENCH_COUNT;
+}
+
+#endif // BENCH
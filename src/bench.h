@@ -0,0 +1,29 @@
+#ifndef _BENCH_H
+#define _BENCH_H
+
+#include <stdint.h>
+
+//! @brief Number of benchmarks in the suite
+#define BENCH_COUNT 21
+
+//! @brief The result of a single benchmark. All times are in CPU cycles.
+typedef struct
+{
+    const char *name;
+    uint16_t iterations;
+    uint32_t min;
+    uint32_t max;
+    uint32_t total;
+} bench_result_t;
+
+#if BENCH == 1
+
+//! @brief Run the benchmark suite. Must be invoked from the main loop.
+//! @param[out] results Destination buffer with room for BENCH_COUNT results
+//! @retval Number of results written to results
+
+unsigned bench_run(bench_result_t *results);
+
+#endif // BENCH
+
+#endif // _BENCH_H
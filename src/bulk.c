@@ -0,0 +1,623 @@
+#include "bulk.h"
+#include <string.h>
+#include <loramac-node/src/radio/radio.h>
+#include <LoRaWAN/Utilities/timeServer.h>
+#include "p2p.h"
+#include "lrw.h"
+#include "atci.h"
+#include "cbuf.h"
+#include "cmd.h"
+#include "lpuart.h"
+#include "nvm.h"
+#include "rtc.h"
+#include "irq.h"
+#include "system.h"
+#include "log.h"
+
+
+// The maximum number of frames in flight. Must be smaller than 128 for the
+// 8-bit sequence numbers to stay unambiguous.
+#ifndef BULK_WINDOW
+#define BULK_WINDOW 8
+#endif
+
+// The size of the FIFO between AT$BULKTX and the radio (a power of two). Data
+// stays in the FIFO until it has been acknowledged, so the FIFO should hold at
+// least BULK_WINDOW full frames.
+#ifndef BULK_TX_FIFO_SIZE
+#define BULK_TX_FIFO_SIZE 1024
+#endif
+
+// The number of received frames kept until the main loop processes them
+#ifndef BULK_RX_QUEUE_SIZE
+#define BULK_RX_QUEUE_SIZE 4
+#endif
+
+// Give up after this many consecutive bursts without any progress
+#define MAX_RETRIES 8
+
+// Preamble length in bytes
+#define PREAMBLE 5
+
+// The SX1276 FSK receiver bandwidth (single side) must fit between 2.6 and 250 kHz
+#define MIN_RX_BANDWIDTH 2600
+#define MAX_RX_BANDWIDTH 250000
+
+// The time the receiver may take to notice a polled frame in its main loop and
+// turn the radio around, on top of the time on air of the acknowledgement (ms)
+#define ACK_MARGIN 20
+
+// A transmission that has not completed this many milliseconds after its time
+// on air is reported as timed out
+#define TX_TIMEOUT_MARGIN 100
+
+// Frame header: type (with the poll flag), session, and sequence number
+#define HEADER_SIZE 3
+#define FRAME_SIZE (HEADER_SIZE + BULK_FRAME_DATA)
+
+enum frame_type {
+    FRAME_DATA = 0,
+    FRAME_END  = 1,  // End of stream, numbered and acknowledged like data
+    FRAME_ACK  = 2   // Carries the sequence number the receiver expects next
+};
+
+// Set in the type of the last frame of a burst to request an acknowledgement
+#define FRAME_POLL 0x80
+
+enum radio_event {
+    EVENT_NONE = 0,
+    EVENT_TX_DONE,
+    EVENT_TX_TIMEOUT,
+    EVENT_RX_DONE,
+    EVENT_RX_FAILED
+};
+
+typedef struct {
+    uint8_t length;
+    uint8_t data[FRAME_SIZE];
+} rx_frame_t;
+
+static bulk_config_t config = {
+    .frequency = 0,
+    .bitrate = 150000,
+    .fdev = 50000,
+    .power = 14
+};
+
+static char tx_fifo_buffer[BULK_TX_FIFO_SIZE];
+static cbuf_t tx_fifo;
+
+static struct {
+    bool active;          // The radio has been claimed for an outgoing stream
+    bool ending;          // The host has closed the stream with AT$BULKEND
+    bool end_in_flight;   // The END frame has been sent and not acknowledged yet
+    bool transmitting;    // A frame is on air
+    bool waiting;         // Waiting for an acknowledgement
+    bool polled;          // The frame on air requests an acknowledgement
+    uint8_t session;
+    uint8_t base;         // The oldest unacknowledged frame
+    uint8_t next;         // The next frame to be sent
+    uint8_t retries;
+    uint8_t length[BULK_WINDOW];  // Data bytes in each frame in flight
+    size_t offset;        // Position of the next frame's data in the FIFO
+    uint32_t started;     // RTC time of the first frame in ms
+    uint8_t ack[HEADER_SIZE];
+    uint8_t ack_length;
+} tx;
+
+static struct {
+    bool enabled;
+    bool synced;          // A session has been started with frame zero
+    bool transmitting;    // An acknowledgement is on air
+    bool ack_pending;
+    uint8_t session;
+    uint8_t expected;     // The next frame to be delivered to the host
+    uint8_t ack_session;
+    uint8_t ack_seq;
+    uint32_t started;
+} rx;
+
+static struct {
+    rx_frame_t slot[BULK_RX_QUEUE_SIZE];
+    uint8_t head;
+    uint8_t count;
+} rx_queue;
+
+static bulk_stats_t tx_stats, rx_stats;
+static volatile uint8_t radio_event;
+
+
+static void on_tx_done(void)
+{
+    radio_event = EVENT_TX_DONE;
+    system_post(SYSTEM_TASK_LORA);
+}
+
+
+static void on_tx_timeout(void)
+{
+    radio_event = EVENT_TX_TIMEOUT;
+    system_post(SYSTEM_TASK_LORA);
+}
+
+
+static void on_rx_done(uint8_t *payload, uint16_t size, int16_t rssi, int8_t snr)
+{
+    rx_frame_t *f;
+    (void)rssi;
+    (void)snr;
+
+    if (tx.active) {
+        tx.ack_length = size > HEADER_SIZE ? HEADER_SIZE : size;
+        memcpy(tx.ack, payload, tx.ack_length);
+        radio_event = EVENT_RX_DONE;
+    } else if (size <= FRAME_SIZE) {
+        // Frames that do not fit into the queue are lost and will be
+        // retransmitted by the sender
+        if (rx_queue.count == BULK_RX_QUEUE_SIZE) {
+            rx_stats.repeated++;
+        } else {
+            f = &rx_queue.slot[(rx_queue.head + rx_queue.count) % BULK_RX_QUEUE_SIZE];
+            f->length = size;
+            memcpy(f->data, payload, size);
+            rx_queue.count++;
+        }
+    }
+    system_post(SYSTEM_TASK_LORA);
+}
+
+
+static void on_rx_failed(void)
+{
+    if (tx.active) {
+        radio_event = EVENT_RX_FAILED;
+        system_post(SYSTEM_TASK_LORA);
+    } else if (rx.enabled && !rx.transmitting) {
+        // Continuous reception does not time out, but restart it just in case
+        Radio.Rx(0);
+    }
+}
+
+
+static const RadioEvents_t events = {
+    .TxDone = on_tx_done,
+    .TxTimeout = on_tx_timeout,
+    .RxDone = on_rx_done,
+    .RxTimeout = on_rx_failed,
+    .RxError = on_rx_failed
+};
+
+
+static uint32_t rx_bandwidth(const bulk_config_t *c)
+{
+    uint32_t bw = c->fdev + c->bitrate / 2;
+    return bw < MIN_RX_BANDWIDTH ? MIN_RX_BANDWIDTH : bw;
+}
+
+
+static uint32_t time_on_air(size_t length)
+{
+    return Radio.TimeOnAir(MODEM_FSK, 0, config.bitrate, 0, PREAMBLE, false, length, true);
+}
+
+
+static void configure_radio(bool continuous)
+{
+    uint32_t bw = rx_bandwidth(&config);
+
+    Radio.Standby();
+    Radio.SetChannel(config.frequency);
+    Radio.SetMaxPayloadLength(MODEM_FSK, FRAME_SIZE);
+    Radio.SetTxConfig(MODEM_FSK, config.power, config.fdev, 0, config.bitrate, 0,
+        PREAMBLE, false, true, false, 0, false, time_on_air(FRAME_SIZE) + TX_TIMEOUT_MARGIN);
+    Radio.SetRxConfig(MODEM_FSK, bw, config.bitrate, 0, bw, PREAMBLE, 0, false, 0,
+        true, false, 0, false, continuous);
+}
+
+
+static uint8_t take_event(void)
+{
+    uint32_t mask = disable_irq();
+    uint8_t ev = radio_event;
+    radio_event = EVENT_NONE;
+    reenable_irq(mask);
+    return ev;
+}
+
+
+void bulk_init(void)
+{
+    cbuf_init(&tx_fifo, tx_fifo_buffer, sizeof(tx_fifo_buffer));
+}
+
+
+void bulk_get_config(bulk_config_t *dst)
+{
+    *dst = config;
+}
+
+
+int bulk_set_config(const bulk_config_t *src)
+{
+    if (tx.active || rx.enabled) return LORAMAC_STATUS_BUSY;
+    if (src->bitrate < 1200 || src->bitrate > 300000) return LORAMAC_STATUS_PARAMETER_INVALID;
+    if (src->fdev < 600 || src->fdev > 200000) return LORAMAC_STATUS_PARAMETER_INVALID;
+    if (rx_bandwidth(src) > MAX_RX_BANDWIDTH) return LORAMAC_STATUS_PARAMETER_INVALID;
+    if (!Radio.CheckRfFrequency(src->frequency)) return LORAMAC_STATUS_FREQUENCY_INVALID;
+
+    config = *src;
+    return LORAMAC_STATUS_OK;
+}
+
+
+static int start_tx(void)
+{
+    int rc;
+
+    if (tx.active) return LORAMAC_STATUS_OK;
+    if (rx.enabled) return LORAMAC_STATUS_BUSY;
+    if (config.frequency == 0) return LORAMAC_STATUS_PARAMETER_INVALID;
+
+    rc = p2p_claim(&events);
+    if (rc != LORAMAC_STATUS_OK) return rc;
+
+    memset(&tx, 0, sizeof(tx));
+    memset(&tx_stats, 0, sizeof(tx_stats));
+    radio_event = EVENT_NONE;
+
+    // A random session number lets the receiver tell a new stream from
+    // retransmissions of the previous one
+    tx.session = Radio.Random();
+    configure_radio(false);
+    tx.active = true;
+    log_debug("Bulk: Session %d started", tx.session);
+    return LORAMAC_STATUS_OK;
+}
+
+
+static void finish_tx(unsigned int status)
+{
+    cbuf_consume(&tx_fifo, cbuf_length(&tx_fifo));
+    tx.active = false;
+    p2p_release();
+    log_debug("Bulk: Session %d finished: %lu bytes in %lu ms", tx.session,
+        tx_stats.bytes, tx_stats.elapsed);
+    cmd_event(CMD_EVENT_P2P, status);
+}
+
+
+size_t bulk_tx_space(void)
+{
+    return tx.ending ? 0 : cbuf_space(&tx_fifo);
+}
+
+
+int bulk_write(const void *buffer, size_t length)
+{
+    int rc;
+
+    if (tx.ending) return LORAMAC_STATUS_BUSY;
+    if (length > cbuf_space(&tx_fifo)) return LORAMAC_STATUS_BUSY;
+
+    rc = start_tx();
+    if (rc != LORAMAC_STATUS_OK) return rc;
+
+    cbuf_put(&tx_fifo, buffer, length);
+    system_post(SYSTEM_TASK_LORA);
+    return LORAMAC_STATUS_OK;
+}
+
+
+int bulk_end(void)
+{
+    int rc;
+
+    if (tx.ending) return LORAMAC_STATUS_BUSY;
+
+    // Closing a stream that has not been started sends an empty one
+    rc = start_tx();
+    if (rc != LORAMAC_STATUS_OK) return rc;
+
+    tx.ending = true;
+    system_post(SYSTEM_TASK_LORA);
+    return LORAMAC_STATUS_OK;
+}
+
+
+bool bulk_sending(void)
+{
+    return tx.active;
+}
+
+
+// Copy data from the given position in the FIFO without consuming it
+static void peek_fifo(void *dst, size_t offset, size_t length)
+{
+    cbuf_view_t v;
+
+    cbuf_head(&tx_fifo, &v);
+    if (offset < v.len[0]) {
+        v.ptr[0] += offset;
+        v.len[0] -= offset;
+    } else {
+        offset -= v.len[0];
+        v.ptr[0] = v.ptr[1] + offset;
+        v.len[0] = v.len[1] - offset;
+        v.len[1] = 0;
+    }
+    cbuf_copy_out(dst, &v, length);
+}
+
+
+static void go_back(void)
+{
+    tx_stats.repeated += (uint8_t)(tx.next - tx.base);
+    tx.next = tx.base;
+    tx.offset = 0;
+    tx.end_in_flight = false;
+}
+
+
+static void retry(void)
+{
+    if (++tx.retries > MAX_RETRIES) {
+        log_debug("Bulk: No acknowledgement from the receiver");
+        finish_tx(CMD_P2P_BULK_TX_FAILED);
+        return;
+    }
+    go_back();
+}
+
+
+static void process_ack(void)
+{
+    uint8_t n, outstanding = tx.next - tx.base;
+
+    if (tx.ack_length < HEADER_SIZE || tx.ack[0] != FRAME_ACK || tx.ack[1] != tx.session) {
+        retry();
+        return;
+    }
+
+    // A receiver that makes no progress, e.g., because its host does not read
+    // the data, eventually fails the transfer
+    n = tx.ack[2] - tx.base;
+    if (n == 0 || n > outstanding) {
+        retry();
+        return;
+    }
+
+    tx.retries = 0;
+    while (n--) {
+        size_t len = tx.length[tx.base % BULK_WINDOW];
+        cbuf_consume(&tx_fifo, len);
+        tx.offset -= len;
+        tx_stats.bytes += len;
+        tx.base++;
+    }
+    tx_stats.elapsed = rtc_tick2ms(rtc_get_timer_value()) - tx.started;
+
+    if (tx.base == tx.next && tx.end_in_flight) {
+        finish_tx(CMD_P2P_BULK_TX_DONE);
+        return;
+    }
+
+    // The receiver has seen the polled frame, so frames it has not
+    // acknowledged were lost
+    if (tx.base != tx.next) go_back();
+}
+
+
+static void send_next(void)
+{
+    uint8_t frame[FRAME_SIZE];
+    size_t avail, len;
+    bool end;
+
+    avail = cbuf_length(&tx_fifo) - tx.offset;
+
+    // Wait for more data from the host
+    if (avail == 0 && !tx.ending) return;
+
+    len = avail > BULK_FRAME_DATA ? BULK_FRAME_DATA : avail;
+    end = avail == 0;
+
+    frame[0] = end ? FRAME_END : FRAME_DATA;
+    frame[1] = tx.session;
+    frame[2] = tx.next;
+    peek_fifo(frame + HEADER_SIZE, tx.offset, len);
+
+    tx.length[tx.next % BULK_WINDOW] = len;
+    tx.offset += len;
+    tx.next++;
+    if (end) tx.end_in_flight = true;
+
+    // Request an acknowledgement once the window is full or the data runs
+    // out. A closed stream is polled with the END frame instead.
+    tx.polled = end || (uint8_t)(tx.next - tx.base) == BULK_WINDOW
+        || (!tx.ending && tx.offset == cbuf_length(&tx_fifo));
+    if (tx.polled) frame[0] |= FRAME_POLL;
+
+    if (tx_stats.frames++ == 0) tx.started = rtc_tick2ms(rtc_get_timer_value());
+    tx.transmitting = true;
+    Radio.Send(frame, HEADER_SIZE + len);
+}
+
+
+static void tx_process(void)
+{
+    switch (take_event()) {
+        case EVENT_TX_DONE:
+            tx.transmitting = false;
+            if (tx.polled) {
+                tx.waiting = true;
+                Radio.Rx(time_on_air(HEADER_SIZE) + ACK_MARGIN);
+            }
+            break;
+
+        case EVENT_TX_TIMEOUT:
+            tx.transmitting = false;
+            retry();
+            break;
+
+        case EVENT_RX_DONE:
+            tx.waiting = false;
+            process_ack();
+            break;
+
+        case EVENT_RX_FAILED:
+            tx.waiting = false;
+            retry();
+            break;
+
+        default:
+            break;
+    }
+
+    if (tx.active && !tx.transmitting && !tx.waiting) send_next();
+}
+
+
+int bulk_receive(bool enable)
+{
+    int rc;
+
+    if (!enable) {
+        if (rx.enabled) {
+            rx.enabled = false;
+            p2p_release();
+        }
+        return LORAMAC_STATUS_OK;
+    }
+
+    if (rx.enabled) return LORAMAC_STATUS_OK;
+    if (tx.active) return LORAMAC_STATUS_BUSY;
+    if (config.frequency == 0) return LORAMAC_STATUS_PARAMETER_INVALID;
+
+    rc = p2p_claim(&events);
+    if (rc != LORAMAC_STATUS_OK) return rc;
+
+    memset(&rx, 0, sizeof(rx));
+    radio_event = EVENT_NONE;
+    configure_radio(true);
+    rx.enabled = true;
+    Radio.Rx(0);
+    return LORAMAC_STATUS_OK;
+}
+
+
+bool bulk_receiving(void)
+{
+    return rx.enabled;
+}
+
+
+void bulk_get_stats(bool incoming, bulk_stats_t *dst)
+{
+    uint32_t mask = disable_irq();
+    *dst = incoming ? rx_stats : tx_stats;
+    reenable_irq(mask);
+}
+
+
+static bool have_output_space(size_t length)
+{
+    if (atci_is_framed()) length = 2 * length + 8;
+    if (length > lpuart_tx_fifo.max_length) length = lpuart_tx_fifo.max_length;
+    return cbuf_space(&lpuart_tx_fifo) >= length;
+}
+
+
+// Deliver a frame to the host if it is the next one in order and there is room
+// for it. Everything else is discarded and left to the sender to retransmit.
+static void process_frame(const rx_frame_t *f)
+{
+    uint8_t type, session, seq;
+    int len;
+
+    if (f->length < HEADER_SIZE) return;
+
+    type = f->data[0] & ~FRAME_POLL;
+    session = f->data[1];
+    seq = f->data[2];
+    len = f->length - HEADER_SIZE;
+    if (type != FRAME_DATA && type != FRAME_END) return;
+
+    rx_stats.frames++;
+
+    if ((!rx.synced || session != rx.session) && seq == 0) {
+        rx.synced = true;
+        rx.session = session;
+        rx.expected = 0;
+        rx.started = rtc_tick2ms(rtc_get_timer_value());
+        memset(&rx_stats, 0, sizeof(rx_stats));
+        rx_stats.frames = 1;
+    }
+
+    if (rx.synced && session == rx.session && seq == rx.expected) {
+        if (type == FRAME_END) {
+            rx.expected++;
+            rx_stats.elapsed = rtc_tick2ms(rtc_get_timer_value()) - rx.started;
+            cmd_event(CMD_EVENT_P2P, CMD_P2P_BULK_RX_DONE);
+        } else if (have_output_space(20 + (sysconf.data_format ? 2 : 1) * len)) {
+            // +BULKRX=lll, two blank lines, the data, and CRLF
+            atci_frame_open(0);
+            atci_printf("+BULKRX=%d\r\n\r\n", len);
+            if (sysconf.data_format) {
+                atci_print_buffer_as_hex(f->data + HEADER_SIZE, len);
+            } else {
+                atci_write((const char *)f->data + HEADER_SIZE, len);
+            }
+            atci_write("\r\n", 2);
+            atci_frame_close();
+            rx.expected++;
+            rx_stats.bytes += len;
+        } else {
+            rx_stats.repeated++;
+        }
+    } else {
+        rx_stats.repeated++;
+    }
+
+    if (f->data[0] & FRAME_POLL) {
+        rx.ack_pending = true;
+        rx.ack_session = session;
+        rx.ack_seq = rx.synced && session == rx.session ? rx.expected : 0;
+    }
+}
+
+
+static void rx_process(void)
+{
+    uint8_t ack[HEADER_SIZE];
+    uint32_t mask;
+
+    if (take_event() == EVENT_TX_DONE && rx.transmitting) {
+        rx.transmitting = false;
+        if (rx.enabled) Radio.Rx(0);
+    }
+
+    while (rx_queue.count) {
+        if (rx.enabled) process_frame(&rx_queue.slot[rx_queue.head]);
+
+        mask = disable_irq();
+        rx_queue.head = (rx_queue.head + 1) % BULK_RX_QUEUE_SIZE;
+        rx_queue.count--;
+        reenable_irq(mask);
+    }
+
+    if (rx.enabled && rx.ack_pending && !rx.transmitting) {
+        rx.ack_pending = false;
+        ack[0] = FRAME_ACK;
+        ack[1] = rx.ack_session;
+        ack[2] = rx.ack_seq;
+        rx.transmitting = true;
+        Radio.Send(ack, sizeof(ack));
+    }
+}
+
+
+void bulk_process(void)
+{
+    if (tx.active) tx_process();
+    else rx_process();
+}
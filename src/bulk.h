@@ -0,0 +1,106 @@
+#ifndef _BULK_H
+#define _BULK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+//! @brief The largest number of data bytes carried by a single bulk frame
+#ifndef BULK_FRAME_DATA
+#define BULK_FRAME_DATA 128
+#endif
+
+//! @brief FSK bulk transfer link parameters
+typedef struct
+{
+    uint32_t frequency;  // Hz, 0 until configured
+    uint32_t bitrate;    // bps, 1200-300000
+    uint32_t fdev;       // Frequency deviation in Hz
+    int8_t power;        // Transmission power in dBm
+} bulk_config_t;
+
+//! @brief Statistics of the current or last bulk transfer in either direction
+typedef struct
+{
+    uint32_t bytes;      // Data bytes acknowledged (sender) or delivered (receiver)
+    uint32_t frames;     // Frames transmitted (sender) or received (receiver)
+    uint32_t repeated;   // Frames retransmitted (sender) or discarded (receiver)
+    uint32_t elapsed;    // Time from the first frame to the last acknowledgement in ms
+} bulk_stats_t;
+
+/*! @brief FSK bulk transfer
+ *
+ * The bulk transfer mode moves a stream of data between two nearby modems with
+ * high-rate FSK packets, e.g., to offload logs to a service tool. The host
+ * writes the stream into a FIFO with AT$BULKTX; the sender cuts it into
+ * numbered frames and keeps up to BULK_WINDOW of them in flight (go-back-N
+ * sliding window ARQ). The last frame of each burst requests an
+ * acknowledgement, which carries the number of the next frame the receiver
+ * expects. If the acknowledgement does not arrive in time, the sender goes
+ * back to the oldest unacknowledged frame.
+ *
+ * The receiver only accepts frames in order and only if there is room for
+ * their data in the LPUART TX FIFO, so a slow host throttles the sender
+ * through retransmissions. Delivered data is written to the host as
+ * +BULKRX=<length> followed by the data, like +P2PRX.
+ *
+ * The bulk transfer claims the radio from the P2P engine (see p2p_claim), so
+ * LoRaWAN and P2P LoRa are unavailable until the stream ends or reception is
+ * disabled.
+ */
+
+//! @brief Initialize the bulk transfer. Invoked from lrw_init.
+
+void bulk_init(void);
+
+//! @brief Get the link parameters
+//! @param[out] config Destination
+
+void bulk_get_config(bulk_config_t *config);
+
+//! @brief Set the link parameters. Fails while a transfer is in progress.
+//! @return Zero on success, a @c LoRaMacStatus_t value on error
+
+int bulk_set_config(const bulk_config_t *config);
+
+//! @brief Return the number of bytes that can be appended to the stream
+
+size_t bulk_tx_space(void);
+
+//! @brief Append data to the outgoing stream, starting a transfer if idle
+//! @return Zero on success, a @c LoRaMacStatus_t value on error
+
+int bulk_write(const void *buffer, size_t length);
+
+//! @brief Close the outgoing stream. The transfer ends with +EVENT=11,3 once
+//! the receiver has acknowledged all data, or with +EVENT=11,4 if it stops
+//! responding.
+//! @return Zero on success, a @c LoRaMacStatus_t value on error
+
+int bulk_end(void);
+
+//! @brief Return true if an outgoing transfer is in progress
+
+bool bulk_sending(void);
+
+//! @brief Start or stop FSK bulk reception
+//! @return Zero on success, a @c LoRaMacStatus_t value on error
+
+int bulk_receive(bool enable);
+
+//! @brief Return true if bulk reception is enabled
+
+bool bulk_receiving(void);
+
+//! @brief Get the statistics of the outgoing or incoming transfer
+//! @param[in] rx Select the incoming (true) or outgoing (false) transfer
+//! @param[out] stats Destination
+
+void bulk_get_stats(bool rx, bulk_stats_t *stats);
+
+//! @brief Transmit the next frames, process acknowledgements, and deliver
+//! received data to the host. Invoked from lrw_process.
+
+void bulk_process(void);
+
+#endif // _BULK_H
@@ -8,13 +8,20 @@
  *
  * This data structure can be used to implement a fixed-size first-in, first-out
  * (FIFO) or queue that can store up to @p max_length bytes.
+ *
+ * The buffer is safe for a single producer and a single consumer running in
+ * different contexts, e.g., the main thread and an interrupt handler, without
+ * disabling interrupts. The producer only modifies the write index and the
+ * consumer only modifies the read index. Both indices run freely and are
+ * reduced to a position in the buffer with a mask, hence the size of the
+ * backing memory must be a power of two.
  */
 typedef struct cbuf {
     char *buffer;
-    size_t max_length;  //! Maximum length of the circular buffer in bytes
-    size_t length;      //! The number of bytes stored in the circular buffer
-    size_t read;        //! The index of the first byte
-    size_t write;       //! The index of the first empty element (if length > 0)
+    size_t max_length;  //! Size of the circular buffer in bytes (a power of two)
+    size_t read;        //! Free-running index of the first byte (consumer)
+    size_t write;       //! Free-running index of the first empty element (producer)
+    size_t peak;        //! Largest number of bytes stored, see cbuf_produce
 } cbuf_t;
 
 
@@ -36,18 +43,41 @@ typedef struct cbuf_view {
  *
  * @param[in] queue A pointer to the circular buffer to be initialized
  * @param[in] buffer A pointer to the memory buffer to back the circular buffer
- * @param[in] size The size of the memory buffer in bytes
+ * @param[in] size The size of the memory buffer in bytes (a power of two)
  */
 void cbuf_init(volatile cbuf_t *cbuf, void *buffer, size_t size);
 
 
+/*! @brief Return the number of bytes stored in @p cbuf
+ *
+ * Thread-safe: yes
+ * Running time: constant
+ */
+static inline size_t cbuf_length(const volatile cbuf_t *cbuf)
+{
+    return cbuf->write - cbuf->read;
+}
+
+
+/*! @brief Return the number of free bytes in @p cbuf
+ *
+ * Thread-safe: yes
+ * Running time: constant
+ */
+static inline size_t cbuf_space(const volatile cbuf_t *cbuf)
+{
+    return cbuf->max_length - cbuf_length(cbuf);
+}
+
+
 /*! @brief Return a view representing free space at the end of @p cbuf
  *
  * This function can be used to obtain a view of the empty space (if any) at the
  * end of the circular buffer. The view can be used to append data. The function
  * returns the same pointer that is passed to it via @p tail .
  *
- * Thread-safe: no Running time: constant
+ * Thread-safe: yes, when invoked by the single producer
+ * Running time: constant
  *
  * @param[in] cbuf A pointer to the circular buffer
  * @param[in] tail A pointer to a view variable to be filled
@@ -82,7 +112,11 @@ size_t cbuf_copy_in(const cbuf_view_t *tail, const void *data, size_t len);
  * memory buffer returned by cbuf_tail. The function returns the actual number
  * of bytes by which the circular buffer data was extended.
  *
- * Thread-safe: no Running time: constant
+ * The function also updates the peak length of the buffer. The peak can be
+ * reset by the application by writing zero to the peak field.
+ *
+ * Thread-safe: yes, when invoked by the single producer
+ * Running time: constant
  *
  * @param[in] cbuf A pointer to the circular buffer
  * @param[in] len The desired number of bytes to extend the queue with
@@ -99,7 +133,7 @@ size_t cbuf_produce(volatile cbuf_t *cbuf, size_t len);
  * function returns the number of appended bytes. The data from @p data is
  * copied into the internal buffer.
  *
- * Thread-safe: no
+ * Thread-safe: yes, when invoked by the single producer
  * Running time: linear with @p size
  *
  * @param[in] cbuf A pointer to the circular buffer
@@ -115,7 +149,7 @@ size_t cbuf_put(volatile cbuf_t *cbuf, const void *data, size_t len);
  * This function can be used to obtain a view into the data stored in the
  * circular buffer. The function returns the pointer passed to it via @p head .
  *
- * Thread-safe: no
+ * Thread-safe: yes, when invoked by the single consumer
  * Running time: constant
  *
  * @param[in] cbuf A pointer to the circular buffer
@@ -151,7 +185,8 @@ size_t cbuf_copy_out(void *buffer, const cbuf_view_t *head, size_t max_len);
  * function. The function returns the real number of bytes consumed from the
  * circular buffer.
  *
- * Thread-safe: no Running time: constant
+ * Thread-safe: yes, when invoked by the single consumer
+ * Running time: constant
  *
  * @param[in] cbuf A pointer to the circular buffer
  * @param[in] len The desired number of bytes to consume
@@ -168,7 +203,7 @@ size_t cbuf_consume(volatile cbuf_t *cbuf, size_t len);
  * retrieved if there is not enough data in the circular buffer. The function
  * returns the number of bytes retrieved.
  *
- * Thread-safe: no
+ * Thread-safe: yes, when invoked by the single consumer
  * Running time: linear with @p size
  *
  * @param[in] cbuf A pointer to the circular buffer
@@ -0,0 +1,257 @@
+#include "clocksync.h"
+
+#if CLOCK_SYNC == 1
+
+#include <string.h>
+#include <LoRaWAN/Utilities/timeServer.h>
+#include <LoRaWAN/Utilities/systime.h>
+#include <LoRaWAN/Utilities/utilities.h>
+#include "lrw.h"
+#include "rtc.h"
+#include "nvm.h"
+#include "system.h"
+#include "log.h"
+
+#define PACKAGE_ID      1
+#define PACKAGE_VERSION 1
+
+#define PACKAGE_VERSION_REQ              0x00
+#define APP_TIME_REQ                     0x01
+#define DEVICE_APP_TIME_PERIODICITY_REQ  0x02
+#define FORCE_DEVICE_RESYNC_REQ          0x03
+
+#define ANS_REQUIRED (1 << 4)
+
+// The interval between AppTimeReq attempts while answers are outstanding or
+// while the MAC cannot transmit (ms)
+#define RETRY_INTERVAL 30000
+
+// Periodic synchronization is randomized by up to this many milliseconds so
+// that devices configured at the same time do not transmit together
+#define PERIOD_JITTER 30000
+
+#define MAX_PERIOD 4000000
+
+#define CLOCKSYNC_TIMER_SLACK 1000
+
+// The drift of the RTC is only estimated from corrections that accumulated
+// over at least this many seconds. The corrections have a resolution of one
+// second, so shorter intervals would make the estimate too noisy.
+#define MIN_DRIFT_INTERVAL (4 * 3600)
+
+// Corrections larger than this are treated as a time step rather than drift
+#define MAX_DRIFT_CORRECTION 1000
+
+
+static struct {
+    uint8_t token;        // TokenReq of the next AppTimeReq
+    uint8_t left;         // Number of AppTimeReq uplinks still to be sent
+    bool due;             // Set by the timer, the uplink is sent from the main loop
+    bool ref_valid;
+    uint32_t ref;         // RTC time (s) right after the last applied correction
+    uint32_t syncs;
+    int32_t correction;
+} state;
+
+static TimerEvent_t timer;
+
+
+static void on_timer(void *ctx)
+{
+    (void)ctx;
+    state.due = true;
+    system_post(SYSTEM_TASK_LORA);
+}
+
+
+static void schedule(void)
+{
+    TimerStop(&timer);
+
+    if (state.left) {
+        TimerSetValue(&timer, RETRY_INTERVAL);
+    } else if (sysconf.clocksync_period) {
+        TimerSetValue(&timer, sysconf.clocksync_period * 1000 + randr(0, PERIOD_JITTER));
+    } else {
+        return;
+    }
+
+    TimerStart(&timer);
+}
+
+
+void clocksync_init(void)
+{
+    TimerInit(&timer, on_timer);
+    TimerSetSlack(&timer, CLOCKSYNC_TIMER_SLACK);
+
+    // The period and the calibration are kept in sysconf
+    if (sysconf.rtc_calibration) rtc_set_calibration(sysconf.rtc_calibration);
+    schedule();
+}
+
+
+void clocksync_poll(void)
+{
+    uint8_t req[6];
+    uint32_t t;
+
+    if (!state.due) return;
+    state.due = false;
+
+    if (state.left == 0) {
+        if (sysconf.clocksync_period == 0) return;
+        state.left = 1;
+    }
+
+    // DeviceTime is the GPS time of the device when the uplink is sent
+    t = SysTimeGet().Seconds - UNIX_GPS_EPOCH_OFFSET;
+    req[0] = APP_TIME_REQ;
+    memcpy(req + 1, &t, sizeof(t));
+    req[5] = (state.token & 0x0f) | ANS_REQUIRED;
+
+    if (lrw_send(CLOCKSYNC_PORT, req, sizeof(req), false, NULL) == 0) {
+        log_debug("clocksync: Sent AppTimeReq, token %d", state.token);
+        state.left--;
+    }
+
+    schedule();
+}
+
+
+void clocksync_request(unsigned int count)
+{
+    state.left = count;
+    state.due = true;
+    system_post(SYSTEM_TASK_LORA);
+}
+
+
+void clocksync_set_period(uint32_t period)
+{
+    if (period > MAX_PERIOD) period = MAX_PERIOD;
+    if (period != sysconf.clocksync_period) {
+        sysconf.clocksync_period = period;
+        sysconf_modified = true;
+    }
+    schedule();
+}
+
+
+// Estimate the relative frequency error of the RTC from the correction and the
+// time since the previous correction, and adjust the RTC smooth calibration by
+// half of it. The RTC runs slow if the correction is positive.
+static void update_drift(int32_t correction, uint32_t now)
+{
+    int32_t elapsed, delta;
+
+    if (!state.ref_valid) return;
+
+    elapsed = now - state.ref;
+    if (elapsed < MIN_DRIFT_INTERVAL) return;
+    if (correction > MAX_DRIFT_CORRECTION || correction < -MAX_DRIFT_CORRECTION) return;
+
+    // The calibration unit is 2^-20, halved for the gain of 1/2
+    delta = correction * (1 << 19) / elapsed;
+    if (delta == 0) return;
+
+    log_info("clocksync: %ld s over %ld s, adjusting RTC calibration by %ld",
+        correction, elapsed, delta);
+    rtc_set_calibration(rtc_get_calibration() + delta);
+    sysconf.rtc_calibration = rtc_get_calibration();
+    sysconf_modified = true;
+}
+
+
+static void app_time_ans(const uint8_t *p)
+{
+    int32_t correction;
+    SysTime_t now;
+
+    if ((p[4] & 0x0f) != state.token) {
+        log_debug("clocksync: Ignoring AppTimeAns with token %d", p[4] & 0x0f);
+        return;
+    }
+
+    memcpy(&correction, p, sizeof(correction));
+    now = SysTimeGet();
+
+    // A zero correction leaves the reference in place, so that the next
+    // non-zero correction is measured over a longer interval
+    if (correction != 0 || !state.ref_valid) {
+        update_drift(correction, now.Seconds);
+        now.Seconds += correction;
+        SysTimeSet(now);
+        state.ref = now.Seconds;
+        state.ref_valid = true;
+    }
+
+    log_debug("clocksync: Time corrected by %ld s", correction);
+    state.correction = correction;
+    state.syncs++;
+    state.token = (state.token + 1) & 0x0f;
+    state.left = 0;
+    schedule();
+}
+
+
+void clocksync_process(const uint8_t *buf, size_t length)
+{
+    uint8_t ans[16], len = 0;
+    uint32_t t;
+
+    while (length) {
+        switch (buf[0]) {
+            case PACKAGE_VERSION_REQ:
+                ans[len++] = PACKAGE_VERSION_REQ;
+                ans[len++] = PACKAGE_ID;
+                ans[len++] = PACKAGE_VERSION;
+                buf += 1; length -= 1;
+                break;
+
+            case APP_TIME_REQ: // AppTimeAns
+                if (length < 6) return;
+                app_time_ans(buf + 1);
+                buf += 6; length -= 6;
+                break;
+
+            case DEVICE_APP_TIME_PERIODICITY_REQ:
+                if (length < 2) return;
+                clocksync_set_period(128UL << (buf[1] & 0x0f));
+                t = SysTimeGet().Seconds - UNIX_GPS_EPOCH_OFFSET;
+                ans[len++] = DEVICE_APP_TIME_PERIODICITY_REQ;
+                ans[len++] = 0;
+                memcpy(ans + len, &t, sizeof(t));
+                len += sizeof(t);
+                buf += 2; length -= 2;
+                break;
+
+            case FORCE_DEVICE_RESYNC_REQ:
+                if (length < 2) return;
+                clocksync_request(buf[1] & 0x07);
+                buf += 2; length -= 2;
+                break;
+
+            default:
+                log_debug("clocksync: Unsupported command %d", buf[0]);
+                length = 0;
+                break;
+        }
+
+        if (len > sizeof(ans) - 6) break;
+    }
+
+    if (len && lrw_enqueue(CLOCKSYNC_PORT, ans, len, false, NULL) < 0)
+        log_warning("clocksync: Transmit queue full, dropping answer");
+}
+
+
+void clocksync_get_status(clocksync_status_t *status)
+{
+    status->period = sysconf.clocksync_period;
+    status->syncs = state.syncs;
+    status->correction = state.correction;
+    status->calibration = rtc_get_calibration();
+}
+
+#endif // CLOCK_SYNC
@@ -0,0 +1,60 @@
+#ifndef _CLOCKSYNC_H
+#define _CLOCKSYNC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+//! @brief LoRaWAN port of the Application Layer Clock Synchronization package
+//! (TS003)
+#define CLOCKSYNC_PORT 202
+
+//! @brief Status of the clock synchronization
+typedef struct
+{
+    uint32_t period;       // Interval between AppTimeReq uplinks in seconds, 0 if disabled
+    uint32_t syncs;        // Number of AppTimeAns applied since boot
+    int32_t correction;    // The most recent time correction in seconds
+    int32_t calibration;   // RTC smooth calibration in units of 2^-20
+} clocksync_status_t;
+
+#if CLOCK_SYNC == 1
+
+//! @brief Initialize the clock synchronization package
+
+void clocksync_init(void);
+
+//! @brief Process a downlink received on CLOCKSYNC_PORT
+//!
+//! Applies the time correction from AppTimeAns to the RTC and updates the
+//! drift estimate. Handles the periodicity, forced resynchronization, and
+//! package version requests from the server.
+//! @param[in] buffer Downlink payload
+//! @param[in] length Length of the payload
+
+void clocksync_process(const uint8_t *buffer, size_t length);
+
+//! @brief Transmit due AppTimeReq uplinks. Invoke from the main loop.
+
+void clocksync_poll(void);
+
+//! @brief Schedule a number of AppTimeReq uplinks. The transmissions stop
+//! early once an answer has been received.
+//! @param[in] count Number of uplinks
+
+void clocksync_request(unsigned int count);
+
+//! @brief Configure the interval of periodic synchronization. The interval is
+//! kept in sysconf.
+//! @param[in] period Interval in seconds, 0 disables periodic synchronization
+
+void clocksync_set_period(uint32_t period);
+
+//! @brief Retrieve the status of the clock synchronization
+//! @param[out] status Pointer to the destination structure
+
+void clocksync_get_status(clocksync_status_t *status);
+
+#endif // CLOCK_SYNC
+
+#endif // _CLOCKSYNC_H
@@ -1,5 +1,8 @@
+#define LOG_MODULE_THRESHOLD LOG_THRESHOLD_CMD
 #include "cmd.h"
+#include <assert.h>
 #include <string.h>
+#include <stdlib.h>
 #include <loramac-node/src/radio/radio.h>
 #include <loramac-node/src/mac/secure-element.h>
 #include <loramac-node/src/mac/secure-element-nvm.h>
@@ -15,11 +18,46 @@
 #include "halt.h"
 #include "utils.h"
 #include "sx1276-board.h"
+#include "trace.h"
+#include "frag.h"
+#include "clocksync.h"
+#include "p2p.h"
+#include "bulk.h"
+#include "ping.h"
+#include "agg.h"
+#include "delta.h"
+#include "evlog.h"
+#include "mcast.h"
+#include "tpl.h"
+#include "trigger.h"
+#include "heartbeat.h"
+#include "bench.h"
+#include "energy.h"
+#include "eeprom.h"
+#include "pool.h"
 
 // These are global variables exported by radio.c that store the RSSI and SNR of
 // the most recent received packet.
 extern int16_t radio_rssi;
 extern int8_t radio_snr;
+extern uint32_t radio_lbt_checks;
+extern uint32_t radio_lbt_busy;
+extern int16_t radio_lbt_rssi;
+extern uint32_t radio_lbt_samples;
+extern uint32_t radio_lbt_time;
+extern uint32_t radio_cad_cycles;
+extern uint32_t radio_cad_detections;
+extern uint32_t radio_cad_packets;
+extern uint32_t radio_idle_holds;
+extern uint32_t radio_idle_sleeps;
+
+// Implemented in radio.c
+void radio_cad_rx_set(uint32_t period);
+uint32_t radio_cad_rx_get(void);
+void radio_scan(uint32_t freq, uint32_t bandwidth, unsigned int samples,
+    int16_t *min, int16_t *avg, int16_t *max);
+uint32_t radio_wakeup_us(void);
+uint32_t radio_standby_threshold(void);
 
 
 typedef enum cmd_errno {
@@ -50,9 +88,43 @@ typedef enum cmd_errno {
 
 static uint8_t port;
 static bool request_confirmation;
+static lrw_tx_options_t tx_options;
 static TimerEvent_t payload_timer;
 
+// The mailbox used in the polling mode (AT$ASYNC=0). Instead of buffering
+// asynchronous messages in the LPUART TX FIFO until the next command, events
+// are kept here and downlinks in the receive queue in lrw.c. Both are stamped
+// with a common sequence number so that AT$MBOXGET? returns them in the order
+// in which they were generated.
+#ifndef CMD_EVENT_QUEUE_SIZE
+#define CMD_EVENT_QUEUE_SIZE 8
+#endif
+
+#define CMD_EVENT_MAX_ARGS 4
+
+typedef struct {
+    uint16_t seq;
+    uint8_t type;
+    uint8_t subtype;
+    uint8_t nargs;
+    int16_t arg[CMD_EVENT_MAX_ARGS];  // Optional fields after the subtype
+} queued_event_t;
+
+static struct {
+    queued_event_t slot[CMD_EVENT_QUEUE_SIZE];
+    uint8_t head;
+    uint8_t count;
+    bool dropped;
+} event_queue;
+
+static uint16_t mailbox_seq;
+
+// The payload reader timeout is not timing-critical and may fire late by up to
+// this many milliseconds so that it can share a wakeup with another timer
+#define PAYLOAD_TIMER_SLACK 100
+
 bool schedule_reset = false;
+bool schedule_warm_reset = false;
 
 #if DETACHABLE_LPUART == 1
 
@@ -174,6 +246,11 @@ static void set_uart(atci_param_t *param)
         case 9600:  break;
         case 19200: break;
         case 38400: break;
+        // The following two baud rates are not supported by the original
+        // Type ABZ firmware. LPUART1 is clocked from HSI16 which provides
+        // sufficient resolution for both.
+        case 57600: break;
+        case 115200: break;
         default: abort(ERR_PARAM);
     }
 
@@ -185,39 +262,40 @@ static void set_uart(atci_param_t *param)
 
 
 // Backwards compatible implementation of AT+VER
+// The responses to the version and model queries below are made of constant
+// strings that are concatenated at compile time and written out as they are
+// from flash. Only the numeric LoRaMac versions still need to be formatted.
+
 static void get_version_comp(void)
 {
-    OK("%s,%s", VERSION_COMPAT, BUILD_DATE_COMPAT);
+    atci_print("+OK=" VERSION_COMPAT "," BUILD_DATE_COMPAT ATCI_EOL);
 }
 
 
-// AT$VER with more detailed firmware version and build time
-static void get_version(void)
-{
-    char *mode;
-
 #if defined(DEBUG)
-    mode = "debug";
+#define BUILD_MODE "debug"
 #elif defined(RELEASE)
-    mode = "release";
+#define BUILD_MODE "release"
 #else
-    mode = "?";
+#define BUILD_MODE "?"
 #endif
 
-    OK("%s,%s,%s,%d.%d.%d,%d.%d.%d,%d.%d.%d,RP%03d-%d.%d.%d,%s,%s", VERSION, BUILD_DATE, LIB_VERSION,
+static void get_version(void)
+{
+    atci_print("+OK=" VERSION "," BUILD_DATE "," LIB_VERSION ",");
+    atci_printf("%d.%d.%d,%d.%d.%d,%d.%d.%d,RP%03d-%d.%d.%d",
         LORAMAC_VERSION >> 24, (LORAMAC_VERSION >> 16) & 0xff, (LORAMAC_VERSION >> 8) & 0xff,
         LORAMAC_FALLBACK_VERSION >> 24, (LORAMAC_FALLBACK_VERSION >> 16) & 0xff, (LORAMAC_FALLBACK_VERSION >> 8) & 0xff,
         LORAMAC_ABP_VERSION >> 24, (LORAMAC_ABP_VERSION >> 16) & 0xff, (LORAMAC_ABP_VERSION >> 8) & 0xff,
         REGION_VERSION >> 24, (REGION_VERSION >> 16) & 0xff,
-        (REGION_VERSION >> 8) & 0xff, REGION_VERSION & 0xff,
-        ENABLED_REGIONS,
-        mode);
+        (REGION_VERSION >> 8) & 0xff, REGION_VERSION & 0xff);
+    atci_print("," ENABLED_REGIONS "," BUILD_MODE ATCI_EOL);
 }
 
 
 static void get_model(void)
 {
-    OK("ABZ");
+    atci_print("+OK=ABZ" ATCI_EOL);
 }
 
 
@@ -231,10 +309,15 @@ static void reboot(atci_param_t *param)
     }
 
     if (hard) {
+        lrw_flush_state();
+        sysconf_flush();
+        evlog_flush();
+        nvm_retain();
         NVIC_SystemReset();
     } else {
         OK_();
         schedule_reset = true;
+        schedule_warm_reset = true;
         atci_flush();
     }
 }
@@ -304,6 +387,84 @@ static void set_band(atci_param_t *param)
 }
 
 
+static void airtime(atci_param_t *param)
+{
+    uint32_t length, dr, ms;
+
+    if (!atci_param_get_uint(param, &length)) abort(ERR_PARAM);
+    if (length > 255) abort(ERR_PARAM);
+
+    if (param->offset != param->length) {
+        if (!atci_param_is_comma(param)) abort(ERR_PARAM);
+        if (!atci_param_get_uint(param, &dr)) abort(ERR_PARAM);
+        if (dr > 15) abort(ERR_PARAM);
+    } else {
+        MibRequestConfirm_t r = { .Type = MIB_CHANNELS_DATARATE };
+        LoRaMacMibGetRequestConfirm(&r);
+        dr = r.Param.ChannelsDatarate;
+    }
+
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    abort_on_error(lrw_airtime(length, dr, &ms));
+    OK("%lu", ms);
+}
+
+
+static void get_airbudget(void)
+{
+    OK("%d,%lu", sysconf.airtime_cap, lrw_airtime_used());
+}
+
+
+static void set_airbudget(atci_param_t *param)
+{
+    uint32_t cap;
+
+    if (!atci_param_get_uint(param, &cap)) abort(ERR_PARAM);
+    if (cap > UINT16_MAX) abort(ERR_PARAM);
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    sysconf.airtime_cap = cap;
+    sysconf_modified = true;
+    OK_();
+}
+
+
+static void reset_airbudget(atci_param_t *param)
+{
+    (void)param;
+    lrw_airtime_reset();
+    OK_();
+}
+
+
+static void get_profile(void)
+{
+    OK("%d", lrw_get_profile());
+}
+
+
+static void set_profile(atci_param_t *param)
+{
+    uint32_t value;
+
+    if (!atci_param_get_uint(param, &value)) abort(ERR_PARAM);
+    if (value >= LRW_PROFILES) abort(ERR_PARAM);
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    int rv = lrw_set_profile(value);
+    abort_on_error(rv);
+
+    OK_();
+    if (rv == 0) {
+        // The state of the selected profile is loaded on reboot
+        atci_flush();
+        schedule_reset = true;
+    }
+}
+
+
 static void get_class(void)
 {
     OK("%d", lrw_get_class());
@@ -315,9 +476,8 @@ static void set_class(atci_param_t *param)
     uint32_t v;
     if (!atci_param_get_uint(param, &v)) abort(ERR_PARAM);
 
-    // In original firmware compatibility mode, only class A (0) and class C (2)
-    // can be configured with this command.
-    if (v != 0 && v != 2) abort(ERR_PARAM);
+    // Class B (1) is activated asynchronously, see AT$BEACON
+    if (v > 2) abort(ERR_PARAM);
 
     if (param->offset != param->length) abort(ERR_PARAM_NO);
 
@@ -589,6 +749,23 @@ static void join(atci_param_t *param)
 }
 
 
+static void rejoin(atci_param_t *param)
+{
+    uint32_t type;
+
+    if (lrw_get_mode() == 0) abort(ERR_NO_OTAA);
+
+    if (!atci_param_get_uint(param, &type)) abort(ERR_PARAM);
+    if (type > 2) abort(ERR_PARAM);
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    int rc = lrw_rejoin(type);
+    if (rc == LORAMAC_STATUS_SERVICE_UNKNOWN) abort(ERR_UNSUPPORTED);
+    abort_on_error(rc);
+    OK_();
+}
+
+
 static void get_joindc(void)
 {
     LoRaMacNvmData_t *state = lrw_get_state();
@@ -606,16 +783,95 @@ static void set_joindc(atci_param_t *param)
 }
 
 
-static void lncheck(atci_param_t *param)
+static void get_join_sched(void)
 {
-    int piggyback = 0;
+    uint32_t jitter;
+    unsigned int subband;
+    bool ladder;
 
-    if (param != NULL) {
-        piggyback = parse_enabled(param);
-        if (piggyback == -1) abort(ERR_PARAM);
+    lrw_join_sched_get(&jitter, &ladder, &subband);
+    OK("%lu,%d,%d", jitter, ladder, subband);
+}
+
+
+static void set_join_sched(atci_param_t *param)
+{
+    uint32_t jitter, ladder = 0, subband = 0;
+
+    if (!atci_param_get_uint(param, &jitter)) abort(ERR_PARAM);
+    if (jitter > 3600000) abort(ERR_PARAM);
+
+    if (param->offset != param->length) {
+        if (!atci_param_is_comma(param)) abort(ERR_PARAM);
+        if (!atci_param_get_uint(param, &ladder)) abort(ERR_PARAM);
+        if (ladder > 1) abort(ERR_PARAM);
+
+        if (!atci_param_is_comma(param)) abort(ERR_PARAM);
+        if (!atci_param_get_uint(param, &subband)) abort(ERR_PARAM);
+        if (subband > LRW_JOIN_SUBBAND_LEARN) abort(ERR_PARAM);
+    }
+
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    lrw_join_sched_set(jitter, ladder, subband);
+    OK_();
+}
+
+
+static void get_join_stats(void)
+{
+    lrw_join_stats_t stats;
+
+    lrw_join_stats(&stats, false);
+    OK("%lu,%lu,%lu,%lu,%d,%d,%d", stats.attempts, stats.accepts,
+        stats.airtime, stats.time, stats.rssi, stats.snr, stats.dr);
+}
+
+
+static void reset_join_stats(atci_param_t *param)
+{
+    lrw_join_stats_t stats;
+
+    (void)param;
+    lrw_join_stats(&stats, true);
+    OK_();
+}
+
+
+// Parse the parameters of a MAC request: "0" sends the request immediately,
+// "1[,deadline]" defers it to the next uplink for up to deadline seconds (0
+// or omitted to wait indefinitely). Return -1 on error.
+static int parse_mac_request(atci_param_t *param, uint32_t *deadline)
+{
+    uint32_t piggyback;
+
+    *deadline = 0;
+    if (param == NULL) return 0;
+
+    if (!atci_param_get_uint(param, &piggyback)) return -1;
+    if (piggyback > 1) return -1;
+
+    if (atci_param_is_comma(param)) {
+        if (!piggyback) return -1;
+        if (!atci_param_get_uint(param, deadline)) return -1;
     }
 
-    abort_on_error(lrw_check_link(piggyback == 1));
+    if (param->offset != param->length) return -1;
+    return piggyback;
+}
+
+
+static void lncheck(atci_param_t *param)
+{
+    uint32_t deadline;
+    int piggyback = parse_mac_request(param, &deadline);
+
+    if (piggyback == -1) abort(ERR_PARAM);
+
+    if (piggyback)
+        abort_on_error(lrw_defer_mac_request(LRW_MAC_LINK_CHECK, deadline));
+    else
+        abort_on_error(lrw_check_link(false));
     OK_();
 }
 
@@ -648,33 +904,27 @@ static void get_rfparam(void)
 static void set_rfparam(atci_param_t *param)
 {
     LoRaMacStatus_t rc;
-    uint32_t id, freq, min_dr, max_dr;
-
-    if (!atci_param_get_uint(param, &id)) abort(ERR_PARAM);
-    if (id > UINT8_MAX) abort(ERR_PARAM);
+    atci_token_t t[4];
+    int n;
 
-    if (param->offset < param->length) {
-        if (!atci_param_is_comma(param)) abort(ERR_PARAM);
-
-        if (!atci_param_get_uint(param, &freq)) abort(ERR_PARAM);
-        if (!atci_param_is_comma(param)) abort(ERR_PARAM);
+    n = atci_param_tokenize(param, t, 4);
+    if (n < 0) abort(ERR_PARAM_NO);
+    if (n != 1 && n != 4) abort(ERR_PARAM);
 
-        if (!atci_param_get_uint(param, &min_dr)) abort(ERR_PARAM);
-        if (min_dr > INT8_MAX) abort(ERR_PARAM);
-        if (!atci_param_is_comma(param)) abort(ERR_PARAM);
-
-        if (!atci_param_get_uint(param, &max_dr)) abort(ERR_PARAM);
-        if (max_dr > INT8_MAX) abort(ERR_PARAM);
+    if (!(t[0].flags & ATCI_TOKEN_DEC) || t[0].value > UINT8_MAX) abort(ERR_PARAM);
 
-        if (param->offset != param->length) abort(ERR_PARAM_NO);
+    if (n == 4) {
+        if (!(t[1].flags & ATCI_TOKEN_DEC)) abort(ERR_PARAM);
+        if (!(t[2].flags & ATCI_TOKEN_DEC) || t[2].value > INT8_MAX) abort(ERR_PARAM);
+        if (!(t[3].flags & ATCI_TOKEN_DEC) || t[3].value > INT8_MAX) abort(ERR_PARAM);
 
-        ChannelParams_t params = { .Frequency = freq };
-        params.DrRange.Fields.Min = min_dr;
-        params.DrRange.Fields.Max = max_dr;
+        ChannelParams_t params = { .Frequency = t[1].value };
+        params.DrRange.Fields.Min = t[2].value;
+        params.DrRange.Fields.Max = t[3].value;
 
-        rc = LoRaMacChannelAdd(id, params);
+        rc = LoRaMacChannelAdd(t[0].value, params);
     } else {
-        rc = LoRaMacChannelRemove(id);
+        rc = LoRaMacChannelRemove(t[0].value);
     }
 
     abort_on_error(rc);
@@ -858,6 +1108,60 @@ static void set_delay(atci_param_t *param)
 }
 
 
+static void get_rxadapt(void)
+{
+    lrw_rx_timing_t t;
+
+    // The mode and the RX error in use come first, followed by the sample
+    // count, the mean offset, the mean deviation (all in ms), and the
+    // adaptive RX error of each data rate with downlinks
+    atci_printf("+OK=%d,%lu", sysconf.rx_adapt, lrw_max_rx_error());
+    for (unsigned int dr = 0; dr < 16; dr++) {
+        lrw_rx_timing(dr, &t);
+        if (!t.samples) continue;
+        atci_printf(";%u,%u,%d,%u,%u", dr, t.samples, t.mean, t.dev, t.error);
+    }
+    EOL();
+}
+
+
+static void set_rxadapt(atci_param_t *param)
+{
+    uint32_t v;
+
+    if (!atci_param_get_uint(param, &v)) abort(ERR_PARAM);
+    if (v > 1) abort(ERR_PARAM);
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    sysconf.rx_adapt = v;
+    sysconf_modified = true;
+    OK_();
+}
+
+
+static void get_radioidle(void)
+{
+    // The mode, the longest gap (ms) bridged in standby, the measured radio
+    // wake-up time (us), and the numbers of gaps held and slept through
+    OK("%d,%lu,%lu,%lu,%lu", sysconf.rx_standby, radio_standby_threshold(),
+        radio_wakeup_us(), radio_idle_holds, radio_idle_sleeps);
+}
+
+
+static void set_radioidle(atci_param_t *param)
+{
+    uint32_t v;
+
+    if (!atci_param_get_uint(param, &v)) abort(ERR_PARAM);
+    if (v > 1) abort(ERR_PARAM);
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    sysconf.rx_standby = v;
+    sysconf_modified = true;
+    OK_();
+}
+
+
 static void get_adrack(void)
 {
     uint16_t limit;
@@ -983,6 +1287,30 @@ static void set_sleep(atci_param_t *param)
 }
 
 
+static void get_pwrmode(void)
+{
+    OK("%d", sysconf.power_profile);
+}
+
+
+static void set_pwrmode(atci_param_t *param)
+{
+    uint32_t v;
+
+    if (!atci_param_get_uint(param, &v)) abort(ERR_PARAM);
+    if (v >= SYSTEM_POWER_PROFILES) abort(ERR_PARAM);
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    // The low-latency profile never drops to the slow operating point, so
+    // switch to the fast one right away
+    if (v == SYSTEM_POWER_LOW_LATENCY) system_enable_pll();
+
+    sysconf.power_profile = v;
+    sysconf_modified = true;
+    OK_();
+}
+
+
 static void get_port(void)
 {
     OK("%d", sysconf.default_port);
@@ -1094,15 +1422,43 @@ static void transmit(atci_data_status_t status, atci_param_t *param)
         abort(ERR_PARAM);
     }
 
-    abort_on_error(lrw_send(port, param->txt, param->length, request_confirmation));
+    if (sysconf.tx_store) {
+        if (lrw_store(port, param->txt, param->length, request_confirmation) < 0)
+            abort(ERR_BUSY);
+        OK("%u", lrw_tx_store_length(NULL));
+        return;
+    }
+
+    if (sysconf.tx_queue) {
+        int id = lrw_enqueue(port, param->txt, param->length, request_confirmation, &tx_options);
+        if (id < 0) abort(ERR_BUSY);
+        OK("%d,%lu", id, lrw_predict_tx_delay());
+        return;
+    }
+
+    abort_on_error(lrw_send(port, param->txt, param->length, request_confirmation, &tx_options));
     OK_();
 }
 
 
+static void read_uplink_payload(uint32_t size)
+{
+    TimerInit(&payload_timer, payload_timeout);
+    TimerSetSlack(&payload_timer, PAYLOAD_TIMER_SLACK);
+    TimerSetValue(&payload_timer, sysconf.uart_timeout);
+    TimerStart(&payload_timer);
+
+    if (!atci_set_read_next_data(size,
+        sysconf.data_format == 1 ? ATCI_ENCODING_HEX : ATCI_ENCODING_BIN, transmit))
+        abort(ERR_PAYLOAD_LONG);
+}
+
+
 static void utx(atci_param_t *param)
 {
     uint32_t size;
     port = sysconf.default_port;
+    memset(&tx_options, 0, sizeof(tx_options));
 
     if (param == NULL) abort(ERR_PARAM_NO);
     if (!atci_param_get_uint(param, &size)) abort(ERR_PARAM);
@@ -1115,14 +1471,8 @@ static void utx(atci_param_t *param)
 
     if (param->offset != param->length) abort(ERR_PARAM_NO);
 
-    TimerInit(&payload_timer, payload_timeout);
-    TimerSetValue(&payload_timer, sysconf.uart_timeout);
-    TimerStart(&payload_timer);
-
     request_confirmation = false;
-    if (!atci_set_read_next_data(size,
-        sysconf.data_format == 1 ? ATCI_ENCODING_HEX : ATCI_ENCODING_BIN, transmit))
-        abort(ERR_PAYLOAD_LONG);
+    read_uplink_payload(size);
 }
 
 
@@ -1170,27 +1520,20 @@ static void set_mcast(atci_param_t *param)
     LoRaMacStatus_t rc;
     uint8_t nwkskey[SE_KEY_SIZE];
     uint8_t appskey[SE_KEY_SIZE];
+    atci_token_t t[4];
+    int n;
 
-    if (!atci_param_get_uint(param, &id)) abort(ERR_PARAM);
-    if (id >= LORAMAC_MAX_MC_CTX) abort(ERR_PARAM);
-
-    if (param->offset < param->length) {
-        if (!atci_param_is_comma(param)) abort(ERR_PARAM);
-
-        if (atci_param_get_buffer_from_hex(param, &addr, sizeof(addr), sizeof(addr) * 2) != sizeof(addr))
-            abort(ERR_PARAM);
-
-        if (!atci_param_is_comma(param)) abort(ERR_PARAM);
-
-        if (atci_param_get_buffer_from_hex(param, nwkskey, SE_KEY_SIZE, SE_KEY_SIZE * 2) != SE_KEY_SIZE)
-            abort(ERR_PARAM);
-
-        if (!atci_param_is_comma(param)) abort(ERR_PARAM);
+    n = atci_param_tokenize(param, t, 4);
+    if (n < 0) abort(ERR_PARAM_NO);
+    if (n != 1 && n != 4) abort(ERR_PARAM);
 
-        if (atci_param_get_buffer_from_hex(param, appskey, SE_KEY_SIZE, SE_KEY_SIZE * 2) != SE_KEY_SIZE)
-            abort(ERR_PARAM);
+    if (!(t[0].flags & ATCI_TOKEN_DEC) || t[0].value >= LORAMAC_MAX_MC_CTX) abort(ERR_PARAM);
+    id = t[0].value;
 
-        if (param->offset != param->length) abort(ERR_PARAM_NO);
+    if (n == 4) {
+        if (!atci_token_get_hex(&t[1], &addr, sizeof(addr))) abort(ERR_PARAM);
+        if (!atci_token_get_hex(&t[2], nwkskey, SE_KEY_SIZE)) abort(ERR_PARAM);
+        if (!atci_token_get_hex(&t[3], appskey, SE_KEY_SIZE)) abort(ERR_PARAM);
 
         McChannelParams_t c = {
             .IsEnabled = true,
@@ -1219,6 +1562,99 @@ static void set_mcast(atci_param_t *param)
 }
 
 
+// AT$MCSLOT?: +OK=<n>;<slot>,<addr>,<group>;... for each slot in use, with
+// group -1 if the slot is not loaded into a LoRaMac context
+static void get_mcslot(void)
+{
+    uint32_t addr;
+    int n = 0;
+
+    for (unsigned int i = 0; i < MCAST_SLOTS; i++)
+        if (mcast_slot_get(i, &addr)) n++;
+
+    atci_printf("+OK=%d", n);
+    for (unsigned int i = 0; i < MCAST_SLOTS; i++) {
+        if (!mcast_slot_get(i, &addr)) continue;
+        atci_printf(";%d,%08lX,%d", i, addr, mcast_slot_group(i));
+    }
+    EOL();
+}
+
+
+// AT$MCSLOT=<slot>[,<addr>,<mckey>|,<addr>,<nwkskey>,<appskey>]
+static void set_mcslot(atci_param_t *param)
+{
+    uint32_t slot, addr;
+    uint8_t key1[SE_KEY_SIZE];
+    uint8_t key2[SE_KEY_SIZE];
+    atci_token_t t[4];
+    int n, rc;
+
+    n = atci_param_tokenize(param, t, 4);
+    if (n < 0) abort(ERR_PARAM_NO);
+
+    if (!(t[0].flags & ATCI_TOKEN_DEC) || t[0].value >= MCAST_SLOTS) abort(ERR_PARAM);
+    slot = t[0].value;
+
+    if (n == 1) {
+        rc = mcast_slot_delete(slot);
+    } else {
+        if (n < 3) abort(ERR_PARAM);
+        if (!atci_token_get_hex(&t[1], &addr, sizeof(addr))) abort(ERR_PARAM);
+        if (!atci_token_get_hex(&t[2], key1, SE_KEY_SIZE)) abort(ERR_PARAM);
+
+        if (n == 3) {
+            rc = mcast_slot_derive(slot, ntohl(addr), key1);
+        } else {
+            if (!atci_token_get_hex(&t[3], key2, SE_KEY_SIZE)) abort(ERR_PARAM);
+            rc = mcast_slot_set(slot, ntohl(addr), key1, key2);
+        }
+    }
+
+    abort_on_error(rc);
+    OK_();
+}
+
+
+// AT$MCACT?: +OK=<slot>,<slot>,... the slot loaded into each LoRaMac context,
+// or -1
+static void get_mcact(void)
+{
+    int slot[LORAMAC_MAX_MC_CTX];
+    int g;
+
+    for (int i = 0; i < LORAMAC_MAX_MC_CTX; i++) slot[i] = -1;
+    for (unsigned int i = 0; i < MCAST_SLOTS; i++) {
+        g = mcast_slot_group(i);
+        if (g >= 0) slot[g] = i;
+    }
+
+    atci_print("+OK=");
+    for (int i = 0; i < LORAMAC_MAX_MC_CTX; i++)
+        atci_printf(i ? ",%d" : "%d", slot[i]);
+    EOL();
+}
+
+
+// AT$MCACT=<slot>[,<group>]: +OK=<group>
+static void set_mcact(atci_param_t *param)
+{
+    uint32_t slot, v;
+    int group = -1;
+
+    if (!atci_param_get_uint(param, &slot)) abort(ERR_PARAM);
+    if (atci_param_is_comma(param)) {
+        if (!atci_param_get_uint(param, &v)) abort(ERR_PARAM);
+        if (v >= LORAMAC_MAX_MC_CTX) abort(ERR_PARAM);
+        group = v;
+    }
+    if (param->offset != param->length) abort(ERR_PARAM);
+
+    abort_on_error(mcast_activate(slot, &group));
+    OK("%d", group);
+}
+
+
 static void putx(atci_param_t *param)
 {
     if (param == NULL) abort(ERR_PARAM_NO);
@@ -1238,12 +1674,228 @@ static void pctx(atci_param_t *param)
     request_confirmation = true;
 }
 
-#if CERTIFICATION_ATCI != 0
 
-static void cw(atci_param_t *param)
+// AT$UTX and AT$CTX: port,length[,transmissions[,urgent]]. The options travel
+// with the message through the uplink queue, see lrw_tx_options_t.
+static void utx_ext(atci_param_t *param)
 {
-    uint32_t freq, timeout;
-    int32_t power;
+    uint32_t size, transmissions = 0, urgent = 0;
+
+    int p = parse_port(param);
+    if (p < 0) abort(ERR_PARAM);
+    if (!atci_param_is_comma(param)) abort(ERR_PARAM);
+
+    if (!atci_param_get_uint(param, &size)) abort(ERR_PARAM);
+    unsigned int mul = sysconf.data_format == 1 ? 2 : 1;
+    if (size > 242 * mul) abort(ERR_PAYLOAD_LONG);
+
+    if (atci_param_is_comma(param)) {
+        if (!atci_param_get_uint(param, &transmissions)) abort(ERR_PARAM);
+        if (transmissions > 15) abort(ERR_PARAM);
+
+        if (atci_param_is_comma(param)) {
+            if (!atci_param_get_uint(param, &urgent)) abort(ERR_PARAM);
+            if (urgent > 1) abort(ERR_PARAM);
+        }
+    }
+
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    // The persistent uplink store does not keep per-message options
+    if (sysconf.tx_store && (transmissions || urgent)) abort(ERR_UNSUPPORTED);
+
+    port = p;
+    tx_options.transmissions = transmissions;
+    tx_options.urgent = urgent;
+    request_confirmation = false;
+    read_uplink_payload(size);
+}
+
+
+static void ctx_ext(atci_param_t *param)
+{
+    utx_ext(param);
+    request_confirmation = true;
+}
+
+
+// Parse a hex field that ends at the next comma or at the end of the line.
+// Returns the number of bytes or -1 on error.
+static int get_hex_field(atci_param_t *param, uint8_t *buf, size_t size)
+{
+    const char *end = memchr(param->txt + param->offset, ',', param->length - param->offset);
+    size_t n = (end ? (size_t)(end - param->txt) : param->length) - param->offset;
+
+    if (n == 0 || n & 1 || n / 2 > size) return -1;
+    if (atci_param_get_buffer_from_hex(param, buf, size, n) != n / 2) return -1;
+    return n / 2;
+}
+
+
+static void get_tpl(void)
+{
+    const tpl_t *t;
+    int n = 0;
+
+    // +OK=<slot>,<port>,<confirmed>,<payload>;... for the defined templates
+    atci_print("+OK=");
+    for (unsigned int i = 0; i < TPL_SLOTS; i++) {
+        if ((t = tpl_get(i)) == NULL) continue;
+        atci_printf(n++ ? ";%u,%d,%d," : "%u,%d,%d,", i, t->port, t->confirmed);
+        atci_print_buffer_as_hex(t->payload, t->length);
+    }
+    EOL();
+}
+
+
+static void set_tpl(atci_param_t *param)
+{
+    uint8_t buf[TPL_MAX_SIZE];
+    uint32_t slot, port, confirmed = 0;
+    int n = 0;
+
+    if (!atci_param_get_uint(param, &slot)) abort(ERR_PARAM);
+    if (!atci_param_is_comma(param)) abort(ERR_PARAM);
+    if (!atci_param_get_uint(param, &port)) abort(ERR_PARAM);
+    if (port > 223) abort(ERR_PARAM);
+
+    // AT$TPL=<slot>,0 deletes the template
+    if (port != 0) {
+        if (!atci_param_is_comma(param)) abort(ERR_PARAM_NO);
+        if (!atci_param_get_uint(param, &confirmed)) abort(ERR_PARAM);
+        if (confirmed > 1) abort(ERR_PARAM);
+        if (!atci_param_is_comma(param)) abort(ERR_PARAM_NO);
+        if ((n = get_hex_field(param, buf, sizeof(buf))) < 0) abort(ERR_PARAM);
+    }
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    if (tpl_define(slot, port, confirmed, buf, n) != 0) abort(ERR_PARAM);
+    OK_();
+}
+
+
+static void get_tplfield(void)
+{
+    const tpl_t *t;
+    int n = 0;
+
+    // +OK=<slot>,<offset>,<type>;...
+    atci_print("+OK=");
+    for (unsigned int i = 0; i < TPL_SLOTS; i++) {
+        if ((t = tpl_get(i)) == NULL) continue;
+        for (int j = 0; j < TPL_MAX_FIELDS; j++) {
+            if (t->field[j].type == TPL_FIELD_NONE) continue;
+            atci_printf(n++ ? ";%u,%d,%d" : "%u,%d,%d", i, t->field[j].offset, t->field[j].type);
+        }
+    }
+    EOL();
+}
+
+
+static void set_tplfield(atci_param_t *param)
+{
+    uint32_t slot, offset, type;
+
+    if (!atci_param_get_uint(param, &slot)) abort(ERR_PARAM);
+    if (!atci_param_is_comma(param)) abort(ERR_PARAM);
+    if (!atci_param_get_uint(param, &offset)) abort(ERR_PARAM);
+    if (!atci_param_is_comma(param)) abort(ERR_PARAM);
+    if (!atci_param_get_uint(param, &type)) abort(ERR_PARAM);
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    if (offset >= TPL_MAX_SIZE || type >= TPL_FIELD_TYPES) abort(ERR_PARAM);
+    if (tpl_set_field(slot, offset, type) != 0) abort(ERR_PARAM);
+    OK_();
+}
+
+
+// AT$TPLTX=<slot>[,<offset>,<data>]... applies the patches to the template and
+// sends it like AT+UTX or AT+CTX would
+static void tpl_transmit(atci_param_t *param)
+{
+    uint8_t buf[TPL_MAX_SIZE];
+    uint32_t slot, offset;
+    const tpl_t *t;
+    int n;
+
+    if (!atci_param_get_uint(param, &slot)) abort(ERR_PARAM);
+    if ((t = tpl_get(slot)) == NULL) abort(ERR_PARAM);
+
+    while (param->offset < param->length) {
+        if (!atci_param_is_comma(param)) abort(ERR_PARAM);
+        if (!atci_param_get_uint(param, &offset)) abort(ERR_PARAM);
+        if (!atci_param_is_comma(param)) abort(ERR_PARAM_NO);
+        if ((n = get_hex_field(param, buf, sizeof(buf))) < 0) abort(ERR_PARAM);
+        if (offset > UINT8_MAX || tpl_patch(slot, offset, buf, n) != 0) abort(ERR_PARAM);
+    }
+
+    port = t->port;
+    request_confirmation = t->confirmed;
+    memset(&tx_options, 0, sizeof(tx_options));
+
+    atci_param_t payload = {
+        .txt = (char *)buf,
+        .length = tpl_build(slot, buf),
+        .offset = 0
+    };
+    transmit(ATCI_DATA_OK, &payload);
+}
+
+
+#if TRIGGER_PIN == 1
+static void get_trigger(void)
+{
+    trigger_config_t c;
+    trigger_stats_t st;
+
+    trigger_get_config(&c);
+    trigger_get_stats(&st);
+    OK("%d,%d,%d,%d,%lu,%lu,%lu", c.edge, c.slot, c.debounce, c.interval,
+        st.sent, st.suppressed, st.failed);
+}
+
+
+static void set_trigger(atci_param_t *param)
+{
+    trigger_config_t c;
+    uint32_t v;
+
+    trigger_get_config(&c);
+
+    if (!atci_param_get_uint(param, &v)) abort(ERR_PARAM);
+    if (v >= TRIGGER_EDGES) abort(ERR_PARAM);
+    c.edge = v;
+
+    if (atci_param_is_comma(param)) {
+        if (!atci_param_get_uint(param, &v)) abort(ERR_PARAM);
+        if (v >= TPL_SLOTS) abort(ERR_PARAM);
+        c.slot = v;
+
+        if (atci_param_is_comma(param)) {
+            if (!atci_param_get_uint(param, &v)) abort(ERR_PARAM);
+            if (v > UINT16_MAX) abort(ERR_PARAM);
+            c.debounce = v;
+
+            if (atci_param_is_comma(param)) {
+                if (!atci_param_get_uint(param, &v)) abort(ERR_PARAM);
+                if (v > UINT16_MAX) abort(ERR_PARAM);
+                c.interval = v;
+            }
+        }
+    }
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    if (trigger_set_config(&c) != 0) abort(ERR_PARAM);
+    OK_();
+}
+#endif
+
+#if CERTIFICATION_ATCI != 0
+
+static void cw(atci_param_t *param)
+{
+    uint32_t freq, timeout;
+    int32_t power;
 
     if (!atci_param_get_uint(param, &freq)) abort(ERR_PARAM);
     if (!atci_param_is_comma(param)) abort(ERR_PARAM);
@@ -1407,7 +2059,7 @@ static void cm(atci_param_t *param)
 
 #endif
 
-static void get_frmcnt(void)
+static uint32_t get_downlink_frmcnt(void)
 {
     uint32_t down;
     LoRaMacNvmData_t *state = lrw_get_state();
@@ -1422,28 +2074,20 @@ static void get_frmcnt(void)
 
     // For compatibility with the original firmware, return 0 if the downlink
     // counter still has the initial value (no downlink was received yet).
-    OK("%lu,%lu", state->Crypto.FCntList.FCntUp,
-        down == FCNT_DOWN_INITIAL_VALUE ? 0 : down);
+    return down == FCNT_DOWN_INITIAL_VALUE ? 0 : down;
 }
 
 
-static void get_msize(void)
+static void get_frmcnt(void)
 {
-    LoRaMacTxInfo_t txi;
-    LoRaMacStatus_t rc = LoRaMacQueryTxPossible(0, &txi);
-    switch(rc) {
-        case LORAMAC_STATUS_OK:
-            OK("%d", txi.MaxPossibleApplicationDataSize);
-            break;
+    LoRaMacNvmData_t *state = lrw_get_state();
+    OK("%lu,%lu", state->Crypto.FCntList.FCntUp, get_downlink_frmcnt());
+}
 
-        case LORAMAC_STATUS_LENGTH_ERROR:
-            OK("%d", 0);
-            break;
 
-        default:
-            abort_on_error(rc);
-            break;
-    }
+static void get_msize(void)
+{
+    OK("%d", lrw_get_msize());
 }
 
 
@@ -1489,7 +2133,8 @@ static void set_dwell(atci_param_t *param)
 static void get_maxeirp(void)
 {
     LoRaMacNvmData_t *state = lrw_get_state();
-    OK("%.0f", state->MacGroup2.MacParams.MaxEirp);
+    // atci_printf has no floating point support, round the value here
+    OK("%d", (int)(state->MacGroup2.MacParams.MaxEirp + 0.5f));
 }
 
 
@@ -1536,478 +2181,2632 @@ static void set_rssith(atci_param_t *param)
 }
 
 
-static void get_cst(void)
+static void get_lbt(void)
 {
-    MibRequestConfirm_t r = { .Type = MIB_CARRIER_SENSE_TIME };
+    OK("%lu,%lu,%d,%lu,%lu", radio_lbt_checks, radio_lbt_busy,
+        radio_lbt_rssi, radio_lbt_samples, radio_lbt_time);
+}
 
-    LoRaMacStatus_t rc = LoRaMacMibGetRequestConfirm(&r);
-    if (rc == LORAMAC_STATUS_ERROR) abort(ERR_UNSUPPORTED);
-    abort_on_error(rc);
 
-    OK("%lu", r.Param.CarrierSenseTime);
+static void reset_lbt(atci_param_t *param)
+{
+    (void)param;
+    radio_lbt_checks = 0;
+    radio_lbt_busy = 0;
+    OK_();
 }
 
 
-static void set_cst(atci_param_t *param)
+static void get_cad_rx(void)
 {
-    uint32_t cst;
+    OK("%lu,%lu,%lu,%lu", radio_cad_rx_get(), radio_cad_cycles,
+        radio_cad_detections, radio_cad_packets);
+}
 
-    if (!atci_param_get_uint(param, &cst)) abort(ERR_PARAM);
-    if (param->offset != param->length) abort(ERR_PARAM_NO);
 
-    MibRequestConfirm_t r = { .Type = MIB_CARRIER_SENSE_TIME };
-    r.Param.CarrierSenseTime = cst;
+static void set_cad_rx(atci_param_t *param)
+{
+    uint32_t period;
 
-    LoRaMacStatus_t rc = LoRaMacMibSetRequestConfirm(&r);
-    if (rc == LORAMAC_STATUS_ERROR) abort(ERR_UNSUPPORTED);
-    abort_on_error(rc);
+    if (!atci_param_get_uint(param, &period)) abort(ERR_PARAM);
+    if (period != 0 && (period < 20 || period > 10000)) abort(ERR_PARAM);
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
 
+    radio_cad_rx_set(period);
     OK_();
 }
 
 
-static void get_backoff(void)
-{
-    TimerTime_t now = rtc_tick2ms(rtc_get_timer_value());
-    OK("%ld", lrw_dutycycle_deadline > now ? lrw_dutycycle_deadline - now : 0);
-}
+// The LoRa bandwidth in kHz indexed by the bandwidth field of p2p_config_t
+static const uint16_t p2p_bandwidths[] = { 125, 250, 500 };
 
 
-// A version compatible with the original Type ABZ firmware
-static void get_chmask_comp(void)
+static void get_p2p(void)
 {
-    MibRequestConfirm_t r = { .Type = MIB_CHANNELS_MASK };
-    abort_on_error(LoRaMacMibGetRequestConfirm(&r));
-    atci_print("+OK=");
-    atci_print_buffer_as_hex(r.Param.ChannelsMask, lrw_get_max_channels() / 8);
-    EOL();
+    p2p_config_t c;
+    p2p_get_config(&c);
+    OK("%lu,%d,%d,%d,%d,%d", c.frequency, c.sf, p2p_bandwidths[c.bandwidth],
+        c.coderate + 4, c.power, c.preamble);
 }
 
 
-static bool parse_chmask(uint16_t *buf, size_t len, atci_param_t *param)
+static void set_p2p(atci_param_t *param)
 {
-    int chmask_bytes = lrw_get_max_channels() / 8;
+    uint32_t freq, sf, bw, cr, preamble;
+    int32_t power;
+    p2p_config_t c;
 
-    memset(buf, 0, len);
-    int read = atci_param_get_buffer_from_hex(param, buf, len, chmask_bytes * 2);
+    p2p_get_config(&c);
 
-    if (read != chmask_bytes) return false;
-    return true;
-}
+    if (!atci_param_get_uint(param, &freq)) abort(ERR_PARAM);
+    if (!atci_param_is_comma(param)) abort(ERR_PARAM);
 
+    if (!atci_param_get_uint(param, &sf)) abort(ERR_PARAM);
+    if (sf < 7 || sf > 12) abort(ERR_PARAM);
+    if (!atci_param_is_comma(param)) abort(ERR_PARAM);
 
-// A version compatible with the original Type ABZ firmware
-static void set_chmask_comp(atci_param_t *param)
-{
-    uint16_t chmask[REGION_NVM_CHANNELS_MASK_SIZE];
+    if (!atci_param_get_uint(param, &bw)) abort(ERR_PARAM);
+    if (!atci_param_is_comma(param)) abort(ERR_PARAM);
 
-    if (!parse_chmask(chmask, sizeof(chmask), param)) abort(ERR_PARAM);
+    // The coding rate is given as the denominator of 4/5 to 4/8
+    if (!atci_param_get_uint(param, &cr)) abort(ERR_PARAM);
+    if (cr < 5 || cr > 8) abort(ERR_PARAM);
+    if (!atci_param_is_comma(param)) abort(ERR_PARAM);
 
-    // Make sure all data from the value have been consumed
-    if (param->length != param->offset) abort(ERR_PARAM_NO);
+    if (!atci_param_get_int(param, &power)) abort(ERR_PARAM);
+    if (power < INT8_MIN || power > INT8_MAX) abort(ERR_PARAM);
 
-    // First set the default channel mask. The default channel mask is the
-    // channel mask used before Join or ADR.
-    MibRequestConfirm_t r = {
-        .Type  = MIB_CHANNELS_DEFAULT_MASK,
-        .Param = { .ChannelsDefaultMask = chmask }
-    };
-    abort_on_error(LoRaMacMibSetRequestConfirm(&r));
+    if (atci_param_is_comma(param)) {
+        if (!atci_param_get_uint(param, &preamble)) abort(ERR_PARAM);
+        if (preamble < 6 || preamble > UINT16_MAX) abort(ERR_PARAM);
+        c.preamble = preamble;
+    }
 
-    // Then update the channel mask currently in use
-    r.Type = MIB_CHANNELS_MASK;
-    r.Param.ChannelsMask = chmask;
-    abort_on_error(LoRaMacMibSetRequestConfirm(&r));
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
 
-    OK_();
-}
+    unsigned int i;
+    for (i = 0; i < sizeof(p2p_bandwidths) / sizeof(p2p_bandwidths[0]); i++)
+        if (p2p_bandwidths[i] == bw) break;
+    if (i == sizeof(p2p_bandwidths) / sizeof(p2p_bandwidths[0])) abort(ERR_PARAM);
 
+    c.frequency = freq;
+    c.sf = sf;
+    c.bandwidth = i;
+    c.coderate = cr - 4;
+    c.power = power;
 
-static void get_rtynum(void)
-{
-    OK("%d", sysconf.confirmed_retransmissions);
+    abort_on_error(p2p_set_config(&c));
+    OK_();
 }
 
 
-static void set_rtynum(atci_param_t *param)
+static void p2p_transmit(atci_data_status_t status, atci_param_t *param)
 {
-    uint32_t v;
-    if (!atci_param_get_uint(param, &v)) abort(ERR_PARAM);
-    if (v < 1 || v > 15) abort(ERR_PARAM);
+    TimerStop(&payload_timer);
 
-    if (param->offset != param->length) abort(ERR_PARAM_NO);
+    if (status == ATCI_DATA_ENCODING_ERROR) abort(ERR_PARAM);
+    if (status == ATCI_DATA_ABORTED) abort(ERR_PARAM);
 
-    sysconf.confirmed_retransmissions = v;
-    sysconf_modified = true;
+    abort_on_error(p2p_send(param->txt, param->length));
     OK_();
 }
 
 
-static void get_netid(void)
+static void p2p_tx(atci_param_t *param)
 {
-    MibRequestConfirm_t r = { .Type = MIB_NET_ID };
-    abort_on_error(LoRaMacMibGetRequestConfirm(&r));
-    OK("%08lX", r.Param.NetID);
-}
+    uint32_t size;
 
+    if (!atci_param_get_uint(param, &size)) abort(ERR_PARAM);
+    if (size == 0) abort(ERR_PARAM);
 
-static void set_netid(atci_param_t *param)
-{
-    uint32_t buf;
-    if (atci_param_get_buffer_from_hex(param, &buf, sizeof(buf), 0) != sizeof(buf))
-        abort(ERR_PARAM);
+    unsigned int mul = sysconf.data_format == 1 ? 2 : 1;
+    if (size > P2P_MAX_PAYLOAD * mul) abort(ERR_PAYLOAD_LONG);
 
-    MibRequestConfirm_t r = {
-        .Type  = MIB_NET_ID,
-        .Param = { .NetID = ntohl(buf) }
-    };
-    abort_on_error(LoRaMacMibSetRequestConfirm(&r));
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
 
-    OK_();
+    TimerInit(&payload_timer, payload_timeout);
+    TimerSetSlack(&payload_timer, PAYLOAD_TIMER_SLACK);
+    TimerSetValue(&payload_timer, sysconf.uart_timeout);
+    TimerStart(&payload_timer);
+
+    if (!atci_set_read_next_data(size,
+        sysconf.data_format == 1 ? ATCI_ENCODING_HEX : ATCI_ENCODING_BIN, p2p_transmit))
+        abort(ERR_PAYLOAD_LONG);
 }
 
 
-#if DEBUG_LOG != 0
-static void dbg(atci_param_t *param)
+static void get_p2p_rx(void)
 {
-    (void)param;
-    // RF_IDLE = 0,   //!< The radio is idle
-    // RF_RX_RUNNING, //!< The radio is in the reception state
-    // RF_TX_RUNNING, //!< The radio is in the transmission state
-    // RF_CAD,        //!< The radio is doing channel activity detection
-    atci_printf("sleep_lock=%d stop_lock=%d radio_state=%d loramac_busy=%d\r\n",
-        system_sleep_lock, system_stop_lock, Radio.GetStatus(), LoRaMacIsBusy());
-
-    OK_();
+    p2p_stats_t s;
+    p2p_get_stats(&s);
+    OK("%d,%lu,%lu,%lu", p2p_receiving(), s.received, s.errors, s.dropped);
 }
-#endif
 
-static void do_halt(atci_param_t *param)
+
+static void set_p2p_rx(atci_param_t *param)
 {
-    (void)param;
-    OK_();
-    atci_flush();
+    int v = parse_enabled(param);
+    if (v < 0) abort(ERR_PARAM);
 
-    halt(NULL);
+    abort_on_error(p2p_receive(v));
+    OK_();
 }
 
 
-static void get_nwkkey(void)
+static void get_bulk(void)
 {
-    if (sysconf.lock_keys) abort(ERR_ACCESS_DENIED);
-
-    atci_print("+OK=");
-    atci_print_buffer_as_hex(find_key(NWK_KEY), SE_KEY_SIZE);
-    EOL();
+    bulk_config_t c;
+    bulk_get_config(&c);
+    OK("%lu,%lu,%lu,%d", c.frequency, c.bitrate, c.fdev, c.power);
 }
 
 
-static void set_nwkkey(atci_param_t *param)
+static void set_bulk(atci_param_t *param)
 {
-    uint8_t key[SE_KEY_SIZE];
+    uint32_t freq, bitrate, fdev;
+    int32_t power;
+    bulk_config_t c;
 
-    if (atci_param_get_buffer_from_hex(param, key, SE_KEY_SIZE, 0) != SE_KEY_SIZE)
-        abort(ERR_PARAM);
+    if (!atci_param_get_uint(param, &freq)) abort(ERR_PARAM);
+    if (!atci_param_is_comma(param)) abort(ERR_PARAM);
 
-    MibRequestConfirm_t r = {
-        .Type  = MIB_NWK_KEY,
-        .Param = { .NwkKey = key }
-    };
-    abort_on_error(LoRaMacMibSetRequestConfirm(&r));
+    if (!atci_param_get_uint(param, &bitrate)) abort(ERR_PARAM);
+    if (!atci_param_is_comma(param)) abort(ERR_PARAM);
+
+    if (!atci_param_get_uint(param, &fdev)) abort(ERR_PARAM);
+    if (!atci_param_is_comma(param)) abort(ERR_PARAM);
+
+    if (!atci_param_get_int(param, &power)) abort(ERR_PARAM);
+    if (power < INT8_MIN || power > INT8_MAX) abort(ERR_PARAM);
+
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    c.frequency = freq;
+    c.bitrate = bitrate;
+    c.fdev = fdev;
+    c.power = power;
+
+    abort_on_error(bulk_set_config(&c));
+    OK_();
+}
+
+
+static void bulk_transmit(atci_data_status_t status, atci_param_t *param)
+{
+    TimerStop(&payload_timer);
+
+    if (status == ATCI_DATA_ENCODING_ERROR) abort(ERR_PARAM);
+    if (status == ATCI_DATA_ABORTED) abort(ERR_PARAM);
+
+    abort_on_error(bulk_write(param->txt, param->length));
+    OK_();
+}
+
+
+static void bulk_tx(atci_param_t *param)
+{
+    uint32_t size;
+
+    if (!atci_param_get_uint(param, &size)) abort(ERR_PARAM);
+    if (size == 0) abort(ERR_PARAM);
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    // Refuse the data before the host sends it if the FIFO cannot take it
+    unsigned int mul = sysconf.data_format == 1 ? 2 : 1;
+    if (size > bulk_tx_space() * mul) abort(ERR_BUSY);
+
+    TimerInit(&payload_timer, payload_timeout);
+    TimerSetSlack(&payload_timer, PAYLOAD_TIMER_SLACK);
+    TimerSetValue(&payload_timer, sysconf.uart_timeout);
+    TimerStart(&payload_timer);
+
+    if (!atci_set_read_next_data(size,
+        sysconf.data_format == 1 ? ATCI_ENCODING_HEX : ATCI_ENCODING_BIN, bulk_transmit))
+        abort(ERR_PAYLOAD_LONG);
+}
+
+
+static void get_bulk_tx(void)
+{
+    bulk_stats_t s;
+    bulk_get_stats(false, &s);
+    OK("%d,%u,%lu,%lu,%lu,%lu", bulk_sending(), (unsigned int)bulk_tx_space(), s.bytes, s.frames,
+        s.repeated, s.elapsed);
+}
+
+
+static void bulk_end_tx(atci_param_t *param)
+{
+    (void)param;
+    abort_on_error(bulk_end());
+    OK_();
+}
+
+
+static void get_bulk_rx(void)
+{
+    bulk_stats_t s;
+    bulk_get_stats(true, &s);
+    OK("%d,%lu,%lu,%lu,%lu", bulk_receiving(), s.bytes, s.frames, s.repeated, s.elapsed);
+}
+
+
+static void set_bulk_rx(atci_param_t *param)
+{
+    int v = parse_enabled(param);
+    if (v < 0) abort(ERR_PARAM);
+
+    abort_on_error(bulk_receive(v));
+    OK_();
+}
+
+
+// The payload length of pings sent with the base configuration only
+#define PING_DEFAULT_LENGTH 16
+
+
+static void get_ping(void)
+{
+    ping_state_t s;
+    ping_get_state(&s);
+    OK("%d,%d,%d", ping_running(), s.step, s.steps);
+}
+
+
+static void set_ping(atci_param_t *param)
+{
+    uint32_t count, sf_min, sf_max, bw, length;
+    ping_sweep_t s;
+    p2p_config_t c;
+    unsigned int i;
+
+    if (!atci_param_get_uint(param, &count)) abort(ERR_PARAM);
+    if (count > PING_MAX_COUNT) abort(ERR_PARAM);
+
+    memset(&s, 0, sizeof(s));
+    s.count = count;
+
+    if (atci_param_is_comma(param)) {
+        if (!atci_param_get_uint(param, &sf_min)) abort(ERR_PARAM);
+        if (sf_min < 7 || sf_min > 12) abort(ERR_PARAM);
+        if (!atci_param_is_comma(param)) abort(ERR_PARAM);
+
+        if (!atci_param_get_uint(param, &sf_max)) abort(ERR_PARAM);
+        if (sf_max < sf_min || sf_max > 12) abort(ERR_PARAM);
+        if (!atci_param_is_comma(param)) abort(ERR_PARAM);
+
+        // Bit 0 selects 125 kHz, bit 1 250 kHz, and bit 2 500 kHz
+        if (!atci_param_get_uint(param, &bw)) abort(ERR_PARAM);
+        if (bw == 0 || bw > 7) abort(ERR_PARAM);
+        if (!atci_param_is_comma(param)) abort(ERR_PARAM);
+
+        i = 0;
+        do {
+            if (i == PING_MAX_LENGTHS) abort(ERR_PARAM_NO);
+            if (!atci_param_get_uint(param, &length)) abort(ERR_PARAM);
+            if (length < PING_MIN_LENGTH || length > P2P_MAX_PAYLOAD) abort(ERR_PARAM);
+            s.lengths[i++] = length;
+        } while (atci_param_is_comma(param));
+
+        s.sf_min = sf_min;
+        s.sf_max = sf_max;
+        s.bandwidths = bw;
+    } else {
+        // Without a sweep, ping with the configuration set with AT$P2P
+        p2p_get_config(&c);
+        s.sf_min = s.sf_max = c.sf;
+        s.bandwidths = 1 << c.bandwidth;
+        s.lengths[0] = PING_DEFAULT_LENGTH;
+    }
+
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    if (count == 0) {
+        ping_stop();
+        OK_();
+        return;
+    }
+
+    abort_on_error(ping_start(&s));
+    OK_();
+}
+
+
+static void get_pong(void)
+{
+    ping_state_t s;
+    ping_get_state(&s);
+    OK("%d,%lu", ping_echoing(), s.echoed);
+}
+
+
+static void set_pong(atci_param_t *param)
+{
+    int v = parse_enabled(param);
+    if (v < 0) abort(ERR_PARAM);
+
+    abort_on_error(ping_echo(v));
+    OK_();
+}
+
+
+// Streaming of data larger than the ATCI receive buffer, see AT$STREAM. The
+// host sends no more than it has been granted with +CREDIT lines, so the data
+// never has to wait for room in the sink.
+enum {
+    STREAM_BULK  = 0,  // FSK bulk transfer FIFO
+    STREAM_STORE = 1   // Persistent uplink store, one message per chunk
+};
+
+// How often to check for room in the sink while the host is out of credit (ms)
+#define STREAM_RETRY_INTERVAL 50
+
+static struct {
+    bool active;
+    uint8_t sink;
+    uint8_t size;        // Message size of STREAM_STORE
+    uint32_t ungranted;  // Bytes of the stream not granted yet
+    uint32_t granted;    // Bytes granted but not received yet
+    uint32_t received;
+} stream;
+
+static TimerEvent_t stream_timer;
+static volatile bool stream_poll;
+
+
+static void start_payload_timer(void)
+{
+    TimerInit(&payload_timer, payload_timeout);
+    TimerSetSlack(&payload_timer, PAYLOAD_TIMER_SLACK);
+    TimerSetValue(&payload_timer, sysconf.uart_timeout);
+    TimerStart(&payload_timer);
+}
+
+
+static void on_stream_timer(void *ctx)
+{
+    (void)ctx;
+    stream_poll = true;
+    system_post(SYSTEM_TASK_ATCI);
+}
+
+
+static uint32_t stream_space(void)
+{
+    uint32_t space;
+
+    if (stream.sink == STREAM_BULK) {
+        space = bulk_tx_space();
+    } else {
+        // The store is written synchronously. Granting one message ahead keeps
+        // the UART busy while the previous message is being written to flash.
+        space = 2 * stream.size;
+    }
+    return space > stream.granted ? space - stream.granted : 0;
+}
+
+
+static void grant_credit(void)
+{
+    uint32_t n = stream_space();
+
+    if (n > stream.ungranted) n = stream.ungranted;
+
+    // Do not flood the host with tiny grants while the bulk FIFO drains
+    if (stream.sink == STREAM_BULK && n < stream.ungranted && n < BULK_FRAME_DATA) n = 0;
+
+    if (n) {
+        stream.ungranted -= n;
+        stream.granted += n;
+        atci_printf("+CREDIT=%lu" ATCI_EOL, n);
+        start_payload_timer();
+        atci_stream_grant(n);
+    }
+
+    if (stream.ungranted) {
+        TimerStop(&stream_timer);
+        TimerSetValue(&stream_timer, STREAM_RETRY_INTERVAL);
+        TimerStart(&stream_timer);
+    }
+}
+
+
+static void end_stream(void)
+{
+    TimerStop(&payload_timer);
+    TimerStop(&stream_timer);
+    atci_stream_end();
+    stream.active = false;
+}
+
+
+static void stream_chunk(atci_data_status_t status, atci_param_t *param)
+{
+    int rc = LORAMAC_STATUS_OK;
+
+    stream.granted -= param->length;
+
+    if (status == ATCI_DATA_ENCODING_ERROR || status == ATCI_DATA_ABORTED) {
+        end_stream();
+        abort(ERR_PARAM);
+    }
+
+    if (stream.sink == STREAM_BULK) {
+        rc = bulk_write(param->txt, param->length);
+    } else if (lrw_store(sysconf.default_port, param->txt, param->length, false) < 0) {
+        rc = LORAMAC_STATUS_BUSY;
+    }
+
+    if (rc != LORAMAC_STATUS_OK) {
+        end_stream();
+        abort_on_error(rc);
+    }
+    stream.received += param->length;
+
+    if (status == ATCI_DATA_OK) {
+        end_stream();
+        OK_();
+        return;
+    }
+
+    if (stream.granted) start_payload_timer();
+    else TimerStop(&payload_timer);
+    grant_credit();
+}
+
+
+static void get_stream(void)
+{
+    OK("%d,%lu,%lu", stream.active, stream.received, stream.ungranted + stream.granted);
+}
+
+
+static void set_stream(atci_param_t *param)
+{
+    atci_token_t t[3];
+    int n;
+
+    if (stream.active) abort(ERR_BUSY);
+    if (atci_is_framed()) abort(ERR_UNSUPPORTED);
+
+    n = atci_param_tokenize(param, t, 3);
+    if (n < 0) abort(ERR_PARAM_NO);
+    if (n < 2) abort(ERR_PARAM);
+
+    for (int i = 0; i < n; i++)
+        if (!(t[i].flags & ATCI_TOKEN_DEC)) abort(ERR_PARAM);
+    if (t[1].value == 0) abort(ERR_PARAM);
+
+    switch (t[0].value) {
+        case STREAM_BULK:
+            if (n != 2) abort(ERR_PARAM_NO);
+            stream.size = 0;
+            break;
+
+        case STREAM_STORE:
+            if (n != 3) abort(ERR_PARAM_NO);
+            if (t[2].value == 0 || t[2].value > LRW_TX_QUEUE_MAX_PAYLOAD) abort(ERR_PAYLOAD_LONG);
+            if (!sysconf.tx_store) abort(ERR_BUSY);
+            stream.size = t[2].value;
+            break;
+
+        default:
+            abort(ERR_PARAM);
+    }
+
+    if (!atci_set_read_stream(t[1].value, stream.size,
+        sysconf.data_format == 1 ? ATCI_ENCODING_HEX : ATCI_ENCODING_BIN, stream_chunk))
+        abort(ERR_PARAM);
+
+    stream.active = true;
+    stream.sink = t[0].value;
+    stream.ungranted = t[1].value;
+    stream.granted = 0;
+    stream.received = 0;
+
+    TimerInit(&stream_timer, on_stream_timer);
+    grant_credit();
+}
+
+
+void cmd_process(void)
+{
+    atci_process();
+
+    if (stream_poll) {
+        stream_poll = false;
+        if (stream.active) grant_credit();
+    }
+}
+
+
+static void get_agg(void)
+{
+    agg_config_t c;
+    agg_get_config(&c);
+    OK("%d,%lu,%d", c.port, c.timeout, c.confirmed);
+}
+
+
+static void set_agg(atci_param_t *param)
+{
+    uint32_t port, timeout, confirmed = 0;
+    agg_config_t c;
+
+    if (!atci_param_get_uint(param, &port)) abort(ERR_PARAM);
+    if (!atci_param_is_comma(param)) abort(ERR_PARAM);
+
+    if (!atci_param_get_uint(param, &timeout)) abort(ERR_PARAM);
+
+    if (atci_param_is_comma(param)) {
+        if (!atci_param_get_uint(param, &confirmed)) abort(ERR_PARAM);
+        if (confirmed > 1) abort(ERR_PARAM);
+    }
+
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    c.port = port > UINT8_MAX ? UINT8_MAX : port;
+    c.timeout = timeout;
+    c.confirmed = confirmed;
+
+    abort_on_error(agg_set_config(&c));
+    OK_();
+}
+
+
+static void agg_transmit(atci_data_status_t status, atci_param_t *param)
+{
+    TimerStop(&payload_timer);
+
+    if (status == ATCI_DATA_ENCODING_ERROR) abort(ERR_PARAM);
+    if (status == ATCI_DATA_ABORTED) abort(ERR_PARAM);
+
+    abort_on_error(agg_add(param->txt, param->length));
+    OK_();
+}
+
+
+static void agg_tx(atci_param_t *param)
+{
+    uint32_t size;
+
+    if (!atci_param_get_uint(param, &size)) abort(ERR_PARAM);
+    if (size == 0) abort(ERR_PARAM);
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    unsigned int mul = sysconf.data_format == 1 ? 2 : 1;
+    if (size > (AGG_BUFFER_SIZE - 1) * mul) abort(ERR_PAYLOAD_LONG);
+
+    TimerInit(&payload_timer, payload_timeout);
+    TimerSetSlack(&payload_timer, PAYLOAD_TIMER_SLACK);
+    TimerSetValue(&payload_timer, sysconf.uart_timeout);
+    TimerStart(&payload_timer);
+
+    if (!atci_set_read_next_data(size,
+        sysconf.data_format == 1 ? ATCI_ENCODING_HEX : ATCI_ENCODING_BIN, agg_transmit))
+        abort(ERR_PAYLOAD_LONG);
+}
+
+
+static void get_agg_tx(void)
+{
+    agg_stats_t s;
+    agg_get_stats(&s);
+    OK("%lu,%lu,%lu,%lu,%lu", s.pending, s.bytes, s.readings, s.frames, s.dropped);
+}
+
+
+static void agg_flush_tx(atci_param_t *param)
+{
+    (void)param;
+    agg_flush();
+    OK_();
+}
+
+
+static void get_delta(void)
+{
+    delta_config_t c;
+    delta_get_config(&c);
+
+    atci_printf("+OK=%d,%d,%d", c.port, c.confirmed, c.interval);
+    for (unsigned int i = 0; i < c.fields; i++)
+        atci_printf(",%d", c.width[i]);
+    EOL();
+}
+
+
+static void set_delta(atci_param_t *param)
+{
+    uint32_t port, confirmed, interval, width;
+    delta_config_t c;
+
+    if (!atci_param_get_uint(param, &port)) abort(ERR_PARAM);
+    if (!atci_param_is_comma(param)) abort(ERR_PARAM);
+
+    if (!atci_param_get_uint(param, &confirmed)) abort(ERR_PARAM);
+    if (confirmed > 1) abort(ERR_PARAM);
+    if (!atci_param_is_comma(param)) abort(ERR_PARAM);
+
+    if (!atci_param_get_uint(param, &interval)) abort(ERR_PARAM);
+    if (interval > UINT8_MAX) abort(ERR_PARAM);
+
+    c.fields = 0;
+    while (atci_param_is_comma(param)) {
+        if (c.fields == DELTA_MAX_FIELDS) abort(ERR_PARAM);
+        if (!atci_param_get_uint(param, &width)) abort(ERR_PARAM);
+        if (width > UINT8_MAX) abort(ERR_PARAM);
+        c.width[c.fields++] = width;
+    }
+
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    c.port = port > UINT8_MAX ? UINT8_MAX : port;
+    c.confirmed = confirmed;
+    c.interval = interval;
+
+    abort_on_error(delta_set_config(&c));
+    OK_();
+}
+
+
+static void delta_transmit(atci_data_status_t status, atci_param_t *param)
+{
+    TimerStop(&payload_timer);
+
+    if (status == ATCI_DATA_ENCODING_ERROR) abort(ERR_PARAM);
+    if (status == ATCI_DATA_ABORTED) abort(ERR_PARAM);
+
+    abort_on_error(delta_send(param->txt, param->length));
+    OK_();
+}
+
+
+static void delta_tx(atci_param_t *param)
+{
+    uint32_t size;
+
+    if (!atci_param_get_uint(param, &size)) abort(ERR_PARAM);
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    unsigned int mul = sysconf.data_format == 1 ? 2 : 1;
+    if (delta_frame_size() == 0) abort(ERR_PARAM);
+    if (size != delta_frame_size() * mul) abort(ERR_PARAM);
+
+    TimerInit(&payload_timer, payload_timeout);
+    TimerSetSlack(&payload_timer, PAYLOAD_TIMER_SLACK);
+    TimerSetValue(&payload_timer, sysconf.uart_timeout);
+    TimerStart(&payload_timer);
+
+    if (!atci_set_read_next_data(size,
+        sysconf.data_format == 1 ? ATCI_ENCODING_HEX : ATCI_ENCODING_BIN, delta_transmit))
+        abort(ERR_PAYLOAD_LONG);
+}
+
+
+static void get_delta_tx(void)
+{
+    delta_stats_t s;
+    delta_get_stats(&s);
+    OK("%lu,%lu,%lu,%lu", s.frames, s.keyframes, s.raw, s.encoded);
+}
+
+
+static void get_heartbeat(void)
+{
+    OK("%lu,%d,%d,%d,%d,%d,%lu", sysconf.hb_period, sysconf.hb_port, sysconf.hb_jitter,
+        sysconf.hb_content, sysconf.hb_nvm_offset, sysconf.hb_nvm_length, heartbeat_count());
+}
+
+
+static void set_heartbeat(atci_param_t *param)
+{
+    int port;
+    uint32_t period, jitter = sysconf.hb_jitter, content = sysconf.hb_content,
+        offset = sysconf.hb_nvm_offset, length = sysconf.hb_nvm_length;
+
+    if (!atci_param_get_uint(param, &period)) abort(ERR_PARAM);
+    if (period != 0 && (period < 10 || period > 604800)) abort(ERR_PARAM);
+    if (!atci_param_is_comma(param)) abort(ERR_PARAM);
+
+    port = parse_port(param);
+    if (port < 0) abort(ERR_PARAM);
+
+    if (atci_param_is_comma(param)) {
+        if (!atci_param_get_uint(param, &jitter)) abort(ERR_PARAM);
+        if (jitter > 50) abort(ERR_PARAM);
+
+        if (atci_param_is_comma(param)) {
+            if (!atci_param_get_uint(param, &content)) abort(ERR_PARAM);
+            if (content > (HEARTBEAT_COUNTER | HEARTBEAT_BATTERY | HEARTBEAT_USER_NVM))
+                abort(ERR_PARAM);
+
+            if (atci_param_is_comma(param)) {
+                if (!atci_param_get_uint(param, &offset)) abort(ERR_PARAM);
+                if (!atci_param_is_comma(param)) abort(ERR_PARAM);
+                if (!atci_param_get_uint(param, &length)) abort(ERR_PARAM);
+                if (offset >= USER_NVM_MAX_SIZE || length > HEARTBEAT_MAX_NVM
+                    || length > USER_NVM_MAX_SIZE - offset) abort(ERR_PARAM);
+            }
+        }
+    }
+
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    sysconf.hb_period = period;
+    sysconf.hb_port = port;
+    sysconf.hb_jitter = jitter;
+    sysconf.hb_content = content;
+    sysconf.hb_nvm_offset = offset;
+    sysconf.hb_nvm_length = length;
+    sysconf_modified = true;
+
+    heartbeat_reschedule();
+    OK_();
+}
+
+
+// The number of RSSI samples per channel taken by AT$SCAN without a parameter
+#define SCAN_SAMPLES 16
+
+// The receiver bandwidth used by AT$SCAN, matching the LoRa 125 kHz channels
+#define SCAN_BANDWIDTH 125000
+
+
+static void run_scan(unsigned int samples)
+{
+    static const RadioEvents_t no_events;
+    static struct {
+        int16_t min, avg, max;
+    } result[REGION_NVM_CHANNELS_MASK_SIZE * 16];
+    ChannelParams_t *c;
+    unsigned int i, n = 0, nb_channels = lrw_get_max_channels();
+
+    MibRequestConfirm_t r = { .Type = MIB_CHANNELS };
+    abort_on_error(LoRaMacMibGetRequestConfirm(&r));
+
+    // Take the radio from LoRaMac for the duration of the sweep. The results
+    // are printed afterwards so that the UART does not slow the sweep down.
+    abort_on_error(p2p_claim(&no_events));
+    for (i = 0; i < nb_channels; i++) {
+        c = r.Param.ChannelList + i;
+        if (c->Frequency == 0) continue;
+        radio_scan(c->Frequency, SCAN_BANDWIDTH, samples,
+            &result[i].min, &result[i].avg, &result[i].max);
+        lrw_channel_noise(c->Frequency, result[i].avg);
+        n++;
+    }
+    p2p_release();
+
+    atci_printf("+OK=%d", n);
+    for (i = 0; i < nb_channels; i++) {
+        c = r.Param.ChannelList + i;
+        if (c->Frequency == 0) continue;
+        atci_printf(";%d,%lu,%d,%d,%d", i, c->Frequency, result[i].min,
+            result[i].avg, result[i].max);
+    }
+    EOL();
+}
+
+
+static void scan(atci_param_t *param)
+{
+    (void)param;
+    run_scan(SCAN_SAMPLES);
+}
+
+
+static void set_scan(atci_param_t *param)
+{
+    uint32_t samples;
+
+    if (!atci_param_get_uint(param, &samples)) abort(ERR_PARAM);
+    if (samples < 1 || samples > 1000) abort(ERR_PARAM);
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    run_scan(samples);
+}
+
+
+static void get_cst(void)
+{
+    MibRequestConfirm_t r = { .Type = MIB_CARRIER_SENSE_TIME };
+
+    LoRaMacStatus_t rc = LoRaMacMibGetRequestConfirm(&r);
+    if (rc == LORAMAC_STATUS_ERROR) abort(ERR_UNSUPPORTED);
+    abort_on_error(rc);
+
+    OK("%lu", r.Param.CarrierSenseTime);
+}
+
+
+static void set_cst(atci_param_t *param)
+{
+    uint32_t cst;
+
+    if (!atci_param_get_uint(param, &cst)) abort(ERR_PARAM);
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    MibRequestConfirm_t r = { .Type = MIB_CARRIER_SENSE_TIME };
+    r.Param.CarrierSenseTime = cst;
+
+    LoRaMacStatus_t rc = LoRaMacMibSetRequestConfirm(&r);
+    if (rc == LORAMAC_STATUS_ERROR) abort(ERR_UNSUPPORTED);
+    abort_on_error(rc);
+
+    OK_();
+}
+
+
+static void get_backoff(void)
+{
+    TimerTime_t now = rtc_tick2ms(rtc_get_timer_value());
+    OK("%ld", lrw_dutycycle_deadline > now ? lrw_dutycycle_deadline - now : 0);
+}
+
+
+// A version compatible with the original Type ABZ firmware
+static void get_chmask_comp(void)
+{
+    MibRequestConfirm_t r = { .Type = MIB_CHANNELS_MASK };
+    abort_on_error(LoRaMacMibGetRequestConfirm(&r));
+    atci_print("+OK=");
+    atci_print_buffer_as_hex(r.Param.ChannelsMask, lrw_get_max_channels() / 8);
+    EOL();
+}
+
+
+static bool parse_chmask(uint16_t *buf, size_t len, const atci_token_t *token)
+{
+    size_t chmask_bytes = lrw_get_max_channels() / 8;
+
+    if (chmask_bytes > len) return false;
+    memset(buf, 0, len);
+    return atci_token_get_hex(token, buf, chmask_bytes);
+}
+
+
+// A version compatible with the original Type ABZ firmware
+static void set_chmask_comp(atci_param_t *param)
+{
+    uint16_t chmask[REGION_NVM_CHANNELS_MASK_SIZE];
+    atci_token_t t;
+
+    int n;
+
+    n = atci_param_tokenize(param, &t, 1);
+    if (n < 0) abort(ERR_PARAM_NO);
+    if (n != 1) abort(ERR_PARAM);
+
+    if (!parse_chmask(chmask, sizeof(chmask), &t)) abort(ERR_PARAM);
+
+    // First set the default channel mask. The default channel mask is the
+    // channel mask used before Join or ADR.
+    MibRequestConfirm_t r = {
+        .Type  = MIB_CHANNELS_DEFAULT_MASK,
+        .Param = { .ChannelsDefaultMask = chmask }
+    };
+    abort_on_error(LoRaMacMibSetRequestConfirm(&r));
+
+    // Then update the channel mask currently in use
+    r.Type = MIB_CHANNELS_MASK;
+    r.Param.ChannelsMask = chmask;
+    abort_on_error(LoRaMacMibSetRequestConfirm(&r));
+
+    OK_();
+}
+
+
+// AT$CHPLAN carries a channel plan as a hex blob: the number of channels,
+// followed by that many 5-byte channel entries, followed by the channel mask
+// (lrw_get_max_channels() / 8 bytes), which is optional when loading. Each
+// entry holds the channel index, the frequency in units of 100 Hz (24 bits,
+// little endian), and the data rate range (max << 4 | min) as in the
+// NewChannelReq MAC command. A zero frequency removes the channel.
+#define CHPLAN_ENTRY_SIZE 5
+
+static void get_chplan(void)
+{
+    ChannelParams_t *c;
+    uint8_t entry[CHPLAN_ENTRY_SIZE];
+    LoRaMacNvmData_t *state = lrw_get_state();
+    GetPhyParams_t pr = { .Attribute = PHY_MAX_NB_CHANNELS };
+    unsigned nb_channels = RegionGetPhyParam(state->MacGroup2.Region, &pr).Value;
+    uint8_t n = 0;
+
+    MibRequestConfirm_t r = { .Type = MIB_CHANNELS };
+    abort_on_error(LoRaMacMibGetRequestConfirm(&r));
+
+    for (unsigned i = 0; i < nb_channels; i++)
+        if (r.Param.ChannelList[i].Frequency != 0) n++;
+
+    atci_print("+OK=");
+    atci_print_buffer_as_hex(&n, 1);
+    for (unsigned i = 0; i < nb_channels; i++) {
+        c = r.Param.ChannelList + i;
+        if (c->Frequency == 0) continue;
+        entry[0] = i;
+        entry[1] = (c->Frequency / 100) & 0xff;
+        entry[2] = (c->Frequency / 100) >> 8 & 0xff;
+        entry[3] = (c->Frequency / 100) >> 16 & 0xff;
+        entry[4] = c->DrRange.Fields.Max << 4 | c->DrRange.Fields.Min;
+        atci_print_buffer_as_hex(entry, sizeof(entry));
+    }
+
+    r.Type = MIB_CHANNELS_MASK;
+    LoRaMacMibGetRequestConfirm(&r);
+    atci_print_buffer_as_hex(r.Param.ChannelsMask, lrw_get_max_channels() / 8);
+    EOL();
+}
+
+
+static void set_chplan(atci_param_t *param)
+{
+    uint8_t buf[1 + LRW_CHPLAN_MAX * CHPLAN_ENTRY_SIZE + REGION_NVM_CHANNELS_MASK_SIZE * 2];
+    uint16_t mask[REGION_NVM_CHANNELS_MASK_SIZE];
+    lrw_channel_t channels[LRW_CHPLAN_MAX];
+    size_t len, mask_bytes = lrw_get_max_channels() / 8;
+    const uint8_t *p;
+    unsigned int count;
+
+    if ((param->length - param->offset) & 1) abort(ERR_PARAM);
+    len = atci_param_get_buffer_from_hex(param, buf, sizeof(buf), 0);
+    if (len == 0 || param->offset != param->length) abort(ERR_PARAM);
+
+    count = buf[0];
+    if (count > LRW_CHPLAN_MAX) abort(ERR_PARAM);
+    if (len < 1 + count * CHPLAN_ENTRY_SIZE) abort(ERR_PARAM);
+    len -= 1 + count * CHPLAN_ENTRY_SIZE;
+    if (len != 0 && len != mask_bytes) abort(ERR_PARAM);
+
+    p = buf + 1;
+    for (unsigned int i = 0; i < count; i++, p += CHPLAN_ENTRY_SIZE) {
+        channels[i].index = p[0];
+        channels[i].frequency = (p[1] | p[2] << 8 | (uint32_t)p[3] << 16) * 100;
+        channels[i].dr_min = p[4] & 0xf;
+        channels[i].dr_max = p[4] >> 4;
+    }
+
+    if (len) {
+        memset(mask, 0, sizeof(mask));
+        memcpy(mask, p, mask_bytes);
+    }
+
+    abort_on_error(lrw_set_chplan(channels, count, len ? mask : NULL));
+    OK_();
+}
+
+
+static void get_rtynum(void)
+{
+    OK("%d", sysconf.confirmed_retransmissions);
+}
+
+
+static void set_rtynum(atci_param_t *param)
+{
+    uint32_t v;
+    if (!atci_param_get_uint(param, &v)) abort(ERR_PARAM);
+    if (v < 1 || v > 15) abort(ERR_PARAM);
+
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    sysconf.confirmed_retransmissions = v;
+    sysconf_modified = true;
+    OK_();
+}
+
+
+static void get_netid(void)
+{
+    MibRequestConfirm_t r = { .Type = MIB_NET_ID };
+    abort_on_error(LoRaMacMibGetRequestConfirm(&r));
+    OK("%08lX", r.Param.NetID);
+}
+
+
+static void set_netid(atci_param_t *param)
+{
+    uint32_t buf;
+    if (atci_param_get_buffer_from_hex(param, &buf, sizeof(buf), 0) != sizeof(buf))
+        abort(ERR_PARAM);
+
+    MibRequestConfirm_t r = {
+        .Type  = MIB_NET_ID,
+        .Param = { .NetID = ntohl(buf) }
+    };
+    abort_on_error(LoRaMacMibSetRequestConfirm(&r));
+
+    OK_();
+}
+
+
+#if DEBUG_LOG != 0
+static void dbg(atci_param_t *param)
+{
+    (void)param;
+    // RF_IDLE = 0,   //!< The radio is idle
+    // RF_RX_RUNNING, //!< The radio is in the reception state
+    // RF_TX_RUNNING, //!< The radio is in the transmission state
+    // RF_CAD,        //!< The radio is doing channel activity detection
+    atci_printf("sleep_lock=%d stop_lock=%d tasks=%d radio_state=%d loramac_busy=%d\r\n",
+        system_sleep_lock, system_stop_lock, system_tasks, Radio.GetStatus(), LoRaMacIsBusy());
+
+    OK_();
+}
+#endif
+
+static void do_halt(atci_param_t *param)
+{
+    (void)param;
+    OK_();
+    atci_flush();
+
+    halt(NULL);
+}
+
+
+static void get_nwkkey(void)
+{
+    if (sysconf.lock_keys) abort(ERR_ACCESS_DENIED);
+
+    atci_print("+OK=");
+    atci_print_buffer_as_hex(find_key(NWK_KEY), SE_KEY_SIZE);
+    EOL();
+}
+
+
+static void set_nwkkey(atci_param_t *param)
+{
+    uint8_t key[SE_KEY_SIZE];
+
+    if (atci_param_get_buffer_from_hex(param, key, SE_KEY_SIZE, 0) != SE_KEY_SIZE)
+        abort(ERR_PARAM);
+
+    MibRequestConfirm_t r = {
+        .Type  = MIB_NWK_KEY,
+        .Param = { .NwkKey = key }
+    };
+    abort_on_error(LoRaMacMibSetRequestConfirm(&r));
+
+    OK_();
+}
+
+
+static void get_fnwksintkey(void)
+{
+    if (sysconf.lock_keys) abort(ERR_ACCESS_DENIED);
+
+    atci_print("+OK=");
+    atci_print_buffer_as_hex(find_key(F_NWK_S_INT_KEY), SE_KEY_SIZE);
+    EOL();
+}
+
+
+static void set_fnwksintkey(atci_param_t *param)
+{
+    uint8_t key[SE_KEY_SIZE];
+
+    if (atci_param_get_buffer_from_hex(param, key, SE_KEY_SIZE, 0) != SE_KEY_SIZE)
+        abort(ERR_PARAM);
+
+    MibRequestConfirm_t r = {
+        .Type  = MIB_F_NWK_S_INT_KEY,
+        .Param = { .FNwkSIntKey = key }
+    };
+    abort_on_error(LoRaMacMibSetRequestConfirm(&r));
+
+    OK_();
+}
+
+
+static void get_snwksintkey(void)
+{
+    if (sysconf.lock_keys) abort(ERR_ACCESS_DENIED);
+
+    atci_print("+OK=");
+    atci_print_buffer_as_hex(find_key(S_NWK_S_INT_KEY), SE_KEY_SIZE);
+    EOL();
+}
+
+
+static void set_snwksintkey(atci_param_t *param)
+{
+    uint8_t key[SE_KEY_SIZE];
+
+    if (atci_param_get_buffer_from_hex(param, key, SE_KEY_SIZE, 0) != SE_KEY_SIZE)
+        abort(ERR_PARAM);
+
+    MibRequestConfirm_t r = {
+        .Type  = MIB_S_NWK_S_INT_KEY,
+        .Param = { .SNwkSIntKey = key }
+    };
+    abort_on_error(LoRaMacMibSetRequestConfirm(&r));
+
+    OK_();
+}
+
+
+static void get_nwksenckey(void)
+{
+    if (sysconf.lock_keys) abort(ERR_ACCESS_DENIED);
+
+    atci_print("+OK=");
+    atci_print_buffer_as_hex(find_key(NWK_S_ENC_KEY), SE_KEY_SIZE);
+    EOL();
+}
+
+
+static void set_nwksenckey(atci_param_t *param)
+{
+    uint8_t key[SE_KEY_SIZE];
+
+    if (atci_param_get_buffer_from_hex(param, key, SE_KEY_SIZE, 0) != SE_KEY_SIZE)
+        abort(ERR_PARAM);
+
+    MibRequestConfirm_t r = {
+        .Type  = MIB_NWK_S_ENC_KEY,
+        .Param = { .NwkSEncKey = key }
+    };
+    abort_on_error(LoRaMacMibSetRequestConfirm(&r));
+
+    OK_();
+}
+
+
+static void get_chmask(void)
+{
+    atci_print("+OK=");
+
+    MibRequestConfirm_t r = { .Type = MIB_CHANNELS_MASK };
+    LoRaMacMibGetRequestConfirm(&r);
+    atci_print_buffer_as_hex(r.Param.ChannelsMask, lrw_get_max_channels() / 8);
+
+    atci_print(",");
+
+    r.Type = MIB_CHANNELS_DEFAULT_MASK;
+    LoRaMacMibGetRequestConfirm(&r);
+    atci_print_buffer_as_hex(r.Param.ChannelsDefaultMask, lrw_get_max_channels() / 8);
+
+    EOL();
+}
+
+
+static void set_chmask(atci_param_t *param)
+{
+    uint16_t chmask1[REGION_NVM_CHANNELS_MASK_SIZE];
+    uint16_t chmask2[REGION_NVM_CHANNELS_MASK_SIZE];
+    atci_token_t t[2];
+    int n;
+
+    n = atci_param_tokenize(param, t, 2);
+    if (n < 0) abort(ERR_PARAM_NO);
+    if (n != 2) abort(ERR_PARAM);
+
+    if (!parse_chmask(chmask1, sizeof(chmask1), &t[0])) abort(ERR_PARAM);
+    if (!parse_chmask(chmask2, sizeof(chmask2), &t[1])) abort(ERR_PARAM);
+
+    MibRequestConfirm_t r = {
+        .Type  = MIB_CHANNELS_DEFAULT_MASK,
+        .Param = { .ChannelsDefaultMask = chmask2 }
+    };
+    abort_on_error(LoRaMacMibSetRequestConfirm(&r));
+
+    // Then update the channel mask currently in use
+    r.Type = MIB_CHANNELS_MASK;
+    r.Param.ChannelsMask = chmask1;
+    abort_on_error(LoRaMacMibSetRequestConfirm(&r));
+
+    OK_();
+}
+
+
+static void get_rx2(void)
+{
+    MibRequestConfirm_t r1 = { .Type = MIB_RX2_CHANNEL };
+    LoRaMacMibGetRequestConfirm(&r1);
+
+    MibRequestConfirm_t r2 = { .Type = MIB_RX2_DEFAULT_CHANNEL };
+    LoRaMacMibGetRequestConfirm(&r2);
+
+    OK("%ld,%d,%ld,%d", r1.Param.Rx2Channel.Frequency, r1.Param.Rx2Channel.Datarate,
+        r2.Param.Rx2DefaultChannel.Frequency, r2.Param.Rx2DefaultChannel.Datarate);
+}
+
+
+static void set_rx2(atci_param_t *param)
+{
+    uint32_t freq1, dr1, freq2, dr2;
+
+    if (!atci_param_get_uint(param, &freq1)) abort(ERR_PARAM);
+    if (!atci_param_is_comma(param)) abort(ERR_PARAM);
+    if (!atci_param_get_uint(param, &dr1)) abort(ERR_PARAM);
+
+    if (!atci_param_is_comma(param)) abort(ERR_PARAM);
+
+    if (!atci_param_get_uint(param, &freq2)) abort(ERR_PARAM);
+    if (!atci_param_is_comma(param)) abort(ERR_PARAM);
+    if (!atci_param_get_uint(param, &dr2)) abort(ERR_PARAM);
+
+    if (dr1 > 15 || dr2 > 15) abort(ERR_PARAM);
+
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    MibRequestConfirm_t r = {
+        .Type = MIB_RX2_DEFAULT_CHANNEL,
+        .Param = {
+            .Rx2DefaultChannel = {
+                .Frequency = freq2,
+                .Datarate = dr2
+            }
+        }
+    };
+    abort_on_error(LoRaMacMibSetRequestConfirm(&r));
+
+    r.Type = MIB_RX2_CHANNEL;
+    r.Param.Rx2Channel.Frequency = freq1;
+    r.Param.Rx2Channel.Datarate = dr1;
+    abort_on_error(LoRaMacMibSetRequestConfirm(&r));
+
+    OK_();
+}
+
+
+static void get_dr(void)
+{
+    MibRequestConfirm_t r1 = { .Type = MIB_CHANNELS_DATARATE };
+    LoRaMacMibGetRequestConfirm(&r1);
+
+    MibRequestConfirm_t r2 = { .Type = MIB_CHANNELS_DEFAULT_DATARATE };
+    LoRaMacMibGetRequestConfirm(&r2);
+
+    OK("%d,%d", r1.Param.ChannelsDatarate, r2.Param.ChannelsDefaultDatarate);
+}
+
+
+static void set_dr(atci_param_t *param)
+{
+    uint32_t val1, val2;
+
+    if (!atci_param_get_uint(param, &val1)) abort(ERR_PARAM);
+    if (val1 > 15) abort(ERR_PARAM);
+
+    if (!atci_param_is_comma(param)) abort(ERR_PARAM);
+
+    if (!atci_param_get_uint(param, &val2)) abort(ERR_PARAM);
+    if (val2 > 15) abort(ERR_PARAM);
+
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    MibRequestConfirm_t r = {
+        .Type  = MIB_CHANNELS_DEFAULT_DATARATE,
+        .Param = { .ChannelsDefaultDatarate = val2 }
+    };
+    abort_on_error(LoRaMacMibSetRequestConfirm(&r));
+
+    r.Type = MIB_CHANNELS_DATARATE;
+    r.Param.ChannelsDatarate = val1;
+    abort_on_error(LoRaMacMibSetRequestConfirm(&r));
+
+    OK_();
+}
+
+
+static void get_rfpower(void)
+{
+    MibRequestConfirm_t r1 = { .Type  = MIB_CHANNELS_TX_POWER };
+    LoRaMacMibGetRequestConfirm(&r1);
+    MibRequestConfirm_t r2 = { .Type  = MIB_CHANNELS_DEFAULT_TX_POWER };
+    LoRaMacMibGetRequestConfirm(&r2);
+    OK("0,%d,0,%d", r1.Param.ChannelsTxPower, r2.Param.ChannelsDefaultTxPower);
+}
+
+
+static void set_rfpower(atci_param_t *param)
+{
+    uint32_t paboost1, paboost2, val1, val2;
+
+    if (!atci_param_get_uint(param, &paboost1)) abort(ERR_PARAM);
+    if (paboost1 != 0) {
+        log_warning("PA boost currently unsupported");
+        abort(ERR_PARAM);
+    }
+
+    if (!atci_param_is_comma(param)) abort(ERR_PARAM);
+
+    if (!atci_param_get_uint(param, &val1)) abort(ERR_PARAM);
+    if (val1 > 15) abort(ERR_PARAM);
+
+    if (!atci_param_is_comma(param)) abort(ERR_PARAM);
+
+    if (!atci_param_get_uint(param, &paboost2)) abort(ERR_PARAM);
+    if (paboost2 != 0) {
+        log_warning("PA boost currently unsupported");
+        abort(ERR_PARAM);
+    }
+
+    if (!atci_param_is_comma(param)) abort(ERR_PARAM);
+
+    if (!atci_param_get_uint(param, &val2)) abort(ERR_PARAM);
+    if (val2 > 15) abort(ERR_PARAM);
+
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    MibRequestConfirm_t r = {
+        .Type  = MIB_CHANNELS_DEFAULT_TX_POWER,
+        .Param = { .ChannelsDefaultTxPower = val2 }
+    };
+    abort_on_error(LoRaMacMibSetRequestConfirm(&r));
+
+    r.Type = MIB_CHANNELS_TX_POWER;
+    r.Param.ChannelsTxPower = val1;
+    abort_on_error(LoRaMacMibSetRequestConfirm(&r));
+
+    OK_();
+}
+
+
+static void set_async(atci_param_t *param)
+{
+    uint32_t v;
+
+    if (!atci_param_get_uint(param, &v))
+        abort(ERR_PARAM);
+
+    if (v > 1) abort(ERR_PARAM);
+
+    sysconf.async_uart = v;
+    sysconf_modified = true;
+    OK_();
+}
+
+
+static void get_async(void)
+{
+    OK("%d", sysconf.async_uart);
+}
+
+
+static void get_coalesce(void)
+{
+    OK("%d", sysconf.uart_coalesce);
+}
+
+
+static void set_coalesce(atci_param_t *param)
+{
+    uint32_t v;
+
+    if (!atci_param_get_uint(param, &v)) abort(ERR_PARAM);
+    if (v > UINT16_MAX) abort(ERR_PARAM);
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    // The new window applies to notifications generated after the response.
+    // Notifications held so far have been released by this command.
+    sysconf.uart_coalesce = v;
+    sysconf_modified = true;
+    OK_();
+}
+
+
+static void get_nvmpolicy(void)
+{
+    OK("%d,%d", sysconf.nvm_window, sysconf.nvm_fcnt_margin);
+}
+
+
+static void set_nvmpolicy(atci_param_t *param)
+{
+    uint32_t window, margin = 16;
+
+    if (!atci_param_get_uint(param, &window)) abort(ERR_PARAM);
+    if (window > UINT8_MAX) abort(ERR_PARAM);
+
+    if (param->offset < param->length) {
+        if (!atci_param_is_comma(param)) abort(ERR_PARAM);
+        if (!atci_param_get_uint(param, &margin)) abort(ERR_PARAM);
+        if (margin > UINT8_MAX) abort(ERR_PARAM);
+    }
+
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    // Write any changes pending under the old policy first
+    if (window == 0) lrw_flush_state();
+
+    sysconf.nvm_window = window;
+    sysconf.nvm_fcnt_margin = margin;
+    sysconf_modified = true;
+    OK_();
+}
+
+
+static void get_txqueue(void)
+{
+    OK("%d,%u", sysconf.tx_queue, lrw_tx_queue_length());
+}
+
+
+static void set_txqueue(atci_param_t *param)
+{
+    int v = parse_enabled(param);
+    if (v < 0) abort(ERR_PARAM);
+
+    // Messages already in the queue continue to be transmitted when the queue
+    // is disabled. Only new messages are sent right away.
+    sysconf.tx_queue = v;
+    sysconf_modified = true;
+    OK_();
+}
+
+
+static void get_standby(void)
+{
+    OK("%d", sysconf.standby);
+}
+
+
+static void set_standby(atci_param_t *param)
+{
+    int v = parse_enabled(param);
+    if (v < 0) abort(ERR_PARAM);
+
+    sysconf.standby = v;
+    sysconf_modified = true;
+    OK_();
+}
+
+
+static void get_chpolicy(void)
+{
+    OK("%d", sysconf.chpolicy);
+}
+
+
+static void set_chpolicy(atci_param_t *param)
+{
+    int v = parse_enabled(param);
+    if (v < 0) abort(ERR_PARAM);
+
+    sysconf.chpolicy = v;
+    sysconf_modified = true;
+    OK_();
+}
+
+
+static void get_split(void)
+{
+    OK("%d", sysconf.split_port);
+}
+
+
+static void set_split(atci_param_t *param)
+{
+    uint32_t v;
+
+    if (!atci_param_get_uint(param, &v)) abort(ERR_PARAM);
+    if (v > 223) abort(ERR_PARAM);
+
+    sysconf.split_port = v;
+    sysconf_modified = true;
+    OK_();
+}
+
+
+static void get_slot(void)
+{
+    // The configured offset is -1 if the slot is derived from the DevAddr.
+    // The last field is the slot in effect.
+    OK("%u,%u,%d,%u", sysconf.slot_period, sysconf.slot_width,
+        sysconf.slot_offset == SYSCONF_SLOT_AUTO ? -1 : sysconf.slot_offset,
+        lrw_uplink_slot());
+}
+
+
+static void set_slot(atci_param_t *param)
+{
+    uint32_t period, width = sysconf.slot_width, offset = SYSCONF_SLOT_AUTO;
+
+    if (!atci_param_get_uint(param, &period)) abort(ERR_PARAM);
+    if (period > UINT16_MAX) abort(ERR_PARAM);
+
+    if (atci_param_is_comma(param)) {
+        if (!atci_param_get_uint(param, &width)) abort(ERR_PARAM);
+        if (width == 0 || width > UINT8_MAX) abort(ERR_PARAM);
+
+        if (atci_param_is_comma(param)) {
+            if (!atci_param_get_uint(param, &offset)) abort(ERR_PARAM);
+            if (offset >= period) abort(ERR_PARAM);
+        }
+    }
+
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+    if (period != 0 && width > period) abort(ERR_PARAM);
+
+    sysconf.slot_period = period;
+    sysconf.slot_width = width;
+    sysconf.slot_offset = offset;
+    sysconf_modified = true;
+    OK_();
+}
+
+
+static void get_class_c(void)
+{
+    uint32_t windows;
+    bool open = lrw_get_class_c_window(&windows);
+
+    // The last two fields are the state of the window and the number of
+    // windows opened since boot
+    OK("%d,%u,%lu,%lu,%d,%lu", sysconf.class_c_policy, sysconf.class_c_window,
+        sysconf.class_c_period, sysconf.class_c_offset, open, windows);
+}
+
+
+static void set_class_c(atci_param_t *param)
+{
+    uint32_t policy, window, period = sysconf.class_c_period, offset = 0;
+
+    if (!atci_param_get_uint(param, &policy)) abort(ERR_PARAM);
+    if (policy & ~(LRW_CLASS_C_UPLINK | LRW_CLASS_C_PENDING | LRW_CLASS_C_SCHEDULE))
+        abort(ERR_PARAM);
+    if (!atci_param_is_comma(param)) abort(ERR_PARAM);
+
+    if (!atci_param_get_uint(param, &window)) abort(ERR_PARAM);
+    if (window > UINT16_MAX) abort(ERR_PARAM);
+
+    if (atci_param_is_comma(param)) {
+        if (!atci_param_get_uint(param, &period)) abort(ERR_PARAM);
+
+        if (atci_param_is_comma(param)) {
+            if (!atci_param_get_uint(param, &offset)) abort(ERR_PARAM);
+            if (offset >= period) abort(ERR_PARAM);
+        }
+    }
+
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+    if ((policy & LRW_CLASS_C_SCHEDULE) && (period == 0 || window >= period))
+        abort(ERR_PARAM);
+
+    sysconf.class_c_policy = policy;
+    sysconf.class_c_window = window;
+    sysconf.class_c_period = period;
+    sysconf.class_c_offset = offset;
+    sysconf_modified = true;
+
+    lrw_class_c_reschedule();
+    OK_();
+}
+
+
+static void get_rtx_backoff(void)
+{
+    OK("%d,%d,%d", sysconf.rtx_backoff_base, sysconf.rtx_backoff_max,
+        sysconf.rtx_backoff_jitter);
+}
+
+
+static void set_rtx_backoff(atci_param_t *param)
+{
+    uint32_t base, max = sysconf.rtx_backoff_max, jitter = sysconf.rtx_backoff_jitter;
+
+    if (!atci_param_get_uint(param, &base)) abort(ERR_PARAM);
+    if (base > UINT16_MAX) abort(ERR_PARAM);
+
+    if (atci_param_is_comma(param)) {
+        if (!atci_param_get_uint(param, &max)) abort(ERR_PARAM);
+        if (max > UINT16_MAX) abort(ERR_PARAM);
+
+        if (atci_param_is_comma(param)) {
+            if (!atci_param_get_uint(param, &jitter)) abort(ERR_PARAM);
+            if (jitter > 100) abort(ERR_PARAM);
+        }
+    }
+
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+    if (base != 0 && max < base) abort(ERR_PARAM);
+
+    sysconf.rtx_backoff_base = base;
+    sysconf.rtx_backoff_max = max;
+    sysconf.rtx_backoff_jitter = jitter;
+    sysconf_modified = true;
+    OK_();
+}
+
+
+// +OK=uplinks,retransmissions,acks,noacks,downlinks,mac_only,joins,overruns,
+// eeprom_writes;airtime DR0,...,airtime DRn;channel:transmissions,...
+static void get_stats(void)
+{
+    const lrw_stats_t *s = lrw_stats();
+    unsigned int i, n = 1;
+    char sep = ';';
+
+    atci_printf("+OK=%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu", s->uplinks,
+        s->retransmissions, s->acks, s->noacks, s->downlinks, s->mac_only,
+        s->joins, lpuart_overruns, eeprom_writes);
+
+    // The LPUART counters start over on every read so that they can be
+    // sampled over a test run without a separate reset
+    atci_printf(",%lu,%lu,%lu,%u,%u", lpuart_rx_dropped, lpuart_tx_stalls,
+        lpuart_tx_stall_time, (unsigned int)lpuart_tx_fifo.peak,
+        (unsigned int)lpuart_rx_fifo.peak);
+    lpuart_overruns = 0;
+    lpuart_rx_dropped = 0;
+    lpuart_tx_stalls = 0;
+    lpuart_tx_stall_time = 0;
+    lpuart_tx_fifo.peak = cbuf_length(&lpuart_tx_fifo);
+    lpuart_rx_fifo.peak = cbuf_length(&lpuart_rx_fifo);
+
+    for (i = 0; i < LRW_STATS_DATARATES; i++)
+        if (s->airtime[i]) n = i + 1;
+    for (i = 0; i < n; i++)
+        atci_printf("%c%lu", i ? ',' : ';', s->airtime[i]);
+
+    for (i = 0; i < LRW_STATS_CHANNELS; i++) {
+        if (s->transmissions[i] == 0) continue;
+        atci_printf("%c%d:%u", sep, i, s->transmissions[i]);
+        sep = ',';
+    }
+    if (sep == ';') atci_printf(";");
+    EOL();
+}
+
+
+static void reset_stats(atci_param_t *param)
+{
+    (void)param;
+    lrw_stats_reset();
+    lpuart_overruns = 0;
+    lpuart_rx_dropped = 0;
+    lpuart_tx_stalls = 0;
+    lpuart_tx_stall_time = 0;
+    eeprom_writes = 0;
+    OK_();
+}
+
+
+static void get_mem(void)
+{
+    system_ram_t r;
+    pool_stats_t s;
+
+    system_get_ram(&r);
+    pool_get_stats(&s);
+
+    atci_printf("+OK=%lu,%lu,%lu,%lu", r.data, r.bss, r.stack, r.stack_peak);
+    atci_printf(";%u,%u,%u,%u", (unsigned int)lpuart_tx_fifo.max_length,
+        (unsigned int)lpuart_tx_fifo.peak, (unsigned int)lpuart_rx_fifo.max_length,
+        (unsigned int)lpuart_rx_fifo.peak);
+    atci_printf(";%lu,%d,%d,%d", s.failures, s.owned[POOL_LRW_TX], s.owned[POOL_LRW_RX],
+        s.owned[POOL_P2P]);
+    for (unsigned int i = 0; i < POOL_CLASSES; i++)
+        atci_printf(";%d,%d,%d,%d", s.cls[i].size, s.cls[i].blocks, s.cls[i].used, s.cls[i].peak);
+    EOL();
+}
+
+
+static void reset_mem(atci_param_t *param)
+{
+    (void)param;
+    pool_reset_stats();
+    lpuart_tx_fifo.peak = 0;
+    lpuart_rx_fifo.peak = 0;
+    OK_();
+}
+
+
+static void get_chstat(void)
+{
+    lrw_channel_stats_t s;
+    unsigned int i, n = 0, nb_channels = lrw_get_max_channels();
+
+    MibRequestConfirm_t r = { .Type = MIB_CHANNELS };
+    abort_on_error(LoRaMacMibGetRequestConfirm(&r));
+
+    for (i = 0; i < nb_channels; i++)
+        if (r.Param.ChannelList[i].Frequency != 0) n++;
+
+    atci_printf("+OK=%d", n);
+    for (i = 0; i < nb_channels; i++) {
+        if (r.Param.ChannelList[i].Frequency == 0) continue;
+        lrw_channel_stats(i, &s);
+        atci_printf(";%d,%u,%u,%d,%d", i, s.attempts, s.acks, s.noise, s.benched);
+    }
+    EOL();
+}
+
+
+static void reset_chstat(atci_param_t *param)
+{
+    (void)param;
+    lrw_channel_stats_reset();
+    OK_();
+}
+
+
+static void get_autopull(void)
+{
+    OK("%d", sysconf.auto_pull);
+}
+
+
+static void set_autopull(atci_param_t *param)
+{
+    int v = parse_enabled(param);
+    if (v < 0) abort(ERR_PARAM);
+
+    sysconf.auto_pull = v;
+    sysconf_modified = true;
+    OK_();
+}
+
+
+// The masks of enabled subtypes for each event type, see cmd_event_enabled
+static void get_events(void)
+{
+    atci_print("+OK=");
+    for (unsigned int i = 0; i < SYSCONF_EVENT_TYPES; i++)
+        atci_printf(i ? ",%u" : "%u", (uint8_t)~sysconf.event_filter[i]);
+    EOL();
+}
+
+
+static void set_events(atci_param_t *param)
+{
+    uint32_t type, mask;
+
+    if (!atci_param_get_uint(param, &type)) abort(ERR_PARAM);
+    if (type >= SYSCONF_EVENT_TYPES) abort(ERR_PARAM);
+    if (!atci_param_is_comma(param)) abort(ERR_PARAM);
+    if (!atci_param_get_uint(param, &mask)) abort(ERR_PARAM);
+    if (mask > UINT8_MAX) abort(ERR_PARAM);
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    sysconf.event_filter[type] = ~mask;
+    sysconf_modified = true;
+    OK_();
+}
+
+
+static void commit(atci_param_t *param)
+{
+    (void)param;
+    sysconf_commit();
+    OK_();
+}
+
+
+static void get_commit(void)
+{
+    bool transaction;
+    bool pending = sysconf_pending(&transaction);
+    OK("%d,%d", transaction, pending);
+}
+
+
+static void set_commit(atci_param_t *param)
+{
+    int v = parse_enabled(param);
+    if (v < 0) abort(ERR_PARAM);
+
+    // AT$COMMIT=1 opens a transaction, the configuration modified by the
+    // following AT commands is written to NVM once with AT$COMMIT or
+    // AT$COMMIT=0. A reset writes it too.
+    if (v) sysconf_begin();
+    else sysconf_commit();
+    OK_();
+}
+
+
+static void get_txstore(void)
+{
+    bool online;
+    unsigned int count = lrw_tx_store_length(&online);
+
+    OK("%d,%u,%lu,%u,%d", sysconf.tx_store, sysconf.tx_store_interval,
+        sysconf.tx_store_max_age, count, online);
+}
+
+
+static void set_txstore(atci_param_t *param)
+{
+    uint32_t enabled, interval = sysconf.tx_store_interval, max_age = sysconf.tx_store_max_age;
+
+    if (!atci_param_get_uint(param, &enabled)) abort(ERR_PARAM);
+    if (enabled > 1) abort(ERR_PARAM);
+
+    if (param->offset < param->length) {
+        if (!atci_param_is_comma(param)) abort(ERR_PARAM);
+        if (!atci_param_get_uint(param, &interval)) abort(ERR_PARAM);
+        if (interval > UINT16_MAX) abort(ERR_PARAM);
+    }
+
+    if (param->offset < param->length) {
+        if (!atci_param_is_comma(param)) abort(ERR_PARAM);
+        if (!atci_param_get_uint(param, &max_age)) abort(ERR_PARAM);
+    }
+
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    // As with the transmit queue, messages already in the store continue to
+    // be sent when the store is disabled
+    sysconf.tx_store = enabled;
+    sysconf.tx_store_interval = interval;
+    sysconf.tx_store_max_age = max_age;
+    sysconf_modified = true;
+    OK_();
+}
+
+
+static void txstore_del(atci_param_t *param)
+{
+    (void)param;
+    lrw_tx_store_clear();
+    OK_();
+}
+
+
+static void get_mcfilter(void)
+{
+    const uint8_t *ports;
+
+    // +OK=<group>[,<port>...];<group>[,<port>...];...
+    atci_print("+OK=");
+    for (int i = 0; i < LORAMAC_MAX_MC_CTX; i++) {
+        ports = lrw_mc_filter_get(i);
+        atci_printf(i ? ";%d" : "%d", i);
+        for (int j = 0; j < LRW_MC_FILTER_PORTS; j++)
+            if (ports[j]) atci_printf(",%d", ports[j]);
+    }
+    EOL();
+}
+
+
+static void set_mcfilter(atci_param_t *param)
+{
+    uint32_t group, v;
+    uint8_t ports[LRW_MC_FILTER_PORTS];
+    unsigned int n = 0;
+
+    if (!atci_param_get_uint(param, &group)) abort(ERR_PARAM);
+
+    while (param->offset < param->length) {
+        if (n == LRW_MC_FILTER_PORTS) abort(ERR_PARAM_NO);
+        if (!atci_param_is_comma(param)) abort(ERR_PARAM);
+        if (!atci_param_get_uint(param, &v)) abort(ERR_PARAM);
+        if (v > UINT8_MAX) abort(ERR_PARAM);
+        ports[n++] = v;
+    }
+
+    if (lrw_mc_filter_set(group, ports, n) != 0) abort(ERR_PARAM);
+    OK_();
+}
+
+
+static void get_mcbatch(void)
+{
+    OK("%lu", lrw_mc_batch_get());
+}
+
+
+static void set_mcbatch(atci_param_t *param)
+{
+    uint32_t v;
+
+    if (!atci_param_get_uint(param, &v)) abort(ERR_PARAM);
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    lrw_mc_batch_set(v);
+    OK_();
+}
+
+
+static void get_dlroute(void)
+{
+    int n = 0;
+
+    // +OK=<port>,<action>;<port>,<action>;... for the ports not forwarded
+    atci_print("+OK=");
+    for (int i = 0; i < SYSCONF_DL_ROUTES; i++) {
+        if (sysconf.dl_route[i].port == 0) continue;
+        atci_printf(n++ ? ";%d,%d" : "%d,%d", sysconf.dl_route[i].port,
+            sysconf.dl_route[i].action);
+    }
+    EOL();
+}
+
+
+static void set_dlroute(atci_param_t *param)
+{
+    uint32_t port, action;
+
+    if (!atci_param_get_uint(param, &port)) abort(ERR_PARAM);
+    if (!atci_param_is_comma(param)) abort(ERR_PARAM);
+    if (!atci_param_get_uint(param, &action)) abort(ERR_PARAM);
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    if (action >= LRW_ROUTE_ACTIONS) abort(ERR_PARAM);
+    if (lrw_dl_route_set(port, action) != 0) abort(ERR_PARAM);
+    OK_();
+}
+
+
+static void get_recvext(void)
+{
+    OK("%d", sysconf.recv_ext);
+}
+
+
+static void set_recvext(atci_param_t *param)
+{
+    int v = parse_enabled(param);
+    if (v < 0) abort(ERR_PARAM);
+
+    sysconf.recv_ext = v;
+    sysconf_modified = true;
+    OK_();
+}
+
+
+static void get_pwrstat(void)
+{
+    system_pwrstat_t stat;
+    system_get_pwrstat(&stat);
+
+    atci_printf("+OK=%lu,%lu,%lu,%lu,%lu,%lu,%lu", stat.total, stat.run, stat.sleep, stat.stop,
+        stat.slow, stat.clock_switches, stat.lp_sleep);
+    for (int i = 0; i < SYSTEM_MODULE_COUNT; i++)
+        atci_printf(";%d,%lu,%lu", i, stat.module_time[i], stat.module_count[i]);
+    EOL();
+}
+
+
+static void set_pwrstat(atci_param_t *param)
+{
+    uint32_t v;
+
+    // The only value accepted is 0 which resets all counters
+    if (!atci_param_get_uint(param, &v)) abort(ERR_PARAM);
+    if (v != 0) abort(ERR_PARAM);
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    system_reset_pwrstat();
+    OK_();
+}
+
+
+static const queued_event_t *peek_event(void)
+{
+    if (event_queue.count == 0) return NULL;
+    return &event_queue.slot[event_queue.head];
+}
+
+
+static void pop_event(void)
+{
+    if (event_queue.count == 0) return;
+    event_queue.head = (event_queue.head + 1) % CMD_EVENT_QUEUE_SIZE;
+    event_queue.count--;
+}
+
+
+// Return true if the oldest mailbox entry is the event e rather than the
+// downlink d
+static bool event_first(const queued_event_t *e, const lrw_downlink_t *d)
+{
+    if (e == NULL) return false;
+    if (d == NULL) return true;
+    return (int16_t)(e->seq - d->seq) < 0;
+}
+
+
+// With AT$RECVEXT=1, insert the remaining per-frame metadata before the
+// payload: data rate, frequency, downlink frame counter, multicast flag, and
+// multicast group ID
+static void print_recv_ext(const lrw_downlink_t *d)
+{
+    if (!sysconf.recv_ext) return;
+    atci_printf("%d,%lu,%lu,%d,%d,", d->dr, d->frequency, d->fcnt, d->multicast, d->group);
+}
+
+
+static void get_mbox(void)
+{
+    // The number of entries and whether any have been dropped since the last
+    // query
+    OK("%u,%d", lrw_rx_queue_length() + event_queue.count, event_queue.dropped ? 1 : 0);
+    event_queue.dropped = false;
+}
+
+
+static void get_mbox_entry(void)
+{
+    const queued_event_t *e = peek_event();
+    const lrw_downlink_t *d = lrw_rx_queue_peek();
+
+    // Return the oldest entry without removing it; AT$MBOXACK removes it
+    if (event_first(e, d)) {
+        atci_printf("+OK=EVENT,%d,%d", e->type, e->subtype);
+        for (unsigned int i = 0; i < e->nargs; i++) atci_printf(",%d", e->arg[i]);
+        EOL();
+    } else if (d != NULL) {
+        atci_printf("+OK=RECV,%d,%d,%d,%lu,", d->port, d->rssi, d->snr, d->timestamp);
+        print_recv_ext(d);
+        atci_print_buffer_as_hex(d->payload, d->length);
+        EOL();
+    } else {
+        OK_();
+    }
+}
+
+
+static void ack_mbox_entries(uint32_t n)
+{
+    while (n-- && (event_queue.count || lrw_rx_queue_length())) {
+        if (event_first(peek_event(), lrw_rx_queue_peek())) pop_event();
+        else lrw_rx_queue_pop();
+    }
+}
 
+
+static void mbox_ack(atci_param_t *param)
+{
+    (void)param;
+    ack_mbox_entries(1);
     OK_();
 }
 
 
-static void get_fnwksintkey(void)
+static void set_mbox_ack(atci_param_t *param)
 {
-    if (sysconf.lock_keys) abort(ERR_ACCESS_DENIED);
+    uint32_t n;
 
-    atci_print("+OK=");
-    atci_print_buffer_as_hex(find_key(F_NWK_S_INT_KEY), SE_KEY_SIZE);
+    // Remove the given number of the oldest entries
+    if (!atci_param_get_uint(param, &n)) abort(ERR_PARAM);
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    ack_mbox_entries(n);
+    OK_();
+}
+
+
+static void get_recv(void)
+{
+    const lrw_downlink_t *d = lrw_rx_queue_peek();
+
+    // Return and remove the oldest queued downlink. The payload is always
+    // hex-encoded so that the response fits on a single line.
+    if (d == NULL) {
+        OK_();
+        return;
+    }
+
+    atci_printf("+OK=%d,%d,%d,%lu,", d->port, d->rssi, d->snr, d->timestamp);
+    print_recv_ext(d);
+    atci_print_buffer_as_hex(d->payload, d->length);
     EOL();
+    lrw_rx_queue_pop();
 }
 
 
-static void set_fnwksintkey(atci_param_t *param)
+#if TRACE == 1
+static void get_trace(void)
 {
-    uint8_t key[SE_KEY_SIZE];
+    trace_entry_t entries[TRACE_BUFFER_SIZE];
+    unsigned n = trace_take(entries);
 
-    if (atci_param_get_buffer_from_hex(param, key, SE_KEY_SIZE, 0) != SE_KEY_SIZE)
-        abort(ERR_PARAM);
+    // Each entry is reported as a pair of the trace point name and the time in
+    // RTC ticks (1/1024 s). Retrieving the trace clears the buffer.
+    atci_printf("+OK=%u", n);
+    for (unsigned i = 0; i < n; i++)
+        atci_printf(";%s,%lu", trace_event_name(entries[i].event), trace_ticks(&entries[i]));
+    EOL();
+}
+#endif
 
-    MibRequestConfirm_t r = {
-        .Type  = MIB_F_NWK_S_INT_KEY,
-        .Param = { .FNwkSIntKey = key }
-    };
-    abort_on_error(LoRaMacMibSetRequestConfirm(&r));
 
-    OK_();
+#if TRACE_IRQ == 1
+// +OK=rtc,exti,lpuart,dma,log with the longest run time of each interrupt
+// handler in microseconds since the previous query
+static void get_irq_time(void)
+{
+    uint32_t t[TRACE_IRQ_COUNT];
+
+    trace_irq_take(t);
+    OK("%lu,%lu,%lu,%lu,%lu", t[TRACE_IRQ_RTC], t[TRACE_IRQ_EXTI], t[TRACE_IRQ_LPUART],
+        t[TRACE_IRQ_DMA], t[TRACE_IRQ_LOG]);
 }
+#endif
 
 
-static void get_snwksintkey(void)
+#if ENERGY_PROFILE == 1
+static void get_energy(void)
 {
-    if (sysconf.lock_keys) abort(ERR_ACCESS_DENIED);
+    energy_entry_t entries[ENERGY_BUFFER_SIZE];
+    uint32_t lost;
+    unsigned n = energy_take(entries, &lost);
 
-    atci_print("+OK=");
-    atci_print_buffer_as_hex(find_key(S_NWK_S_INT_KEY), SE_KEY_SIZE);
+    // The number of entries and the number of entries lost to overflow come
+    // first. Each entry is reported as the phase name, 1 (start) or 0 (end),
+    // and the time in RTC ticks (1/1024 s). Each entry corresponds to one edge
+    // on the marker GPIO. Retrieving the profile clears it.
+    atci_printf("+OK=%u,%lu", n, lost);
+    for (unsigned i = 0; i < n; i++)
+        atci_printf(";%s,%u,%lu", energy_phase_name(entries[i].phase),
+            entries[i].active, entries[i].ticks);
     EOL();
 }
+#endif
 
 
-static void set_snwksintkey(atci_param_t *param)
+#if ENERGY_METER == 1
+static const char *charge_names[ENERGY_I_COUNT] = {
+    [ENERGY_I_RUN]      = "RUN",
+    [ENERGY_I_SLEEP]    = "SLEEP",
+    [ENERGY_I_LP_SLEEP] = "LPSLEEP",
+    [ENERGY_I_STOP]     = "STOP",
+    [ENERGY_I_RX]       = "RX",
+    [ENERGY_I_EEPROM]   = "EEPROM",
+    [ENERGY_I_TCXO]     = "TCXO",
+    [ENERGY_I_UART_TX]  = "UARTTX"
+};
+
+
+static void print_charge(uint64_t nah)
 {
-    uint8_t key[SE_KEY_SIZE];
+    atci_printf("%lu.%03lu", (uint32_t)(nah / 1000), (uint32_t)(nah % 1000));
+}
 
-    if (atci_param_get_buffer_from_hex(param, key, SE_KEY_SIZE, 0) != SE_KEY_SIZE)
-        abort(ERR_PARAM);
 
-    MibRequestConfirm_t r = {
-        .Type  = MIB_S_NWK_S_INT_KEY,
-        .Param = { .SNwkSIntKey = key }
-    };
-    abort_on_error(LoRaMacMibSetRequestConfirm(&r));
+static void get_charge(void)
+{
+    energy_meter_t m;
+    uint64_t c, total = 0, tx = 0;
+
+    energy_meter_get(&m);
+
+    for (int i = 0; i < ENERGY_I_COUNT; i++)
+        total += energy_charge(m.ticks[i], energy_current(i));
+    for (int i = 0; i < ENERGY_TX_LEVELS; i++)
+        tx += energy_charge(m.tx_ticks[i], energy_tx_current(ENERGY_TX_MIN + i));
+
+    // The time since the last reset (s) and the total charge (uAh) come
+    // first, followed by the time (ms) and the charge of each category. TX
+    // levels that have not been used are left out.
+    atci_printf("+OK=%lu,", (uint32_t)(m.elapsed / 1024));
+    print_charge(total + tx);
+
+    for (int i = 0; i < ENERGY_I_COUNT; i++) {
+        c = energy_charge(m.ticks[i], energy_current(i));
+        atci_printf(";%s,%lu,", charge_names[i], (uint32_t)(m.ticks[i] * 1000 / 1024));
+        print_charge(c);
+    }
+
+    for (int i = 0; i < ENERGY_TX_LEVELS; i++) {
+        if (!m.tx_ticks[i]) continue;
+        c = energy_charge(m.tx_ticks[i], energy_tx_current(ENERGY_TX_MIN + i));
+        atci_printf(";TX%d,%lu,", ENERGY_TX_MIN + i, (uint32_t)((uint64_t)m.tx_ticks[i] * 1000 / 1024));
+        print_charge(c);
+    }
+    EOL();
+}
+
+
+static void set_charge(atci_param_t *param)
+{
+    uint32_t v;
+
+    if (!atci_param_get_uint(param, &v)) abort(ERR_PARAM);
+    if (v != 0) abort(ERR_PARAM);
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
 
+    energy_meter_reset();
     OK_();
 }
 
 
-static void get_nwksenckey(void)
+static void get_chargecal(void)
 {
-    if (sysconf.lock_keys) abort(ERR_ACCESS_DENIED);
+    atci_printf("+OK=");
+    for (int i = 0; i < ENERGY_I_COUNT; i++)
+        atci_printf("%s%lu", i ? "," : "", energy_current(i));
+    for (int i = ENERGY_TX_MIN; i <= ENERGY_TX_MAX; i++)
+        atci_printf(";%lu", energy_tx_current(i));
+    EOL();
+}
+
+
+static void set_chargecal(atci_param_t *param)
+{
+    uint32_t category, current;
+    int32_t power;
+
+    // AT$CHARGECAL=category,nA sets the current of one of the categories in
+    // the order reported by AT$CHARGE?, AT$CHARGECAL=TX,dBm,nA the current of
+    // a TX power level
+    if (param->length - param->offset >= 2 && !memcmp(param->txt + param->offset, "TX", 2)) {
+        param->offset += 2;
+        if (!atci_param_is_comma(param)) abort(ERR_PARAM);
+        if (!atci_param_get_int(param, &power)) abort(ERR_PARAM);
+        if (!atci_param_is_comma(param)) abort(ERR_PARAM_NO);
+        if (!atci_param_get_uint(param, &current)) abort(ERR_PARAM);
+        if (param->offset != param->length) abort(ERR_PARAM_NO);
+        if (energy_set_tx_current(power, current) != 0) abort(ERR_PARAM);
+    } else {
+        if (!atci_param_get_uint(param, &category)) abort(ERR_PARAM);
+        if (!atci_param_is_comma(param)) abort(ERR_PARAM_NO);
+        if (!atci_param_get_uint(param, &current)) abort(ERR_PARAM);
+        if (param->offset != param->length) abort(ERR_PARAM_NO);
+        if (energy_set_current(category, current) != 0) abort(ERR_PARAM);
+    }
+    OK_();
+}
+#endif
+
+
+#if BENCH == 1
+static void get_bench(void)
+{
+    bench_result_t results[BENCH_COUNT];
+    unsigned n = bench_run(results);
+
+    // The CPU clock frequency in Hz comes first, followed by the number of
+    // iterations and the minimum, average, and maximum number of CPU cycles
+    // for each benchmark.
+    atci_printf("+OK=%lu", SystemCoreClock);
+    for (unsigned i = 0; i < n; i++)
+        atci_printf(";%s,%u,%lu,%lu,%lu", results[i].name, results[i].iterations,
+            results[i].min, results[i].total / results[i].iterations, results[i].max);
+    EOL();
+}
+#endif
+
+
+#if FUOTA == 1
+// The maximum number of bytes returned by a single AT$FRAGREAD
+#define FRAG_READ_MAX 128
+
+static void get_frag(void)
+{
+    frag_status_t st;
+    frag_get_status(&st);
+
+    OK("%d,%d,%d,%d,%d,%08lX,%d,%d", st.state, st.index, st.nb_frag, st.size,
+        st.padding, st.descriptor, st.received, st.missing);
+}
+
+
+static void set_fragread(atci_param_t *param)
+{
+    uint32_t offset, length;
+    const uint8_t *data;
+    size_t size;
+
+    if (!atci_param_get_uint(param, &offset)) abort(ERR_PARAM);
+    if (!atci_param_is_comma(param)) abort(ERR_PARAM);
+    if (!atci_param_get_uint(param, &length)) abort(ERR_PARAM);
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+    if (length > FRAG_READ_MAX) abort(ERR_PARAM);
+
+    // Only a complete data block can be read
+    data = frag_get_data(&size);
+    if (data == NULL || offset > size) abort(ERR_PARAM);
+    if (length > size - offset) length = size - offset;
 
     atci_print("+OK=");
-    atci_print_buffer_as_hex(find_key(NWK_S_ENC_KEY), SE_KEY_SIZE);
+    atci_print_buffer_as_hex(data + offset, length);
     EOL();
 }
 
 
-static void set_nwksenckey(atci_param_t *param)
+static void frag_del(atci_param_t *param)
 {
-    uint8_t key[SE_KEY_SIZE];
+    (void)param;
+    frag_delete();
+    OK_();
+}
+#endif
 
-    if (atci_param_get_buffer_from_hex(param, key, SE_KEY_SIZE, 0) != SE_KEY_SIZE)
-        abort(ERR_PARAM);
 
-    MibRequestConfirm_t r = {
-        .Type  = MIB_NWK_S_ENC_KEY,
-        .Param = { .NwkSEncKey = key }
-    };
-    abort_on_error(LoRaMacMibSetRequestConfirm(&r));
+#if CLOCK_SYNC == 1
+static void get_clksync(void)
+{
+    clocksync_status_t st;
+    clocksync_get_status(&st);
+
+    OK("%lu,%lu,%ld,%ld", st.period, st.syncs, st.correction, st.calibration);
+}
+
+
+static void set_clksync(atci_param_t *param)
+{
+    uint32_t period;
+
+    if (!atci_param_get_uint(param, &period)) abort(ERR_PARAM);
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
 
+    clocksync_set_period(period);
     OK_();
 }
 
 
-static void get_chmask(void)
+static void clksync(atci_param_t *param)
 {
-    atci_print("+OK=");
+    (void)param;
+    clocksync_request(1);
+    OK_();
+}
+#endif
 
-    MibRequestConfirm_t r = { .Type = MIB_CHANNELS_MASK };
-    LoRaMacMibGetRequestConfirm(&r);
-    atci_print_buffer_as_hex(r.Param.ChannelsMask, lrw_get_max_channels() / 8);
 
-    atci_print(",");
+#if REMOTE_ATCI == 1
+static void get_remote(void)
+{
+    OK("%d", sysconf.remote_port);
+}
 
-    r.Type = MIB_CHANNELS_DEFAULT_MASK;
-    LoRaMacMibGetRequestConfirm(&r);
-    atci_print_buffer_as_hex(r.Param.ChannelsDefaultMask, lrw_get_max_channels() / 8);
 
-    EOL();
+static void set_remote(atci_param_t *param)
+{
+    uint32_t v;
+
+    if (!atci_param_get_uint(param, &v)) abort(ERR_PARAM);
+    if (v > 223) abort(ERR_PARAM);
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    sysconf.remote_port = v;
+    sysconf_modified = true;
+    OK_();
 }
+#endif
 
 
-static void set_chmask(atci_param_t *param)
+static void get_battery(void)
 {
-    uint16_t chmask1[REGION_NVM_CHANNELS_MASK_SIZE];
-    uint16_t chmask2[REGION_NVM_CHANNELS_MASK_SIZE];
+    uint16_t empty, full, voltage;
+    uint8_t level = lrw_battery_get(&empty, &full, &voltage);
 
-    if (!parse_chmask(chmask1, sizeof(chmask1), param)) abort(ERR_PARAM);
-    if (!atci_param_is_comma(param)) abort(ERR_PARAM);
-    if (!parse_chmask(chmask2, sizeof(chmask2), param)) abort(ERR_PARAM);
+    OK("%u,%u,%u,%u", empty, full, voltage, level);
+}
 
-    // Make sure all data from the value have been consumed
-    if (param->length != param->offset) abort(ERR_PARAM_NO);
 
-    MibRequestConfirm_t r = {
-        .Type  = MIB_CHANNELS_DEFAULT_MASK,
-        .Param = { .ChannelsDefaultMask = chmask2 }
-    };
-    abort_on_error(LoRaMacMibSetRequestConfirm(&r));
+static void set_battery(atci_param_t *param)
+{
+    uint32_t empty, full = 0;
 
-    // Then update the channel mask currently in use
-    r.Type = MIB_CHANNELS_MASK;
-    r.Param.ChannelsMask = chmask1;
-    abort_on_error(LoRaMacMibSetRequestConfirm(&r));
+    if (!atci_param_get_uint(param, &empty)) abort(ERR_PARAM);
+    if (empty > UINT16_MAX) abort(ERR_PARAM);
 
+    if (empty != 0) {
+        if (!atci_param_is_comma(param)) abort(ERR_PARAM);
+        if (!atci_param_get_uint(param, &full)) abort(ERR_PARAM);
+        if (full > UINT16_MAX) abort(ERR_PARAM);
+    }
+
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    if (lrw_battery_set(empty, full) != 0) abort(ERR_PARAM);
     OK_();
 }
 
 
-static void get_rx2(void)
+static void battery(atci_param_t *param)
 {
-    MibRequestConfirm_t r1 = { .Type = MIB_RX2_CHANNEL };
-    LoRaMacMibGetRequestConfirm(&r1);
+    (void)param;
+    lrw_battery_measure();
+    OK_();
+}
 
-    MibRequestConfirm_t r2 = { .Type = MIB_RX2_DEFAULT_CHANNEL };
-    LoRaMacMibGetRequestConfirm(&r2);
 
-    OK("%ld,%d,%ld,%d", r1.Param.Rx2Channel.Frequency, r1.Param.Rx2Channel.Datarate,
-        r2.Param.Rx2DefaultChannel.Frequency, r2.Param.Rx2DefaultChannel.Datarate);
+static void get_batpol(void)
+{
+    uint16_t low, critical, interval;
+    unsigned int state = lrw_batpol_get(&low, &critical, &interval);
+
+    OK("%u,%u,%u,%u", low, critical, interval, state);
 }
 
 
-static void set_rx2(atci_param_t *param)
+static void set_batpol(atci_param_t *param)
 {
-    uint32_t freq1, dr1, freq2, dr2;
+    uint32_t low, critical, interval;
 
-    if (!atci_param_get_uint(param, &freq1)) abort(ERR_PARAM);
+    if (!atci_param_get_uint(param, &low)) abort(ERR_PARAM);
     if (!atci_param_is_comma(param)) abort(ERR_PARAM);
-    if (!atci_param_get_uint(param, &dr1)) abort(ERR_PARAM);
-
+    if (!atci_param_get_uint(param, &critical)) abort(ERR_PARAM);
     if (!atci_param_is_comma(param)) abort(ERR_PARAM);
+    if (!atci_param_get_uint(param, &interval)) abort(ERR_PARAM);
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
 
-    if (!atci_param_get_uint(param, &freq2)) abort(ERR_PARAM);
-    if (!atci_param_is_comma(param)) abort(ERR_PARAM);
-    if (!atci_param_get_uint(param, &dr2)) abort(ERR_PARAM);
+    if (low > UINT16_MAX || critical > UINT16_MAX || interval > UINT16_MAX)
+        abort(ERR_PARAM);
+    if (low != 0 && critical >= low) abort(ERR_PARAM);
 
-    if (dr1 > 15 || dr2 > 15) abort(ERR_PARAM);
+    lrw_batpol_set(low, critical, interval);
+    OK_();
+}
 
-    if (param->offset != param->length) abort(ERR_PARAM_NO);
 
-    MibRequestConfirm_t r = {
-        .Type = MIB_RX2_DEFAULT_CHANNEL,
-        .Param = {
-            .Rx2DefaultChannel = {
-                .Frequency = freq2,
-                .Datarate = dr2
-            }
-        }
-    };
-    abort_on_error(LoRaMacMibSetRequestConfirm(&r));
+static void get_temp_comp(void)
+{
+    int16_t temperature;
+    int32_t compensation;
+    bool enabled = lrw_temp_comp_get(&temperature, &compensation);
 
-    r.Type = MIB_RX2_CHANNEL;
-    r.Param.Rx2Channel.Frequency = freq1;
-    r.Param.Rx2Channel.Datarate = dr1;
-    abort_on_error(LoRaMacMibSetRequestConfirm(&r));
+    // Temperature in tenths of degC, compensation in hundredths of ppm
+    int32_t t = temperature;
+    int32_t ppm = compensation * 9537 / 100;
+
+    OK("%d,%s%ld.%ld,%s%ld.%02ld", enabled,
+        t < 0 ? "-" : "", labs(t) / 10, labs(t) % 10,
+        ppm < 0 ? "-" : "", labs(ppm) / 100, labs(ppm) % 100);
+}
 
+
+static void set_temp_comp(atci_param_t *param)
+{
+    int enabled = parse_enabled(param);
+    if (enabled == -1) abort(ERR_PARAM);
+
+    lrw_temp_comp_set(enabled);
     OK_();
 }
 
 
-static void get_dr(void)
+// The demodulation margin targeted by AT$TPC=1 and AT$CADR=1 without a target
+#define TPC_DEFAULT_TARGET 10
+
+
+static void get_tpc(void)
 {
-    MibRequestConfirm_t r1 = { .Type = MIB_CHANNELS_DATARATE };
-    LoRaMacMibGetRequestConfirm(&r1);
+    uint8_t target;
+    int8_t margin;
+    bool enabled = lrw_tpc_get(&target, &margin);
 
-    MibRequestConfirm_t r2 = { .Type = MIB_CHANNELS_DEFAULT_DATARATE };
-    LoRaMacMibGetRequestConfirm(&r2);
+    MibRequestConfirm_t r = { .Type = MIB_CHANNELS_TX_POWER };
+    abort_on_error(LoRaMacMibGetRequestConfirm(&r));
 
-    OK("%d,%d", r1.Param.ChannelsDatarate, r2.Param.ChannelsDefaultDatarate);
+    OK("%d,%d,%d,%d", enabled, target, r.Param.ChannelsTxPower, margin);
 }
 
 
-static void set_dr(atci_param_t *param)
+static void set_tpc(atci_param_t *param)
 {
-    uint32_t val1, val2;
+    uint32_t enabled, target = TPC_DEFAULT_TARGET;
 
-    if (!atci_param_get_uint(param, &val1)) abort(ERR_PARAM);
-    if (val1 > 15) abort(ERR_PARAM);
+    if (!atci_param_get_uint(param, &enabled)) abort(ERR_PARAM);
+    if (enabled > 1) abort(ERR_PARAM);
 
-    if (!atci_param_is_comma(param)) abort(ERR_PARAM);
+    if (atci_param_is_comma(param)) {
+        if (!atci_param_get_uint(param, &target)) abort(ERR_PARAM);
+        if (target > 30) abort(ERR_PARAM);
+    }
 
-    if (!atci_param_get_uint(param, &val2)) abort(ERR_PARAM);
-    if (val2 > 15) abort(ERR_PARAM);
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    // Both controllers would spend the same margin
+    if (enabled && lrw_cadr_get(NULL, NULL, NULL, NULL)) abort(ERR_PARAM);
+
+    lrw_tpc_set(enabled, target);
+    OK_();
+}
+
+
+static void get_cadr(void)
+{
+    uint8_t target, min_dr, max_dr;
+    int8_t margin;
+    bool enabled = lrw_cadr_get(&target, &min_dr, &max_dr, &margin);
+
+    MibRequestConfirm_t r = { .Type = MIB_CHANNELS_DATARATE };
+    abort_on_error(LoRaMacMibGetRequestConfirm(&r));
+
+    OK("%d,%d,%d,%d,%d,%d", enabled, target, min_dr, max_dr,
+        r.Param.ChannelsDatarate, margin);
+}
+
+
+static void set_cadr(atci_param_t *param)
+{
+    uint32_t enabled, target = TPC_DEFAULT_TARGET, min_dr = 0, max_dr = 15;
+
+    if (!atci_param_get_uint(param, &enabled)) abort(ERR_PARAM);
+    if (enabled > 1) abort(ERR_PARAM);
+
+    if (atci_param_is_comma(param)) {
+        if (!atci_param_get_uint(param, &target)) abort(ERR_PARAM);
+        if (target > 30) abort(ERR_PARAM);
 
-    if (param->offset != param->length) abort(ERR_PARAM_NO);
+        if (atci_param_is_comma(param)) {
+            if (!atci_param_get_uint(param, &min_dr)) abort(ERR_PARAM);
+            if (!atci_param_is_comma(param)) abort(ERR_PARAM);
+            if (!atci_param_get_uint(param, &max_dr)) abort(ERR_PARAM);
+            if (max_dr > 15 || min_dr > max_dr) abort(ERR_PARAM);
+        }
+    }
 
-    MibRequestConfirm_t r = {
-        .Type  = MIB_CHANNELS_DEFAULT_DATARATE,
-        .Param = { .ChannelsDefaultDatarate = val2 }
-    };
-    abort_on_error(LoRaMacMibSetRequestConfirm(&r));
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
 
-    r.Type = MIB_CHANNELS_DATARATE;
-    r.Param.ChannelsDatarate = val1;
-    abort_on_error(LoRaMacMibSetRequestConfirm(&r));
+    // Both controllers would spend the same margin
+    if (enabled && lrw_tpc_get(NULL, NULL)) abort(ERR_PARAM);
 
+    lrw_cadr_set(enabled, target, min_dr, max_dr);
     OK_();
 }
 
 
-static void get_rfpower(void)
+static void get_linkwd(void)
 {
-    MibRequestConfirm_t r1 = { .Type  = MIB_CHANNELS_TX_POWER };
-    LoRaMacMibGetRequestConfirm(&r1);
-    MibRequestConfirm_t r2 = { .Type  = MIB_CHANNELS_DEFAULT_TX_POWER };
-    LoRaMacMibGetRequestConfirm(&r2);
-    OK("0,%d,0,%d", r1.Param.ChannelsTxPower, r2.Param.ChannelsDefaultTxPower);
+    uint8_t failures;
+    uint32_t backoff;
+    uint8_t limit = lrw_linkwd_get(&failures, &backoff);
+    OK("%d,%d,%lu", limit, failures, backoff / 1000);
 }
 
 
-static void set_rfpower(atci_param_t *param)
+static void set_linkwd(atci_param_t *param)
 {
-    uint32_t paboost1, paboost2, val1, val2;
-
-    if (!atci_param_get_uint(param, &paboost1)) abort(ERR_PARAM);
-    if (paboost1 != 0) {
-        log_warning("PA boost currently unsupported");
-        abort(ERR_PARAM);
-    }
+    uint32_t limit;
 
-    if (!atci_param_is_comma(param)) abort(ERR_PARAM);
+    if (!atci_param_get_uint(param, &limit)) abort(ERR_PARAM);
+    if (limit > UINT8_MAX) abort(ERR_PARAM);
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
 
-    if (!atci_param_get_uint(param, &val1)) abort(ERR_PARAM);
-    if (val1 > 15) abort(ERR_PARAM);
+    lrw_linkwd_set(limit);
+    OK_();
+}
 
-    if (!atci_param_is_comma(param)) abort(ERR_PARAM);
 
-    if (!atci_param_get_uint(param, &paboost2)) abort(ERR_PARAM);
-    if (paboost2 != 0) {
-        log_warning("PA boost currently unsupported");
-        abort(ERR_PARAM);
-    }
+static void get_ping_slot(void)
+{
+    OK("%u", lrw_get_ping_slot_periodicity());
+}
 
-    if (!atci_param_is_comma(param)) abort(ERR_PARAM);
 
-    if (!atci_param_get_uint(param, &val2)) abort(ERR_PARAM);
-    if (val2 > 15) abort(ERR_PARAM);
+static void set_ping_slot(atci_param_t *param)
+{
+    uint32_t v;
 
+    if (!atci_param_get_uint(param, &v)) abort(ERR_PARAM);
     if (param->offset != param->length) abort(ERR_PARAM_NO);
 
-    MibRequestConfirm_t r = {
-        .Type  = MIB_CHANNELS_DEFAULT_TX_POWER,
-        .Param = { .ChannelsDefaultTxPower = val2 }
-    };
-    abort_on_error(LoRaMacMibSetRequestConfirm(&r));
-
-    r.Type = MIB_CHANNELS_TX_POWER;
-    r.Param.ChannelsTxPower = val1;
-    abort_on_error(LoRaMacMibSetRequestConfirm(&r));
-
+    if (lrw_set_ping_slot_periodicity(v) != 0) abort(ERR_PARAM);
     OK_();
 }
 
 
-static void set_async(atci_param_t *param)
+static void get_beacon(void)
 {
-    uint32_t v;
+    bool locked;
+    BeaconInfo_t beacon;
+    lrw_class_b_state_t state = lrw_get_class_b_status(&locked, &beacon);
 
-    if (!atci_param_get_uint(param, &v))
-        abort(ERR_PARAM);
+    if (!locked) {
+        OK("%d,0", state);
+        return;
+    }
 
-    if (v > 1) abort(ERR_PARAM);
+    // The beacon time is GPS time
+    OK("%d,1,%lu,%lu,%d,%d", state, beacon.Time.Seconds, beacon.Frequency,
+        beacon.Rssi, beacon.Snr);
+}
 
-    sysconf.async_uart = v;
-    sysconf_modified = true;
+
+static void set_framed(atci_param_t *param)
+{
+    int v = parse_enabled(param);
+    if (v < 0) abort(ERR_PARAM);
+
+    // The response is still sent using the current mode. The new mode will be
+    // used starting with the next command.
+    atci_set_framed(v == 1);
     OK_();
 }
 
 
-static void get_async(void)
+static void get_framed(void)
 {
-    OK("%d", sysconf.async_uart);
+    OK("%d", atci_is_framed() ? 1 : 0);
 }
 
 
@@ -2106,18 +4905,111 @@ static void get_session(void)
 }
 
 
+// The version of the AT$STATE? snapshot layout. Increment whenever the layout
+// changes. Fields may only be appended at the end, so that older decoders can
+// still parse the fields they know about.
+#define STATE_VERSION 1
+
+static uint8_t *put_le(uint8_t *p, uint32_t v, size_t n)
+{
+    while (n--) {
+        *p++ = v & 0xff;
+        v >>= 8;
+    }
+    return p;
+}
+
+
+// Return a compact snapshot of the session and radio state as a hex-encoded
+// packed structure. All multi-byte fields are little-endian:
+//
+//  0 u8  layout version (STATE_VERSION)
+//  1 u8  flags: bit 0 public network, bit 1 ADR enabled, bit 2 MAC busy
+//  2 u8  network activation (0 none, 1 ABP, 2 OTAA)
+//  3 u8  device class (0 A, 1 B, 2 C)
+//  4 u32 uplink frame counter
+//  8 u32 downlink frame counter
+// 12 u8  data rate
+// 13 u8  TX power index
+// 14 s16 RSSI of the most recently received packet [dBm]
+// 16 s8  SNR of the most recently received packet [dB]
+// 17 u32 duty cycle backoff time [ms]
+// 21 u32 device address
+// 25 u16 LoRaMac NVM groups not yet written to NVM
+// 27 u8  number of messages in the uplink transmit queue
+//
+// This returns the combined information of AT$SESSION?, AT+FRMCNT?, AT+RFQ?,
+// AT+DR?, AT+RFPOWER? and AT+BACKOFF? in a single response.
+static void get_state(void)
+{
+    LoRaMacNvmData_t *state = lrw_get_state();
+    MibRequestConfirm_t r;
+    uint8_t buf[28], *p = buf, flags = 0;
+    TimerTime_t now;
+
+    r.Type = MIB_PUBLIC_NETWORK;
+    LoRaMacMibGetRequestConfirm(&r);
+    if (r.Param.EnablePublicNetwork) flags |= 1 << 0;
+
+    r.Type = MIB_ADR;
+    LoRaMacMibGetRequestConfirm(&r);
+    if (r.Param.AdrEnable) flags |= 1 << 1;
+
+    if (LoRaMacIsBusy()) flags |= 1 << 2;
+
+    *p++ = STATE_VERSION;
+    *p++ = flags;
+
+    r.Type = MIB_NETWORK_ACTIVATION;
+    LoRaMacMibGetRequestConfirm(&r);
+    *p++ = r.Param.NetworkActivation;
+    *p++ = lrw_get_class();
+
+    p = put_le(p, state->Crypto.FCntList.FCntUp, 4);
+    p = put_le(p, get_downlink_frmcnt(), 4);
+
+    r.Type = MIB_CHANNELS_DATARATE;
+    LoRaMacMibGetRequestConfirm(&r);
+    *p++ = r.Param.ChannelsDatarate;
+
+    r.Type = MIB_CHANNELS_TX_POWER;
+    LoRaMacMibGetRequestConfirm(&r);
+    *p++ = r.Param.ChannelsTxPower;
+
+    p = put_le(p, (uint16_t)radio_rssi, 2);
+    *p++ = (uint8_t)radio_snr;
+
+    now = rtc_tick2ms(rtc_get_timer_value());
+    p = put_le(p, lrw_dutycycle_deadline > now ? lrw_dutycycle_deadline - now : 0, 4);
+
+    r.Type = MIB_DEV_ADDR;
+    LoRaMacMibGetRequestConfirm(&r);
+    p = put_le(p, r.Param.DevAddr, 4);
+
+    p = put_le(p, nvm_flags, 2);
+    *p++ = lrw_tx_queue_length();
+
+    atci_print("+OK=");
+    atci_print_buffer_as_hex(buf, p - buf);
+    EOL();
+}
+
+
 // Manage data stored in NVM user registers
 //
 // To read the value in NVM register 0, use the syntax AT$NVM 0. To write the
 // value 223 to NVM register 0, use the syntax AT$NVM 0,223.
 static void nvm_userdata(atci_param_t *param)
 {
+    const uint8_t *values = nvm_user_data();
     uint32_t addr, value;
+    uint8_t v;
 
     if (param == NULL) abort(ERR_PARAM);
 
     if (!atci_param_get_uint(param, &addr)) abort(ERR_PARAM);
     if (addr >= USER_NVM_MAX_SIZE) abort(ERR_PARAM);
+    if (values == NULL) abort(ERR_FLASH_ERROR);
 
     if (param->offset < param->length) {
         if (!atci_param_is_comma(param)) abort(ERR_PARAM);
@@ -2125,12 +5017,52 @@ static void nvm_userdata(atci_param_t *param)
         if (!atci_param_get_uint(param, &value)) abort(ERR_PARAM);
         if (value >= UINT8_MAX) abort(ERR_PARAM);
 
-        user_nvm.values[addr] = value;
-        nvm_update_user_data();
+        v = value;
+        if (!nvm_write_user_data(addr, &v, 1)) abort(ERR_FLASH_ERROR);
         OK_();
     } else {
-        OK("%d", user_nvm.values[addr]);
+        OK("%d", values[addr]);
+    }
+}
+
+
+// The maximum number of bytes written with a single AT$NVM= command. The data
+// is sent hex-encoded and must fit into the ATCI line buffer.
+#define USER_NVM_WRITE_MAX 96
+
+// Read or write a block of NVM user registers
+//
+// AT$NVM=<offset>,<length> returns length registers starting at offset,
+// hex-encoded. AT$NVM=<offset>,<length>,<data> writes length bytes of
+// hex-encoded data starting at offset. Only the registers whose value changes
+// are programmed.
+static void set_nvm_block(atci_param_t *param)
+{
+    const uint8_t *values = nvm_user_data();
+    uint8_t buf[USER_NVM_WRITE_MAX];
+    uint32_t offset, length;
+
+    if (!atci_param_get_uint(param, &offset)) abort(ERR_PARAM);
+    if (!atci_param_is_comma(param)) abort(ERR_PARAM);
+    if (!atci_param_get_uint(param, &length)) abort(ERR_PARAM);
+    if (offset > USER_NVM_MAX_SIZE || length > USER_NVM_MAX_SIZE - offset) abort(ERR_PARAM);
+    if (values == NULL) abort(ERR_FLASH_ERROR);
+
+    if (param->offset == param->length) {
+        atci_print("+OK=");
+        atci_print_buffer_as_hex(values + offset, length);
+        EOL();
+        return;
     }
+
+    if (!atci_param_is_comma(param)) abort(ERR_PARAM);
+    if (length > sizeof(buf)) abort(ERR_PARAM);
+    if (param->length - param->offset != length * 2) abort(ERR_PARAM);
+    if (atci_param_get_buffer_from_hex(param, buf, sizeof(buf), length * 2) != length)
+        abort(ERR_PARAM);
+
+    if (!nvm_write_user_data(offset, buf, length)) abort(ERR_FLASH_ERROR);
+    OK_();
 }
 
 
@@ -2143,6 +5075,150 @@ static void lock_keys(atci_param_t *param)
 }
 
 
+// NVM configuration snapshots for cloning devices
+//
+// AT$NVMDUMP? returns the configuration stored in NVM as a single hex-encoded
+// blob with a checksum, see nvm_snapshot_dump. The keys are omitted if they
+// have been locked with AT$LOCKKEYS. AT$NVMLOAD=<size> loads such a blob. The
+// blob follows the command like the payload of AT+UTX, in binary or hex form
+// as configured with AT+DFORMAT. The modem reboots at the end of the transfer
+// to apply the configuration, even if the load fails.
+#define NVM_LOAD_CHUNK 128
+
+static uint32_t nvm_load_left;
+
+
+static void print_hex(const void *buffer, size_t length)
+{
+    atci_print_buffer_as_hex(buffer, length);
+}
+
+
+static void get_nvmdump(void)
+{
+    // Make sure NVM is up to date with the state in RAM
+    lrw_flush_state();
+    sysconf_flush();
+
+    atci_print("+OK=");
+    nvm_snapshot_dump(print_hex, !sysconf.lock_keys);
+    EOL();
+}
+
+
+static void nvm_load_data(atci_data_status_t status, atci_param_t *param);
+
+static void nvm_load_next(void)
+{
+    TimerStart(&payload_timer);
+    atci_set_read_next_data(nvm_load_left < NVM_LOAD_CHUNK ? nvm_load_left : NVM_LOAD_CHUNK,
+        sysconf.data_format == 1 ? ATCI_ENCODING_HEX : ATCI_ENCODING_BIN, nvm_load_data);
+}
+
+
+static void nvm_load_data(atci_data_status_t status, atci_param_t *param)
+{
+    int rc;
+
+    TimerStop(&payload_timer);
+
+    // Errors are reported once the entire blob has been received, so that the
+    // rest of the blob is not interpreted as AT commands
+    if (status == ATCI_DATA_OK) {
+        nvm_snapshot_load(param->txt, param->length);
+        nvm_load_left -= param->length;
+        if (nvm_load_left) {
+            nvm_load_next();
+            return;
+        }
+    }
+
+    rc = nvm_snapshot_load_finish();
+
+    // The state in RAM predates the snapshot and must not be written back to
+    // NVM before the reboot
+    sysconf_modified = false;
+    nvm_flags = 0;
+    schedule_reset = true;
+
+    if (status != ATCI_DATA_OK || rc != 0) abort(ERR_PARAM);
+    OK_();
+}
+
+
+static void set_nvmload(atci_param_t *param)
+{
+    uint32_t size;
+
+    if (!atci_param_get_uint(param, &size)) abort(ERR_PARAM);
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+    if (size == 0) abort(ERR_PARAM);
+
+    // A snapshot without keys could unlock the keys stored in this device
+    if (sysconf.lock_keys) abort(ERR_ACCESS_DENIED);
+
+    // The frame counters are not part of the snapshot. Write them and any
+    // other pending state to NVM before the reboot.
+    if (LoRaMacStop() != LORAMAC_STATUS_OK) abort(ERR_BUSY);
+    lrw_flush_state();
+
+    nvm_snapshot_load_start();
+    nvm_load_left = size;
+
+    TimerInit(&payload_timer, payload_timeout);
+    TimerSetSlack(&payload_timer, PAYLOAD_TIMER_SLACK);
+    TimerSetValue(&payload_timer, sysconf.uart_timeout);
+    nvm_load_next();
+}
+
+
+static void print_evlog_record(const evlog_record_t *record, void *ctx)
+{
+    (void)ctx;
+    atci_printf(";%lu,%u,%u,%lu", record->time, record->event, record->a, record->b);
+}
+
+
+// +OK=<n>;<time>,<event>,<a>,<b>;... with the records of the persistent event
+// log from the oldest, see evlog.h. The time is in seconds since the RTC was
+// last reset, i.e., since the last power-on.
+static void get_evlog(void)
+{
+    atci_printf("+OK=%u", evlog_count());
+    evlog_foreach(print_evlog_record, NULL);
+    EOL();
+}
+
+
+static void clear_evlog(atci_param_t *param)
+{
+    if (param != NULL) abort(ERR_PARAM);
+    if (!evlog_clear()) abort(ERR_FLASH_ERROR);
+    OK_();
+}
+
+
+#if DFU == 1
+
+// Restart into the STM32 system bootloader for a firmware update over the AT
+// command UART. The reset is scheduled like a graceful AT+REBOOT, so pending
+// NVM writes are flushed first. The bootloader could read the keys from the
+// data EEPROM, so the command is not available once they have been locked.
+static void dfu(atci_param_t *param)
+{
+    if (param != NULL) abort(ERR_PARAM);
+    if (sysconf.lock_keys) abort(ERR_ACCESS_DENIED);
+
+    OK_();
+    cmd_event(CMD_EVENT_MODULE, CMD_MODULE_BOOTLOADER);
+    system_request_bootloader();
+    schedule_reset = true;
+    atci_flush();
+}
+
+#endif
+
+
 #if DETACHABLE_LPUART == 1
 
 #if FACTORY_RESET_PIN != 0
@@ -2211,7 +5287,7 @@ void cmd_init_attach_pin(void)
     else if (attach_pin.port == GPIOH) __GPIOH_CLK_ENABLE();
 
     gpio_init(attach_pin.port, attach_pin.pinIndex, &gpio);
-    gpio_set_irq(attach_pin.port, attach_pin.pinIndex, 0, attach_isr);
+    gpio_set_irq(attach_pin.port, attach_pin.pinIndex, IRQ_PRIORITY_EXTI, attach_isr);
 }
 
 #endif
@@ -2219,14 +5295,15 @@ void cmd_init_attach_pin(void)
 
 static void get_device_time(atci_param_t *param)
 {
-    int piggyback = 0;
+    uint32_t deadline;
+    int piggyback = parse_mac_request(param, &deadline);
 
-    if (param != NULL) {
-        piggyback = parse_enabled(param);
-        if (piggyback == -1) abort(ERR_PARAM);
-    }
+    if (piggyback == -1) abort(ERR_PARAM);
 
-    abort_on_error(lrw_get_device_time(piggyback == 1));
+    if (piggyback)
+        abort_on_error(lrw_defer_mac_request(LRW_MAC_DEVICE_TIME, deadline));
+    else
+        abort_on_error(lrw_get_device_time(false));
     OK_();
 }
 
@@ -2307,6 +5384,16 @@ static void set_devnonce(atci_param_t *param)
 }
 
 
+// The time since the cold boot, including any time spent in Standby, as
+// seconds and milliseconds. The RTC tick count (1/1024 s) behind it does not
+// wrap. The seconds are split off with a shift to avoid a 64-bit division.
+static void get_uptime(void)
+{
+    uint64_t ticks = rtc_get_ticks64();
+    OK("%lu,%u", (uint32_t)(ticks >> 10), (unsigned)rtc_tick2ms((uint32_t)ticks & 1023));
+}
+
+
 static void get_mcuid(void)
 {
     uint8_t id[8];
@@ -2334,17 +5421,20 @@ static const atci_command_t cmds[] = {
     {"+APPKEY",      NULL,            set_appkey_10,    get_appkey,       NULL, "Configure AppKey (LoRaWAN 1.0)"},
     {"+JOIN",        join,            NULL,             NULL,             NULL, "Send OTAA Join packet"},
     {"+JOINDC",      NULL,            set_joindc,       get_joindc,       NULL, "Configure OTAA Join duty cycling"},
-    {"+LNCHECK",     lncheck,         lncheck,          NULL,             NULL, "Perform link check"},
+    {"+LNCHECK",     lncheck,         lncheck,          NULL,             NULL, "Perform link check (=0 now, =1[,deadline s] with the next uplink)"},
     {"+RFPARAM",     NULL,            set_rfparam,      get_rfparam,      NULL, "Configure RF channel parameters"},
     {"+RFPOWER",     NULL,            set_rfpower_comp, get_rfpower_comp, NULL, "Configure RF power"},
     {"+NWK",         NULL,            set_nwk,          get_nwk,          NULL, "Configure public/private LoRa network setting"},
     {"+ADR",         NULL,            set_adr,          get_adr,          NULL, "Configure adaptive data rate (ADR)"},
     {"+DR",          NULL,            set_dr_comp,      get_dr_comp,      NULL, "Configure data rate (DR)"},
     {"+DELAY",       NULL,            set_delay,        get_delay,        NULL, "Configure receive window offsets"},
+    {"$RXADAPT",     NULL,            set_rxadapt,      get_rxadapt,      NULL, "Size class A RX windows from measured downlink timing (=0/1), ? also returns RX error and per-DR stats"},
+    {"$RADIOIDLE",   NULL,            set_radioidle,    get_radioidle,    NULL, "Keep the radio in standby over short gaps before RX windows (=0/1), ? also returns threshold, wake-up time and stats"},
     {"+ADRACK",      NULL,            set_adrack,       get_adrack,       NULL, "Configure ADR ACK parameters"},
     {"+RX2",         NULL,            set_rx2_comp,     get_rx2_comp,     NULL, "Configure RX2 window frequency and data rate"},
     {"+DUTYCYCLE",   NULL,            set_dutycycle,    get_dutycycle,    NULL, "Configure duty cycling in EU868"},
     {"+SLEEP",       NULL,            set_sleep,        get_sleep,        NULL, "Configure low power (sleep) mode"},
+    {"$PWRMODE",     NULL,            set_pwrmode,      get_pwrmode,      NULL, "Select power profile (0 balanced, 1 ultra-low-power, 2 low-latency)"},
     {"+PORT",        NULL,            set_port,         get_port,         NULL, "Configure default port number for uplink messages <1,223>"},
     {"+REP",         NULL,            set_rep,          get_rep,          NULL, "Unconfirmed message repeats [1..15]"},
     {"+DFORMAT",     NULL,            set_dformat,      get_dformat,      NULL, "Configure payload format used by the modem"},
@@ -2352,8 +5442,18 @@ static const atci_command_t cmds[] = {
     {"+UTX",         utx,             NULL,             NULL,             NULL, "Send unconfirmed uplink message"},
     {"+CTX",         ctx,             NULL,             NULL,             NULL, "Send confirmed uplink message"},
     {"+MCAST",       NULL,            set_mcast,        get_mcast,        NULL, "Configure multicast addresses and keys"},
+    {"$MCSLOT",      NULL,            set_mcslot,       get_mcslot,       NULL, "Configure the multicast group table (=slot[,addr,mckey|,addr,nwkskey,appskey])"},
+    {"$MCACT",       NULL,            set_mcact,        get_mcact,        NULL, "Load a multicast group table slot into a LoRaMac context (=slot[,group])"},
     {"+PUTX",        putx,            NULL,             NULL,             NULL, "Send unconfirmed uplink message to port"},
     {"+PCTX",        pctx,            NULL,             NULL,             NULL, "Send confirmed uplink message to port"},
+    {"$UTX",         NULL,            utx_ext,          NULL,             NULL, "Send unconfirmed uplink (=port,length[,transmissions[,urgent]])"},
+    {"$CTX",         NULL,            ctx_ext,          NULL,             NULL, "Send confirmed uplink (=port,length[,retries[,urgent]])"},
+    {"$TPL",         NULL,            set_tpl,          get_tpl,          NULL, "Define an uplink payload template (=slot,port,confirmed,hex data; =slot,0 deletes)"},
+    {"$TPLFIELD",    NULL,            set_tplfield,     get_tplfield,     NULL, "Auto-fill a template field (=slot,offset,0 none|1 battery|2 uptime|3 temperature|4 counter)"},
+    {"$TPLTX",       NULL,            tpl_transmit,     NULL,             NULL, "Send an uplink from a template (=slot[,offset,hex data]...)"},
+#if TRIGGER_PIN == 1
+    {"$TRIGGER",     NULL,            set_trigger,      get_trigger,      NULL, "Send a template on a PB2 edge (=edge 0-2,slot,debounce_ms,interval_s), ? also returns sent,suppressed,failed"},
+#endif
     {"+FRMCNT",      NULL,            NULL,             get_frmcnt,       NULL, "Return current values for uplink and downlink counters"},
     {"+MSIZE",       NULL,            NULL,             get_msize,        NULL, "Return maximum payload size for current data rate"},
     {"+RFQ",         NULL,            NULL,             get_rfq,          NULL, "Return RSSI and SNR of the last received message"},
@@ -2371,37 +5471,138 @@ static const atci_command_t cmds[] = {
 #endif
     {"$HALT",        do_halt,         NULL,             NULL,             NULL, "Halt the modem"},
     {"$JOINEUI",     NULL,            set_joineui,      get_joineui,      NULL, "Configure JoinEUI"},
+    {"$JOINSCHED",   NULL,            set_join_sched,   get_join_sched,   NULL, "Configure OTAA Join scheduler (=jitter_ms[,ladder,subband 0-2])"},
+    {"$JOINSTAT",    reset_join_stats, NULL,            get_join_stats,   NULL, "Get Join statistics (tries,accepts,airtime,ms,rssi,snr,dr), reset"},
     {"$NWKKEY",      NULL,            set_nwkkey,       get_nwkkey,       NULL, "Configure NwkKey (LoRaWAN 1.1)"},
     {"$APPKEY",      NULL,            set_appkey_11,    get_appkey,       NULL, "Configure AppKey (LoRaWAN 1.1)"},
     {"$FNWKSINTKEY", NULL,            set_fnwksintkey,  get_fnwksintkey,  NULL, "Configure FNwkSIntKey (LoRaWAN 1.1)"},
     {"$SNWKSINTKEY", NULL,            set_snwksintkey,  get_snwksintkey,  NULL, "Configure SNwkSIntKey (LoRaWAN 1.1)"},
     {"$NWKSENCKEY",  NULL,            set_nwksenckey,   get_nwksenckey,   NULL, "Configure NwkSEncKey (LoRaWAN 1.1)"},
     {"$CHMASK",      NULL,            set_chmask,       get_chmask,       NULL, "Configure channel mask"},
+    {"$CHPLAN",      NULL,            set_chplan,       get_chplan,       NULL, "Load channels and channel mask at once (=hex plan)"},
     {"$RX2",         NULL,            set_rx2,          get_rx2,          NULL, "Configure RX2 window frequency and data rate"},
     {"$DR",          NULL,            set_dr,           get_dr,           NULL, "Configure data rate (DR)"},
     {"$RFPOWER",     NULL,            set_rfpower,      get_rfpower,      NULL, "Configure RF power"},
     {"$ASYNC",       NULL,            set_async,        get_async,        NULL, "Enable/disable asynchronous UART communication"},
+    {"$COALESCE",    NULL,            set_coalesce,     get_coalesce,     NULL, "Configure the notification coalescing window (ms)"},
+    {"$FRAMED",      NULL,            set_framed,       get_framed,       NULL, "Enable/disable framed binary AT command transport"},
+    {"$NVMPOLICY",   NULL,            set_nvmpolicy,    get_nvmpolicy,    NULL, "Configure NVM write-behind window and frame counter margin"},
+    {"$TXQUEUE",     NULL,            set_txqueue,      get_txqueue,      NULL, "Enable/disable the uplink transmit queue"},
+    {"$AUTOPULL",    NULL,            set_autopull,     get_autopull,     NULL, "Enable/disable automatic fetch of pending downlinks"},
+    {"$EVENTS",      NULL,            set_events,       get_events,       NULL, "Enable/disable notifications (=type,subtype_mask)"},
+    {"$COMMIT",      commit,          set_commit,       get_commit,       NULL, "Write configuration changes to NVM now (=1 to open a transaction)"},
+    {"$TXSTORE",     NULL,            set_txstore,      get_txstore,      NULL, "Configure the persistent uplink store (=enabled[,interval s[,max age s]])"},
+    {"$TXSTOREDEL",  txstore_del,     NULL,             NULL,             NULL, "Drop all messages from the persistent uplink store"},
+    {"$MCFILTER",    NULL,            set_mcfilter,     get_mcfilter,     NULL, "Configure multicast group port filters"},
+    {"$MCBATCH",     NULL,            set_mcbatch,      get_mcbatch,      NULL, "Configure multicast downlink batching interval (ms)"},
+    {"$DLROUTE",     NULL,            set_dlroute,      get_dlroute,      NULL, "Route downlinks by port (=port,0 forward|1 store|2 drop|3 apply to user NVM)"},
+    {"$RECVEXT",     NULL,            set_recvext,      get_recvext,      NULL, "Enable/disable downlink metadata in +RECV"},
+    {"$PWRSTAT",     NULL,            set_pwrstat,      get_pwrstat,      NULL, "Power residency and lock statistics (=0 to reset)"},
+    {"$STANDBY",     NULL,            set_standby,      get_standby,      NULL, "Enable/disable the Standby mode when idle"},
+    {"$LBT",         reset_lbt,       NULL,             get_lbt,          NULL, "Get LBT statistics (checks,busy,rssi,samples,ms), reset"},
+    {"$CADRX",       NULL,            set_cad_rx,       get_cad_rx,       NULL, "Configure CAD duty-cycled class C reception (=period in ms, 0 off)"},
+    {"$P2P",         NULL,            set_p2p,          get_p2p,          NULL, "Configure P2P mode (=freq,sf,bw kHz,cr 5-8,power dBm[,preamble])"},
+    {"$P2PTX",       NULL,            p2p_tx,           NULL,             NULL, "Transmit a raw LoRa packet in P2P mode (=length)"},
+    {"$P2PRX",       NULL,            set_p2p_rx,       get_p2p_rx,       NULL, "Enable/disable continuous P2P reception"},
+    {"$CHSTAT",      reset_chstat,    NULL,             get_chstat,       NULL, "Get per-channel uplink statistics (n;ch,attempts,acks,noise,benched), reset"},
+    {"$CHPOLICY",    NULL,            set_chpolicy,     get_chpolicy,     NULL, "Enable/disable deprioritising channels with poor delivery"},
+    {"$SPLIT",       NULL,            set_split,        get_split,        NULL, "Split queued uplinks too long for the data rate (=port, 0 off)"},
+    {"$SLOT",        NULL,            set_slot,         get_slot,         NULL, "Send queued uplinks in a slot of GPS time (=period_s[,width_s[,offset_s]]), ? also returns the slot in effect"},
+    {"$CLASSC",      NULL,            set_class_c,      get_class_c,      NULL, "Open class C windows in class A (=events 1 uplink|2 FPending|4 schedule,window s[,period s[,offset s]])"},
+    {"$RTXBACKOFF",  NULL,            set_rtx_backoff,  get_rtx_backoff,  NULL, "Retransmit queued confirmed uplinks with backoff (=base s[,max s[,jitter %]], 0 off)"},
+    {"$SCAN",        scan,            set_scan,         NULL,             NULL, "Sample RSSI on every channel (=samples), returns n;ch,freq,min,avg,max"},
+    {"$BULK",        NULL,            set_bulk,         get_bulk,         NULL, "Configure FSK bulk transfer (=freq,bitrate bps,fdev Hz,power dBm)"},
+    {"$BULKTX",      NULL,            bulk_tx,          get_bulk_tx,      NULL, "Append data to the FSK bulk stream (=length), get state and statistics"},
+    {"$BULKEND",     bulk_end_tx,     NULL,             NULL,             NULL, "Close the FSK bulk stream once all data has been sent"},
+    {"$BULKRX",      NULL,            set_bulk_rx,      get_bulk_rx,      NULL, "Enable/disable FSK bulk reception"},
+    {"$PING",        NULL,            set_ping,         get_ping,         NULL, "P2P ping-pong sweep (=count[,sf min,sf max,bw mask,length...], 0 aborts), get progress"},
+    {"$PONG",        NULL,            set_pong,         get_pong,         NULL, "Enable/disable echoing P2P pings, get the number of echoed pings"},
+    {"$STREAM",      NULL,            set_stream,       get_stream,       NULL, "Stream data into a sink with credit flow control (=sink,length[,size])"},
+    {"$HEARTBEAT",   NULL,            set_heartbeat,    get_heartbeat,    NULL, "Configure periodic uplinks (=period s,port[,jitter %[,content[,nvm offset,length]]])"},
+    {"$AGG",         NULL,            set_agg,          get_agg,          NULL, "Configure uplink aggregation (=port 0 off,timeout ms[,confirmed])"},
+    {"$AGGTX",       NULL,            agg_tx,           get_agg_tx,       NULL, "Buffer a reading for an aggregated uplink (=length), get statistics"},
+    {"$AGGFLUSH",    agg_flush_tx,    NULL,             NULL,             NULL, "Send buffered readings now"},
+    {"$DELTA",       NULL,            set_delta,        get_delta,        NULL, "Configure the delta codec (=port 0 off,confirmed,keyframe interval,field width...)"},
+    {"$DELTATX",     NULL,            delta_tx,         get_delta_tx,     NULL, "Send a delta-encoded frame (=length), get statistics"},
 #if DEBUG_LOG != 0
     {"$LOGLEVEL",    NULL,            set_loglevel,     get_loglevel,     NULL, "Configure logging on USART port"},
 #endif
     {"$SESSION",     NULL,            NULL,             get_session,      NULL, "Get network session information"},
+    {"$STATE",       NULL,            NULL,             get_state,        NULL, "Get a compact binary snapshot of session and radio state"},
+    {"$RECV",        NULL,            NULL,             get_recv,         NULL, "Retrieve the oldest queued downlink message"},
+    {"$MBOX",        NULL,            NULL,             get_mbox,         NULL, "Get the number of messages in the polling mode mailbox"},
+    {"$MBOXGET",     NULL,            NULL,             get_mbox_entry,   NULL, "Read the oldest message in the mailbox"},
+    {"$MBOXACK",     mbox_ack,        set_mbox_ack,     NULL,             NULL, "Remove the oldest message(s) from the mailbox"},
+#if FUOTA == 1
+    {"$FRAG",        NULL,            NULL,             get_frag,         NULL, "Get the status of the FUOTA fragmentation session"},
+    {"$FRAGREAD",    NULL,            set_fragread,     NULL,             NULL, "Read the reassembled FUOTA data block"},
+    {"$FRAGDEL",     frag_del,        NULL,             NULL,             NULL, "Delete the FUOTA fragmentation session"},
+#endif
+#if TRACE == 1
+    {"$TRACE",       NULL,            NULL,             get_trace,        NULL, "Get and clear radio hot-path trace points"},
+#endif
+#if TRACE_IRQ == 1
+    {"$IRQTIME",     NULL,            NULL,             get_irq_time,     NULL, "Get and clear the longest run time of each interrupt handler (rtc,exti,lpuart,dma,log us)"},
+#endif
+#if ENERGY_PROFILE == 1
+    {"$ENERGY",      NULL,            NULL,             get_energy,       NULL, "Get and clear the energy profile phase transitions"},
+#endif
+#if ENERGY_METER == 1
+    {"$CHARGE",      NULL,            set_charge,       get_charge,       NULL, "Get the estimated charge since reset (s,uAh;category,ms,uAh...), =0 resets"},
+    {"$CHARGECAL",   NULL,            set_chargecal,    get_chargecal,    NULL, "Calibrate the energy meter current table (=category,nA or =TX,dBm,nA)"},
+#endif
+#if BENCH == 1
+    {"$BENCH",       NULL,            NULL,             get_bench,        NULL, "Run the on-target benchmark suite"},
+#endif
+#if ATCI_PROF == 1
+    ATCI_COMMAND_PROF,
+#endif
 #if CERTIFICATION_ATCI != 0
     {"$CERT",        NULL,            set_cert,         get_cert,         NULL, "Enable or disable LoRaWAN certification port"},
     {"$CW",          cw,              NULL,             NULL,             NULL, "Start continuous carrier wave transmission"},
     {"$CM",          cm,              NULL,             NULL,             NULL, "Start continuous modulated FSK transmission"},
 #endif
-    {"$NVM",         nvm_userdata,    NULL,             NULL,             NULL, "Manage data in NVM user registers"},
+    {"$NVM",         nvm_userdata,    set_nvm_block,    NULL,             NULL, "Manage data in NVM user registers (=offset,length[,data] for blocks)"},
     {"$LOCKKEYS",    lock_keys,       NULL,             NULL,             NULL, "Prevent read access to security keys from ATCI"},
+    {"$NVMDUMP",     NULL,            NULL,             get_nvmdump,      NULL, "Get a snapshot of the configuration stored in NVM"},
+    {"$NVMLOAD",     NULL,            set_nvmload,      NULL,             NULL, "Load an NVM configuration snapshot (=size) and reboot"},
+    {"$EVLOG",       clear_evlog,     NULL,             get_evlog,        NULL, "Get the persistent event log (boots, halts, NVM errors, joins), clear"},
+#if DFU == 1
+    {"$DFU",         dfu,             NULL,             NULL,             NULL, "Reboot into the system bootloader for a firmware update"},
+#endif
 #if DETACHABLE_LPUART == 1
     {"$DETACH",      detach_lpuart,   NULL,             NULL,             NULL, "Disconnect LPUART (ATCI) GPIOs"},
 #endif
     {"$TIME",        NULL,            set_time,         get_time,         NULL, "Get or set modem's RTC time (GPS time)"},
-    {"$DEVTIME",     get_device_time, NULL,             NULL,             NULL, "Get network time via DeviceTimeReq MAC command"},
+    {"$UPTIME",      NULL,            NULL,             get_uptime,       NULL, "Get the time since cold boot (s,ms), including Standby"},
+#if CLOCK_SYNC == 1
+    {"$CLKSYNC",     clksync,         set_clksync,      get_clksync,      NULL, "Synchronize RTC with the clock sync package (=period in s)"},
+#endif
+#if REMOTE_ATCI == 1
+    {"$REMOTE",      NULL,            set_remote,       get_remote,       NULL, "Configure the port of remotely executed AT commands (0 disables)"},
+#endif
+    {"$BAT",         battery,         set_battery,      get_battery,      NULL, "Configure battery level for DevStatusAns (=empty_mV,full_mV)"},
+    {"$BATPOL",      NULL,            set_batpol,       get_batpol,       NULL, "Throttle uplinks on low battery (=low_mV,critical_mV,interval_s), ? also returns state"},
+    {"$TCOMP",       NULL,            set_temp_comp,    get_temp_comp,    NULL, "Enable RTC temperature compensation (? returns temp, ppm)"},
+    {"$REJOIN",      NULL,            rejoin,           NULL,             NULL, "Send a LoRaWAN 1.1 Rejoin-request (=type 0-2)"},
+    {"$STATS",       reset_stats,     NULL,             get_stats,        NULL, "Get uplink/downlink statistics (counters,LPUART counters reset on read;airtime per DR;channel:transmissions), reset"},
+    {"$MEM",         reset_mem,       NULL,             get_mem,          NULL, "Get RAM usage (data,bss,stack,stack peak;UART FIFO sizes and peaks;pool failures,tx,rx,p2p;pool classes), reset peaks"},
+    {"$AIRTIME",     NULL,            airtime,          NULL,             NULL, "Compute uplink time on air in ms (=length[,dr])"},
+    {"$AIRBUDGET",   reset_airbudget, set_airbudget,    get_airbudget,    NULL, "Configure uplink airtime budget (=s per 24 h, 0 off), ? also returns ms used in 24 h, reset"},
+    {"$PROFILE",     NULL,            set_profile,      get_profile,      NULL, "Switch LoRaWAN network profile (=profile 0-2), reboots"},
+    {"$LINKWD",      NULL,            set_linkwd,       get_linkwd,       NULL, "Configure the link supervisor (=failures before DR step-down/rejoin, 0 off)"},
+    {"$CADR",        NULL,            set_cadr,         get_cadr,         NULL, "Enable data rate control with ADR off (=enabled[,target margin dB[,min dr,max dr]]), ? returns DR, margin"},
+    {"$TPC",         NULL,            set_tpc,          get_tpc,          NULL, "Enable TX power control with ADR off (=enabled[,target margin dB]), ? returns power index, margin"},
+    {"$PINGSLOT",    NULL,            set_ping_slot,    get_ping_slot,    NULL, "Configure class B ping slot periodicity (0-7)"},
+    {"$BEACON",      NULL,            NULL,             get_beacon,       NULL, "Get class B state and the last received beacon"},
+    {"$DEVTIME",     get_device_time, get_device_time,  NULL,             NULL, "Get network time via DeviceTimeReq MAC command (=0 now, =1[,deadline s] with the next uplink)"},
     {"$DEVNONCE",    NULL,            set_devnonce,     get_devnonce,     NULL, "Get or set LoRaWAN 1.1 DevNonce"},
     {"$MCUID",       NULL,            NULL,             get_mcuid,        NULL, "Get the modem's unique MCU ID"},
     ATCI_COMMAND_CLAC,
     ATCI_COMMAND_HELP};
 
+static_assert(ATCI_COMMANDS_LENGTH(cmds) <= ATCI_MAX_COMMANDS, "ATCI_MAX_COMMANDS is too small for the command table");
+
 
 void cmd_init(unsigned int baudrate)
 {
@@ -2409,7 +5610,80 @@ void cmd_init(unsigned int baudrate)
 }
 
 
+uint16_t cmd_mailbox_seq(void)
+{
+    return mailbox_seq++;
+}
+
+
+void cmd_update_data_ready(void)
+{
+    lpuart_set_pending(!cmd_mailbox_empty());
+}
+
+
+bool cmd_mailbox_empty(void)
+{
+    return sysconf.async_uart || (!event_queue.count && !lrw_rx_queue_length());
+}
+
+
+// In the polling mode, keep the event in the mailbox. Module events are always
+// sent immediately since they are generated right before or after a reset or
+// halt, which would discard the mailbox.
+static bool queue_event(unsigned int type, unsigned int subtype, const int *arg, unsigned int nargs)
+{
+    queued_event_t *e;
+
+    if (sysconf.async_uart || type == CMD_EVENT_MODULE) return false;
+
+    if (event_queue.count == CMD_EVENT_QUEUE_SIZE) {
+        event_queue.dropped = true;
+        return true;
+    }
+
+    e = &event_queue.slot[(event_queue.head + event_queue.count) % CMD_EVENT_QUEUE_SIZE];
+    e->seq = cmd_mailbox_seq();
+    e->type = type;
+    e->subtype = subtype;
+    e->nargs = nargs;
+    for (unsigned int i = 0; i < nargs; i++) e->arg[i] = arg[i];
+    event_queue.count++;
+    return true;
+}
+
+
+bool cmd_event_enabled(unsigned int type, unsigned int subtype)
+{
+    if (type >= SYSCONF_EVENT_TYPES || subtype >= 8) return true;
+    return !(sysconf.event_filter[type] & (1 << subtype));
+}
+
+
+void cmd_event_args(unsigned int type, unsigned int subtype, const int *arg, unsigned int nargs)
+{
+    // Drop disabled events before they are formatted or queued
+    if (!cmd_event_enabled(type, subtype)) return;
+
+    if (nargs > CMD_EVENT_MAX_ARGS) nargs = CMD_EVENT_MAX_ARGS;
+    if (queue_event(type, subtype, arg, nargs)) return;
+
+    atci_frame_open(0);
+    atci_printf("+EVENT=%d,%d", type, subtype);
+    for (unsigned int i = 0; i < nargs; i++) atci_printf(",%d", arg[i]);
+    atci_print(ATCI_EOL);
+    atci_frame_close();
+}
+
+
 void cmd_event(unsigned int type, unsigned int subtype)
 {
-    atci_printf("+EVENT=%d,%d" ATCI_EOL, type, subtype);
+    cmd_event_args(type, subtype, NULL, 0);
+}
+
+
+void cmd_uplink_event(unsigned int id, unsigned int status)
+{
+    int arg = id;
+    cmd_event_args(CMD_EVENT_UPLINK, status, &arg, 1);
 }
@@ -8,7 +8,27 @@ enum cmd_event {
     CMD_EVENT_MODULE  = 0,
     CMD_EVENT_JOIN    = 1,
     CMD_EVENT_NETWORK = 2,
-    CMD_EVENT_CERT    = 9
+    CMD_EVENT_UPLINK  = 3,
+    CMD_EVENT_FUOTA   = 4,
+    CMD_EVENT_CLASS_B = 5,
+    CMD_EVENT_TX      = 6,
+    CMD_EVENT_CERT    = 9,
+
+    // Not an +EVENT type. Used with AT$EVENTS to select +NOACK (subtype 0)
+    // and +ACK (subtype 1) notifications.
+    CMD_EVENT_ACK     = 10,
+
+    // Point-to-point mode, see p2p.h. Cannot be disabled with AT$EVENTS.
+    CMD_EVENT_P2P     = 11,
+
+    // TX power control decisions, see lrw_tpc_set. Cannot be disabled with
+    // AT$EVENTS.
+    CMD_EVENT_TPC     = 12,
+
+    // Battery policy state changes, see lrw_batpol_set. The subtype is the new
+    // state (enum lrw_battery_state), followed by the voltage in mV. Cannot
+    // be disabled with AT$EVENTS.
+    CMD_EVENT_BATTERY = 13
 };
 
 
@@ -16,20 +36,93 @@ enum cmd_event_module {
     CMD_MODULE_BOOT       = 0,
     CMD_MODULE_FACNEW     = 1,
     CMD_MODULE_BOOTLOADER = 2,
-    CMD_MODULE_HALT       = 3
+    CMD_MODULE_HALT       = 3,
+    CMD_MODULE_RESUME     = 4
 };
 
 
 enum cmd_event_join {
     CMD_JOIN_FAILED    = 0,
-    CMD_JOIN_SUCCEEDED = 1
+    CMD_JOIN_SUCCEEDED = 1,
+
+    // The outcome of a Rejoin-request sent with AT$REJOIN. The current
+    // session remains valid if the Rejoin fails.
+    CMD_JOIN_REJOIN_FAILED    = 2,
+    CMD_JOIN_REJOIN_SUCCEEDED = 3
 };
 
 
 enum cmd_event_net {
     CMD_NET_NOANSWER       = 0,
     CMD_NET_ANSWER         = 1,
-    CMD_NET_RETRANSMISSION = 2
+    CMD_NET_RETRANSMISSION = 2,
+    CMD_NET_RX_DROPPED     = 3,
+
+    // Link supervisor steps, see lrw_linkwd_set. CMD_NET_LINK_DR_DOWN carries
+    // the new data rate.
+    CMD_NET_LINK_DR_DOWN   = 4,
+    CMD_NET_LINK_CHECK     = 5,
+    CMD_NET_LINK_REJOIN    = 6,
+
+    // Client-side data rate control, see lrw_cadr_set. Both subtypes carry
+    // the new data rate and the most recent margin in dB (-1 if unknown).
+    CMD_NET_ADR_DR_UP      = 7,
+    CMD_NET_ADR_DR_DOWN    = 8
+};
+
+
+enum cmd_event_uplink {
+    CMD_UPLINK_FAILED = 0,
+    CMD_UPLINK_SENT   = 1
+};
+
+
+enum cmd_event_fuota {
+    CMD_FUOTA_SESSION   = 0,
+    CMD_FUOTA_COMPLETED = 1,
+    CMD_FUOTA_FAILED    = 2
+};
+
+
+enum cmd_event_class_b {
+    CMD_CLASS_B_BEACON_NOT_FOUND = 0,
+    CMD_CLASS_B_BEACON_LOCKED    = 1,
+    CMD_CLASS_B_BEACON_LOST      = 2,
+    CMD_CLASS_B_ACTIVE           = 3
+};
+
+
+// CMD_TX_DONE carries the time on air in milliseconds, the channel index, the
+// data rate, and the TX power index of the transmission, followed by the
+// maximum payload size of the next uplink (see AT+MSIZE). CMD_TX_RX_CLOSED
+// follows it if no downlink was received in the RX windows.
+enum cmd_event_tx {
+    CMD_TX_DONE      = 0,
+    CMD_TX_RX_CLOSED = 1
+};
+
+
+enum cmd_event_p2p {
+    CMD_P2P_TX_DONE    = 0,
+    CMD_P2P_TX_TIMEOUT = 1,
+    CMD_P2P_RX_DROPPED = 2,
+
+    // FSK bulk transfer, see bulk.h
+    CMD_P2P_BULK_TX_DONE   = 3,
+    CMD_P2P_BULK_TX_FAILED = 4,
+    CMD_P2P_BULK_RX_DONE   = 5,
+
+    // P2P ping-pong benchmark, see ping.h
+    CMD_P2P_PING_DONE   = 6,
+    CMD_P2P_PING_FAILED = 7
+};
+
+
+// Both subtypes carry the new TX power index and the most recent margin in dB
+// (-1 if unknown)
+enum cmd_event_tpc {
+    CMD_TPC_LOWERED = 0,
+    CMD_TPC_RAISED  = 1
 };
 
 
@@ -41,15 +134,49 @@ enum cmd_event_cert {
 
 extern bool schedule_reset;
 
+// Set together with schedule_reset by AT+REBOOT. The NVM state is then kept
+// across the reset, see nvm_retain.
+extern bool schedule_warm_reset;
+
 void cmd_init(unsigned int baudrate);
 
 void cmd_event(unsigned int type, unsigned subtype);
 
+//! @brief Return true if the host has not disabled notifications of the given
+//! type and subtype with AT$EVENTS
+
+bool cmd_event_enabled(unsigned int type, unsigned int subtype);
+
+//! @brief Send or queue an event with up to four additional fields after the
+//! subtype, e.g., +EVENT=6,0,airtime,channel,dr,power
+
+void cmd_event_args(unsigned int type, unsigned int subtype, const int *arg, unsigned int nargs);
+
+void cmd_uplink_event(unsigned int id, unsigned int status);
+
+//! @brief Return the next sequence number for an entry in the polling mode
+//! mailbox. The sequence numbers order events and queued downlinks.
+
+uint16_t cmd_mailbox_seq(void);
+
+//! @brief Signal a non-empty polling mode mailbox to the host, see
+//! lpuart_set_pending. Invoked from the main loop after the task handlers.
+
+void cmd_update_data_ready(void);
+
+//! @brief Return true if the polling mode mailbox holds no events or downlinks
+
+bool cmd_mailbox_empty(void);
+
 #if DETACHABLE_LPUART == 1
 void cmd_init_attach_pin(void);
 #endif
 
-#define cmd_process atci_process
+//! @brief Process AT commands and stream data received from the host.
+//! Invoked from the main loop.
+
+void cmd_process(void);
+
 #define cmd_print atci_print
 #define cmd_printf atci_printf
 
@@ -0,0 +1,355 @@
+// Accelerated AES-128 for LoRaMac-node's software secure element (soft-se).
+// Both AES-CMAC (MIC) and the payload and key encryption in soft-se.c are
+// built on aes_set_key and aes_encrypt from soft-se/aes.c, and soft-se sets
+// the key again on every operation. Replacing the two functions thus speeds
+// up all LoRaWAN cryptography.
+//
+// The Makefile links the firmware with --wrap=aes_set_key and
+// --wrap=aes_encrypt when AES_HW is 1 or AES_KEY_CACHE is not 0. The functions
+// below then receive all calls made by LoRaMac-node and the original
+// software implementation remains available as __real_aes_set_key and
+// __real_aes_encrypt.
+//
+// With AES_HW, the blocks are encrypted by the AES peripheral of the
+// STM32L082. The peripheral is verified with a known-answer test on first use
+// and is not used if the test fails.
+//
+// With AES_KEY_CACHE, the software key schedules of the most recently used
+// keys are kept in RAM, so that the schedule is not expanded again for every
+// MIC and every encrypted frame. aes_set_key then only records the key in the
+// caller's context and aes_encrypt looks the schedule up. The cache is keyed
+// by the key itself and thus cannot go stale; it is nonetheless cleared
+// whenever the secure element stores a new key (AT commands, Join) so that
+// no copies of old keys are kept around.
+//
+// With AES_KEYSTREAM, the AES blocks that encrypt the FRMPayload of the next
+// uplink are computed in advance, see crypto_precompute_keystream. The
+// wrapper of aes_encrypt answers LoRaMac's requests for those blocks from the
+// precomputed keystream.
+
+#include "crypto.h"
+
+#if AES_HW == 1 || AES_KEY_CACHE > 0
+
+#include <stdbool.h>
+#include <string.h>
+#include <stm/STM32L0xx_HAL_Driver/Inc/stm32l0xx_hal.h>
+#include <loramac-node/src/peripherals/soft-se/aes.h>
+#include <loramac-node/src/mac/secure-element.h>
+#include "log.h"
+
+// Markers stored in aes_context.rnd of contexts that hold the raw key in
+// ksch[0..15] instead of the key schedule. The software implementation uses
+// 10, 12, or 14 rounds.
+#define RND_HW     0xff
+#define RND_CACHED 0xfe
+
+return_type __real_aes_set_key(const uint8_t key[], length_type keylen, aes_context ctx[1]);
+return_type __real_aes_encrypt(const uint8_t in[N_BLOCK], uint8_t out[N_BLOCK], const aes_context ctx[1]);
+
+
+#if AES_HW == 1
+
+// The device header of the STM32L072 does not describe the AES peripheral of
+// the otherwise identical STM32L082, see RM0367
+typedef struct
+{
+    __IO uint32_t CR;
+    __IO uint32_t SR;
+    __IO uint32_t DINR;
+    __IO uint32_t DOUTR;
+    __IO uint32_t KEYR0;
+    __IO uint32_t KEYR1;
+    __IO uint32_t KEYR2;
+    __IO uint32_t KEYR3;
+    __IO uint32_t IVR0;
+    __IO uint32_t IVR1;
+    __IO uint32_t IVR2;
+    __IO uint32_t IVR3;
+} aes_hw_t;
+
+#define AES_REGS       ((aes_hw_t *)(AHBPERIPH_BASE + 0x00006000UL))
+#define AES_CR_EN      (1UL << 0)
+#define AES_CR_BYTES   (2UL << 1)  // DATATYPE: swap the bytes of each word
+#define AES_CR_CCFC    (1UL << 7)
+#define AES_SR_CCF     (1UL << 0)
+#define RCC_AHBENR_AES (1UL << 24) // CRYPEN
+
+// The number of status register polls before the peripheral is considered
+// unusable. A block takes 202 AES clock cycles.
+#define AES_TIMEOUT 1000
+
+static enum {
+    HW_UNKNOWN = 0,
+    HW_AVAILABLE,
+    HW_UNAVAILABLE
+} hw_state;
+
+
+static inline uint32_t load_be32(const uint8_t *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+
+static bool hw_encrypt(const uint8_t key[16], const uint8_t in[16], uint8_t out[16])
+{
+    uint32_t v, i, j;
+    bool rv = false;
+
+    RCC->AHBENR |= RCC_AHBENR_AES;
+
+    // The key can only be written while the peripheral is disabled. With the
+    // byte DATATYPE, the data words are byte-swapped by the peripheral, so the
+    // blocks can be transferred with unaligned little-endian loads and stores.
+    AES_REGS->CR = AES_CR_BYTES;
+    AES_REGS->KEYR3 = load_be32(key);
+    AES_REGS->KEYR2 = load_be32(key + 4);
+    AES_REGS->KEYR1 = load_be32(key + 8);
+    AES_REGS->KEYR0 = load_be32(key + 12);
+    AES_REGS->CR = AES_CR_BYTES | AES_CR_EN;
+
+    for (i = 0; i < 16; i += 4) {
+        memcpy(&v, in + i, 4);
+        AES_REGS->DINR = v;
+    }
+
+    for (i = 0; i < AES_TIMEOUT; i++) {
+        if (AES_REGS->SR & AES_SR_CCF) {
+            for (j = 0; j < 16; j += 4) {
+                v = AES_REGS->DOUTR;
+                memcpy(out + j, &v, 4);
+            }
+            rv = true;
+            break;
+        }
+    }
+
+    AES_REGS->CR = AES_CR_CCFC;
+    RCC->AHBENR &= ~RCC_AHBENR_AES;
+    return rv;
+}
+
+
+// Run the FIPS-197 Appendix C.1 test vector through the peripheral
+static void hw_probe(void)
+{
+    static const uint8_t key[16] = {
+        0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+        0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f
+    };
+    static const uint8_t plain[16] = {
+        0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+        0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff
+    };
+    static const uint8_t cipher[16] = {
+        0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30,
+        0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a
+    };
+    uint8_t out[16];
+
+    if (hw_encrypt(key, plain, out) && !memcmp(out, cipher, sizeof(out))) {
+        hw_state = HW_AVAILABLE;
+    } else {
+        log_warning("AES peripheral failed self-test, using software AES");
+        hw_state = HW_UNAVAILABLE;
+    }
+}
+
+#endif // AES_HW
+
+
+#if AES_KEY_CACHE > 0
+
+static struct {
+    uint8_t key[16];
+    uint32_t used;  // 0 if the entry is empty
+    aes_context ctx;
+} cache[AES_KEY_CACHE];
+
+static uint32_t cache_clock;
+
+
+// Return the cached key schedule of the given key, expanding it into the least
+// recently used entry if needed
+static const aes_context *cache_get(const uint8_t key[16])
+{
+    unsigned i, victim = 0;
+
+    for (i = 0; i < AES_KEY_CACHE; i++) {
+        if (cache[i].used && !memcmp(cache[i].key, key, 16)) {
+            victim = i;
+            goto found;
+        }
+        if (cache[i].used < cache[victim].used) victim = i;
+    }
+
+    memcpy(cache[victim].key, key, 16);
+    __real_aes_set_key(key, 16, &cache[victim].ctx);
+
+found:
+    cache[victim].used = ++cache_clock;
+    return &cache[victim].ctx;
+}
+
+
+static void cache_clear(void)
+{
+    memset(cache, 0, sizeof(cache));
+}
+
+#endif // AES_KEY_CACHE
+
+
+#if CRYPTO_KEYSTREAM == 1
+
+static struct {
+    bool valid;
+    uint8_t key[16];
+    uint8_t prefix[15];  // The A_i block without the block counter
+    uint8_t block[AES_KEYSTREAM][16];
+} keystream;
+
+
+// The A_i blocks are numbered from 1 in their last byte
+static bool keystream_lookup(const uint8_t key[16], const uint8_t in[16], uint8_t out[16])
+{
+    unsigned i = in[15];
+
+    if (!keystream.valid || i == 0 || i > AES_KEYSTREAM) return false;
+    if (memcmp(keystream.prefix, in, 15) || memcmp(keystream.key, key, 16)) return false;
+
+    memcpy(out, keystream.block[i - 1], 16);
+    return true;
+}
+
+#endif // CRYPTO_KEYSTREAM
+
+
+return_type __wrap_aes_set_key(const uint8_t key[], length_type keylen, aes_context ctx[1])
+{
+    if (keylen != 16) return __real_aes_set_key(key, keylen, ctx);
+
+#if AES_HW == 1
+    if (hw_state == HW_UNKNOWN) hw_probe();
+    if (hw_state == HW_AVAILABLE) {
+        // The peripheral expands the key itself
+        memcpy(ctx->ksch, key, 16);
+        ctx->rnd = RND_HW;
+        return 0;
+    }
+#endif
+
+#if AES_KEY_CACHE > 0
+    memcpy(ctx->ksch, key, 16);
+    ctx->rnd = RND_CACHED;
+    return 0;
+#else
+    return __real_aes_set_key(key, keylen, ctx);
+#endif
+}
+
+
+static return_type encrypt_block(const uint8_t in[N_BLOCK], uint8_t out[N_BLOCK], const aes_context ctx[1])
+{
+#if AES_HW == 1
+    if (ctx->rnd == RND_HW) {
+        if (!hw_encrypt(ctx->ksch, in, out)) {
+            memset(out, 0, N_BLOCK);
+            return (return_type)-1;
+        }
+        return 0;
+    }
+#endif
+
+#if AES_KEY_CACHE > 0
+    if (ctx->rnd == RND_CACHED)
+        return __real_aes_encrypt(in, out, cache_get(ctx->ksch));
+#endif
+
+    return __real_aes_encrypt(in, out, ctx);
+}
+
+
+return_type __wrap_aes_encrypt(const uint8_t in[N_BLOCK], uint8_t out[N_BLOCK], const aes_context ctx[1])
+{
+#if CRYPTO_KEYSTREAM == 1
+    // Only the contexts marked by __wrap_aes_set_key hold the raw key
+    if ((ctx->rnd == RND_HW || ctx->rnd == RND_CACHED) && keystream_lookup(ctx->ksch, in, out))
+        return 0;
+#endif
+
+    return encrypt_block(in, out, ctx);
+}
+
+
+#if CRYPTO_KEYSTREAM == 1
+
+void crypto_precompute_keystream(const uint8_t key[16], uint32_t devaddr, uint32_t fcnt)
+{
+    // Uplink direction (byte 5) and the zero bytes 1-4 and 14
+    uint8_t a[16] = { 0x01 };
+    aes_context ctx;
+    unsigned i;
+
+    for (i = 0; i < 4; i++) {
+        a[6 + i] = devaddr >> (8 * i);
+        a[10 + i] = fcnt >> (8 * i);
+    }
+
+    if (keystream.valid && !memcmp(keystream.prefix, a, 15) && !memcmp(keystream.key, key, 16))
+        return;
+
+    keystream.valid = false;
+    __wrap_aes_set_key(key, 16, &ctx);
+    if (ctx.rnd != RND_HW && ctx.rnd != RND_CACHED) return;
+
+    for (i = 0; i < AES_KEYSTREAM; i++) {
+        a[15] = i + 1;
+        if (encrypt_block(a, keystream.block[i], &ctx) != 0) return;
+    }
+
+    memcpy(keystream.prefix, a, 15);
+    memcpy(keystream.key, key, 16);
+    keystream.valid = true;
+}
+
+
+void crypto_clear_keystream(void)
+{
+    memset(&keystream, 0, sizeof(keystream));
+}
+
+#endif // CRYPTO_KEYSTREAM
+
+
+#if AES_KEY_CACHE > 0
+
+SecureElementStatus_t __real_SecureElementSetKey(KeyIdentifier_t keyID, uint8_t *key);
+SecureElementStatus_t __real_SecureElementDeriveAndStoreKey(uint8_t *input, KeyIdentifier_t rootKeyID, KeyIdentifier_t targetKeyID);
+
+
+SecureElementStatus_t __wrap_SecureElementSetKey(KeyIdentifier_t keyID, uint8_t *key)
+{
+    SecureElementStatus_t rv = __real_SecureElementSetKey(keyID, key);
+    cache_clear();
+#if CRYPTO_KEYSTREAM == 1
+    crypto_clear_keystream();
+#endif
+    return rv;
+}
+
+
+SecureElementStatus_t __wrap_SecureElementDeriveAndStoreKey(uint8_t *input, KeyIdentifier_t rootKeyID, KeyIdentifier_t targetKeyID)
+{
+    SecureElementStatus_t rv = __real_SecureElementDeriveAndStoreKey(input, rootKeyID, targetKeyID);
+    cache_clear();
+#if CRYPTO_KEYSTREAM == 1
+    crypto_clear_keystream();
+#endif
+    return rv;
+}
+
+#endif // AES_KEY_CACHE
+
+#endif // AES_HW || AES_KEY_CACHE
@@ -0,0 +1,42 @@
+#ifndef _CRYPTO_H
+#define _CRYPTO_H
+
+#include <stdint.h>
+
+//! @brief True if the FRMPayload keystream of the next uplink is precomputed.
+//! The keystream is served from the AES wrappers, which hold the raw key only
+//! with AES_HW or AES_KEY_CACHE.
+#if AES_KEYSTREAM > 0 && (AES_HW == 1 || AES_KEY_CACHE > 0)
+#  define CRYPTO_KEYSTREAM 1
+#else
+#  define CRYPTO_KEYSTREAM 0
+#endif
+
+#if CRYPTO_KEYSTREAM == 1
+
+/*! @brief Precompute the FRMPayload keystream of an uplink
+ *
+ * FRMPayload is encrypted by XORing it with AES blocks of the A_i blocks
+ * (LoRaWAN 1.0.4 Section 4.3.3.1), which only depend on the key, the
+ * direction, the DevAddr, and the frame counter. The blocks of the next
+ * uplink are encrypted ahead of time and kept until LoRaMac asks for them,
+ * so that encrypting the payload costs a lookup instead of up to
+ * AES_KEYSTREAM block encryptions. The cache holds pairs of a key and an
+ * input block, hence it can never return a wrong block. A new session key
+ * or frame counter merely makes it miss.
+ *
+ * Calling the function again with the same parameters does nothing.
+ *
+ * @param[in] key AppSKey
+ * @param[in] devaddr DevAddr of the session
+ * @param[in] fcnt Frame counter of the next uplink
+ */
+void crypto_precompute_keystream(const uint8_t key[16], uint32_t devaddr, uint32_t fcnt);
+
+//! @brief Drop the precomputed keystream
+
+void crypto_clear_keystream(void);
+
+#endif // CRYPTO_KEYSTREAM
+
+#endif // _CRYPTO_H
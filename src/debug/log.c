@@ -1,5 +1,6 @@
 #include "log.h"
 
+#include <stdint.h>
 #include <string.h>
 #include <stdio.h>
 #include <rtt/segger_rtt.h>
@@ -208,6 +209,86 @@ void _log_message(log_level_t level, char id, const char *format, ...)
 }
 
 
+#if LOG_BINARY == 1
+
+// Binary log records have the following layout (multi-byte fields are
+// little-endian):
+//
+//   u8  LOG_RECORD_MESSAGE
+//   u8  bit 7: continuation of a composite message; bits 4-6: log level;
+//       bits 0-3: number of arguments
+//   u16 offset of the format string in section .log_fmt
+//   u32 timestamp in RTC ticks
+//   u32 arguments...
+//
+// Each record written by _log_binary_dump is followed by one or more data
+// records consisting of LOG_RECORD_DATA, a u8 length, and up to 255 bytes.
+#define LOG_RECORD_MESSAGE 0xa5
+#define LOG_RECORD_DATA    0xa6
+
+static void _write_record(unsigned header, const char *format, va_list ap)
+{
+    uint8_t buf[8 + 4 * 15], *p = buf;
+    uint32_t v;
+    unsigned n = header & 0x0f;
+
+    if (!_log.initialized) return;
+    if (_log.level > (log_level_t)((header >> 4) & 0x07)) return;
+
+    if (_log.state == LOG_STATE_HAVE_HEADER) header |= 0x80;
+    else if (_log.state == LOG_STATE_COMPOSITE_MSG) _log.state = LOG_STATE_HAVE_HEADER;
+
+    *p++ = LOG_RECORD_MESSAGE;
+    *p++ = header;
+    v = (uintptr_t)format;
+    *p++ = v & 0xff;
+    *p++ = v >> 8;
+
+    v = rtc_get_timer_value();
+    for (int i = 0; i < 4; i++, v >>= 8) *p++ = v & 0xff;
+
+    while (n--) {
+        v = va_arg(ap, uint32_t);
+        for (int i = 0; i < 4; i++, v >>= 8) *p++ = v & 0xff;
+    }
+
+    _write((char *)buf, p - buf);
+}
+
+
+void _log_binary(unsigned header, const char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    _write_record(header, format, ap);
+    va_end(ap);
+}
+
+
+void _log_binary_dump(const void *buffer, size_t length, unsigned header, const char *format, ...)
+{
+    va_list ap;
+    uint8_t hdr[2];
+    size_t n;
+
+    if (!_log.initialized || _log.level > LOG_LEVEL_DUMP) return;
+
+    va_start(ap, format);
+    _write_record(header, format, ap);
+    va_end(ap);
+
+    for (; length; length -= n, buffer = (const uint8_t *)buffer + n) {
+        n = length < UINT8_MAX ? length : UINT8_MAX;
+        hdr[0] = LOG_RECORD_DATA;
+        hdr[1] = n;
+        _write((char *)hdr, sizeof(hdr));
+        _write(buffer, n);
+    }
+}
+
+#endif // LOG_BINARY
+
+
 void _log_finish(void)
 {
     switch(_log.state) {
@@ -218,7 +299,9 @@ void _log_finish(void)
             break;
 
         case LOG_STATE_HAVE_HEADER:
+#if LOG_BINARY != 1
             _write("\r\n", 2);
+#endif
             break;
 
         default:
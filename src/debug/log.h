@@ -54,6 +54,22 @@ typedef enum
 
 #if DEBUG_LOG != 0
 
+// Messages below the compile-time threshold of the file that logs them are
+// compiled out, see LOG_THRESHOLD in the Makefile. A file selects a per-module
+// threshold by defining LOG_MODULE_THRESHOLD before its first include.
+#ifndef LOG_THRESHOLD
+#define LOG_THRESHOLD LOG_LEVEL_DUMP
+#endif
+
+#ifndef LOG_MODULE_THRESHOLD
+#define LOG_MODULE_THRESHOLD LOG_THRESHOLD
+#endif
+
+//! @brief True if messages of @p level are compiled into the calling file
+#define log_enabled(level) ((level) >= LOG_MODULE_THRESHOLD)
+
+#define _LOG_IF(level, call) do { if (log_enabled(level)) call; } while (0)
+
 void _log_init(log_level_t level, log_timestamp_t timestamp);
 
 log_level_t _log_get_level(void);
@@ -79,16 +95,83 @@ void _log_finish(void);
 #define log_init(...)      _log_init(__VA_ARGS__)
 #define log_get_level(...) _log_get_level(__VA_ARGS__)
 #define log_set_level(...) _log_set_level(__VA_ARGS__)
-#define log_dump(...)      _log_dump(__VA_ARGS__)
-#define log_debug(...)     _log_message(LOG_LEVEL_DEBUG, 'D', __VA_ARGS__)
-#define log_info(...)      _log_message(LOG_LEVEL_INFO, 'I', __VA_ARGS__)
-#define log_warning(...)   _log_message(LOG_LEVEL_WARNING, 'W', __VA_ARGS__)
-#define log_error(...)     _log_message(LOG_LEVEL_ERROR, 'E', __VA_ARGS__)
 #define log_compose(...)   _log_compose(__VA_ARGS__)
 #define log_finish(...)    _log_finish(__VA_ARGS__)
 
+#if LOG_BINARY == 1
+
+// In the binary mode, messages are not formatted on the MCU. The format string
+// is placed in the non-loaded section .log_fmt (it takes no flash) and each
+// message is sent as a record carrying the offset of the format string in that
+// section, a timestamp, and the raw 32-bit arguments. Records are decoded on
+// the host with tools/log-decode.py. Arguments must be at most 32 bits wide;
+// arguments for %s are sent as pointers and can only be decoded if they point
+// into flash.
+
+//! @brief Write a binary log record
+//! @param[in] header Log level in bits 4-6, number of arguments in bits 0-3
+//! @param[in] format Format string in the .log_fmt section
+//! @param[in] ... Arguments, each at most 32 bits wide
+
+void _log_binary(unsigned header, const char *format, ...);
+
+//! @brief Write a binary log record followed by raw data records
+
+void _log_binary_dump(const void *buffer, size_t length, unsigned header, const char *format, ...);
+
+#define _LOG_CAT_(a, b) a ## b
+#define _LOG_CAT(a, b) _LOG_CAT_(a, b)
+#define _LOG_FIRST_(f, ...) f
+#define _LOG_FIRST(...) _LOG_FIRST_(__VA_ARGS__, 0)
+#define _LOG_NARGS_(f, _1, _2, _3, _4, _5, _6, _7, _8, _9, _10, n, ...) n
+#define _LOG_NARGS(...) _LOG_NARGS_(__VA_ARGS__, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0, x)
+
+// Expand to the arguments that follow the format string, each preceded by a
+// comma
+#define _LOG_ARGS(...) _LOG_CAT(_LOG_ARGS_, _LOG_NARGS(__VA_ARGS__))(__VA_ARGS__)
+#define _LOG_ARGS_0(f)
+#define _LOG_ARGS_1(f, a)               , (a)
+#define _LOG_ARGS_2(f, a, b)            , (a), (b)
+#define _LOG_ARGS_3(f, a, b, c)         , (a), (b), (c)
+#define _LOG_ARGS_4(f, a, b, c, d)      , (a), (b), (c), (d)
+#define _LOG_ARGS_5(f, a, b, c, d, e)   , (a), (b), (c), (d), (e)
+#define _LOG_ARGS_6(f, a, b, c, d, e, g)                , (a), (b), (c), (d), (e), (g)
+#define _LOG_ARGS_7(f, a, b, c, d, e, g, h)             , (a), (b), (c), (d), (e), (g), (h)
+#define _LOG_ARGS_8(f, a, b, c, d, e, g, h, i)          , (a), (b), (c), (d), (e), (g), (h), (i)
+#define _LOG_ARGS_9(f, a, b, c, d, e, g, h, i, j)       , (a), (b), (c), (d), (e), (g), (h), (i), (j)
+#define _LOG_ARGS_10(f, a, b, c, d, e, g, h, i, j, k)   , (a), (b), (c), (d), (e), (g), (h), (i), (j), (k)
+
+#define _log_binary_message(level, ...) do {                                           \
+    static const char _log_fmt[] __attribute__((section(".log_fmt"))) = _LOG_FIRST(__VA_ARGS__); \
+    if (log_enabled(level))                                                            \
+        _log_binary((level) << 4 | _LOG_NARGS(__VA_ARGS__), _log_fmt _LOG_ARGS(__VA_ARGS__)); \
+} while (0)
+
+#define log_dump(buffer, length, ...) do {                                             \
+    static const char _log_fmt[] __attribute__((section(".log_fmt"))) = _LOG_FIRST(__VA_ARGS__); \
+    if (log_enabled(LOG_LEVEL_DUMP))                                                   \
+        _log_binary_dump((buffer), (length), LOG_LEVEL_DUMP << 4 | _LOG_NARGS(__VA_ARGS__), \
+            _log_fmt _LOG_ARGS(__VA_ARGS__));                                          \
+} while (0)
+
+#define log_debug(...)     _log_binary_message(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define log_info(...)      _log_binary_message(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_warning(...)   _log_binary_message(LOG_LEVEL_WARNING, __VA_ARGS__)
+#define log_error(...)     _log_binary_message(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+#else
+
+#define log_dump(...)      _LOG_IF(LOG_LEVEL_DUMP, _log_dump(__VA_ARGS__))
+#define log_debug(...)     _LOG_IF(LOG_LEVEL_DEBUG, _log_message(LOG_LEVEL_DEBUG, 'D', __VA_ARGS__))
+#define log_info(...)      _LOG_IF(LOG_LEVEL_INFO, _log_message(LOG_LEVEL_INFO, 'I', __VA_ARGS__))
+#define log_warning(...)   _LOG_IF(LOG_LEVEL_WARNING, _log_message(LOG_LEVEL_WARNING, 'W', __VA_ARGS__))
+#define log_error(...)     _LOG_IF(LOG_LEVEL_ERROR, _log_message(LOG_LEVEL_ERROR, 'E', __VA_ARGS__))
+
+#endif
+
 #else
 
+#define log_enabled(level) 0
 #define log_init(...)      {}
 #define log_get_level(...) {}
 #define log_set_level(...) {}
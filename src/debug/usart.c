@@ -1,10 +1,12 @@
 #include "usart.h"
+#include <stm/STM32L0xx_HAL_Driver/Inc/stm32l0xx_ll_dma.h>
 #include <stm/STM32L0xx_HAL_Driver/Inc/stm32l0xx_ll_usart.h>
 #include <stm/STM32L0xx_HAL_Driver/Inc/stm32l0xx_hal.h>
 #include "cbuf.h"
 #include "irq.h"
 #include "system.h"
 #include "halt.h"
+#include "trace.h"
 
 #if DEBUG_LOG != 3
 
@@ -14,25 +16,85 @@
 #  define CLK_ENABLE __USART1_CLK_ENABLE
 #  define PIN        GPIO_PIN_9
 #  define ALTERNATE  GPIO_AF4_USART1
+#  define DMA_REQ    LL_DMA_REQUEST_3
 #elif DEBUG_LOG == 2
 #  define PORT       USART2
 #  define IRQn       USART2_IRQn
 #  define CLK_ENABLE __USART2_CLK_ENABLE
 #  define PIN        GPIO_PIN_2
 #  define ALTERNATE  GPIO_AF4_USART2
+#  define DMA_REQ    LL_DMA_REQUEST_4
 #else
 #  error Unsupported DEBUG_LOG value
 #endif
 
+// Both USART1_TX and USART2_TX can be served by DMA channel 4, which is not
+// used by anything else. Each contiguous part of the TX FIFO is sent with a
+// single DMA transfer. The end of the transfer is detected with the USART
+// transmission complete interrupt rather than with the DMA interrupt, which
+// the channel shares with LPUART1. That keeps the interrupt load at one per
+// transfer instead of one per byte, close to what release builds see.
+#define DMA_TX LL_DMA_CHANNEL_4
+
 
 #ifndef USART_TX_BUFFER_SIZE
 #define USART_TX_BUFFER_SIZE 1024
 #endif
 
+#if (USART_TX_BUFFER_SIZE & (USART_TX_BUFFER_SIZE - 1)) != 0
+#error USART_TX_BUFFER_SIZE must be a power of two
+#endif
+
 
 static char tx_buffer[USART_TX_BUFFER_SIZE];
 static cbuf_t tx_fifo;
 
+// The number of bytes currently being transmitted by DMA
+static volatile size_t tx_bytes_transmitting;
+
+
+static void init_dma(void)
+{
+    __HAL_RCC_DMA1_CLK_ENABLE();
+
+    LL_DMA_DisableChannel(DMA1, DMA_TX);
+    LL_DMA_ConfigTransfer(DMA1, DMA_TX, LL_DMA_DIRECTION_MEMORY_TO_PERIPH | LL_DMA_MODE_NORMAL |
+        LL_DMA_PRIORITY_LOW | LL_DMA_PERIPH_NOINCREMENT | LL_DMA_MEMORY_INCREMENT |
+        LL_DMA_PDATAALIGN_BYTE | LL_DMA_MDATAALIGN_BYTE);
+    LL_DMA_SetPeriphRequest(DMA1, DMA_TX, DMA_REQ);
+    LL_DMA_SetPeriphAddress(DMA1, DMA_TX, (uint32_t)&PORT->TDR);
+    LL_DMA_ClearFlag_GI4(DMA1);
+}
+
+
+// Start a DMA transfer of the next contiguous part of the TX FIFO. Must be
+// invoked with interrupts disabled or from the IRQ handler.
+static void start_dma_transmission(void)
+{
+    cbuf_view_t v;
+
+    if (tx_bytes_transmitting) return;
+
+    cbuf_head(&tx_fifo, &v);
+    int i = v.len[0] != 0 ? 0 : 1;
+    if (!v.len[i]) {
+        system_unlock(&system_stop_lock, SYSTEM_MODULE_USART);
+        return;
+    }
+
+    // The baud rate generator is clocked from PCLK, which must run from PLL
+    // for the configured baud rate to be correct
+    system_enable_pll();
+    system_lock(&system_stop_lock, SYSTEM_MODULE_USART);
+
+    tx_bytes_transmitting = v.len[i];
+    LL_DMA_DisableChannel(DMA1, DMA_TX);
+    LL_DMA_SetMemoryAddress(DMA1, DMA_TX, (uint32_t)v.ptr[i]);
+    LL_DMA_SetDataLength(DMA1, DMA_TX, tx_bytes_transmitting);
+    LL_USART_ClearFlag_TC(PORT);
+    LL_DMA_EnableChannel(DMA1, DMA_TX);
+}
+
 
 void usart_init(void)
 {
@@ -53,13 +115,17 @@ void usart_init(void)
 
     if (LL_USART_Init(PORT, &params) != 0) goto error;
 
+    init_dma();
+
+    LL_USART_EnableDMAReq_TX(PORT);
     LL_USART_Enable(PORT);
 
     LL_USART_DisableIT_TXE(PORT);
+    LL_USART_ClearFlag_TC(PORT);
     LL_USART_EnableIT_TC(PORT);
 
     // Configure interrupts
-    HAL_NVIC_SetPriority(IRQn, 0, 0);
+    HAL_NVIC_SetPriority(IRQn, IRQ_PRIORITY_LOG, 0);
     HAL_NVIC_EnableIRQ(IRQn);
 
     // Configure GPIO
@@ -87,24 +153,14 @@ error:
 size_t usart_write(const char *buffer, size_t length)
 {
     cbuf_view_t v;
-    uint32_t masked = disable_irq();
     cbuf_tail(&tx_fifo, &v);
-    reenable_irq(masked);
-
     size_t stored = cbuf_copy_in(&v, buffer, length);
-
-    system_wait_hsi();
-
-    masked = disable_irq();
     cbuf_produce(&tx_fifo, stored);
 
-    // Enable the transmission buffer empty interrupt, which will pick up the
-    // data written by the FIFO using the above code and starts transmitting it.
-    if (!LL_USART_IsEnabledIT_TXE(PORT)) {
-        system_stop_lock |= SYSTEM_MODULE_USART;
-        LL_USART_EnableIT_TXE(PORT);
-    }
+    system_wait_hsi();
 
+    uint32_t masked = disable_irq();
+    start_dma_transmission();
     reenable_irq(masked);
     return stored;
 }
@@ -118,20 +174,26 @@ void USART2_IRQHandler(void)
 #error Unsupport DEBUG_LOG
 #endif
 {
-    uint8_t c;
-
-    if (LL_USART_IsEnabledIT_TXE(PORT) && LL_USART_IsActiveFlag_TXE(PORT)) {
-        if (cbuf_get(&tx_fifo, &c, 1) != 0) {
-            LL_USART_TransmitData8(PORT, c);
-        } else {
-            LL_USART_DisableIT_TXE(PORT);
-        }
-    }
-
+    uint32_t start = trace_irq_enter();
+
+    // The last byte of a DMA transfer has left the shift register. The flag
+    // may also be set before the first transfer, hence the check of the DMA
+    // data counter.
+    //
+    // Log messages written from the RTC and EXTI interrupts, which preempt this
+    // one, start transmissions too.
     if (LL_USART_IsActiveFlag_TC(PORT)) {
         LL_USART_ClearFlag_TC(PORT);
-        system_stop_lock &= ~SYSTEM_MODULE_USART;
+        uint32_t masked = disable_irq();
+        if (tx_bytes_transmitting && LL_DMA_GetDataLength(DMA1, DMA_TX) == 0) {
+            cbuf_consume(&tx_fifo, tx_bytes_transmitting);
+            tx_bytes_transmitting = 0;
+            start_dma_transmission();
+        }
+        reenable_irq(masked);
     }
+
+    trace_irq_exit(TRACE_IRQ_LOG, start);
 }
 
 #endif
\ No newline at end of file
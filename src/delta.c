@@ -0,0 +1,206 @@
+#include "delta.h"
+#include <string.h>
+#include <LoRaWAN/Utilities/timeServer.h>
+#include "lrw.h"
+#include "log.h"
+
+
+#define KEYFRAME 0x80
+#define SEQ_MASK 0x7f
+
+// The header and a five-byte varint for each field
+#define MAX_ENCODED (2 + 5 * DELTA_MAX_FIELDS)
+
+static delta_config_t config = {
+    .port = 0,
+    .confirmed = false,
+    .interval = 16,
+    .fields = 0
+};
+
+// The frame the decoder is known to have
+static struct {
+    bool valid;
+    uint8_t seq;
+    uint32_t number;     // The value of stats.frames when the frame was sent
+    uint8_t frame[DELTA_MAX_FRAME];
+} ref;
+
+// The frame handed to lrw_send, until its uplink completes
+static struct {
+    bool pending;
+    bool keyframe;
+    uint8_t seq;
+    uint32_t number;
+    uint8_t frame[DELTA_MAX_FRAME];
+} sent;
+
+static uint8_t seq;
+static uint8_t since_keyframe;
+static delta_stats_t stats;
+
+
+static size_t frame_size(const delta_config_t *c)
+{
+    size_t n = 0;
+    for (unsigned int i = 0; i < c->fields; i++) n += c->width[i];
+    return n;
+}
+
+
+void delta_get_config(delta_config_t *dst)
+{
+    *dst = config;
+}
+
+
+int delta_set_config(const delta_config_t *src)
+{
+    if (src->port > 223) return LORAMAC_STATUS_PARAMETER_INVALID;
+    if (src->interval == 0 || src->interval > DELTA_MAX_INTERVAL)
+        return LORAMAC_STATUS_PARAMETER_INVALID;
+    if (src->port && src->fields == 0) return LORAMAC_STATUS_PARAMETER_INVALID;
+    if (src->fields > DELTA_MAX_FIELDS) return LORAMAC_STATUS_PARAMETER_INVALID;
+
+    for (unsigned int i = 0; i < src->fields; i++)
+        if (src->width[i] != 1 && src->width[i] != 2 && src->width[i] != 4)
+            return LORAMAC_STATUS_PARAMETER_INVALID;
+    if (frame_size(src) > DELTA_MAX_FRAME) return LORAMAC_STATUS_LENGTH_ERROR;
+
+    config = *src;
+    ref.valid = false;
+    sent.pending = false;
+    seq = 0;
+    since_keyframe = 0;
+    memset(&stats, 0, sizeof(stats));
+    return LORAMAC_STATUS_OK;
+}
+
+
+size_t delta_frame_size(void)
+{
+    return config.port ? frame_size(&config) : 0;
+}
+
+
+static uint32_t get_field(const uint8_t *p, unsigned int width)
+{
+    uint32_t v = 0;
+    while (width--) v = (v << 8) | p[width];
+    return v;
+}
+
+
+static size_t put_varint(uint8_t *dst, uint32_t v)
+{
+    size_t n = 0;
+
+    while (v >= 0x80) {
+        dst[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    dst[n++] = v;
+    return n;
+}
+
+
+// Encode the frame as the difference to the reference. Return the size of the
+// encoding, or 0 if a keyframe would not be larger.
+static size_t encode_delta(uint8_t *dst, const uint8_t *frame, size_t length)
+{
+    unsigned int i, width, shift;
+    const uint8_t *a = frame, *b = ref.frame;
+    uint32_t d;
+    int32_t s;
+    size_t n = 2;
+
+    dst[0] = seq;
+    dst[1] = ref.seq;
+
+    for (i = 0; i < config.fields; i++) {
+        width = config.width[i];
+
+        // Sign-extend the difference modulo the width of the field, so that a
+        // counter that wraps around still yields a small difference
+        shift = 32 - 8 * width;
+        d = get_field(a, width) - get_field(b, width);
+        s = (int32_t)(d << shift) >> shift;
+
+        n += put_varint(dst + n, ((uint32_t)s << 1) ^ (uint32_t)(s >> 31));
+        a += width;
+        b += width;
+    }
+
+    return n < 1 + length ? n : 0;
+}
+
+
+int delta_send(const void *frame, size_t length)
+{
+    uint8_t buf[MAX_ENCODED > 1 + DELTA_MAX_FRAME ? MAX_ENCODED : 1 + DELTA_MAX_FRAME];
+    bool keyframe;
+    size_t n = 0;
+    int rc;
+
+    if (config.port == 0) return LORAMAC_STATUS_PARAMETER_INVALID;
+    if (length != frame_size(&config)) return LORAMAC_STATUS_LENGTH_ERROR;
+    if (sent.pending) return LORAMAC_STATUS_BUSY;
+
+    // The sequence number of a reference more than 127 frames old would be
+    // ambiguous
+    keyframe = !ref.valid || since_keyframe + 1 >= config.interval
+        || stats.frames - ref.number > SEQ_MASK;
+
+    if (!keyframe) {
+        n = encode_delta(buf, frame, length);
+        if (n == 0) keyframe = true;
+    }
+
+    if (keyframe) {
+        buf[0] = KEYFRAME | seq;
+        memcpy(buf + 1, frame, length);
+        n = 1 + length;
+    }
+
+    rc = lrw_send(config.port, buf, n, config.confirmed, NULL);
+    if (rc != LORAMAC_STATUS_OK) return rc;
+
+    sent.pending = true;
+    sent.keyframe = keyframe;
+    sent.seq = seq;
+    sent.number = stats.frames;
+    memcpy(sent.frame, frame, length);
+
+    seq = (seq + 1) & SEQ_MASK;
+    since_keyframe = keyframe ? 0 : since_keyframe + 1;
+
+    stats.frames++;
+    if (keyframe) stats.keyframes++;
+    stats.raw += length;
+    stats.encoded += n;
+
+    log_debug("delta: Sent %s %d (%d of %d bytes)", keyframe ? "keyframe" : "frame",
+        sent.seq, (int)n, (int)length);
+    return LORAMAC_STATUS_OK;
+}
+
+
+void delta_get_stats(delta_stats_t *dst)
+{
+    *dst = stats;
+}
+
+
+void delta_uplink_done(bool delivered)
+{
+    if (!sent.pending) return;
+    sent.pending = false;
+
+    // Without acknowledgements, only keyframes serve as references
+    if (!delivered || (!config.confirmed && !sent.keyframe)) return;
+
+    ref.valid = true;
+    ref.seq = sent.seq;
+    ref.number = sent.number;
+    memcpy(ref.frame, sent.frame, frame_size(&config));
+}
@@ -0,0 +1,94 @@
+#ifndef _DELTA_H
+#define _DELTA_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+//! @brief The largest number of fields in a frame
+#define DELTA_MAX_FIELDS 16
+
+//! @brief The largest frame in bytes
+#define DELTA_MAX_FRAME 64
+
+//! @brief The largest keyframe interval, in frames. Sequence numbers have
+//! seven bits, so a delta frame never refers to an ambiguous reference.
+#define DELTA_MAX_INTERVAL 64
+
+//! @brief Delta codec parameters
+typedef struct
+{
+    uint8_t port;        // LoRaWAN port of encoded uplinks, 0 if disabled
+    bool confirmed;      // Send encoded uplinks as confirmed
+    uint8_t interval;    // Send every interval-th frame as a keyframe
+    uint8_t fields;      // Number of fields
+    uint8_t width[DELTA_MAX_FIELDS];  // Size of each field in bytes: 1, 2, or 4
+} delta_config_t;
+
+//! @brief Codec statistics since the codec was configured
+typedef struct
+{
+    uint32_t frames;     // Frames sent
+    uint32_t keyframes;  // Frames sent as keyframes
+    uint32_t raw;        // Bytes submitted by the host
+    uint32_t encoded;    // Bytes sent, including headers
+} delta_stats_t;
+
+/*! @brief Delta codec for periodic sensor frames
+ *
+ * Hosts that send frames with a fixed layout of integer fields, e.g., sensor
+ * readings, can register the layout with AT$DELTA and submit frames with
+ * AT$DELTATX instead of AT+UTX. The modem sends each frame as the difference
+ * to a reference frame the network server is known to have, which typically
+ * takes a fraction of the bytes of the frame:
+ *
+ *   keyframe:    0x80 | seq, the frame as submitted
+ *   delta frame: seq, reference seq, a varint for each field
+ *
+ * The sequence number has seven bits and counts the frames sent. Each field is
+ * a little-endian integer of 1, 2, or 4 bytes. Its difference to the field of
+ * the reference, taken modulo the field's width and interpreted as signed, is
+ * zigzag-encoded (0, -1, 1, -2, ... become 0, 1, 2, 3, ...) and written as a
+ * base-128 varint, least significant group first, with bit 7 set in all
+ * bytes but the last.
+ *
+ * With confirmed uplinks, the reference is the last frame acknowledged by the
+ * network. With unconfirmed uplinks, the modem gets no delivery feedback and
+ * uses the last keyframe as the reference, so a lost delta frame does not
+ * affect the frames that follow. Every interval-th frame is sent as a
+ * keyframe, and so is a frame whose encoding would not be smaller. A decoder
+ * keeps the recent frames it has decoded by sequence number; see
+ * DeltaDecoder in python/lora.py.
+ */
+
+//! @brief Get the codec parameters
+//! @param[out] config Destination
+
+void delta_get_config(delta_config_t *config);
+
+//! @brief Set the codec parameters. The next frame is sent as a keyframe.
+//! @return Zero on success, a @c LoRaMacStatus_t value on error
+
+int delta_set_config(const delta_config_t *config);
+
+//! @brief Return the size of a frame in bytes, 0 if the codec is disabled
+
+size_t delta_frame_size(void);
+
+//! @brief Encode a frame and send it with lrw_send
+//! @return Zero on success, a @c LoRaMacStatus_t value on error
+
+int delta_send(const void *frame, size_t length);
+
+//! @brief Get the codec statistics
+//! @param[out] stats Destination
+
+void delta_get_stats(delta_stats_t *stats);
+
+//! @brief Record the outcome of the last uplink. Invoked from mcps_confirm.
+//! @param[in] delivered The uplink was acknowledged (confirmed uplinks) or
+//! transmitted (unconfirmed uplinks)
+
+void delta_uplink_done(bool delivered);
+
+#endif // _DELTA_H
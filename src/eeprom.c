@@ -1,17 +1,36 @@
 #include "eeprom.h"
 #include <string.h>
 #include <LoRaWAN/Utilities/timeServer.h>
+#include <stm/STM32L0xx_HAL_Driver/Inc/stm32l0xx_hal.h>
 #include <stm/STM32L0xx_HAL_Driver/Inc/stm32l0xx_hal_flash.h>
 #include "irq.h"
+#include "system.h"
 
 #define _EEPROM_BASE DATA_EEPROM_BASE
 #define _EEPROM_END  DATA_EEPROM_BANK2_END
 #define _EEPROM_IS_BUSY() ((FLASH->SR & FLASH_SR_BSY) != 0UL)
+#define _EEPROM_ERRORS (FLASH_SR_WRPERR | FLASH_SR_PGAERR | FLASH_SR_SIZERR | FLASH_SR_NOTZEROERR | FLASH_SR_FWWERR)
+
+volatile uint32_t eeprom_writes;
+
+// The state of the background write started with eeprom_write_async
+static struct
+{
+    const uint8_t *buffer;
+    uint32_t start;
+    uint32_t address;    // The next EEPROM address to be examined
+    uint32_t end;
+    volatile int status;
+} _async;
 
 static bool _eeprom_is_busy(TimerTime_t timeout);
 static void _eeprom_unlock(void);
 static void _eeprom_lock(void);
-static bool _eeprom_write(uint32_t address, size_t *i, uint8_t *buffer, size_t length);
+static void _eeprom_write(uint32_t address, const uint8_t *buffer, size_t length);
+static uint32_t _eeprom_merge(uint32_t word, uint32_t address, const uint8_t *buffer, size_t length);
+static bool _eeprom_program_next(void);
+static void _eeprom_finish_async(int status);
+static void _eeprom_wait_async(void);
 
 bool eeprom_write(uint32_t address, const void *buffer, size_t length)
 {
@@ -25,6 +44,15 @@ bool eeprom_write(uint32_t address, const void *buffer, size_t length)
         return false;
     }
 
+    // Let any background write finish first
+    _eeprom_wait_async();
+
+    // If the EEPROM already contains the data, there is nothing to program
+    if (memcmp(buffer, (void *) address, length) == 0)
+    {
+        return true;
+    }
+
     if (_eeprom_is_busy(50))
     {
         return false;
@@ -32,12 +60,7 @@ bool eeprom_write(uint32_t address, const void *buffer, size_t length)
 
     _eeprom_unlock();
 
-    size_t i = 0;
-
-    while (i < length)
-    {
-        _eeprom_write(address, &i, (uint8_t *) buffer, length);
-    }
+    _eeprom_write(address, (const uint8_t *) buffer, length);
 
     _eeprom_lock();
 
@@ -52,6 +75,148 @@ bool eeprom_write(uint32_t address, const void *buffer, size_t length)
     return true;
 }
 
+bool eeprom_erase(uint32_t address, size_t length)
+{
+    // Add EEPROM base offset to address
+    address += _EEPROM_BASE;
+
+    // If user attempts to erase outside EEPROM area...
+    if ((address + length) > (_EEPROM_END + 1))
+    {
+        // Indicate failure
+        return false;
+    }
+
+    _eeprom_wait_async();
+
+    if (_eeprom_is_busy(50))
+    {
+        return false;
+    }
+
+    uint32_t end = address + length;
+    uint32_t first = (address + 3) & ~3UL;
+    uint32_t last = end & ~3UL;
+    // A range without a whole aligned word is shorter than 8 bytes
+    static const uint8_t zero[8];
+
+    _eeprom_unlock();
+
+    if (first >= last)
+    {
+        // The range does not cover a single aligned word
+        _eeprom_write(address, zero, length);
+    }
+    else
+    {
+        // Clear the bytes of the partially covered words at either end with
+        // regular programming
+        _eeprom_write(address, zero, first - address);
+        _eeprom_write(last, zero, end - last);
+
+        // Erase the aligned words in between. A word erase takes a single
+        // programming cycle, whereas programming a non-zero value into a word
+        // that is not erased first erases the word and then programs it. Words
+        // that are already erased are skipped.
+        FLASH->PECR |= FLASH_PECR_ERASE | FLASH_PECR_DATA;
+
+        for (uint32_t word = first; word < last; word += 4)
+        {
+            if (*((uint32_t *) word) == 0)
+            {
+                continue;
+            }
+
+            *((__IO uint32_t *) word) = 0;
+            eeprom_writes++;
+
+            while (_EEPROM_IS_BUSY())
+            {
+                continue;
+            }
+        }
+
+        FLASH->PECR &= ~(FLASH_PECR_ERASE | FLASH_PECR_DATA);
+    }
+
+    _eeprom_lock();
+
+    // Verify that the entire range reads as zero
+    for (uint32_t a = address; a < end; a++)
+    {
+        if (*((uint8_t *) a) != 0)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool eeprom_write_async(uint32_t address, const void *buffer, size_t length)
+{
+    // Add EEPROM base offset to address
+    address += _EEPROM_BASE;
+
+    // If user attempts to write outside EEPROM area...
+    if ((address + length) > (_EEPROM_END + 1))
+    {
+        // Indicate failure
+        return false;
+    }
+
+    _eeprom_wait_async();
+
+    // If the EEPROM already contains the data, there is nothing to program
+    if (memcmp(buffer, (void *) address, length) == 0)
+    {
+        return true;
+    }
+
+    if (_eeprom_is_busy(50))
+    {
+        return false;
+    }
+
+    _async.buffer = (const uint8_t *) buffer;
+    _async.start = address;
+    _async.address = address & ~3UL;
+    _async.end = address + length;
+    _async.status = 1;
+
+    uint32_t masked = disable_irq();
+    system_lock(&system_stop_lock, SYSTEM_MODULE_NVM);
+    reenable_irq(masked);
+
+    _eeprom_unlock();
+
+    HAL_NVIC_SetPriority(FLASH_IRQn, IRQ_PRIORITY_FLASH, 0);
+    HAL_NVIC_EnableIRQ(FLASH_IRQn);
+
+    masked = disable_irq();
+    FLASH->SR = FLASH_SR_EOP | _EEPROM_ERRORS;
+    FLASH->PECR |= FLASH_PECR_EOPIE | FLASH_PECR_ERRIE;
+    if (!_eeprom_program_next())
+    {
+        _eeprom_finish_async(0);
+    }
+    reenable_irq(masked);
+
+    return true;
+}
+
+int eeprom_async_status(void)
+{
+    int status = _async.status;
+
+    if (status < 0)
+    {
+        _async.status = 0;
+    }
+
+    return status;
+}
+
 const void *eeprom_mmap(uint32_t address, size_t length)
 {
     // Add EEPROM base offset to address
@@ -129,75 +294,117 @@ static void _eeprom_lock(void)
     reenable_irq(masked);
 }
 
-static bool _eeprom_write(uint32_t address, size_t *i, uint8_t *buffer, size_t length)
+// Program the data in buffer into the EEPROM at address. The data is merged
+// into the aligned 32-bit words it overlaps and only the words whose value
+// changes are programmed. Programming a word takes as long as programming a
+// single byte, so this minimizes both the time and the wear of the EEPROM.
+static void _eeprom_write(uint32_t address, const uint8_t *buffer, size_t length)
 {
-    uint32_t addr = address + *i;
+    uint32_t end = address + length;
+    uint32_t value;
+
+    for (uint32_t word = address & ~3UL; word < end; word += 4)
+    {
+        value = _eeprom_merge(word, address, buffer, length);
 
-    uint8_t mod = addr % 4;
+        if (*((uint32_t *) word) == value)
+        {
+            continue;
+        }
 
-    bool write = false;
+        *((uint32_t *) word) = value;
+        eeprom_writes++;
 
-    if (mod == 0)
-    {
-        if (*i + 4 > length)
+        while (_EEPROM_IS_BUSY())
         {
-            mod = (addr % 2) + 2;
+            continue;
         }
     }
+}
+
+// Return the value of the aligned EEPROM word at the given address with the
+// bytes that overlap with the data in buffer replaced
+static uint32_t _eeprom_merge(uint32_t word, uint32_t address, const uint8_t *buffer, size_t length)
+{
+    uint32_t value = *((uint32_t *) word);
+    uint8_t *bytes = (uint8_t *) &value;
 
-    if (mod == 2)
+    for (uint32_t b = 0; b < 4; b++)
     {
-        if (*i + 2 > length)
+        if (word + b >= address && word + b < address + length)
         {
-            mod = 1;
+            bytes[b] = buffer[word + b - address];
         }
     }
 
-    if (mod == 0)
-    {
-        uint32_t value = ((uint32_t) buffer[*i + 3]) << 24 | ((uint32_t) buffer[*i + 2]) << 16 | ((uint32_t) buffer[*i + 1]) << 8 | buffer[*i];
-
-        if (*((uint32_t *) addr) != value)
-        {
-            *((uint32_t *) addr) = value;
+    return value;
+}
 
-            write = true;
-        }
+// Start programming the next changed word of the background write. Returns
+// false if there are no more words to be programmed. Must be called with
+// interrupts disabled or from the FLASH interrupt handler.
+static bool _eeprom_program_next(void)
+{
+    uint32_t value;
+    size_t length = _async.end - _async.start;
 
-        *i += 4;
-    }
-    else if (mod == 2)
+    while (_async.address < _async.end)
     {
-        uint16_t value = ((uint16_t) buffer[*i + 1]) << 8 | (uint16_t) buffer[*i];
+        uint32_t word = _async.address;
+        _async.address += 4;
 
-        if (*((uint16_t *) addr) != value)
-        {
-            *((uint16_t *) addr) = value;
+        value = _eeprom_merge(word, _async.start, _async.buffer, length);
 
-            write = true;
+        if (*((uint32_t *) word) != value)
+        {
+            *((uint32_t *) word) = value;
+            eeprom_writes++;
+            return true;
         }
-
-        *i += 2;
     }
-    else
-    {
-        uint8_t value = buffer[*i];
 
-        if (*((uint8_t *) addr) != value)
-        {
-            *((uint8_t *) addr) = value;
+    return false;
+}
 
-            write = true;
-        }
+static void _eeprom_finish_async(int status)
+{
+    FLASH->PECR &= ~(FLASH_PECR_EOPIE | FLASH_PECR_ERRIE);
+    _eeprom_lock();
 
-        *i += 1;
-    }
+    _async.status = status;
 
-    while (_EEPROM_IS_BUSY())
+    // Allow Stop mode again and let the main loop run once more so that the
+    // owner of the write can find out that it has finished.
+    system_unlock(&system_stop_lock, SYSTEM_MODULE_NVM);
+    system_post(SYSTEM_TASK_NVM);
+}
+
+static void _eeprom_wait_async(void)
+{
+    while (_async.status > 0)
     {
         continue;
     }
-
-    return write;
 }
 
+void FLASH_IRQHandler(void)
+{
+    uint32_t sr = FLASH->SR;
+
+    if (sr & _EEPROM_ERRORS)
+    {
+        FLASH->SR = sr & _EEPROM_ERRORS;
+        _eeprom_finish_async(-1);
+        return;
+    }
+
+    if (sr & FLASH_SR_EOP)
+    {
+        FLASH->SR = FLASH_SR_EOP;
+
+        if (!_eeprom_program_next())
+        {
+            _eeprom_finish_async(0);
+        }
+    }
+}
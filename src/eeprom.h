@@ -5,6 +5,10 @@
 #include <stdint.h>
 #include <stddef.h>
 
+//! @brief The number of EEPROM words programmed or erased since boot or since
+//! cleared by AT$STATS
+extern volatile uint32_t eeprom_writes;
+
 //! @brief Write buffer to EEPROM area and verify it
 //! @param[in] address EEPROM start address (starts at 0)
 //! @param[in] buffer Pointer to source buffer
@@ -14,6 +18,42 @@
 
 bool eeprom_write(uint32_t address, const void *buffer, size_t length);
 
+//! @brief Erase EEPROM area and verify it
+//!
+//! Erased EEPROM bytes read as zero. Aligned words are cleared with word
+//! erase operations, which take half the time of programming a word that is
+//! not erased yet, and words that are already erased are skipped.
+//! @param[in] address EEPROM start address (starts at 0)
+//! @param[in] length Number of bytes to be erased
+//! @return true On success
+//! @return false On failure
+
+bool eeprom_erase(uint32_t address, size_t length);
+
+//! @brief Start writing buffer to EEPROM area in the background
+//!
+//! The changed words are programmed one by one from the FLASH interrupt handler
+//! and the MCU can sleep (but not stop) in between. The contents of the buffer
+//! must not be modified until the write completes. Only one background write
+//! can be in progress at a time. Use eeprom_async_status to find out when the
+//! write has completed.
+//! @param[in] address EEPROM start address (starts at 0)
+//! @param[in] buffer Pointer to source buffer
+//! @param[in] length Number of bytes to be written
+//! @return true If the write has been started (or there was nothing to write)
+//! @return false On failure
+
+bool eeprom_write_async(uint32_t address, const void *buffer, size_t length);
+
+//! @brief Return the status of the most recent background write
+//!
+//! An error status is only reported once, subsequent calls return 0.
+//! @return 1 While the write is in progress
+//! @return 0 If there is no write in progress
+//! @return -1 If the most recent write failed
+
+int eeprom_async_status(void);
+
 //! @brief Read buffer from EEPROM area
 //! @param[in] address EEPROM start address (starts at 0)
 //! @param[out] buffer Pointer to destination buffer
@@ -0,0 +1,282 @@
+#include "energy.h"
+#include <string.h>
+#include "gpio.h"
+#include "irq.h"
+#include "rtc.h"
+
+#if ENERGY_PROFILE == 1 || ENERGY_METER == 1
+static unsigned active;
+#endif
+
+#if ENERGY_METER == 1
+
+// The energy meter estimates the consumed charge without external equipment.
+// It integrates the time spent in each MCU power mode and the on-time of the
+// radio (TX per power level, RX), the TCXO, EEPROM programming, and LPUART1
+// transmission, and multiplies each with a per-board current from the table
+// below. The defaults are typical datasheet values for the Type ABZ module;
+// override them from a measurement of the particular board with AT$CHARGECAL.
+// The currents are in nA.
+
+#ifndef ENERGY_CURRENT_RUN
+#define ENERGY_CURRENT_RUN      4400000
+#endif
+#ifndef ENERGY_CURRENT_SLEEP
+#define ENERGY_CURRENT_SLEEP    1100000
+#endif
+#ifndef ENERGY_CURRENT_LP_SLEEP
+#define ENERGY_CURRENT_LP_SLEEP 10000
+#endif
+#ifndef ENERGY_CURRENT_STOP
+#define ENERGY_CURRENT_STOP     1400
+#endif
+#ifndef ENERGY_CURRENT_RX
+#define ENERGY_CURRENT_RX       10800000
+#endif
+#ifndef ENERGY_CURRENT_EEPROM
+#define ENERGY_CURRENT_EEPROM   2000000
+#endif
+#ifndef ENERGY_CURRENT_TCXO
+#define ENERGY_CURRENT_TCXO     1500000
+#endif
+#ifndef ENERGY_CURRENT_UART_TX
+#define ENERGY_CURRENT_UART_TX  50000
+#endif
+
+static uint32_t current[ENERGY_I_COUNT] = {
+    [ENERGY_I_RUN]      = ENERGY_CURRENT_RUN,
+    [ENERGY_I_SLEEP]    = ENERGY_CURRENT_SLEEP,
+    [ENERGY_I_LP_SLEEP] = ENERGY_CURRENT_LP_SLEEP,
+    [ENERGY_I_STOP]     = ENERGY_CURRENT_STOP,
+    [ENERGY_I_RX]       = ENERGY_CURRENT_RX,
+    [ENERGY_I_EEPROM]   = ENERGY_CURRENT_EEPROM,
+    [ENERGY_I_TCXO]     = ENERGY_CURRENT_TCXO,
+    [ENERGY_I_UART_TX]  = ENERGY_CURRENT_UART_TX
+};
+
+// The RFO output up to 14 dBm, PA_BOOST above, see SX1276SetRfTxPower
+static uint32_t tx_current[ENERGY_TX_LEVELS] = {
+     20000000,  21300000,  22600000,  23900000,  25200000,  26500000,  27800000,
+     29100000,  30400000,  31700000,  33000000,  34300000,  35600000,  36900000,
+     38200000,  39500000,  40800000,  42100000,  43400000,  75000000,  81000000,
+     87000000, 100000000, 110000000, 120000000
+};
+
+// The category of each profiler phase, -1 for the phases covered by
+// energy_mcu and for TX, which is kept per power level
+static const int8_t phase_category[ENERGY_PHASE_COUNT] = {
+    [ENERGY_TCXO]     = ENERGY_I_TCXO,
+    [ENERGY_TX]       = -1,
+    [ENERGY_RX1]      = ENERGY_I_RX,
+    [ENERGY_RX2]      = ENERGY_I_RX,
+    [ENERGY_EEPROM]   = ENERGY_I_EEPROM,
+    [ENERGY_UART_TX]  = ENERGY_I_UART_TX,
+    [ENERGY_STOP]     = -1,
+    [ENERGY_LP_SLEEP] = -1
+};
+
+static struct {
+    uint32_t reset;                        // RTC time of the last reset
+    uint32_t started[ENERGY_PHASE_COUNT];  // RTC time each active phase started
+    uint8_t tx_level;                      // Index into tx_ticks
+    uint64_t ticks[ENERGY_I_COUNT];
+    uint32_t tx_ticks[ENERGY_TX_LEVELS];
+} meter;
+
+
+static void meter_mark(energy_phase_t phase, bool on, uint32_t now)
+{
+    uint32_t ticks;
+
+    if (on) {
+        meter.started[phase] = now;
+        return;
+    }
+
+    ticks = now - meter.started[phase];
+    if (phase == ENERGY_TX) {
+        meter.tx_ticks[meter.tx_level] += ticks;
+    } else if (phase_category[phase] >= 0) {
+        meter.ticks[phase_category[phase]] += ticks;
+    }
+}
+
+
+void energy_mcu(energy_mcu_t mode, uint32_t ticks)
+{
+    uint32_t mask = disable_irq();
+    meter.ticks[mode] += ticks;
+    reenable_irq(mask);
+}
+
+
+void energy_tx_power(int power)
+{
+    if (power < ENERGY_TX_MIN) power = ENERGY_TX_MIN;
+    if (power > ENERGY_TX_MAX) power = ENERGY_TX_MAX;
+    meter.tx_level = power - ENERGY_TX_MIN;
+}
+
+
+void energy_meter_get(energy_meter_t *dst)
+{
+    uint64_t idle = 0;
+
+    uint32_t mask = disable_irq();
+    dst->elapsed = (uint32_t)(rtc_get_timer_value() - meter.reset);
+    memcpy(dst->ticks, meter.ticks, sizeof(dst->ticks));
+    memcpy(dst->tx_ticks, meter.tx_ticks, sizeof(dst->tx_ticks));
+    reenable_irq(mask);
+
+    for (int i = ENERGY_I_SLEEP; i < ENERGY_MCU_MODES; i++) idle += dst->ticks[i];
+    dst->ticks[ENERGY_I_RUN] = dst->elapsed > idle ? dst->elapsed - idle : 0;
+}
+
+
+void energy_meter_reset(void)
+{
+    uint32_t mask = disable_irq();
+    uint32_t now = rtc_get_timer_value();
+
+    meter.reset = now;
+    memset(meter.ticks, 0, sizeof(meter.ticks));
+    memset(meter.tx_ticks, 0, sizeof(meter.tx_ticks));
+
+    // Phases in progress are counted from now on
+    for (int i = 0; i < ENERGY_PHASE_COUNT; i++)
+        if (active & (1 << i)) meter.started[i] = now;
+    reenable_irq(mask);
+}
+
+
+uint32_t energy_current(unsigned category)
+{
+    return category < ENERGY_I_COUNT ? current[category] : 0;
+}
+
+
+uint32_t energy_tx_current(int power)
+{
+    if (power < ENERGY_TX_MIN || power > ENERGY_TX_MAX) return 0;
+    return tx_current[power - ENERGY_TX_MIN];
+}
+
+
+int energy_set_current(unsigned category, uint32_t value)
+{
+    if (category >= ENERGY_I_COUNT) return -1;
+    current[category] = value;
+    return 0;
+}
+
+
+int energy_set_tx_current(int power, uint32_t value)
+{
+    if (power < ENERGY_TX_MIN || power > ENERGY_TX_MAX) return -1;
+    tx_current[power - ENERGY_TX_MIN] = value;
+    return 0;
+}
+
+
+uint64_t energy_charge(uint64_t ticks, uint32_t current)
+{
+    // nA * ticks / 1024 / 3600 gives nAh
+    return ticks * current / (1024 * 3600);
+}
+
+#endif // ENERGY_METER
+
+#if ENERGY_PROFILE == 1
+
+// The marker output. The pin is shared with the MCU debugging interface, see
+// init_dbgmcu in system.c.
+#define MARKER_PORT GPIOB
+#define MARKER_PIN  GPIO_PIN_14
+
+#if DEBUG_MCU == 1
+#  error ENERGY_PROFILE cannot be combined with DEBUG_MCU
+#endif
+
+static energy_entry_t buffer[ENERGY_BUFFER_SIZE];
+static uint32_t next;
+
+static const char *phase_names[ENERGY_PHASE_COUNT] = {
+    [ENERGY_TCXO]    = "TCXO",
+    [ENERGY_TX]      = "TX",
+    [ENERGY_RX1]     = "RX1",
+    [ENERGY_RX2]     = "RX2",
+    [ENERGY_EEPROM]  = "EEPROM",
+    [ENERGY_UART_TX] = "UARTTX",
+    [ENERGY_STOP]    = "STOP",
+    [ENERGY_LP_SLEEP] = "LPSLEEP"
+};
+
+
+void energy_init(void)
+{
+    GPIO_InitTypeDef cfg = {
+        .Mode = GPIO_MODE_OUTPUT_PP,
+        .Pull = GPIO_NOPULL,
+        .Speed = GPIO_SPEED_HIGH
+    };
+
+    gpio_write(MARKER_PORT, MARKER_PIN, 0);
+    gpio_init(MARKER_PORT, MARKER_PIN, &cfg);
+}
+
+#endif // ENERGY_PROFILE
+
+#if ENERGY_PROFILE == 1 || ENERGY_METER == 1
+
+void energy_mark(energy_phase_t phase, bool on)
+{
+    uint32_t mask = disable_irq();
+    unsigned bit = 1 << phase;
+
+    if (!!(active & bit) != on) {
+        active ^= bit;
+
+#if ENERGY_PROFILE == 1
+        // Toggle the marker first so that the edge is as close to the actual
+        // transition as possible
+        MARKER_PORT->ODR ^= MARKER_PIN;
+
+        energy_entry_t *e = &buffer[next++ & (ENERGY_BUFFER_SIZE - 1)];
+        e->ticks = rtc_get_timer_value();
+        e->phase = phase;
+        e->active = on;
+#endif
+#if ENERGY_METER == 1
+        meter_mark(phase, on, rtc_get_timer_value());
+#endif
+    }
+    reenable_irq(mask);
+}
+
+#endif
+
+#if ENERGY_PROFILE == 1
+
+unsigned energy_take(energy_entry_t *dst, uint32_t *lost)
+{
+    uint32_t mask = disable_irq();
+    unsigned n = next < ENERGY_BUFFER_SIZE ? next : ENERGY_BUFFER_SIZE;
+    unsigned first = (next - n) & (ENERGY_BUFFER_SIZE - 1);
+
+    // Unroll the ring so that the oldest entry comes first
+    memcpy(dst, &buffer[first], (ENERGY_BUFFER_SIZE - first) * sizeof(*dst));
+    memcpy(dst + ENERGY_BUFFER_SIZE - first, buffer, first * sizeof(*dst));
+    *lost = next - n;
+    next = 0;
+    reenable_irq(mask);
+    return n;
+}
+
+
+const char *energy_phase_name(unsigned phase)
+{
+    if (phase >= ENERGY_PHASE_COUNT) return "?";
+    return phase_names[phase];
+}
+
+#endif // ENERGY_PROFILE
@@ -0,0 +1,171 @@
+#ifndef _ENERGY_H
+#define _ENERGY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+//! @brief Number of entries kept in the energy profile, must be a power of two
+#ifndef ENERGY_BUFFER_SIZE
+#define ENERGY_BUFFER_SIZE 64
+#endif
+
+#if (ENERGY_BUFFER_SIZE & (ENERGY_BUFFER_SIZE - 1)) != 0
+#  error ENERGY_BUFFER_SIZE must be a power of two
+#endif
+
+//! @brief Power-relevant phases recorded by the energy profiler
+typedef enum
+{
+    ENERGY_TCXO = 0,  // TCXO powered
+    ENERGY_TX,        // Radio transmitting
+    ENERGY_RX1,       // Radio receiving in the first window after an uplink
+    ENERGY_RX2,       // Radio receiving in any later or a continuous window
+    ENERGY_EEPROM,    // EEPROM write in progress
+    ENERGY_UART_TX,   // LPUART1 transmitting
+    ENERGY_STOP,      // MCU in Stop mode
+    ENERGY_LP_SLEEP,  // MCU in Low-power sleep mode, see system_idle
+    ENERGY_PHASE_COUNT
+} energy_phase_t;
+
+//! @brief A single phase transition
+typedef struct
+{
+    uint32_t ticks;   // RTC ticks (1/1024 s), see rtc_get_timer_value
+    uint8_t phase;
+    uint8_t active;
+} energy_entry_t;
+
+//! @brief MCU power modes tracked by the energy meter
+typedef enum
+{
+    ENERGY_MCU_RUN = 0,
+    ENERGY_MCU_SLEEP,
+    ENERGY_MCU_LP_SLEEP,
+    ENERGY_MCU_STOP,
+    ENERGY_MCU_MODES
+} energy_mcu_t;
+
+//! @brief Categories of the energy meter's current table. The MCU modes come
+//! first, in the order of energy_mcu_t, followed by the peripherals, whose
+//! currents add to that of the MCU. The radio's TX current is kept per power
+//! level, see energy_meter_t.
+typedef enum
+{
+    ENERGY_I_RUN = 0,
+    ENERGY_I_SLEEP,
+    ENERGY_I_LP_SLEEP,
+    ENERGY_I_STOP,
+    ENERGY_I_RX,
+    ENERGY_I_EEPROM,
+    ENERGY_I_TCXO,
+    ENERGY_I_UART_TX,
+    ENERGY_I_COUNT
+} energy_current_t;
+
+//! @brief The range of TX power levels (dBm) the meter tells apart. Levels
+//! outside the range are counted at the nearest one.
+#define ENERGY_TX_MIN    -4
+#define ENERGY_TX_MAX    20
+#define ENERGY_TX_LEVELS (ENERGY_TX_MAX - ENERGY_TX_MIN + 1)
+
+//! @brief Time spent in each category since the meter was reset, in RTC ticks
+typedef struct
+{
+    uint64_t elapsed;
+    uint64_t ticks[ENERGY_I_COUNT];
+    uint32_t tx_ticks[ENERGY_TX_LEVELS];
+} energy_meter_t;
+
+#if ENERGY_PROFILE == 1 || ENERGY_METER == 1
+
+//! @brief Record the start or the end of a phase. Calls that do not change the
+//! state of the phase are ignored. With ENERGY_PROFILE, every recorded
+//! transition toggles the marker GPIO. Can be invoked from the ISR context.
+//! @param[in] phase One of ENERGY_*
+//! @param[in] on True when the phase starts, false when it ends
+
+void energy_mark(energy_phase_t phase, bool on);
+
+#else
+
+#define energy_mark(phase, on) ((void)0)
+
+#endif
+
+#if ENERGY_METER == 1
+
+//! @brief Account time the MCU spent in a low-power mode. The remainder of the
+//! elapsed time is counted as run time. Can be invoked from the ISR context.
+//! @param[in] mode One of ENERGY_MCU_*
+//! @param[in] ticks Duration in RTC ticks
+
+void energy_mcu(energy_mcu_t mode, uint32_t ticks);
+
+//! @brief Record the power level of the following transmissions
+//! @param[in] power TX power in dBm
+
+void energy_tx_power(int power);
+
+//! @brief Get the times accumulated since the last reset
+
+void energy_meter_get(energy_meter_t *dst);
+
+//! @brief Clear the accumulated times
+
+void energy_meter_reset(void);
+
+//! @brief Get the calibrated current of a category in nA, see energy_current_t
+//! and, for the TX levels, energy_tx_current
+
+uint32_t energy_current(unsigned category);
+
+//! @brief Get the calibrated TX current at a power level (dBm) in nA
+
+uint32_t energy_tx_current(int power);
+
+//! @brief Calibrate the current of a category (nA). Lasts until reset.
+//! @return 0 on success, -1 if the category is invalid
+
+int energy_set_current(unsigned category, uint32_t current);
+
+//! @brief Calibrate the TX current at a power level (dBm) in nA
+//! @return 0 on success, -1 if the level is out of range
+
+int energy_set_tx_current(int power, uint32_t current);
+
+//! @brief Convert a time (RTC ticks) at a current (nA) into charge in
+//! thousandths of a microampere-hour (nAh)
+
+uint64_t energy_charge(uint64_t ticks, uint32_t current);
+
+#else
+
+#define energy_mcu(mode, ticks) ((void)0)
+#define energy_tx_power(power) ((void)0)
+
+#endif // ENERGY_METER
+
+#if ENERGY_PROFILE == 1
+
+//! @brief Configure the marker GPIO (PB14). Must be invoked after system_init.
+
+void energy_init(void);
+
+//! @brief Copy the recorded transitions, oldest first, and clear the profile
+//! @param[out] dst Destination buffer with room for ENERGY_BUFFER_SIZE entries
+//! @param[out] lost The number of transitions overwritten since the last call
+//! @retval Number of entries written to dst
+
+unsigned energy_take(energy_entry_t *dst, uint32_t *lost);
+
+//! @brief Return the name of a phase
+
+const char *energy_phase_name(unsigned phase);
+
+#else
+
+#define energy_init() ((void)0)
+
+#endif // ENERGY_PROFILE
+
+#endif // _ENERGY_H
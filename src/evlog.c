@@ -0,0 +1,158 @@
+#include "evlog.h"
+#include <string.h>
+#include <LoRaWAN/Utilities/timeServer.h>
+#include "store.h"
+#include "part.h"
+#include "rtc.h"
+#include "system.h"
+#include "log.h"
+
+// The size of the part in the store. Sectors are aligned within the store, so
+// the log has three or four sectors, one of which is kept erased.
+#define EVLOG_STORE_SIZE 4096
+
+#define EVLOG_FLUSH_DELAY 30000
+#define EVLOG_FLUSH_SLACK 10000
+
+static part_log_t elog;
+static bool ready;
+static bool flushing;
+
+// Records not written to the store yet
+static evlog_record_t pending[EVLOG_BATCH];
+static unsigned int npending;
+
+static TimerEvent_t timer;
+static volatile bool due;
+
+
+static void on_timer(void *ctx)
+{
+    (void)ctx;
+    due = true;
+    system_post(SYSTEM_TASK_NVM);
+}
+
+
+void evlog_init(void)
+{
+    part_t part;
+
+    TimerInit(&timer, on_timer);
+    TimerSetSlack(&timer, EVLOG_FLUSH_SLACK);
+
+    evlog_record(EVLOG_BOOT, system_reset_flags, (uint32_t)(rtc_previous_ticks() >> 10));
+
+    if (store_open(&part, "evlog", EVLOG_STORE_SIZE) != 0) return;
+    if (part_log_open(&elog, &part, STORE_SECTOR_SIZE) != 0) {
+        log_error("Could not open event log");
+        return;
+    }
+    ready = true;
+
+    evlog_flush();
+}
+
+
+void evlog_record(unsigned int event, uint16_t a, uint32_t b)
+{
+    evlog_record_t *r;
+
+    // A full batch is only possible before evlog_init or if the store cannot
+    // be written. Keep the oldest records; they explain what followed.
+    if (npending == EVLOG_BATCH) return;
+
+    r = &pending[npending++];
+    r->time = (uint32_t)(rtc_get_ticks64() >> 10);
+    r->event = event;
+    r->a = a;
+    r->b = b;
+
+    if (!ready) return;
+
+    if (npending == EVLOG_BATCH) {
+        due = true;
+        system_post(SYSTEM_TASK_NVM);
+    } else if (!TimerIsStarted(&timer)) {
+        TimerSetValue(&timer, EVLOG_FLUSH_DELAY);
+        TimerStart(&timer);
+    }
+}
+
+
+void evlog_flush(void)
+{
+    size_t size = npending * sizeof(pending[0]);
+
+    if (!ready || flushing) return;
+    TimerStop(&timer);
+    due = false;
+
+    if (npending == 0) return;
+    flushing = true;
+
+    // Drop the oldest records until the batch fits
+    while (!part_log_append(&elog, pending, size)) {
+        if (elog.count == 0 || !part_log_consume(&elog)) {
+            log_error("Error while writing event log");
+            break;
+        }
+    }
+
+    npending = 0;
+    flushing = false;
+}
+
+
+void evlog_process(void)
+{
+    if (due) evlog_flush();
+}
+
+
+void evlog_foreach(void (*cb)(const evlog_record_t *record, void *ctx), void *ctx)
+{
+    part_log_cursor_t cursor;
+    evlog_record_t r;
+    const uint8_t *p;
+    size_t n;
+
+    if (ready) {
+        part_log_rewind(&elog, &cursor);
+        while ((p = part_log_next(&elog, &cursor, &n)) != NULL) {
+            // Each log record holds a batch of records
+            for (; n >= sizeof(r); n -= sizeof(r), p += sizeof(r)) {
+                memcpy(&r, p, sizeof(r));
+                cb(&r, ctx);
+            }
+        }
+    }
+
+    for (unsigned int i = 0; i < npending; i++) cb(&pending[i], ctx);
+}
+
+
+static void count_record(const evlog_record_t *record, void *ctx)
+{
+    (void)record;
+    (*(size_t *)ctx)++;
+}
+
+
+size_t evlog_count(void)
+{
+    size_t n = 0;
+    evlog_foreach(count_record, &n);
+    return n;
+}
+
+
+bool evlog_clear(void)
+{
+    npending = 0;
+    if (!ready) return true;
+
+    TimerStop(&timer);
+    due = false;
+    return part_log_clear(&elog);
+}
@@ -0,0 +1,91 @@
+#ifndef _EVLOG_H
+#define _EVLOG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+//! @brief Events recorded in the persistent event log
+enum evlog_event {
+    EVLOG_BOOT        = 1,  // a: RCC_CSR reset flags (bits 24-31), b: seconds run by the previous boot
+    EVLOG_HALT        = 2,  // b: the address halt was invoked from
+    EVLOG_NVM         = 3,  // a: enum evlog_nvm, b: the size of a legacy sysconf
+    EVLOG_JOIN        = 4   // a: LoRaMacEventInfoStatus_t of an OTAA attempt (0 if accepted), b: data rate
+};
+
+//! @brief Subtypes of EVLOG_NVM
+enum evlog_nvm {
+    EVLOG_NVM_FORMATTED       = 1,  // There was no partition table, the EEPROM was formatted
+    EVLOG_NVM_ERASED          = 2,  // Parts were missing or invalid, NVM was erased
+    EVLOG_NVM_MIGRATED        = 3,  // The partition table was migrated to a new layout
+    EVLOG_NVM_SYSCONF_INVALID = 4,  // Invalid sysconf checksum, defaults used
+    EVLOG_NVM_SYSCONF_LEGACY  = 5,  // Sysconf of an older firmware extended
+    EVLOG_NVM_USER_INVALID    = 6   // Invalid user data checksum, registers cleared
+};
+
+//! @brief A record of the event log, 12 bytes
+typedef struct evlog_record
+{
+    uint32_t time;  // Seconds of the RTC tick count, see rtc_get_ticks64
+    uint16_t event; // enum evlog_event
+    uint16_t a;
+    uint32_t b;
+} evlog_record_t;
+
+//! @brief The largest number of records kept in RAM before they are written
+#define EVLOG_BATCH 8
+
+/*! @brief Persistent event log for post-mortem analysis
+ *
+ * The modem records a small number of rare events that help explain the
+ * behavior of devices in the field, e.g., boots with their reset cause, calls
+ * to halt, NVM checksum failures, and Join attempts, into a log in the flash
+ * store (see store.h) that survives resets and firmware upgrades. Read it
+ * with AT$EVLOG?.
+ *
+ * Records are collected in RAM and written to the store as a single log
+ * record (see part_log_t) once EVLOG_BATCH records have accumulated or
+ * EVLOG_FLUSH_DELAY ms after the first one, so that a series of Join attempts
+ * programs the flash once. The boot record and everything recorded before it
+ * is written right away, so that the reset cause of each boot is kept even if
+ * the device resets again shortly. halt and the reset commands flush the log.
+ * Once the log is full, the oldest records are dropped. The log costs nothing
+ * while no events are recorded.
+ */
+
+//! @brief Open the log in the store and write the boot record. Records made
+//! before, e.g., by nvm_init, are kept in RAM and written with it. Invoked
+//! from main after store_init.
+
+void evlog_init(void);
+
+//! @brief Record an event. Can be invoked before evlog_init.
+
+void evlog_record(unsigned int event, uint16_t a, uint32_t b);
+
+//! @brief Write the records kept in RAM to the store right away, e.g., before
+//! a reset
+
+void evlog_flush(void);
+
+//! @brief Write the records kept in RAM once they are due. Invoked from the
+//! main loop.
+
+void evlog_process(void);
+
+//! @brief Invoke cb for each record, from the oldest, including those not
+//! written yet
+
+void evlog_foreach(void (*cb)(const evlog_record_t *record, void *ctx), void *ctx);
+
+//! @brief Return the number of records in the log, including those not
+//! written yet
+
+size_t evlog_count(void);
+
+//! @brief Erase the log
+//! @return true On success
+
+bool evlog_clear(void);
+
+#endif // _EVLOG_H
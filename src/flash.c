@@ -0,0 +1,116 @@
+#include "flash.h"
+#include <string.h>
+#include <stm/STM32L0xx_HAL_Driver/Inc/stm32l0xx_hal.h>
+#include <stm/STM32L0xx_HAL_Driver/Inc/stm32l0xx_hal_flash.h>
+#include "eeprom.h"
+
+#define PAGE_WORDS (FLASH_PAGE_SIZE / sizeof(uint32_t))
+
+// Defined by the linker script
+extern uint32_t _sidata, _sdata, _edata;
+
+
+static bool _flash_write_page(uint32_t base, const uint32_t *page)
+{
+    const volatile uint32_t *mem = (const volatile uint32_t *) base;
+    FLASH_EraseInitTypeDef erase = {
+        .TypeErase = FLASH_TYPEERASE_PAGES,
+        .PageAddress = base,
+        .NbPages = 1
+    };
+    uint32_t error;
+    unsigned int i;
+    bool ok = true;
+
+    // A word can only be programmed once it has been erased. The page needs to
+    // be erased only if a word that is to be changed is not erased yet.
+    for (i = 0; i < PAGE_WORDS; i++)
+    {
+        if (mem[i] != page[i] && mem[i] != 0) break;
+    }
+
+    HAL_FLASH_Unlock();
+
+    if (i < PAGE_WORDS)
+    {
+        ok = HAL_FLASHEx_Erase(&erase, &error) == HAL_OK;
+    }
+
+    // Program memory reads as zero after an erase, so only the words that
+    // differ from the memory (and thus are non-zero) need to be programmed
+    for (i = 0; ok && i < PAGE_WORDS; i++)
+    {
+        if (mem[i] == page[i]) continue;
+        ok = HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, base + i * sizeof(*page), page[i]) == HAL_OK;
+    }
+
+    HAL_FLASH_Lock();
+    return ok;
+}
+
+
+// Write length bytes from buffer, or zeroes if buffer is NULL
+static bool _flash_update(uint32_t address, const void *buffer, size_t length)
+{
+    const uint8_t *src = (const uint8_t *) buffer;
+    uint32_t page[PAGE_WORDS];
+    uint32_t base;
+    size_t offset, n;
+
+    // If user attempts to write outside of the flash memory...
+    if (address < FLASH_BASE || address + length > FLASH_END + 1)
+    {
+        // Indicate failure
+        return false;
+    }
+
+    // The EEPROM shares the memory interface with flash. Let any background
+    // EEPROM write finish first.
+    while (eeprom_async_status() == 1);
+
+    while (length)
+    {
+        base = address & ~(FLASH_PAGE_SIZE - 1);
+        offset = address - base;
+        n = FLASH_PAGE_SIZE - offset;
+        if (n > length) n = length;
+
+        memcpy(page, (void *) base, FLASH_PAGE_SIZE);
+        if (src != NULL) memcpy((uint8_t *) page + offset, src, n);
+        else memset((uint8_t *) page + offset, 0, n);
+
+        if (memcmp(page, (void *) base, FLASH_PAGE_SIZE) != 0)
+        {
+            if (!_flash_write_page(base, page)) return false;
+
+            // If we do not read what we wrote...
+            if (memcmp(page, (void *) base, FLASH_PAGE_SIZE) != 0) return false;
+        }
+
+        address += n;
+        if (src != NULL) src += n;
+        length -= n;
+    }
+
+    // Indicate success
+    return true;
+}
+
+
+bool flash_write(uint32_t address, const void *buffer, size_t length)
+{
+    if (buffer == NULL) return false;
+    return _flash_update(address, buffer, length);
+}
+
+
+bool flash_erase(uint32_t address, size_t length)
+{
+    return _flash_update(address, NULL, length);
+}
+
+
+uint32_t flash_get_firmware_end(void)
+{
+    return (uint32_t) &_sidata + ((uint32_t) &_edata - (uint32_t) &_sdata);
+}
@@ -0,0 +1,41 @@
+#ifndef _FLASH_H
+#define _FLASH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+//! @brief Write buffer to program flash memory and verify it
+//!
+//! Each page touched by the write is read into RAM and merged with the new
+//! data. If all the words to be changed are erased (read as zero), they are
+//! programmed in place. Otherwise, the page is erased and programmed again.
+//! Pages that already contain the data are left alone. The MCU stalls while a page in the bank it executes from is being
+//! erased or programmed. Must only be used on pages that do not hold the
+//! firmware.
+//! @param[in] address Absolute flash memory address
+//! @param[in] buffer Pointer to source buffer
+//! @param[in] length Number of bytes to be written
+//! @return true On success
+//! @return false On failure
+
+bool flash_write(uint32_t address, const void *buffer, size_t length);
+
+//! @brief Erase a range of program flash memory
+//!
+//! Erased memory reads as zero. Pages fully covered by the range are erased,
+//! the remaining data of partially covered pages is preserved as in
+//! flash_write. Pages that are erased already are left alone.
+//! @param[in] address Absolute flash memory address
+//! @param[in] length Number of bytes to be erased
+//! @return true On success
+//! @return false On failure
+
+bool flash_erase(uint32_t address, size_t length);
+
+//! @brief Return the first flash memory address following the firmware image
+//! (code, constants, and the initializers of the .data section)
+
+uint32_t flash_get_firmware_end(void);
+
+#endif // _FLASH_H
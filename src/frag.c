@@ -0,0 +1,411 @@
+#include "frag.h"
+
+#if FUOTA == 1
+
+#include <string.h>
+#include "part.h"
+#include "store.h"
+#include "lrw.h"
+#include "cmd.h"
+#include "log.h"
+
+#define PACKAGE_ID      3
+#define PACKAGE_VERSION 1
+
+#define PACKAGE_VERSION_REQ     0x00
+#define FRAG_SESSION_STATUS_REQ 0x01
+#define FRAG_SESSION_SETUP_REQ  0x02
+#define FRAG_SESSION_DELETE_REQ 0x03
+#define DATA_FRAGMENT           0x08
+
+#define ROW_BYTES (FRAG_MAX_MISSING / 8)
+
+#if FRAG_MAX_MISSING % 8 != 0 || FRAG_MAX_MISSING > 255
+#  error FRAG_MAX_MISSING must be a multiple of 8 smaller than 256
+#endif
+
+// The fragments are stored in a part of the flash-backed store
+static part_t data_part;
+static bool store_ok;
+
+static struct {
+    frag_state_t state;
+    uint8_t index;
+    uint8_t groups;       // McGroupBitMask of the session
+    uint16_t nb_frag;
+    uint8_t size;
+    uint8_t padding;
+    uint32_t descriptor;
+    uint16_t received;    // All fragments received, coded or uncoded
+    uint16_t known;       // Uncoded fragments stored at their final position
+    bool coded;           // True once the first coded fragment has arrived
+    bool no_memory;       // Too many fragments lost for FRAG_MAX_MISSING
+    uint8_t columns;      // Number of lost fragments (unknowns)
+    uint8_t rank;         // Number of linearly independent equations
+} session;
+
+// A bitmap of uncoded fragments stored at their final position
+static uint8_t known[(FRAG_MAX_NB + 7) / 8];
+
+// Once coded fragments start arriving, each lost uncoded fragment is assigned
+// a column. Each coded fragment then yields an equation over the columns. The
+// equations are kept in row echelon form: row p has its lowest set bit at
+// column p. The data of row p is kept in flash memory at the position of the
+// lost fragment of column p, which is otherwise unused until recovered.
+static uint16_t column_frag[FRAG_MAX_MISSING];
+static uint8_t rows[FRAG_MAX_MISSING][ROW_BYTES];
+static uint8_t pivots[ROW_BYTES];
+
+// The fragment being processed
+static uint8_t work[FRAG_MAX_SIZE];
+
+
+static inline bool bit_get(const uint8_t *map, unsigned int i)
+{
+    return (map[i >> 3] & (1 << (i & 7))) != 0;
+}
+
+
+static inline void bit_set(uint8_t *map, unsigned int i)
+{
+    map[i >> 3] |= 1 << (i & 7);
+}
+
+
+void frag_init(void)
+{
+    if (store_open(&data_part, "fragdata", FRAG_STORE_SIZE) != 0) {
+        log_error("frag: Could not open fragment data part");
+        return;
+    }
+
+    store_ok = true;
+}
+
+
+static const uint8_t *fragment(unsigned int n)
+{
+    size_t size;
+    const uint8_t *p = part_mmap(&size, &data_part);
+    return p + n * session.size;
+}
+
+
+static bool write_fragment(unsigned int n, const uint8_t *data)
+{
+    return part_write(&data_part, n * session.size, data, session.size);
+}
+
+
+static void xor_fragment(uint8_t *dst, unsigned int n)
+{
+    const uint8_t *src = fragment(n);
+    for (unsigned int i = 0; i < session.size; i++) dst[i] ^= src[i];
+}
+
+
+static void finish(frag_state_t state)
+{
+    session.state = state;
+    if (state == FRAG_STATE_COMPLETE) {
+        log_info("frag: Data block %d complete (%d fragments received)",
+            session.index, session.received);
+        cmd_event(CMD_EVENT_FUOTA, CMD_FUOTA_COMPLETED);
+    } else {
+        log_warning("frag: Data block %d cannot be recovered", session.index);
+        cmd_event(CMD_EVENT_FUOTA, CMD_FUOTA_FAILED);
+    }
+}
+
+
+// The pseudo-random generator and the parity matrix of TS004
+static uint32_t prbs23(uint32_t x)
+{
+    uint32_t b0 = x & 1;
+    uint32_t b1 = (x & 0x20) >> 5;
+    return (x >> 1) + ((b0 ^ b1) << 22);
+}
+
+
+static void parity_row(uint8_t *row, uint32_t n, uint32_t m)
+{
+    uint32_t x = 1 + 1001 * n, r, count = 0;
+    uint32_t mod = (m & (m - 1)) == 0 ? m + 1 : m;
+
+    memset(row, 0, (m + 7) / 8);
+    while (count < m / 2) {
+        do {
+            x = prbs23(x);
+            r = x % mod;
+        } while (r >= m);
+        bit_set(row, r);
+        count++;
+    }
+}
+
+
+static int find_column(unsigned int n)
+{
+    for (int c = 0; c < session.columns; c++)
+        if (column_frag[c] == n) return c;
+    return -1;
+}
+
+
+// Assign a column to each uncoded fragment that has not been received yet.
+// Returns false if there are more of them than FRAG_MAX_MISSING.
+static bool start_coded(void)
+{
+    session.coded = true;
+    session.columns = 0;
+    session.rank = 0;
+    memset(pivots, 0, sizeof(pivots));
+
+    for (unsigned int i = 0; i < session.nb_frag; i++) {
+        if (bit_get(known, i)) continue;
+        if (session.columns == FRAG_MAX_MISSING) return false;
+        column_frag[session.columns++] = i;
+    }
+    return true;
+}
+
+
+// Back substitution: solve the columns from the last one, whose row has a
+// single bit set, to the first one
+static bool solve(void)
+{
+    for (int p = session.columns - 1; p >= 0; p--) {
+        memcpy(work, fragment(column_frag[p]), session.size);
+        for (int q = p + 1; q < session.columns; q++)
+            if (bit_get(rows[p], q)) xor_fragment(work, column_frag[q]);
+        if (!write_fragment(column_frag[p], work)) return false;
+    }
+    return true;
+}
+
+
+// Add the equation v with the data in work. The equation is reduced by the
+// rows already present. If anything remains, it becomes a new row.
+static void add_equation(uint8_t *v)
+{
+    for (int p = 0; p < session.columns; p++) {
+        if (!bit_get(v, p)) continue;
+
+        if (bit_get(pivots, p)) {
+            for (unsigned int i = 0; i < ROW_BYTES; i++) v[i] ^= rows[p][i];
+            xor_fragment(work, column_frag[p]);
+            continue;
+        }
+
+        if (!write_fragment(column_frag[p], work)) {
+            log_error("frag: Error while writing fragment");
+            return;
+        }
+        memcpy(rows[p], v, ROW_BYTES);
+        bit_set(pivots, p);
+        session.rank++;
+        break;
+    }
+
+    if (session.rank == session.columns)
+        finish(solve() ? FRAG_STATE_COMPLETE : FRAG_STATE_FAILED);
+}
+
+
+static void data_fragment(const uint8_t *p, size_t length, int group)
+{
+    uint8_t row[(FRAG_MAX_NB + 7) / 8];
+    uint8_t v[ROW_BYTES];
+    unsigned int n, index;
+    int c;
+
+    if (length < 2) return;
+    n = p[0] | (p[1] << 8);
+    index = n >> 14;
+    n &= 0x3fff;
+
+    if (session.state != FRAG_STATE_RECEIVING || index != session.index) return;
+    if (group >= 0 && !(session.groups & (1 << group))) return;
+    if (length - 2 != session.size || n == 0) return;
+
+    session.received++;
+    memcpy(work, p + 2, session.size);
+    memset(v, 0, sizeof(v));
+
+    if (n <= session.nb_frag) {
+        n--;
+        if (bit_get(known, n)) return;
+
+        if (!session.coded) {
+            if (!write_fragment(n, work)) {
+                log_error("frag: Error while writing fragment");
+                return;
+            }
+            bit_set(known, n);
+            if (++session.known == session.nb_frag) finish(FRAG_STATE_COMPLETE);
+            return;
+        }
+
+        // An uncoded fragment that arrives after coded fragments is an
+        // equation with a single unknown
+        if ((c = find_column(n)) < 0) return;
+        bit_set(v, c);
+        add_equation(v);
+        return;
+    }
+
+    if (!session.coded && !start_coded()) {
+        session.no_memory = true;
+        finish(FRAG_STATE_FAILED);
+        return;
+    }
+
+    // Remove the uncoded fragments we already have from the coded fragment
+    parity_row(row, n - session.nb_frag, session.nb_frag);
+    for (unsigned int i = 0; i < session.nb_frag; i++) {
+        if (!bit_get(row, i)) continue;
+        if (bit_get(known, i)) xor_fragment(work, i);
+        else if ((c = find_column(i)) >= 0) bit_set(v, c);
+    }
+    add_equation(v);
+}
+
+
+static uint8_t setup_session(const uint8_t *p)
+{
+    uint8_t index = (p[0] >> 4) & 0x03;
+    uint16_t nb_frag = p[1] | (p[2] << 8);
+    uint8_t size = p[3];
+    uint8_t algo = (p[4] >> 3) & 0x07;
+    uint8_t status = index << 6;
+
+    if (algo != 0) status |= 1 << 0;
+    if (!store_ok || nb_frag == 0 || nb_frag > FRAG_MAX_NB || size == 0 ||
+        size > FRAG_MAX_SIZE || (uint32_t)nb_frag * size > data_part.dsc->size)
+        status |= 1 << 1;
+    if (session.state == FRAG_STATE_RECEIVING && session.index != index)
+        status |= 1 << 2;
+    if (status & 0x0f) return status;
+
+    memset(&session, 0, sizeof(session));
+    memset(known, 0, sizeof(known));
+    session.state = FRAG_STATE_RECEIVING;
+    session.index = index;
+    session.groups = p[0] & 0x0f;
+    session.nb_frag = nb_frag;
+    session.size = size;
+    session.padding = p[5];
+    memcpy(&session.descriptor, p + 6, sizeof(session.descriptor));
+
+    log_info("frag: Session %d: %d fragments of %d B", index, nb_frag, size);
+    cmd_event(CMD_EVENT_FUOTA, CMD_FUOTA_SESSION);
+    return status;
+}
+
+
+static unsigned int missing(void)
+{
+    if (session.state == FRAG_STATE_COMPLETE) return 0;
+    if (!session.coded) return session.nb_frag - session.known;
+    return session.columns - session.rank;
+}
+
+
+void frag_process(const uint8_t *buf, size_t length, int group)
+{
+    uint8_t ans[16], len = 0;
+    unsigned int index, v;
+
+    while (length) {
+        switch (buf[0]) {
+            case PACKAGE_VERSION_REQ:
+                ans[len++] = PACKAGE_VERSION_REQ;
+                ans[len++] = PACKAGE_ID;
+                ans[len++] = PACKAGE_VERSION;
+                buf += 1; length -= 1;
+                break;
+
+            case FRAG_SESSION_STATUS_REQ:
+                if (length < 2) return;
+                index = (buf[1] >> 1) & 0x03;
+                // Only answer requests for all participants (bit 0) if the
+                // block is incomplete
+                if (session.state != FRAG_STATE_NONE && session.index == index &&
+                    (buf[1] & 1 || session.state != FRAG_STATE_COMPLETE)) {
+                    v = (session.received & 0x3fff) | (index << 14);
+                    ans[len++] = FRAG_SESSION_STATUS_REQ;
+                    ans[len++] = v & 0xff;
+                    ans[len++] = v >> 8;
+                    ans[len++] = missing() > 255 ? 255 : missing();
+                    ans[len++] = session.no_memory ? 1 : 0;
+                }
+                buf += 2; length -= 2;
+                break;
+
+            case FRAG_SESSION_SETUP_REQ:
+                if (length < 11) return;
+                ans[len++] = FRAG_SESSION_SETUP_REQ;
+                ans[len++] = setup_session(buf + 1);
+                buf += 11; length -= 11;
+                break;
+
+            case FRAG_SESSION_DELETE_REQ:
+                if (length < 2) return;
+                index = buf[1] & 0x03;
+                ans[len++] = FRAG_SESSION_DELETE_REQ;
+                if (session.state != FRAG_STATE_NONE && session.index == index) {
+                    ans[len++] = index;
+                    frag_delete();
+                } else {
+                    ans[len++] = index | (1 << 2);
+                }
+                buf += 2; length -= 2;
+                break;
+
+            case DATA_FRAGMENT:
+                // A data fragment takes up the rest of the message
+                data_fragment(buf + 1, length - 1, group);
+                length = 0;
+                break;
+
+            default:
+                log_debug("frag: Unsupported command %d", buf[0]);
+                length = 0;
+                break;
+        }
+
+        if (len > sizeof(ans) - 5) break;
+    }
+
+    if (len && lrw_enqueue(FRAG_PORT, ans, len, false, NULL) < 0)
+        log_warning("frag: Transmit queue full, dropping answer");
+}
+
+
+void frag_get_status(frag_status_t *status)
+{
+    status->state = session.state;
+    status->index = session.index;
+    status->nb_frag = session.nb_frag;
+    status->size = session.size;
+    status->padding = session.padding;
+    status->descriptor = session.descriptor;
+    status->received = session.received;
+    status->missing = missing();
+}
+
+
+const uint8_t *frag_get_data(size_t *size)
+{
+    if (session.state != FRAG_STATE_COMPLETE) return NULL;
+    *size = session.nb_frag * session.size - session.padding;
+    return fragment(0);
+}
+
+
+void frag_delete(void)
+{
+    memset(&session, 0, sizeof(session));
+}
+
+#endif // FUOTA
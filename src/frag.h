@@ -0,0 +1,93 @@
+#ifndef _FRAG_H
+#define _FRAG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+//! @brief LoRaWAN port of the Fragmented Data Block Transport package (TS004)
+#define FRAG_PORT 201
+
+//! @brief Size of the part of the flash-backed store (see store.h) that holds
+//! the fragments of a data block
+#ifndef FRAG_STORE_SIZE
+#define FRAG_STORE_SIZE 32768
+#endif
+
+//! @brief Maximum number of fragments in a data block
+#ifndef FRAG_MAX_NB
+#define FRAG_MAX_NB 1024
+#endif
+
+//! @brief Maximum number of lost fragments that can be recovered from coded
+//! fragments, must be a multiple of 8
+#ifndef FRAG_MAX_MISSING
+#define FRAG_MAX_MISSING 64
+#endif
+
+//! @brief Maximum size of a fragment in bytes
+#define FRAG_MAX_SIZE 240
+
+//! @brief State of the fragmentation session
+typedef enum
+{
+    FRAG_STATE_NONE = 0,   // No session has been set up
+    FRAG_STATE_RECEIVING,  // Fragments are being received
+    FRAG_STATE_COMPLETE,   // The data block has been reassembled
+    FRAG_STATE_FAILED      // Too many fragments lost to recover the data block
+} frag_state_t;
+
+//! @brief Status of the fragmentation session
+typedef struct
+{
+    frag_state_t state;
+    uint8_t index;        // FragIndex chosen by the server
+    uint16_t nb_frag;     // Number of uncoded fragments in the data block
+    uint8_t size;         // Fragment size in bytes
+    uint8_t padding;      // Number of padding bytes in the last fragment
+    uint32_t descriptor;  // Application-specific descriptor of the data block
+    uint16_t received;    // Number of fragments received so far
+    uint16_t missing;     // Number of fragments still missing
+} frag_status_t;
+
+#if FUOTA == 1
+
+//! @brief Open (and format if necessary) the flash memory area that stores
+//! fragments. Fragmentation sessions are refused if the area overlaps with the
+//! firmware image.
+
+void frag_init(void);
+
+//! @brief Process a downlink received on FRAG_PORT
+//!
+//! Handles the fragmentation session setup, status, and delete requests and
+//! data fragments. Uncoded fragments are written into flash memory at their
+//! final position. Lost fragments are recovered from coded fragments by
+//! Gaussian elimination. Answers to the server are sent through the transmit
+//! queue. The host is notified with FUOTA events.
+//! @param[in] buffer Downlink payload
+//! @param[in] length Length of the payload
+//! @param[in] group Multicast group ID, or -1 for unicast downlinks
+
+void frag_process(const uint8_t *buffer, size_t length, int group);
+
+//! @brief Retrieve the status of the fragmentation session
+//! @param[out] status Pointer to the destination structure
+
+void frag_get_status(frag_status_t *status);
+
+//! @brief Return the reassembled data block
+//! @param[out] size Size of the data block in bytes (without padding)
+//! @return Pointer to the data block in flash memory
+//! @return NULL If there is no complete data block
+
+const uint8_t *frag_get_data(size_t *size);
+
+//! @brief Delete the fragmentation session. The data block in flash memory is
+//! not erased.
+
+void frag_delete(void);
+
+#endif // FUOTA
+
+#endif // _FRAG_H
@@ -1,7 +1,24 @@
 #include "gpio.h"
+#include "spi.h"
+#include "irq.h"
+#include "trace.h"
 
 static gpio_irq_handler_t *_gpio_irq[16] = {NULL};
-static uint8_t HW_GPIO_Getbit_pos(uint16_t pin);
+
+// The Cortex-M0+ has no count-leading-zeros instruction. The position of a
+// single set bit is looked up with a de Bruijn sequence instead.
+static const uint8_t debruijn_pos[32] = {
+    0, 1, 28, 2, 29, 14, 24, 3, 30, 22, 20, 15, 25, 17, 4, 8,
+    31, 27, 13, 23, 21, 19, 16, 7, 26, 12, 18, 6, 11, 5, 10, 9
+};
+
+
+// Return the EXTI line number of a GPIO pin mask with a single bit set
+static inline unsigned int line_of(uint32_t bit)
+{
+    return debruijn_pos[(bit * 0x077cb531UL) >> 27];
+}
+
 
 void gpio_init(GPIO_TypeDef *port, uint16_t pin, GPIO_InitTypeDef *init_struct)
 {
@@ -35,7 +52,7 @@ void gpio_set_irq(GPIO_TypeDef *port, uint16_t pin, uint32_t prio, gpio_irq_hand
     (void) port;
     IRQn_Type irq_nb;
 
-    uint32_t bit_pos = HW_GPIO_Getbit_pos(pin);
+    uint32_t bit_pos = line_of(pin);
 
     if (irqHandler != NULL)
     {
@@ -77,16 +94,6 @@ void gpio_set_irq(GPIO_TypeDef *port, uint16_t pin, uint32_t prio, gpio_irq_hand
     }
 }
 
-void gpio_hal_msp_irq_handler(uint16_t pin)
-{
-    uint32_t bit_pos = HW_GPIO_Getbit_pos(pin);
-
-    if (_gpio_irq[bit_pos] != NULL)
-    {
-        _gpio_irq[bit_pos](NULL);
-    }
-}
-
 void gpio_write(GPIO_TypeDef *port, uint16_t pin, uint32_t value)
 {
     HAL_GPIO_WritePin(port, pin, (GPIO_PinState)value);
@@ -97,73 +104,50 @@ uint32_t gpio_read(GPIO_TypeDef *port, uint16_t pin)
     return HAL_GPIO_ReadPin(port, pin);
 }
 
-static uint8_t HW_GPIO_Getbit_pos(uint16_t pin)
+// Dispatch the pending EXTI lines from the given set. The pending register is
+// read and cleared once and each line jumps straight to its handler, with the
+// line number computed in constant time.
+RAMFUNC static void dispatch_exti(uint32_t lines)
 {
-    uint8_t pin_pos = 0;
-
-    if ((pin & 0xFF00) != 0)
-    {
-        pin_pos |= 0x8;
+    gpio_irq_handler_t *handler;
+    uint32_t pending, bit, start = trace_irq_enter();
+
+    trace(TRACE_EXTI);
+    pending = EXTI->PR & lines;
+    EXTI->PR = pending;
+
+    while (pending) {
+        bit = pending & -pending;
+        pending ^= bit;
+        handler = _gpio_irq[line_of(bit)];
+        if (handler != NULL) handler(NULL);
     }
-    if ((pin & 0xF0F0) != 0)
-    {
-        pin_pos |= 0x4;
-    }
-    if ((pin & 0xCCCC) != 0)
-    {
-        pin_pos |= 0x2;
-    }
-    if ((pin & 0xAAAA) != 0)
-    {
-        pin_pos |= 0x1;
-    }
-
-    return pin_pos;
+    trace_irq_exit(TRACE_IRQ_EXTI, start);
 }
 
-void EXTI0_1_IRQHandler(void)
-{
-    HAL_GPIO_EXTI_IRQHandler(GPIO_PIN_0);
-
-    HAL_GPIO_EXTI_IRQHandler(GPIO_PIN_1);
-}
 
-void EXTI2_3_IRQHandler(void)
+RAMFUNC void EXTI0_1_IRQHandler(void)
 {
-    HAL_GPIO_EXTI_IRQHandler(GPIO_PIN_2);
-
-    HAL_GPIO_EXTI_IRQHandler(GPIO_PIN_3);
+    dispatch_exti(0x0003);
 }
 
-void EXTI4_15_IRQHandler(void)
-{
-    HAL_GPIO_EXTI_IRQHandler(GPIO_PIN_4);
-
-    HAL_GPIO_EXTI_IRQHandler(GPIO_PIN_5);
-
-    HAL_GPIO_EXTI_IRQHandler(GPIO_PIN_6);
 
-    HAL_GPIO_EXTI_IRQHandler(GPIO_PIN_7);
-
-    HAL_GPIO_EXTI_IRQHandler(GPIO_PIN_8);
-
-    HAL_GPIO_EXTI_IRQHandler(GPIO_PIN_9);
-
-    HAL_GPIO_EXTI_IRQHandler(GPIO_PIN_10);
-
-    HAL_GPIO_EXTI_IRQHandler(GPIO_PIN_11);
-
-    HAL_GPIO_EXTI_IRQHandler(GPIO_PIN_12);
-
-    HAL_GPIO_EXTI_IRQHandler(GPIO_PIN_13);
+RAMFUNC void EXTI2_3_IRQHandler(void)
+{
+    dispatch_exti(0x000c);
+}
 
-    HAL_GPIO_EXTI_IRQHandler(GPIO_PIN_14);
 
-    HAL_GPIO_EXTI_IRQHandler(GPIO_PIN_15);
+RAMFUNC void EXTI4_15_IRQHandler(void)
+{
+    dispatch_exti(0xfff0);
 }
 
 
 void GpioWrite(Gpio_t *obj, uint32_t value)
 {
+    // LoRaMac-node selects the radio with this function. The radio's NSS pin
+    // is driven by the SPI register shadow.
+    if (spi_shadow_nss(obj, value)) return;
     gpio_write(obj->port, obj->pinIndex, value);
 }
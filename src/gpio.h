@@ -34,12 +34,6 @@ void gpio_write(GPIO_TypeDef *port, uint16_t pin,  uint32_t value);
 
 uint32_t gpio_read(GPIO_TypeDef *port, uint16_t pin);
 
-//! @brief Execute the interrupt from the object
-//! @param [IN] port where x can be (A..E and H)
-//! @param [IN] pin specifies the port bit to set the irq handler for
-
-void gpio_hal_msp_irq_handler(uint16_t pin);
-
 
 // The following function is a wrapper for LoRaMac-node
 
@@ -5,6 +5,7 @@
 #include "system.h"
 #include "cmd.h"
 #include "irq.h"
+#include "evlog.h"
 
 
 __attribute__((noreturn)) void halt(const char *msg)
@@ -14,6 +15,10 @@ __attribute__((noreturn)) void halt(const char *msg)
 #endif
     cmd_event(CMD_EVENT_MODULE, CMD_MODULE_HALT);
 
+    // The address of the caller identifies the halt in the firmware's map file
+    evlog_record(EVLOG_HALT, 0, (uint32_t)(uintptr_t)__builtin_return_address(0));
+    evlog_flush();
+
     if (msg == NULL) {
         log_error(prefix);
     } else {
@@ -27,6 +32,7 @@ __attribute__((noreturn)) void halt(const char *msg)
     // Make sure we can enter the low-power Stop mode
     system_sleep_lock = 0;
     system_stop_lock = 0;
+    system_tasks = 0;
 
     // Mask all EXTI interrupts and events to ensure we're not woken up. The
     // only way of recovering from a halt should be via the external reset pin.
@@ -0,0 +1,110 @@
+#include "heartbeat.h"
+#include <string.h>
+#include <LoRaWAN/Utilities/timeServer.h>
+#include <LoRaWAN/Utilities/utilities.h>
+#include "lrw.h"
+#include "nvm.h"
+#include "system.h"
+#include "log.h"
+
+
+// The interval between attempts to send a heartbeat that the MAC did not
+// accept, e.g., before join or while another uplink is in progress (ms)
+#define RETRY_INTERVAL 30000
+
+#define HEARTBEAT_TIMER_SLACK 1000
+
+static TimerEvent_t timer;
+static volatile bool due;
+static uint32_t count;
+
+
+static void on_timer(void *ctx)
+{
+    (void)ctx;
+    due = true;
+    system_post(SYSTEM_TASK_LORA);
+}
+
+
+// Start the timer for the next heartbeat. The period is randomized by up to
+// hb_jitter percent in either direction, so that devices configured at the
+// same time drift apart.
+static void schedule(uint32_t delay)
+{
+    TimerStop(&timer);
+    if (sysconf.hb_period == 0) return;
+
+    if (delay == 0) {
+        int32_t jitter = sysconf.hb_period * 10 * sysconf.hb_jitter;
+        delay = sysconf.hb_period * 1000 + randr(-jitter, jitter);
+    }
+
+    TimerSetValue(&timer, delay);
+    TimerStart(&timer);
+}
+
+
+void heartbeat_init(void)
+{
+    TimerInit(&timer, on_timer);
+    TimerSetSlack(&timer, HEARTBEAT_TIMER_SLACK);
+    schedule(0);
+}
+
+
+void heartbeat_reschedule(void)
+{
+    due = false;
+    schedule(0);
+}
+
+
+uint32_t heartbeat_count(void)
+{
+    return count;
+}
+
+
+void heartbeat_process(void)
+{
+    uint8_t buf[3 + HEARTBEAT_MAX_NVM];
+    size_t n = 0;
+
+    if (!due) return;
+    due = false;
+
+    if (sysconf.hb_period == 0 || sysconf.hb_port == 0) return;
+
+    if (sysconf.hb_content & HEARTBEAT_COUNTER) {
+        buf[n++] = count & 0xff;
+        buf[n++] = (count >> 8) & 0xff;
+    }
+
+    if (sysconf.hb_content & HEARTBEAT_BATTERY)
+        buf[n++] = lrw_battery_get(NULL, NULL, NULL);
+
+    const uint8_t *values = nvm_user_data();
+    size_t length = sysconf.hb_nvm_length;
+    if (length > HEARTBEAT_MAX_NVM) length = HEARTBEAT_MAX_NVM;
+    if (length > (size_t)(USER_NVM_MAX_SIZE - sysconf.hb_nvm_offset))
+        length = USER_NVM_MAX_SIZE - sysconf.hb_nvm_offset;
+
+    if ((sysconf.hb_content & HEARTBEAT_USER_NVM) && values != NULL) {
+        memcpy(buf + n, values + sysconf.hb_nvm_offset, length);
+        n += length;
+    }
+
+    // LoRaMac cannot reliably send an empty payload on a non-zero port, see
+    // transmit in cmd.c
+    if (n == 0) buf[n++] = 0;
+
+    if (lrw_send(sysconf.hb_port, buf, n, false, NULL) != 0) {
+        schedule(RETRY_INTERVAL);
+        return;
+    }
+
+    log_debug("heartbeat: Sent uplink %lu", count);
+    count++;
+    schedule(0);
+}
@@ -0,0 +1,49 @@
+#ifndef _HEARTBEAT_H
+#define _HEARTBEAT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+//! @brief Items included in the heartbeat payload, in this order
+enum heartbeat_content {
+    HEARTBEAT_COUNTER  = (1 << 0),  // Heartbeats sent since boot, 2 bytes LE
+    HEARTBEAT_BATTERY  = (1 << 1),  // Battery level as in DevStatusAns, 1 byte
+    HEARTBEAT_USER_NVM = (1 << 2)   // A range of user NVM registers (AT$NVM)
+};
+
+//! @brief The largest number of user NVM registers included in a heartbeat
+#define HEARTBEAT_MAX_NVM 32
+
+/*! @brief Autonomous periodic uplinks
+ *
+ * The modem sends a heartbeat uplink with a configured payload at a fixed
+ * interval, randomized by a configurable jitter, without any involvement of
+ * the host. The configuration is kept in sysconf (see AT$HEARTBEAT), so the
+ * heartbeats resume after a reset as soon as the device has joined, and a
+ * host that only needs to report liveness can stay powered down.
+ *
+ * A heartbeat that cannot be sent, e.g., because of the duty cycle or an
+ * uplink submitted by the host, is retried shortly. The next heartbeat is
+ * scheduled one period after the previous one was sent.
+ */
+
+//! @brief Initialize the heartbeat and schedule the first uplink from sysconf.
+//! Invoked from lrw_init.
+
+void heartbeat_init(void);
+
+//! @brief Restart the heartbeat period after the configuration in sysconf has
+//! been modified
+
+void heartbeat_reschedule(void);
+
+//! @brief Return the number of heartbeats sent since boot
+
+uint32_t heartbeat_count(void);
+
+//! @brief Send a due heartbeat. Invoked from lrw_process.
+
+void heartbeat_process(void);
+
+#endif // _HEARTBEAT_H
@@ -0,0 +1,614 @@
+#include "i2c_target.h"
+#include "lpuart.h"
+
+#if ATCI_I2C == 1
+
+#include <string.h>
+#include <stm/STM32L0xx_HAL_Driver/Inc/stm32l0xx_ll_i2c.h>
+#include <stm/STM32L0xx_HAL_Driver/Inc/stm32l0xx_ll_exti.h>
+#include <stm/STM32L0xx_HAL_Driver/Inc/stm32l0xx_hal.h>
+#include <LoRaWAN/Utilities/timeServer.h>
+#include "cbuf.h"
+#include "gpio.h"
+#include "irq.h"
+#include "lrw.h"
+#include "nvm.h"
+#include "rtc.h"
+#include "system.h"
+
+// This file implements the lpuart.h interface over I2C1 in the target role,
+// the same way lpuart_rtt.c does over Segger RTT. The ATCI register is a pipe
+// into the RX FIFO and out of the TX FIFO, so the ATCI and everything else
+// that writes into the TX FIFO works unmodified. The UPLINK and DOWNLINK
+// registers bypass the ATCI and connect the host to the transmit and receive
+// queues of lrw.c directly. See i2c_target.h for the register map.
+
+#if ATCI_RTT == 1 || DETACHABLE_LPUART == 1 || LPUART_FLOW_CONTROL != 0
+#error ATCI_I2C cannot be combined with ATCI_RTT, DETACHABLE_LPUART, or LPUART_FLOW_CONTROL
+#endif
+
+#if HOST_WAKE_PIN == 1
+#error ATCI_I2C uses PB5 for the IRQ output and cannot be combined with HOST_WAKE_PIN
+#endif
+
+#ifndef LPUART_BUFFER_SIZE
+#define LPUART_BUFFER_SIZE 512
+#endif
+
+#if (LPUART_BUFFER_SIZE & (LPUART_BUFFER_SIZE - 1)) != 0
+#error LPUART_BUFFER_SIZE must be a power of two
+#endif
+
+#ifndef ATCI_I2C_ADDRESS
+#define ATCI_I2C_ADDRESS 0x42
+#endif
+
+// The size of the UPLINK FIFO (a power of two). Each message takes three
+// bytes more than its payload.
+#ifndef I2C_UPLINK_FIFO_SIZE
+#define I2C_UPLINK_FIFO_SIZE 512
+#endif
+
+// PRESC=1, SCLDEL=3, SDADEL=2 at 16 MHz (RM0367, fast mode). In the target
+// role, only the data setup and hold times apply.
+#define I2C_TIMING 0x10320309
+
+#define UPLINK_HEADER   2   // Port and flags as written by the host
+#define UPLINK_MAX      (1 + UPLINK_HEADER + LRW_TX_QUEUE_MAX_PAYLOAD)
+#define DOWNLINK_HEADER 6
+
+#define IRQ_PORT GPIOB
+#define IRQ_PIN  GPIO_PIN_5
+
+#define LINE_END  '\r'
+#define FRAME_END 0xc0
+
+static unsigned char tx_buffer[LPUART_BUFFER_SIZE];
+static unsigned char rx_buffer[LPUART_BUFFER_SIZE];
+
+volatile cbuf_t lpuart_tx_fifo;
+volatile cbuf_t lpuart_rx_fifo;
+volatile uint32_t lpuart_overruns;
+volatile uint32_t lpuart_rx_dropped;
+uint32_t lpuart_tx_stalls;
+uint32_t lpuart_tx_stall_time;
+#if BENCH == 1
+bool lpuart_mute;
+#endif
+
+static bool volatile tx_paused;
+static volatile size_t rx_threshold;
+
+// Conditions and latched events, see i2c_target.h
+static bool volatile pending;
+static uint8_t volatile irq_flags;
+static uint8_t volatile irq_enable = 0xff;
+
+// Uplink messages written by the host, each stored as the payload length
+// followed by the port, the flags, and the payload. Written in the ISR, read
+// by i2c_target_process.
+static unsigned char ul_buffer[I2C_UPLINK_FIFO_SIZE];
+static volatile cbuf_t ul_fifo;
+static uint8_t volatile ul_id;
+static bool volatile ul_full;
+
+// The record exposed in DOWNLINK. Filled by i2c_target_process, released by
+// the ISR once the host has read it.
+static uint8_t dl_buffer[DOWNLINK_HEADER + LRW_RX_QUEUE_MAX_PAYLOAD];
+static uint8_t volatile dl_length;
+
+// The state of the current transfer
+static struct {
+    bool active;
+    bool read;
+    bool addressed;         // The register address has been received
+    uint8_t reg;            // Selected by the last write
+    size_t index;           // Bytes transferred so far
+    uint8_t unsent;         // Prefetched into TXDR, but NACKed by the host
+    size_t served;          // ATCI bytes returned to the host
+    bool exhausted;         // The host has read past the end of ATCI
+    bool end;               // A line or frame end has been written into ATCI
+    bool overrun;
+    uint8_t block[I2C_REG_BLOCK_SIZE];
+    uint8_t uplink[UPLINK_MAX];
+    size_t ul_length;
+} bus;
+
+
+static void update_irq_pin(void)
+{
+    gpio_write(IRQ_PORT, IRQ_PIN, (irq_flags & irq_enable) ? 0 : 1);
+}
+
+
+static void raise_irq(uint8_t flags)
+{
+    uint32_t masked = disable_irq();
+    irq_flags |= flags;
+    update_irq_pin();
+    reenable_irq(masked);
+}
+
+
+static size_t tx_available(void)
+{
+    return tx_paused ? 0 : cbuf_length(&lpuart_tx_fifo);
+}
+
+
+static size_t ul_space(void)
+{
+    size_t space = cbuf_space(&ul_fifo);
+    return space ? space - 1 : 0;
+}
+
+
+static void snapshot(void)
+{
+    size_t n;
+
+    memset(bus.block, 0, sizeof(bus.block));
+    bus.block[I2C_REG_STATUS] =
+        (tx_available() ? I2C_STATUS_ATCI : 0)
+        | (dl_length ? I2C_STATUS_DOWNLINK : 0)
+        | (pending ? I2C_STATUS_MAILBOX : 0)
+        | (cbuf_space(&ul_fifo) >= UPLINK_MAX ? I2C_STATUS_UPLINK : 0);
+    bus.block[I2C_REG_IRQ] = irq_flags;
+    bus.block[I2C_REG_IRQ_ENABLE] = irq_enable;
+
+    n = tx_available();
+    bus.block[I2C_REG_ATCI_LENGTH] = n & 0xff;
+    bus.block[I2C_REG_ATCI_LENGTH + 1] = n >> 8;
+
+    n = cbuf_space(&lpuart_rx_fifo);
+    bus.block[I2C_REG_ATCI_SPACE] = n & 0xff;
+    bus.block[I2C_REG_ATCI_SPACE + 1] = n >> 8;
+
+    bus.block[I2C_REG_DL_LENGTH] = dl_length;
+    bus.block[I2C_REG_UL_ID] = ul_id;
+
+    n = ul_space();
+    bus.block[I2C_REG_UL_SPACE] = n & 0xff;
+    bus.block[I2C_REG_UL_SPACE + 1] = n >> 8;
+}
+
+
+static void write_block(unsigned int addr, uint8_t value)
+{
+    switch (addr) {
+        case I2C_REG_IRQ:        irq_flags &= ~value; break;
+        case I2C_REG_IRQ_ENABLE: irq_enable = value; break;
+        default: return;
+    }
+    update_irq_pin();
+}
+
+
+static void start(bool read)
+{
+    bus.active = true;
+    bus.read = read;
+    bus.index = 0;
+    bus.unsent = 0;
+    bus.served = 0;
+    bus.exhausted = false;
+
+    if (read) {
+        if (bus.reg < I2C_REG_BLOCK_SIZE) snapshot();
+        // Flush whatever was left in TXDR by the previous read
+        LL_I2C_ClearFlag_TXE(I2C1);
+    } else {
+        bus.addressed = false;
+        bus.end = false;
+        bus.overrun = false;
+        bus.ul_length = 0;
+    }
+}
+
+
+static void receive(uint8_t value)
+{
+    if (!bus.addressed) {
+        bus.reg = value;
+        bus.addressed = true;
+        return;
+    }
+
+    if (bus.reg < I2C_REG_BLOCK_SIZE) {
+        write_block(bus.reg + bus.index, value);
+    } else if (bus.reg == I2C_REG_ATCI) {
+        if (cbuf_put(&lpuart_rx_fifo, &value, 1) != 1) {
+            if (!bus.overrun) lpuart_overruns++;
+            lpuart_rx_dropped++;
+            bus.overrun = true;
+        }
+        bus.end |= value == LINE_END || value == FRAME_END;
+    } else if (bus.reg == I2C_REG_UPLINK) {
+        // The first byte of the buffer is reserved for the payload length
+        if (bus.ul_length < UPLINK_MAX - 1)
+            bus.uplink[1 + bus.ul_length] = value;
+        bus.ul_length++;
+    }
+    bus.index++;
+}
+
+
+static uint8_t transmit(void)
+{
+    size_t i = bus.index++;
+
+    if (bus.reg < I2C_REG_BLOCK_SIZE) {
+        i += bus.reg;
+        return i < I2C_REG_BLOCK_SIZE ? bus.block[i] : 0;
+    } else if (bus.reg == I2C_REG_ATCI) {
+        // Once the host has read past the end, it gets zeros until the end of
+        // the transfer, even if more data arrives in the meantime
+        if (bus.exhausted || i >= tx_available()) {
+            bus.exhausted = true;
+            return 0;
+        }
+        bus.served++;
+        return lpuart_tx_fifo.buffer[(lpuart_tx_fifo.read + i) & (lpuart_tx_fifo.max_length - 1)];
+    } else if (bus.reg == I2C_REG_DOWNLINK) {
+        return i < dl_length ? dl_buffer[i] : 0;
+    }
+    return 0;
+}
+
+
+static void commit_uplink(void)
+{
+    if (bus.ul_length < UPLINK_HEADER || bus.ul_length > UPLINK_MAX - 1
+        || cbuf_space(&ul_fifo) < bus.ul_length + 1) {
+        ul_full = true;
+        raise_irq(I2C_IRQ_UL_ERROR);
+        return;
+    }
+
+    bus.uplink[0] = bus.ul_length - UPLINK_HEADER;
+    cbuf_put(&ul_fifo, bus.uplink, bus.ul_length + 1);
+    if (cbuf_space(&ul_fifo) < UPLINK_MAX) ul_full = true;
+    system_post(SYSTEM_TASK_LORA);
+}
+
+
+static void finish(void)
+{
+    size_t sent = bus.index - bus.unsent;
+
+    bus.active = false;
+
+    if (bus.read) {
+        if (bus.reg == I2C_REG_ATCI) {
+            cbuf_consume(&lpuart_tx_fifo, sent < bus.served ? sent : bus.served);
+        } else if (bus.reg == I2C_REG_DOWNLINK && sent && dl_length) {
+            dl_length = 0;
+            system_post(SYSTEM_TASK_LORA);
+        }
+        return;
+    }
+
+    if (!bus.index) return;
+
+    if (bus.reg == I2C_REG_ATCI) {
+        if (bus.overrun) raise_irq(I2C_IRQ_OVERRUN);
+        // The end of the transfer stands in for the idle line of the UART and
+        // hands an incomplete payload over to the ATCI
+        if (bus.end || rx_threshold
+            || cbuf_space(&lpuart_rx_fifo) < LPUART_BUFFER_SIZE / 4)
+            system_post(SYSTEM_TASK_ATCI);
+    } else if (bus.reg == I2C_REG_UPLINK) {
+        commit_uplink();
+    }
+}
+
+
+RAMFUNC void I2C1_IRQHandler(void)
+{
+    // An address match also wakes the MCU up from the Stop mode. Keep it out
+    // of the Stop mode until the end of the transfer; the peripheral loses
+    // its kernel clock there.
+    if (LL_I2C_IsActiveFlag_ADDR(I2C1)) {
+        if (bus.active) finish();
+        system_lock(&system_stop_lock, SYSTEM_MODULE_LPUART_RX);
+        start(LL_I2C_GetTransferDirection(I2C1) == LL_I2C_DIRECTION_READ);
+        LL_I2C_ClearFlag_ADDR(I2C1);
+    }
+
+    if (LL_I2C_IsActiveFlag_RXNE(I2C1))
+        receive(LL_I2C_ReceiveData8(I2C1));
+
+    if (LL_I2C_IsActiveFlag_TXIS(I2C1))
+        LL_I2C_TransmitData8(I2C1, transmit());
+
+    // The host NACKs the last byte it wants. The peripheral has already asked
+    // for the next one, which is still in TXDR and is not going to be sent.
+    if (LL_I2C_IsActiveFlag_NACK(I2C1)) {
+        LL_I2C_ClearFlag_NACK(I2C1);
+        if (!LL_I2C_IsActiveFlag_TXE(I2C1) && bus.index) bus.unsent = 1;
+        LL_I2C_ClearFlag_TXE(I2C1);
+    }
+
+    if (LL_I2C_IsActiveFlag_BERR(I2C1)) LL_I2C_ClearFlag_BERR(I2C1);
+    if (LL_I2C_IsActiveFlag_OVR(I2C1)) LL_I2C_ClearFlag_OVR(I2C1);
+
+    if (LL_I2C_IsActiveFlag_STOP(I2C1)) {
+        LL_I2C_ClearFlag_STOP(I2C1);
+        if (bus.active) finish();
+        system_unlock(&system_stop_lock, SYSTEM_MODULE_LPUART_RX);
+    }
+}
+
+
+static void init_gpio(void)
+{
+    GPIO_InitTypeDef gpio = {
+        .Mode = GPIO_MODE_AF_OD,
+        .Pull = GPIO_NOPULL,
+        .Alternate = GPIO_AF4_I2C1,
+        .Speed = GPIO_SPEED_HIGH
+    };
+
+    __HAL_RCC_GPIOB_CLK_ENABLE();
+
+    // The bus needs external pull-up resistors
+    gpio.Pin = GPIO_PIN_8 | GPIO_PIN_9;
+    HAL_GPIO_Init(GPIOB, &gpio);
+
+    // The IRQ output is open-drain too, so that several devices can share it
+    GPIO_InitTypeDef irq = {
+        .Mode = GPIO_MODE_OUTPUT_OD,
+        .Pull = GPIO_NOPULL,
+        .Speed = GPIO_SPEED_LOW
+    };
+
+    gpio_write(IRQ_PORT, IRQ_PIN, 1);
+    gpio_init(IRQ_PORT, IRQ_PIN, &irq);
+}
+
+
+void lpuart_init(unsigned int baudrate)
+{
+    (void)baudrate;
+
+    cbuf_init(&lpuart_tx_fifo, tx_buffer, sizeof(tx_buffer));
+    cbuf_init(&lpuart_rx_fifo, rx_buffer, sizeof(rx_buffer));
+    cbuf_init(&ul_fifo, ul_buffer, sizeof(ul_buffer));
+    tx_paused = sysconf.async_uart ? false : true;
+
+    init_gpio();
+
+    // HSI16 is off in the Stop mode. The peripheral requests it on its own
+    // when it sees its address on the bus (WUPEN).
+    __HAL_RCC_I2C1_CONFIG(RCC_I2C1CLKSOURCE_HSI);
+    __HAL_RCC_I2C1_CLK_ENABLE();
+
+    LL_I2C_Disable(I2C1);
+    LL_I2C_SetTiming(I2C1, I2C_TIMING);
+    LL_I2C_EnableClockStretching(I2C1);
+    LL_I2C_SetOwnAddress1(I2C1, ATCI_I2C_ADDRESS << 1, LL_I2C_OWNADDRESS1_7BIT);
+    LL_I2C_EnableOwnAddress1(I2C1);
+    LL_I2C_EnableWakeUpFromStop(I2C1);
+    LL_I2C_Enable(I2C1);
+
+    LL_I2C_EnableIT_ADDR(I2C1);
+    LL_I2C_EnableIT_RX(I2C1);
+    LL_I2C_EnableIT_TX(I2C1);
+    LL_I2C_EnableIT_NACK(I2C1);
+    LL_I2C_EnableIT_STOP(I2C1);
+    LL_I2C_EnableIT_ERR(I2C1);
+
+    // EXTI line 23 carries the wake-up event of I2C1
+    LL_EXTI_EnableIT_0_31(LL_EXTI_LINE_23);
+
+    HAL_NVIC_SetPriority(I2C1_IRQn, IRQ_PRIORITY_LPUART, 0);
+    HAL_NVIC_EnableIRQ(I2C1_IRQn);
+}
+
+
+cbuf_view_t *lpuart_tail(cbuf_view_t *tail)
+{
+    return cbuf_tail(&lpuart_tx_fifo, tail);
+}
+
+
+void lpuart_produce(size_t length)
+{
+#if BENCH == 1
+    if (lpuart_mute) return;
+#endif
+
+    cbuf_produce(&lpuart_tx_fifo, length);
+    if (length && !tx_paused) raise_irq(I2C_IRQ_ATCI);
+}
+
+
+size_t lpuart_write(const char *buffer, size_t length)
+{
+    cbuf_view_t v;
+
+    size_t written = cbuf_copy_in(lpuart_tail(&v), buffer, length);
+    lpuart_produce(written);
+    return written;
+}
+
+
+void lpuart_wait_for_space(size_t length)
+{
+    uint32_t masked, start;
+
+    if (cbuf_space(&lpuart_tx_fifo) >= length) return;
+    lpuart_tx_stalls++;
+    start = rtc_get_timer_value();
+
+    // The host makes room by reading ATCI. The MCU may enter the Stop mode in
+    // the meantime, the next transfer wakes it up.
+    while (cbuf_space(&lpuart_tx_fifo) < length) {
+        system_yield();
+        masked = disable_irq();
+        if (cbuf_space(&lpuart_tx_fifo) < length)
+            system_idle();
+        reenable_irq(masked);
+    }
+
+    lpuart_tx_stall_time += rtc_tick2ms(rtc_get_timer_value() - start);
+}
+
+
+void lpuart_write_blocking(const char *buffer, size_t length)
+{
+    size_t written;
+    while (length) {
+        written = lpuart_write(buffer, length);
+        buffer += written;
+        length -= written;
+
+        if (written == 0) lpuart_wait_for_space(1);
+    }
+}
+
+
+size_t lpuart_read(char *buffer, size_t length)
+{
+    cbuf_view_t v;
+
+    cbuf_head(&lpuart_rx_fifo, &v);
+    size_t rv = cbuf_copy_out(buffer, &v, length);
+    lpuart_consume(rv);
+    return rv;
+}
+
+
+void lpuart_consume(size_t length)
+{
+    cbuf_consume(&lpuart_rx_fifo, length);
+}
+
+
+void lpuart_set_rx_threshold(size_t length)
+{
+    rx_threshold = length;
+    if (length && cbuf_length(&lpuart_rx_fifo) >= length)
+        system_post(SYSTEM_TASK_ATCI);
+}
+
+
+// Give the host a chance to read the rest of the TX FIFO, e.g., the response
+// to ATZ, but do not wait for a host that does not read at all
+void lpuart_flush(void)
+{
+    uint32_t last = rtc_get_timer_value();
+    size_t length = cbuf_length(&lpuart_tx_fifo), n;
+
+    while ((n = tx_available()) != 0) {
+        if (n != length) {
+            length = n;
+            last = rtc_get_timer_value();
+        } else if (rtc_tick2ms(rtc_get_timer_value() - last) > 100) {
+            break;
+        }
+    }
+}
+
+
+// The peripheral keeps watching the bus in the Stop mode (WUPEN) and needs
+// no attention around it
+
+void lpuart_before_stop(void)
+{
+}
+
+
+void lpuart_after_stop(void)
+{
+}
+
+
+bool lpuart_uses_lse(void)
+{
+    return false;
+}
+
+
+void lpuart_resume_tx(void)
+{
+    tx_paused = false;
+    if (cbuf_length(&lpuart_tx_fifo)) raise_irq(I2C_IRQ_ATCI);
+}
+
+
+void lpuart_pause_tx(void)
+{
+    tx_paused = true;
+}
+
+
+void lpuart_set_pending(bool value)
+{
+    if (value && !pending) raise_irq(I2C_IRQ_MAILBOX);
+    pending = value;
+}
+
+
+// Hand the uplinks written by the host to the transmit queue. A message that
+// does not fit stays in the FIFO until the queue has room again, which
+// invokes lrw_process.
+static void forward_uplinks(void)
+{
+    uint8_t buf[UPLINK_MAX];
+    cbuf_view_t v;
+    size_t length;
+    int id;
+
+    while (cbuf_length(&ul_fifo)) {
+        cbuf_head(&ul_fifo, &v);
+        cbuf_copy_out(buf, &v, 1);
+        length = 1 + UPLINK_HEADER + buf[0];
+        cbuf_copy_out(buf, &v, length);
+
+        id = lrw_enqueue(buf[1], buf + 1 + UPLINK_HEADER, buf[0], buf[2] & 1, NULL);
+        if (id < 0) break;
+
+        ul_id = id;
+        cbuf_consume(&ul_fifo, length);
+    }
+
+    if (ul_full && cbuf_space(&ul_fifo) >= UPLINK_MAX) {
+        ul_full = false;
+        raise_irq(I2C_IRQ_UPLINK);
+    }
+}
+
+
+// Move the oldest downlink the ATCI is not going to deliver into DOWNLINK
+static void load_downlink(void)
+{
+    const lrw_downlink_t *d;
+
+    if (dl_length) return;
+
+    d = lrw_rx_queue_peek();
+    if (d == NULL) return;
+    if (sysconf.async_uart && !d->stored) return;
+
+    dl_buffer[0] = d->port;
+    dl_buffer[1] = d->length;
+    dl_buffer[2] = d->rssi & 0xff;
+    dl_buffer[3] = (uint16_t)d->rssi >> 8;
+    dl_buffer[4] = d->snr;
+    dl_buffer[5] = d->multicast ? 1 : 0;
+    if (d->length) memcpy(dl_buffer + DOWNLINK_HEADER, d->payload, d->length);
+
+    dl_length = DOWNLINK_HEADER + d->length;
+    lrw_rx_queue_pop();
+    raise_irq(I2C_IRQ_DOWNLINK);
+}
+
+
+void i2c_target_process(void)
+{
+    forward_uplinks();
+    load_downlink();
+}
+
+#endif // ATCI_I2C
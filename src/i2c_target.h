@@ -0,0 +1,84 @@
+#ifndef _I2C_TARGET_H
+#define _I2C_TARGET_H
+
+/*! @brief The host interface over I2C (ATCI_I2C=1)
+ *
+ * The modem is an I2C target on I2C1 (SCL on PB8, SDA on PB9) at the 7-bit
+ * address ATCI_I2C_ADDRESS and replaces LPUART1 as the transport of the AT
+ * command interface. Standard and fast mode are supported. The modem stretches
+ * the clock while it is busy, so the host needs no delays between transfers.
+ * I2C1 is clocked from HSI16 and wakes the modem up from the Stop mode on an
+ * address match; the host does not need to wake the modem up first.
+ *
+ * Each write starts with a register address byte. A read returns the
+ * register selected by the last write, typically in a write-read transfer
+ * with a repeated start. The addresses below 0x10 form a block of status
+ * registers that can be read or written in one transfer, the address
+ * increments with each byte. The other registers are FIFOs: all bytes of a
+ * transfer go to or come from the same FIFO.
+ *
+ *   0x00 STATUS      (R)   Conditions, I2C_STATUS_*
+ *   0x01 IRQ         (R/W) Latched events, I2C_IRQ_*. Write ones to clear.
+ *   0x02 IRQ_ENABLE  (R/W) Events that assert the IRQ output, all by default
+ *   0x03 ATCI_LENGTH (R)   Bytes waiting in ATCI, 16 bits little-endian
+ *   0x05 ATCI_SPACE  (R)   Bytes that can be written into ATCI, 16 bits
+ *   0x07 DL_LENGTH   (R)   Size of the record waiting in DOWNLINK, 0 if none
+ *   0x08 UL_ID       (R)   Message identifier of the last queued uplink
+ *   0x09 UL_SPACE    (R)   Bytes free in the UPLINK FIFO, 16 bits
+ *
+ *   0x10 ATCI        (R/W) The AT command channel. Writes carry AT commands
+ *                          in the text or the framed mode, reads return the
+ *                          responses and asynchronous messages, exactly as
+ *                          on the UART.
+ *   0x20 UPLINK      (W)   An uplink message per transfer: port, flags
+ *                          (bit 0: confirmed), and the payload. The message
+ *                          is handed to the transmit queue (see lrw_enqueue)
+ *                          and completes with an uplink event on ATCI.
+ *   0x30 DOWNLINK    (R)   The oldest received downlink: port, payload
+ *                          length, RSSI (16 bits), SNR, flags (bit 0:
+ *                          multicast), and the payload. The record is
+ *                          removed once the host has read from it.
+ *
+ * Downlinks become available in DOWNLINK if they stay in the receive queue on
+ * the modem, i.e., in the polling mode (AT$ASYNC=0) or if routed to the
+ * mailbox with AT$DLROUTE. Otherwise they are written to ATCI as +RECV.
+ *
+ * The IRQ output (PB5, open-drain, active low) is asserted while any of the
+ * enabled events is latched in IRQ.
+ */
+
+#define I2C_REG_STATUS      0x00
+#define I2C_REG_IRQ         0x01
+#define I2C_REG_IRQ_ENABLE  0x02
+#define I2C_REG_ATCI_LENGTH 0x03
+#define I2C_REG_ATCI_SPACE  0x05
+#define I2C_REG_DL_LENGTH   0x07
+#define I2C_REG_UL_ID       0x08
+#define I2C_REG_UL_SPACE    0x09
+#define I2C_REG_BLOCK_SIZE  0x10
+#define I2C_REG_ATCI        0x10
+#define I2C_REG_UPLINK      0x20
+#define I2C_REG_DOWNLINK    0x30
+
+#define I2C_STATUS_ATCI     (1 << 0)  // ATCI has data for the host
+#define I2C_STATUS_DOWNLINK (1 << 1)  // DOWNLINK holds a record
+#define I2C_STATUS_MAILBOX  (1 << 2)  // The mailbox is not empty (AT$ASYNC=0)
+#define I2C_STATUS_UPLINK   (1 << 3)  // UPLINK can take a message of any size
+
+#define I2C_IRQ_ATCI        (1 << 0)  // New data in ATCI
+#define I2C_IRQ_DOWNLINK    (1 << 1)  // A record has been placed in DOWNLINK
+#define I2C_IRQ_MAILBOX     (1 << 2)  // The mailbox has received an entry
+#define I2C_IRQ_UPLINK      (1 << 3)  // UPLINK can take a message of any size again
+#define I2C_IRQ_UL_ERROR    (1 << 4)  // An uplink message was rejected
+#define I2C_IRQ_OVERRUN     (1 << 5)  // Data written into ATCI was dropped
+
+#if ATCI_I2C == 1
+
+//! @brief Move messages between the FIFOs and the LoRaWAN queues. Invoke
+//! from the main loop.
+
+void i2c_target_process(void);
+
+#endif // ATCI_I2C
+
+#endif // _I2C_TARGET_H
@@ -3,6 +3,34 @@
 
 #include <stm/include/cmsis_compiler.h>
 
+// Place a function into the .ramfunc section, which the startup code copies to
+// RAM along with .data (see the linker script). Used for interrupt handlers and
+// the functions they depend on, which then run without flash wait states and
+// without waiting for the flash to power up after Sleep. Calls between flash
+// and RAM go through linker-generated veneers. See RAM_ISR in the Makefile.
+#if RAM_ISR == 1
+#define RAMFUNC __attribute__((section(".ramfunc")))
+#else
+#define RAMFUNC
+#endif
+
+
+// The NVIC priority of every interrupt the firmware enables. The Cortex-M0+
+// implements four levels, 0 being the highest. The RTC alarm drives the timer
+// server, which opens the RX windows, and the SX1276 DIO interrupts timestamp
+// received frames. Both preempt the ATCI and debug log interrupts, which may
+// run for tens of microseconds under UART load. Use TRACE_IRQ to measure how
+// long each handler runs.
+#define IRQ_PRIORITY_RTC    0  // RTC alarm (timer server)
+#define IRQ_PRIORITY_EXTI   0  // SX1276 DIO lines and the other EXTI pins, see below
+#define IRQ_PRIORITY_FLASH  1  // EEPROM write completion
+#define IRQ_PRIORITY_LPUART 2  // LPUART1 and its DMA channels (ATCI)
+#define IRQ_PRIORITY_LOG    3  // Debug USART
+
+// The factory reset and LPUART attach pins share EXTI4_15 with DIO0, DIO3, and
+// DIO4. A priority set for one line applies to all lines of the vector, thus
+// every EXTI pin uses IRQ_PRIORITY_EXTI. Their handlers are short.
+
 
 __STATIC_FORCEINLINE uint32_t disable_irq(void)
 {
@@ -1,7 +1,12 @@
 #include "lpuart.h"
+
+#if ATCI_RTT == 0 && ATCI_I2C == 0
+
+#include <string.h>
 #include <stm/STM32L0xx_HAL_Driver/Inc/stm32l0xx_ll_dma.h>
 #include <stm/STM32L0xx_HAL_Driver/Inc/stm32l0xx_ll_lpuart.h>
 #include <stm/STM32L0xx_HAL_Driver/Inc/stm32l0xx_hal.h>
+#include <LoRaWAN/Utilities/timeServer.h>
 #include "halt.h"
 #include "utils.h"
 #include "cbuf.h"
@@ -10,6 +15,8 @@
 #include "system.h"
 #include "cmd.h"
 #include "nvm.h"
+#include "rtc.h"
+#include "trace.h"
 
 #ifndef LPUART_BUFFER_SIZE
 #define LPUART_BUFFER_SIZE 512
@@ -19,26 +26,71 @@
 #define LPUART_DMA_BUFFER_SIZE 64
 #endif
 
+// The highest baud rate at which LPUART1 is clocked from the 32.768 kHz LSE
+// rather than from HSI16. The LPUART needs a kernel clock of at least three
+// times the baud rate.
+#ifndef LPUART_LSE_MAX_BAUDRATE
+#define LPUART_LSE_MAX_BAUDRATE 9600
+#endif
+
+// How long to wait for the peripheral to acknowledge being enabled (ms)
+#define LPUART_ENABLE_TIMEOUT 100
+
+#if (LPUART_BUFFER_SIZE & (LPUART_BUFFER_SIZE - 1)) != 0
+#error LPUART_BUFFER_SIZE must be a power of two
+#endif
+
+#if LPUART_FLOW_CONTROL != 0 && (DEBUG_MCU == 1 || DETACHABLE_LPUART == 1)
+#error LPUART_FLOW_CONTROL cannot be combined with DEBUG_MCU or DETACHABLE_LPUART
+#endif
+
 
-static UART_HandleTypeDef port;
+// The driver programs LPUART1 and its two DMA channels through the LL
+// interface. Channel 6 receives into dma_buffer in circular mode and channel 7
+// transmits from the TX FIFO, see start_dma_transmission.
+#define DMA_RX LL_DMA_CHANNEL_6
+#define DMA_TX LL_DMA_CHANNEL_7
+
+// True if LPUART1 is clocked from the LSE, see init_clock. The LSE keeps
+// running in the Stop mode, so the peripheral receives a complete frame on its
+// own and the MCU only needs to wake up to let the DMA move it to memory.
+static bool lse_clock;
 
 
 // The actual buffer holding the data to be transmitted
 static unsigned char tx_buffer[LPUART_BUFFER_SIZE];
 // The number of bytes currently being transmitted by DMA (<= tx_bytes_left)
 static volatile size_t tx_bytes_transmitting; 
-// The number of bytes left to transmit before DMA can be paused (<= lpuart_tx_fifo.length)
+// The number of bytes left to transmit before DMA can be paused (<= cbuf_length(&lpuart_tx_fifo))
 static volatile size_t tx_bytes_left;         
+// True while the TX DMA channel is moving data into the peripheral
+static bool volatile tx_dma;
+// True while the peripheral sends the last frames after the DMA has finished,
+// see DMA1_Channel4_5_6_7_IRQHandler
+static bool volatile tx_draining;
 // True if LPUART transmissions are paused
 bool volatile lpuart_tx_paused;
 // A circular buffer implementation over tx_buffer    
 volatile cbuf_t lpuart_tx_fifo;
+#if BENCH == 1
+// If true, data written into the TX FIFO is dropped, see bench.c
+bool lpuart_mute;
+#endif
 
 
 // The following variables implement the RX direction (host to modem)
 static unsigned char dma_buffer[LPUART_DMA_BUFFER_SIZE];
 static unsigned char rx_buffer[LPUART_BUFFER_SIZE];
 volatile cbuf_t lpuart_rx_fifo;
+volatile uint32_t lpuart_overruns;
+volatile uint32_t lpuart_rx_dropped;
+uint32_t lpuart_tx_stalls;
+uint32_t lpuart_tx_stall_time;
+
+#if LPUART_FLOW_CONTROL == 1
+// True if the RX DMA has been paused because the RX FIFO is almost full
+static bool volatile rx_paused;
+#endif
 
 
 #if DETACHABLE_LPUART == 1
@@ -46,123 +98,135 @@ static bool volatile attached;
 #endif // DETACHABLE_LPUART
 
 
-// This function is invoked from the IRQ handler context
-static void enqueue(unsigned char *data, size_t len)
+// With AT$COALESCE, asynchronous notifications written while the ATCI is idle
+// are held in the TX FIFO. Each notification restarts the coalescing window
+// (system_coalesce_window ms). Once the window expires, all held data is
+// released in a single burst. See release_held.
+static TimerEvent_t coalesce_timer;
+
+#if HOST_WAKE_PIN == 1
+// The host wake-up output. In the asynchronous mode, the pin is driven high for
+// the duration of each burst released after the coalescing window. In the
+// polling mode, the pin is high while data is waiting for the host. Either way,
+// the host can sleep until the rising edge.
+#define WAKE_PORT GPIOB
+#define WAKE_PIN  GPIO_PIN_5
+#define host_wake(v) gpio_write(WAKE_PORT, WAKE_PIN, (v))
+#else
+#define host_wake(v) do {} while (0)
+#endif
+
+// True while a burst released from the coalescing window is being transmitted
+static bool volatile bursting;
+
+// True if the host has entries waiting in the mailbox, see lpuart_set_pending
+static bool volatile pending;
+
+
+// The ATCI task is only woken up once it has something to do: a complete line
+// (or SLIP frame), rx_threshold bytes of payload data, or a nearly full RX FIFO.
+// The DMA half and full transfer interrupts otherwise just move the data into
+// the RX FIFO. See lpuart_set_rx_threshold.
+#define LINE_END  '\r'
+#define FRAME_END 0xc0
+
+static volatile size_t rx_threshold;
+
+
+// This function is invoked from the IRQ handler context. Returns true if the
+// data contains the end of a line or frame.
+RAMFUNC static bool enqueue(unsigned char *data, size_t len)
 {
     size_t stored = cbuf_put(&lpuart_rx_fifo, data, len);
-    if (stored != len)
+    if (stored != len) {
+        lpuart_overruns++;
+        lpuart_rx_dropped += len - stored;
         log_warning("lpuart: Read overrun, %d bytes discarded", len - stored);
+    }
+
+#if LPUART_FLOW_CONTROL == 1
+    // If the RX FIFO could not accommodate another full DMA buffer, stop
+    // serving DMA requests. The receive data register then stays full and the
+    // peripheral deasserts RTS, asking the host to stop sending. The DMA is
+    // resumed by lpuart_consume once the ATCI has processed some data.
+    if (cbuf_space(&lpuart_rx_fifo) < ARRAY_LEN(dma_buffer)) {
+        LL_LPUART_DisableDMAReq_RX(LPUART1);
+        rx_paused = true;
+    }
+#endif
+
+    return memchr(data, LINE_END, len) != NULL || memchr(data, FRAME_END, len) != NULL;
 }
 
 
-// This function is invoked from the IRQ handler context
-static void rx_callback(void)
+// This function is invoked from the IRQ handler context. The parameter idle is
+// true if the host has stopped transmitting. An incomplete payload is handed
+// over to the ATCI at that point, so that it can time out or be aborted.
+RAMFUNC static void rx_callback(bool idle)
 {
     static size_t old_pos;
     size_t pos;
+    bool end;
 
-    pos = ARRAY_LEN(dma_buffer) - LL_DMA_GetDataLength(DMA1, LL_DMA_CHANNEL_6);
+    pos = ARRAY_LEN(dma_buffer) - LL_DMA_GetDataLength(DMA1, DMA_RX);
     if (pos == old_pos) return;
 
     if (pos > old_pos) {
-        enqueue(&dma_buffer[old_pos], pos - old_pos);
+        end = enqueue(&dma_buffer[old_pos], pos - old_pos);
     } else {
-        enqueue(&dma_buffer[old_pos], ARRAY_LEN(dma_buffer) - old_pos);
-        if (pos > 0) enqueue(&dma_buffer[0], pos);
+        end = enqueue(&dma_buffer[old_pos], ARRAY_LEN(dma_buffer) - old_pos);
+        if (pos > 0) end |= enqueue(&dma_buffer[0], pos);
     }
     old_pos = pos;
+
+    if (end
+        || (rx_threshold && (idle || cbuf_length(&lpuart_rx_fifo) >= rx_threshold))
+        || cbuf_space(&lpuart_rx_fifo) < 2 * ARRAY_LEN(dma_buffer))
+        system_post(SYSTEM_TASK_ATCI);
 }
 
 
+void lpuart_set_rx_threshold(size_t length)
+{
+    rx_threshold = length;
+    if (length && cbuf_length(&lpuart_rx_fifo) >= length)
+        system_post(SYSTEM_TASK_ATCI);
+}
+
+
+static void on_coalesce_timer(void *ctx);
+
+
 static void init_tx(void)
 {
     cbuf_init(&lpuart_tx_fifo, tx_buffer, sizeof(tx_buffer));
     tx_bytes_transmitting = 0;
     tx_bytes_left = 0;
-    lpuart_tx_paused = sysconf.async_uart ? false : true;
+    lpuart_tx_paused = sysconf.async_uart && !system_coalesce_window() ? false : true;
 #if DETACHABLE_LPUART == 1
     attached = true;
 #endif
-}
+    TimerInit(&coalesce_timer, on_coalesce_timer);
 
+#if HOST_WAKE_PIN == 1
+    GPIO_InitTypeDef cfg = {
+        .Mode = GPIO_MODE_OUTPUT_PP,
+        .Pull = GPIO_NOPULL,
+        .Speed = GPIO_SPEED_LOW
+    };
 
-static void init_rx(void)
-{
-    cbuf_init(&lpuart_rx_fifo, rx_buffer, sizeof(rx_buffer));
+    gpio_write(WAKE_PORT, WAKE_PIN, 0);
+    gpio_init(WAKE_PORT, WAKE_PIN, &cfg);
+#endif
 }
 
 
-void lpuart_init(unsigned int baudrate)
+static void init_rx(void)
 {
-    init_tx();
-    init_rx();
-
-    uint32_t masked = disable_irq();
-
-    port.Instance = LPUART1;
-    port.Init.Mode = UART_MODE_TX_RX;
-    port.Init.BaudRate = baudrate;
-    port.Init.WordLength = UART_WORDLENGTH_8B;
-    port.Init.StopBits = UART_STOPBITS_1;
-    port.Init.Parity = UART_PARITY_NONE;
-    port.Init.HwFlowCtl = UART_HWCONTROL_NONE;
-
-    if (HAL_UART_Init(&port) != HAL_OK) goto error;
-
-    __HAL_UART_DISABLE(&port);
-
-    // Do not disable DMA on parity, framing, or noise errors. This will
-    // configure the LPUART peripheral not to raise RXNE, which will NOT assert
-    // DMA request and the erroneous data is skipped. The following byte will be
-    // transferred again.
-    //
-    LL_LPUART_DisableDMADeactOnRxErr(port.Instance);
-
-    // Disable overrun detection. If we are not fast enough at receiving data,
-    // let the new byte overwrite the previous one without setting the overrun
-    // event. The application layer (ATCI) can deal with such errors.
-    LL_LPUART_DisableOverrunDetect(port.Instance);
-
-    __HAL_UART_ENABLE(&port);
-    uint32_t tickstart = HAL_GetTick();
-    if (UART_WaitOnFlagUntilTimeout(&port, USART_ISR_REACK, RESET, tickstart, HAL_UART_TIMEOUT_VALUE) != HAL_OK)
-        goto error;
-
-    // Wake the MCU up from Stop mode once a full frame has been received
-    UART_WakeUpTypeDef wake = { .WakeUpEvent = LL_LPUART_WAKEUP_ON_RXNE };
-    HAL_UARTEx_StopModeWakeUpSourceConfig(&port, wake);
-
-    if (HAL_UART_Receive_DMA(&port, dma_buffer, ARRAY_LEN(dma_buffer)) != HAL_OK)
-        goto error;
-
-    HAL_UARTEx_EnableStopMode(&port);
-
-    // Enable the idle line detection interrupt. We use the event to transmit
-    // data from the DMA buffer to the input FIFO queue and to re-enable the
-    // low-power Stop mode.
-    LL_LPUART_EnableIT_IDLE(port.Instance);
-
-    // Disable the receive-buffer-not-empty interrupt. We use DMA to receive
-    // data over LPUART1 so that the receiving process works even when
-    // interrupts don't, e.g., during heavy memory bus activity (writes to
-    // EEPROM).
-    LL_LPUART_DisableIT_RXNE(port.Instance);
-
-    // Disable framing, noise, and overrun interrupt generation. We don't want
-    // those errors to stop DMA transfers. We ignore such errors and let
-    // the ATCI recover at the application layer.
-    LL_LPUART_DisableIT_ERROR(port.Instance);
-
-    // Disable parity error interrupts. Although we do not enable parity on the
-    // LPUART port, we call this function anyway to be sure.
-    LL_LPUART_DisableIT_PE(port.Instance);
-
-    reenable_irq(masked);
-    return;
-
-error:
-    reenable_irq(masked);
-    halt("Error while initializing LPUART port");
+    cbuf_init(&lpuart_rx_fifo, rx_buffer, sizeof(rx_buffer));
+#if LPUART_FLOW_CONTROL == 1
+    rx_paused = false;
+#endif
 }
 
 
@@ -184,9 +248,27 @@ static void init_gpio(void)
     gpio.Pin = GPIO_PIN_3;
     gpio.Pull = GPIO_PULLUP;
     HAL_GPIO_Init(GPIOA, &gpio);
+
+#if LPUART_FLOW_CONTROL != 0
+    __HAL_RCC_GPIOB_CLK_ENABLE();
+    gpio.Alternate = GPIO_AF4_LPUART1;
+
+#if LPUART_FLOW_CONTROL == 1
+    // CTS is pulled up so that a disconnected host does not stall the modem
+    // right away. The output FIFO will fill up regardless.
+    gpio.Pin = GPIO_PIN_13;
+    gpio.Pull = GPIO_PULLUP;
+    HAL_GPIO_Init(GPIOB, &gpio);
+#endif
+
+    gpio.Pin = GPIO_PIN_14;
+    gpio.Pull = GPIO_NOPULL;
+    HAL_GPIO_Init(GPIOB, &gpio);
+#endif
 }
 
 
+#if DETACHABLE_LPUART == 1
 static void deinit_gpio(void)
 {
     GPIO_InitTypeDef gpio = {
@@ -202,93 +284,157 @@ static void deinit_gpio(void)
 
     gpio.Pin = GPIO_PIN_3;
     HAL_GPIO_Init(GPIOA, &gpio);
+
+#if LPUART_FLOW_CONTROL != 0
+    __HAL_RCC_GPIOB_CLK_ENABLE();
+    gpio.Pin = GPIO_PIN_13 | GPIO_PIN_14;
+    HAL_GPIO_Init(GPIOB, &gpio);
+#endif
 }
+#endif // DETACHABLE_LPUART
 
 
-void HAL_UART_MspInit(UART_HandleTypeDef *port)
+static void init_clock(unsigned int baudrate)
 {
-    /* Enable peripherals and GPIO Clocks */
-    __HAL_RCC_GPIOA_CLK_ENABLE();
-    __HAL_RCC_GPIOA_CLK_ENABLE();
-
     /* Enable LPUART clock */
     __LPUART1_CLK_ENABLE();
 
-    /* select LPUART clock source */
-    RCC_PeriphCLKInitTypeDef clock = {
-        .PeriphClockSelection = RCC_PERIPHCLK_LPUART1,
-        .Lpuart1ClockSelection = RCC_LPUART1CLKSOURCE_HSI
-    };
-    HAL_RCCEx_PeriphCLKConfig(&clock);
+    /* select LPUART clock source. The LSE is enabled by system_init for the
+     * RTC. HSI16, which is needed for the higher baud rates, is woken up by
+     * the LPUART at every start bit received in the Stop mode and the MCU has
+     * to stay awake until the end of the transfer. */
+    lse_clock = baudrate <= LPUART_LSE_MAX_BAUDRATE;
+    __HAL_RCC_LPUART1_CONFIG(lse_clock ? RCC_LPUART1CLKSOURCE_LSE : RCC_LPUART1CLKSOURCE_HSI);
+}
+
+
+static void init_dma(void)
+{
+    uint32_t mode = LL_DMA_PRIORITY_LOW | LL_DMA_PERIPH_NOINCREMENT | LL_DMA_MEMORY_INCREMENT |
+        LL_DMA_PDATAALIGN_BYTE | LL_DMA_MDATAALIGN_BYTE;
 
     /* Enable DMA clock */
     __HAL_RCC_DMA1_CLK_ENABLE();
 
-    static DMA_HandleTypeDef tx_dma = {
-        .Instance = DMA1_Channel7,
-        .Init = {
-            .Direction           = DMA_MEMORY_TO_PERIPH,
-            .Priority            = DMA_PRIORITY_LOW,
-            .Mode                = DMA_NORMAL,
-            .Request             = DMA_REQUEST_5,
-            .PeriphDataAlignment = DMA_PDATAALIGN_BYTE,
-            .MemDataAlignment    = DMA_MDATAALIGN_BYTE,
-            .PeriphInc           = DMA_PINC_DISABLE,
-            .MemInc              = DMA_MINC_ENABLE
-        }
-    };
+    LL_DMA_DisableChannel(DMA1, DMA_TX);
+    LL_DMA_ConfigTransfer(DMA1, DMA_TX, mode | LL_DMA_DIRECTION_MEMORY_TO_PERIPH | LL_DMA_MODE_NORMAL);
+    LL_DMA_SetPeriphRequest(DMA1, DMA_TX, LL_DMA_REQUEST_5);
+    LL_DMA_SetPeriphAddress(DMA1, DMA_TX, (uint32_t)&LPUART1->TDR);
+    LL_DMA_ClearFlag_GI7(DMA1);
+    LL_DMA_EnableIT_TC(DMA1, DMA_TX);
+    LL_DMA_EnableIT_TE(DMA1, DMA_TX);
+
+    // The RX channel runs continuously. The half-transfer and transfer-complete
+    // interrupts move the data out of each half of dma_buffer, see rx_callback.
+    LL_DMA_DisableChannel(DMA1, DMA_RX);
+    LL_DMA_ConfigTransfer(DMA1, DMA_RX, mode | LL_DMA_DIRECTION_PERIPH_TO_MEMORY | LL_DMA_MODE_CIRCULAR);
+    LL_DMA_SetPeriphRequest(DMA1, DMA_RX, LL_DMA_REQUEST_5);
+    LL_DMA_ConfigAddresses(DMA1, DMA_RX, (uint32_t)&LPUART1->RDR, (uint32_t)dma_buffer,
+        LL_DMA_DIRECTION_PERIPH_TO_MEMORY);
+    LL_DMA_SetDataLength(DMA1, DMA_RX, ARRAY_LEN(dma_buffer));
+    LL_DMA_ClearFlag_GI6(DMA1);
+    LL_DMA_EnableIT_HT(DMA1, DMA_RX);
+    LL_DMA_EnableIT_TC(DMA1, DMA_RX);
+    LL_DMA_EnableIT_TE(DMA1, DMA_RX);
+    LL_DMA_EnableChannel(DMA1, DMA_RX);
+
+    HAL_NVIC_SetPriority(DMA1_Channel4_5_6_7_IRQn, IRQ_PRIORITY_LPUART, 0);
+    HAL_NVIC_EnableIRQ(DMA1_Channel4_5_6_7_IRQn);
+}
 
-    if (HAL_DMA_Init(&tx_dma) != HAL_OK)
-        halt("Failed to initialize DMA for LPUART1 TX path");
 
-    __HAL_LINKDMA(port, hdmatx, tx_dma);
+void lpuart_init(unsigned int baudrate)
+{
+    uint32_t fck, brr, start;
 
+    init_tx();
+    init_rx();
 
-    static DMA_HandleTypeDef rx_dma = {
-        .Instance = DMA1_Channel6,
-        .Init = {
-            .Direction           = DMA_PERIPH_TO_MEMORY,
-            .Priority            = DMA_PRIORITY_LOW,
-            .Mode                = DMA_CIRCULAR,
-            .Request             = DMA_REQUEST_5,
-            .PeriphDataAlignment = DMA_PDATAALIGN_BYTE,
-            .MemDataAlignment    = DMA_MDATAALIGN_BYTE,
-            .PeriphInc           = DMA_PINC_DISABLE,
-            .MemInc              = DMA_MINC_ENABLE
-        }
-    };
+    uint32_t masked = disable_irq();
 
-    if (HAL_DMA_Init(&rx_dma) != HAL_OK)
-        halt("Failed to initialize DMA for LPUART1 RX path");
+    init_clock(baudrate);
+
+    // The baud rate register holds 256 * fck / baudrate, which must be within
+    // 0x300 and 0xfffff
+    fck = lse_clock ? LSE_VALUE : HSI_VALUE;
+    brr = ((uint64_t)fck * 256 + baudrate / 2) / baudrate;
+    if (brr < 0x300 || brr > 0xfffff) goto error;
+
+    // 8N1 in both directions. The peripheral must be disabled while it is
+    // being configured.
+    LL_LPUART_Disable(LPUART1);
+    WRITE_REG(LPUART1->CR1, USART_CR1_TE | USART_CR1_RE);
+    WRITE_REG(LPUART1->CR2, 0);
+    WRITE_REG(LPUART1->CR3, 0);
+    WRITE_REG(LPUART1->BRR, brr);
+
+#if LPUART_FLOW_CONTROL == 1
+    LL_LPUART_SetHWFlowCtrl(LPUART1, LL_LPUART_HWCONTROL_RTS_CTS);
+#elif LPUART_FLOW_CONTROL == 2
+    // Assert DE (active high) for the duration of each transmitted frame. No
+    // extra assertion or deassertion time is needed for typical transceivers.
+    LL_LPUART_EnableDEMode(LPUART1);
+    LL_LPUART_SetDESignalPolarity(LPUART1, LL_LPUART_DE_POLARITY_HIGH);
+#endif
 
-    /* Associate the initialized DMA handle with the LPUART handle */
-    __HAL_LINKDMA(port, hdmarx, rx_dma);
+    // Do not disable DMA on parity, framing, or noise errors. This will
+    // configure the LPUART peripheral not to raise RXNE, which will NOT assert
+    // DMA request and the erroneous data is skipped. The following byte will be
+    // transferred again.
+    //
+    LL_LPUART_DisableDMADeactOnRxErr(LPUART1);
 
-    HAL_NVIC_SetPriority(DMA1_Channel4_5_6_7_IRQn, 0, 0);
-    HAL_NVIC_EnableIRQ(DMA1_Channel4_5_6_7_IRQn);
+    // Disable overrun detection. If we are not fast enough at receiving data,
+    // let the new byte overwrite the previous one without setting the overrun
+    // event. The application layer (ATCI) can deal with such errors.
+    LL_LPUART_DisableOverrunDetect(LPUART1);
 
-    HAL_NVIC_SetPriority(RNG_LPUART1_IRQn, 0, 0);
-    HAL_NVIC_EnableIRQ(RNG_LPUART1_IRQn);
+    // Raise the character match interrupt at the end of each AT command line,
+    // see rx_callback. The character can only be configured while the
+    // peripheral is disabled.
+    LL_LPUART_ConfigNodeAddress(LPUART1, LL_LPUART_ADDRESS_DETECT_7B, LINE_END);
 
-    /* Configure the GPIO pins used by LPUART */
-    init_gpio();
-}
+    // Wake the MCU up from Stop mode once a full frame has been received
+    LL_LPUART_SetWKUPType(LPUART1, LL_LPUART_WAKEUP_ON_RXNE);
 
+    init_dma();
 
-void HAL_UART_MspDeInit(UART_HandleTypeDef *port)
-{
-    deinit_gpio();
+    LL_LPUART_Enable(LPUART1);
+    start = rtc_get_timer_value();
+    while (!LL_LPUART_IsActiveFlag_TEACK(LPUART1) || !LL_LPUART_IsActiveFlag_REACK(LPUART1)) {
+        if (rtc_tick2ms(rtc_get_timer_value() - start) > LPUART_ENABLE_TIMEOUT) goto error;
+    }
 
-    /* Reset peripherals */
-    __LPUART1_FORCE_RESET();
-    __LPUART1_RELEASE_RESET();
+    LL_LPUART_EnableDMAReq_RX(LPUART1);
+    LL_LPUART_EnableInStopMode(LPUART1);
 
-    /* Disable DMA */
-    if (port->hdmarx != 0) HAL_DMA_DeInit(port->hdmarx);
-    if (port->hdmatx != 0) HAL_DMA_DeInit(port->hdmatx);
+    // Enable the idle line detection interrupt. We use the event to transmit
+    // data from the DMA buffer to the input FIFO queue and to re-enable the
+    // low-power Stop mode.
+    LL_LPUART_EnableIT_IDLE(LPUART1);
+    LL_LPUART_EnableIT_CM(LPUART1);
 
-    HAL_NVIC_DisableIRQ(DMA1_Channel4_5_6_7_IRQn);
-    HAL_NVIC_DisableIRQ(RNG_LPUART1_IRQn);
+    // The receive-buffer-not-empty interrupt stays disabled. We use DMA to
+    // receive data over LPUART1 so that the receiving process works even when
+    // interrupts don't, e.g., during heavy memory bus activity (writes to
+    // EEPROM).
+    //
+    // Framing, noise, overrun, and parity error interrupts stay disabled too.
+    // We don't want those errors to stop DMA transfers. We ignore such errors
+    // and let the ATCI recover at the application layer.
+
+    HAL_NVIC_SetPriority(RNG_LPUART1_IRQn, IRQ_PRIORITY_LPUART, 0);
+    HAL_NVIC_EnableIRQ(RNG_LPUART1_IRQn);
+
+    /* Configure the GPIO pins used by LPUART */
+    init_gpio();
+
+    reenable_irq(masked);
+    return;
+
+error:
+    reenable_irq(masked);
+    halt("Error while initializing LPUART port");
 }
 
 
@@ -296,6 +442,11 @@ void HAL_UART_MspDeInit(UART_HandleTypeDef *port)
 // interrupts disabled because it is also called from the DMA transmission
 // completition callback.
 //
+// Each DMA transfer covers one contiguous segment of the TX FIFO. The next
+// segment is chained from the DMA transfer complete interrupt while the
+// peripheral still shifts out the last bytes of the previous one, so the line
+// does not go idle between segments, e.g., when the FIFO wraps around or when
+// more data has been written during the transfer.
 static inline void start_dma_transmission(void)
 {
     cbuf_view_t v;
@@ -304,10 +455,16 @@ static inline void start_dma_transmission(void)
     // be started from the completion callback if necessary.
     if (tx_bytes_transmitting) return;
 
-    // If there is nothing to transmit, return. No need to check
-    // lpuart_tx_fifo.length here because tx_bytes_left <= lpuart_tx_fifo.length
+    // If there is nothing to transmit, return. No need to check the length of
+    // lpuart_tx_fifo here because tx_bytes_left is never larger. The Stop mode
+    // must wait until the last frame has left the peripheral, see tx_done.
     if (!tx_bytes_left) {
-        system_stop_lock &= ~SYSTEM_MODULE_LPUART_TX;
+        if (tx_draining) return;
+        system_unlock(&system_stop_lock, SYSTEM_MODULE_LPUART_TX);
+        if (bursting) {
+            bursting = false;
+            host_wake(0);
+        }
         return;
     }
 
@@ -317,159 +474,308 @@ static inline void start_dma_transmission(void)
     tx_bytes_transmitting = tx_bytes_left < v.len[i] ? tx_bytes_left : v.len[i];
  
     if (tx_bytes_transmitting) {
-        HAL_UART_Transmit_DMA(&port, (unsigned char *)v.ptr[i], tx_bytes_transmitting);
+        LL_LPUART_DisableIT_TC(LPUART1);
+        tx_draining = false;
+        LL_DMA_DisableChannel(DMA1, DMA_TX);
+        LL_DMA_SetMemoryAddress(DMA1, DMA_TX, (uint32_t)v.ptr[i]);
+        LL_DMA_SetDataLength(DMA1, DMA_TX, tx_bytes_transmitting);
+        LL_DMA_EnableChannel(DMA1, DMA_TX);
+        LL_LPUART_ClearFlag_TC(LPUART1);
+        tx_dma = true;
+        LL_LPUART_EnableDMAReq_TX(LPUART1);
         tx_bytes_left -= tx_bytes_transmitting;
-        system_stop_lock |= SYSTEM_MODULE_LPUART_TX;
+        system_lock(&system_stop_lock, SYSTEM_MODULE_LPUART_TX);
     }
 }
 
 
-size_t lpuart_write(const char *buffer, size_t length)
+cbuf_view_t *lpuart_tail(cbuf_view_t *tail)
+{
+    return cbuf_tail(&lpuart_tx_fifo, tail);
+}
+
+
+// The number of bytes written into the TX FIFO while transmissions were paused
+static inline size_t held_bytes(void)
+{
+    return cbuf_length(&lpuart_tx_fifo) - tx_bytes_transmitting - tx_bytes_left;
+}
+
+
+// In the polling mode, signal data waiting for the host in the mailbox or in
+// the paused TX FIFO
+static void update_data_ready(void)
 {
     uint32_t masked = disable_irq();
-    cbuf_view_t v;
+    if (!bursting)
+        host_wake(!sysconf.async_uart && (pending || (lpuart_tx_paused && held_bytes())));
+    reenable_irq(masked);
+}
+
+
+// Transmit the notifications held in the coalescing window in one burst
+static void release_held(void)
+{
+    uint32_t masked = disable_irq();
+
+#if DETACHABLE_LPUART == 1
+    if (!attached) {
+        reenable_irq(masked);
+        return;
+    }
+#endif
+
+    size_t held = held_bytes();
+    if (held) {
+        tx_bytes_left += held;
+        bursting = true;
+        host_wake(1);
+        start_dma_transmission();
+    }
 
-    cbuf_tail(&lpuart_tx_fifo, &v);
     reenable_irq(masked);
+}
 
-    size_t written = cbuf_copy_in(&v, buffer, length);
 
-    masked = disable_irq();
-    cbuf_produce(&lpuart_tx_fifo, written);
+static void on_coalesce_timer(void *ctx)
+{
+    (void)ctx;
+    release_held();
+}
+
+
+void lpuart_produce(size_t length)
+{
+    bool hold = false;
+
+#if BENCH == 1
+    if (lpuart_mute) return;
+#endif
+
+    cbuf_produce(&lpuart_tx_fifo, length);
+
+    // tx_bytes_left is shared with the DMA completion callback
+    uint32_t masked = disable_irq();
 
     // If we are not paused, mark the newly added data as to be transmitted
-    // immediately.
+    // immediately. In the asynchronous mode, transmissions are paused only to
+    // coalesce notifications.
     if (!lpuart_tx_paused) {
-        tx_bytes_left += written;
+        tx_bytes_left += length;
         start_dma_transmission();
+    } else if (sysconf.async_uart && system_coalesce_window()) {
+        hold = true;
     }
 
     reenable_irq(masked);
+
+    if (!sysconf.async_uart) update_data_ready();
+    if (!hold) return;
+
+    // Do not let the held data fill the FIFO up, the next writer would wait
+    // for space forever
+    TimerStop(&coalesce_timer);
+    if (held_bytes() > sizeof(tx_buffer) / 2) {
+        release_held();
+    } else {
+        TimerSetValue(&coalesce_timer, system_coalesce_window());
+        TimerStart(&coalesce_timer);
+    }
+}
+
+
+size_t lpuart_write(const char *buffer, size_t length)
+{
+    cbuf_view_t v;
+
+    size_t written = cbuf_copy_in(lpuart_tail(&v), buffer, length);
+    lpuart_produce(written);
     return written;
 }
 
 
+void lpuart_wait_for_space(size_t length)
+{
+    uint32_t masked, start;
+
+    if (cbuf_space(&lpuart_tx_fifo) >= length) return;
+    lpuart_tx_stalls++;
+    start = rtc_get_timer_value();
+
+    // Data held in the coalescing window would never make room
+    if (lpuart_tx_paused && sysconf.async_uart && cbuf_space(&lpuart_tx_fifo) < length)
+        release_held();
+
+    while (cbuf_space(&lpuart_tx_fifo) < length) {
+        // A slow host must not hold off the MAC, see system_yield
+        system_yield();
+
+        masked = disable_irq();
+        // If there is not enough free space in the TX FIFO, we invoke
+        // system_idle to put the MCU to sleep until there is some space in the
+        // output FIFO, which will be signaled by the ISR when the DMA transfer
+        // finishes. Since the transmission happens via DMA, system_idle used
+        // below must not enter the Stop mode. That is, however, guaranteed,
+        // since the function lpuart_produce creates a stop mode wake lock,
+        // which will still be in place when the process gets here.
+        if (cbuf_space(&lpuart_tx_fifo) < length)
+            system_idle();
+        reenable_irq(masked);
+    }
+
+    lpuart_tx_stall_time += rtc_tick2ms(rtc_get_timer_value() - start);
+}
+
+
 void lpuart_write_blocking(const char *buffer, size_t length)
 {
-    uint32_t masked;
     size_t written;
     while (length) {
         written = lpuart_write(buffer, length);
         buffer += written;
         length -= written;
 
-        if (written == 0) {
-            while (lpuart_tx_fifo.max_length == lpuart_tx_fifo.length) {
-                masked = disable_irq();
-                // If the TX FIFO is at full capacity, we invoke system_idle to
-                // put the MCU to sleep until there is some space in the output
-                // FIFO, which will be signaled by the ISR when the DMA transfer
-                // finishes. Since the transmission happens via DMA, system_idle
-                // used below must not enter the Stop mode. That is, however,
-                // guaranteed, since the function luart_write above creates a
-                // stop mode wake lock, which will still be in place when the
-                // process gets here.
-                if (lpuart_tx_fifo.max_length == lpuart_tx_fifo.length)
-                    system_idle();
-                reenable_irq(masked);
-            }
-        }
+        if (written == 0) lpuart_wait_for_space(1);
     }
 }
 
 
-void HAL_UART_TxCpltCallback(UART_HandleTypeDef *port)
+// Invoked from the IRQ handler once the last byte of the last DMA transfer has
+// left the shift register
+RAMFUNC static void tx_done(void)
 {
-    (void)port;
-
-    // Remove the just transmitted data from the circular buffer
-    if (tx_bytes_transmitting) {
-        cbuf_consume(&lpuart_tx_fifo, tx_bytes_transmitting);
-        tx_bytes_transmitting = 0;
-    }
-
+    uint32_t masked = disable_irq();
+    tx_draining = false;
     start_dma_transmission();
+    reenable_irq(masked);
 }
 
 
-void RNG_LPUART1_IRQHandler(void)
+RAMFUNC void RNG_LPUART1_IRQHandler(void)
 {
+    uint32_t start = trace_irq_enter();
+
     // If we were woken up by LPUART activity, prevent the MCU from entering the
     // Stop mode until we receive an idle frame. This generally indicates
     // incoming data over LPUART1, and we want to give the DMA controller a
     // chance to transfer that data into RAM. The modem will still enter the
     // sleep mode between received bytes.
-    if (LL_LPUART_IsActiveFlag_WKUP(port.Instance)) {
-        LL_LPUART_ClearFlag_WKUP(port.Instance);
-        system_stop_lock |= SYSTEM_MODULE_LPUART_RX;
+    //
+    // With the LSE clock, the peripheral keeps receiving in the Stop mode. Each
+    // received frame wakes the MCU up for just long enough to have it
+    // transferred by the DMA, which lpuart_after_stop has resumed by now, after
+    // which the MCU may enter the Stop mode again. The idle frame interrupt
+    // cannot wake the MCU up, thus the data is moved into the RX FIFO here.
+    if (LL_LPUART_IsActiveFlag_WKUP(LPUART1)) {
+        LL_LPUART_ClearFlag_WKUP(LPUART1);
+        if (lse_clock) {
+            for (int i = 0; i < 100 && LL_LPUART_IsActiveFlag_RXNE(LPUART1); i++);
+            rx_callback(false);
+        } else {
+            system_lock(&system_stop_lock, SYSTEM_MODULE_LPUART_RX);
+        }
     }
 
     // Once an idle frame has been received, we assume that the client is done
     // transmitting, and we re-enable the Stop mode again. While in the Stop
     // mode, the MCU will be woken up by WKUP interrupt once another frame is
     // received by LPUART.
-    if (LL_LPUART_IsEnabledIT_IDLE(port.Instance) && LL_LPUART_IsActiveFlag_IDLE(port.Instance)) {
-        LL_LPUART_ClearFlag_IDLE(port.Instance);
-        rx_callback();
-        system_stop_lock &= ~SYSTEM_MODULE_LPUART_RX;
+    if (LL_LPUART_IsEnabledIT_IDLE(LPUART1) && LL_LPUART_IsActiveFlag_IDLE(LPUART1)) {
+        LL_LPUART_ClearFlag_IDLE(LPUART1);
+        rx_callback(true);
+        system_unlock(&system_stop_lock, SYSTEM_MODULE_LPUART_RX);
     }
 
-    // Delegate to the HAL. But before we do that, check and clear the error
-    // flags. Otherwise, the HAL will abort the DMA transfer. These errors are
-    // disabled in the init function, but it is better to be safe than sorry.
+    // The end of a command line has been received. Wait for the DMA to move the
+    // character out of the receive data register and hand the line over to the
+    // ATCI without waiting for the idle frame, which never comes if the host
+    // sends the next command right away.
+    if (LL_LPUART_IsEnabledIT_CM(LPUART1) && LL_LPUART_IsActiveFlag_CM(LPUART1)) {
+        LL_LPUART_ClearFlag_CM(LPUART1);
+        for (int i = 0; i < 100 && LL_LPUART_IsActiveFlag_RXNE(LPUART1); i++);
+        rx_callback(false);
+    }
 
-    if (LL_LPUART_IsActiveFlag_PE(port.Instance))
-        LL_LPUART_ClearFlag_PE(port.Instance);
+    // The TX DMA transfer has finished and the last frame has been sent out.
+    // The Stop mode must not be entered any sooner, see start_dma_transmission.
+    if (LL_LPUART_IsEnabledIT_TC(LPUART1) && LL_LPUART_IsActiveFlag_TC(LPUART1)) {
+        LL_LPUART_DisableIT_TC(LPUART1);
+        tx_done();
+    }
 
-    if (LL_LPUART_IsActiveFlag_FE(port.Instance))
-        LL_LPUART_ClearFlag_FE(port.Instance);
+    // Clear the error flags. These errors are disabled in the init function,
+    // but it is better to be safe than sorry.
 
-    if (LL_LPUART_IsActiveFlag_ORE(port.Instance))
-        LL_LPUART_ClearFlag_ORE(port.Instance);
+    if (LL_LPUART_IsActiveFlag_PE(LPUART1))
+        LL_LPUART_ClearFlag_PE(LPUART1);
 
-    if (LL_LPUART_IsActiveFlag_NE(port.Instance))
-        LL_LPUART_ClearFlag_NE(port.Instance);
+    if (LL_LPUART_IsActiveFlag_FE(LPUART1))
+        LL_LPUART_ClearFlag_FE(LPUART1);
 
-    HAL_UART_IRQHandler(&port);
-}
+    if (LL_LPUART_IsActiveFlag_ORE(LPUART1))
+        LL_LPUART_ClearFlag_ORE(LPUART1);
 
+    if (LL_LPUART_IsActiveFlag_NE(LPUART1))
+        LL_LPUART_ClearFlag_NE(LPUART1);
 
-void HAL_UART_RxHalfCpltCallback(UART_HandleTypeDef *port)
-{
-    (void)port;
-    rx_callback();
+    trace_irq_exit(TRACE_IRQ_LPUART, start);
 }
 
 
-void HAL_UART_RxCpltCallback(UART_HandleTypeDef *handle)
+RAMFUNC void DMA1_Channel4_5_6_7_IRQHandler(void)
 {
-    (void)handle;
-    rx_callback();
-}
+    uint32_t start = trace_irq_enter();
 
+    // Either half of the RX buffer has been filled up
+    if (LL_DMA_IsActiveFlag_HT6(DMA1) || LL_DMA_IsActiveFlag_TC6(DMA1)) {
+        LL_DMA_ClearFlag_HT6(DMA1);
+        LL_DMA_ClearFlag_TC6(DMA1);
+        rx_callback(false);
+    }
 
-void DMA1_Channel4_5_6_7_IRQHandler(void)
-{
-    HAL_DMA_IRQHandler(port.hdmarx);
-    HAL_DMA_IRQHandler(port.hdmatx);
+    if (LL_DMA_IsActiveFlag_TE6(DMA1)) {
+        LL_DMA_ClearFlag_TE6(DMA1);
+        log_error("LPUART1 RX DMA error");
+    }
+
+    // All data of the segment has been moved into the peripheral, its room in
+    // the TX FIFO can be reused. Chain the next segment, if any, while the
+    // peripheral is still busy with the last bytes. Otherwise, wait for the
+    // transmission complete interrupt before releasing the Stop mode lock.
+    // Timer callbacks in the RTC interrupt, which preempts this one, may start
+    // transmissions too, see release_held.
+    if (LL_DMA_IsActiveFlag_TC7(DMA1) || LL_DMA_IsActiveFlag_TE7(DMA1)) {
+        if (LL_DMA_IsActiveFlag_TE7(DMA1)) log_error("LPUART1 TX DMA error");
+        uint32_t masked = disable_irq();
+        LL_DMA_ClearFlag_GI7(DMA1);
+        LL_DMA_DisableChannel(DMA1, DMA_TX);
+        cbuf_consume(&lpuart_tx_fifo, tx_bytes_transmitting);
+        tx_bytes_transmitting = 0;
+
+        if (tx_bytes_left) {
+            start_dma_transmission();
+        } else {
+            LL_LPUART_DisableDMAReq_TX(LPUART1);
+            tx_dma = false;
+            tx_draining = true;
+            LL_LPUART_EnableIT_TC(LPUART1);
+        }
+        reenable_irq(masked);
+    }
+
+    trace_irq_exit(TRACE_IRQ_DMA, start);
 }
 
 
 static inline void pause_rx_dma(void)
 {
-    if (HAL_IS_BIT_SET(port.Instance->CR3, USART_CR3_DMAR)
-        && (port.RxState == HAL_UART_STATE_BUSY_RX)) {
-        CLEAR_BIT(port.Instance->CR3, USART_CR3_DMAR);
-    }
+    LL_LPUART_DisableDMAReq_RX(LPUART1);
 }
 
 
 static inline void pause_tx_dma(void)
 {
-    if (HAL_IS_BIT_SET(port.Instance->CR3, USART_CR3_DMAT)
-        && (port.gState == HAL_UART_STATE_BUSY_TX)) {
-        CLEAR_BIT(port.Instance->CR3, USART_CR3_DMAT);
-    }
+    LL_LPUART_DisableDMAReq_TX(LPUART1);
 }
 
 
@@ -486,89 +792,94 @@ void lpuart_before_stop(void)
 #if DETACHABLE_LPUART == 1
     if (attached)
 #endif
-        LL_LPUART_EnableIT_WKUP(port.Instance);
+        LL_LPUART_EnableIT_WKUP(LPUART1);
 }
 
 
 static inline void resume_rx_dma(void)
 {
-    if (port.RxState == HAL_UART_STATE_BUSY_RX) {
-        /* Clear the Overrun flag before resuming the Rx transfer */
-        __HAL_UART_CLEAR_FLAG(&port, UART_CLEAR_OREF);
+#if LPUART_FLOW_CONTROL == 1
+    // Keep the RX DMA paused until the ATCI has made room in the RX FIFO
+    if (rx_paused) return;
+#endif
 
-        /* Enable the UART DMA Rx request */
-        SET_BIT(port.Instance->CR3, USART_CR3_DMAR);
-    }
+    /* Clear the Overrun flag before resuming the Rx transfer */
+    LL_LPUART_ClearFlag_ORE(LPUART1);
+
+    /* Enable the UART DMA Rx request */
+    LL_LPUART_EnableDMAReq_RX(LPUART1);
 }
 
 
 static inline void resume_tx_dma(void)
 {
-    if (port.gState == HAL_UART_STATE_BUSY_TX) {
-        SET_BIT(port.Instance->CR3, USART_CR3_DMAT);
-    }
+    if (tx_dma) LL_LPUART_EnableDMAReq_TX(LPUART1);
 }
 
 
 void lpuart_after_stop(void)
 {
-    LL_LPUART_DisableIT_WKUP(port.Instance);
+    LL_LPUART_DisableIT_WKUP(LPUART1);
 
-    // We cannot use HAL_UART_DMAResume provided by the STM HAL here. That
-    // function resumes both RX and TX DMA transfers and additionally re-enables
-    // error interrupts. We need to resume the TX DMA here if and only if the
-    // port is attached. Resuming a TX DMA while the port is detached from GPIO
+    // We need to resume the TX DMA here if and only if the port is attached. Resuming a TX DMA while the port is detached from GPIO
     // would result in lost data.
     resume_rx_dma();
     resume_tx_dma();
 }
 
 
+bool lpuart_uses_lse(void)
+{
+    return lse_clock;
+}
+
+
 size_t lpuart_read(char *buffer, size_t length)
 {
-    uint32_t masked = disable_irq();
     cbuf_view_t v;
 
     cbuf_head(&lpuart_rx_fifo, &v);
-    reenable_irq(masked);
-
     size_t rv = cbuf_copy_out(buffer, &v, length);
+    lpuart_consume(rv);
+    return rv;
+}
 
-    masked = disable_irq();
-    cbuf_consume(&lpuart_rx_fifo, rv);
-    reenable_irq(masked);
 
-    return rv;
+void lpuart_consume(size_t length)
+{
+    cbuf_consume(&lpuart_rx_fifo, length);
+
+#if LPUART_FLOW_CONTROL == 1
+    uint32_t masked = disable_irq();
+    if (rx_paused && cbuf_space(&lpuart_rx_fifo) >= ARRAY_LEN(dma_buffer)) {
+        rx_paused = false;
+        resume_rx_dma();
+    }
+    reenable_irq(masked);
+#endif
 }
 
 
 // Block until all data from the output FIFO buffer has been transmitted. The
-// transmit process signals that condition by setting the variable tx_idle to 1
-// from within the IRQ context.
+// transmit process signals that condition by clearing tx_bytes_transmitting
+// and tx_draining from within the IRQ context.
 void lpuart_flush(void)
 {
     uint32_t masked;
-    while (tx_bytes_transmitting) {
+    while (tx_bytes_transmitting || tx_draining) {
         masked = disable_irq();
-        if (tx_bytes_transmitting)
+        if (tx_bytes_transmitting || tx_draining)
             HAL_PWR_EnterSLEEPMode(PWR_MAINREGULATOR_ON, PWR_SLEEPENTRY_WFI);
         reenable_irq(masked);
     }
 }
 
 
-void HAL_UART_ErrorCallback(UART_HandleTypeDef *port)
-{
-    (void)port;
-    log_error("LPUART1 error: %ld", port->ErrorCode);
-}
-
-
 void lpuart_resume_tx(void)
 {
     lpuart_tx_paused = false;
     uint32_t masked = disable_irq();
-    tx_bytes_left = lpuart_tx_fifo.length - tx_bytes_transmitting;
+    tx_bytes_left = cbuf_length(&lpuart_tx_fifo) - tx_bytes_transmitting;
     start_dma_transmission();
     reenable_irq(masked);
 }
@@ -577,6 +888,14 @@ void lpuart_resume_tx(void)
 void lpuart_pause_tx(void)
 {
     lpuart_tx_paused = true;
+    update_data_ready();
+}
+
+
+void lpuart_set_pending(bool value)
+{
+    pending = value;
+    update_data_ready();
 }
 
 
@@ -601,3 +920,5 @@ void lpuart_attach(void)
 }
 
 #endif // DETACHABLE_LPUART
+
+#endif // ATCI_RTT, ATCI_I2C
@@ -3,6 +3,7 @@
 
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include "cbuf.h"
 #include "gpio.h"
 
@@ -10,6 +11,24 @@
 extern volatile cbuf_t lpuart_tx_fifo;
 extern volatile cbuf_t lpuart_rx_fifo;
 
+//! @brief The number of times received data was discarded because the RX FIFO
+//! was full, since boot or since read with AT$STATS
+extern volatile uint32_t lpuart_overruns;
+
+//! @brief The number of received bytes discarded due to RX FIFO overruns
+extern volatile uint32_t lpuart_rx_dropped;
+
+//! @brief The number of times a writer had to wait for room in the TX FIFO
+extern uint32_t lpuart_tx_stalls;
+
+//! @brief The total time spent waiting for room in the TX FIFO in ms
+extern uint32_t lpuart_tx_stall_time;
+
+#if BENCH == 1
+//! @brief Discard all data committed with lpuart_produce while true
+extern bool lpuart_mute;
+#endif
+
 #if DETACHABLE_LPUART == 1
 
 /*! @brief Detach from the ATCI LPUART port
@@ -81,6 +100,39 @@ size_t lpuart_write(const char *buffer, size_t length);
 void lpuart_write_blocking(const char *buffer, size_t length);
 
 
+/*! @brief Return a view of the free space at the end of the TX queue
+ *
+ * This function can be used to encode data directly into the internal
+ * transmission queue, without staging it in a separate buffer first. Once the
+ * data has been written into the view, it must be committed with
+ * lpuart_produce.
+ *
+ * @param[in] tail A pointer to a view variable to be filled
+ * @return The pointer passed to the function via @p tail
+ */
+cbuf_view_t *lpuart_tail(cbuf_view_t *tail);
+
+
+/*! @brief Schedule @p length bytes written into the TX queue for transmission
+ *
+ * Commit @p length bytes previously written into a view obtained with
+ * lpuart_tail. The data will be transmitted as soon as possible.
+ *
+ * @param[in] length The number of bytes written into the view
+ */
+void lpuart_produce(size_t length);
+
+
+/*! @brief Wait until there are at least @p length free bytes in the TX queue
+ *
+ * This function blocks (sleeps) until the DMA transmission releases enough
+ * space in the internal transmission queue for @p length bytes.
+ *
+ * @param[in] length The number of bytes that need to be free
+ */
+void lpuart_wait_for_space(size_t length);
+
+
 /*! @brief Read up to @p length bytes from LPUART1
  *
  * This function reads up to @p length bytes from the LPUART1 port and copies
@@ -97,6 +149,31 @@ void lpuart_write_blocking(const char *buffer, size_t length);
 size_t lpuart_read(char *buffer, size_t length);
 
 
+/*! @brief Remove @p length bytes from the beginning of the RX queue
+ *
+ * This function is meant to be used by code that processes the data in the RX
+ * queue in place, through a view obtained with cbuf_head. With RTS/CTS flow
+ * control enabled, the function also resumes reception if it was paused
+ * because the RX queue was almost full.
+ *
+ * @param[in] length The number of bytes to remove
+ */
+void lpuart_consume(size_t length);
+
+
+/*! @brief Wake the ATCI once @p length bytes have been received
+ *
+ * Received data is moved into the RX queue silently and the ATCI task is only
+ * posted once the data contains the end of a command line or a frame, the RX
+ * queue is about to fill up, or the host stops transmitting. This function
+ * additionally wakes the ATCI once the RX queue holds at least @p length bytes,
+ * e.g., the payload expected after AT+UTX. The value 0 disables the threshold.
+ *
+ * @param[in] length The number of bytes the ATCI is waiting for
+ */
+void lpuart_set_rx_threshold(size_t length);
+
+
 /*! @brief Wait for all data from the internal queue to be sent
  *
  * This function blocks until all data from the internal queue have been
@@ -126,6 +203,14 @@ void lpuart_before_stop(void);
 void lpuart_after_stop(void);
 
 
+/*! @brief Return true if LPUART1 is clocked from the LSE oscillator
+ *
+ * LPUART1 runs from the LSE at low baud rates and from HSI16 otherwise. The
+ * system can only switch HSI16 off while LPUART1 does not depend on it.
+ */
+bool lpuart_uses_lse(void);
+
+
 /*! @brief Pause modem->host transmissions over LPUART1
  *
  * Calling this function pauses modem->host transmissions over LPUART1 until
@@ -150,4 +235,17 @@ void lpuart_pause_tx();
  */
 void lpuart_resume_tx();
 
+
+/*! @brief Tell LPUART1 whether the host has data waiting in the mailbox
+ *
+ * On builds with HOST_WAKE_PIN, the host wake-up output is driven high in the
+ * polling mode while @p pending is true or while the TX queue holds data
+ * written after lpuart_pause_tx. The host can then sleep until the rising edge
+ * instead of polling the modem with AT commands. The output does not change
+ * when transmissions are resumed, only when they are paused again.
+ *
+ * @param[in] pending True if the mailbox is not empty
+ */
+void lpuart_set_pending(bool pending);
+
 #endif /* __LPUART_H__ */
@@ -0,0 +1,318 @@
+#include "lpuart.h"
+
+#if ATCI_RTT == 1
+
+#include <string.h>
+#include <stm/STM32L0xx_HAL_Driver/Inc/stm32l0xx_hal.h>
+#include <LoRaWAN/Utilities/timeServer.h>
+#include <rtt/segger_rtt.h>
+#include "cbuf.h"
+#include "irq.h"
+#include "system.h"
+#include "rtc.h"
+
+// This file implements the lpuart.h interface over a Segger RTT up/down buffer
+// pair instead of LPUART1. The ATCI, and everything else that writes into the
+// TX FIFO, works unmodified. A debug probe (J-Link, or OpenOCD/pyOCD with RTT
+// support) exchanges AT commands with the modem through target memory, leaving
+// LPUART1 and its pins free for the device under test.
+
+#if DEBUG_SWD == 0
+#error ATCI_RTT requires DEBUG_SWD=1
+#endif
+
+#if DETACHABLE_LPUART == 1 || LPUART_FLOW_CONTROL != 0
+#error ATCI_RTT cannot be combined with DETACHABLE_LPUART or LPUART_FLOW_CONTROL
+#endif
+
+#ifndef LPUART_BUFFER_SIZE
+#define LPUART_BUFFER_SIZE 512
+#endif
+
+#if (LPUART_BUFFER_SIZE & (LPUART_BUFFER_SIZE - 1)) != 0
+#error LPUART_BUFFER_SIZE must be a power of two
+#endif
+
+// The RTT channel used by the ATCI. Channel 0 is the terminal used by the debug
+// log (DEBUG_LOG=3).
+#define ATCI_RTT_CHANNEL 1
+
+// The sizes of the RTT buffers in target memory. The probe moves data in and
+// out of them; the TX and RX FIFOs sit behind them as with LPUART1.
+#ifndef ATCI_RTT_UP_SIZE
+#define ATCI_RTT_UP_SIZE 512
+#endif
+
+#ifndef ATCI_RTT_DOWN_SIZE
+#define ATCI_RTT_DOWN_SIZE 256
+#endif
+
+// RTT has no interrupt, the host only writes into target memory. The down
+// buffer is polled this often (ms) and the TX FIFO is drained into the up
+// buffer at the same time, see on_poll_timer.
+#ifndef ATCI_RTT_POLL_INTERVAL
+#define ATCI_RTT_POLL_INTERVAL 5
+#endif
+
+#define LINE_END  '\r'
+#define FRAME_END 0xc0
+
+static char up_buffer[ATCI_RTT_UP_SIZE];
+static char down_buffer[ATCI_RTT_DOWN_SIZE];
+
+static unsigned char tx_buffer[LPUART_BUFFER_SIZE];
+static unsigned char rx_buffer[LPUART_BUFFER_SIZE];
+
+volatile cbuf_t lpuart_tx_fifo;
+volatile cbuf_t lpuart_rx_fifo;
+volatile uint32_t lpuart_overruns;
+volatile uint32_t lpuart_rx_dropped;
+uint32_t lpuart_tx_stalls;
+uint32_t lpuart_tx_stall_time;
+#if BENCH == 1
+bool lpuart_mute;
+#endif
+
+// True if transmissions are paused, see lpuart_pause_tx
+static bool volatile tx_paused;
+static volatile size_t rx_threshold;
+static TimerEvent_t poll_timer;
+
+
+// Move as much of the TX FIFO into the RTT up buffer as fits. Returns the
+// number of bytes moved. Invoked from both the main and the timer context.
+static size_t push(void)
+{
+    cbuf_view_t v;
+    unsigned n, rv = 0;
+
+    uint32_t masked = disable_irq();
+
+    if (!tx_paused) {
+        cbuf_head(&lpuart_tx_fifo, &v);
+        for (int i = 0; i < 2 && v.len[i]; i++) {
+            n = SEGGER_RTT_WriteNoLock(ATCI_RTT_CHANNEL, v.ptr[i], v.len[i]);
+            rv += n;
+            if (n < v.len[i]) break;
+        }
+        cbuf_consume(&lpuart_tx_fifo, rv);
+    }
+
+    reenable_irq(masked);
+    return rv;
+}
+
+
+// Move the data written by the host into the RX FIFO. Returns true if the data
+// contains the end of a line or frame. Sets *count to the number of bytes read.
+static bool pull(size_t *count)
+{
+    char buf[32];
+    unsigned n;
+    size_t stored;
+    bool end = false;
+
+    *count = 0;
+    while ((n = SEGGER_RTT_Read(ATCI_RTT_CHANNEL, buf, sizeof(buf))) != 0) {
+        *count += n;
+        stored = cbuf_put(&lpuart_rx_fifo, buf, n);
+        if (stored != n) {
+            lpuart_overruns++;
+            lpuart_rx_dropped += n - stored;
+        }
+        end |= memchr(buf, LINE_END, n) != NULL || memchr(buf, FRAME_END, n) != NULL;
+    }
+    return end;
+}
+
+
+static void on_poll_timer(void *ctx)
+{
+    (void)ctx;
+    static bool receiving;
+    size_t count;
+    bool end, idle;
+
+    end = pull(&count);
+
+    // RTT has no idle line detection. The first poll that brings no new data
+    // after some did stands in for the idle frame and hands an incomplete
+    // payload over to the ATCI.
+    idle = receiving && !count;
+    receiving = count != 0;
+
+    if (end
+        || (rx_threshold && (idle || cbuf_length(&lpuart_rx_fifo) >= rx_threshold))
+        || cbuf_space(&lpuart_rx_fifo) < ATCI_RTT_DOWN_SIZE)
+        system_post(SYSTEM_TASK_ATCI);
+
+    push();
+
+    TimerSetValue(&poll_timer, ATCI_RTT_POLL_INTERVAL);
+    TimerStart(&poll_timer);
+}
+
+
+void lpuart_init(unsigned int baudrate)
+{
+    (void)baudrate;
+
+    cbuf_init(&lpuart_tx_fifo, tx_buffer, sizeof(tx_buffer));
+    cbuf_init(&lpuart_rx_fifo, rx_buffer, sizeof(rx_buffer));
+
+    SEGGER_RTT_ConfigUpBuffer(ATCI_RTT_CHANNEL, "ATCI", up_buffer, sizeof(up_buffer),
+        SEGGER_RTT_MODE_NO_BLOCK_TRIM);
+    SEGGER_RTT_ConfigDownBuffer(ATCI_RTT_CHANNEL, "ATCI", down_buffer, sizeof(down_buffer),
+        SEGGER_RTT_MODE_NO_BLOCK_TRIM);
+
+    // Keep the debug domain powered in the Stop mode so that the probe can
+    // access the RTT buffers while the modem sleeps between polls
+    __DBGMCU_CLK_ENABLE();
+    HAL_DBGMCU_EnableDBGStopMode();
+
+    TimerInit(&poll_timer, on_poll_timer);
+    TimerSetValue(&poll_timer, ATCI_RTT_POLL_INTERVAL);
+    TimerStart(&poll_timer);
+}
+
+
+cbuf_view_t *lpuart_tail(cbuf_view_t *tail)
+{
+    return cbuf_tail(&lpuart_tx_fifo, tail);
+}
+
+
+void lpuart_produce(size_t length)
+{
+#if BENCH == 1
+    if (lpuart_mute) return;
+#endif
+
+    cbuf_produce(&lpuart_tx_fifo, length);
+    push();
+}
+
+
+size_t lpuart_write(const char *buffer, size_t length)
+{
+    cbuf_view_t v;
+
+    size_t written = cbuf_copy_in(lpuart_tail(&v), buffer, length);
+    lpuart_produce(written);
+    return written;
+}
+
+
+void lpuart_wait_for_space(size_t length)
+{
+    uint32_t masked, start;
+
+    if (cbuf_space(&lpuart_tx_fifo) >= length) return;
+    lpuart_tx_stalls++;
+    start = rtc_get_timer_value();
+
+    // The poll timer makes room as the probe drains the up buffer
+    while (cbuf_space(&lpuart_tx_fifo) < length) {
+        if (push()) continue;
+        system_yield();
+        masked = disable_irq();
+        if (cbuf_space(&lpuart_tx_fifo) < length)
+            system_idle();
+        reenable_irq(masked);
+    }
+
+    lpuart_tx_stall_time += rtc_tick2ms(rtc_get_timer_value() - start);
+}
+
+
+void lpuart_write_blocking(const char *buffer, size_t length)
+{
+    size_t written;
+    while (length) {
+        written = lpuart_write(buffer, length);
+        buffer += written;
+        length -= written;
+
+        if (written == 0) lpuart_wait_for_space(1);
+    }
+}
+
+
+size_t lpuart_read(char *buffer, size_t length)
+{
+    cbuf_view_t v;
+
+    cbuf_head(&lpuart_rx_fifo, &v);
+    size_t rv = cbuf_copy_out(buffer, &v, length);
+    lpuart_consume(rv);
+    return rv;
+}
+
+
+void lpuart_consume(size_t length)
+{
+    cbuf_consume(&lpuart_rx_fifo, length);
+}
+
+
+void lpuart_set_rx_threshold(size_t length)
+{
+    rx_threshold = length;
+    if (length && cbuf_length(&lpuart_rx_fifo) >= length)
+        system_post(SYSTEM_TASK_ATCI);
+}
+
+
+// Wait until the probe has picked up the TX FIFO. Give up once it stops making
+// progress, e.g., when no probe is attached, so that a reset is not held off.
+void lpuart_flush(void)
+{
+    uint32_t last = rtc_get_timer_value();
+
+    while (cbuf_length(&lpuart_tx_fifo)) {
+        if (push()) {
+            last = rtc_get_timer_value();
+        } else if (rtc_tick2ms(rtc_get_timer_value() - last) > 2 * ATCI_RTT_POLL_INTERVAL) {
+            break;
+        }
+    }
+}
+
+
+// The RTT buffers are plain memory and need no attention around the Stop mode
+
+void lpuart_before_stop(void)
+{
+}
+
+
+void lpuart_after_stop(void)
+{
+}
+
+
+bool lpuart_uses_lse(void)
+{
+    return false;
+}
+
+
+void lpuart_resume_tx(void)
+{
+    tx_paused = false;
+    push();
+}
+
+
+void lpuart_pause_tx(void)
+{
+    tx_paused = true;
+}
+
+
+void lpuart_set_pending(bool value)
+{
+    (void)value;
+}
+
+#endif // ATCI_RTT
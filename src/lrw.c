@@ -1,13 +1,19 @@
+#define LOG_MODULE_THRESHOLD LOG_THRESHOLD_LRW
 #include "lrw.h"
 #include <assert.h>
+#include <stddef.h>
 #include <string.h>
 #include <LoRaWAN/Utilities/timeServer.h>
 #include <LoRaWAN/Utilities/utilities.h>
 #include <loramac-node/src/mac/LoRaMac.h>
 #include <loramac-node/src/mac/LoRaMacTest.h>
 #include <loramac-node/src/mac/region/Region.h>
+#ifdef REGION_EU868
+#include <loramac-node/src/mac/region/RegionEU868.h>
+#endif
 #include <loramac-node/src/radio/radio.h>
 #include <loramac-node/src/mac/LoRaMacCrypto.h>
+#include <loramac-node/src/mac/LoRaMacCommands.h>
 #include <loramac-node/src/mac/secure-element.h>
 #include <loramac-node/src/mac/secure-element-nvm.h>
 #include "adc.h"
@@ -21,27 +27,350 @@
 #include "irq.h"
 #include "nvm.h"
 #include "rtc.h"
+#include "trace.h"
+#include "lpuart.h"
+#include "frag.h"
+#include "store.h"
+#include "clocksync.h"
+#include "remote.h"
+#include "trigger.h"
+#include "i2c_target.h"
+#include "crypto.h"
+#include "p2p.h"
+#include "bulk.h"
+#include "ping.h"
+#include "agg.h"
+#include "delta.h"
+#include "evlog.h"
+#include "heartbeat.h"
+#include "pool.h"
+#include "sx1276-board.h"
 
 #define MAX_BAT 254
 
+extern uint32_t radio_rx_frequency;
+extern uint32_t radio_rx_time;
+extern volatile uint32_t radio_tx_count;
+extern uint32_t radio_tx_time;
+extern uint32_t radio_rx_airtime;
+extern int16_t radio_rssi;
+extern int8_t radio_snr;
+
+// Implemented in radio.c
+void radio_set_rx_delays(uint32_t rx1, uint32_t rx2);
 
 unsigned int lrw_event_subtype;
 static McpsConfirm_t tx_params;
 static int joins_left = 0;
 static TimerEvent_t join_retry_timer;
 static uint8_t join_datarate;
+static_assert(sizeof(LoRaMacCryptoNvmData_t) <= PART_JOURNAL_MAX_RECORD_SIZE, "Crypto NVM data too long for the journal");
+
+// The following variables implement the write-behind policy for the LoRaMac
+// state configured with AT$NVMPOLICY. See save_state.
+static TimerEvent_t nvm_flush_timer;
+static bool nvm_flush_due;
+static uint32_t saved_fcnt_up;
+static LoRaMacCryptoNvmData_t saved_crypto;
+
+// The DevNonce saved in NVM, i.e., the end of the block of DevNonce values
+// reserved with DEVNONCE_BLOCK. See devnonce_reserved.
+static uint16_t reserved_devnonce;
+
+// The shadow part whose group has been written by save_state but not committed
+// yet. The commit is started once the write of the group has finished.
+static part_shadow_t *uncommitted;
+
+// A copy of the group being written to NVM in the background. LoRaMac and AT
+// commands may modify the live state while the EEPROM is being programmed (see
+// eeprom_write_async), and a shadow record must match the checksum computed
+// when the write started. Only one
+// group is written at a time, see save_state.
+static union {
+    LoRaMacNvmDataGroup1_t mac1;
+    LoRaMacNvmDataGroup2_t mac2;
+    SecureElementNvmData_t se;
+    RegionNvmDataGroup1_t region1;
+    RegionNvmDataGroup2_t region2;
+    LoRaMacClassBNvmData_t classb;
+} staged;
 
 TimerTime_t lrw_dutycycle_deadline;
 
+// The maximum timing error (in ms) LoRaMac assumes when it computes the offset
+// and the length of RX windows. The default is used until the MCU wakeup
+// latency has been measured. After that, the error is derived from the
+// variation of the measured latency plus MAX_RX_ERROR_MIN to account for the
+// quantization of alarms and timestamps to RTC ticks. See update_max_rx_error.
+#define MAX_RX_ERROR_DEFAULT 20
+#define MAX_RX_ERROR_MIN 3
+
+static uint32_t max_rx_error = MAX_RX_ERROR_DEFAULT;
+
+// With AT$RXADAPT, the RX error is derived from the offsets of the class A
+// downlinks received at the data rates of the next RX windows instead. The
+// offsets are smoothed like the MCU wakeup latency (see rtc.c) and kept in
+// 1/16 ms. The adaptive error is the mean offset plus four mean deviations
+// plus RX_ADAPT_MARGIN, and is used once both data rates have at least
+// RX_ADAPT_MIN_SAMPLES samples.
+#define RX_ADAPT_MEAN_SHIFT 3
+#define RX_ADAPT_DEV_SHIFT 2
+#define RX_ADAPT_MIN_SAMPLES 4
+#define RX_ADAPT_MARGIN 2
+#define RX_ADAPT_DRS 16
+
+// Offsets larger than this (ms) are not downlinks in the expected window
+#define RX_ADAPT_MAX_OFFSET 1000
+
+typedef struct {
+    int32_t mean;
+    uint32_t dev;
+    uint16_t samples;
+} rx_timing_t;
+
+static rx_timing_t rx_timing[RX_ADAPT_DRS];
+
 
 enum lora_event {
     NO_EVENT = 0,
-    RETRANSMIT_JOIN = (1 << 0)
+    RETRANSMIT_JOIN = (1 << 0),
+    DRAIN_TX_QUEUE  = (1 << 1),
+    DRAIN_RX_QUEUE  = (1 << 2),
+    CLASS_B_STEP    = (1 << 3),
+    SAMPLE_TEMP     = (1 << 4),
+    DRAIN_TX_STORE  = (1 << 5),
+    AUTO_PULL       = (1 << 6),
+    CLASS_C_START   = (1 << 7),
+    CLASS_C_END     = (1 << 8),
+    MAC_DEADLINE    = (1 << 9)
 };
 
 static unsigned events;
 
+// How late (in ms) the non-critical timers below may fire. The timer server
+// uses the slack to merge their expiration into wakeups scheduled for other
+// timers. The timers that open RX windows in LoRaMac remain exact.
+#define JOIN_RETRY_TIMER_SLACK 1000
+#define TX_QUEUE_TIMER_SLACK    500
+#define NVM_FLUSH_TIMER_SLACK  2000
+#define CLASS_B_TIMER_SLACK    1000
+#define TEMP_COMP_TIMER_SLACK 60000
+#define TX_STORE_TIMER_SLACK   1000
+#define AUTO_PULL_TIMER_SLACK   500
+#define CLASS_C_TIMER_SLACK    1000
+#define MAC_DEADLINE_SLACK     1000
+
+
+// The uplink queue used by AT+UTX & co. when enabled with AT$TXQUEUE. Messages
+// are kept in LRW_TX_QUEUE_SIZE slots with their payload in a block from the
+// shared message pool (see pool.h), and are handed to the MAC one at a time
+// from lrw_process whenever the MAC is idle and the duty cycle permits it. See
+// drain_tx_queue.
+#ifndef LRW_TX_QUEUE_SIZE
+#define LRW_TX_QUEUE_SIZE 8
+#endif
+
+typedef struct {
+    uint8_t id;
+    uint8_t port;
+    uint8_t length;
+    bool confirmed : 1;
+    bool flushed : 1;
+    bool urgent : 1;
+    bool split : 1;         // Sent in fragments, see send_fragment
+    uint8_t transmissions;  // See lrw_tx_options_t
+    uint8_t split_id;       // Message number carried by each fragment
+    uint8_t fragment;       // Index of the next fragment
+    uint8_t offset;         // Payload bytes sent in previous fragments
+    uint8_t fragment_length;  // Payload bytes in the fragment in flight
+    uint8_t attempts;       // Transmissions with backoff so far, see backoff_retry
+    uint8_t channel;        // Channel of the previous attempt
+    uint8_t *payload;       // Pool block, NULL for an empty payload
+} tx_slot_t;
+
+static struct {
+    tx_slot_t slot[LRW_TX_QUEUE_SIZE];
+    uint8_t head;
+    uint8_t count;
+    uint8_t next_id;
+    uint8_t next_split_id;
+    bool in_flight;
+    TimerTime_t retry_at;   // Earliest time of the next attempt, see backoff_retry
+} tx_queue;
+
+// The channel a retransmission should hop away from, -1 if none. See
+// deprioritise_channels.
+static int hop_channel = -1;
+
+// Fragment header: the message number, and the fragment index with
+// SPLIT_LAST set in the last fragment. The first fragment also carries the
+// port of the original message.
+#define SPLIT_HEADER_SIZE 2
+#define SPLIT_LAST        0x80
+
+static TimerEvent_t tx_queue_timer;
+
+// With AT$SLOT, messages from the uplink queue start only within the device's
+// slot of each period of GPS time, see slot_wait. Devices that report on the
+// same period spread over it instead of colliding. The start is randomized
+// within the slot and the message must end SLOT_GUARD ms before the slot does.
+// The slot timer has no slack so that the slot is not missed.
+#define SLOT_GUARD 100
+
+static TimerEvent_t slot_timer;
+
+// RTC time (Unix seconds) below which the time is considered unknown
+#define MIN_VALID_TIME 1577836800
+
+// With AT$CLASSC, a device configured for class A switches to class C for a
+// bounded window, see class_c_poll. The MAC callbacks only request a window;
+// it is opened and closed from lrw_process once the MAC is idle, since
+// switching the class reconfigures the radio.
+static struct {
+    bool open;
+    bool start;          // Open the window, or extend the open window
+    bool end;            // Close the window
+    uint32_t windows;    // Windows opened since boot
+} class_c;
+
+static TimerEvent_t class_c_timer;           // Ends the open window
+static TimerEvent_t class_c_schedule_timer;  // Starts scheduled windows
+
+// How often to check for the GPS time before scheduling class C windows
+#define CLASS_C_TIME_POLL 60000
+
+
+// The persistent uplink store used by AT+UTX & co. when enabled with
+// AT$TXSTORE. Messages are appended to a log in the flash-backed store (see
+// store.h), so they survive resets and network outages. They are sent one at a
+// time from lrw_process while the network is known to be reachable, at most
+// one every sysconf.tx_store_interval seconds. A message is removed from the
+// store only once its delivery has been confirmed: by the ACK for confirmed
+// messages, by a downlink in the RX windows (e.g., the answer to a
+// LinkCheckReq piggybacked on the uplink) for unconfirmed ones. Without the
+// confirmation, the network is considered unreachable and a standalone link
+// check probes it every TX_STORE_PROBE_INTERVAL. Any downlink or link check
+// answer resumes the sending. Messages older than sysconf.tx_store_max_age
+// seconds are dropped. See drain_tx_store.
+#ifndef LRW_TX_STORE_SIZE
+#define LRW_TX_STORE_SIZE 8192
+#endif
+
+#define TX_STORE_PROBE_INTERVAL 300000
+#define TX_STORE_RETRY_INTERVAL 10000
+
+typedef struct {
+    uint32_t time;       // SysTime seconds when the message was stored
+    uint8_t port;
+    uint8_t confirmed;
+    uint8_t payload[LRW_TX_QUEUE_MAX_PAYLOAD];
+} tx_record_t;
+
+static struct {
+    part_log_t log;
+    bool ready;          // The log has been opened
+    bool online;         // The network is believed to be reachable
+    bool in_flight;      // The oldest message has been handed to the MAC
+    bool done;           // The MAC has confirmed the message in flight
+    bool delivered;      // The network has answered the message in flight
+    bool checking;       // A link check requested by the store is pending
+    bool flushed;        // An empty frame has flushed MAC commands, see lrw_send
+    bool kick;           // Set from the MAC callbacks to run drain_tx_store
+    TimerTime_t next;    // The earliest time of the next transmission (ms)
+} tx_store;
+
+static TimerEvent_t tx_store_timer;
+
+
+// The auto-pull policy enabled with AT$AUTOPULL. When a downlink indicates
+// that the network has more downlinks queued or that LoRaMac has MAC command
+// answers to send (IsUplinkTxPending), an empty uplink is sent as soon as the
+// MAC is idle and the duty cycle permits, so that the next downlink can be
+// delivered in its RX windows. This repeats until a downlink arrives without
+// the indication, an uplink gets no downlink, or AUTO_PULL_MAX uplinks have
+// been sent in a row. See pull_downlinks.
+#define AUTO_PULL_MAX 16
+
+static struct {
+    bool pending;        // An empty uplink is to be sent
+    uint8_t count;       // Empty uplinks sent since the last downlink without the indication
+} auto_pull;
+
+static TimerEvent_t auto_pull_timer;
+
+
+// The downlink queue. Received messages are copied here from mcps_indication
+// and written to the host from lrw_process only when the UART output buffer has
+// room for the whole message, so that a slow host or a burst of (multicast)
+// downlinks in class C never blocks the MAC. In the polling mode, the host
+// fetches the messages with AT$RECV?. The payload is kept in a block from the
+// shared message pool. See drain_rx_queue.
+#ifndef LRW_RX_QUEUE_SIZE
+#define LRW_RX_QUEUE_SIZE 8
+#endif
+
+// How often to check for room in the UART output buffer (ms)
+#define RX_QUEUE_RETRY_INTERVAL 20
+#define RX_QUEUE_TIMER_SLACK    20
+
+static struct {
+    lrw_downlink_t slot[LRW_RX_QUEUE_SIZE];
+    uint8_t head;
+    uint8_t count;
+    bool dropped;
+} rx_queue;
+
+static TimerEvent_t rx_queue_timer;
+
+// Per-group port filters for multicast downlinks configured with AT$MCFILTER.
+// A group with no ports configured accepts all ports. Frames filtered out are
+// dropped before they enter the receive queue, so they never wake the host.
+static uint8_t mc_filter[LORAMAC_MAX_MC_CTX][LRW_MC_FILTER_PORTS];
+
+// If non-zero, multicast downlinks are held in the receive queue for up to
+// this many milliseconds, so that the host receives fragments in batches
+// rather than one at a time. See hold_mc_batch.
+static uint32_t mc_batch_interval;
+
+
+#ifdef REGION_EU868
+// A per-band view of duty cycle availability in EU868. LoRaMac reports a wait
+// time only when it refuses a transmission, and the value applies to the band
+// that becomes available first. To predict when a queued message is going to
+// be sent, we keep our own estimate of when each band becomes available again,
+// based on the time-on-air of past uplinks and the band's duty cycle from the
+// region's band table. The estimate is conservative; it does not model the
+// time credits LoRaMac accumulates while a band is idle.
+static const Band_t eu868_bands[EU868_MAX_NB_BANDS] = {
+    EU868_BAND0, EU868_BAND1, EU868_BAND2, EU868_BAND3, EU868_BAND4, EU868_BAND5
+};
+static TimerTime_t band_deadline[EU868_MAX_NB_BANDS];
+#endif
+
+// The duty cycle deadlines are kept across warm resets (watchdog, software,
+// NRST) in RAM the startup code does not initialize, see the .noinit section
+// in the linker script. The RTC keeps running through such resets, so
+// restore_deadlines can tell how much of each wait is left. LoRaMac starts
+// with all bands available after a reset; uplinks are held back until
+// resume_deadline instead. A power-on reset stops the RTC and loses the RAM,
+// and the device starts with no restrictions as before.
+#define RETAINED_MAGIC 0x44435959
+
+static struct retained_deadlines {
+    uint32_t magic;
+    TimerTime_t deadline;       // lrw_dutycycle_deadline
+#ifdef REGION_EU868
+    TimerTime_t band[EU868_MAX_NB_BANDS];
+#endif
+    uint32_t crc32;
+} retained __attribute__((section(".noinit")));
+
+// Uplinks are refused with LORAMAC_STATUS_DUTYCYCLE_RESTRICTED until this time
+// (ms) after a warm reset
+static TimerTime_t resume_deadline;
 
+
+#if !defined(FIXED_REGION) || DEBUG_LOG != 0
 static struct {
     const char *name;
     int id;
@@ -57,6 +386,7 @@ static struct {
     { "US915", LORAMAC_REGION_US915 },
     { "RU864", LORAMAC_REGION_RU864 }
 };
+#endif
 
 
 #if RESTORE_CHMASK_AFTER_JOIN == 1
@@ -64,6 +394,7 @@ static uint16_t saved_chmask[REGION_NVM_CHANNELS_MASK_SIZE];
 #endif
 
 
+#ifndef FIXED_REGION
 static int region2id(const char *name)
 {
     if (name == NULL) return -1;
@@ -72,6 +403,7 @@ static int region2id(const char *name)
         if (!strcmp(region_map[i].name, name)) return region_map[i].id;
     return -2;
 }
+#endif
 
 #if DEBUG_LOG != 0
 static const char *region2str(int id)
@@ -82,11 +414,323 @@ static const char *region2str(int id)
 }
 #endif
 
+// The battery voltage reported in DevStatusAns. Reading VDD requires the ADC
+// to be initialized and calibrated, which is too slow to be done while LoRaMac
+// processes MAC commands. The voltage is thus measured right after each
+// transmission, when the battery is the most loaded, and smoothed with an
+// exponential moving average. LoRaMac gets the cached value. Measurements are
+// disabled until the voltage range of the battery is configured with AT$BAT.
+static struct {
+    uint16_t empty;     // Voltage of an empty battery (mV), 0 if disabled
+    uint16_t full;      // Voltage of a full battery (mV)
+    uint16_t voltage;   // Filtered voltage (mV), 0 if not measured yet
+    uint32_t tx_count;  // The value of radio_tx_count at the last measurement
+} battery;
+
+
+// Battery policy, see lrw_batpol_set. It acts on the filtered voltage above.
+// Below the low threshold, uplinks are spaced at least batpol.interval seconds
+// apart, sent one data rate higher if ADR is off, and BATPOL_POWER_STEP power
+// indices lower, and LoRaMac state writes are batched in a write-behind window
+// of at least BATPOL_NVM_WINDOW seconds. Below the critical threshold, uplinks
+// are refused. A state is left once the voltage has recovered by
+// BATPOL_HYSTERESIS mV above its threshold. Each change is reported with
+// +EVENT=13.
+#define BATPOL_HYSTERESIS 50
+#define BATPOL_POWER_STEP 1
+#define BATPOL_NVM_WINDOW 60
+#define BATPOL_NVM_FCNT_MARGIN 16
+
+// How long to refuse uplinks in the critical state before the voltage is
+// measured again (ms)
+#define BATPOL_CRITICAL_RETRY (60 * 1000)
+
+static struct {
+    uint16_t low;        // Low threshold (mV), 0 if disabled
+    uint16_t critical;   // Critical threshold (mV), 0 if disabled
+    uint16_t interval;   // Minimum uplink spacing in the low state (s)
+    uint8_t state;       // See enum lrw_battery_state
+    bool sent;           // An uplink has been sent in the low state
+    TimerTime_t last;    // Time of the most recent uplink (ms)
+} batpol;
+
+
+static void batpol_set_power(bool lower)
+{
+    LoRaMacNvmData_t *state = lrw_get_state();
+    MibRequestConfirm_t r = { .Type = MIB_CHANNELS_DEFAULT_TX_POWER };
+    int power;
+
+    GetPhyParams_t req = { .Attribute = PHY_MIN_TX_POWER };
+    int min_power = RegionGetPhyParam(state->MacGroup2.Region, &req).Value;
+
+    if (lower) {
+        r.Type = MIB_CHANNELS_TX_POWER;
+        LoRaMacMibGetRequestConfirm(&r);
+        power = r.Param.ChannelsTxPower + BATPOL_POWER_STEP;
+        r.Param.ChannelsTxPower = power > min_power ? min_power : power;
+    } else {
+        LoRaMacMibGetRequestConfirm(&r);
+        r.Type = MIB_CHANNELS_TX_POWER;
+        r.Param.ChannelsTxPower = r.Param.ChannelsDefaultTxPower;
+    }
+    LoRaMacMibSetRequestConfirm(&r);
+}
+
+
+static void batpol_update(void)
+{
+    unsigned int state = LRW_BATTERY_NORMAL;
+    uint16_t v = battery.voltage;
+
+    // Without a measurement, the policy does not apply
+    if (battery.empty == 0 || v == 0) v = UINT16_MAX;
+
+    if (batpol.low && v < batpol.low
+        + (batpol.state != LRW_BATTERY_NORMAL ? BATPOL_HYSTERESIS : 0U))
+        state = LRW_BATTERY_LOW;
+    if (batpol.critical && v < batpol.critical
+        + (batpol.state == LRW_BATTERY_CRITICAL ? BATPOL_HYSTERESIS : 0U))
+        state = LRW_BATTERY_CRITICAL;
+
+    if (state == batpol.state) return;
+
+    if ((batpol.state == LRW_BATTERY_NORMAL) != (state == LRW_BATTERY_NORMAL))
+        batpol_set_power(state != LRW_BATTERY_NORMAL);
+
+    log_info("Battery %u mV, policy state %u", battery.voltage, state);
+    batpol.state = state;
+    batpol.sent = false;
+
+    int arg = battery.voltage;
+    cmd_event_args(CMD_EVENT_BATTERY, state, &arg, 1);
+}
+
+
+static void measure_battery(void)
+{
+    uint16_t v = adc_get_battery_level();
+    if (v == 0) return;
+
+    if (battery.voltage == 0) battery.voltage = v;
+    else battery.voltage += ((int)v - (int)battery.voltage) / 4;
+
+    batpol_update();
+}
+
+
+// Refuse the uplink if the battery policy does not allow it now, and set the
+// duty cycle deadline to the time it will
+static LoRaMacStatus_t check_battery_policy(void)
+{
+    TimerTime_t now = TimerGetCurrentTime();
+    uint32_t wait, elapsed;
+
+    if (batpol.state == LRW_BATTERY_CRITICAL) {
+        // Nothing else measures the voltage while uplinks are refused
+        measure_battery();
+        if (batpol.state == LRW_BATTERY_CRITICAL) {
+            lrw_dutycycle_deadline = rtc_tick2ms(rtc_get_timer_value()) + BATPOL_CRITICAL_RETRY;
+            return LORAMAC_STATUS_DUTYCYCLE_RESTRICTED;
+        }
+    }
+
+    if (batpol.state != LRW_BATTERY_LOW || !batpol.sent || !batpol.interval)
+        return LORAMAC_STATUS_OK;
+
+    elapsed = now - batpol.last;
+    if (elapsed >= batpol.interval * 1000UL) return LORAMAC_STATUS_OK;
+
+    wait = batpol.interval * 1000UL - elapsed;
+    lrw_dutycycle_deadline = rtc_tick2ms(rtc_get_timer_value()) + wait;
+    log_debug("Battery low, next uplink in %lu ms", wait);
+    return LORAMAC_STATUS_DUTYCYCLE_RESTRICTED;
+}
+
+
+// One data rate higher in the low state if ADR is off
+static uint8_t batpol_datarate(uint8_t dr)
+{
+    LoRaMacNvmData_t *state = lrw_get_state();
+    MibRequestConfirm_t r = { .Type = MIB_ADR };
+
+    if (batpol.state != LRW_BATTERY_LOW) return dr;
+
+    LoRaMacMibGetRequestConfirm(&r);
+    if (r.Param.AdrEnable) return dr;
+
+    GetPhyParams_t req = {
+        .Attribute = PHY_MAX_TX_DR,
+        .UplinkDwellTime = state->MacGroup2.MacParams.UplinkDwellTime
+    };
+    return dr < RegionGetPhyParam(state->MacGroup2.Region, &req).Value ? dr + 1 : dr;
+}
+
+
+// The write-behind window and the frame counter margin in effect, see
+// save_state. The battery policy batches writes in the low and critical states
+// even if the window has not been configured with AT$NVMPOLICY.
+static unsigned int nvm_window(void)
+{
+    if (batpol.state != LRW_BATTERY_NORMAL && sysconf.nvm_window < BATPOL_NVM_WINDOW)
+        return BATPOL_NVM_WINDOW;
+    if (sysconf.sleep && sysconf.power_profile == SYSTEM_POWER_ULTRA_LOW
+        && sysconf.nvm_window < SYSTEM_ULP_NVM_WINDOW)
+        return SYSTEM_ULP_NVM_WINDOW;
+    return sysconf.nvm_window;
+}
+
+
+static unsigned int nvm_fcnt_margin(void)
+{
+    if (sysconf.nvm_window == 0 && batpol.state != LRW_BATTERY_NORMAL)
+        return BATPOL_NVM_FCNT_MARGIN;
+    return sysconf.nvm_fcnt_margin;
+}
+
+
+// Temperature compensation of the RTC crystal. While enabled, the MCU
+// temperature is sampled after each transmission, when the ADC is in use
+// anyway, and at least every TEMP_COMP_INTERVAL, so that long sleeps are
+// covered too. Each sample updates the RTC smooth calibration.
+#define TEMP_COMP_INTERVAL (10 * 60 * 1000)
+
+static struct {
+    bool enabled;
+    bool valid;
+    int16_t level;      // The most recent sample (q7.8 degC)
+    float temperature;  // The same for LoRaMac and the RTC compensation
+} temp_comp;
+
+static TimerEvent_t temp_comp_timer;
+
+
+static void on_temp_comp_timer(void *ctx)
+{
+    (void)ctx;
+    events |= SAMPLE_TEMP;
+    system_post(SYSTEM_TASK_LORA);
+}
+
+
+static void sample_temperature(void)
+{
+    temp_comp.level = (int16_t)adc_get_temperature_level();
+    temp_comp.temperature = temp_comp.level / 256.f;
+    temp_comp.valid = true;
+    rtc_compensate_temperature(temp_comp.temperature);
+
+    TimerStop(&temp_comp_timer);
+    TimerSetValue(&temp_comp_timer, TEMP_COMP_INTERVAL);
+    TimerStart(&temp_comp_timer);
+}
+
+
+static void sample_after_tx(void)
+{
+    uint32_t count = radio_tx_count;
+
+    if (count == battery.tx_count) return;
+    battery.tx_count = count;
+
+    if (battery.empty != 0) measure_battery();
+    if (temp_comp.enabled) sample_temperature();
+}
+
+
+static float get_temperature_level(void)
+{
+    // Class B widens beacon windows by the temperature drift of the RTC. Serve
+    // the cached sample if there is one.
+    if (temp_comp.enabled && temp_comp.valid) return temp_comp.temperature;
+    return adc_get_temperature_celsius();
+}
+
+
+void lrw_temp_comp_set(bool enabled)
+{
+    temp_comp.enabled = enabled;
+    temp_comp.valid = false;
+
+    if (enabled) {
+        sample_temperature();
+    } else {
+        TimerStop(&temp_comp_timer);
+        rtc_clear_temperature_compensation();
+    }
+}
+
+
+bool lrw_temp_comp_get(int16_t *temperature, int32_t *compensation)
+{
+    // Round q7.8 to tenths of degC in integer arithmetic
+    int32_t t = temp_comp.level * 10;
+    if (temperature) *temperature = (t + (t < 0 ? -128 : 128)) / 256;
+    if (compensation) *compensation = rtc_get_temperature_compensation();
+    return temp_comp.enabled;
+}
+
+
 static uint8_t get_battery_level(void)
 {
     // callback to get the battery level in % of full charge (254 full charge, 0
     // no charge)
-    return MAX_BAT;
+    if (battery.empty == 0 || battery.voltage == 0) return MAX_BAT;
+
+    if (battery.voltage <= battery.empty) return 1;
+    if (battery.voltage >= battery.full) return MAX_BAT;
+    return 1 + (uint32_t)(battery.voltage - battery.empty) * (MAX_BAT - 1)
+        / (battery.full - battery.empty);
+}
+
+
+int lrw_battery_set(uint16_t empty, uint16_t full)
+{
+    if (empty != 0 && full <= empty) return -1;
+
+    battery.empty = empty;
+    battery.full = full;
+    battery.voltage = 0;
+
+    // Take the first sample now so that DevStatusAns has a value even before
+    // the next transmission
+    if (empty != 0) measure_battery();
+    batpol_update();
+    return 0;
+}
+
+
+uint8_t lrw_battery_get(uint16_t *empty, uint16_t *full, uint16_t *voltage)
+{
+    if (empty) *empty = battery.empty;
+    if (full) *full = battery.full;
+    if (voltage) *voltage = battery.voltage;
+    return get_battery_level();
+}
+
+
+void lrw_battery_measure(void)
+{
+    measure_battery();
+}
+
+
+void lrw_batpol_set(uint16_t low, uint16_t critical, uint16_t interval)
+{
+    batpol.low = low;
+    batpol.critical = critical;
+    batpol.interval = interval;
+    if (battery.empty != 0) measure_battery();
+    batpol_update();
+}
+
+
+unsigned int lrw_batpol_get(uint16_t *low, uint16_t *critical, uint16_t *interval)
+{
+    if (low) *low = batpol.low;
+    if (critical) *critical = batpol.critical;
+    if (interval) *interval = batpol.interval;
+    return batpol.state;
 }
 
 
@@ -96,38 +740,123 @@ static void process_notify(void)
     // generated by the radio), or from the thread context (manually invoked by
     // LoRaMac during ABP activation).
     //
-    // Disable sleep so that LoRaMacProcess() gets a chance to run to process
-    // the event.
-    uint32_t mask = disable_irq();
-    system_sleep_lock |= SYSTEM_MODULE_LORA;
-    reenable_irq(mask);
+    // Post the LoRa task so that LoRaMacProcess() gets a chance to run to
+    // process the event.
+    system_post(SYSTEM_TASK_LORA);
+}
+
+
+#if DEVNONCE_BLOCK > 1
+
+// Return true if the crypto state differs from the state saved last only in a
+// DevNonce below the end of the reserved block. Each Join request advances the
+// DevNonce and would otherwise write the crypto state. The DevNonce saved in
+// NVM is the end of the block, so the modem skips ahead to it after a reset.
+static bool devnonce_reserved(const LoRaMacCryptoNvmData_t *c)
+{
+    LoRaMacCryptoNvmData_t t;
+
+    if (c->DevNonce >= reserved_devnonce) return false;
+
+    memcpy(&t, c, sizeof(t));
+    t.DevNonce = saved_crypto.DevNonce;
+
+    // The uplink frame counter may be ahead of the last write within the
+    // margin of the write-behind window
+    if (nvm_window() != 0 && c->FCntList.FCntUp < saved_fcnt_up)
+        t.FCntList.FCntUp = saved_crypto.FCntList.FCntUp;
+
+    return memcmp(&t, &saved_crypto, offsetof(LoRaMacCryptoNvmData_t, Crc32)) == 0;
 }
 
+#endif
+
 
 static void save_state(void)
 {
-    uint32_t mask;
     LoRaMacNvmData_t *s;
+    int status;
 
-    if (nvm_flags == LORAMAC_NVM_NOTIFY_FLAG_NONE) {
-        mask = disable_irq();
-        system_sleep_lock &= ~SYSTEM_MODULE_NVM;
-        reenable_irq(mask);
+    // The state is written to NVM in the background, one group at a time. If
+    // the previous write is still in progress, let the MCU sleep. The EEPROM
+    // interrupt handler will post the NVM task once the write is done.
+    status = eeprom_async_status();
+
+    if (status < 0) {
+        log_error("Error while writing LoRaMac state to NVM");
+        // Do not commit a group that may have been written only partially
+        uncommitted = NULL;
+    }
+    if (status > 0) return;
+
+    // Groups are written into the inactive bank of their shadow part and only
+    // become valid once the trailer has been written after them. The commit
+    // does not depend on LoRaMac and is never deferred.
+    if (uncommitted != NULL) {
+        system_post(SYSTEM_TASK_NVM);
+        if (!part_shadow_commit(uncommitted))
+            log_error("Error while committing LoRaMac state to NVM");
+        uncommitted = NULL;
         return;
     }
 
-    mask = disable_irq();
-    system_sleep_lock |= SYSTEM_MODULE_NVM;
-    reenable_irq(mask);
-
     s = lrw_get_state();
 
+    // With a non-zero write-behind window, changes are only written once the
+    // window has expired. The write cannot be deferred if a system reset has
+    // been scheduled, or if the device has used up all the uplink frame
+    // counter values reserved in NVM (see below).
+    if (nvm_flags == LORAMAC_NVM_NOTIFY_FLAG_NONE
+        || (nvm_window() != 0 && !nvm_flush_due && !schedule_reset
+            && s->Crypto.FCntList.FCntUp < saved_fcnt_up)) {
+        if (nvm_flags == LORAMAC_NVM_NOTIFY_FLAG_NONE) nvm_flush_due = false;
+        return;
+    }
+
+    // Come back for the remaining groups on the next iteration of the main
+    // loop
+    system_post(SYSTEM_TASK_NVM);
+
     if (nvm_flags & LORAMAC_NVM_NOTIFY_FLAG_CRYPTO) {
         if (LoRaMacIsBusy()) return;
 
+#if DEVNONCE_BLOCK > 1
+        if (devnonce_reserved(&s->Crypto)) {
+            nvm_flags &= ~LORAMAC_NVM_NOTIFY_FLAG_CRYPTO;
+            return;
+        }
+#endif
+
+        // Save a copy of the crypto state since the write is performed in the
+        // background. If the write-behind window is enabled, the saved uplink
+        // frame counter is advanced by the configured margin. Should the device
+        // lose power before the next write, it will resume from the saved
+        // value and will never reuse a frame counter value. The DevNonce is
+        // advanced by DEVNONCE_BLOCK the same way.
+        saved_crypto = s->Crypto;
+        if (nvm_window() != 0) {
+            saved_crypto.FCntList.FCntUp += nvm_fcnt_margin();
+            update_block_crc(&saved_crypto, sizeof(saved_crypto));
+        }
+        saved_fcnt_up = saved_crypto.FCntList.FCntUp;
+
+#if DEVNONCE_BLOCK > 1
+        saved_crypto.DevNonce = s->Crypto.DevNonce > UINT16_MAX - DEVNONCE_BLOCK
+            ? UINT16_MAX : s->Crypto.DevNonce + DEVNONCE_BLOCK;
+        update_block_crc(&saved_crypto, sizeof(saved_crypto));
+#endif
+        reserved_devnonce = saved_crypto.DevNonce;
+
         log_debug("Saving Crypto state to NVM");
-        if (!part_write(&nvm_parts.crypto, 0, &s->Crypto, sizeof(s->Crypto)))
-            log_error("Error while writing Crypto state to NVM");
+        if (nvm_journal.slots != 0) {
+            if (!part_journal_append(&nvm_journal, &saved_crypto))
+                log_error("Error while writing Crypto state to NVM journal");
+        } else {
+            if (part_shadow_write_async(&nvm_shadows.crypto, &saved_crypto))
+                uncommitted = &nvm_shadows.crypto;
+            else
+                log_error("Error while writing Crypto state to NVM");
+        }
         nvm_flags &= ~LORAMAC_NVM_NOTIFY_FLAG_CRYPTO;
         return;
     }
@@ -136,7 +865,10 @@ static void save_state(void)
         if (LoRaMacIsBusy()) return;
 
         log_debug("Saving MacGroup1 state to NVM");
-        if (!part_write(&nvm_parts.mac1, 0, &s->MacGroup1, sizeof(s->MacGroup1)))
+        staged.mac1 = s->MacGroup1;
+        if (part_shadow_write_async(&nvm_shadows.mac1, &staged.mac1))
+            uncommitted = &nvm_shadows.mac1;
+        else
             log_error("Error while writing MacGroup1 state to NVM");
         nvm_flags &= ~LORAMAC_NVM_NOTIFY_FLAG_MAC_GROUP1;
         return;
@@ -146,7 +878,10 @@ static void save_state(void)
         if (LoRaMacIsBusy()) return;
 
         log_debug("Saving MacGroup2 state to NVM");
-        if (!part_write(&nvm_parts.mac2, 0, &s->MacGroup2, sizeof(s->MacGroup2)))
+        staged.mac2 = s->MacGroup2;
+        if (part_shadow_write_async(&nvm_shadows.mac2, &staged.mac2))
+            uncommitted = &nvm_shadows.mac2;
+        else
             log_error("Error while writing MacGroup2 state to NVM");
         nvm_flags &= ~LORAMAC_NVM_NOTIFY_FLAG_MAC_GROUP2;
         return;
@@ -156,7 +891,10 @@ static void save_state(void)
         if (LoRaMacIsBusy()) return;
 
         log_debug("Saving SecureElement state to NVM");
-        if (!part_write(&nvm_parts.se, 0, &s->SecureElement, sizeof(s->SecureElement)))
+        staged.se = s->SecureElement;
+        if (part_shadow_write_async(&nvm_shadows.se, &staged.se))
+            uncommitted = &nvm_shadows.se;
+        else
             log_error("Error while writing SecureElement state to NVM");
         nvm_flags &= ~LORAMAC_NVM_NOTIFY_FLAG_SECURE_ELEMENT;
         return;
@@ -166,7 +904,10 @@ static void save_state(void)
         if (LoRaMacIsBusy()) return;
 
         log_debug("Saving RegionGroup1 state to NVM");
-        if (!part_write(&nvm_parts.region1, 0, &s->RegionGroup1, sizeof(s->RegionGroup1)))
+        staged.region1 = s->RegionGroup1;
+        if (part_shadow_write_async(&nvm_shadows.region1, &staged.region1))
+            uncommitted = &nvm_shadows.region1;
+        else
             log_error("Error while writing RegionGroup1 state to NVM");
         nvm_flags &= ~LORAMAC_NVM_NOTIFY_FLAG_REGION_GROUP1;
         return;
@@ -176,7 +917,9 @@ static void save_state(void)
         if (LoRaMacIsBusy()) return;
 
         log_debug("Saving RegionGroup2 state to NVM");
-        if (!part_write(&nvm_parts.region2, 0, &s->RegionGroup2, sizeof(s->RegionGroup2)))
+        // The group has no shadow copy, a torn write would be restored as is
+        staged.region2 = s->RegionGroup2;
+        if (!part_write_async(&nvm_parts.region2, 0, &staged.region2, sizeof(staged.region2)))
             log_error("Error while writing RegionGroup2 state to NVM");
         nvm_flags &= ~LORAMAC_NVM_NOTIFY_FLAG_REGION_GROUP2;
         return;
@@ -186,7 +929,10 @@ static void save_state(void)
         if (LoRaMacIsBusy()) return;
 
         log_debug("Saving ClassB state to NVM");
-        if (!part_write(&nvm_parts.classb, 0, &s->ClassB, sizeof(s->ClassB)))
+        staged.classb = s->ClassB;
+        if (part_shadow_write_async(&nvm_shadows.classb, &staged.classb))
+            uncommitted = &nvm_shadows.classb;
+        else
             log_error("Error while writing ClassB state to NVM");
         nvm_flags &= ~LORAMAC_NVM_NOTIFY_FLAG_CLASS_B;
         return;
@@ -194,38 +940,72 @@ static void save_state(void)
 }
 
 
-static void restore_state(void)
+// Copy an NVM group from EEPROM into the LoRaMac context, but only if the
+// group's checksum matches. LoRaMac ignores groups with an invalid checksum
+// when restoring and keeps its defaults, so must we. A group known to be
+// intact, i.e., a valid shadow or journal record after a warm reset (see
+// nvm_retain), is copied without computing its checksum.
+static void restore_group(void *dst, const void *src, size_t size, size_t crc_offset, bool intact)
 {
-    size_t size;
-    const unsigned char *p;
-    LoRaMacNvmData_t s;
+    uint32_t crc;
 
-    memset(&s, 0, sizeof(s));
+    if (src == NULL) return;
+
+    memcpy(&crc, (const uint8_t *)src + crc_offset, sizeof(crc));
+    if (!intact && Crc32((uint8_t *)src, crc_offset) != crc) return;
+
+    memcpy(dst, src, size);
+}
 
-    p = part_mmap(&size, &nvm_parts.crypto);
-    if (p && size >= sizeof(s.Crypto)) memcpy(&s.Crypto, p, sizeof(s.Crypto));
 
-    p = part_mmap(&size, &nvm_parts.mac1);
-    if (p && size >= sizeof(s.MacGroup1)) memcpy(&s.MacGroup1, p, sizeof(s.MacGroup1));
+static void restore_part(void *dst, const part_t *part, size_t size, size_t crc_offset)
+{
+    size_t len;
+    const void *p = part_mmap(&len, part);
+    if (p != NULL && len >= size) restore_group(dst, p, size, crc_offset, false);
+}
 
-    p = part_mmap(&size, &nvm_parts.mac2);
-    if (p && size >= sizeof(s.MacGroup2)) memcpy(&s.MacGroup2, p, sizeof(s.MacGroup2));
 
-    p = part_mmap(&size, &nvm_parts.se);
-    if (p && size >= sizeof(s.SecureElement)) memcpy(&s.SecureElement, p, sizeof(s.SecureElement));
+static void restore_shadow(void *dst, const part_shadow_t *shadow, size_t size, size_t crc_offset)
+{
+    if (shadow->record_size >= size)
+        restore_group(dst, part_shadow_read(shadow), size, crc_offset, nvm_warm && shadow->valid);
+}
 
-    p = part_mmap(&size, &nvm_parts.region1);
-    if (p && size >= sizeof(s.RegionGroup1)) memcpy(&s.RegionGroup1, p, sizeof(s.RegionGroup1));
 
-    p = part_mmap(&size, &nvm_parts.region2);
-    if (p && size >= sizeof(s.RegionGroup2)) memcpy(&s.RegionGroup2, p, sizeof(s.RegionGroup2));
+static void restore_state(void)
+{
+    const void *p;
+
+    // Restore the groups from the memory-mapped EEPROM directly into the
+    // LoRaMac context rather than through a copy of the entire context on the
+    // stack. MIB_NVM_CTXS below then validates the groups in place and
+    // performs LoRaMac's own post-restore initialization.
+    LoRaMacNvmData_t *s = lrw_get_state();
+
+    // The crypto state is saved in the journal if there is one. Fall back to
+    // the crypto shadow part if the journal is empty, e.g., after a firmware upgrade
+    // or after a factory reset which writes the crypto part directly.
+    p = part_journal_read(&nvm_journal);
+    if (p) {
+        restore_group(&s->Crypto, p, sizeof(s->Crypto), offsetof(LoRaMacCryptoNvmData_t, Crc32), nvm_warm);
+    } else {
+        restore_shadow(&s->Crypto, &nvm_shadows.crypto, sizeof(s->Crypto), offsetof(LoRaMacCryptoNvmData_t, Crc32));
+    }
+    saved_fcnt_up = s->Crypto.FCntList.FCntUp;
+    saved_crypto = s->Crypto;
+    reserved_devnonce = s->Crypto.DevNonce;
 
-    p = part_mmap(&size, &nvm_parts.classb);
-    if (p && size >= sizeof(s.ClassB)) memcpy(&s.ClassB, p, sizeof(s.ClassB));
+    restore_shadow(&s->MacGroup1, &nvm_shadows.mac1, sizeof(s->MacGroup1), offsetof(LoRaMacNvmDataGroup1_t, Crc32));
+    restore_shadow(&s->MacGroup2, &nvm_shadows.mac2, sizeof(s->MacGroup2), offsetof(LoRaMacNvmDataGroup2_t, Crc32));
+    restore_shadow(&s->SecureElement, &nvm_shadows.se, sizeof(s->SecureElement), offsetof(SecureElementNvmData_t, Crc32));
+    restore_shadow(&s->RegionGroup1, &nvm_shadows.region1, sizeof(s->RegionGroup1), offsetof(RegionNvmDataGroup1_t, Crc32));
+    restore_part(&s->RegionGroup2, &nvm_parts.region2, sizeof(s->RegionGroup2), offsetof(RegionNvmDataGroup2_t, Crc32));
+    restore_shadow(&s->ClassB, &nvm_shadows.classb, sizeof(s->ClassB), offsetof(LoRaMacClassBNvmData_t, Crc32));
 
     MibRequestConfirm_t r = {
         .Type = MIB_NVM_CTXS,
-        .Param = { .Contexts = &s }
+        .Param = { .Contexts = s }
     };
     int rc = LoRaMacMibSetRequestConfirm(&r);
     if (rc != LORAMAC_STATUS_OK)
@@ -233,19 +1013,83 @@ static void restore_state(void)
 }
 
 
+// Translate a deadline of the previous boot into the timer of this boot. The
+// previous timer had reached elapsed ms at the time of the reset.
+static TimerTime_t shift_deadline(TimerTime_t deadline, TimerTime_t elapsed, TimerTime_t now)
+{
+    return deadline > elapsed ? now + (deadline - elapsed) : 0;
+}
+
+
+static void restore_deadlines(void)
+{
+    TimerTime_t elapsed, now;
+    uint64_t previous = rtc_previous_ticks();
+
+    if (previous == 0 || retained.magic != RETAINED_MAGIC) return;
+    if (Crc32((uint8_t *)&retained, offsetof(struct retained_deadlines, crc32)) != retained.crc32) return;
+
+    elapsed = rtc_tick2ms((uint32_t)previous);
+    now = rtc_tick2ms(rtc_get_timer_value());
+
+    lrw_dutycycle_deadline = shift_deadline(retained.deadline, elapsed, now);
+#ifdef REGION_EU868
+    for (unsigned int i = 0; i < EU868_MAX_NB_BANDS; i++)
+        band_deadline[i] = shift_deadline(retained.band[i], elapsed, now);
+#endif
+
+    // The earliest time one of the enabled channels is available
+    resume_deadline = now + lrw_predict_tx_delay();
+    if (resume_deadline > lrw_dutycycle_deadline) lrw_dutycycle_deadline = resume_deadline;
+    if (resume_deadline > now)
+        log_debug("Duty cycle: Holding uplinks for %lu ms after reset", resume_deadline - now);
+}
+
+
+// Keep the current deadlines in retained RAM. Invoked from the main loop.
+static void retain_deadlines(void)
+{
+    if (retained.magic == RETAINED_MAGIC && retained.deadline == lrw_dutycycle_deadline
+#ifdef REGION_EU868
+        && !memcmp(retained.band, band_deadline, sizeof(band_deadline))
+#endif
+        ) return;
+
+    retained.magic = RETAINED_MAGIC;
+    retained.deadline = lrw_dutycycle_deadline;
+#ifdef REGION_EU868
+    memcpy(retained.band, band_deadline, sizeof(band_deadline));
+#endif
+    retained.crc32 = Crc32((uint8_t *)&retained, offsetof(struct retained_deadlines, crc32));
+}
+
+
+// Refuse the uplink while the duty cycle time-off of the previous boot lasts
+static LoRaMacStatus_t check_resume_deadline(void)
+{
+    if (resume_deadline == 0) return LORAMAC_STATUS_OK;
+    if (rtc_tick2ms(rtc_get_timer_value()) >= resume_deadline) {
+        resume_deadline = 0;
+        return LORAMAC_STATUS_OK;
+    }
+
+    if (lrw_dutycycle_deadline < resume_deadline) lrw_dutycycle_deadline = resume_deadline;
+    return LORAMAC_STATUS_DUTYCYCLE_RESTRICTED;
+}
+
+
 static uint8_t dev_eui[SE_EUI_SIZE];
 static_assert(sizeof(((SecureElementNvmData_t *)0)->DevEui) == sizeof(dev_eui), "Unsupported DevEUI size found in LoRaMac-node");
 
 static void load_deveui(void)
 {
-    size_t size;
     uint32_t crc;
 
     memset(dev_eui, '\0', sizeof(dev_eui));
 
-    const SecureElementNvmData_t *p = part_mmap(&size, &nvm_parts.se);
+    const SecureElementNvmData_t *p = part_shadow_read(&nvm_shadows.se);
     if (p == NULL) return;
-    if (size < sizeof(SecureElementNvmData_t)) return;
+    if (nvm_shadows.se.record_size < sizeof(SecureElementNvmData_t)) return;
 
     // Only restore the DevEUI if the crc32 checksum over the entire block
     // matches, or if the checksum calculated over the DevEui parameter matches.
@@ -269,13 +1113,12 @@ static void load_deveui(void)
 
 static int restore_region(void)
 {
-    size_t size;
     LoRaMacRegion_t region;
     uint32_t crc;
 
-    const LoRaMacNvmDataGroup2_t *p = part_mmap(&size, &nvm_parts.mac2);
+    const LoRaMacNvmDataGroup2_t *p = part_shadow_read(&nvm_shadows.mac2);
     if (p == NULL) goto out;
-    if (size < sizeof(LoRaMacNvmDataGroup2_t)) goto out;
+    if (nvm_shadows.mac2.record_size < sizeof(LoRaMacNvmDataGroup2_t)) goto out;
 
     // Only restore the region parameter value if the crc32 checksum over the
     // entire block matches, or if the checksum calculated over the region
@@ -297,91 +1140,2647 @@ static int restore_region(void)
     }
 
 out:
+#ifdef FIXED_REGION
+    return FIXED_REGION;
+#else
     return region2id(DEFAULT_ACTIVE_REGION);
+#endif
 }
 
 
-static void state_changed(uint16_t flags)
+static void on_nvm_flush_timer(void *ctx)
 {
-    nvm_flags |= flags;
+    (void)ctx;
+    nvm_flush_due = true;
+    system_post(SYSTEM_TASK_NVM);
 }
 
 
-static void on_ack(bool ack_received)
+static void state_changed(uint16_t flags)
 {
-    if (ack_received) {
-        cmd_print("+ACK\r\n\r\n");
-    } else {
-        cmd_print("+NOACK\r\n\r\n");
+    nvm_flags |= flags;
+
+    // Start the write-behind window with the first change
+    if (nvm_window() != 0 && !nvm_flush_due && !TimerIsStarted(&nvm_flush_timer)) {
+        TimerSetValue(&nvm_flush_timer, nvm_window() * 1000);
+        TimerStart(&nvm_flush_timer);
     }
 }
 
 
-static void recv(uint8_t port, uint8_t *buffer, uint8_t length)
-{
-    atci_printf("+RECV=%d,%d\r\n\r\n", port, length);
+static const KeyIdentifier_t region_session_keys[REGION_CACHE_KEYS] = {
+    F_NWK_S_INT_KEY, S_NWK_S_INT_KEY, NWK_S_ENC_KEY, APP_S_KEY
+};
 
-    if (sysconf.data_format) {
-        atci_print_buffer_as_hex(buffer, length);
-    } else {
-        atci_write((char *) buffer, length);
-    }
-    atci_write("\r\n", 2);
-}
+static_assert(SE_KEY_SIZE == sizeof(((region_session_t *)0)->keys[0]), "Unsupported key size found in LoRaMac-node");
+static_assert(REGION_NVM_CHANNELS_MASK_SIZE <= sizeof(((region_session_t *)0)->mask) / sizeof(uint16_t), "The region cache cannot hold the channel mask");
 
 
-static void mcps_confirm(McpsConfirm_t *param)
+static const uint8_t *find_se_key(const SecureElementNvmData_t *se, KeyIdentifier_t id)
 {
-    log_debug("mcps_confirm: McpsRequest: %d, Channel: %ld AckReceived: %d", param->McpsRequest, param->Channel, param->AckReceived);
-    tx_params = *param;
-
-    if (param->McpsRequest == MCPS_CONFIRMED)
-        on_ack(param->AckReceived == 1);
+    for (int i = 0; i < NUM_OF_KEYS; i++)
+        if (se->KeyList[i].KeyID == id) return se->KeyList[i].KeyValue;
+    return NULL;
 }
 
 
-static void mcps_retransmit(void)
+// Return the index of the valid region cache entry for the given region in the
+// active network profile, or -1
+static int find_region_session(const region_session_t *cache, uint8_t region)
 {
-    cmd_event(CMD_EVENT_NETWORK, CMD_NET_RETRANSMISSION);
+    for (int i = 0; i < REGION_CACHE_ENTRIES; i++) {
+        if (!check_block_crc(&cache[i], sizeof(cache[i]))) continue;
+        if (cache[i].region == region && cache[i].profile == sysconf.profile) return i;
+    }
+    return -1;
 }
 
 
-static void mcps_indication(McpsIndication_t *param)
+// Save the session of the current region into the region cache before
+// lrw_set_region wipes it out. The entry of the same region is overwritten,
+// otherwise an empty entry or the least recently saved one is used.
+static void save_region_session(void)
 {
-    log_debug("mcps_indication: status: %d rssi: %d", param->Status, param->Rssi);
-
+    LoRaMacNvmData_t *state = lrw_get_state();
+    const region_session_t *cache;
+    region_session_t s;
+    MibRequestConfirm_t r;
+    const uint8_t *key;
+    size_t size;
+    int i, slot, n;
+    bool valid[REGION_CACHE_ENTRIES];
+
+    if (state->MacGroup2.NetworkActivation == ACTIVATION_TYPE_NONE) return;
+
+    cache = part_mmap(&size, &nvm_parts.regions);
+    if (cache == NULL || size < REGION_CACHE_ENTRIES * sizeof(*cache)) return;
+
+    memset(&s, 0, sizeof(s));
+    s.region = state->MacGroup2.Region;
+    s.profile = sysconf.profile;
+    s.activation = state->MacGroup2.NetworkActivation;
+    s.version = state->MacGroup2.Version.Value;
+    s.rx1_dr_offset = state->MacGroup2.MacParams.Rx1DrOffset;
+    s.rx2_frequency = state->MacGroup2.MacParams.Rx2Channel.Frequency;
+    s.rx2_datarate = state->MacGroup2.MacParams.Rx2Channel.Datarate;
+    s.fcnt_up = state->Crypto.FCntList.FCntUp;
+    s.nfcnt_down = state->Crypto.FCntList.NFCntDown;
+    s.afcnt_down = state->Crypto.FCntList.AFCntDown;
+    s.fcnt_down = state->Crypto.FCntList.FCntDown;
+
+    r.Type = MIB_DEV_ADDR;
+    LoRaMacMibGetRequestConfirm(&r);
+    s.dev_addr = r.Param.DevAddr;
+
+    r.Type = MIB_NET_ID;
+    LoRaMacMibGetRequestConfirm(&r);
+    s.net_id = r.Param.NetID;
+
+    for (i = 0; i < REGION_CACHE_KEYS; i++) {
+        key = find_se_key(&state->SecureElement, region_session_keys[i]);
+        if (key != NULL) memcpy(s.keys[i], key, SE_KEY_SIZE);
+    }
+
+    r.Type = MIB_CHANNELS;
+    if (LoRaMacMibGetRequestConfirm(&r) == LORAMAC_STATUS_OK) {
+        n = lrw_get_max_channels();
+        if (n > REGION_CACHE_CHANNELS) n = REGION_CACHE_CHANNELS;
+        for (i = 0; i < n; i++) {
+            s.frequency[i] = r.Param.ChannelList[i].Frequency;
+            s.dr_range[i] = r.Param.ChannelList[i].DrRange.Value;
+        }
+    }
+
+    r.Type = MIB_CHANNELS_MASK;
+    if (LoRaMacMibGetRequestConfirm(&r) == LORAMAC_STATUS_OK)
+        memcpy(s.mask, r.Param.ChannelsMask, REGION_NVM_CHANNELS_MASK_SIZE * sizeof(uint16_t));
+
+    for (i = 0; i < REGION_CACHE_ENTRIES; i++)
+        valid[i] = check_block_crc(&cache[i], sizeof(cache[i]));
+
+    slot = find_region_session(cache, s.region);
+    for (i = 0; slot < 0 && i < REGION_CACHE_ENTRIES; i++)
+        if (!valid[i]) slot = i;
+
+    if (slot < 0) {
+        // The sequence numbers wrap around, compare them modulo 256
+        slot = 0;
+        for (i = 1; i < REGION_CACHE_ENTRIES; i++)
+            if ((int8_t)(cache[i].seq - cache[slot].seq) < 0) slot = i;
+    }
+
+    s.seq = 0;
+    for (i = 0; i < REGION_CACHE_ENTRIES; i++) {
+        if (i == slot || !valid[i]) continue;
+        if ((int8_t)(cache[i].seq + 1 - s.seq) > 0) s.seq = cache[i].seq + 1;
+    }
+
+    update_block_crc(&s, sizeof(s));
+    if (!part_write(&nvm_parts.regions, slot * sizeof(s), &s, sizeof(s))) {
+        log_error("LoRaMac: Error while caching the session of region %s",
+            region2str(s.region));
+        return;
+    }
+    log_debug("LoRaMac: Cached the session of region %s in slot %d",
+        region2str(s.region), slot);
+}
+
+
+// Restore the cached session of the current region, if there is one and the
+// device has no session of its own, e.g., right after lrw_set_region.
+static void restore_region_session(void)
+{
+    LoRaMacNvmData_t *state = lrw_get_state();
+    const region_session_t *cache, *s;
+    MibRequestConfirm_t r;
+    size_t size;
+    int i, n;
+
+    if (state->MacGroup2.NetworkActivation != ACTIVATION_TYPE_NONE) return;
+
+    cache = part_mmap(&size, &nvm_parts.regions);
+    if (cache == NULL || size < REGION_CACHE_ENTRIES * sizeof(*cache)) return;
+
+    i = find_region_session(cache, state->MacGroup2.Region);
+    if (i < 0) return;
+    s = &cache[i];
+
+    for (i = 0; i < REGION_CACHE_KEYS; i++)
+        SecureElementSetKey(region_session_keys[i], (uint8_t *)s->keys[i]);
+
+    r.Type = MIB_DEV_ADDR;
+    r.Param.DevAddr = s->dev_addr;
+    LoRaMacMibSetRequestConfirm(&r);
+
+    r.Type = MIB_NET_ID;
+    r.Param.NetID = s->net_id;
+    LoRaMacMibSetRequestConfirm(&r);
+
+    // Channels that cannot be added, e.g., the default channels or the
+    // channels of a fixed channel plan, are already defined by the region
+    n = lrw_get_max_channels();
+    if (n > REGION_CACHE_CHANNELS) n = REGION_CACHE_CHANNELS;
+    for (i = 0; i < n; i++) {
+        if (s->frequency[i] == 0) continue;
+        LoRaMacChannelAdd(i, (ChannelParams_t) {
+            .Frequency = s->frequency[i],
+            .DrRange.Value = s->dr_range[i]
+        });
+    }
+
+    uint16_t mask[REGION_NVM_CHANNELS_MASK_SIZE];
+    memcpy(mask, s->mask, sizeof(mask));
+    r.Type = MIB_CHANNELS_MASK;
+    r.Param.ChannelsMask = mask;
+    LoRaMacMibSetRequestConfirm(&r);
+
+    r.Type = MIB_RX2_CHANNEL;
+    r.Param.Rx2Channel.Frequency = s->rx2_frequency;
+    r.Param.Rx2Channel.Datarate = s->rx2_datarate;
+    LoRaMacMibSetRequestConfirm(&r);
+
+    state->MacGroup2.MacParams.Rx1DrOffset = s->rx1_dr_offset;
+    state->MacGroup2.Version.Value = s->version;
+    state->MacGroup2.NetworkActivation = s->activation;
+
+    state->Crypto.FCntList.FCntUp = s->fcnt_up;
+    state->Crypto.FCntList.NFCntDown = s->nfcnt_down;
+    state->Crypto.FCntList.AFCntDown = s->afcnt_down;
+    state->Crypto.FCntList.FCntDown = s->fcnt_down;
+    saved_fcnt_up = s->fcnt_up;
+
+    state_changed(
+        LORAMAC_NVM_NOTIFY_FLAG_CRYPTO         |
+        LORAMAC_NVM_NOTIFY_FLAG_SECURE_ELEMENT |
+        LORAMAC_NVM_NOTIFY_FLAG_MAC_GROUP2     |
+        LORAMAC_NVM_NOTIFY_FLAG_REGION_GROUP2);
+
+    log_debug("LoRaMac: Restored the cached session of region %s, DevAddr %08lX",
+        region2str(s->region), s->dev_addr);
+}
+
+
+void lrw_flush_state(void)
+{
+    TimerStop(&nvm_flush_timer);
+    nvm_flush_due = true;
+
+    while (uncommitted != NULL ||
+        (nvm_flags != LORAMAC_NVM_NOTIFY_FLAG_NONE && !LoRaMacIsBusy()))
+        save_state();
+
+    // Wait for the last background write to finish
+    while (eeprom_async_status() > 0);
+}
+
+
+// With AT$RTXBACKOFF enabled, +ACK and +NOACK carry the number of
+// transmissions of the message
+static void on_ack(bool ack_received, unsigned int transmissions)
+{
+    if (!cmd_event_enabled(CMD_EVENT_ACK, ack_received)) return;
+
+    if (sysconf.rtx_backoff_base) {
+        cmd_printf(ack_received ? "+ACK=%u\r\n\r\n" : "+NOACK=%u\r\n\r\n", transmissions);
+    } else if (ack_received) {
+        cmd_print("+ACK\r\n\r\n");
+    } else {
+        cmd_print("+NOACK\r\n\r\n");
+    }
+}
+
+
+// Return the group ID of the multicast channel with the given address or -1 if
+// there is no such channel
+static int find_mc_group(uint32_t address)
+{
+    LoRaMacNvmData_t *state = lrw_get_state();
+    McChannelParams_t *c;
+
+    for (int i = 0; i < LORAMAC_MAX_MC_CTX; i++) {
+        c = &state->MacGroup2.MulticastChannelList[i].ChannelParams;
+        if (c->IsEnabled && c->Address == address) return c->GroupID;
+    }
+    return -1;
+}
+
+
+static bool mc_port_allowed(int group, uint8_t port)
+{
+    const uint8_t *ports;
+    bool empty = true;
+
+    if (group < 0 || group >= LORAMAC_MAX_MC_CTX) return true;
+    ports = mc_filter[group];
+
+    for (int i = 0; i < LRW_MC_FILTER_PORTS; i++) {
+        if (ports[i] == 0) continue;
+        if (ports[i] == port) return true;
+        empty = false;
+    }
+    return empty;
+}
+
+
+static lrw_route_t find_route(uint8_t port)
+{
+    for (int i = 0; i < SYSCONF_DL_ROUTES; i++)
+        if (sysconf.dl_route[i].port == port) return sysconf.dl_route[i].action;
+    return LRW_ROUTE_FORWARD;
+}
+
+
+int lrw_dl_route_set(unsigned int port, lrw_route_t action)
+{
+    int i, unused = -1;
+
+    if (port == 0 || port > 223 || action >= LRW_ROUTE_ACTIONS) return -1;
+
+    for (i = 0; i < SYSCONF_DL_ROUTES; i++) {
+        if (sysconf.dl_route[i].port == port) break;
+        if (unused < 0 && sysconf.dl_route[i].port == 0) unused = i;
+    }
+
+    if (i == SYSCONF_DL_ROUTES) {
+        if (action == LRW_ROUTE_FORWARD) return 0;
+        if (unused < 0) return -1;
+        i = unused;
+    }
+
+    sysconf.dl_route[i].port = action == LRW_ROUTE_FORWARD ? 0 : port;
+    sysconf.dl_route[i].action = action;
+    sysconf_modified = true;
+    return 0;
+}
+
+
+// Remote configuration: the first byte of the payload is the offset of the
+// first user NVM register to write, the rest are the values
+static void apply_user_nvm(const McpsIndication_t *param)
+{
+    if (param->BufferSize < 2
+        || !nvm_write_user_data(param->Buffer[0], param->Buffer + 1, param->BufferSize - 1)) {
+        log_warning("Invalid user NVM update on port %d", param->Port);
+        return;
+    }
+    log_debug("Applied %d user NVM registers from port %d", param->BufferSize - 1, param->Port);
+}
+
+
+static void recv(McpsIndication_t *param)
+{
+    lrw_downlink_t *d;
+    int group = -1;
+    lrw_route_t route;
+
+    if (param->Multicast) {
+        group = find_mc_group(param->DevAddress);
+        if (!mc_port_allowed(group, param->Port)) {
+            log_debug("Filtered multicast downlink group %d port %d", group, param->Port);
+            return;
+        }
+    }
+
+    // Downlinks the host does not handle are kept away from it, so that it is
+    // not woken up for them
+    route = find_route(param->Port);
+    if (route == LRW_ROUTE_DROP) {
+        log_debug("Dropped downlink on port %d", param->Port);
+        return;
+    }
+    if (route == LRW_ROUTE_APPLY) {
+        apply_user_nvm(param);
+        return;
+    }
+
+    if (rx_queue.count == LRW_RX_QUEUE_SIZE || param->BufferSize > LRW_RX_QUEUE_MAX_PAYLOAD) {
+        log_warning("Dropping downlink on port %d", param->Port);
+        rx_queue.dropped = true;
+        return;
+    }
+
+    d = &rx_queue.slot[(rx_queue.head + rx_queue.count) % LRW_RX_QUEUE_SIZE];
+    d->payload = NULL;
+    if (param->BufferSize) {
+        d->payload = pool_alloc(param->BufferSize, POOL_LRW_RX);
+        if (d->payload == NULL) {
+            log_warning("Dropping downlink on port %d, out of memory", param->Port);
+            rx_queue.dropped = true;
+            return;
+        }
+    }
+
+    d->seq = cmd_mailbox_seq();
+    // The timestamp and the frequency were recorded by the radio's RxDone
+    // callback, which precedes the indication of the received frame.
+    d->timestamp = rtc_tick2ms(radio_rx_time);
+    d->frequency = radio_rx_frequency;
+    d->fcnt = param->DownLinkCounter;
+    d->rssi = param->Rssi;
+    d->snr = param->Snr;
+    d->dr = param->RxDatarate;
+    d->multicast = param->Multicast;
+    d->group = group;
+    d->port = param->Port;
+    d->length = param->BufferSize;
+    d->stored = route == LRW_ROUTE_STORE;
+    memcpy(d->payload, param->Buffer, param->BufferSize);
+    rx_queue.count++;
+}
+
+
+const lrw_downlink_t *lrw_rx_queue_peek(void)
+{
+    if (rx_queue.count == 0) return NULL;
+    return &rx_queue.slot[rx_queue.head];
+}
+
+
+// Remove the message at the given position of the receive queue. The messages
+// in front of it move back by one, so that the order is kept.
+static void remove_rx_slot(unsigned int pos)
+{
+    pool_free(rx_queue.slot[(rx_queue.head + pos) % LRW_RX_QUEUE_SIZE].payload);
+    for (; pos > 0; pos--)
+        rx_queue.slot[(rx_queue.head + pos) % LRW_RX_QUEUE_SIZE] =
+            rx_queue.slot[(rx_queue.head + pos - 1) % LRW_RX_QUEUE_SIZE];
+    rx_queue.head = (rx_queue.head + 1) % LRW_RX_QUEUE_SIZE;
+    rx_queue.count--;
+}
+
+
+void lrw_rx_queue_pop(void)
+{
+    if (rx_queue.count == 0) return;
+    remove_rx_slot(0);
+}
+
+
+unsigned int lrw_rx_queue_length(void)
+{
+    return rx_queue.count;
+}
+
+
+static void on_rx_queue_timer(void *ctx)
+{
+    (void)ctx;
+    events |= DRAIN_RX_QUEUE;
+    system_post(SYSTEM_TASK_LORA);
+}
+
+
+// Return true if the UART output buffer has room for length bytes of output.
+// In the framed mode, every byte may need to be escaped and the frame adds a
+// header and a CRC. Output longer than the buffer can only be written once the
+// buffer is empty.
+static bool have_output_space(size_t length)
+{
+    if (atci_is_framed()) length = 2 * length + 8;
+    if (length > lpuart_tx_fifo.max_length) length = lpuart_tx_fifo.max_length;
+    return cbuf_space(&lpuart_tx_fifo) >= length;
+}
+
+
+int lrw_mc_filter_set(unsigned int group, const uint8_t *ports, unsigned int count)
+{
+    if (group >= LORAMAC_MAX_MC_CTX || count > LRW_MC_FILTER_PORTS) return -1;
+
+    memset(mc_filter[group], 0, sizeof(mc_filter[group]));
+    for (unsigned int i = 0; i < count; i++) {
+        if (ports[i] == 0 || ports[i] > 223) return -1;
+        mc_filter[group][i] = ports[i];
+    }
+    return 0;
+}
+
+
+const uint8_t *lrw_mc_filter_get(unsigned int group)
+{
+    if (group >= LORAMAC_MAX_MC_CTX) return NULL;
+    return mc_filter[group];
+}
+
+
+void lrw_mc_batch_set(uint32_t interval)
+{
+    mc_batch_interval = interval;
+    events |= DRAIN_RX_QUEUE;
+    system_post(SYSTEM_TASK_LORA);
+}
+
+
+uint32_t lrw_mc_batch_get(void)
+{
+    return mc_batch_interval;
+}
+
+
+// Return true if the delivery of queued multicast downlinks should be delayed
+// to form a batch. The batch is released when the oldest frame has waited for
+// mc_batch_interval, when the queue becomes full, or when a unicast frame
+// arrives, whichever happens first.
+static bool hold_mc_batch(void)
+{
+    const lrw_downlink_t *d = NULL, *p;
+    uint32_t age;
+
+    if (mc_batch_interval == 0) return false;
+    if (rx_queue.count == LRW_RX_QUEUE_SIZE) return false;
+
+    // Stored frames are not delivered and do not count
+    for (unsigned int i = 0; i < rx_queue.count; i++) {
+        p = &rx_queue.slot[(rx_queue.head + i) % LRW_RX_QUEUE_SIZE];
+        if (p->stored) continue;
+        if (!p->multicast) return false;
+        if (d == NULL) d = p;
+    }
+    if (d == NULL) return false;
+
+    age = rtc_tick2ms(rtc_get_timer_value()) - d->timestamp;
+    if (age >= mc_batch_interval) return false;
+
+    TimerStop(&rx_queue_timer);
+    TimerSetValue(&rx_queue_timer, mc_batch_interval - age);
+    TimerStart(&rx_queue_timer);
+    return true;
+}
+
+
+static void drain_rx_queue(void)
+{
+    const lrw_downlink_t *d;
+
+    // In the polling mode, the host retrieves the messages from the mailbox
+    // (AT$MBOXGET? or AT$RECV?). The drop event goes to the mailbox as well.
+    if (!sysconf.async_uart) {
+        if (rx_queue.dropped) {
+            rx_queue.dropped = false;
+            cmd_event(CMD_EVENT_NETWORK, CMD_NET_RX_DROPPED);
+        }
+        return;
+    }
+
+    if (rx_queue.dropped && have_output_space(16)) {
+        rx_queue.dropped = false;
+        cmd_event(CMD_EVENT_NETWORK, CMD_NET_RX_DROPPED);
+    }
+
+    if (hold_mc_batch()) return;
+
+    // Downlinks routed to the mailbox stay in the queue until the host fetches
+    // them, the ones behind them are delivered
+    for (unsigned int i = 0; i < rx_queue.count;) {
+        d = &rx_queue.slot[(rx_queue.head + i) % LRW_RX_QUEUE_SIZE];
+        if (d->stored) {
+            i++;
+            continue;
+        }
+
+        // +RECV=ppp,lll, two blank lines, the payload, and CRLF. The extended
+        // header adds up to 51 characters of metadata.
+        if (!have_output_space(18 + (sysconf.recv_ext ? 51 : 0)
+                + (sysconf.data_format ? 2 : 1) * d->length)) {
+            TimerStop(&rx_queue_timer);
+            TimerSetValue(&rx_queue_timer, RX_QUEUE_RETRY_INTERVAL);
+            TimerStart(&rx_queue_timer);
+            return;
+        }
+
+        // In the framed mode, send the header and the payload in a single frame
+        atci_frame_open(0);
+        if (sysconf.recv_ext) {
+            atci_printf("+RECV=%d,%d,%d,%d,%d,%lu,%lu,%d,%lu,%d\r\n\r\n",
+                d->port, d->length, d->rssi, d->snr, d->dr, d->frequency,
+                d->fcnt, d->multicast, d->timestamp, d->group);
+        } else {
+            atci_printf("+RECV=%d,%d\r\n\r\n", d->port, d->length);
+        }
+
+        if (sysconf.data_format) {
+            atci_print_buffer_as_hex(d->payload, d->length);
+        } else {
+            atci_write((const char *)d->payload, d->length);
+        }
+        atci_write("\r\n", 2);
+        atci_frame_close();
+
+        remove_rx_slot(i);
+    }
+}
+
+
+static void complete_tx_slot(unsigned int status)
+{
+    tx_slot_t *s = &tx_queue.slot[tx_queue.head];
+
+    cmd_uplink_event(s->id, status);
+    pool_free(s->payload);
+
+    tx_queue.head = (tx_queue.head + 1) % LRW_TX_QUEUE_SIZE;
+    tx_queue.count--;
+    tx_queue.in_flight = false;
+    tx_queue.retry_at = 0;
+}
+
+
+static void on_tx_queue_timer(void *ctx)
+{
+    // Invoked in the ISR context once the duty cycle deadline of the message
+    // at the head of the queue has passed. Wake up the main loop so that
+    // lrw_process can hand the message to the MAC.
+    (void)ctx;
+    events |= DRAIN_TX_QUEUE;
+    system_post(SYSTEM_TASK_LORA);
+}
+
+
+unsigned int lrw_uplink_slot(void)
+{
+    MibRequestConfirm_t r = { .Type = MIB_DEV_ADDR };
+    unsigned int slots;
+
+    if (sysconf.slot_period == 0) return 0;
+    if (sysconf.slot_offset != SYSCONF_SLOT_AUTO)
+        return sysconf.slot_offset % sysconf.slot_period;
+
+    slots = sysconf.slot_period / sysconf.slot_width;
+    if (slots == 0) return 0;
+    LoRaMacMibGetRequestConfirm(&r);
+    return r.Param.DevAddr % slots * sysconf.slot_width;
+}
+
+
+// Return the number of milliseconds until the message at the head of the
+// uplink queue may start, 0 if it may start now. Messages are not held back
+// while the GPS time is unknown.
+static uint32_t slot_wait(const tx_slot_t *s)
+{
+    MibRequestConfirm_t r = { .Type = MIB_CHANNELS_DATARATE };
+    uint32_t period, start, end, pos, airtime = 0;
+    SysTime_t t;
+
+    if (sysconf.slot_period == 0) return 0;
+    t = SysTimeGet();
+    if (t.Seconds < MIN_VALID_TIME) return 0;
+
+    LoRaMacMibGetRequestConfirm(&r);
+    lrw_airtime(s->length, r.Param.ChannelsDatarate, &airtime);
+
+    period = sysconf.slot_period * 1000UL;
+    start = lrw_uplink_slot() * 1000UL;
+    end = start + sysconf.slot_width * 1000UL;
+    pos = (t.Seconds - UNIX_GPS_EPOCH_OFFSET) % sysconf.slot_period * 1000UL + t.SubSeconds;
+
+    // A message longer than the slot starts at the beginning of the slot
+    if (end - start < airtime + SLOT_GUARD) {
+        if (pos >= start && pos < end) return 0;
+        airtime = end - start - SLOT_GUARD;
+    }
+
+    if (pos >= start && pos + airtime + SLOT_GUARD <= end) return 0;
+    return (pos < start ? start - pos : start + period - pos)
+        + randr(0, end - start - airtime - SLOT_GUARD);
+}
+
+
+static void retry_tx_queue(TimerTime_t now)
+{
+    TimerTime_t deadline = lrw_dutycycle_deadline;
+
+    // Retry once the duty cycle deadline and the retransmission backoff pass.
+    // If the MAC refused the message without telling us how long to wait, poll
+    // again after a second.
+    if (tx_queue.retry_at > deadline) deadline = tx_queue.retry_at;
+    TimerStop(&tx_queue_timer);
+    TimerSetValue(&tx_queue_timer, deadline > now ? deadline - now : 1000);
+    TimerStart(&tx_queue_timer);
+}
+
+
+// Send the next fragment of a message too long for the current data rate on
+// the port sysconf.split_port. Each fragment is as large as the data rate and
+// pending MAC commands permit at the time it is sent.
+static int send_fragment(tx_slot_t *s, const lrw_tx_options_t *options)
+{
+    uint8_t buf[SPLIT_HEADER_SIZE + 1 + LRW_TX_QUEUE_MAX_PAYLOAD];
+    size_t header, max, n;
+
+    header = SPLIT_HEADER_SIZE + (s->fragment == 0 ? 1 : 0);
+    max = lrw_get_msize();
+
+    // If pending MAC commands leave no room, lrw_send fails with a length
+    // error and flushes them with an empty frame
+    n = max > header ? max - header : 1;
+    if (n > (size_t)(s->length - s->offset)) n = s->length - s->offset;
+
+    buf[0] = s->split_id;
+    buf[1] = s->fragment;
+    if (s->offset + n == s->length) buf[1] |= SPLIT_LAST;
+    if (s->fragment == 0) buf[2] = s->port;
+    memcpy(buf + header, s->payload + s->offset, n);
+
+    s->fragment_length = n;
+    return lrw_send(sysconf.split_port, buf, header + n, s->confirmed, options);
+}
+
+
+// Move on to the next fragment of the message at the head of the queue once
+// the previous one has been sent. Return false if there are no more fragments.
+static bool next_fragment(void)
+{
+    tx_slot_t *s = &tx_queue.slot[tx_queue.head];
+
+    if (!s->split) return false;
+    s->offset += s->fragment_length;
+    s->fragment++;
+    s->flushed = false;
+    s->attempts = 0;
+    return s->offset < s->length;
+}
+
+
+static void drain_tx_queue(void)
+{
+    TimerTime_t now;
+    tx_slot_t *s;
+    uint32_t wait;
+    int rc;
+
+    if (tx_queue.count == 0 || tx_queue.in_flight) return;
+    if (tx_store.in_flight || tx_store.checking) return;
+    if (LoRaMacIsBusy()) return;
+
+    now = rtc_now();
+    if (lrw_dutycycle_deadline > now || tx_queue.retry_at > now) {
+        retry_tx_queue(now);
+        return;
+    }
+
+    s = &tx_queue.slot[tx_queue.head];
+
+    wait = slot_wait(s);
+    if (wait) {
+        TimerStop(&slot_timer);
+        TimerSetValue(&slot_timer, wait);
+        TimerStart(&slot_timer);
+        return;
+    }
+
+    lrw_tx_options_t options = { .transmissions = s->transmissions, .urgent = s->urgent };
+
+    // The modem retransmits confirmed messages itself, see backoff_retry
+    if (s->confirmed && sysconf.rtx_backoff_base) {
+        options.transmissions = 1;
+        if (s->attempts) hop_channel = s->channel;
+    }
+
+    if (!s->split && sysconf.split_port) {
+        LoRaMacTxInfo_t txi;
+        if (LoRaMacQueryTxPossible(s->length, &txi) == LORAMAC_STATUS_LENGTH_ERROR
+            && txi.MaxPossibleApplicationDataSize > SPLIT_HEADER_SIZE + 1) {
+            s->split = true;
+            s->split_id = tx_queue.next_split_id++;
+            log_debug("Splitting queued uplink %d (%d bytes)", s->id, s->length);
+        }
+    }
+
+    if (s->split) {
+        rc = send_fragment(s, &options);
+    } else {
+        rc = lrw_send(s->port, s->payload, s->length, s->confirmed, &options);
+    }
+    hop_channel = -1;
+
+    switch (rc) {
+        case LORAMAC_STATUS_OK:
+            // The message will be completed from mcps_confirm
+            tx_queue.in_flight = true;
+            break;
+
+        case LORAMAC_STATUS_BUSY:
+        case LORAMAC_STATUS_DUTYCYCLE_RESTRICTED:
+            retry_tx_queue(now);
+            break;
+
+        case LORAMAC_STATUS_LENGTH_ERROR:
+            // lrw_send has sent an empty frame to flush pending MAC commands.
+            // Try once more after the flush. If the message still does not
+            // fit, it is too long for the current data rate.
+            if (!s->flushed) {
+                s->flushed = true;
+                break;
+            }
+            // fall through
+
+        default:
+            log_debug("Dropping queued uplink %d: %d", s->id, rc);
+            complete_tx_slot(CMD_UPLINK_FAILED);
+            break;
+    }
+}
+
+
+static void on_tx_store_timer(void *ctx)
+{
+    (void)ctx;
+    events |= DRAIN_TX_STORE;
+    system_post(SYSTEM_TASK_LORA);
+}
+
+
+static void retry_tx_store(TimerTime_t now, TimerTime_t at)
+{
+    TimerStop(&tx_store_timer);
+    TimerSetValue(&tx_store_timer, at > now ? at - now : 1);
+    TimerStart(&tx_store_timer);
+}
+
+
+static void init_tx_store(void)
+{
+    part_t part;
+
+    TimerInit(&tx_store_timer, on_tx_store_timer);
+    TimerSetSlack(&tx_store_timer, TX_STORE_TIMER_SLACK);
+    tx_store.online = true;
+
+    if (store_open(&part, "txstore", LRW_TX_STORE_SIZE) != 0) return;
+    if (part_log_open(&tx_store.log, &part, STORE_SECTOR_SIZE) != 0) {
+        log_error("Could not open uplink store");
+        return;
+    }
+    tx_store.ready = true;
+
+    if (tx_store.log.count) {
+        log_debug("Found %d message(s) in uplink store", tx_store.log.count);
+        events |= DRAIN_TX_STORE;
+    }
+}
+
+
+static void complete_tx_store(void)
+{
+    tx_store.in_flight = false;
+    tx_store.done = false;
+
+    if (tx_store.delivered) {
+        part_log_consume(&tx_store.log);
+    } else {
+        log_debug("Uplink store: No answer, network unreachable");
+        tx_store.online = false;
+    }
+}
+
+
+static void drain_tx_store(void)
+{
+    const tx_record_t *r;
+    TimerTime_t now;
+    size_t n;
+    int rc;
+
+    tx_store.kick = false;
+    if (!tx_store.ready) return;
+
+    // Wait for the result of the message in flight and of the link check
+    // requested with it or as a probe
+    if (tx_store.in_flight && tx_store.done && !tx_store.checking) complete_tx_store();
+    if (tx_store.in_flight || tx_store.checking || tx_queue.in_flight) return;
+
+    while ((r = part_log_peek(&tx_store.log, &n)) != NULL) {
+        // The time is not checked if it went backwards, e.g., after the RTC
+        // lost power
+        uint32_t time = SysTimeGet().Seconds;
+        if (sysconf.tx_store_max_age == 0 || time < r->time ||
+            time - r->time <= sysconf.tx_store_max_age)
+            break;
+
+        log_debug("Uplink store: Dropping message stored %lu s ago", time - r->time);
+        if (!part_log_consume(&tx_store.log)) return;
+    }
+    if (r == NULL) return;
+    if (LoRaMacIsBusy()) return;
+
+    now = rtc_now();
+    if (tx_store.next > now) {
+        retry_tx_store(now, tx_store.next);
+        return;
+    }
+    if (lrw_dutycycle_deadline > now) {
+        retry_tx_store(now, lrw_dutycycle_deadline);
+        return;
+    }
+
+    if (!tx_store.online) {
+        // Probe the network with a standalone link check. The answer (or a
+        // downlink) resumes the sending.
+        tx_store.next = now + TX_STORE_PROBE_INTERVAL;
+        if (lrw_check_link(false) == LORAMAC_STATUS_OK) tx_store.checking = true;
+        retry_tx_store(now, tx_store.next);
+        return;
+    }
+
+    // The answer to the link check request in an unconfirmed uplink tells
+    // whether the network has received it
+    bool check = !r->confirmed && lrw_check_link(true) == LORAMAC_STATUS_OK;
+
+    n -= offsetof(tx_record_t, payload);
+    rc = lrw_send(r->port, (void *)r->payload, n, r->confirmed, NULL);
+    switch (rc) {
+        case LORAMAC_STATUS_OK:
+            tx_store.in_flight = true;
+            tx_store.checking = check;
+            tx_store.delivered = false;
+            tx_store.flushed = false;
+            tx_store.next = now + sysconf.tx_store_interval * 1000;
+            break;
+
+        case LORAMAC_STATUS_BUSY:
+        case LORAMAC_STATUS_DUTYCYCLE_RESTRICTED:
+            retry_tx_store(now, lrw_dutycycle_deadline);
+            break;
+
+        case LORAMAC_STATUS_LENGTH_ERROR:
+            // See drain_tx_queue. A message too long for the data rate even
+            // after the flush is dropped.
+            if (!tx_store.flushed) {
+                tx_store.flushed = true;
+                break;
+            }
+            log_debug("Uplink store: Dropping message too long for data rate");
+            part_log_consume(&tx_store.log);
+            tx_store.flushed = false;
+            events |= DRAIN_TX_STORE;
+            system_post(SYSTEM_TASK_LORA);
+            break;
+
+        default:
+            // E.g., the device has not joined yet. Keep the message.
+            retry_tx_store(now, now + TX_STORE_RETRY_INTERVAL);
+            break;
+    }
+}
+
+
+int lrw_store(uint8_t port, void *buffer, uint8_t length, bool confirmed)
+{
+    tx_record_t r;
+
+    if (!tx_store.ready) return -1;
+    if (length > sizeof(r.payload)) return -2;
+
+    r.time = SysTimeGet().Seconds;
+    r.port = port;
+    r.confirmed = confirmed;
+    memcpy(r.payload, buffer, length);
+
+    if (!part_log_append(&tx_store.log, &r, offsetof(tx_record_t, payload) + length))
+        return -3;
+
+    uint32_t mask = disable_irq();
+    events |= DRAIN_TX_STORE;
+    reenable_irq(mask);
+    system_post(SYSTEM_TASK_LORA);
+    return 0;
+}
+
+
+unsigned int lrw_tx_store_length(bool *online)
+{
+    if (online != NULL) *online = tx_store.online;
+    return tx_store.ready ? tx_store.log.count : 0;
+}
+
+
+void lrw_tx_store_clear(void)
+{
+    if (!tx_store.ready) return;
+    part_log_clear(&tx_store.log);
+    tx_store.in_flight = false;
+    tx_store.done = false;
+}
+
+
+// Channel policy, see AT$CHPOLICY. A channel whose delivery rate is less than
+// half the average of the enabled channels after at least CHPOLICY_MIN_ATTEMPTS
+// confirmed uplinks is left out of the channel mask for the first transmission
+// of the next CHPOLICY_BENCH uplinks. Its statistics then start over to give
+// it another chance. At most half of the enabled channels are left out.
+#define CHPOLICY_MIN_ATTEMPTS 8
+#define CHPOLICY_BENCH 16
+
+// The attempts and acks counters are halved when a channel reaches this many
+// attempts
+#define CHSTAT_WINDOW 64
+
+static lrw_channel_stats_t chstat[REGION_NVM_CHANNELS_MASK_SIZE * 16];
+
+
+static void update_channel_stats(McpsConfirm_t *param)
+{
+    lrw_channel_stats_t *s;
+
+    if (param->McpsRequest != MCPS_CONFIRMED) return;
+    if (param->Status == LORAMAC_EVENT_INFO_STATUS_TX_TIMEOUT) return;
+    if (param->Channel >= sizeof(chstat) / sizeof(chstat[0])) return;
+
+    s = &chstat[param->Channel];
+    if (s->attempts == CHSTAT_WINDOW) {
+        s->attempts /= 2;
+        s->acks /= 2;
+    }
+    s->attempts++;
+    if (param->AckReceived) s->acks++;
+}
+
+
+// Replace the channel mask with one without the deprioritised channels and
+// without hop_channel. Return true if the mask has been replaced, in which case
+// the original mask has been copied into @p saved.
+static bool deprioritise_channels(uint16_t *saved)
+{
+    uint16_t mask[REGION_NVM_CHANNELS_MASK_SIZE];
+    MibRequestConfirm_t r = { .Type = MIB_CHANNELS_MASK };
+    uint32_t attempts = 0, acks = 0;
+    int i, n = lrw_get_max_channels(), enabled = 0, benched = 0;
+    lrw_channel_stats_t *s;
+
+    if (!sysconf.chpolicy && hop_channel < 0) return false;
+    if (LoRaMacMibGetRequestConfirm(&r) != LORAMAC_STATUS_OK) return false;
+    memcpy(mask, r.Param.ChannelsMask, sizeof(mask));
+
+    for (i = 0; i < n; i++) {
+        if (!(mask[i / 16] & (1 << (i % 16)))) continue;
+        enabled++;
+        attempts += chstat[i].attempts;
+        acks += chstat[i].acks;
+    }
+
+    for (i = 0; sysconf.chpolicy && i < n; i++) {
+        if (!(mask[i / 16] & (1 << (i % 16)))) continue;
+        s = &chstat[i];
+
+        // acks / attempts < (total acks / total attempts) / 2
+        if (s->benched == 0 && s->attempts >= CHPOLICY_MIN_ATTEMPTS
+            && 2 * s->acks * attempts < s->attempts * acks)
+            s->benched = CHPOLICY_BENCH;
+        if (s->benched == 0) continue;
+
+        if (2 * (benched + 1) <= enabled) {
+            mask[i / 16] &= ~(1 << (i % 16));
+            benched++;
+        }
+
+        if (--s->benched == 0) {
+            s->attempts = 0;
+            s->acks = 0;
+        }
+    }
+
+    // A retransmission avoids the channel of the previous attempt as long as
+    // another channel remains
+    i = hop_channel;
+    if (i >= 0 && i < n && (mask[i / 16] & (1 << (i % 16))) && benched + 1 < enabled) {
+        mask[i / 16] &= ~(1 << (i % 16));
+        benched++;
+    }
+    if (benched == 0) return false;
+
+    memcpy(saved, r.Param.ChannelsMask, sizeof(mask));
+
+    // The region rejects masks that violate its rules, e.g., too few channels
+    r.Param.ChannelsMask = mask;
+    if (LoRaMacMibSetRequestConfirm(&r) != LORAMAC_STATUS_OK) return false;
+
+    log_debug("Channel policy: %d channel(s) deprioritised", benched);
+    return true;
+}
+
+
+void lrw_channel_stats(unsigned int channel, lrw_channel_stats_t *stats)
+{
+    if (channel < sizeof(chstat) / sizeof(chstat[0])) {
+        *stats = chstat[channel];
+    } else {
+        memset(stats, 0, sizeof(*stats));
+    }
+}
+
+
+void lrw_channel_stats_reset(void)
+{
+    memset(chstat, 0, sizeof(chstat));
+}
+
+
+void lrw_channel_noise(uint32_t frequency, int16_t rssi)
+{
+    MibRequestConfirm_t r = { .Type = MIB_CHANNELS };
+    lrw_channel_stats_t *s;
+    int i, n = lrw_get_max_channels();
+
+    if (LoRaMacMibGetRequestConfirm(&r) != LORAMAC_STATUS_OK) return;
+
+    for (i = 0; i < n; i++) {
+        if (r.Param.ChannelList[i].Frequency != frequency) continue;
+        s = &chstat[i];
+        s->noise = s->noise == 0 ? rssi : (3 * s->noise + rssi) / 4;
+        return;
+    }
+}
+
+
+// Transmission power control for devices at a fixed position with ADR off.
+// The power is lowered by one step while link check answers report a
+// demodulation margin of at least TPC_STEP dB above the target, and raised by
+// one step when the margin falls below the target, a link check goes
+// unanswered, or a confirmed uplink is not acknowledged. A link check is
+// piggybacked on every TPC_CHECK_INTERVAL-th uplink. The power never exceeds
+// the default set with AT+RFPOWER. See lrw_tpc_set.
+#define TPC_CHECK_INTERVAL 8
+#define TPC_STEP 2
+
+static struct {
+    bool enabled;
+    bool check_due;
+    bool checking;      // A link check requested by the controller is pending
+    uint8_t target;     // Target margin in dB
+    uint8_t uplinks;    // Uplinks since the last link check
+    int8_t margin;      // The most recent margin, -1 if unknown
+} tpc = { .margin = -1 };
+
+
+static bool tpc_active(void)
+{
+    MibRequestConfirm_t r = { .Type = MIB_ADR };
+
+    if (!tpc.enabled) return false;
+    LoRaMacMibGetRequestConfirm(&r);
+    return !r.Param.AdrEnable;
+}
+
+
+// Move the TX power by the given number of power indices; positive values
+// lower the power. Report the decision with +EVENT=12.
+static void tpc_adjust(int step)
+{
+    LoRaMacNvmData_t *state = lrw_get_state();
+    MibRequestConfirm_t r = { .Type = MIB_CHANNELS_TX_POWER };
+    int power, max_power, min_power;
+
+    GetPhyParams_t req = { .Attribute = PHY_MIN_TX_POWER };
+    min_power = RegionGetPhyParam(state->MacGroup2.Region, &req).Value;
+
+    // Higher indices mean lower power
+    r.Type = MIB_CHANNELS_DEFAULT_TX_POWER;
+    LoRaMacMibGetRequestConfirm(&r);
+    max_power = r.Param.ChannelsDefaultTxPower;
+
+    r.Type = MIB_CHANNELS_TX_POWER;
+    LoRaMacMibGetRequestConfirm(&r);
+    power = r.Param.ChannelsTxPower + step;
+    if (power > min_power) power = min_power;
+    if (power < max_power) power = max_power;
+    if (power == r.Param.ChannelsTxPower) return;
+
+    r.Param.ChannelsTxPower = power;
+    if (LoRaMacMibSetRequestConfirm(&r) != LORAMAC_STATUS_OK) return;
+
+    log_debug("TPC: TX power index %d, margin %d dB", power, tpc.margin);
+    int arg[2] = { power, tpc.margin };
+    cmd_event_args(CMD_EVENT_TPC, step > 0 ? CMD_TPC_LOWERED : CMD_TPC_RAISED, arg, 2);
+}
+
+
+static void tpc_link_check(LoRaMacEventInfoStatus_t status, uint8_t margin)
+{
+    bool requested = tpc.checking;
+
+    tpc.checking = false;
+    if (!tpc_active()) return;
+
+    if (status == LORAMAC_EVENT_INFO_STATUS_OK) {
+        tpc.margin = margin;
+        if (margin >= tpc.target + TPC_STEP) tpc_adjust(1);
+        else if (margin < tpc.target) tpc_adjust(-1);
+    } else if (requested) {
+        tpc_adjust(-1);
+    }
+}
+
+
+static void tpc_uplink_done(McpsConfirm_t *param)
+{
+    if (!tpc_active()) return;
+
+    if (param->McpsRequest == MCPS_CONFIRMED && param->AckReceived != 1)
+        tpc_adjust(-1);
+
+    if (++tpc.uplinks >= TPC_CHECK_INTERVAL) tpc.check_due = true;
+}
+
+
+// Invoked from lrw_process. The link check request is issued outside of the
+// MAC callbacks and piggybacked on the next uplink.
+static void tpc_poll(void)
+{
+    if (!tpc.check_due || tpc.checking || tx_store.checking) return;
+    if (LoRaMacIsBusy()) return;
+
+    if (lrw_check_link(true) == LORAMAC_STATUS_OK) {
+        tpc.checking = true;
+        tpc.check_due = false;
+        tpc.uplinks = 0;
+    }
+}
+
+
+void lrw_tpc_set(bool enabled, uint8_t target)
+{
+    MibRequestConfirm_t r = { .Type = MIB_CHANNELS_DEFAULT_TX_POWER };
+
+    tpc.enabled = enabled;
+    tpc.target = target;
+    tpc.uplinks = 0;
+    tpc.check_due = enabled;
+    tpc.margin = -1;
+
+    // Return to the configured power when disabled
+    if (!enabled && LoRaMacMibGetRequestConfirm(&r) == LORAMAC_STATUS_OK) {
+        r.Type = MIB_CHANNELS_TX_POWER;
+        r.Param.ChannelsTxPower = r.Param.ChannelsDefaultTxPower;
+        LoRaMacMibSetRequestConfirm(&r);
+    }
+}
+
+
+bool lrw_tpc_get(uint8_t *target, int8_t *margin)
+{
+    if (target) *target = tpc.target;
+    if (margin) *margin = tpc.margin;
+    return tpc.enabled;
+}
+
+
+// Client-side data rate control for networks with ADR off, see lrw_cadr_set.
+// Like the power controller, it piggybacks a link check on every
+// CADR_CHECK_INTERVAL-th uplink. The data rate is raised by one step after
+// CADR_HYSTERESIS consecutive answers report a demodulation margin of at least
+// CADR_STEP dB above the target, and lowered by one step when an answer
+// reports a margin below the target, a link check goes unanswered, or
+// CADR_NOACK_LIMIT consecutive confirmed uplinks are not acknowledged. Each
+// data rate step costs about 2.5 dB of margin.
+//
+// The SNR of downlinks only vetoes raising the data rate. Gateways transmit
+// with more power than the device, so the downlink margin overestimates the
+// uplink margin, but a poor downlink margin is a reliable warning.
+#define CADR_CHECK_INTERVAL 8
+#define CADR_STEP           3
+#define CADR_HYSTERESIS     2
+#define CADR_NOACK_LIMIT    2
+
+static struct {
+    bool enabled;
+    bool check_due;
+    bool checking;      // A link check requested by the controller is pending
+    uint8_t target;     // Target margin in dB
+    uint8_t min_dr;     // Configured data rate bounds
+    uint8_t max_dr;
+    uint8_t uplinks;    // Uplinks since the last link check
+    uint8_t good;       // Consecutive answers with headroom
+    uint8_t noacks;     // Consecutive unacknowledged confirmed uplinks
+    int8_t margin;      // The most recent margin, -1 if unknown
+    int8_t dl_margin;   // The margin of the most recent downlink, INT8_MIN if unknown
+} cadr = { .margin = -1, .dl_margin = INT8_MIN };
+
+
+static bool cadr_active(void)
+{
+    MibRequestConfirm_t r = { .Type = MIB_ADR };
+
+    if (!cadr.enabled) return false;
+    LoRaMacMibGetRequestConfirm(&r);
+    return !r.Param.AdrEnable;
+}
+
+
+// Return the spreading factor of an uplink or downlink data rate of the
+// current region, 0 for FSK. See lrw_airtime for the uplink data rates.
+static unsigned int dr_spreading_factor(unsigned int dr)
+{
+    switch (lrw_get_state()->MacGroup2.Region) {
+        case LORAMAC_REGION_US915:
+            if (dr >= 8) return 20 - dr;
+            return dr == 4 ? 8 : 10 - dr;
+
+        case LORAMAC_REGION_AU915:
+            if (dr >= 8) return 20 - dr;
+            return dr == 6 ? 8 : 12 - dr;
+
+        default:
+            if (dr == 7) return 0;
+            return dr == 6 ? 7 : 12 - dr;
+    }
+}
+
+
+// The data rates the controller may use: the configured bounds within the
+// region's uplink data rates, without FSK
+static void cadr_bounds(int *min, int *max)
+{
+    LoRaMacNvmData_t *state = lrw_get_state();
+    GetPhyParams_t req = {
+        .Attribute = PHY_MIN_TX_DR,
+        .UplinkDwellTime = state->MacGroup2.MacParams.UplinkDwellTime
+    };
+    int lo, hi;
+
+    lo = RegionGetPhyParam(state->MacGroup2.Region, &req).Value;
+    req.Attribute = PHY_MAX_TX_DR;
+    hi = RegionGetPhyParam(state->MacGroup2.Region, &req).Value;
+
+    *min = cadr.min_dr > lo ? cadr.min_dr : lo;
+    *max = cadr.max_dr < hi ? cadr.max_dr : hi;
+    while (*max > *min && dr_spreading_factor(*max) == 0) (*max)--;
+}
+
+
+// Move the data rate by the given number of steps; positive values raise it.
+// Report the decision with +EVENT=2,7 or +EVENT=2,8.
+static void cadr_step(int step)
+{
+    MibRequestConfirm_t r = { .Type = MIB_CHANNELS_DATARATE };
+    int dr, min, max;
+
+    cadr.good = 0;
+    cadr.noacks = 0;
+
+    cadr_bounds(&min, &max);
+    LoRaMacMibGetRequestConfirm(&r);
+    dr = r.Param.ChannelsDatarate + step;
+    if (dr > max) dr = max;
+    if (dr < min) dr = min;
+    if (dr == r.Param.ChannelsDatarate) return;
+
+    r.Param.ChannelsDatarate = dr;
+    if (LoRaMacMibSetRequestConfirm(&r) != LORAMAC_STATUS_OK) return;
+
+    // Check the margin at the new data rate with the next uplink
+    cadr.check_due = true;
+
+    log_debug("Client ADR: DR%d, margin %d dB", dr, cadr.margin);
+    int arg[2] = { dr, cadr.margin };
+    cmd_event_args(CMD_EVENT_NETWORK, step > 0 ? CMD_NET_ADR_DR_UP : CMD_NET_ADR_DR_DOWN, arg, 2);
+}
+
+
+static void cadr_link_check(LoRaMacEventInfoStatus_t status, uint8_t margin)
+{
+    bool requested = cadr.checking;
+
+    cadr.checking = false;
+    if (!cadr_active()) return;
+
+    if (status == LORAMAC_EVENT_INFO_STATUS_OK) {
+        cadr.margin = margin;
+        if (margin < cadr.target) {
+            cadr_step(-1);
+        } else if (margin >= cadr.target + CADR_STEP
+            && (cadr.dl_margin == INT8_MIN || cadr.dl_margin >= cadr.target)) {
+            if (++cadr.good >= CADR_HYSTERESIS) cadr_step(1);
+        } else {
+            cadr.good = 0;
+        }
+    } else if (requested) {
+        cadr_step(-1);
+    }
+}
+
+
+static void cadr_uplink_done(McpsConfirm_t *param)
+{
+    if (!cadr_active()) return;
+
+    if (param->McpsRequest == MCPS_CONFIRMED) {
+        if (param->AckReceived == 1) cadr.noacks = 0;
+        else if (++cadr.noacks >= CADR_NOACK_LIMIT) cadr_step(-1);
+    }
+
+    if (++cadr.uplinks >= CADR_CHECK_INTERVAL) cadr.check_due = true;
+}
+
+
+// Record the demodulation margin of a downlink: its SNR above the floor of
+// its spreading factor, -7.5 dB at SF7 and 2.5 dB lower for each further SF
+static void cadr_downlink(McpsIndication_t *param)
+{
+    unsigned int sf = dr_spreading_factor(param->RxDatarate);
+
+    if (!cadr.enabled || sf == 0) return;
+    cadr.dl_margin = (2 * param->Snr + 5 * sf - 20) / 2;
+}
+
+
+// Invoked from lrw_process, see tpc_poll
+static void cadr_poll(void)
+{
+    if (!cadr.check_due || cadr.checking || tpc.checking || tx_store.checking) return;
+    if (LoRaMacIsBusy()) return;
+
+    if (lrw_check_link(true) == LORAMAC_STATUS_OK) {
+        cadr.checking = true;
+        cadr.check_due = false;
+        cadr.uplinks = 0;
+    }
+}
+
+
+void lrw_cadr_set(bool enabled, uint8_t target, uint8_t min_dr, uint8_t max_dr)
+{
+    cadr.enabled = enabled;
+    cadr.target = target;
+    cadr.min_dr = min_dr;
+    cadr.max_dr = max_dr;
+    cadr.uplinks = 0;
+    cadr.good = 0;
+    cadr.noacks = 0;
+    cadr.check_due = enabled;
+    cadr.margin = -1;
+    cadr.dl_margin = INT8_MIN;
+}
+
+
+bool lrw_cadr_get(uint8_t *target, uint8_t *min_dr, uint8_t *max_dr, int8_t *margin)
+{
+    if (target) *target = cadr.target;
+    if (min_dr) *min_dr = cadr.min_dr;
+    if (max_dr) *max_dr = cadr.max_dr;
+    if (margin) *margin = cadr.margin;
+    return cadr.enabled;
+}
+
+
+// Link supervisor, see lrw_linkwd_set. After the configured number of
+// consecutive failures, i.e., unacknowledged confirmed uplinks or unanswered
+// link checks, the supervisor steps the data rate down by one. At the lowest
+// data rate, it sends a link check instead, and if that goes unanswered too,
+// it rejoins (OTAA only). Failed rejoins are retried with exponential backoff.
+#define LINKWD_BACKOFF_MIN  60000
+#define LINKWD_BACKOFF_MAX  (24 * 3600 * 1000UL)
+#define LINKWD_JOIN_TRIES   9
+#define LINKWD_TIMER_SLACK  1000
+
+static struct {
+    uint8_t limit;       // Consecutive failures that trigger a step, 0 if disabled
+    uint8_t failures;
+    bool check_due;
+    bool checking;       // A link check sent by the supervisor is pending
+    volatile bool join_due;
+    bool joining;        // A Join started by the supervisor is in progress
+    uint32_t backoff;    // Delay before the next rejoin attempt in ms
+} linkwd;
+
+static TimerEvent_t linkwd_timer;
+
+
+static void on_linkwd_timer(void *ctx)
+{
+    (void)ctx;
+    linkwd.join_due = true;
+    system_post(SYSTEM_TASK_LORA);
+}
+
+
+static void linkwd_escalate(void)
+{
+    LoRaMacNvmData_t *state = lrw_get_state();
+    MibRequestConfirm_t r = { .Type = MIB_CHANNELS_DATARATE };
+    GetPhyParams_t req = {
+        .Attribute = PHY_MIN_TX_DR,
+        .UplinkDwellTime = state->MacGroup2.MacParams.UplinkDwellTime
+    };
+    int dr;
+
+    linkwd.failures = 0;
+
+    LoRaMacMibGetRequestConfirm(&r);
+    if (r.Param.ChannelsDatarate > (int8_t)RegionGetPhyParam(state->MacGroup2.Region, &req).Value) {
+        r.Param.ChannelsDatarate--;
+        if (LoRaMacMibSetRequestConfirm(&r) == LORAMAC_STATUS_OK) {
+            dr = r.Param.ChannelsDatarate;
+            log_debug("Link supervisor: Stepping down to DR%d", dr);
+            cmd_event_args(CMD_EVENT_NETWORK, CMD_NET_LINK_DR_DOWN, &dr, 1);
+            return;
+        }
+    }
+
+    // Already at the lowest data rate, find out if the network still hears us
+    linkwd.check_due = true;
+}
+
+
+static void linkwd_result(bool ok)
+{
+    if (linkwd.limit == 0) return;
+
+    if (ok) {
+        linkwd.failures = 0;
+        return;
+    }
+
+    if (++linkwd.failures >= linkwd.limit) linkwd_escalate();
+}
+
+
+static void linkwd_link_check(bool answered)
+{
+    bool requested = linkwd.checking;
+
+    linkwd.checking = false;
+    if (linkwd.limit == 0) return;
+
+    // An unanswered link check sent at the lowest data rate ends in a rejoin
+    if (requested && !answered && lrw_get_mode() == 1) {
+        linkwd.backoff = 0;
+        linkwd.join_due = true;
+        return;
+    }
+
+    linkwd_result(answered);
+}
+
+
+static void linkwd_join_done(bool ok)
+{
+    if (!linkwd.joining) return;
+    linkwd.joining = false;
+
+    if (ok) {
+        linkwd.failures = 0;
+        linkwd.backoff = 0;
+        return;
+    }
+
+    linkwd.backoff = linkwd.backoff == 0 ? LINKWD_BACKOFF_MIN : 2 * linkwd.backoff;
+    if (linkwd.backoff > LINKWD_BACKOFF_MAX) linkwd.backoff = LINKWD_BACKOFF_MAX;
+
+    log_debug("Link supervisor: Rejoin in %lu ms", linkwd.backoff);
+    TimerSetValue(&linkwd_timer, linkwd.backoff);
+    TimerStart(&linkwd_timer);
+}
+
+
+// Invoked from lrw_process to start the link checks and Joins of the
+// supervisor outside of the MAC callbacks
+static void linkwd_poll(void)
+{
+    if (linkwd.limit == 0) return;
+    if (!linkwd.check_due && !linkwd.join_due) return;
+    if (LoRaMacIsBusy()) return;
+
+    if (linkwd.join_due) {
+        linkwd.join_due = false;
+        linkwd.check_due = false;
+
+        if (lrw_join(DR_0, LINKWD_JOIN_TRIES) == LORAMAC_STATUS_OK) {
+            log_debug("Link supervisor: Rejoining");
+            linkwd.joining = true;
+            cmd_event(CMD_EVENT_NETWORK, CMD_NET_LINK_REJOIN);
+        } else {
+            linkwd.joining = true;
+            linkwd_join_done(false);
+        }
+        return;
+    }
+
+    if (lrw_check_link(false) == LORAMAC_STATUS_OK) {
+        log_debug("Link supervisor: Checking link");
+        linkwd.check_due = false;
+        linkwd.checking = true;
+        cmd_event(CMD_EVENT_NETWORK, CMD_NET_LINK_CHECK);
+    }
+}
+
+
+void lrw_linkwd_set(uint8_t limit)
+{
+    linkwd.limit = limit;
+    linkwd.failures = 0;
+    linkwd.check_due = false;
+    linkwd.join_due = false;
+    linkwd.backoff = 0;
+    TimerStop(&linkwd_timer);
+}
+
+
+uint8_t lrw_linkwd_get(uint8_t *failures, uint32_t *backoff)
+{
+    if (failures) *failures = linkwd.failures;
+    if (backoff) *backoff = linkwd.backoff;
+    return linkwd.limit;
+}
+
+
+// The airtime accountant keeps the time on air of the uplinks sent in the last
+// 24 hours in AIRTIME_BUCKETS hourly buckets. Once the total reaches the
+// budget in sysconf.airtime_cap, further uplinks are refused until the oldest
+// buckets expire.
+#define AIRTIME_BUCKETS       24
+#define AIRTIME_BUCKET_LENGTH (3600 * 1000UL)
+
+// MHDR, FHDR without FOpts, FPort, and MIC
+#define AIRTIME_FRAME_OVERHEAD 13
+
+// The preamble of LoRaWAN FSK frames in bytes
+#define AIRTIME_FSK_PREAMBLE 5
+
+static struct {
+    uint32_t bucket[AIRTIME_BUCKETS];  // Time on air in ms
+    uint8_t current;                   // The bucket of the current hour
+    TimerTime_t start;                 // Start of the current bucket
+} airtime;
+
+
+static void advance_airtime(TimerTime_t now)
+{
+    uint32_t hours = (now - airtime.start) / AIRTIME_BUCKET_LENGTH;
+    if (hours == 0) return;
+
+    airtime.start += hours * AIRTIME_BUCKET_LENGTH;
+    if (hours > AIRTIME_BUCKETS) hours = AIRTIME_BUCKETS;
+    while (hours--) {
+        airtime.current = (airtime.current + 1) % AIRTIME_BUCKETS;
+        airtime.bucket[airtime.current] = 0;
+    }
+}
+
+
+static void add_airtime(uint32_t ms)
+{
+    advance_airtime(TimerGetCurrentTime());
+    airtime.bucket[airtime.current] += ms;
+}
+
+
+uint32_t lrw_airtime_used(void)
+{
+    uint32_t sum = 0;
+
+    advance_airtime(TimerGetCurrentTime());
+    for (int i = 0; i < AIRTIME_BUCKETS; i++) sum += airtime.bucket[i];
+    return sum;
+}
+
+
+// Refuse the uplink if the airtime budget has been used up, and set the duty
+// cycle deadline to the time the oldest buckets free enough of it
+static LoRaMacStatus_t check_airtime_budget(void)
+{
+    TimerTime_t now = TimerGetCurrentTime();
+    uint32_t cap, used, wait;
+    int i, n;
+
+    if (sysconf.airtime_cap == 0) return LORAMAC_STATUS_OK;
+
+    cap = sysconf.airtime_cap * 1000UL;
+    used = lrw_airtime_used();
+    if (used < cap) return LORAMAC_STATUS_OK;
+
+    for (n = 1; n < AIRTIME_BUCKETS; n++) {
+        i = (airtime.current + n) % AIRTIME_BUCKETS;
+        used -= airtime.bucket[i];
+        if (used < cap) break;
+    }
+
+    wait = airtime.start + n * AIRTIME_BUCKET_LENGTH - now;
+    lrw_dutycycle_deadline = rtc_tick2ms(rtc_get_timer_value()) + wait;
+    log_debug("Airtime budget used up, next uplink in %lu ms", wait);
+    return LORAMAC_STATUS_DUTYCYCLE_RESTRICTED;
+}
+
+
+void lrw_airtime_reset(void)
+{
+    memset(airtime.bucket, 0, sizeof(airtime.bucket));
+}
+
+
+int lrw_airtime(unsigned int length, unsigned int dr, uint32_t *ms)
+{
+    LoRaMacNvmData_t *state = lrw_get_state();
+    uint32_t sf, bandwidth = 0;
+    GetPhyParams_t req = {
+        .Attribute = PHY_MAX_TX_DR,
+        .UplinkDwellTime = state->MacGroup2.MacParams.UplinkDwellTime
+    };
+    PhyParam_t phy = RegionGetPhyParam(state->MacGroup2.Region, &req);
+
+    if (dr > phy.Value) return LORAMAC_STATUS_DATARATE_INVALID;
+    length += AIRTIME_FRAME_OVERHEAD;
+    if (length > 255) return LORAMAC_STATUS_LENGTH_ERROR;
+
+    // The uplink data rates of the regional parameters (RP002-1.0.3)
+    switch (state->MacGroup2.Region) {
+        case LORAMAC_REGION_US915:
+            if (dr == 4) {
+                sf = 8;
+                bandwidth = 2;
+            } else {
+                sf = 10 - dr;
+            }
+            break;
+
+        case LORAMAC_REGION_AU915:
+            if (dr == 6) {
+                sf = 8;
+                bandwidth = 2;
+            } else {
+                sf = 12 - dr;
+            }
+            break;
+
+        default:
+            if (dr == 7) {
+                *ms = Radio.TimeOnAir(MODEM_FSK, 0, 50000, 0, AIRTIME_FSK_PREAMBLE,
+                    false, length, true);
+                return LORAMAC_STATUS_OK;
+            }
+            if (dr == 6) {
+                sf = 7;
+                bandwidth = 1;
+            } else {
+                sf = 12 - dr;
+            }
+            break;
+    }
+
+    *ms = Radio.TimeOnAir(MODEM_LORA, bandwidth, sf, 1, 8, false, length, true);
+    return LORAMAC_STATUS_OK;
+}
+
+
+static lrw_stats_t stats;
+
+
+// A message the modem retransmits with backoff counts as a single uplink, see
+// backoff_retry. Each attempt but the last is counted as a retransmission.
+static void update_stats(McpsConfirm_t *param, bool retry)
+{
+    if (param->Status == LORAMAC_EVENT_INFO_STATUS_TX_TIMEOUT) return;
+
+    if (param->NbTrans > 1) stats.retransmissions += param->NbTrans - 1;
+
+    if (retry) {
+        stats.retransmissions++;
+    } else {
+        stats.uplinks++;
+        if (param->McpsRequest == MCPS_CONFIRMED) {
+            if (param->AckReceived) stats.acks++;
+            else stats.noacks++;
+        }
+    }
+
+    if (param->Datarate < LRW_STATS_DATARATES)
+        stats.airtime[param->Datarate] += param->TxTimeOnAir * param->NbTrans;
+    if (param->Channel < LRW_STATS_CHANNELS)
+        stats.transmissions[param->Channel] += param->NbTrans;
+}
+
+
+const lrw_stats_t *lrw_stats(void)
+{
+    return &stats;
+}
+
+
+void lrw_stats_reset(void)
+{
+    memset(&stats, 0, sizeof(stats));
+}
+
+
+static void update_band_view(McpsConfirm_t *param)
+{
+#ifdef REGION_EU868
+    LoRaMacNvmData_t *state = lrw_get_state();
+
+    if (state->MacGroup2.Region != LORAMAC_REGION_EU868) return;
+    if (!state->MacGroup2.DutyCycleOn || param->TxTimeOnAir == 0) return;
+    if (param->Channel >= EU868_MAX_NB_CHANNELS) return;
+
+    MibRequestConfirm_t r = { .Type = MIB_CHANNELS };
+    if (LoRaMacMibGetRequestConfirm(&r) != LORAMAC_STATUS_OK) return;
+
+    uint8_t band = r.Param.ChannelList[param->Channel].Band;
+    if (band >= EU868_MAX_NB_BANDS) return;
+
+    // Only the channel of the last transmission is known. Attribute all
+    // transmissions of the message to its band.
+    band_deadline[band] = rtc_tick2ms(rtc_get_timer_value()) +
+        param->TxTimeOnAir * param->NbTrans * (eu868_bands[band].DCycle - 1);
+#else
+    (void)param;
+#endif
+}
+
+
+// LoRaMac invokes mcps_confirm once the RX windows of an uplink have closed,
+// but within a single LoRaMacProcess pass it does so before mcps_indication
+// reports a downlink received in those windows. The TX-done event is thus only
+// recorded here and sent from lrw_process after LoRaMacProcess has returned,
+// when it is known whether a downlink arrived. See report_tx_done.
+static struct {
+    bool pending;
+    bool downlink;
+    int arg[5];  // Time on air, channel, data rate, TX power, and MSIZE
+} tx_done;
+
+
+static void report_tx_done(void)
+{
+    if (!tx_done.pending) return;
+    tx_done.pending = false;
+
+    // The payload limit of the next uplink, after LoRaMac has processed any
+    // downlink and queued the MAC command answers
+    tx_done.arg[4] = lrw_get_msize();
+    cmd_event_args(CMD_EVENT_TX, CMD_TX_DONE, tx_done.arg, 5);
+    if (!tx_done.downlink) cmd_event(CMD_EVENT_TX, CMD_TX_RX_CLOSED);
+}
+
+
+// LoRaMac retransmits a confirmed uplink that has not been acknowledged within
+// a few seconds, which with a congested gateway burns duty cycle budget and
+// tends to collide again. With AT$RTXBACKOFF enabled, confirmed messages from
+// the TX queue are sent with a single transmission and retransmitted from
+// here instead. Each retransmission waits twice as long as the previous one,
+// up to sysconf.rtx_backoff_max, plus a random jitter, and avoids the channel
+// of the previous attempt. Each attempt is a new frame with its own frame
+// counter. Return true if the message will be retransmitted.
+static bool backoff_retry(McpsConfirm_t *param)
+{
+    tx_slot_t *s = &tx_queue.slot[tx_queue.head];
+    unsigned int limit, i;
+    uint32_t delay, max;
+
+    if (!tx_queue.in_flight || !s->confirmed || !sysconf.rtx_backoff_base) return false;
+    if (param->McpsRequest != MCPS_CONFIRMED) return false;
+
+    s->attempts++;
+    if (param->AckReceived == 1) return false;
+
+    limit = s->transmissions ? s->transmissions : sysconf.confirmed_retransmissions;
+    if (s->attempts >= limit) return false;
+
+    delay = sysconf.rtx_backoff_base * 1000;
+    max = sysconf.rtx_backoff_max * 1000;
+    for (i = 1; i < s->attempts && delay < max; i++) delay *= 2;
+    if (delay > max) delay = max;
+    delay += randr(0, delay / 100 * sysconf.rtx_backoff_jitter);
+
+    s->channel = param->Channel;
+    tx_queue.retry_at = rtc_now() + delay;
+    tx_queue.in_flight = false;
+
+    log_debug("Retransmitting queued uplink %d in %lu ms", s->id, delay);
+    cmd_event(CMD_EVENT_NETWORK, CMD_NET_RETRANSMISSION);
+    return true;
+}
+
+
+static void mcps_confirm(McpsConfirm_t *param)
+{
+    log_debug("mcps_confirm: McpsRequest: %d, Channel: %ld AckReceived: %d", param->McpsRequest, param->Channel, param->AckReceived);
+    bool retry = backoff_retry(param);
+    unsigned int transmissions = param->NbTrans;
+
+    if (tx_queue.in_flight && tx_queue.slot[tx_queue.head].attempts)
+        transmissions = tx_queue.slot[tx_queue.head].attempts;
+
+    tx_params = *param;
+    update_stats(param, retry);
+    update_band_view(param);
+    update_channel_stats(param);
+
+    // Nothing went on the air if the radio failed to transmit
+    if (param->Status != LORAMAC_EVENT_INFO_STATUS_TX_TIMEOUT) {
+        add_airtime(param->TxTimeOnAir * param->NbTrans);
+        tx_done.pending = true;
+        tx_done.downlink = false;
+        tx_done.arg[0] = param->TxTimeOnAir;
+        tx_done.arg[1] = param->Channel;
+        tx_done.arg[2] = param->Datarate;
+        tx_done.arg[3] = param->TxPower;
+    }
+
+    if (param->McpsRequest == MCPS_CONFIRMED && !retry)
+        on_ack(param->AckReceived == 1, transmissions);
+
+    tpc_uplink_done(param);
+    cadr_uplink_done(param);
+    if (param->McpsRequest == MCPS_CONFIRMED && !retry)
+        linkwd_result(param->AckReceived == 1);
+
+    if (!retry)
+        delta_uplink_done(param->McpsRequest == MCPS_CONFIRMED
+            ? param->AckReceived == 1
+            : param->Status == LORAMAC_EVENT_INFO_STATUS_OK);
+
+    if (!retry && param->Status != LORAMAC_EVENT_INFO_STATUS_TX_TIMEOUT
+        && (sysconf.class_c_policy & LRW_CLASS_C_UPLINK))
+        class_c.start = true;
+
+    if (tx_queue.in_flight) {
+        bool sent = param->McpsRequest == MCPS_CONFIRMED
+            ? param->AckReceived == 1
+            : param->Status == LORAMAC_EVENT_INFO_STATUS_OK;
+
+        // A split message is complete once its last fragment has been sent.
+        // If any fragment fails, the whole message fails.
+        if (sent && next_fragment()) {
+            tx_queue.in_flight = false;
+            events |= DRAIN_TX_QUEUE;
+        } else {
+            complete_tx_slot(sent ? CMD_UPLINK_SENT : CMD_UPLINK_FAILED);
+        }
+    }
+
+    // The message is completed from drain_tx_store once the link check
+    // requested with it, if any, has been confirmed too
+    if (tx_store.in_flight) {
+        if (param->McpsRequest == MCPS_CONFIRMED && param->AckReceived == 1)
+            tx_store.delivered = true;
+        tx_store.done = true;
+    }
+    tx_store.kick = true;
+}
+
+
+static void mcps_retransmit(void)
+{
+    cmd_event(CMD_EVENT_NETWORK, CMD_NET_RETRANSMISSION);
+}
+
+
+// Record the offset of a class A downlink from the time its RX window was
+// scheduled for
+static void sample_rx_timing(const McpsIndication_t *param)
+{
+    MibRequestConfirm_t r;
+    rx_timing_t *t;
+    int32_t offset, diff;
+    uint32_t delay;
+
+    if (param->RxSlot != RX_SLOT_WIN_1 && param->RxSlot != RX_SLOT_WIN_2) return;
+    if (lrw_get_class() != CLASS_A || radio_rx_airtime == 0) return;
+    if (param->RxDatarate >= RX_ADAPT_DRS) return;
+
+    r.Type = param->RxSlot == RX_SLOT_WIN_1 ? MIB_RECEIVE_DELAY_1 : MIB_RECEIVE_DELAY_2;
+    LoRaMacMibGetRequestConfirm(&r);
+    delay = param->RxSlot == RX_SLOT_WIN_1 ? r.Param.ReceiveDelay1 : r.Param.ReceiveDelay2;
+
+    offset = (int32_t)rtc_tick2ms(radio_rx_time - radio_tx_time) - radio_rx_airtime - delay;
+    if (offset > RX_ADAPT_MAX_OFFSET || offset < -RX_ADAPT_MAX_OFFSET) return;
+    offset *= 16;
+
+    t = &rx_timing[param->RxDatarate];
+    if (t->samples == 0) {
+        t->mean = offset;
+        t->dev = 0;
+    } else {
+        diff = offset - t->mean;
+        t->mean += diff >> RX_ADAPT_MEAN_SHIFT;
+        if (diff < 0) diff = -diff;
+        t->dev = t->dev - (t->dev >> RX_ADAPT_DEV_SHIFT) + ((uint32_t)diff >> RX_ADAPT_DEV_SHIFT);
+    }
+    if (t->samples < UINT16_MAX) t->samples++;
+    log_debug("LoRaMac: RX offset %ld ms at DR%d", offset / 16, param->RxDatarate);
+}
+
+
+// Return the adaptive RX error (ms) of a data rate, -1 if it has not been
+// measured often enough
+static int32_t adaptive_rx_error(unsigned int dr)
+{
+    int32_t mean;
+
+    if (dr >= RX_ADAPT_DRS || rx_timing[dr].samples < RX_ADAPT_MIN_SAMPLES) return -1;
+    mean = rx_timing[dr].mean < 0 ? -rx_timing[dr].mean : rx_timing[dr].mean;
+    return (mean + 4 * (int32_t)rx_timing[dr].dev + 15) / 16 + RX_ADAPT_MARGIN;
+}
+
+
+void lrw_rx_timing(unsigned int dr, lrw_rx_timing_t *dst)
+{
+    int32_t error;
+
+    memset(dst, 0, sizeof(*dst));
+    if (dr >= RX_ADAPT_DRS) return;
+
+    dst->samples = rx_timing[dr].samples;
+    dst->mean = rx_timing[dr].mean / 16;
+    dst->dev = rx_timing[dr].dev / 16;
+    error = adaptive_rx_error(dr);
+    dst->error = error < 0 ? 0 : error;
+}
+
+
+void lrw_rx_timing_reset(void)
+{
+    memset(rx_timing, 0, sizeof(rx_timing));
+}
+
+
+uint32_t lrw_max_rx_error(void)
+{
+    return max_rx_error;
+}
+
+
+static void mcps_indication(McpsIndication_t *param)
+{
+    trace(TRACE_MCPS_INDICATION);
+    log_debug("mcps_indication: status: %d rssi: %d", param->Status, param->Rssi);
+
     if (param->Status != LORAMAC_EVENT_INFO_STATUS_OK) {
         return;
     }
 
-    if (param->RxData) {
-        recv(param->Port, param->Buffer, param->BufferSize);
+    tx_done.downlink = true;
+    stats.downlinks++;
+    sample_rx_timing(param);
+    if (!param->RxData || param->Port == 0) stats.mac_only++;
+
+    if (param->IsUplinkTxPending == true && sysconf.auto_pull) {
+        auto_pull.pending = true;
+    } else {
+        auto_pull.pending = false;
+        auto_pull.count = 0;
+    }
+
+    // A downlink within a class C window extends it, and so does the FPending
+    // bit, which outside of a window opens one instead of pulling the
+    // downlink with an uplink
+    if (class_c.open || (param->IsUplinkTxPending == true
+        && (sysconf.class_c_policy & LRW_CLASS_C_PENDING)))
+        class_c.start = true;
+
+    cadr_downlink(param);
+
+    // Any downlink shows that the network is reachable
+    linkwd_result(true);
+    if (tx_store.in_flight) tx_store.delivered = true;
+    if (!tx_store.online) {
+        tx_store.online = true;
+        tx_store.next = 0;
+        tx_store.kick = true;
+    }
+
+    if (param->RxData) {
+#if FUOTA == 1
+        // Fragmented data block transport is handled on the modem. The host
+        // only reads the reassembled data block.
+        if (param->Port == FRAG_PORT) {
+            frag_process(param->Buffer, param->BufferSize,
+                param->Multicast ? find_mc_group(param->DevAddress) : -1);
+            return;
+        }
+#endif
+#if CLOCK_SYNC == 1
+        if (param->Port == CLOCKSYNC_PORT) {
+            clocksync_process(param->Buffer, param->BufferSize);
+            return;
+        }
+#endif
+#if REMOTE_ATCI == 1
+        if (sysconf.remote_port && param->Port == sysconf.remote_port) {
+            remote_process(param->Buffer, param->BufferSize, param->Multicast);
+            return;
+        }
+#endif
+        recv(param);
+    }
+}
+
+
+// Class B is entered in several steps, each completed by an MLME confirm:
+// obtain the network time with DeviceTimeReq, acquire the beacon, and announce
+// the ping slot periodicity with PingSlotInfoReq. Only then can LoRaMac switch
+// to class B. If the RTC time is already known, e.g., from AT$TIME or from
+// the clock synchronization package, the first step is skipped and the beacon
+// is searched for only around its expected time. A failed step is retried
+// after CLASS_B_RETRY_INTERVAL. See class_b_step.
+#define CLASS_B_RETRY_INTERVAL 30000
+
+static struct {
+    lrw_class_b_state_t state;
+    bool waiting;          // An MLME request of the current step is pending
+    bool locked;           // Beacon received in the most recent beacon period
+    BeaconInfo_t beacon;   // The most recently received beacon
+} class_b;
+
+static TimerEvent_t class_b_timer;
+
+
+static void on_class_b_timer(void *ctx)
+{
+    (void)ctx;
+    events |= CLASS_B_STEP;
+    system_post(SYSTEM_TASK_LORA);
+}
+
+
+static void class_b_next(lrw_class_b_state_t state)
+{
+    class_b.state = state;
+    class_b.waiting = false;
+
+    uint32_t mask = disable_irq();
+    events |= CLASS_B_STEP;
+    reenable_irq(mask);
+    system_post(SYSTEM_TASK_LORA);
+}
+
+
+static void class_b_retry(lrw_class_b_state_t state)
+{
+    class_b.state = state;
+    class_b.waiting = false;
+    TimerStop(&class_b_timer);
+    TimerSetValue(&class_b_timer, CLASS_B_RETRY_INTERVAL);
+    TimerStart(&class_b_timer);
+}
+
+
+static void class_b_start(void)
+{
+    if (class_b.state != LRW_CLASS_B_OFF) return;
+    class_b_next(SysTimeGet().Seconds >= MIN_VALID_TIME
+        ? LRW_CLASS_B_ACQUIRING : LRW_CLASS_B_TIME);
+}
+
+
+static LoRaMacStatus_t send_empty_frame(void)
+{
+    MibRequestConfirm_t mbr = { .Type = MIB_CHANNELS_DATARATE };
+    LoRaMacMibGetRequestConfirm(&mbr);
+
+    McpsReq_t mcr;
+    memset(&mcr, 0, sizeof(mcr));
+    mcr.Type = MCPS_UNCONFIRMED;
+    // See the comments in lrw_send on why the following parameter is set to the
+    // value from MIB
+    mcr.Req.Unconfirmed.Datarate = mbr.Param.ChannelsDatarate;
+
+    // Disable retransmissions. The frame only carries MAC commands such as
+    // DeviceTimeReq. Retransmitting such requests would interfere with time
+    // synchronization.
+    return lrw_mcps_request(&mcr, 1);
+}
+
+
+static void on_auto_pull_timer(void *ctx)
+{
+    (void)ctx;
+    events |= AUTO_PULL;
+    system_post(SYSTEM_TASK_LORA);
+}
+
+
+static void pull_downlinks(void)
+{
+    TimerTime_t now;
+    LoRaMacStatus_t rc;
+
+    if (!auto_pull.pending || !sysconf.auto_pull) return;
+
+    // Queued uplinks pull the downlinks just as well
+    if (tx_queue.in_flight || tx_store.in_flight || LoRaMacIsBusy()) return;
+
+    if (auto_pull.count >= AUTO_PULL_MAX) {
+        log_debug("Auto-pull: Giving up after %d uplinks", auto_pull.count);
+        auto_pull.pending = false;
+        return;
+    }
+
+    now = rtc_now();
+    if (lrw_dutycycle_deadline > now) {
+        TimerStop(&auto_pull_timer);
+        TimerSetValue(&auto_pull_timer, lrw_dutycycle_deadline - now);
+        TimerStart(&auto_pull_timer);
+        return;
+    }
+
+    rc = send_empty_frame();
+    switch (rc) {
+        case LORAMAC_STATUS_OK:
+            // The indication in the next downlink, if any, sets the flag again
+            auto_pull.pending = false;
+            auto_pull.count++;
+            break;
+
+        case LORAMAC_STATUS_BUSY:
+        case LORAMAC_STATUS_DUTYCYCLE_RESTRICTED:
+            TimerStop(&auto_pull_timer);
+            TimerSetValue(&auto_pull_timer, lrw_dutycycle_deadline > now
+                ? lrw_dutycycle_deadline - now : 1000);
+            TimerStart(&auto_pull_timer);
+            break;
+
+        default:
+            log_debug("Auto-pull: Uplink failed: %d", rc);
+            auto_pull.pending = false;
+            break;
+    }
+}
+
+
+// MAC requests deferred with lrw_defer_mac_request. They are handed to LoRaMac
+// right before the next uplink, which carries them in its FOpts, see
+// attach_mac_requests. If the earliest deadline passes before an uplink has
+// carried them, they are sent in an empty frame of their own instead.
+static struct {
+    uint8_t pending;        // LRW_MAC_* requests not handed to LoRaMac yet
+    uint8_t queued;         // Requests handed to LoRaMac, not confirmed yet
+    bool expired;           // The deadline has passed
+    TimerTime_t deadline;   // 0 if none
+} mac_defer;
+
+static TimerEvent_t mac_deadline_timer;
+
+
+static void on_mac_deadline_timer(void *ctx)
+{
+    (void)ctx;
+    events |= MAC_DEADLINE;
+    system_post(SYSTEM_TASK_LORA);
+}
+
+
+static void attach_mac_requests(void)
+{
+    MlmeReq_t r;
+
+    if (mac_defer.pending & LRW_MAC_LINK_CHECK) {
+        memset(&r, 0, sizeof(r));
+        r.Type = MLME_LINK_CHECK;
+        if (lrw_mlme_request(&r) == LORAMAC_STATUS_OK) {
+            mac_defer.pending &= ~LRW_MAC_LINK_CHECK;
+            mac_defer.queued |= LRW_MAC_LINK_CHECK;
+        }
+    }
+
+    if (mac_defer.pending & LRW_MAC_DEVICE_TIME) {
+        memset(&r, 0, sizeof(r));
+        r.Type = MLME_DEVICE_TIME;
+        if (lrw_mlme_request(&r) == LORAMAC_STATUS_OK) {
+            mac_defer.pending &= ~LRW_MAC_DEVICE_TIME;
+            mac_defer.queued |= LRW_MAC_DEVICE_TIME;
+        }
+    }
+}
+
+
+static void mac_request_done(unsigned int request)
+{
+    mac_defer.queued &= ~request;
+    if (mac_defer.pending || mac_defer.queued) return;
+
+    TimerStop(&mac_deadline_timer);
+    mac_defer.deadline = 0;
+    mac_defer.expired = false;
+}
+
+
+static void send_mac_requests(void)
+{
+    LoRaMacStatus_t rc;
+    TimerTime_t now;
+
+    if (!mac_defer.pending && !mac_defer.queued) {
+        mac_defer.expired = false;
+        return;
+    }
+
+    // Retried from the MAC event that ends the operation in progress
+    if (LoRaMacIsBusy()) return;
+
+    // The empty frame goes through lrw_mcps_request, which attaches the
+    // pending requests to it
+    rc = send_empty_frame();
+    now = rtc_now();
+    switch (rc) {
+        case LORAMAC_STATUS_OK:
+            mac_defer.expired = false;
+            mac_defer.deadline = 0;
+            break;
+
+        case LORAMAC_STATUS_BUSY:
+        case LORAMAC_STATUS_DUTYCYCLE_RESTRICTED:
+            mac_defer.expired = false;
+            TimerStop(&mac_deadline_timer);
+            TimerSetValue(&mac_deadline_timer, lrw_dutycycle_deadline > now
+                ? lrw_dutycycle_deadline - now : 1000);
+            TimerStart(&mac_deadline_timer);
+            break;
+
+        default:
+            log_debug("Deferred MAC requests: Uplink failed: %d", rc);
+            mac_defer.pending = 0;
+            mac_defer.queued = 0;
+            mac_defer.expired = false;
+            mac_defer.deadline = 0;
+            break;
+    }
+}
+
+
+int lrw_defer_mac_request(unsigned int requests, uint32_t deadline)
+{
+    MibRequestConfirm_t r = { .Type = MIB_NETWORK_ACTIVATION };
+    TimerTime_t at;
+
+    LoRaMacMibGetRequestConfirm(&r);
+    if (r.Param.NetworkActivation == ACTIVATION_TYPE_NONE)
+        return LORAMAC_STATUS_NO_NETWORK_JOINED;
+
+    mac_defer.pending |= requests & (LRW_MAC_LINK_CHECK | LRW_MAC_DEVICE_TIME);
+    if (deadline == 0) return LORAMAC_STATUS_OK;
+
+    at = rtc_now() + deadline * 1000UL;
+    if (mac_defer.deadline == 0 || at < mac_defer.deadline) {
+        mac_defer.deadline = at;
+        TimerStop(&mac_deadline_timer);
+        TimerSetValue(&mac_deadline_timer, deadline * 1000UL);
+        TimerStart(&mac_deadline_timer);
+    }
+    return LORAMAC_STATUS_OK;
+}
+
+
+static void class_b_step(void)
+{
+    MlmeReq_t r;
+    LoRaMacStatus_t rc;
+    MibRequestConfirm_t m = { .Type = MIB_NETWORK_ACTIVATION };
+
+    if (sysconf.device_class != CLASS_B || class_b.waiting) return;
+    if (class_b.state == LRW_CLASS_B_OFF || class_b.state == LRW_CLASS_B_ACTIVE) return;
+
+    // Joining restarts the procedure through sync_device_class
+    LoRaMacMibGetRequestConfirm(&m);
+    if (m.Param.NetworkActivation == ACTIVATION_TYPE_NONE) return;
+
+    memset(&r, 0, sizeof(r));
+    switch (class_b.state) {
+        case LRW_CLASS_B_TIME:
+            rc = lrw_get_device_time(false);
+            break;
+
+        case LRW_CLASS_B_ACQUIRING:
+            r.Type = MLME_BEACON_ACQUISITION;
+            rc = lrw_mlme_request(&r);
+            break;
+
+        case LRW_CLASS_B_PING_SLOT:
+            r.Type = MLME_PING_SLOT_INFO;
+            r.Req.PingSlotInfo.PingSlot.Fields.Periodicity = sysconf.ping_slot_periodicity;
+            rc = lrw_mlme_request(&r);
+            if (rc == LORAMAC_STATUS_OK) rc = send_empty_frame();
+            break;
+
+        default:
+            return;
+    }
+
+    if (rc != LORAMAC_STATUS_OK) {
+        log_debug("Class B step %d failed: %d", class_b.state, rc);
+        class_b_retry(class_b.state);
+        return;
+    }
+    class_b.waiting = true;
+}
+
+
+static void class_b_confirm(MlmeConfirm_t *param)
+{
+    bool ok = param->Status == LORAMAC_EVENT_INFO_STATUS_OK;
+    MibRequestConfirm_t r = { .Type = MIB_DEVICE_CLASS };
+
+    switch (param->MlmeRequest) {
+        case MLME_DEVICE_TIME:
+            if (class_b.state != LRW_CLASS_B_TIME) return;
+            if (ok) class_b_next(LRW_CLASS_B_ACQUIRING);
+            else class_b_retry(LRW_CLASS_B_TIME);
+            break;
+
+        case MLME_BEACON_ACQUISITION:
+            if (class_b.state != LRW_CLASS_B_ACQUIRING) return;
+            if (ok) {
+                class_b_next(LRW_CLASS_B_PING_SLOT);
+            } else {
+                // The time may be off, obtain it from the network again
+                cmd_event(CMD_EVENT_CLASS_B, CMD_CLASS_B_BEACON_NOT_FOUND);
+                class_b_retry(LRW_CLASS_B_TIME);
+            }
+            break;
+
+        case MLME_PING_SLOT_INFO:
+            if (class_b.state != LRW_CLASS_B_PING_SLOT) return;
+            if (!ok) {
+                class_b_retry(LRW_CLASS_B_PING_SLOT);
+                break;
+            }
+
+            r.Param.Class = CLASS_B;
+            if (LoRaMacMibSetRequestConfirm(&r) != LORAMAC_STATUS_OK) {
+                class_b_retry(LRW_CLASS_B_ACQUIRING);
+                break;
+            }
+            class_b.state = LRW_CLASS_B_ACTIVE;
+            class_b.waiting = false;
+            cmd_event(CMD_EVENT_CLASS_B, CMD_CLASS_B_ACTIVE);
+            break;
+
+        default:
+            break;
     }
+}
+
+
+static void class_b_indication(MlmeIndication_t *param)
+{
+    MibRequestConfirm_t r = { .Type = MIB_DEVICE_CLASS };
+
+    switch (param->MlmeIndication) {
+        case MLME_BEACON:
+            if (param->Status == LORAMAC_EVENT_INFO_STATUS_BEACON_LOCKED) {
+                class_b.beacon = param->BeaconInfo;
+                if (!class_b.locked) cmd_event(CMD_EVENT_CLASS_B, CMD_CLASS_B_BEACON_LOCKED);
+                class_b.locked = true;
+            } else {
+                // LoRaMac keeps the ping slots open (beacon-less operation)
+                // until it gives up with MLME_BEACON_LOST
+                log_debug("Beacon missed");
+                class_b.locked = false;
+            }
+            break;
 
-    if (param->IsUplinkTxPending == true) {
-        // Do nothing for now
+        case MLME_BEACON_LOST:
+            class_b.locked = false;
+            r.Param.Class = CLASS_A;
+            LoRaMacMibSetRequestConfirm(&r);
+            cmd_event(CMD_EVENT_CLASS_B, CMD_CLASS_B_BEACON_LOST);
+
+            // Start over with the network time
+            class_b.state = LRW_CLASS_B_OFF;
+            if (sysconf.device_class == CLASS_B) class_b_next(LRW_CLASS_B_TIME);
+            break;
+
+        default:
+            break;
     }
 }
 
 
 // Copy the device class value from sys config to the MIB. The value in the MIB
-// can be overwritten by LoRaMac at runtime, e.g., after a Join.
+// can be overwritten by LoRaMac at runtime, e.g., after a Join. Class B cannot
+// be set directly, the switch is carried out by class_b_step. A class A device
+// is in class C while a class C window is open.
 static int sync_device_class(void)
 {
     int rc;
     MibRequestConfirm_t r = { .Type = MIB_DEVICE_CLASS };
+    DeviceClass_t device_class = sysconf.device_class == CLASS_A && class_c.open
+        ? CLASS_C : sysconf.device_class;
 
     rc = LoRaMacMibGetRequestConfirm(&r);
     if (rc != LORAMAC_STATUS_OK) return rc;
 
-    if (r.Param.Class == sysconf.device_class)
+    if (r.Param.Class == device_class)
+        return LORAMAC_STATUS_OK;
+
+    if (sysconf.device_class == CLASS_B) {
+        // LoRaMac reverts to class A during Join, which ends class B
+        if (class_b.state == LRW_CLASS_B_ACTIVE) class_b.state = LRW_CLASS_B_OFF;
+
+        // LoRaMac only switches to class B from class A
+        if (r.Param.Class == CLASS_C) {
+            r.Param.Class = CLASS_A;
+            rc = LoRaMacMibSetRequestConfirm(&r);
+            if (rc != LORAMAC_STATUS_OK) return rc;
+        }
+
+        class_b_start();
         return LORAMAC_STATUS_OK;
+    }
+
+    TimerStop(&class_b_timer);
+    class_b.state = LRW_CLASS_B_OFF;
+    class_b.waiting = false;
+    class_b.locked = false;
+
+    // LoRaMac only switches to class C from class A
+    if (r.Param.Class == CLASS_B) {
+        r.Param.Class = CLASS_A;
+        rc = LoRaMacMibSetRequestConfirm(&r);
+        if (rc != LORAMAC_STATUS_OK) return rc;
+    }
 
-    r.Param.Class = sysconf.device_class;
+    r.Param.Class = device_class;
     return LoRaMacMibSetRequestConfirm(&r);
 }
 
 
+static void on_class_c_timer(void *ctx)
+{
+    (void)ctx;
+    events |= CLASS_C_END;
+    system_post(SYSTEM_TASK_LORA);
+}
+
+
+static void on_class_c_schedule_timer(void *ctx)
+{
+    (void)ctx;
+    events |= CLASS_C_START;
+    system_post(SYSTEM_TASK_LORA);
+}
+
+
+// Arm the timer for the start of the next scheduled class C window. While the
+// GPS time is unknown, check again every CLASS_C_TIME_POLL ms.
+static void schedule_class_c_window(void)
+{
+    uint32_t period, pos, wait;
+    SysTime_t t;
+
+    TimerStop(&class_c_schedule_timer);
+    if (!(sysconf.class_c_policy & LRW_CLASS_C_SCHEDULE)) return;
+    if (sysconf.class_c_window == 0 || sysconf.class_c_period == 0) return;
+
+    t = SysTimeGet();
+    if (t.Seconds < MIN_VALID_TIME) {
+        wait = CLASS_C_TIME_POLL;
+    } else {
+        period = sysconf.class_c_period;
+        pos = (t.Seconds - UNIX_GPS_EPOCH_OFFSET) % period;
+        wait = ((sysconf.class_c_offset % period) + period - pos) % period;
+        if (wait == 0) wait = period;
+        wait = wait * 1000UL - t.SubSeconds;
+    }
+
+    TimerSetValue(&class_c_schedule_timer, wait);
+    TimerStart(&class_c_schedule_timer);
+}
+
+
+static void open_class_c_window(void)
+{
+    MibRequestConfirm_t r = { .Type = MIB_NETWORK_ACTIVATION };
+
+    if (sysconf.device_class != CLASS_A || sysconf.class_c_window == 0) return;
+
+    LoRaMacMibGetRequestConfirm(&r);
+    if (r.Param.NetworkActivation == ACTIVATION_TYPE_NONE) return;
+
+    TimerStop(&class_c_timer);
+    TimerSetValue(&class_c_timer, sysconf.class_c_window * 1000UL);
+    TimerStart(&class_c_timer);
+    if (class_c.open) return;
+
+    class_c.open = true;
+    if (sync_device_class() != LORAMAC_STATUS_OK) {
+        TimerStop(&class_c_timer);
+        class_c.open = false;
+        return;
+    }
+
+    class_c.windows++;
+    log_debug("Class C window open for %u s", sysconf.class_c_window);
+}
+
+
+static void close_class_c_window(void)
+{
+    TimerStop(&class_c_timer);
+    if (!class_c.open) return;
+
+    class_c.open = false;
+    sync_device_class();
+    log_debug("Class C window closed");
+}
+
+
+static void class_c_poll(unsigned ev)
+{
+    if (ev & CLASS_C_START) {
+        class_c.start = true;
+        schedule_class_c_window();
+    }
+    if (ev & CLASS_C_END) class_c.end = true;
+
+    if (!class_c.start && !class_c.end) return;
+
+    // Retried from the MAC event that ends the operation in progress
+    if (LoRaMacIsBusy()) return;
+
+    if (class_c.start) open_class_c_window();
+    else close_class_c_window();
+
+    class_c.start = false;
+    class_c.end = false;
+}
+
+
+void lrw_class_c_reschedule(void)
+{
+    class_c.start = false;
+    class_c.end = false;
+    close_class_c_window();
+    schedule_class_c_window();
+}
+
+
+bool lrw_get_class_c_window(uint32_t *windows)
+{
+    if (windows) *windows = class_c.windows;
+    return class_c.open;
+}
+
+
+lrw_class_b_state_t lrw_get_class_b_status(bool *locked, BeaconInfo_t *beacon)
+{
+    if (locked) *locked = class_b.locked;
+    if (beacon) *beacon = class_b.beacon;
+    return class_b.state;
+}
+
+
+unsigned int lrw_get_ping_slot_periodicity(void)
+{
+    return sysconf.ping_slot_periodicity;
+}
+
+
+int lrw_set_ping_slot_periodicity(unsigned int periodicity)
+{
+    if (periodicity > 7) return -1;
+    if (periodicity != sysconf.ping_slot_periodicity) {
+        sysconf.ping_slot_periodicity = periodicity;
+        sysconf_modified = true;
+    }
+
+    // Announce the new periodicity to the network if class B is on
+    if (class_b.state == LRW_CLASS_B_ACTIVE || class_b.state == LRW_CLASS_B_PING_SLOT) {
+        TimerStop(&class_b_timer);
+        class_b_next(LRW_CLASS_B_PING_SLOT);
+    }
+    return 0;
+}
+
+
 #ifdef LORAMAC_ABP_VERSION
 static int set_abp_mac_version(void)
 {
@@ -422,6 +3821,26 @@ static void restore_chmask(void)
 
 static void linkcheck_callback(MlmeConfirm_t *param)
 {
+    bool tpc_check = tpc.checking, cadr_check = cadr.checking;
+    tpc_link_check(param->Status, param->DemodMargin);
+    cadr_link_check(param->Status, param->DemodMargin);
+    linkwd_link_check(param->Status == LORAMAC_EVENT_INFO_STATUS_OK);
+
+    // Link checks requested by the uplink store are not reported to the host
+    if (tx_store.checking) {
+        tx_store.checking = false;
+        if (param->Status == LORAMAC_EVENT_INFO_STATUS_OK) {
+            if (tx_store.in_flight) tx_store.delivered = true;
+            if (!tx_store.online) tx_store.next = 0;
+            tx_store.online = true;
+        }
+        tx_store.kick = true;
+        return;
+    }
+
+    // Neither are link checks requested by the power or data rate controller
+    if (tpc_check || cadr_check) return;
+
     if (param->Status == LORAMAC_EVENT_INFO_STATUS_OK) {
         cmd_event(CMD_EVENT_NETWORK, CMD_NET_ANSWER);
         atci_printf("+ANS=%d,%d,%d" ATCI_EOL, SRV_MAC_LINK_CHECK_ANS, param->DemodMargin, param->NbGateways);
@@ -431,6 +3850,27 @@ static void linkcheck_callback(MlmeConfirm_t *param)
 }
 
 
+// The OTAA Join scheduler steps the data rate down after every JOIN_LADDER_STEP
+// unanswered Join requests and widens a sub-band channel mask to all channels
+// after JOIN_SUBBAND_TRIES unanswered Join requests. With sub-band learning,
+// it cycles through the JOIN_SUBBANDS sub-bands instead.
+#define JOIN_LADDER_STEP   2
+#define JOIN_SUBBAND_TRIES 4
+#define JOIN_SUBBANDS      8
+
+static struct {
+    uint32_t jitter;
+    bool ladder;
+    uint8_t subband;     // LRW_JOIN_SUBBAND_*
+    unsigned int sent;   // Join requests sent since lrw_join
+    bool widened;        // Set if the channel mask has been widened
+    int8_t band;         // Sub-band of the last Join request, -1 if not cycling
+    uint16_t chmask[REGION_NVM_CHANNELS_MASK_SIZE];
+    TimerTime_t start;
+    lrw_join_stats_t stats;
+} join_sched;
+
+
 static void join_callback_abp(MlmeConfirm_t *param)
 {
 #ifdef LORAMAC_ABP_VERSION
@@ -445,12 +3885,129 @@ static void join_callback_abp(MlmeConfirm_t *param)
 }
 
 
-static int send_join(void)
+static int send_join(TimerTime_t *wait)
 {
     MlmeReq_t mlme = { .Type = MLME_JOIN };
     mlme.Req.Join.NetworkActivation = ACTIVATION_TYPE_OTAA;
     mlme.Req.Join.Datarate = join_datarate;
-    return lrw_mlme_request(&mlme);
+    int rc = lrw_mlme_request(&mlme);
+    if (wait != NULL) *wait = mlme.ReqReturn.DutyCycleWaitTime;
+    return rc;
+}
+
+
+static void schedule_join(uint32_t delay)
+{
+    if (join_sched.jitter) delay += randr(0, join_sched.jitter);
+    TimerSetValue(&join_retry_timer, delay);
+    TimerStart(&join_retry_timer);
+}
+
+
+// Remember the application's channel mask and enable all channels so that
+// LoRaMac cycles the Join requests through all sub-bands
+static void widen_join_chmask(void)
+{
+    uint16_t mask[REGION_NVM_CHANNELS_MASK_SIZE] = { 0 };
+    MibRequestConfirm_t r = { .Type = MIB_CHANNELS_MASK };
+    int i, n = lrw_get_max_channels();
+
+    LoRaMacMibGetRequestConfirm(&r);
+    memcpy(join_sched.chmask, r.Param.ChannelsMask, sizeof(join_sched.chmask));
+
+    for (i = 0; i < n; i++) mask[i / 16] |= 1 << (i % 16);
+    if (memcmp(mask, join_sched.chmask, n / 8) == 0) return;
+
+    r.Param.ChannelsMask = mask;
+    if (LoRaMacMibSetRequestConfirm(&r) == LORAMAC_STATUS_OK) {
+        log_debug("Join: Enabling all channels");
+        join_sched.widened = true;
+    }
+}
+
+
+static bool has_subbands(void)
+{
+    LoRaMacNvmData_t *state = lrw_get_state();
+    return state->MacGroup2.Region == LORAMAC_REGION_US915 ||
+        state->MacGroup2.Region == LORAMAC_REGION_AU915;
+}
+
+
+// Limit the channel mask to the eight 125 kHz channels of the given sub-band
+// (0-7) and the 500 kHz channel of the sub-band
+static void set_join_subband(unsigned int band)
+{
+#if REGION_NVM_CHANNELS_MASK_SIZE > 4
+    uint16_t mask[REGION_NVM_CHANNELS_MASK_SIZE] = { 0 };
+    MibRequestConfirm_t r = {
+        .Type  = MIB_CHANNELS_MASK,
+        .Param = { .ChannelsMask = mask }
+    };
+
+    mask[band / 2] = 0xff << (band % 2 * 8);
+    mask[4] = 1 << band;
+    if (LoRaMacMibSetRequestConfirm(&r) == LORAMAC_STATUS_OK) {
+        log_debug("Join: Using sub-band %d", band + 1);
+        join_sched.band = band;
+    }
+#else
+    (void)band;
+#endif
+}
+
+
+// Remember the application's channel mask and start with the sub-band of the
+// last accepted Join request, or with the first sub-band
+static void start_join_subbands(void)
+{
+    MibRequestConfirm_t r = { .Type = MIB_CHANNELS_MASK };
+
+    LoRaMacMibGetRequestConfirm(&r);
+    memcpy(join_sched.chmask, r.Param.ChannelsMask, sizeof(join_sched.chmask));
+    join_sched.widened = true;
+
+    if (sysconf.join_subband > JOIN_SUBBANDS) sysconf.join_subband = 0;
+    set_join_subband(sysconf.join_subband ? sysconf.join_subband - 1 : 0);
+}
+
+
+static void restore_join_chmask(void)
+{
+    if (!join_sched.widened) return;
+    join_sched.widened = false;
+
+    MibRequestConfirm_t r = {
+        .Type  = MIB_CHANNELS_MASK,
+        .Param = { .ChannelsMask = join_sched.chmask }
+    };
+    LoRaMacMibSetRequestConfirm(&r);
+}
+
+
+// Adjust the parameters of the next Join request after an unanswered one
+static void adapt_join(void)
+{
+    LoRaMacNvmData_t *state = lrw_get_state();
+
+    if (join_sched.ladder && join_sched.sent % JOIN_LADDER_STEP == 0) {
+        GetPhyParams_t req = {
+            .Attribute = PHY_MIN_TX_DR,
+            .UplinkDwellTime = state->MacGroup2.MacParams.UplinkDwellTime
+        };
+        PhyParam_t phy = RegionGetPhyParam(state->MacGroup2.Region, &req);
+        if (join_datarate > phy.Value) {
+            join_datarate--;
+            log_debug("Join: Stepping down to DR%d", join_datarate);
+        }
+    }
+
+    if (join_sched.band >= 0) {
+        set_join_subband((join_sched.band + 1) % JOIN_SUBBANDS);
+    } else if (join_sched.subband == LRW_JOIN_SUBBAND_WIDEN &&
+        join_sched.sent == JOIN_SUBBAND_TRIES && has_subbands()) {
+        widen_join_chmask();
+    }
 }
 
 
@@ -459,7 +4016,25 @@ static void stop_join(unsigned int status)
     TimerStop(&join_retry_timer);
     joins_left = 0;
 
+    // Remember the sub-band the network listens on for the next Join
+    if (status == CMD_JOIN_SUCCEEDED && join_sched.band >= 0 &&
+        sysconf.join_subband != join_sched.band + 1) {
+        log_debug("Join: Learned sub-band %d", join_sched.band + 1);
+        sysconf.join_subband = join_sched.band + 1;
+        sysconf_modified = true;
+    }
+    join_sched.band = -1;
+
+    // Keep the widened channel mask after a successful Join. The network
+    // server configures the channels in the Join accept or with LinkADRReq.
+    if (status == CMD_JOIN_SUCCEEDED) join_sched.widened = false;
+    else restore_join_chmask();
+
     cmd_event(CMD_EVENT_JOIN, status);
+    linkwd_join_done(status == CMD_JOIN_SUCCEEDED);
+
+    // LoRaMac discards the MAC commands it has not sent yet when joining
+    mac_defer.queued = 0;
 
     // During the Join operation, LoRaMac internally switches the device class
     // to class A. Thus, we need to restore the original class from
@@ -478,8 +4053,19 @@ static void stop_join(unsigned int status)
 
 static void retransmit_join(void)
 {
+    TimerTime_t wait = 0;
+
     log_debug("Retransmitting Join");
-    LoRaMacStatus_t rc = send_join();
+    LoRaMacStatus_t rc = send_join(&wait);
+
+    // If the Join duty cycle does not permit the transmission yet, try again
+    // once it does rather than failing the Join
+    if (rc == LORAMAC_STATUS_DUTYCYCLE_RESTRICTED && wait != 0) {
+        log_debug("Join delayed by %lu ms due to duty cycle", wait);
+        schedule_join(wait);
+        return;
+    }
+
     if (rc != LORAMAC_STATUS_OK) {
         log_error("Error while retransmitting Join (%d)", rc);
         stop_join(CMD_JOIN_FAILED);
@@ -490,18 +4076,32 @@ static void retransmit_join(void)
 static void on_join_timer(void *ctx)
 {
     // This handler is invoked in the ISR context within an interrupt generated
-    // by the RTC. Perform no work here; only set an even flag and prevent sleep
-    // so that the event gets a chance to be handled on the next run of the main
-    // processing function in this module.
+    // by the RTC. Perform no work here; only set an even flag and post the LoRa
+    // task so that the event gets a chance to be handled on the next run of the
+    // main processing function in this module.
     (void)ctx;
-    system_sleep_lock |= SYSTEM_MODULE_LORA;
     events |= RETRANSMIT_JOIN;
+    system_post(SYSTEM_TASK_LORA);
 }
 
 
 static void join_callback_otaa(MlmeConfirm_t *param)
 {
     joins_left--;
+    join_sched.sent++;
+    join_sched.stats.attempts++;
+    join_sched.stats.airtime += param->TxTimeOnAir;
+    stats.joins++;
+    add_airtime(param->TxTimeOnAir);
+    evlog_record(EVLOG_JOIN, param->Status, join_datarate);
+
+    if (param->Status == LORAMAC_EVENT_INFO_STATUS_OK) {
+        join_sched.stats.accepts++;
+        join_sched.stats.time = TimerGetElapsedTime(join_sched.start);
+        join_sched.stats.rssi = radio_rssi;
+        join_sched.stats.snr = radio_snr;
+        join_sched.stats.dr = join_datarate;
+    }
 
     // If the previous Join request timed out and we have Join retransmissions
     // left, transmit again. In all other cases, consider the Join transmission
@@ -509,10 +4109,9 @@ static void join_callback_otaa(MlmeConfirm_t *param)
     if (joins_left > 0 && param->Status == LORAMAC_EVENT_INFO_STATUS_RX2_TIMEOUT) {
         // Apply a random delay before each Join retransmission, as recommended
         // in Section 7 of LoRaWAN Specification 1.1. We kind of arbitrarily
-        // choose a delay between 100 ms and 500 ms.
-        uint32_t delay = randr(100, 500);
-        TimerSetValue(&join_retry_timer, delay);
-        TimerStart(&join_retry_timer);
+        // choose a delay between 100 ms and 500 ms, plus the configured jitter.
+        adapt_join();
+        schedule_join(randr(100, 500));
     } else {
         stop_join(param->Status == LORAMAC_EVENT_INFO_STATUS_OK ?
             CMD_JOIN_SUCCEEDED : CMD_JOIN_FAILED);
@@ -532,6 +4131,20 @@ static void join_callback(MlmeConfirm_t *param)
 }
 
 
+static void rejoin_callback(MlmeConfirm_t *param)
+{
+    if (param->Status == LORAMAC_EVENT_INFO_STATUS_OK) {
+        log_debug("Rejoin accepted");
+        cmd_event(CMD_EVENT_JOIN, CMD_JOIN_REJOIN_SUCCEEDED);
+    } else {
+        cmd_event(CMD_EVENT_JOIN, CMD_JOIN_REJOIN_FAILED);
+    }
+
+    // A Join-accept switches LoRaMac to class A, see stop_join
+    sync_device_class();
+}
+
+
 static void cert_callback(MlmeConfirm_t *param)
 {
     if (param->Status == LORAMAC_EVENT_INFO_STATUS_TX_TIMEOUT) {
@@ -595,13 +4208,21 @@ static void mlme_confirm(MlmeConfirm_t *param)
 {
     log_debug("mlme_confirm: MlmeRequest: %d Status: %d", param->MlmeRequest, param->Status);
     tx_params.Status = param->Status;
+    tx_store.kick = true;
 
     switch(param->MlmeRequest) {
         case MLME_JOIN:
             join_callback(param);
             break;
 
+        case MLME_REJOIN_0:
+        case MLME_REJOIN_1:
+        case MLME_REJOIN_2:
+            rejoin_callback(param);
+            break;
+
         case MLME_LINK_CHECK:
+            mac_request_done(LRW_MAC_LINK_CHECK);
             linkcheck_callback(param);
             break;
 
@@ -610,7 +4231,14 @@ static void mlme_confirm(MlmeConfirm_t *param)
             break;
 
         case MLME_DEVICE_TIME:
+            mac_request_done(LRW_MAC_DEVICE_TIME);
             device_time_callback(param);
+            class_b_confirm(param);
+            break;
+
+        case MLME_BEACON_ACQUISITION:
+        case MLME_PING_SLOT_INFO:
+            class_b_confirm(param);
             break;
 
         default:
@@ -619,9 +4247,10 @@ static void mlme_confirm(MlmeConfirm_t *param)
 }
 
 
-static void mlme_indication(__attribute__((unused)) MlmeIndication_t *param)
+static void mlme_indication(MlmeIndication_t *param)
 {
     log_debug("MlmeIndication: MlmeIndication: %d Status: %d", param->MlmeIndication, param->Status);
+    class_b_indication(param);
 }
 
 
@@ -636,7 +4265,7 @@ static LoRaMacPrimitives_t primitives = {
 
 static LoRaMacCallback_t callbacks = {
     .GetBatteryLevel     = get_battery_level,
-    .GetTemperatureLevel = adc_get_temperature_celsius,
+    .GetTemperatureLevel = get_temperature_level,
     .NvmDataChange       = state_changed,
     .MacProcessNotify    = process_notify
 };
@@ -775,7 +4404,46 @@ void lrw_init(void)
     MibRequestConfirm_t r;
 
     memset(&tx_params, 0, sizeof(tx_params));
+    join_sched.band = -1;
     TimerInit(&join_retry_timer, on_join_timer);
+    TimerInit(&tx_queue_timer, on_tx_queue_timer);
+    TimerInit(&slot_timer, on_tx_queue_timer);
+    TimerInit(&nvm_flush_timer, on_nvm_flush_timer);
+    TimerSetSlack(&join_retry_timer, JOIN_RETRY_TIMER_SLACK);
+    TimerSetSlack(&tx_queue_timer, TX_QUEUE_TIMER_SLACK);
+    TimerSetSlack(&nvm_flush_timer, NVM_FLUSH_TIMER_SLACK);
+    TimerInit(&auto_pull_timer, on_auto_pull_timer);
+    TimerSetSlack(&auto_pull_timer, AUTO_PULL_TIMER_SLACK);
+    TimerInit(&linkwd_timer, on_linkwd_timer);
+    TimerSetSlack(&linkwd_timer, LINKWD_TIMER_SLACK);
+    TimerInit(&mac_deadline_timer, on_mac_deadline_timer);
+    TimerSetSlack(&mac_deadline_timer, MAC_DEADLINE_SLACK);
+    TimerInit(&class_c_timer, on_class_c_timer);
+    TimerSetSlack(&class_c_timer, CLASS_C_TIMER_SLACK);
+    TimerInit(&class_c_schedule_timer, on_class_c_schedule_timer);
+    TimerSetSlack(&class_c_schedule_timer, CLASS_C_TIMER_SLACK);
+    schedule_class_c_window();
+    init_tx_store();
+#if FUOTA == 1
+    frag_init();
+#endif
+#if CLOCK_SYNC == 1
+    clocksync_init();
+#endif
+    p2p_init();
+    bulk_init();
+    ping_init();
+    agg_init();
+    heartbeat_init();
+#if TRIGGER_PIN == 1
+    trigger_init();
+#endif
+    TimerInit(&temp_comp_timer, on_temp_comp_timer);
+    TimerSetSlack(&temp_comp_timer, TEMP_COMP_TIMER_SLACK);
+    TimerInit(&class_b_timer, on_class_b_timer);
+    TimerSetSlack(&class_b_timer, CLASS_B_TIMER_SLACK);
+    TimerInit(&rx_queue_timer, on_rx_queue_timer);
+    TimerSetSlack(&rx_queue_timer, RX_QUEUE_TIMER_SLACK);
 
     LoRaMacRegion_t region = restore_region();
 
@@ -806,9 +4474,11 @@ void lrw_init(void)
         halt("LoRaMac: Error while initializing to defaults");
 
     restore_state();
+    restore_region_session();
+    restore_deadlines();
 
     r.Type = MIB_SYSTEM_MAX_RX_ERROR;
-    r.Param.SystemMaxRxError = 20;
+    r.Param.SystemMaxRxError = max_rx_error;
     LoRaMacMibSetRequestConfirm(&r);
 
     sync_device_class();
@@ -854,11 +4524,13 @@ void lrw_init(void)
 }
 
 
-int lrw_send(uint8_t port, void *buffer, uint8_t length, bool confirmed)
+int lrw_send(uint8_t port, void *buffer, uint8_t length, bool confirmed,
+    const lrw_tx_options_t *options)
 {
     McpsReq_t mr;
     LoRaMacTxInfo_t txi;
     LoRaMacStatus_t rc;
+    int transmissions;
 
     memset(&mr, 0, sizeof(mr));
 
@@ -881,6 +4553,7 @@ int lrw_send(uint8_t port, void *buffer, uint8_t length, bool confirmed)
 
     MibRequestConfirm_t r = { .Type = MIB_CHANNELS_DATARATE };
     LoRaMacMibGetRequestConfirm(&r);
+    r.Param.ChannelsDatarate = batpol_datarate(r.Param.ChannelsDatarate);
 
     rc = LoRaMacQueryTxPossible(length, &txi);
     if (rc != LORAMAC_STATUS_OK) {
@@ -938,9 +4611,15 @@ int lrw_send(uint8_t port, void *buffer, uint8_t length, bool confirmed)
         mr.Req.Confirmed.Datarate = r.Param.ChannelsDatarate;
     }
 
-    rc = lrw_mcps_request(&mr, confirmed
-        ? sysconf.confirmed_retransmissions
-        : sysconf.unconfirmed_retransmissions);
+    if (options && options->transmissions) {
+        transmissions = options->transmissions;
+    } else {
+        transmissions = confirmed
+            ? sysconf.confirmed_retransmissions
+            : sysconf.unconfirmed_retransmissions;
+    }
+
+    rc = lrw_mcps_request(&mr, transmissions);
     if (rc != LORAMAC_STATUS_OK)
         log_debug("Transmission failed: %d", rc);
 
@@ -948,23 +4627,228 @@ int lrw_send(uint8_t port, void *buffer, uint8_t length, bool confirmed)
 }
 
 
+// Return the adaptive RX error (ms) for the RX windows of the next uplink,
+// -1 if the data rate of either window has not been measured often enough
+static int32_t next_adaptive_rx_error(void)
+{
+    LoRaMacNvmData_t *state = lrw_get_state();
+    int32_t rx1, rx2;
+    int8_t dr;
+
+    dr = RegionApplyDrOffset(state->MacGroup2.Region, state->MacGroup2.MacParams.DownlinkDwellTime,
+        state->MacGroup1.ChannelsDatarate, state->MacGroup2.MacParams.Rx1DrOffset);
+
+    rx1 = adaptive_rx_error(dr);
+    rx2 = adaptive_rx_error(state->MacGroup2.MacParams.Rx2Channel.Datarate);
+    if (rx1 < 0 || rx2 < 0) return -1;
+    return rx1 > rx2 ? rx1 : rx2;
+}
+
+
+static void update_max_rx_error(void)
+{
+    MibRequestConfirm_t r;
+    int32_t adaptive, error = rtc_get_mcu_wake_up_error();
+    if (error < 0) return;
+
+    error += MAX_RX_ERROR_MIN;
+    if (sysconf.rx_adapt && (adaptive = next_adaptive_rx_error()) >= 0) error = adaptive;
+    if (error > MAX_RX_ERROR_DEFAULT) error = MAX_RX_ERROR_DEFAULT;
+    if ((uint32_t)error == max_rx_error) return;
+
+    // Do not change the RX window parameters in the middle of a transaction
+    if (LoRaMacIsBusy()) return;
+
+    max_rx_error = error;
+    r.Type = MIB_SYSTEM_MAX_RX_ERROR;
+    r.Param.SystemMaxRxError = max_rx_error;
+    LoRaMacMibSetRequestConfirm(&r);
+    log_debug("LoRaMac: Max RX error %lu ms (wakeup %d ticks)", max_rx_error, rtc_get_mcu_wake_up_time());
+}
+
+
+#if CRYPTO_KEYSTREAM == 1
+// Have the keystream of the next uplink ready before the host submits it.
+// This does nothing if the keystream of the frame counter has already been
+// computed.
+static void precompute_keystream(void)
+{
+    LoRaMacNvmData_t *state = lrw_get_state();
+    MibRequestConfirm_t r = { .Type = MIB_DEV_ADDR };
+    const uint8_t *key;
+
+    if (state->MacGroup2.NetworkActivation == ACTIVATION_TYPE_NONE) return;
+
+    key = find_se_key(&state->SecureElement, APP_S_KEY);
+    if (key == NULL) return;
+
+    LoRaMacMibGetRequestConfirm(&r);
+    crypto_precompute_keystream(key, r.Param.DevAddr, state->Crypto.FCntList.FCntUp + 1);
+}
+#endif
+
+
 void lrw_process(void)
 {
     uint32_t mask = disable_irq();
     unsigned ev = events;
     events = NO_EVENT;
-
-    system_sleep_lock &= ~SYSTEM_MODULE_LORA;
     reenable_irq(mask);
 
     if (ev & RETRANSMIT_JOIN) retransmit_join();
+    if (ev & CLASS_B_STEP) class_b_step();
+    if ((ev & SAMPLE_TEMP) && temp_comp.enabled) sample_temperature();
 
     if (Radio.IrqProcess != NULL) Radio.IrqProcess();
+    sample_after_tx();
     LoRaMacProcess();
+    report_tx_done();
+    update_max_rx_error();
+    drain_rx_queue();
+    class_c_poll(ev);
+    if ((ev & MAC_DEADLINE) || mac_defer.expired) {
+        mac_defer.expired = true;
+        send_mac_requests();
+    }
+    p2p_process();
+    bulk_process();
+    ping_process();
+#if CLOCK_SYNC == 1
+    clocksync_poll();
+#endif
+#if REMOTE_ATCI == 1
+    remote_poll();
+#endif
+#if TRIGGER_PIN == 1
+    trigger_poll();
+#endif
+#if ATCI_I2C == 1
+    i2c_target_process();
+#endif
+    if ((ev & DRAIN_TX_STORE) || tx_store.kick) drain_tx_store();
+    tpc_poll();
+    cadr_poll();
+    linkwd_poll();
+#if CRYPTO_KEYSTREAM == 1
+    precompute_keystream();
+#endif
+    drain_tx_queue();
+    agg_process();
+    heartbeat_process();
+    pull_downlinks();
+    retain_deadlines();
     save_state();
 }
 
 
+void lrw_yield(void)
+{
+    if (Radio.IrqProcess != NULL) Radio.IrqProcess();
+    sample_after_tx();
+    LoRaMacProcess();
+    report_tx_done();
+}
+
+
+int lrw_enqueue(uint8_t port, void *buffer, uint8_t length, bool confirmed,
+    const lrw_tx_options_t *options)
+{
+    tx_slot_t *s;
+    unsigned int i, pos;
+
+    uint8_t *payload = NULL;
+
+    if (length > LRW_TX_QUEUE_MAX_PAYLOAD) return -1;
+    if (tx_queue.count == LRW_TX_QUEUE_SIZE) return -1;
+
+    if (length) {
+        payload = pool_alloc(length, POOL_LRW_TX);
+        if (payload == NULL) return -1;
+        memcpy(payload, buffer, length);
+    }
+
+    // An urgent message goes behind the message in flight and other urgent
+    // messages. The slots behind it are moved back by one.
+    pos = tx_queue.count;
+    if (options && options->urgent) {
+        pos = tx_queue.in_flight || tx_queue.retry_at ? 1 : 0;
+        for (; pos < tx_queue.count; pos++)
+            if (!tx_queue.slot[(tx_queue.head + pos) % LRW_TX_QUEUE_SIZE].urgent) break;
+        for (i = tx_queue.count; i > pos; i--)
+            tx_queue.slot[(tx_queue.head + i) % LRW_TX_QUEUE_SIZE] =
+                tx_queue.slot[(tx_queue.head + i - 1) % LRW_TX_QUEUE_SIZE];
+    }
+
+    s = &tx_queue.slot[(tx_queue.head + pos) % LRW_TX_QUEUE_SIZE];
+    s->id = tx_queue.next_id++;
+    s->port = port;
+    s->length = length;
+    s->confirmed = confirmed;
+    s->flushed = false;
+    s->urgent = options ? options->urgent : false;
+    s->split = false;
+    s->fragment = 0;
+    s->offset = 0;
+    s->transmissions = options ? options->transmissions : 0;
+    s->attempts = 0;
+    s->payload = payload;
+    tx_queue.count++;
+
+    // Have the main loop attempt the transmission on its next iteration
+    uint32_t mask = disable_irq();
+    events |= DRAIN_TX_QUEUE;
+    reenable_irq(mask);
+    system_post(SYSTEM_TASK_LORA);
+
+    return s->id;
+}
+
+
+unsigned int lrw_tx_queue_length(void)
+{
+    return tx_queue.count;
+}
+
+
+TimerTime_t lrw_predict_tx_delay(void)
+{
+    TimerTime_t now = rtc_tick2ms(rtc_get_timer_value());
+    TimerTime_t delay = lrw_dutycycle_deadline > now ? lrw_dutycycle_deadline - now : 0;
+
+#ifdef REGION_EU868
+    LoRaMacNvmData_t *state = lrw_get_state();
+    if (state->MacGroup2.Region != LORAMAC_REGION_EU868) return delay;
+    if (!state->MacGroup2.DutyCycleOn) return delay;
+
+    MibRequestConfirm_t ch = { .Type = MIB_CHANNELS };
+    MibRequestConfirm_t mask = { .Type = MIB_CHANNELS_MASK };
+    MibRequestConfirm_t dr = { .Type = MIB_CHANNELS_DATARATE };
+    if (LoRaMacMibGetRequestConfirm(&ch) != LORAMAC_STATUS_OK) return delay;
+    if (LoRaMacMibGetRequestConfirm(&mask) != LORAMAC_STATUS_OK) return delay;
+    if (LoRaMacMibGetRequestConfirm(&dr) != LORAMAC_STATUS_OK) return delay;
+
+    // LoRaMac picks a random channel among those whose band is available, so
+    // the earliest transmission time is determined by the enabled channel
+    // (usable with the current data rate) whose band frees up first.
+    TimerTime_t best = UINT32_MAX;
+    for (unsigned i = 0; i < EU868_MAX_NB_CHANNELS; i++) {
+        ChannelParams_t *c = ch.Param.ChannelList + i;
+        if (c->Frequency == 0) continue;
+        if (!(mask.Param.ChannelsMask[i / 16] & (1 << (i % 16)))) continue;
+        if (dr.Param.ChannelsDatarate < c->DrRange.Fields.Min) continue;
+        if (dr.Param.ChannelsDatarate > c->DrRange.Fields.Max) continue;
+        if (c->Band >= EU868_MAX_NB_BANDS) continue;
+
+        TimerTime_t t = band_deadline[c->Band] > now ? band_deadline[c->Band] - now : 0;
+        if (t < best) best = t;
+    }
+
+    if (best != UINT32_MAX && best > delay) delay = best;
+#endif
+    return delay;
+}
+
+
 LoRaMacNvmData_t *lrw_get_state(void)
 {
     MibRequestConfirm_t r = { .Type = MIB_NVM_CTXS };
@@ -1005,27 +4889,40 @@ int lrw_join(uint8_t datarate, uint8_t tries)
             return LORAMAC_STATUS_PARAMETER_INVALID;
 
         join_datarate = datarate;
+        join_sched.sent = 0;
+        join_sched.widened = false;
+        join_sched.start = TimerGetCurrentTime();
 
 #if RESTORE_CHMASK_AFTER_JOIN == 1
         save_chmask();
 #endif
-        LoRaMacStatus_t rc = send_join();
+        join_sched.band = -1;
+        if (join_sched.subband == LRW_JOIN_SUBBAND_LEARN && has_subbands())
+            start_join_subbands();
+
+        // With jitter configured, the first Join request is sent from the
+        // timer so that devices powered on together do not transmit at once
+        if (join_sched.jitter) {
+            joins_left = tries;
+            TimerSetValue(&join_retry_timer, randr(1, join_sched.jitter));
+            TimerStart(&join_retry_timer);
+            return LORAMAC_STATUS_OK;
+        }
+
+        LoRaMacStatus_t rc = send_join(NULL);
         if (rc == LORAMAC_STATUS_OK) joins_left = tries;
         return rc;
     }
 }
 
 
-int lrw_set_region(unsigned int region)
+// Deactivate LoRaMac and reset most of its state in NVM to the defaults of the
+// given region, preserving DevEUI and DevNonce. The defaults are applied on the
+// next boot.
+static int reset_state(LoRaMacRegion_t region)
 {
-    if (!RegionIsActive(region))
-        return LORAMAC_STATUS_REGION_NOT_SUPPORTED;
-
     LoRaMacNvmData_t *state = lrw_get_state();
 
-    // Region did not change, nothing to do
-    if (region == state->MacGroup2.Region) return -1;
-
     // The following function deactivates the MAC, the radio, and initializes
     // the MAC parameters to defaults.
     int rv = LoRaMacDeInitialization();
@@ -1087,6 +4984,124 @@ int lrw_set_region(unsigned int region)
 }
 
 
+int lrw_set_region(unsigned int region)
+{
+#ifdef FIXED_REGION
+    // Single-region firmware, see FIXED_REGION in the Makefile
+    if (region != FIXED_REGION)
+#else
+    if (!RegionIsActive(region))
+#endif
+        return LORAMAC_STATUS_REGION_NOT_SUPPORTED;
+
+    LoRaMacNvmData_t *state = lrw_get_state();
+
+    // Region did not change, nothing to do
+    if (region == state->MacGroup2.Region) return -1;
+
+    // Keep the session of the region being left so that switching back to it
+    // does not require a new Join
+    save_region_session();
+
+    // The data rates of the new region have different timing
+    lrw_rx_timing_reset();
+
+    return reset_state(region);
+}
+
+
+// A network profile saved in the store. The LoRaMac groups keep their own
+// checksums and are restored on boot like the groups in the EEPROM.
+typedef struct {
+    LoRaMacNvmData_t state;
+    uint32_t crc32;
+} profile_t;
+
+static_assert(offsetof(profile_t, crc32) + sizeof(uint32_t) == sizeof(profile_t), "Unsupported profile_t layout");
+
+
+static const profile_t *open_profiles(part_t *part)
+{
+    const profile_t *p;
+    size_t size;
+
+    if (store_open(part, "profiles", LRW_PROFILES * sizeof(profile_t)) != 0) return NULL;
+
+    p = part_mmap(&size, part);
+    if (p == NULL || size < LRW_PROFILES * sizeof(profile_t)) return NULL;
+    return p;
+}
+
+
+int lrw_set_profile(unsigned int profile)
+{
+    LoRaMacNvmData_t *state = lrw_get_state();
+    const profile_t *slots;
+    part_t part;
+    uint32_t crc, address;
+    uint16_t nonce;
+    int rv;
+
+    if (profile >= LRW_PROFILES) return LORAMAC_STATUS_PARAMETER_INVALID;
+    if (profile == sysconf.profile) return -1;
+    if (LoRaMacIsBusy()) return LORAMAC_STATUS_BUSY;
+
+    slots = open_profiles(&part);
+    if (slots == NULL) return LORAMAC_STATUS_NVM_DATA_INCONSISTENT;
+
+    // Save the state of the active profile, including the uplink frame counter
+    // not written to the EEPROM yet
+    if (sysconf.profile < LRW_PROFILES) {
+        address = sysconf.profile * sizeof(profile_t);
+        crc = Crc32((uint8_t *)state, sizeof(*state));
+        if (!part_write(&part, address, state, sizeof(*state)) ||
+            !part_write(&part, address + offsetof(profile_t, crc32), &crc, sizeof(crc))) {
+            log_error("LoRaMac: Error while saving network profile %d", sysconf.profile);
+            return LORAMAC_STATUS_NVM_DATA_INCONSISTENT;
+        }
+    }
+
+    if (check_block_crc(&slots[profile], sizeof(profile_t))) {
+        rv = LoRaMacDeInitialization();
+        if (rv != LORAMAC_STATUS_OK) return rv;
+
+        // Both profiles may use the same JoinEUI and DevEUI, so DevNonce must
+        // never go back
+        nonce = state->Crypto.DevNonce;
+        memcpy(state, &slots[profile].state, sizeof(*state));
+        if (state->Crypto.DevNonce < nonce) {
+            state->Crypto.DevNonce = nonce;
+            update_block_crc(&state->Crypto, sizeof(state->Crypto));
+        }
+
+        state_changed(
+            LORAMAC_NVM_NOTIFY_FLAG_CRYPTO         |
+            LORAMAC_NVM_NOTIFY_FLAG_SECURE_ELEMENT |
+            LORAMAC_NVM_NOTIFY_FLAG_MAC_GROUP1     |
+            LORAMAC_NVM_NOTIFY_FLAG_MAC_GROUP2     |
+            LORAMAC_NVM_NOTIFY_FLAG_REGION_GROUP1  |
+            LORAMAC_NVM_NOTIFY_FLAG_REGION_GROUP2  |
+            LORAMAC_NVM_NOTIFY_FLAG_CLASS_B);
+    } else {
+        // A profile used for the first time starts from the defaults of the
+        // current region
+        rv = reset_state(state->MacGroup2.Region);
+        if (rv != LORAMAC_STATUS_OK) return rv;
+    }
+
+    log_debug("LoRaMac: Switched from network profile %d to %d", sysconf.profile, profile);
+    sysconf.profile = profile;
+    sysconf_modified = true;
+    return LORAMAC_STATUS_OK;
+}
+
+
+unsigned int lrw_get_profile(void)
+{
+    return sysconf.profile;
+}
+
+
 unsigned int lrw_get_mode(void)
 {
     MibRequestConfirm_t r = { .Type = MIB_NETWORK_ACTIVATION };
@@ -1161,10 +5176,36 @@ void lrw_set_devnonce(uint16_t nonce)
     LoRaMacNvmData_t *state = lrw_get_state();
     state->Crypto.DevNonce = nonce;
     state->Crypto.Crc32 = Crc32((uint8_t *)&state->Crypto, sizeof(state->Crypto) - 4);
+
+    // Write the new value even if it falls into the reserved block
+    reserved_devnonce = 0;
     state_changed(LORAMAC_NVM_NOTIFY_FLAG_CRYPTO);
 }
 
 
+int lrw_rejoin(unsigned int type)
+{
+    static const Mlme_t types[] = { MLME_REJOIN_0, MLME_REJOIN_1, MLME_REJOIN_2 };
+    MibRequestConfirm_t r = { .Type = MIB_NETWORK_ACTIVATION };
+
+    if (type >= ARRAY_LEN(types)) return LORAMAC_STATUS_PARAMETER_INVALID;
+    if (joins_left != 0) return LORAMAC_STATUS_BUSY;
+
+    LoRaMacMibGetRequestConfirm(&r);
+    if (r.Param.NetworkActivation != ACTIVATION_TYPE_OTAA)
+        return LORAMAC_STATUS_NO_NETWORK_JOINED;
+
+    // Rejoin-requests do not exist in LoRaWAN 1.0
+    r.Type = MIB_LORAWAN_VERSION;
+    LoRaMacMibGetRequestConfirm(&r);
+    if (r.Param.LrWanVersion.LoRaWan.Fields.Minor == 0)
+        return LORAMAC_STATUS_SERVICE_UNKNOWN;
+
+    MlmeReq_t mlme = { .Type = types[type] };
+    return lrw_mlme_request(&mlme);
+}
+
+
 int lrw_check_link(bool piggyback)
 {
     LoRaMacStatus_t rc;
@@ -1210,6 +5251,10 @@ DeviceClass_t lrw_get_class(void)
 
 int lrw_set_class(DeviceClass_t device_class)
 {
+    // The configured class replaces a class C window
+    TimerStop(&class_c_timer);
+    class_c.open = false;
+
     sysconf.device_class = device_class;
     sysconf_modified = true;
     return sync_device_class();
@@ -1237,6 +5282,151 @@ int lrw_get_max_channels(void)
 }
 
 
+// Set the default mask first since the current mask must be a subset of it in
+// some regions
+static LoRaMacStatus_t set_channel_masks(uint16_t *current, uint16_t *defaults)
+{
+    LoRaMacStatus_t rc;
+    MibRequestConfirm_t r = {
+        .Type  = MIB_CHANNELS_DEFAULT_MASK,
+        .Param = { .ChannelsDefaultMask = defaults }
+    };
+
+    rc = LoRaMacMibSetRequestConfirm(&r);
+    if (rc != LORAMAC_STATUS_OK) return rc;
+
+    r.Type = MIB_CHANNELS_MASK;
+    r.Param.ChannelsMask = current;
+    return LoRaMacMibSetRequestConfirm(&r);
+}
+
+
+LoRaMacStatus_t lrw_set_chplan(const lrw_channel_t *channels, unsigned int count,
+    const uint16_t *mask)
+{
+    ChannelParams_t backup[LRW_CHPLAN_MAX];
+    uint16_t current[REGION_NVM_CHANNELS_MASK_SIZE];
+    uint16_t defaults[REGION_NVM_CHANNELS_MASK_SIZE];
+    uint16_t new_mask[REGION_NVM_CHANNELS_MASK_SIZE];
+    ChannelParams_t *list, params;
+    LoRaMacStatus_t rc = LORAMAC_STATUS_OK;
+    MibRequestConfirm_t r;
+    unsigned int i, max = lrw_get_max_channels();
+
+    if (count > LRW_CHPLAN_MAX) return LORAMAC_STATUS_PARAMETER_INVALID;
+    for (i = 0; i < count; i++)
+        if (channels[i].index >= max) return LORAMAC_STATUS_PARAMETER_INVALID;
+    if (LoRaMacIsBusy()) return LORAMAC_STATUS_BUSY;
+
+    r.Type = MIB_CHANNELS;
+    LoRaMacMibGetRequestConfirm(&r);
+    list = r.Param.ChannelList;
+
+    r.Type = MIB_CHANNELS_MASK;
+    LoRaMacMibGetRequestConfirm(&r);
+    memcpy(current, r.Param.ChannelsMask, sizeof(current));
+
+    r.Type = MIB_CHANNELS_DEFAULT_MASK;
+    LoRaMacMibGetRequestConfirm(&r);
+    memcpy(defaults, r.Param.ChannelsDefaultMask, sizeof(defaults));
+
+    for (i = 0; i < count && rc == LORAMAC_STATUS_OK; i++) {
+        backup[i] = list[channels[i].index];
+        if (channels[i].frequency != 0) {
+            memset(&params, 0, sizeof(params));
+            params.Frequency = channels[i].frequency;
+            params.DrRange.Fields.Min = channels[i].dr_min;
+            params.DrRange.Fields.Max = channels[i].dr_max;
+            rc = LoRaMacChannelAdd(channels[i].index, params);
+        } else {
+            rc = LoRaMacChannelRemove(channels[i].index);
+        }
+    }
+
+    if (rc == LORAMAC_STATUS_OK && mask != NULL) {
+        // The MIB takes non-const pointers
+        memcpy(new_mask, mask, sizeof(new_mask));
+        rc = set_channel_masks(new_mask, new_mask);
+    }
+
+    if (rc != LORAMAC_STATUS_OK) {
+        log_debug("Channel plan rejected: %d, restoring %u channel(s)", rc, i);
+        // In reverse order, so that a channel listed twice gets its original
+        // parameters back
+        while (i--) list[channels[i].index] = backup[i];
+        set_channel_masks(current, defaults);
+    }
+    return rc;
+}
+
+
+// The maximum application payload size without FOpts of each data rate,
+// computed for the region and the uplink dwell time setting recorded with it
+static struct {
+    bool valid;
+    LoRaMacRegion_t region;
+    uint8_t dwell;
+    uint8_t max[16];
+} msize_cache;
+
+
+static uint8_t max_payload_without_fopts(int8_t dr)
+{
+    LoRaMacNvmData_t *state = lrw_get_state();
+    uint8_t dwell = state->MacGroup2.MacParams.UplinkDwellTime;
+    GetPhyParams_t req = { .UplinkDwellTime = dwell };
+    PhyParam_t phy;
+    int i;
+
+    if (!msize_cache.valid || msize_cache.region != state->MacGroup2.Region ||
+        msize_cache.dwell != dwell) {
+        req.Attribute = PHY_MAX_TX_DR;
+        phy = RegionGetPhyParam(state->MacGroup2.Region, &req);
+
+        req.Attribute = PHY_MAX_PAYLOAD;
+        for (i = 0; i < (int)ARRAY_LEN(msize_cache.max); i++) {
+            req.Datarate = i;
+            msize_cache.max[i] = i <= (int)phy.Value ? RegionGetPhyParam(state->MacGroup2.Region, &req).Value : 0;
+        }
+
+        msize_cache.region = state->MacGroup2.Region;
+        msize_cache.dwell = dwell;
+        msize_cache.valid = true;
+    }
+
+    return dr >= 0 && dr < (int)ARRAY_LEN(msize_cache.max) ? msize_cache.max[dr] : 0;
+}
+
+
+uint8_t lrw_get_msize(void)
+{
+    LoRaMacNvmData_t *state = lrw_get_state();
+    LoRaMacTxInfo_t txi = { 0 };
+    size_t fopts;
+    uint8_t max;
+
+    // With ADR, LoRaMac steps the data rate down on its own once the ADR
+    // acknowledgement counter runs past the limit. Leave that case to
+    // LoRaMacQueryTxPossible, which predicts the data rate of the next uplink.
+    if (state->MacGroup2.AdrCtrlOn) {
+        GetPhyParams_t req = { .Attribute = PHY_DEF_ADR_ACK_LIMIT };
+        PhyParam_t phy = RegionGetPhyParam(state->MacGroup2.Region, &req);
+        if (state->MacGroup1.AdrAckCounter >= phy.Value) {
+            LoRaMacQueryTxPossible(0, &txi);
+            return txi.MaxPossibleApplicationDataSize;
+        }
+    }
+
+    // Pending MAC commands travel in FOpts if they fit, as in
+    // LoRaMacQueryTxPossible
+    if (LoRaMacCommandsGetSizeSerializedCmds(&fopts) != LORAMAC_COMMANDS_SUCCESS) return 0;
+    if (fopts > LORA_MAC_COMMAND_MAX_FOPTS_LENGTH) return 0;
+
+    max = max_payload_without_fopts(state->MacGroup2.MacParams.ChannelsDatarate);
+    return max >= fopts ? max - fopts : 0;
+}
+
+
 static void update_duty_cycle_deadline(LoRaMacStatus_t rc, TimerTime_t time)
 {
     switch(rc) {
@@ -1269,11 +5459,28 @@ static void update_duty_cycle_deadline(LoRaMacStatus_t rc, TimerTime_t time)
 }
 
 
+// Tell the radio when the receive windows of the next transmission open so
+// that it can decide whether to sleep or to wait in standby in between
+static void announce_rx_delays(bool join)
+{
+    const LoRaMacParams_t *p = &lrw_get_state()->MacGroup2.MacParams;
+
+    if (join) radio_set_rx_delays(p->JoinAcceptDelay1, p->JoinAcceptDelay2);
+    else radio_set_rx_delays(p->ReceiveDelay1, p->ReceiveDelay2);
+}
+
+
 // This function is a simple wrapper over LoRaMacMlmeRequest that keeps track of
 // the duty cycle wait time returned by the function for the benefit of AT+BACKOFF
 LoRaMacStatus_t lrw_mlme_request(MlmeReq_t* req)
 {
-    LoRaMacStatus_t rc = LoRaMacMlmeRequest(req);
+    LoRaMacStatus_t rc;
+
+    // Let the TCXO start while LoRaMac prepares the frame
+    sx1276_tcxo_prepare();
+    announce_rx_delays(req->Type == MLME_JOIN);
+
+    rc = LoRaMacMlmeRequest(req);
     update_duty_cycle_deadline(rc, req->ReqReturn.DutyCycleWaitTime);
     return rc;
 }
@@ -1282,18 +5489,54 @@ LoRaMacStatus_t lrw_mlme_request(MlmeReq_t* req)
 LoRaMacStatus_t lrw_mcps_request(McpsReq_t* req, int transmissions)
 {
     LoRaMacStatus_t rc;
+    uint16_t chmask[REGION_NVM_CHANNELS_MASK_SIZE];
+    bool masked;
     MibRequestConfirm_t r = {
         .Type = MIB_CHANNELS_NB_TRANS,
         .Param = { .ChannelsNbTrans = transmissions }
     };
-    rc = LoRaMacMibSetRequestConfirm(&r);
-    if (rc != LORAMAC_STATUS_OK) {
-        log_debug("Could not configure retransmissions: %d", rc);
-        return rc;
+
+    rc = check_resume_deadline();
+    if (rc != LORAMAC_STATUS_OK) return rc;
+
+    rc = check_airtime_budget();
+    if (rc != LORAMAC_STATUS_OK) return rc;
+
+    rc = check_battery_policy();
+    if (rc != LORAMAC_STATUS_OK) return rc;
+
+    // Only go through the MIB if the value differs from the one LoRaMac uses,
+    // which the network may also have changed with a LinkADRReq
+    if (lrw_get_state()->MacGroup2.MacParams.ChannelsNbTrans != transmissions) {
+        rc = LoRaMacMibSetRequestConfirm(&r);
+        if (rc != LORAMAC_STATUS_OK) {
+            log_debug("Could not configure retransmissions: %d", rc);
+            return rc;
+        }
     }
 
+    attach_mac_requests();
+
+    // Let the TCXO start while LoRaMac builds and encrypts the frame
+    sx1276_tcxo_prepare();
+    announce_rx_delays(false);
+
+    // LoRaMac selects the channel of the first transmission within
+    // LoRaMacMcpsRequest. Retransmissions, and any changes the network makes
+    // to the channel mask later, use the original mask.
+    masked = deprioritise_channels(chmask);
     rc = LoRaMacMcpsRequest(req);
+    if (masked) {
+        r.Type = MIB_CHANNELS_MASK;
+        r.Param.ChannelsMask = chmask;
+        LoRaMacMibSetRequestConfirm(&r);
+    }
+
     update_duty_cycle_deadline(rc, req->ReqReturn.DutyCycleWaitTime);
+    if (rc == LORAMAC_STATUS_OK && batpol.state == LRW_BATTERY_LOW) {
+        batpol.sent = true;
+        batpol.last = TimerGetCurrentTime();
+    }
     return rc;
 }
 
@@ -1316,6 +5559,20 @@ void lrw_factory_reset(bool reset_devnonce, bool reset_deveui)
         // we have to, depending on the flags.
         nvm_init();
 
+        // The journal has been erased together with the rest of the NVM. Stop
+        // using it so that the crypto state written below is the one that gets
+        // restored after reboot. Any group not committed yet is gone too.
+        memset(&nvm_journal, 0, sizeof(nvm_journal));
+        uncommitted = NULL;
+
+        // Messages stored for the previous session are not sent
+        lrw_tx_store_clear();
+
+        // Saved network profiles contain keys
+        part_t profiles;
+        if (open_profiles(&profiles) != NULL && !part_erase(&profiles))
+            log_error("Error while erasing network profiles");
+
         // Unless the application explicitly asks for the DevNonce to be also
         // reset, we preserve the original value to make sure that OTAA Join
         // continues working from this device after the factory reset.
@@ -1334,7 +5591,7 @@ void lrw_factory_reset(bool reset_devnonce, bool reset_deveui)
 
             // Write the data structure initialized in the previous step into
             // the crypto part.
-            if (!part_write(&nvm_parts.crypto, 0, &c, sizeof(c)))
+            if (!part_shadow_write(&nvm_shadows.crypto, &c))
                 log_error("Error while saving DevNonce to NVM during factory reset");
         } else {
             log_debug("Resetting DevNonce");
@@ -1360,7 +5617,7 @@ void lrw_factory_reset(bool reset_devnonce, bool reset_deveui)
 
             // Write the data structure initialized in the previous step into
             // the secure element part.
-            if (!part_write(&nvm_parts.se, 0, &s, sizeof(s)))
+            if (!part_shadow_write(&nvm_shadows.se, &s))
                 log_error("Error while saving DevEUI to NVM during factory reset");
         } else {
             log_debug("Resetting DevEUI");
@@ -1388,25 +5645,35 @@ LoRaMacStatus_t lrw_get_device_time(bool piggyback)
     }
 
     if (!piggyback) {
-        MibRequestConfirm_t mbr = { .Type = MIB_CHANNELS_DATARATE };
-        LoRaMacMibGetRequestConfirm(&mbr);
-
         // Send an empty frame immediately to piggy-back the DeviceTimeReq MAC
         // command on.
-        McpsReq_t mcr;
-        memset(&mcr, 0, sizeof(mcr));
-        mcr.Type = MCPS_UNCONFIRMED;
-        // See the comments in lrw_send on why the following parameter is set to the
-        // value from MIB
-        mcr.Req.Unconfirmed.Datarate = mbr.Param.ChannelsDatarate;
-
-        // Disable retransmissions. DeviceTime requests are sent as unconfirmed
-        // uplinks with an empty payload. Retransmitting such requests would
-        // interfere with time synchronization.
-        rc = lrw_mcps_request(&mcr, 1);
+        rc = send_empty_frame();
         if (rc != LORAMAC_STATUS_OK)
             log_debug("Failed to transmit DeviceTimeReq uplink: %d", rc);
     }
 
     return rc;
 }
+
+
+void lrw_join_sched_set(uint32_t jitter, bool ladder, unsigned int subband)
+{
+    join_sched.jitter = jitter;
+    join_sched.ladder = ladder;
+    join_sched.subband = subband;
+}
+
+
+void lrw_join_sched_get(uint32_t *jitter, bool *ladder, unsigned int *subband)
+{
+    if (jitter) *jitter = join_sched.jitter;
+    if (ladder) *ladder = join_sched.ladder;
+    if (subband) *subband = join_sched.subband;
+}
+
+
+void lrw_join_stats(lrw_join_stats_t *stats, bool reset)
+{
+    *stats = join_sched.stats;
+    if (reset) memset(&join_sched.stats, 0, sizeof(join_sched.stats));
+}
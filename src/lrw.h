@@ -36,6 +36,32 @@ LoRaMacNvmData_t *lrw_get_state(void);
 void lrw_process(void);
 
 
+/** @brief Run only the time-critical part of lrw_process, i.e., LoRaMacProcess
+ *  and the reporting of its results. Invoked while the main context waits for
+ *  the host to make room in the LPUART TX FIFO. The queues and other
+ *  background work wait for the next lrw_process.
+ */
+void lrw_yield(void);
+
+
+/** @brief Per-message transmission options
+ *
+ * Passed to lrw_send and lrw_enqueue to override the global AT+REP and
+ * AT+RTYNUM settings for a single message.
+ */
+typedef struct {
+    // The number of transmissions (NbTrans) of an unconfirmed message or the
+    // maximum number of transmissions of a confirmed message, 1-15. Zero
+    // selects sysconf.unconfirmed_retransmissions or
+    // sysconf.confirmed_retransmissions.
+    uint8_t transmissions;
+
+    // Urgent messages are queued ahead of all non-urgent messages that have
+    // not been handed to the MAC yet
+    bool urgent;
+} lrw_tx_options_t;
+
+
 /** @brief Send an uplink message
  *
  * This function can be used to send a confirmed or unconfirmed uplink message
@@ -47,9 +73,189 @@ void lrw_process(void);
  * @param[in] buffer Pointer to source buffer
  * @param[in] length Number of bytes in the source buffer
  * @param[in] confirmed Send as confirmed uplink when true
+ * @param[in] options Per-message options, NULL for the defaults
  * @return Zero on success, a @c LoRaMacStatus_t value on error
  */
-int lrw_send(uint8_t port, void *buffer, uint8_t length, bool confirmed);
+int lrw_send(uint8_t port, void *buffer, uint8_t length, bool confirmed,
+    const lrw_tx_options_t *options);
+
+
+#define LRW_TX_QUEUE_MAX_PAYLOAD 242
+
+/** @brief Append an uplink message to the transmit queue
+ *
+ * The message is copied into the queue and transmitted with lrw_send as soon as
+ * the MAC is idle and the duty cycle deadline has passed. Queued messages are
+ * sent in order, except that urgent messages overtake non-urgent ones. When a message's transmission completes or fails, an uplink
+ * event carrying the message identifier returned by this function is sent to
+ * the host.
+ *
+ * @param[in] port LoRaWAN port number
+ * @param[in] buffer Pointer to source buffer
+ * @param[in] length Number of bytes in the source buffer
+ * @param[in] confirmed Send as confirmed uplink when true
+ * @param[in] options Per-message options kept with the message, NULL for the
+ * defaults
+ * @return Message identifier (0-255) on success, -1 if the queue is full
+ */
+int lrw_enqueue(uint8_t port, void *buffer, uint8_t length, bool confirmed,
+    const lrw_tx_options_t *options);
+
+
+/** @brief Return the number of messages in the transmit queue
+ *
+ * The count includes the message currently being transmitted, if any.
+ */
+unsigned int lrw_tx_queue_length(void);
+
+
+/** @brief Append an uplink message to the persistent uplink store
+ *
+ * The message is written into the flash-backed store and sent with lrw_send
+ * once the network is known to be reachable, at most one message every
+ * sysconf.tx_store_interval seconds. The message is removed from the store
+ * only after the network has confirmed its reception, so stored messages
+ * survive resets and network outages.
+ *
+ * @param[in] port LoRaWAN port number
+ * @param[in] buffer Pointer to source buffer
+ * @param[in] length Number of bytes in the source buffer
+ * @param[in] confirmed Send as confirmed uplink when true
+ * @return 0 on success, a negative value if the store is unavailable or full
+ */
+int lrw_store(uint8_t port, void *buffer, uint8_t length, bool confirmed);
+
+
+/** @brief Return the number of messages in the uplink store
+ *
+ * @param[out] online If not NULL, set to true if the network is believed to be
+ * reachable, i.e., if the stored messages are being sent
+ */
+unsigned int lrw_tx_store_length(bool *online);
+
+
+/** @brief Drop all messages from the uplink store */
+void lrw_tx_store_clear(void);
+
+
+#define LRW_RX_QUEUE_MAX_PAYLOAD 242
+
+/** @brief A received downlink message kept in the receive queue */
+typedef struct {
+    uint16_t seq;        // Mailbox sequence number, see cmd_mailbox_seq
+    uint32_t timestamp;  // Reception time in ms (RTC timer)
+    uint32_t frequency;  // Frequency in Hz
+    uint32_t fcnt;       // Downlink frame counter (FCntDown)
+    int16_t rssi;
+    int8_t snr;
+    uint8_t dr;
+    uint8_t multicast;
+    int8_t group;        // Multicast group ID or -1 for unicast downlinks
+    uint8_t port;
+    uint8_t length;
+    bool stored;         // Kept for the mailbox in the asynchronous mode, see lrw_route_t
+    uint8_t *payload;    // Block from the message pool, NULL if empty
+} lrw_downlink_t;
+
+
+/** @brief Return the oldest message in the receive queue
+ *
+ * Received downlink messages are queued and delivered to the host as +RECV
+ * messages whenever there is enough room in the UART output buffer. In the
+ * polling mode (AT$ASYNC=0), messages are not delivered automatically and the
+ * host retrieves them from the mailbox with AT$MBOXGET? (or AT$RECV?). If the queue overflows, new messages are
+ * dropped and the host is notified with a network event.
+ *
+ * @return Pointer to the message or NULL if the queue is empty
+ */
+const lrw_downlink_t *lrw_rx_queue_peek(void);
+
+
+/** @brief Remove the oldest message from the receive queue */
+void lrw_rx_queue_pop(void);
+
+
+/** @brief Return the number of messages in the receive queue */
+unsigned int lrw_rx_queue_length(void);
+
+
+/** @brief Maximum number of ports in the filter of a multicast group */
+#define LRW_MC_FILTER_PORTS 4
+
+
+/** @brief Configure the port filter of a multicast group
+ *
+ * Multicast downlinks for the group are only passed to the host if their port
+ * is in the filter. Other frames are dropped on the modem. An empty filter
+ * (count 0) accepts all ports. The filters are not persisted in NVM.
+ *
+ * @param[in] group Multicast group ID
+ * @param[in] ports Array of port numbers (1-223)
+ * @param[in] count Number of ports, at most LRW_MC_FILTER_PORTS
+ * @return 0 on success, -1 on invalid parameters
+ */
+int lrw_mc_filter_set(unsigned int group, const uint8_t *ports, unsigned int count);
+
+
+/** @brief Return the port filter of a multicast group
+ *
+ * @return Array of LRW_MC_FILTER_PORTS ports where unused entries are zero, or
+ * NULL if the group ID is invalid
+ */
+const uint8_t *lrw_mc_filter_get(unsigned int group);
+
+
+/** @brief Actions of the downlink routing table (AT$DLROUTE) */
+typedef enum {
+    LRW_ROUTE_FORWARD = 0,  // Write the downlink to the host with +RECV
+    LRW_ROUTE_STORE,        // Keep it in the receive queue for AT$RECV? or AT$MBOXGET?
+    LRW_ROUTE_DROP,         // Discard it on the modem
+    LRW_ROUTE_APPLY,        // Write it into the user NVM registers (offset, data)
+    LRW_ROUTE_ACTIONS
+} lrw_route_t;
+
+
+/** @brief Set the routing action of downlinks received on a port
+ *
+ * The table is kept in sysconf. Setting LRW_ROUTE_FORWARD removes the entry of
+ * the port. Downlinks handled on the modem, e.g., clock synchronization, are
+ * not routed.
+ *
+ * @param[in] port Port number (1-223)
+ * @param[in] action The action
+ * @return 0 on success, -1 on invalid parameters or if the table is full
+ */
+int lrw_dl_route_set(unsigned int port, lrw_route_t action);
+
+
+/** @brief Return the start of the device's uplink slot (in seconds) within
+ *  sysconf.slot_period, either configured or derived from the DevAddr
+ */
+unsigned int lrw_uplink_slot(void);
+
+
+/** @brief Configure the batching of multicast downlinks
+ *
+ * @param[in] interval Maximum time (ms) multicast downlinks are held back to
+ * be delivered to the host together. 0 delivers each frame right away.
+ */
+void lrw_mc_batch_set(uint32_t interval);
+
+
+/** @brief Return the multicast batching interval in milliseconds */
+uint32_t lrw_mc_batch_get(void);
+
+
+/** @brief Predict how long it takes until the next uplink can be transmitted
+ *
+ * Combines the duty cycle wait time last reported by LoRaMac with a per-band
+ * view of duty cycle availability (EU868 only) maintained by this module. The
+ * prediction considers all enabled channels usable with the current data rate
+ * and returns the wait time of the one whose band becomes available first.
+ *
+ * @return Predicted delay in milliseconds
+ */
+TimerTime_t lrw_predict_tx_delay(void);
 
 
 /** @brief Activate the node according to the mode selected with AT+MODE
@@ -67,6 +273,24 @@ int lrw_send(uint8_t port, void *buffer, uint8_t length, bool confirmed);
 int lrw_join(uint8_t datarate, uint8_t tries);
 
 
+/** @brief Send a LoRaWAN 1.1 Rejoin-request
+ *
+ * A Rejoin-request refreshes the session of a device activated with OTAA
+ * without a full Join: type 0 and type 2 are sent with the current session
+ * (type 2 only rekeys it), type 1 can restore a lost session and uses the
+ * JoinEUI. The current session remains in use until the network answers with
+ * a Join-accept. The result is reported with +EVENT=1,2 (no answer) or
+ * +EVENT=1,3 (accepted).
+ *
+ * Rejoin-requests triggered by the network with RejoinParamSetupReq and
+ * ForceRejoinReq are scheduled and sent by LoRaMac itself.
+ *
+ * @param[in] type Rejoin-request type (0-2)
+ * @return Zero on success, a @c LoRaMacStatus_t value on error
+ */
+int lrw_rejoin(unsigned int type);
+
+
 /** @brief Perform a LoRaWAN link check
  *
  * This function sends a LoRaWAN @c LinkCheckReq message to the network server.
@@ -84,6 +308,26 @@ int lrw_join(uint8_t datarate, uint8_t tries);
 int lrw_check_link(bool piggyback);
 
 
+/** @brief MAC requests that can be deferred with lrw_defer_mac_request */
+#define LRW_MAC_LINK_CHECK  (1 << 0)  // LinkCheckReq
+#define LRW_MAC_DEVICE_TIME (1 << 1)  // DeviceTimeReq
+
+
+/** @brief Send MAC requests with the next uplink
+ *
+ * The requests are queued in the modem and handed to LoRaMac right before the
+ * next uplink, whichever part of the firmware sends it, so that they travel in
+ * the uplink's FOpts instead of a frame of their own. If no uplink has carried
+ * them by the deadline, they are sent with an empty payload to port 0. The
+ * answers are reported as with lrw_check_link and lrw_get_device_time.
+ *
+ * @param[in] requests A combination of the LRW_MAC_* flags
+ * @param[in] deadline Seconds to wait for an uplink, 0 to wait indefinitely
+ * @return Zero on success, a @c LoRaMacStatus_t value on error
+ */
+int lrw_defer_mac_request(unsigned int requests, uint32_t deadline);
+
+
 /** @brief Reconfigure LoRaMac for the given region
  *
  * This function reconfigures the LoRaMac library for the specified region. The
@@ -96,12 +340,41 @@ int lrw_check_link(bool piggyback);
  * reactivate the stack upon invoking this function. System reboot is also
  * recommended.
  *
+ * The session of the region being left (session keys, DevAddr, frame counters,
+ * and channel plan) is kept in a small cache in NVM. If the device switches
+ * back to a cached region, lrw_init restores the session without a new Join.
+ *
  * @param[in] region LoRaWAN region identifier
  * @return 0 on success, -1 if the region is already active, a @c LoRaMacState_t
  * value on error
  */
 int lrw_set_region(unsigned int region);
 
+//! @brief The number of LoRaWAN network profiles
+#ifndef LRW_PROFILES
+#define LRW_PROFILES 3
+#endif
+
+/** @brief Switch to another LoRaWAN network profile
+ *
+ * Each profile holds a complete copy of the LoRaMac state (keys, EUIs,
+ * session, and MAC and regional parameters). The state of the active profile
+ * is saved into the store in flash memory and the state of the selected
+ * profile is written to NVM, to be restored after reboot. A profile that has
+ * not been used before starts from the defaults of the current region, with
+ * DevEUI preserved. Like lrw_set_region, this function shuts down LoRaMac and
+ * a system reboot is required.
+ *
+ * @param[in] profile Profile number, 0 to LRW_PROFILES - 1
+ * @return 0 on success, -1 if the profile is already active, a @c
+ * LoRaMacStatus_t value on error
+ */
+int lrw_set_profile(unsigned int profile);
+
+//! @brief Return the number of the active network profile
+
+unsigned int lrw_get_profile(void);
+
 
 /** @brief Return currently selected LoRaWAN activation mode (ABP or OTAA)
  * @retval 0 Activation by provisioning (ABP) mode is selected
@@ -140,6 +413,30 @@ DeviceClass_t lrw_get_class(void);
 int lrw_set_class(DeviceClass_t device_class);
 
 
+/** @brief Events that open a class C window, see sysconf.class_c_policy */
+#define LRW_CLASS_C_UPLINK   (1 << 0)  // The end of each uplink
+#define LRW_CLASS_C_PENDING  (1 << 1)  // A downlink with the FPending bit set
+#define LRW_CLASS_C_SCHEDULE (1 << 2)  // The start of each class_c_period of GPS time
+
+
+/** @brief Apply changed class C window settings
+ *
+ * A device configured for class A switches to class C for class_c_window
+ * seconds on the events selected in sysconf.class_c_policy and returns to
+ * class A once the window ends. Each event within a window, as well as each
+ * downlink received within it, extends the window. The function re-arms the
+ * schedule and closes a window that is open.
+ */
+void lrw_class_c_reschedule(void);
+
+
+/** @brief Return the state of class C windows
+ * @param[out] windows The number of windows opened since boot
+ * @return True if a class C window is open
+ */
+bool lrw_get_class_c_window(uint32_t *windows);
+
+
 /** @brief Configure the maximum effective isotropic radiated power (EIRP)
  * @param[in] maxeirp Maximum EIRP to be used by the transmitter
  */
@@ -166,6 +463,47 @@ void lrw_set_devnonce(uint16_t nonce);
 int lrw_get_max_channels(void);
 
 
+//! @brief The largest number of channels lrw_set_chplan takes at once
+#define LRW_CHPLAN_MAX 16
+
+typedef struct {
+    uint8_t index;
+    uint32_t frequency;  // Hz, 0 removes the channel
+    uint8_t dr_min;
+    uint8_t dr_max;
+} lrw_channel_t;
+
+/** @brief Load a complete channel plan in one step
+ *
+ * Adds, replaces, or removes the given channels in order and then sets both
+ * the current and the default channel mask to @p mask, unless it is NULL. The
+ * plan is applied as a whole: if any of the changes fails, the channels and
+ * the masks are restored to their previous state. LoRaMac notices the changes
+ * on the next LoRaMacProcess, so the plan costs a single NVM update however
+ * many channels it has.
+ *
+ * @param[in] channels Channels to configure
+ * @param[in] count Number of channels, at most LRW_CHPLAN_MAX
+ * @param[in] mask Channel mask (REGION_NVM_CHANNELS_MASK_SIZE words), or NULL
+ * @return LORAMAC_STATUS_OK or the status of the first change that failed
+ */
+LoRaMacStatus_t lrw_set_chplan(const lrw_channel_t *channels, unsigned int count,
+    const uint16_t *mask);
+
+
+/** @brief Return the largest application payload the next uplink can carry
+ *
+ * The same as LoRaMacQueryTxPossible, but the maximum payload of each data
+ * rate is cached for the region and the uplink dwell time setting. Only the
+ * data rate and the size of the pending MAC commands are examined on each
+ * call. If ADR is about to step the data rate down, LoRaMacQueryTxPossible is
+ * used.
+ *
+ * @return Payload size in bytes, 0 if pending MAC commands leave no room
+ */
+uint8_t lrw_get_msize(void);
+
+
 LoRaMacStatus_t lrw_mlme_request(MlmeReq_t* req);
 
 // A simple wrapper over LoRaMacMcpsRequest that properly configures uplink
@@ -176,6 +514,14 @@ LoRaMacStatus_t lrw_mcps_request(McpsReq_t* req, int transmissions);
 
 void lrw_factory_reset(bool reset_devnonce, bool reset_deveui);
 
+/** @brief Write all pending LoRaMac state changes to NVM
+ *
+ * Ignores the write-behind window configured with AT$NVMPOLICY and blocks
+ * until everything has been written. Changes that cannot be saved because the
+ * MAC is busy are left pending.
+ */
+void lrw_flush_state(void);
+
 
 /** @brief Get LoRaWAN network time via the DeviceTimeReq MAC command
  *
@@ -189,4 +535,380 @@ void lrw_factory_reset(bool reset_devnonce, bool reset_deveui);
  */
 LoRaMacStatus_t lrw_get_device_time(bool piggyback);
 
+
+/** @brief Configure the battery level reported in DevStatusAns
+ *
+ * The battery voltage is measured after each transmission and mapped linearly
+ * to levels 1-254 between the two voltages. With @p empty set to zero, the
+ * measurement is disabled and the level 254 is reported. The configuration is
+ * not stored in NVM.
+ *
+ * @param[in] empty Voltage of an empty battery in mV or 0
+ * @param[in] full Voltage of a full battery in mV
+ * @return Zero on success, -1 if @p full is not greater than @p empty
+ */
+int lrw_battery_set(uint16_t empty, uint16_t full);
+
+
+/** @brief Return the battery configuration and the cached measurement
+ *
+ * @param[out] empty Voltage of an empty battery in mV. Can be NULL.
+ * @param[out] full Voltage of a full battery in mV. Can be NULL.
+ * @param[out] voltage Filtered battery voltage in mV, zero if not measured yet.
+ * Can be NULL.
+ * @return Battery level as reported in DevStatusAns
+ */
+uint8_t lrw_battery_get(uint16_t *empty, uint16_t *full, uint16_t *voltage);
+
+
+/** @brief Measure the battery voltage now and update the cached value
+ */
+void lrw_battery_measure(void);
+
+
+enum lrw_battery_state {
+    LRW_BATTERY_NORMAL   = 0,
+    LRW_BATTERY_LOW      = 1,
+    LRW_BATTERY_CRITICAL = 2
+};
+
+
+/** @brief Configure the battery policy
+ *
+ * The policy acts on the battery voltage measured after each transmission,
+ * see lrw_battery_set, which must be configured for the policy to apply.
+ * Below @p low, uplinks are spaced at least @p interval seconds apart, sent one
+ * data rate higher if ADR is off and with lower TX power, and LoRaMac state
+ * writes to NVM are batched. Below @p critical, uplinks are refused with
+ * LORAMAC_STATUS_DUTYCYCLE_RESTRICTED. Each state change is reported with
+ * +EVENT=13,state,voltage. The configuration is not stored in NVM.
+ *
+ * @param[in] low Low battery threshold in mV, 0 to disable
+ * @param[in] critical Critical battery threshold in mV, 0 to disable
+ * @param[in] interval Minimum time between uplinks in the low state in seconds
+ */
+void lrw_batpol_set(uint16_t low, uint16_t critical, uint16_t interval);
+
+
+/** @brief Return the battery policy configuration and its current state
+ *
+ * @param[out] low Low battery threshold in mV. Can be NULL.
+ * @param[out] critical Critical battery threshold in mV. Can be NULL.
+ * @param[out] interval Uplink spacing in the low state in seconds. Can be NULL.
+ * @return The current state, see enum lrw_battery_state
+ */
+unsigned int lrw_batpol_get(uint16_t *low, uint16_t *critical, uint16_t *interval);
+
+
+/** @brief Enable or disable temperature compensation of the RTC
+ *
+ * When enabled, the MCU temperature is sampled after each transmission and
+ * periodically, and the RTC smooth calibration is adjusted for the temperature
+ * drift of the crystal. The setting is not stored in NVM.
+ *
+ * @param[in] enabled Enable or disable the compensation
+ */
+void lrw_temp_comp_set(bool enabled);
+
+
+/** @brief Return the state of the RTC temperature compensation
+ *
+ * @param[out] temperature The most recent temperature sample in tenths of
+ * degrees Celsius. Can be NULL.
+ * @param[out] compensation Applied compensation in units of 2^-20 (0.954 ppm).
+ * Can be NULL.
+ * @return true if the compensation is enabled
+ */
+bool lrw_temp_comp_get(int16_t *temperature, int32_t *compensation);
+
+
+/** @brief Enable or disable client-side transmission power control
+ *
+ * While enabled and ADR is off, the TX power is lowered step by step as long
+ * as link check answers report a demodulation margin above the target, and
+ * raised after unanswered link checks and unacknowledged confirmed uplinks.
+ * The controller piggybacks its own link checks on uplinks and reports each
+ * power change with +EVENT=12. It is meant for devices at a fixed position.
+ * Disabling it restores the default TX power. The setting is not stored in
+ * NVM.
+ *
+ * @param[in] enabled Enable or disable the controller
+ * @param[in] target Target demodulation margin in dB
+ */
+void lrw_tpc_set(bool enabled, uint8_t target);
+
+
+/** @brief Return the power control configuration and the last margin
+ *
+ * @param[out] target Target demodulation margin in dB. Can be NULL.
+ * @param[out] margin The most recent margin in dB, -1 if unknown. Can be NULL.
+ * @return true if the power control is enabled
+ */
+bool lrw_tpc_get(uint8_t *target, int8_t *margin);
+
+
+/** @brief Enable or disable client-side data rate control
+ *
+ * While enabled and ADR is off, the data rate is raised step by step as long
+ * as link check answers report a demodulation margin above the target, and
+ * lowered after answers below the target, unanswered link checks, and
+ * unacknowledged confirmed uplinks. The data rate stays within the given
+ * bounds and the LoRa data rates of the region. The controller piggybacks its
+ * own link checks on uplinks and reports each change with +EVENT=2,7 (up) or
+ * +EVENT=2,8 (down). It is meant for private networks whose network server
+ * does not run ADR. The setting is not stored in NVM.
+ *
+ * @param[in] enabled Enable or disable the controller
+ * @param[in] target Target demodulation margin in dB
+ * @param[in] min_dr Lowest data rate to use
+ * @param[in] max_dr Highest data rate to use
+ */
+void lrw_cadr_set(bool enabled, uint8_t target, uint8_t min_dr, uint8_t max_dr);
+
+
+/** @brief Return the data rate control configuration and the last margin
+ *
+ * @param[out] target Target demodulation margin in dB. Can be NULL.
+ * @param[out] min_dr Lowest data rate. Can be NULL.
+ * @param[out] max_dr Highest data rate. Can be NULL.
+ * @param[out] margin The most recent margin in dB, -1 if unknown. Can be NULL.
+ * @return true if the data rate control is enabled
+ */
+bool lrw_cadr_get(uint8_t *target, uint8_t *min_dr, uint8_t *max_dr, int8_t *margin);
+
+
+/** @brief Configure the link supervisor
+ *
+ * The supervisor counts consecutive unacknowledged confirmed uplinks and
+ * unanswered link checks; any downlink resets the count. Each time the count
+ * reaches the limit, the data rate is stepped down by one (+EVENT=2,4,dr).
+ * At the lowest data rate, the supervisor sends a link check instead
+ * (+EVENT=2,5), and if that is not answered, it rejoins in OTAA mode
+ * (+EVENT=2,6). Failed rejoins are retried after one minute, with the delay
+ * doubling up to one day. The setting is not stored in NVM.
+ *
+ * @param[in] limit Consecutive failures that trigger a step, 0 disables the
+ * supervisor
+ */
+void lrw_linkwd_set(uint8_t limit);
+
+
+/** @brief Return the link supervisor configuration and state
+ *
+ * @param[out] failures Consecutive failures counted so far. Can be NULL.
+ * @param[out] backoff Delay before the next rejoin in ms, 0 if no rejoin has
+ * failed. Can be NULL.
+ * @return The configured limit, 0 if the supervisor is disabled
+ */
+uint8_t lrw_linkwd_get(uint8_t *failures, uint32_t *backoff);
+
+
+//! @brief The number of data rates and channels in lrw_stats_t
+#define LRW_STATS_DATARATES 16
+#define LRW_STATS_CHANNELS  72
+
+/** @brief Uplink and downlink statistics since boot or the last reset
+ *
+ * The counters are kept in RAM, which is retained in the Stop mode. Like in
+ * lrw_channel_stats_t, all transmissions of an uplink are attributed to the
+ * channel and data rate of its last transmission.
+ */
+typedef struct {
+    uint32_t uplinks;          // Uplinks that went on the air
+    uint32_t retransmissions;  // Transmissions of those uplinks beyond the first
+    uint32_t acks;             // Confirmed uplinks acknowledged by the network
+    uint32_t noacks;           // Confirmed uplinks not acknowledged
+    uint32_t downlinks;        // Downlinks received
+    uint32_t mac_only;         // Downlinks without application payload
+    uint32_t joins;            // Join requests sent
+    uint32_t airtime[LRW_STATS_DATARATES];        // Uplink time on air in ms
+    uint16_t transmissions[LRW_STATS_CHANNELS];   // Uplink transmissions
+} lrw_stats_t;
+
+
+//! @brief Return the uplink and downlink statistics
+
+const lrw_stats_t *lrw_stats(void);
+
+
+//! @brief Clear the uplink and downlink statistics
+
+void lrw_stats_reset(void);
+
+
+/** @brief Compute the time on air of an uplink
+ *
+ * @param[in] length Application payload length, a frame header without FOpts
+ * is added
+ * @param[in] dr Uplink data rate
+ * @param[out] ms Time on air in ms
+ * @return 0 on success, a @c LoRaMacStatus_t value on error
+ */
+int lrw_airtime(unsigned int length, unsigned int dr, uint32_t *ms);
+
+
+/** @brief Return the time on air of the uplinks sent in the last 24 hours
+ *
+ * Uplinks, including retransmissions and Join requests, are accounted in hourly
+ * buckets kept in RAM. If sysconf.airtime_cap is non-zero, lrw_mcps_request
+ * refuses uplinks with LORAMAC_STATUS_DUTYCYCLE_RESTRICTED once the total has
+ * reached the cap, and sets lrw_dutycycle_deadline to the time the oldest
+ * buckets expire. Queued uplinks are sent then.
+ *
+ * @return Time on air in ms
+ */
+uint32_t lrw_airtime_used(void);
+
+
+//! @brief Clear the airtime accounted in the last 24 hours
+
+void lrw_airtime_reset(void);
+
+
+#define LRW_PING_SLOT_PERIODICITY 1
+
+/** @brief Progress of the switch to LoRaWAN class B */
+typedef enum {
+    LRW_CLASS_B_OFF = 0,    // Class B not selected
+    LRW_CLASS_B_TIME,       // Obtaining the network time
+    LRW_CLASS_B_ACQUIRING,  // Searching for the beacon
+    LRW_CLASS_B_PING_SLOT,  // Announcing the ping slot periodicity
+    LRW_CLASS_B_ACTIVE      // Class B active, ping slots open
+} lrw_class_b_state_t;
+
+
+/** @brief Return the state of class B operation
+ *
+ * @param[out] locked Set to true if the most recent beacon was received. Can be
+ * NULL.
+ * @param[out] beacon The most recently received beacon. Can be NULL.
+ * @return Progress of the switch to class B
+ */
+lrw_class_b_state_t lrw_get_class_b_status(bool *locked, BeaconInfo_t *beacon);
+
+
+/** @brief Return the class B ping slot periodicity
+ *
+ * The device opens a ping slot every 2^periodicity seconds.
+ */
+unsigned int lrw_get_ping_slot_periodicity(void);
+
+
+/** @brief Configure the class B ping slot periodicity
+ *
+ * If class B is active or being activated, the new periodicity is sent to the
+ * network with the PingSlotInfoReq MAC command. The value is kept in sysconf.
+ *
+ * @param[in] periodicity Ping slot periodicity (0-7)
+ * @return Zero on success, -1 if the value is out of range
+ */
+int lrw_set_ping_slot_periodicity(unsigned int periodicity);
+
+
+/** @brief OTAA Join statistics */
+typedef struct {
+    uint32_t attempts;  // Join requests transmitted
+    uint32_t accepts;   // Join accepts received
+    uint32_t airtime;   // Total time on air of the Join requests in ms
+    uint32_t time;      // Time from lrw_join to the last Join accept in ms
+    int16_t rssi;       // RSSI of the last Join accept
+    int8_t snr;         // SNR of the last Join accept
+    uint8_t dr;         // Data rate of the last accepted Join request
+} lrw_join_stats_t;
+
+
+//! @brief Sub-band strategies of the OTAA Join scheduler in US915 and AU915
+#define LRW_JOIN_SUBBAND_OFF   0
+#define LRW_JOIN_SUBBAND_WIDEN 1
+#define LRW_JOIN_SUBBAND_LEARN 2
+
+/** @brief Configure the OTAA Join scheduler
+ *
+ * The configuration is not stored in NVM.
+ *
+ * @param[in] jitter Maximum random delay in ms before each Join request. If
+ * non-zero, lrw_join schedules the first request and returns. Spreads the Join
+ * requests of devices powered on together.
+ * @param[in] ladder If true, the data rate is stepped down by one towards the
+ * region's minimum after every two unanswered Join requests.
+ * @param[in] subband Sub-band strategy in US915 and AU915. With
+ * LRW_JOIN_SUBBAND_WIDEN, a channel mask limited by the application to a
+ * sub-band is widened to all channels after four unanswered Join requests.
+ * With LRW_JOIN_SUBBAND_LEARN, each Join request is limited to one sub-band
+ * (eight 125 kHz channels and one 500 kHz channel) and the sub-band changes
+ * after every unanswered request. The sub-band of an accepted Join request is
+ * saved in NVM and tried first by later Joins. In both cases, the original
+ * mask is restored if the Join fails.
+ */
+void lrw_join_sched_set(uint32_t jitter, bool ladder, unsigned int subband);
+
+
+/** @brief Return the OTAA Join scheduler configuration, see lrw_join_sched_set */
+void lrw_join_sched_get(uint32_t *jitter, bool *ladder, unsigned int *subband);
+
+
+/** @brief Return the OTAA Join statistics
+ *
+ * @param[in] reset If true, the statistics are cleared after they have been
+ * copied
+ */
+void lrw_join_stats(lrw_join_stats_t *stats, bool reset);
+
+
+/** @brief Per-channel uplink statistics
+ *
+ * Only the channel of the last transmission of each message is known, so all
+ * transmissions of a message are attributed to that channel. The counters are
+ * halved once a channel reaches 64 attempts so that they follow changing
+ * conditions.
+ */
+typedef struct {
+    uint16_t attempts;  // Confirmed uplinks last transmitted on the channel
+    uint16_t acks;      // Confirmed uplinks acknowledged by the network
+    int16_t noise;      // Smoothed noise floor in dBm from LBT and AT$SCAN, 0 if unknown
+    uint8_t benched;    // Uplinks for which the channel remains deprioritised
+} lrw_channel_stats_t;
+
+
+/** @brief Return the uplink statistics of the given channel */
+void lrw_channel_stats(unsigned int channel, lrw_channel_stats_t *stats);
+
+
+/** @brief Clear the uplink statistics of all channels */
+void lrw_channel_stats_reset(void);
+
+
+/** @brief Record a noise floor sample for the channel with the given frequency
+ *
+ * Invoked by the radio after a listen-before-talk check and by AT$SCAN. The
+ * sample is ignored if no channel uses the frequency.
+ */
+void lrw_channel_noise(uint32_t frequency, int16_t rssi);
+
+
+/** @brief Timing of the class A downlinks received at a data rate
+ *
+ * The offset is the start of the preamble relative to the moment the RX
+ * window was scheduled for, i.e., TxDone plus the receive delay. The mean and
+ * the mean deviation are smoothed over the recent downlinks.
+ */
+typedef struct {
+    uint16_t samples;  // Downlinks measured since the last reset
+    int16_t mean;      // Mean offset in ms
+    uint16_t dev;      // Mean deviation of the offset in ms
+    uint16_t error;    // The RX error (ms) the adaptive mode uses for the data rate, 0 if unknown
+} lrw_rx_timing_t;
+
+
+/** @brief Return the downlink timing measured at a data rate (0-15) */
+void lrw_rx_timing(unsigned int dr, lrw_rx_timing_t *dst);
+
+
+/** @brief Forget the downlink timing measured at all data rates */
+void lrw_rx_timing_reset(void);
+
+
+/** @brief Return the RX error (ms) LoRaMac currently computes RX windows with */
+uint32_t lrw_max_rx_error(void);
+
 #endif // _LRW_H
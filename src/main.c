@@ -16,25 +16,30 @@
 #include "eeprom.h"
 #include "halt.h"
 #include "nvm.h"
+#include "store.h"
+#include "evlog.h"
 #include "sx1276-board.h"
+#include "trace.h"
+#include "energy.h"
+
+
+// True while the main loop runs lrw_process, which must not be entered again
+// from system_yield. False until LoRaMac has been started.
+static bool lrw_busy = true;
+
+// True if system_yield has taken the LoRa task, which is then posted again
+// for the rest of lrw_process
+static bool lrw_yielded;
 
 
 int main(void)
 {
     int busy;
+    unsigned tasks;
     system_init();
-
-#ifdef DEBUG
-    log_init(LOG_LEVEL_DUMP, LOG_TIMESTAMP_ABS);
-#else
-    log_init(LOG_LEVEL_OFF, LOG_TIMESTAMP_ABS);
-#endif
-    log_info("Open LoRaWAN modem %s [LoRaMac %s] built on %s", VERSION, LIB_VERSION, BUILD_DATE);
-
-    nvm_init();
-    cmd_init(sysconf.uart_baudrate);
-
-    adc_init();
+    trace(TRACE_BOOT);
+    trace_irq_init();
+    energy_init();
 
     SX1276.DIO0.port = GPIOB;
     SX1276.DIO0.pinIndex = GPIO_PIN_4;
@@ -51,58 +56,159 @@ int main(void)
     SX1276.Reset.port = GPIOC;
     SX1276.Reset.pinIndex = GPIO_PIN_0;
 
+    // The boot waits on the radio: the TCXO startup, the 1 ms reset pulse, and
+    // the 6 ms the SX1276 needs after reset. Start them now so that they run
+    // while the configuration is loaded from NVM and the ATCI is brought up.
+    // SX1276Reset, invoked by lrw_init, only waits for what is left.
+    sx1276_reset_begin();
+
+#ifdef DEBUG
+    log_init(LOG_LEVEL_DUMP, LOG_TIMESTAMP_ABS);
+#else
+    log_init(LOG_LEVEL_OFF, LOG_TIMESTAMP_ABS);
+#endif
+    log_info("Open LoRaWAN modem %s [LoRaMac %s] built on %s", VERSION, LIB_VERSION, BUILD_DATE);
+
+    nvm_init();
+    store_init();
+    evlog_init();
+    trace(TRACE_BOOT_NVM);
+
+    sx1276_reset_release();
+
+    cmd_init(sysconf.uart_baudrate);
+
+    // The host can talk to the modem as soon as the ATCI is up. Commands
+    // received before the initialization below completes wait in the LPUART
+    // RX buffer until the main loop runs.
+    if (system_resumed) {
+        int arg = system_standby_time();
+        log_info("Resumed after %lus in Standby", system_standby_time());
+        cmd_event_args(CMD_EVENT_MODULE, CMD_MODULE_RESUME, &arg, 1);
+    } else {
+        cmd_event(CMD_EVENT_MODULE, CMD_MODULE_BOOT);
+    }
+    trace(TRACE_BOOT_ATCI);
+
+    adc_init();
     spi_init(&SX1276.Spi, 10000000);
     SX1276IoInit();
 
     lrw_init();
     log_debug("LoRaMac: Starting");
     LoRaMacStart();
-    cmd_event(CMD_EVENT_MODULE, CMD_MODULE_BOOT);
+
+    // The time between the BOOT and READY trace points is the boot-to-ready
+    // time, see AT$TRACE
+    trace(TRACE_READY);
+
+    // Run every task handler once before the first sleep
+    system_post(SYSTEM_TASK_ALL);
+    lrw_busy = false;
 
     while (1) {
-        cmd_process();
-        lrw_process();
+        tasks = system_take_tasks();
+
+        // Task handlers that can tolerate a slightly stale time use rtc_now
+        // rather than reading the RTC calendar themselves
+        rtc_update_now();
+
+        // Invoke lrw_process as the first thing after waking up to give the MAC
+        // a chance to timestamp incoming downlink as quickly as possible.
+        if (tasks & SYSTEM_TASK_LORA) system_enable_pll();
+        if (tasks & (SYSTEM_TASK_LORA | SYSTEM_TASK_NVM)) {
+            trace(TRACE_LRW_PROCESS);
+            lrw_busy = true;
+            lrw_process();
+            lrw_busy = false;
+        }
+        if (tasks & SYSTEM_TASK_ATCI) {
+            cmd_process();
+
+            // AT commands can modify the LoRaMac state or schedule a reset.
+            // LoRaMac only notices such state changes from within
+            // LoRaMacProcess, so have lrw_process run once more to save them.
+            system_post(SYSTEM_TASK_LORA);
+        }
+
+        // Notifications produced by the MAC while a task handler was writing
+        // to the host follow the handler's output
+        atci_flush_deferred();
+        if (lrw_yielded) {
+            lrw_yielded = false;
+            system_post(SYSTEM_TASK_LORA);
+        }
+
+        // The configuration and the mailbox only change in the task handlers
+        // above; checking them is cheap, so there is no separate task for it.
         sysconf_process();
+        evlog_process();
+        cmd_update_data_ready();
+
+        // Do not lose configuration changes and events still waiting for their
+        // deadline
+        if (schedule_reset) {
+            sysconf_flush();
+            evlog_flush();
+        }
 
         disable_irq();
 
         // If the application has scheduled a system reset, postpone it until
-        // there are no more pending tasks. We don't really have the notion of
-        // tasks in the modem software; however, we can tell that nothing is
-        // going on once both low-power modes (sleep and stop) are not prevented
-        // by any of the subsystems. The low-power sleep mode is typically
-        // prevented if a subsystem requests that the application iterates
-        // through its main loop as quickly as possible, e.g., to handle an ISR
-        // from the main thread. The stop mode can be prevented by hardware
-        // peripherals such as LPUART1, RTC, or SX1276 while they need to finish
-        // some background work. We specifically ignore the RADIO subsystem in
-        // the code below and instead rely on LoRaMacIsBusy to tell us whether
-        // the MAC subsystem (which owns the radio) is busy. This will allow a
-        // reboot in class C, where the radio is continuously listening. This
-        // heuristic to determine when to perform the reset is a bit hackish,
-        // but it's the best we can do in the absence of better activity
-        // tracking mechanism.
-
-        busy = system_sleep_lock | (system_stop_lock & ~SYSTEM_MODULE_RADIO) | LoRaMacIsBusy();
+        // there are no pending tasks and no subsystem needs to finish
+        // background work. The Stop mode can be prevented by hardware
+        // peripherals such as LPUART1, RTC, EEPROM, or SX1276 while they are
+        // busy. We specifically ignore the RADIO subsystem and instead rely on
+        // LoRaMacIsBusy to tell us whether the MAC subsystem (which owns the
+        // radio) is busy. This allows a reboot in class C, where the radio is
+        // continuously listening.
+        busy = system_tasks | system_sleep_lock | (system_stop_lock & ~SYSTEM_MODULE_RADIO) | LoRaMacIsBusy();
         if (schedule_reset && !busy) {
+            if (schedule_warm_reset) nvm_retain();
             NVIC_SystemReset();
         } else {
             system_idle();
         }
 
         enable_irq();
-
-        // Invoke lrw_process as the first thing after waking up to give the MAC
-        // a chance to timestamp incoming downlink as quickly as possible.
-        lrw_process();
     }
 }
 
 
+// Invoked while a task handler waits for the host to make room in the LPUART
+// TX FIFO, e.g., during AT$HELP or with a host that reads slowly. Without it,
+// LoRaMac would wait as long as the host does before it processes a received
+// downlink or a completed transmission.
+void system_yield(void)
+{
+    uint32_t mask;
+
+    if (lrw_busy || __get_PRIMASK() || __get_IPSR()) return;
+
+    mask = disable_irq();
+    bool pending = system_tasks & SYSTEM_TASK_LORA;
+    system_tasks &= ~SYSTEM_TASK_LORA;
+    reenable_irq(mask);
+    if (!pending) return;
+
+    lrw_yielded = true;
+    if (!atci_defer_begin()) return;
+
+    lrw_busy = true;
+    lrw_yield();
+    lrw_busy = false;
+    atci_defer_end();
+}
+
+
 void system_before_stop(void)
 {
-    SX1276IoDeInit();
-    spi_io_deinit(&SX1276.Spi);
+    // If the radio has not been used since the previous Stop, its IOs are
+    // still deinitialized
+    if (spi_io_active(&SX1276.Spi)) {
+        SX1276IoDeInit();
+        spi_io_deinit(&SX1276.Spi);
+    }
     adc_before_stop();
     lpuart_before_stop();
 }
@@ -111,7 +217,26 @@ void system_before_stop(void)
 void system_after_stop(void)
 {
     lpuart_after_stop();
-    adc_after_stop();
-    spi_io_init(&SX1276.Spi);
-    SX1276IoInit();
+
+    // The SPI and SX1276 IOs and the ADC are initialized again on first use,
+    // see spi_on_resume and adc_get_value. Wakeups that touch neither skip the
+    // initialization entirely.
+}
+
+
+// Everything in SRAM is lost in Standby. Only permit it if the MAC is idle,
+// nothing waits for a timer (including deferred NVM writes), and the host has
+// collected every message.
+bool system_can_standby(void)
+{
+    if (LoRaMacIsBusy() || !TimerIsIdle()) return false;
+    if (sysconf_pending(NULL) || schedule_reset) return false;
+    if (lrw_tx_queue_length() || !cmd_mailbox_empty()) return false;
+    return !cbuf_length(&lpuart_tx_fifo) && !cbuf_length(&lpuart_rx_fifo);
+}
+
+
+void spi_on_resume(Spi_t *spi)
+{
+    if (spi == &SX1276.Spi) SX1276IoInit();
 }
@@ -0,0 +1,265 @@
+#include "mcast.h"
+#include <string.h>
+#include <loramac-node/src/mac/LoRaMac.h>
+#include <loramac-node/src/mac/secure-element.h>
+#include <loramac-node/src/peripherals/soft-se/aes.h>
+#include "lrw.h"
+#include "store.h"
+#include "part.h"
+#include "utils.h"
+#include "log.h"
+
+
+// A slot of the table in the store. An erased or cleared slot fails the
+// checksum.
+typedef struct {
+    uint32_t address;
+    uint8_t nwkskey[SE_KEY_SIZE];
+    uint8_t appskey[SE_KEY_SIZE];
+    uint32_t crc32;
+} slot_t;
+
+// The order in which the contexts were activated, for the choice of a context
+// to be reused. Not kept across reboots.
+static uint32_t activated[LORAMAC_MAX_MC_CTX];
+static uint32_t counter;
+
+
+static const slot_t *open_slots(part_t *part)
+{
+    const slot_t *p;
+    size_t size;
+
+    if (store_open(part, "mcast", MCAST_SLOTS * sizeof(slot_t)) != 0) return NULL;
+
+    p = part_mmap(&size, part);
+    if (p == NULL || size < MCAST_SLOTS * sizeof(slot_t)) return NULL;
+    return p;
+}
+
+
+static const slot_t *get_slot(unsigned int slot)
+{
+    const slot_t *slots;
+    part_t part;
+
+    if (slot >= MCAST_SLOTS) return NULL;
+
+    slots = open_slots(&part);
+    if (slots == NULL || !check_block_crc(&slots[slot], sizeof(slot_t))) return NULL;
+    return &slots[slot];
+}
+
+
+static const uint8_t *find_key(KeyIdentifier_t id)
+{
+    LoRaMacNvmData_t *state = lrw_get_state();
+
+    for (int i = 0; i < NUM_OF_KEYS; i++) {
+        if (state->SecureElement.KeyList[i].KeyID == id)
+            return state->SecureElement.KeyList[i].KeyValue;
+    }
+    return NULL;
+}
+
+
+// Return true if the context holds the group of the slot with its keys
+static bool is_loaded(unsigned int group, const slot_t *s)
+{
+    static const KeyIdentifier_t nwkskeys[LORAMAC_MAX_MC_CTX] = {
+        MC_NWK_S_KEY_0, MC_NWK_S_KEY_1, MC_NWK_S_KEY_2, MC_NWK_S_KEY_3
+    };
+    static const KeyIdentifier_t appskeys[LORAMAC_MAX_MC_CTX] = {
+        MC_APP_S_KEY_0, MC_APP_S_KEY_1, MC_APP_S_KEY_2, MC_APP_S_KEY_3
+    };
+    const McChannelParams_t *c = &lrw_get_state()->MacGroup2.MulticastChannelList[group].ChannelParams;
+    const uint8_t *nwkskey = find_key(nwkskeys[group]);
+    const uint8_t *appskey = find_key(appskeys[group]);
+
+    return c->IsEnabled && !c->IsRemotelySetup && c->Address == s->address
+        && nwkskey != NULL && memcmp(nwkskey, s->nwkskey, SE_KEY_SIZE) == 0
+        && appskey != NULL && memcmp(appskey, s->appskey, SE_KEY_SIZE) == 0;
+}
+
+
+static int find_group(const slot_t *s)
+{
+    for (unsigned int i = 0; i < LORAMAC_MAX_MC_CTX; i++)
+        if (is_loaded(i, s)) return i;
+    return -1;
+}
+
+
+static int write_slot(unsigned int slot, const slot_t *s)
+{
+    part_t part;
+
+    if (slot >= MCAST_SLOTS) return LORAMAC_STATUS_PARAMETER_INVALID;
+    if (open_slots(&part) == NULL) return LORAMAC_STATUS_NVM_DATA_INCONSISTENT;
+
+    if (!part_write(&part, slot * sizeof(slot_t), s, sizeof(*s))) {
+        log_error("mcast: Error while writing slot %d", slot);
+        return LORAMAC_STATUS_NVM_DATA_INCONSISTENT;
+    }
+    return LORAMAC_STATUS_OK;
+}
+
+
+int mcast_slot_set(unsigned int slot, uint32_t address, const uint8_t *nwkskey, const uint8_t *appskey)
+{
+    slot_t s;
+    int rc;
+
+    if (slot >= MCAST_SLOTS) return LORAMAC_STATUS_PARAMETER_INVALID;
+
+    // A group loaded from the old contents of the slot would no longer match
+    // the table
+    rc = mcast_slot_delete(slot);
+    if (rc != LORAMAC_STATUS_OK) return rc;
+
+    s.address = address;
+    memcpy(s.nwkskey, nwkskey, SE_KEY_SIZE);
+    memcpy(s.appskey, appskey, SE_KEY_SIZE);
+    update_block_crc(&s, sizeof(s));
+
+    rc = write_slot(slot, &s);
+    memset(&s, 0, sizeof(s));
+    return rc;
+}
+
+
+// McAppSKey = aes128_encrypt(McKey, 0x01 | McAddr | pad16) and McNwkSKey =
+// aes128_encrypt(McKey, 0x02 | McAddr | pad16), see the LoRaWAN Remote
+// Multicast Setup Specification v1.0.0
+int mcast_slot_derive(unsigned int slot, uint32_t address, const uint8_t *mckey)
+{
+    uint8_t block[SE_KEY_SIZE];
+    uint8_t nwkskey[SE_KEY_SIZE];
+    uint8_t appskey[SE_KEY_SIZE];
+    aes_context ctx;
+    int rc = LORAMAC_STATUS_CRYPTO_ERROR;
+
+    if (slot >= MCAST_SLOTS) return LORAMAC_STATUS_PARAMETER_INVALID;
+
+    memset(block, 0, sizeof(block));
+    block[1] = address & 0xff;
+    block[2] = (address >> 8) & 0xff;
+    block[3] = (address >> 16) & 0xff;
+    block[4] = (address >> 24) & 0xff;
+
+    if (aes_set_key(mckey, SE_KEY_SIZE, &ctx) != 0) goto out;
+
+    block[0] = 0x01;
+    if (aes_encrypt(block, appskey, &ctx) != 0) goto out;
+    block[0] = 0x02;
+    if (aes_encrypt(block, nwkskey, &ctx) != 0) goto out;
+
+    rc = mcast_slot_set(slot, address, nwkskey, appskey);
+out:
+    memset(&ctx, 0, sizeof(ctx));
+    memset(nwkskey, 0, sizeof(nwkskey));
+    memset(appskey, 0, sizeof(appskey));
+    return rc;
+}
+
+
+int mcast_slot_delete(unsigned int slot)
+{
+    const slot_t *s;
+    slot_t empty;
+    int group, rc;
+
+    if (slot >= MCAST_SLOTS) return LORAMAC_STATUS_PARAMETER_INVALID;
+
+    s = get_slot(slot);
+    if (s == NULL) return LORAMAC_STATUS_OK;
+
+    group = find_group(s);
+    if (group >= 0) {
+        rc = LoRaMacMcChannelDelete(group);
+        if (rc != LORAMAC_STATUS_OK) return rc;
+    }
+
+    memset(&empty, 0, sizeof(empty));
+    return write_slot(slot, &empty);
+}
+
+
+bool mcast_slot_get(unsigned int slot, uint32_t *address)
+{
+    const slot_t *s = get_slot(slot);
+
+    if (s == NULL) return false;
+    *address = s->address;
+    return true;
+}
+
+
+int mcast_slot_group(unsigned int slot)
+{
+    const slot_t *s = get_slot(slot);
+    return s == NULL ? -1 : find_group(s);
+}
+
+
+// Return a free context, or the one activated least recently
+static unsigned int pick_group(void)
+{
+    LoRaMacNvmData_t *state = lrw_get_state();
+    unsigned int i, oldest = 0;
+
+    for (i = 0; i < LORAMAC_MAX_MC_CTX; i++) {
+        if (!state->MacGroup2.MulticastChannelList[i].ChannelParams.IsEnabled) return i;
+        if (activated[i] < activated[oldest]) oldest = i;
+    }
+    return oldest;
+}
+
+
+int mcast_activate(unsigned int slot, int *group)
+{
+    const slot_t *s;
+    int current, g = *group;
+    LoRaMacStatus_t rc;
+
+    if (slot >= MCAST_SLOTS || g >= LORAMAC_MAX_MC_CTX) return LORAMAC_STATUS_PARAMETER_INVALID;
+
+    s = get_slot(slot);
+    if (s == NULL) return LORAMAC_STATUS_PARAMETER_INVALID;
+
+    current = find_group(s);
+    if (current >= 0 && (g < 0 || g == current)) {
+        activated[current] = ++counter;
+        *group = current;
+        return LORAMAC_STATUS_OK;
+    }
+
+    if (g < 0) g = pick_group();
+
+    // LoRaMac copies the keys into the secure element
+    McChannelParams_t c = {
+        .IsEnabled = true,
+        .IsRemotelySetup = false,
+        .GroupID = g,
+        .Address = s->address,
+        .McKeys = {
+            .Session = {
+                .McNwkSKey = (uint8_t *)s->nwkskey,
+                .McAppSKey = (uint8_t *)s->appskey
+            }
+        },
+        .FCountMin = 0,
+        .FCountMax = UINT32_MAX
+    };
+
+    // A group loaded in another context is moved
+    if (current >= 0) LoRaMacMcChannelDelete(current);
+    LoRaMacMcChannelDelete(g);
+    rc = LoRaMacMcChannelSetup(&c);
+    if (rc != LORAMAC_STATUS_OK) return rc;
+
+    log_debug("mcast: Loaded slot %d into group %d", slot, g);
+    activated[g] = ++counter;
+    *group = g;
+    return LORAMAC_STATUS_OK;
+}
@@ -0,0 +1,78 @@
+#ifndef _MCAST_H
+#define _MCAST_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+//! @brief The number of slots in the multicast group table
+#ifndef MCAST_SLOTS
+#define MCAST_SLOTS 16
+#endif
+
+/*! @brief Multicast group table
+ *
+ * LoRaMac has LORAMAC_MAX_MC_CTX multicast contexts. Hosts that take part in
+ * many multicast groups over time, e.g., FUOTA campaigns that rotate groups,
+ * can keep up to MCAST_SLOTS groups in a table in the flash store (see
+ * store.h) with AT$MCSLOT and load them into the LoRaMac contexts on demand
+ * with AT$MCACT.
+ *
+ * Each slot holds the multicast address and the session keys McNwkSKey and
+ * McAppSKey. A slot configured with a McKey stores the session keys derived
+ * from it as in the LoRaWAN Remote Multicast Setup specification, so the
+ * derivation runs once when the slot is written, not on every activation.
+ * Activating a slot that is already loaded in a context does nothing, so
+ * switching back and forth between groups only writes the secure element when
+ * a context actually receives new keys.
+ */
+
+//! @brief Store a group with its session keys in a slot
+//! @param[in] slot Slot number, 0 to MCAST_SLOTS - 1
+//! @param[in] address Multicast address
+//! @param[in] nwkskey McNwkSKey, SE_KEY_SIZE bytes
+//! @param[in] appskey McAppSKey, SE_KEY_SIZE bytes
+//! @return Zero on success, a @c LoRaMacStatus_t value on error
+
+int mcast_slot_set(unsigned int slot, uint32_t address, const uint8_t *nwkskey, const uint8_t *appskey);
+
+//! @brief Derive the session keys of a group from its McKey and store them in
+//! a slot
+//! @param[in] slot Slot number, 0 to MCAST_SLOTS - 1
+//! @param[in] address Multicast address
+//! @param[in] mckey McKey, SE_KEY_SIZE bytes
+//! @return Zero on success, a @c LoRaMacStatus_t value on error
+
+int mcast_slot_derive(unsigned int slot, uint32_t address, const uint8_t *mckey);
+
+//! @brief Clear a slot. A group loaded from the slot is removed from its
+//! LoRaMac context.
+//! @return Zero on success, a @c LoRaMacStatus_t value on error
+
+int mcast_slot_delete(unsigned int slot);
+
+//! @brief Return the multicast address of a slot
+//! @param[out] address Destination
+//! @return true If the slot holds a group
+
+bool mcast_slot_get(unsigned int slot, uint32_t *address);
+
+//! @brief Return the LoRaMac multicast context the group of a slot is loaded
+//! in, or -1 if it is not loaded
+
+int mcast_slot_group(unsigned int slot);
+
+//! @brief Load the group of a slot into a LoRaMac multicast context
+//!
+//! If the group is loaded in a context already, nothing is written. Otherwise,
+//! without a context given, a free context is used, or the context whose group
+//! was activated least recently.
+//!
+//! @param[in] slot Slot number, 0 to MCAST_SLOTS - 1
+//! @param[in,out] group LoRaMac multicast context (group ID), or -1 to pick
+//! one. Set to the context used.
+//! @return Zero on success, a @c LoRaMacStatus_t value on error
+
+int mcast_activate(unsigned int slot, int *group);
+
+#endif // _MCAST_H
@@ -3,6 +3,7 @@
 #include "halt.h"
 #include "rtc.h"
 #include "gpio.h"
+#include "irq.h"
 
 /* when fast wake up is enabled, the mcu wakes up in ~20us  * and
  * does not wait for the VREFINT to be settled. THis is ok for
@@ -49,9 +50,9 @@ void HAL_MspInit(void)
   /* In the debug mode, e.g., when DBGMCU is activated, the ARM core has always
    * clocks and will not wait until the flash is ready to be read. In this case,
    * it can miss the first instruction. To overcome this issue, the flash
-   * remains clocked during sleep mode.
+   * remains clocked during sleep mode. See FLASH_SLEEP_PD in the Makefile.
    */
-#ifdef DEBUG
+#if FLASH_SLEEP_PD == 0
     do
     {
         __HAL_FLASH_SLEEP_POWERDOWN_DISABLE();
@@ -98,7 +99,7 @@ void HAL_RTC_MspInit(RTC_HandleTypeDef *hrtc)
     __HAL_RCC_RTC_ENABLE();
 
     // Configure the NVIC for RTC alarms
-    HAL_NVIC_SetPriority(RTC_IRQn, 0x0, 0);
+    HAL_NVIC_SetPriority(RTC_IRQn, IRQ_PRIORITY_RTC, 0);
     HAL_NVIC_EnableIRQ(RTC_IRQn);
 }
 
@@ -126,13 +127,3 @@ void HAL_RTC_AlarmAEventCallback(RTC_HandleTypeDef *hrtc)
     (void) hrtc;
     TimerIrqHandler();
 }
-
-/**
-  * @brief  EXTI line detection callbacks.
-  * @param  GPIO_Pin: Specifies the pins connected to the EXTI line.
-  * @retval None
-  */
-void HAL_GPIO_EXTI_Callback(uint16_t GPIO_Pin)
-{
-    gpio_hal_msp_irq_handler(GPIO_Pin);
-}
@@ -1,18 +1,27 @@
+#define LOG_MODULE_THRESHOLD LOG_THRESHOLD_NVM
 #include "nvm.h"
 #include <assert.h>
 #include <string.h>
-#include <strings.h>
 #include <stm/include/stm32l072xx.h>
 #include <loramac-node/src/mac/LoRaMacTypes.h>
 #include <loramac-node/src/mac/LoRaMac.h>
+#include <LoRaWAN/Utilities/utilities.h>
+#include <LoRaWAN/Utilities/timeServer.h>
 #include "log.h"
 #include "part.h"
 #include "eeprom.h"
 #include "halt.h"
 #include "part.h"
 #include "utils.h"
+#include "system.h"
+#include "evlog.h"
+#include "lrw.h"
 
-#define NUMBER_OF_PARTS 9
+#define NUMBER_OF_PARTS 11
+
+// "NVMS" in little-endian byte order, see NVM snapshots below
+#define SNAPSHOT_MAGIC   0x534d564e
+#define SNAPSHOT_VERSION 1
 
 
 /* The following partition sizes have been derived from the in-memory size of
@@ -31,7 +40,16 @@
 #define REGION1_PART_SIZE   32
 #define REGION2_PART_SIZE 1310
 #define CLASSB_PART_SIZE    32
-#define USER_NVM_PART_SIZE  72
+#define USER_NVM_PART_SIZE 264
+
+// The journal part holds a ring of copies of the LoRaMac crypto state (frame
+// counters) which is updated with every uplink and downlink. Its size
+// determines by how much the EEPROM wear caused by frame counter updates is
+// reduced.
+#define JOURNAL_PART_SIZE 1024
+
+// The sessions of the most recently left regions, see region_session_t
+#define REGIONS_PART_SIZE (REGION_CACHE_ENTRIES * sizeof(region_session_t))
 
 
 // Make sure each data structure fits into its fixed-size partition
@@ -46,20 +64,30 @@ static_assert(sizeof(LoRaMacClassBNvmData_t) <= CLASSB_PART_SIZE, "ClassB NVM da
 static_assert(sizeof(user_nvm_t) <= USER_NVM_PART_SIZE, "User NVM data too long");
 
 
-// And also make sure that NVM data fits into the EEPROM twice. This is useful
-// in case we wanted to implement atomic writes or data mirroring.
+// The parts that hold LoRaMac state groups keep two shadow copies of the group,
+// see part_shadow_t. Together with the journal, which is redundant by design,
+// all NVM data must fit into the EEPROM.
+#define CRYPTO_SHADOW_SIZE  PART_SHADOW_SIZE(CRYPTO_PART_SIZE)
+#define MAC1_SHADOW_SIZE    PART_SHADOW_SIZE(MAC1_PART_SIZE)
+#define MAC2_SHADOW_SIZE    PART_SHADOW_SIZE(MAC2_PART_SIZE)
+#define SE_SHADOW_SIZE      PART_SHADOW_SIZE(SE_PART_SIZE)
+#define REGION1_SHADOW_SIZE PART_SHADOW_SIZE(REGION1_PART_SIZE)
+#define CLASSB_SHADOW_SIZE  PART_SHADOW_SIZE(CLASSB_PART_SIZE)
+
 static_assert(
-    SYSCONF_PART_SIZE +
-    CRYPTO_PART_SIZE  +
-    MAC1_PART_SIZE    +
-    MAC2_PART_SIZE    +
-    SE_PART_SIZE      +
-    REGION1_PART_SIZE +
-    REGION2_PART_SIZE +
-    CLASSB_PART_SIZE  +
-    USER_NVM_PART_SIZE
-    <= (DATA_EEPROM_BANK2_END - DATA_EEPROM_BASE + 1 - PART_TABLE_SIZE(NUMBER_OF_PARTS)) / 2,
-    "NVM data does not fit into a single EEPROM bank");
+    SYSCONF_PART_SIZE   +
+    CRYPTO_SHADOW_SIZE  +
+    MAC1_SHADOW_SIZE    +
+    MAC2_SHADOW_SIZE    +
+    SE_SHADOW_SIZE      +
+    REGION1_SHADOW_SIZE +
+    PART_ALIGN(REGION2_PART_SIZE) +
+    CLASSB_SHADOW_SIZE  +
+    USER_NVM_PART_SIZE  +
+    JOURNAL_PART_SIZE   +
+    REGIONS_PART_SIZE
+    <= DATA_EEPROM_BANK2_END - DATA_EEPROM_BASE + 1 - PART_TABLE_SIZE(NUMBER_OF_PARTS),
+    "NVM data does not fit into the EEPROM");
 
 
 // We currently store all non-volatile state in the EEPROM, so there is only one
@@ -70,12 +98,15 @@ static_assert(
 static part_block_t nvm = {
     .size = DATA_EEPROM_BANK2_END - DATA_EEPROM_BASE + 1,
     .mmap = eeprom_mmap,
-    .write = eeprom_write
+    .write = eeprom_write,
+    .write_async = eeprom_write_async,
+    .erase = eeprom_erase
 };
 
 struct nvm_parts nvm_parts;
-
-user_nvm_t user_nvm = { 0 };
+struct nvm_shadows nvm_shadows;
+part_journal_t nvm_journal;
+bool nvm_warm;
 
 sysconf_t sysconf = {
     .uart_baudrate = DEFAULT_UART_BAUDRATE,
@@ -85,19 +116,273 @@ sysconf_t sysconf = {
     .sleep = 1,
     .lock_keys = 0,
     .async_uart = 1,
+    .tx_queue = 0,
+    .recv_ext = 0,
     .device_class = CLASS_A,
     .unconfirmed_retransmissions = 1,
-    .confirmed_retransmissions = 8
+    .confirmed_retransmissions = 8,
+    .nvm_window = 0,
+    .nvm_fcnt_margin = 16,
+    .tx_store = 0,
+    .auto_pull = 0,
+    .standby = 0,
+    .chpolicy = 0,
+    .power_profile = 0,
+    .rx_adapt = 0,
+    .rx_standby = 0,
+    .ping_slot_periodicity = LRW_PING_SLOT_PERIODICITY,
+    .tx_store_interval = 0,
+    .tx_store_max_age = 0,
+    .uart_coalesce = 0,
+    .split_port = 0,
+    .hb_port = 0,
+    .hb_period = 0,
+    .hb_jitter = 10,
+    .hb_content = 3,
+    .hb_nvm_offset = 0,
+    .hb_nvm_length = 0,
+    .profile = 0,
+    .join_subband = 0,
+    .airtime_cap = 0,
+    .rtx_backoff_base = 0,
+    .rtx_backoff_max = 300,
+    .rtx_backoff_jitter = 50,
+    .remote_port = 0,
+    .slot_width = 10,
+    .slot_period = 0,
+    .slot_offset = SYSCONF_SLOT_AUTO,
+    .class_c_window = 0,
+    .class_c_policy = 0,
+    .class_c_period = 0,
+    .class_c_offset = 0,
+    .clocksync_period = 0,
+    .rtc_calibration = 0
 };
 
 bool sysconf_modified;
 uint16_t nvm_flags;
 
+// Changes to the system configuration are written to NVM at most
+// SYSCONF_COMMIT_DELAY ms after the first change, so that a series of AT
+// commands that modify the configuration programs the EEPROM only once. The
+// write can be postponed further with a transaction, see sysconf_begin. See
+// sysconf_process.
+#define SYSCONF_COMMIT_DELAY 2000
+#define SYSCONF_COMMIT_SLACK  500
+
+static TimerEvent_t sysconf_timer;
+static volatile bool sysconf_due;
+static bool sysconf_transaction;
+
+
+// The layout of the NVM block in the order in which nvm_init creates the parts
+// in a freshly formatted EEPROM
+static const part_layout_t layout[] = {
+    { "sysconf", SYSCONF_PART_SIZE,   &nvm_parts.sysconf },
+    { "crypto",  CRYPTO_SHADOW_SIZE,  &nvm_parts.crypto  },
+    { "mac1",    MAC1_SHADOW_SIZE,    &nvm_parts.mac1    },
+    { "mac2",    MAC2_SHADOW_SIZE,    &nvm_parts.mac2    },
+    { "se",      SE_SHADOW_SIZE,      &nvm_parts.se      },
+    { "region1", REGION1_SHADOW_SIZE, &nvm_parts.region1 },
+    { "region2", REGION2_PART_SIZE,   &nvm_parts.region2 },
+    { "classb",  CLASSB_SHADOW_SIZE,  &nvm_parts.classb  },
+    { "user",    USER_NVM_PART_SIZE,  &nvm_parts.user    },
+    { "journal", JOURNAL_PART_SIZE,   &nvm_parts.journal },
+    { "regions", REGIONS_PART_SIZE,   &nvm_parts.regions }
+};
+
+static_assert(ARRAY_LEN(layout) == NUMBER_OF_PARTS, "NVM layout does not match the number of parts");
+
+
+// The shadow parts opened by nvm_init and the size of the record in each
+static const struct {
+    part_shadow_t *shadow;
+    part_t *part;
+    size_t record_size;
+} shadows[] = {
+    { &nvm_shadows.crypto,  &nvm_parts.crypto,  sizeof(LoRaMacCryptoNvmData_t) },
+    { &nvm_shadows.mac1,    &nvm_parts.mac1,    sizeof(LoRaMacNvmDataGroup1_t) },
+    { &nvm_shadows.mac2,    &nvm_parts.mac2,    sizeof(LoRaMacNvmDataGroup2_t) },
+    { &nvm_shadows.se,      &nvm_parts.se,      sizeof(SecureElementNvmData_t) },
+    { &nvm_shadows.region1, &nvm_parts.region1, sizeof(RegionNvmDataGroup1_t)  },
+    { &nvm_shadows.classb,  &nvm_parts.classb,  sizeof(LoRaMacClassBNvmData_t) }
+};
+
+
+/*
+ * Look the parts up by label and create missing parts. This is the slow path
+ * for partition tables that do not match the layout, e.g., a freshly
+ * formatted EEPROM. Fails if a part has a different size or if there is no
+ * room for a missing part, e.g., in tables created by an older firmware
+ * version without the journal part.
+ */
+static int find_parts(void)
+{
+    for (unsigned int i = 0; i < ARRAY_LEN(layout); i++) {
+        if ((part_find(layout[i].part, &nvm, layout[i].label) &&
+            part_create(layout[i].part, &nvm, layout[i].label, layout[i].size)) ||
+            layout[i].part->dsc->size != layout[i].size)
+            return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * Rebuild the partition table in the current layout, preserving the data of
+ * all parts, e.g., after a firmware upgrade changed the size of a part. This
+ * keeps the LoRaWAN session so that the device does not need to rejoin. The
+ * most recent crypto state is first folded from the journal into the crypto
+ * part and the journal is emptied, since a journal whose size changes may
+ * lose its most recent slot. LoRaMac then restores the crypto state from the
+ * crypto part and starts a new journal.
+ */
+static int migrate_parts(void)
+{
+    uint8_t record[sizeof(LoRaMacCryptoNvmData_t)];
+    part_journal_t journal;
+    part_shadow_t shadow;
+    part_t crypto, old;
+
+    log_warning("NVM layout changed, migrating");
+
+    if (!part_find(&old, &nvm, "journal")) {
+        if (part_journal_open(&journal, &old, sizeof(record)) == 0) {
+            const void *p = part_journal_read(&journal);
+            if (p != NULL && !part_find(&crypto, &nvm, "crypto")) {
+                memcpy(record, p, sizeof(record));
+                // A crypto part created by an older firmware version holds
+                // a single copy of the record and is migrated into bank A
+                if (crypto.dsc->size == CRYPTO_SHADOW_SIZE) {
+                    if (part_shadow_open(&shadow, &crypto, sizeof(record)) ||
+                        !part_shadow_write(&shadow, record))
+                        return -1;
+                } else {
+                    if (!part_write(&crypto, 0, record, sizeof(record))) return -1;
+                }
+            }
+        }
+        if (!part_erase(&old)) return -1;
+    }
+
+    memset(&nvm_parts, 0, sizeof(nvm_parts));
+    if (part_migrate_layout(&nvm, layout, ARRAY_LEN(layout)) != 0) return -1;
+
+    log_debug("NVM migrated");
+    evlog_record(EVLOG_NVM, EVLOG_NVM_MIGRATED, 0);
+    return 0;
+}
+
+
+// The size of the system configuration in the released firmware versions. The
+// checksum followed confirmed_retransmissions and two bytes of padding, which
+// nvm_window and nvm_fcnt_margin occupy now.
+#define SYSCONF_BASE_SIZE (offsetof(sysconf_t, nvm_window) + 2 + sizeof(uint32_t))
+
+
+// The size of the user data structure in firmware versions with 64 user data
+// registers. The checksum followed the last register.
+#define USER_NVM_V1_SIZE (sizeof(uint32_t) + 64 + sizeof(uint32_t))
+
+
+/*
+ * Check the user data in NVM. User data from firmware versions with fewer
+ * registers is extended in place, with the new registers set to zero. If
+ * there is no valid user data, all registers are set to zero.
+ */
+static void init_user_data(void)
+{
+    static const uint8_t zero[32];
+    const user_nvm_t *p;
+    uint32_t magic = USER_NVM_MAGIC;
+    size_t size, start;
+
+    p = part_mmap(&size, &nvm_parts.user);
+    if (p == NULL) return;
+
+    if (check_block_crc(p, sizeof(user_nvm_t))) {
+        log_debug("Found valid user data in NVM");
+        return;
+    }
+
+    if (p->magic == USER_NVM_MAGIC && check_block_crc(p, USER_NVM_V1_SIZE)) {
+        log_debug("Extending user data in NVM");
+        start = USER_NVM_V1_SIZE - sizeof(p->magic) - sizeof(p->crc32);
+    } else {
+        log_debug("Invalid user data checksum, using defaults");
+        evlog_record(EVLOG_NVM, EVLOG_NVM_USER_INVALID, 0);
+        if (!part_write(&nvm_parts.user, 0, &magic, sizeof(magic))) return;
+        start = 0;
+    }
+
+    for (size_t i = start; i < USER_NVM_MAX_SIZE; i += sizeof(zero)) {
+        if (!nvm_write_user_data(i, zero,
+            USER_NVM_MAX_SIZE - i < sizeof(zero) ? USER_NVM_MAX_SIZE - i : sizeof(zero))) {
+            log_error("Error while writing user data to NVM");
+            return;
+        }
+    }
+}
+
+
+// The state of the opened parts is kept across a software reset requested with
+// AT+REBOOT in RAM the startup code does not initialize, see the .noinit
+// section in the linker script. NVM is known to be intact at that point, so
+// the next boot takes the state from there rather than validating the shadow
+// banks, the journal slots, and the checksums of the configuration again. The
+// state is only valid for the boot that immediately follows nvm_retain; any
+// other reset, e.g., by the watchdog, finds it invalidated.
+#define RETAINED_MAGIC 0x4d564e57
+
+static struct retained_nvm {
+    uint32_t magic;
+    uint32_t size;
+    struct nvm_parts parts;
+    struct nvm_shadows shadows;
+    part_journal_t journal;
+    uint32_t crc32;
+} retained __attribute__((section(".noinit")));
+
+
+void nvm_retain(void)
+{
+    retained.magic = 0;
+
+    if (nvm_parts.sysconf.block == NULL || sysconf_modified || nvm_flags ||
+        eeprom_async_status() != 0)
+        return;
+
+    for (unsigned int i = 0; i < ARRAY_LEN(shadows); i++)
+        if (shadows[i].shadow->pending) return;
+
+    retained.size = sizeof(retained);
+    retained.parts = nvm_parts;
+    retained.shadows = nvm_shadows;
+    retained.journal = nvm_journal;
+    if (update_block_crc(&retained, sizeof(retained))) retained.magic = RETAINED_MAGIC;
+}
+
+
+static bool restore_retained(void)
+{
+    bool valid = retained.magic == RETAINED_MAGIC && retained.size == sizeof(retained) &&
+        check_block_crc(&retained, sizeof(retained)) &&
+        !memcmp(&retained.parts, &nvm_parts, sizeof(nvm_parts));
+
+    retained.magic = 0;
+    if (!valid) return false;
+
+    nvm_shadows = retained.shadows;
+    nvm_journal = retained.journal;
+    return true;
+}
+
 
 /*
  * Initialize system configuration NVM (EEPROM) partition. If necessary, the
  * function formats the EEPROM if the part is not found. If the part is found
- * but is of an invalid size; it is reformatted. If the part is found and has a
+ * but is of an invalid size, the partition table is migrated to the current
+ * layout; the EEPROM is only erased if that fails. If the part is found and has a
  * matching size, check the CRC32 checksum of the data before using it. If the
  * checksum does not match, use the defaults instead.
  */
@@ -105,79 +390,62 @@ void nvm_init(void)
 {
     int erased = 0;
 
+    nvm_warm = false;
+
 start:
     memset(&nvm_parts, 0, sizeof(nvm_parts));
 
     // Format the EEPROM if it does not contain a part table yet
     if (part_open_block(&nvm) != 0) {
         log_debug("Formatting EEPROM");
+        evlog_record(EVLOG_NVM, EVLOG_NVM_FORMATTED, 0);
         if (part_format_block(&nvm, NUMBER_OF_PARTS) != 0) halt("Could not format EEPROM");
         if (part_open_block(&nvm) != 0) halt("EEPROM I/O error");
     }
 
-    if ((part_find(&nvm_parts.sysconf, &nvm, "sysconf") &&
-        part_create(&nvm_parts.sysconf, &nvm, "sysconf", SYSCONF_PART_SIZE)) ||
-        nvm_parts.sysconf.dsc->size != SYSCONF_PART_SIZE)
-        goto retry;
-
-    if ((part_find(&nvm_parts.crypto, &nvm, "crypto") &&
-        part_create(&nvm_parts.crypto, &nvm, "crypto", CRYPTO_PART_SIZE)) ||
-        nvm_parts.crypto.dsc->size != CRYPTO_PART_SIZE)
+    // Fast path: a partition table created by this firmware version matches
+    // the layout exactly and can be validated in a single pass. Otherwise, find
+    // or create the parts, and migrate the table if that is not possible.
+    if (part_open_layout(&nvm, layout, ARRAY_LEN(layout)) && find_parts() &&
+        migrate_parts())
         goto retry;
 
-    if ((part_find(&nvm_parts.mac1, &nvm, "mac1") &&
-        part_create(&nvm_parts.mac1, &nvm, "mac1", MAC1_PART_SIZE)) ||
-        nvm_parts.mac1.dsc->size != MAC1_PART_SIZE)
-        goto retry;
-
-    if ((part_find(&nvm_parts.mac2, &nvm, "mac2") &&
-        part_create(&nvm_parts.mac2, &nvm, "mac2", MAC2_PART_SIZE)) ||
-        nvm_parts.mac2.dsc->size != MAC2_PART_SIZE)
-        goto retry;
-
-    if ((part_find(&nvm_parts.se, &nvm, "se") &&
-        part_create(&nvm_parts.se, &nvm, "se", SE_PART_SIZE)) ||
-        nvm_parts.se.dsc->size != SE_PART_SIZE)
-        goto retry;
-
-    if ((part_find(&nvm_parts.region1, &nvm, "region1") &&
-        part_create(&nvm_parts.region1, &nvm, "region1", REGION1_PART_SIZE)) ||
-        nvm_parts.region1.dsc->size != REGION1_PART_SIZE)
-        goto retry;
+    size_t size;
+    const uint8_t *p = part_mmap(&size, &nvm_parts.sysconf);
 
-    if ((part_find(&nvm_parts.region2, &nvm, "region2") &&
-        part_create(&nvm_parts.region2, &nvm, "region2", REGION2_PART_SIZE)) ||
-        nvm_parts.region2.dsc->size != REGION2_PART_SIZE)
-        goto retry;
+    if (!erased && restore_retained()) {
+        log_debug("Restoring NVM state retained across reset");
+        memcpy(&sysconf, p, sizeof(sysconf));
+        nvm_warm = true;
+        return;
+    }
 
-    if ((part_find(&nvm_parts.classb, &nvm, "classb") &&
-        part_create(&nvm_parts.classb, &nvm, "classb", CLASSB_PART_SIZE)) ||
-        nvm_parts.classb.dsc->size != CLASSB_PART_SIZE)
-        goto retry;
+    for (unsigned int i = 0; i < ARRAY_LEN(shadows); i++) {
+        if (part_shadow_open(shadows[i].shadow, shadows[i].part, shadows[i].record_size))
+            halt("Could not open NVM shadow part");
+    }
 
-    if ((part_find(&nvm_parts.user, &nvm, "user") &&
-        part_create(&nvm_parts.user, &nvm, "user", USER_NVM_PART_SIZE)) ||
-        nvm_parts.user.dsc->size != USER_NVM_PART_SIZE)
-        goto retry;
+    // The crypto state is saved in the journal if there is one, see save_state
+    // in lrw.c
+    if (part_journal_open(&nvm_journal, &nvm_parts.journal, sizeof(LoRaMacCryptoNvmData_t)) != 0)
+        memset(&nvm_journal, 0, sizeof(nvm_journal));
 
-    size_t size;
-    const uint8_t *p = part_mmap(&size, &nvm_parts.sysconf);
     if (check_block_crc(p, sizeof(sysconf))) {
         log_debug("Restoring system configuration from NVM");
         memcpy(&sysconf, p, sizeof(sysconf));
+    } else if (check_block_crc(p, SYSCONF_BASE_SIZE)) {
+        // Keep the defaults of the fields added since, including those in the
+        // former padding, and write the extended configuration back
+        log_debug("Extending system configuration from NVM");
+        evlog_record(EVLOG_NVM, EVLOG_NVM_SYSCONF_LEGACY, SYSCONF_BASE_SIZE);
+        memcpy(&sysconf, p, offsetof(sysconf_t, nvm_window));
+        sysconf_modified = true;
     } else {
         log_debug("Invalid system configuration checksum, using defaults");
+        evlog_record(EVLOG_NVM, EVLOG_NVM_SYSCONF_INVALID, 0);
     }
 
-    p = part_mmap(&size, &nvm_parts.user);
-    if (check_block_crc(p, sizeof(user_nvm))) {
-        log_debug("Restoring user data from NVM");
-        memcpy(&user_nvm, p, sizeof(user_nvm));
-    } else {
-        log_debug("Invalid user data checksum, using defaults");
-        user_nvm.magic = USER_NVM_MAGIC;
-        bzero(user_nvm.values,USER_NVM_MAX_SIZE);
-    }
+    init_user_data();
 
     return;
 
@@ -185,6 +453,7 @@ retry:
     if (erased) halt("Could not initialize NVM");
 
     log_debug("NVM part(s) missing or invalid, erasing NVM");
+    evlog_record(EVLOG_NVM, EVLOG_NVM_ERASED, 0);
     nvm_erase();
     erased = 1;
 
@@ -199,12 +468,47 @@ int nvm_erase(void)
     // until the block is opened and formatted again.
     int rc = part_erase_block(&nvm);
     part_close_block(&nvm);
+
+    // Configuration changes not written yet must not end up in the erased NVM
+    TimerStop(&sysconf_timer);
+    sysconf_due = false;
+    sysconf_transaction = false;
+    sysconf_modified = false;
     return rc;
 }
 
 
+static void on_sysconf_timer(void *ctx)
+{
+    (void)ctx;
+    sysconf_due = true;
+    system_post(SYSTEM_TASK_NVM);
+}
+
+
 void sysconf_process(void)
 {
+    if (!sysconf_modified || sysconf_transaction) return;
+
+    if (!sysconf_due) {
+        if (!TimerIsStarted(&sysconf_timer)) {
+            TimerInit(&sysconf_timer, on_sysconf_timer);
+            TimerSetSlack(&sysconf_timer, SYSCONF_COMMIT_SLACK);
+            TimerSetValue(&sysconf_timer, SYSCONF_COMMIT_DELAY);
+            TimerStart(&sysconf_timer);
+        }
+        return;
+    }
+
+    sysconf_flush();
+}
+
+
+void sysconf_flush(void)
+{
+    TimerStop(&sysconf_timer);
+    sysconf_due = false;
+
     if (!sysconf_modified) return;
 
     if (update_block_crc(&sysconf, sizeof(sysconf))) {
@@ -217,11 +521,279 @@ void sysconf_process(void)
 }
 
 
-void nvm_update_user_data(void)
+void sysconf_begin(void)
 {
-    if (update_block_crc(&user_nvm, sizeof(user_nvm))) {
-        log_debug("Saving user data to NVM");
-        if (!part_write(&nvm_parts.user, 0, &user_nvm, sizeof(user_nvm)))
-            log_error("Error while writing user data to NVM");
+    sysconf_transaction = true;
+}
+
+
+void sysconf_commit(void)
+{
+    sysconf_transaction = false;
+    sysconf_flush();
+}
+
+
+bool sysconf_pending(bool *transaction)
+{
+    if (transaction != NULL) *transaction = sysconf_transaction;
+    return sysconf_modified;
+}
+
+
+const uint8_t *nvm_user_data(void)
+{
+    size_t size;
+    const user_nvm_t *p = part_mmap(&size, &nvm_parts.user);
+    return p == NULL ? NULL : p->values;
+}
+
+
+/*
+ * Update a range of user data registers. Only the range and the checksum are
+ * written, and eeprom_write only programs the words whose value changes. The
+ * checksum of the updated structure is computed over the EEPROM contents
+ * around the range, without a copy of the structure in RAM.
+ */
+bool nvm_write_user_data(size_t offset, const void *data, size_t length)
+{
+    size_t size;
+    uint32_t crc;
+
+    const user_nvm_t *p = part_mmap(&size, &nvm_parts.user);
+    if (p == NULL) return false;
+    if (offset > USER_NVM_MAX_SIZE || length > USER_NVM_MAX_SIZE - offset) return false;
+
+    crc = Crc32Init();
+    crc = Crc32Update(crc, (uint8_t *)p, offsetof(user_nvm_t, values) + offset);
+    crc = Crc32Update(crc, (uint8_t *)data, length);
+    crc = Crc32Update(crc, (uint8_t *)p->values + offset + length,
+        USER_NVM_MAX_SIZE - offset - length);
+    crc = Crc32Finalize(crc);
+
+    return part_write(&nvm_parts.user, offsetof(user_nvm_t, values) + offset, data, length)
+        && part_write(&nvm_parts.user, offsetof(user_nvm_t, crc32), &crc, sizeof(crc));
+}
+
+
+/*
+ * NVM snapshots (AT$NVMDUMP, AT$NVMLOAD)
+ *
+ * A snapshot is a single binary blob with the raw contents of a set of parts.
+ * All integers are little-endian:
+ *
+ *   u32 magic, u8 version, u8 number of parts, u16 reserved (zero)
+ *   For each part: char label[MAX_LABEL_SIZE], u32 size, u8 data[size]
+ *   u32 CRC32 checksum over all of the above
+ *
+ * A snapshot carries the configuration of the device. The crypto part and the
+ * journal hold the frame counters and the DevNonce, which must never be copied
+ * to another device, and are thus not included. The secure element part (the
+ * keys) is optional.
+ */
+static const part_t *const snapshot_parts[] = {
+    &nvm_parts.sysconf,
+    &nvm_parts.mac1,
+    &nvm_parts.mac2,
+    &nvm_parts.se,
+    &nvm_parts.region1,
+    &nvm_parts.region2,
+    &nvm_parts.classb,
+    &nvm_parts.user
+};
+
+
+// The state of the snapshot being loaded with nvm_snapshot_load
+static struct {
+    enum {
+        LOAD_HEADER,
+        LOAD_PART,
+        LOAD_DATA,
+        LOAD_CRC,
+        LOAD_DONE,
+        LOAD_ERROR
+    } state;
+    uint32_t crc;
+    uint8_t buf[MAX_LABEL_SIZE + sizeof(uint32_t)];
+    size_t len;            // The number of bytes collected in buf
+    unsigned int parts;    // The number of parts yet to be loaded
+    const part_t *part;    // The part being loaded
+    uint32_t offset;       // The next offset within the part being loaded
+    uint16_t written;      // A bitmap of the snapshot_parts written so far
+} load;
+
+static_assert(ARRAY_LEN(snapshot_parts) <= 16, "Too many NVM snapshot parts");
+
+
+static void snapshot_output(uint32_t *crc, void (*output)(const void *buffer, size_t length),
+    const void *buffer, size_t length)
+{
+    *crc = Crc32Update(*crc, (uint8_t *)buffer, length);
+    output(buffer, length);
+}
+
+
+void nvm_snapshot_dump(void (*output)(const void *buffer, size_t length), bool keys)
+{
+    uint32_t crc = Crc32Init(), v;
+    uint8_t header[8] = { 0 };
+    char label[MAX_LABEL_SIZE];
+    const uint8_t *p;
+    size_t size;
+
+    v = SNAPSHOT_MAGIC;
+    memcpy(header, &v, sizeof(v));
+    header[4] = SNAPSHOT_VERSION;
+    header[5] = ARRAY_LEN(snapshot_parts) - (keys ? 0 : 1);
+    snapshot_output(&crc, output, header, sizeof(header));
+
+    for (unsigned int i = 0; i < ARRAY_LEN(snapshot_parts); i++) {
+        if (!keys && snapshot_parts[i] == &nvm_parts.se) continue;
+
+        p = part_mmap(&size, snapshot_parts[i]);
+        if (p == NULL) size = 0;
+
+        memset(label, 0, sizeof(label));
+        strncpy(label, snapshot_parts[i]->dsc->label, sizeof(label) - 1);
+        snapshot_output(&crc, output, label, sizeof(label));
+
+        v = size;
+        snapshot_output(&crc, output, &v, sizeof(v));
+        if (size) snapshot_output(&crc, output, p, size);
+    }
+
+    v = Crc32Finalize(crc);
+    output(&v, sizeof(v));
+}
+
+
+void nvm_snapshot_load_start(void)
+{
+    memset(&load, 0, sizeof(load));
+    load.state = LOAD_HEADER;
+    load.crc = Crc32Init();
+}
+
+
+// Process a complete header, part header, or checksum collected in load.buf
+// and return the next state
+static int load_field(void)
+{
+    uint32_t v;
+
+    switch (load.state) {
+        case LOAD_HEADER:
+            memcpy(&v, load.buf, sizeof(v));
+            if (v != SNAPSHOT_MAGIC || load.buf[4] != SNAPSHOT_VERSION) return LOAD_ERROR;
+            load.parts = load.buf[5];
+            return load.parts ? LOAD_PART : LOAD_CRC;
+
+        case LOAD_PART:
+            if (load.buf[MAX_LABEL_SIZE - 1] != '\0') return LOAD_ERROR;
+            memcpy(&v, load.buf + MAX_LABEL_SIZE, sizeof(v));
+
+            for (unsigned int i = 0; i < ARRAY_LEN(snapshot_parts); i++) {
+                load.part = snapshot_parts[i];
+                if (strcmp(load.part->dsc->label, (char *)load.buf)) continue;
+
+                // Only parts that have the same size in this firmware version
+                // can be loaded
+                if (v != load.part->dsc->size || v == 0) return LOAD_ERROR;
+                load.written |= 1 << i;
+                load.offset = 0;
+                load.parts--;
+                return LOAD_DATA;
+            }
+            return LOAD_ERROR;
+
+        case LOAD_CRC:
+            memcpy(&v, load.buf, sizeof(v));
+            return v == Crc32Finalize(load.crc) ? LOAD_DONE : LOAD_ERROR;
+
+        default:
+            return LOAD_ERROR;
+    }
+}
+
+
+static size_t field_size(void)
+{
+    switch (load.state) {
+        case LOAD_HEADER: return 8;
+        case LOAD_PART:   return MAX_LABEL_SIZE + sizeof(uint32_t);
+        default:          return sizeof(uint32_t);
+    }
+}
+
+
+/*
+ * Load the next chunk of a snapshot. The data of each part is written to NVM
+ * as it arrives, so that a snapshot of any size can be loaded without buffering
+ * it. Returns -1 if the snapshot is malformed or cannot be written.
+ */
+int nvm_snapshot_load(const void *data, size_t length)
+{
+    const uint8_t *p = data;
+    size_t n;
+
+    while (length && load.state != LOAD_ERROR) {
+        switch (load.state) {
+            case LOAD_DATA:
+                n = load.part->dsc->size - load.offset;
+                if (n > length) n = length;
+
+                load.crc = Crc32Update(load.crc, (uint8_t *)p, n);
+                if (!part_write(load.part, load.offset, p, n)) {
+                    load.state = LOAD_ERROR;
+                    break;
+                }
+
+                load.offset += n;
+                if (load.offset == load.part->dsc->size)
+                    load.state = load.parts ? LOAD_PART : LOAD_CRC;
+                break;
+
+            case LOAD_DONE:
+                // Trailing data after the checksum
+                load.state = LOAD_ERROR;
+                n = 0;
+                break;
+
+            default:
+                n = field_size() - load.len;
+                if (n > length) n = length;
+
+                memcpy(load.buf + load.len, p, n);
+                load.len += n;
+                if (load.len < field_size()) break;
+
+                if (load.state != LOAD_CRC)
+                    load.crc = Crc32Update(load.crc, load.buf, load.len);
+                load.state = load_field();
+                load.len = 0;
+                break;
+        }
+        p += n;
+        length -= n;
+    }
+
+    return load.state == LOAD_ERROR ? -1 : 0;
+}
+
+
+/*
+ * Finish loading a snapshot. If the snapshot is incomplete or its checksum
+ * does not match, the parts written so far are erased, since they may contain
+ * a mix of old and new data, and -1 is returned. The erased parts are
+ * initialized to defaults upon the next boot.
+ */
+int nvm_snapshot_load_finish(void)
+{
+    if (load.state == LOAD_DONE) return 0;
+
+    for (unsigned int i = 0; i < ARRAY_LEN(snapshot_parts); i++) {
+        if (load.written & (1 << i)) part_erase(snapshot_parts[i]);
     }
+    load.state = LOAD_ERROR;
+    return -1;
 }
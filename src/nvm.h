@@ -4,6 +4,17 @@
 #include "part.h"
 
 
+// The number of entries in sysconf.event_filter, one per event type including
+// the pseudo-type CMD_EVENT_ACK
+#define SYSCONF_EVENT_TYPES 11
+
+// The number of entries in sysconf.dl_route
+#define SYSCONF_DL_ROUTES 8
+
+// The value of sysconf.slot_offset that derives the slot from the DevAddr
+#define SYSCONF_SLOT_AUTO 0xffff
+
+
 /* The sysconf data structure is meant to be used for platform configuration
  * (UART parameters, etc.) and for configuration that cannot be stored
  * elsewhere, e.g., the LoRaMAC MIB. Some of the parameters, e.g., device_class,
@@ -12,7 +23,7 @@
 typedef struct sysconf
 {
     /* The baud rate to be used by the ATCI UART interface. The following values
-     * are supported: 1200, 2400, 4800, 9600, 19200, 38400.
+     * are supported: 4800, 9600, 19200, 38400, 57600, 115200.
      */
     unsigned int uart_baudrate;
 
@@ -59,6 +70,24 @@ typedef struct sysconf
      */
     uint8_t async_uart : 1;
 
+    /* When this flag is set to 1, AT+UTX, AT+CTX, AT+PUTX, and AT+PCTX append
+     * the message to an on-modem transmit queue and return its identifier
+     * instead of transmitting right away. The completion of each queued message
+     * is reported with an uplink event. This field occupies a previously unused
+     * bit, so it reads as zero (disabled) on devices upgraded from older
+     * firmware versions.
+     */
+    uint8_t tx_queue : 1;
+
+    /* When this flag is set to 1, +RECV notifications carry per-frame metadata
+     * after the port and length: RSSI, SNR, data rate, frequency, downlink
+     * frame counter, multicast flag, the RTC receive timestamp in ms, and the
+     * multicast group ID (-1 for unicast downlinks). The field occupies the
+     * last unused bit and reads as zero (disabled) on devices upgraded from
+     * older firmware versions.
+     */
+    uint8_t recv_ext : 1;
+
     /* The maximum number of retransmissions of unconfirmed uplink messages.
      * Receiving a downlink message from the network stops retransmissions.
      */
@@ -69,6 +98,215 @@ typedef struct sysconf
      */
     uint8_t confirmed_retransmissions;
 
+    /* The write-behind window (in seconds) for LoRaMac state. Changes to the
+     * state are written to NVM at most this long after they happen, which
+     * allows multiple changes to be written at once. The value 0 writes each
+     * change as soon as possible. This and the following fields were added
+     * after the released layout, which ended with confirmed_retransmissions.
+     * The configuration written by released firmware versions is extended with
+     * the defaults, see nvm_init.
+     */
+    uint8_t nvm_window;
+
+    /* The number of uplink frame counter values reserved in NVM while the
+     * write-behind window is enabled. The saved frame counter is advanced by
+     * this value, so that the device never reuses a frame counter value after
+     * an unexpected reset.
+     */
+    uint8_t nvm_fcnt_margin;
+
+    /* When this flag is set to 1, AT+UTX, AT+CTX, AT+PUTX, and AT+PCTX append
+     * the message to the persistent uplink store in flash memory, from which
+     * it is sent once the network is known to be reachable.
+     */
+    uint8_t tx_store : 1;
+
+    /* When this flag is set to 1, the modem sends an empty uplink as soon as
+     * the duty cycle permits whenever a downlink indicates that the network
+     * has more downlinks queued or that LoRaMac needs to send an uplink, see
+     * AT$AUTOPULL.
+     */
+    uint8_t auto_pull : 1;
+
+    /* When this flag is set to 1, the modem enters the Standby mode instead of
+     * the Stop mode when it has nothing left to do, see AT$STANDBY.
+     */
+    uint8_t standby : 1;
+
+    /* When this flag is set to 1, channels with a poor delivery rate of
+     * confirmed uplinks are temporarily left out of the channel mask, see
+     * AT$CHPOLICY.
+     */
+    uint8_t chpolicy : 1;
+
+    /* The power/latency profile, one of the system_power_profile_t values,
+     * see AT$PWRMODE. The profile only applies while sysconf.sleep is 1.
+     */
+    uint8_t power_profile : 2;
+
+    /* When this flag is set to 1, the RX windows of class A are sized from the
+     * timing of the downlinks received so far at their data rates rather than
+     * from the MCU wakeup latency alone, see AT$RXADAPT.
+     */
+    uint8_t rx_adapt : 1;
+
+    /* When this flag is set to 1, the radio and the TCXO wait in standby
+     * rather than sleep over short gaps between a transmission and the class A
+     * receive windows, see AT$RADIOIDLE.
+     */
+    uint8_t rx_standby : 1;
+
+    /* The class B ping slot periodicity (0-7), see AT$PINGSLOT. The device
+     * opens a ping slot every 2^n seconds and announces the value to the
+     * network whenever it switches to class B, see device_class.
+     */
+    uint8_t ping_slot_periodicity;
+
+    /* The minimum interval (in seconds) between two uplinks sent from the
+     * uplink store. The value 0 sends the messages as fast as the duty cycle
+     * permits.
+     */
+    uint16_t tx_store_interval;
+
+    /* The maximum age (in seconds) of a message in the uplink store. Older
+     * messages are dropped instead of being sent. The value 0 disables the
+     * limit.
+     */
+    uint32_t tx_store_max_age;
+
+    /* Notifications suppressed with AT$EVENTS. Bit n of entry t suppresses
+     * events of type t and subtype n; the entry CMD_EVENT_ACK suppresses +NOACK
+     * (bit 0) and +ACK (bit 1). All bits are zero (every notification enabled)
+     * by default.
+     */
+    uint8_t event_filter[SYSCONF_EVENT_TYPES];
+
+    /* The notification coalescing window (in milliseconds) in the asynchronous
+     * mode. Notifications are held until no further notification has been
+     * generated for this long and then sent in a single burst, see
+     * AT$COALESCE. The value 0 (default) sends each notification right away.
+     */
+    uint16_t uart_coalesce;
+
+    /* The port on which queued uplinks too long for the current data rate are
+     * sent in fragments, see AT$SPLIT. The value 0 (default) disables
+     * fragmentation.
+     */
+    uint8_t split_port;
+
+    /* The port of the autonomous heartbeat uplinks, see AT$HEARTBEAT. The
+     * value 0 (default) disables the heartbeat.
+     */
+    uint8_t hb_port;
+
+    /* The interval (in seconds) between two heartbeat uplinks. The value 0
+     * (default) disables the heartbeat.
+     */
+    uint32_t hb_period;
+
+    /* The maximum deviation of the heartbeat interval from hb_period in
+     * percent, in either direction.
+     */
+    uint8_t hb_jitter;
+
+    /* The items included in the heartbeat payload, a combination of the
+     * heartbeat_content flags from heartbeat.h.
+     */
+    uint8_t hb_content;
+
+    /* The range of user NVM registers included in the heartbeat payload with
+     * HEARTBEAT_USER_NVM.
+     */
+    uint8_t hb_nvm_offset;
+    uint8_t hb_nvm_length;
+
+    /* The active LoRaWAN network profile, see AT$PROFILE.
+     */
+    uint8_t profile;
+
+    /* The US915 or AU915 sub-band (1-8) of the last Join request accepted with
+     * the sub-band learning strategy, see AT$JOINSCHED. The value 0 (default)
+     * means unknown.
+     */
+    uint8_t join_subband;
+
+    /* The airtime budget of uplinks in seconds per 24 hours, see
+     * AT$AIRBUDGET. The value 0 (default) disables the budget.
+     */
+    uint16_t airtime_cap;
+
+    /* The delay (in seconds) before the first modem-driven retransmission of
+     * a queued confirmed uplink, see AT$RTXBACKOFF. The delay doubles with
+     * each further attempt. The value 0 (default) leaves retransmissions to
+     * LoRaMac.
+     */
+    uint16_t rtx_backoff_base;
+
+    /* The upper limit (in seconds) of the retransmission delay */
+    uint16_t rtx_backoff_max;
+
+    /* The random extension of each retransmission delay, in percent of the
+     * delay
+     */
+    uint8_t rtx_backoff_jitter;
+
+    /* The downlink routing table, see AT$DLROUTE. Each entry assigns one of
+     * the lrw_route_t actions to the downlinks received on a port. Entries
+     * with port 0 are unused. Downlinks on ports without an entry are written
+     * to the host. All entries are unused by default.
+     */
+    struct {
+        uint8_t port;
+        uint8_t action;
+    } dl_route[SYSCONF_DL_ROUTES];
+
+    /* The port of remotely executed AT commands, see AT$REMOTE and remote.h.
+     * The value 0 (default) disables remote execution.
+     */
+    uint8_t remote_port;
+
+    /* The length (in seconds) of the uplink slot, see slot_period */
+    uint8_t slot_width;
+
+    /* The period (in seconds) of slotted uplinks, see AT$SLOT. Messages from
+     * the transmit queue only start within the device's slot of each period of
+     * GPS time. The value 0 (default) disables slotting.
+     */
+    uint16_t slot_period;
+
+    /* The start of the device's slot (in seconds) within the period, or
+     * SYSCONF_SLOT_AUTO to derive the slot from the DevAddr
+     */
+    uint16_t slot_offset;
+
+    /* The length (in seconds) of the class C windows of a class A device, see
+     * AT$CLASSC. The value 0 (default) disables the windows.
+     */
+    uint16_t class_c_window;
+
+    /* The events that open a class C window, a combination of the
+     * LRW_CLASS_C_* flags from lrw.h
+     */
+    uint8_t class_c_policy;
+
+    /* The period and start (in seconds) of scheduled class C windows within
+     * GPS time, see LRW_CLASS_C_SCHEDULE
+     */
+    uint32_t class_c_period;
+    uint32_t class_c_offset;
+
+    /* The interval (in seconds) of periodic AppTimeReq uplinks of the clock
+     * synchronization package, see AT$CLKSYNC and clocksync.h. The value 0
+     * (default) disables periodic synchronization.
+     */
+    uint32_t clocksync_period;
+
+    /* The RTC smooth calibration (in units of 2^-20) derived from the clock
+     * corrections of the network, see rtc_set_calibration. The drift of the
+     * crystal survives a reset, so the calibration is applied again at boot.
+     */
+    int16_t rtc_calibration;
+
     uint32_t crc32;
 } sysconf_t;
 
@@ -83,10 +321,27 @@ struct nvm_parts {
     part_t region2;
     part_t classb;
     part_t user;
+    part_t journal;
+    part_t regions;
 };
 
 
-#define USER_NVM_MAX_SIZE 64   // The maximum number of NVM user data registers
+/* The LoRaMac state groups are kept in shadow parts (see part_shadow_t), so
+ * that an interrupted write never leaves a group half-written. RegionGroup2 is
+ * the exception: two copies of it do not fit into the EEPROM next to the
+ * journal.
+ */
+struct nvm_shadows {
+    part_shadow_t crypto;
+    part_shadow_t mac1;
+    part_shadow_t mac2;
+    part_shadow_t se;
+    part_shadow_t region1;
+    part_shadow_t classb;
+};
+
+
+#define USER_NVM_MAX_SIZE 256  // The maximum number of NVM user data registers
 #define USER_NVM_MAGIC    0xD15C9101
 
 typedef struct user_nvm_s {
@@ -96,18 +351,92 @@ typedef struct user_nvm_s {
 } user_nvm_t;
 
 
+/* The LoRaWAN session of a region the device has left, see lrw_set_region.
+ * Switching back to the region restores the session without a new Join. The
+ * arrays are sized for the regions with a dynamic channel plan (16 channels)
+ * and for the channel mask of the 72-channel regions.
+ */
+#define REGION_CACHE_ENTRIES  2
+#define REGION_CACHE_CHANNELS 16
+#define REGION_CACHE_KEYS     4  // FNwkSIntKey, SNwkSIntKey, NwkSEncKey, AppSKey
+
+typedef struct region_session_s {
+    uint8_t     region;
+    uint8_t     activation;     // ActivationType_t of the session
+    uint8_t     seq;            // Higher values were saved more recently
+    uint8_t     rx1_dr_offset;
+    uint32_t    rx2_frequency;
+    uint8_t     rx2_datarate;
+    uint8_t     profile;        // The network profile the session belongs to
+    uint8_t     unused[2];
+    uint32_t    version;        // LoRaWAN version of the session
+    uint32_t    dev_addr;
+    uint32_t    net_id;
+    uint32_t    fcnt_up;
+    uint32_t    nfcnt_down;
+    uint32_t    afcnt_down;
+    uint32_t    fcnt_down;
+    uint8_t     keys[REGION_CACHE_KEYS][16];
+    uint32_t    frequency[REGION_CACHE_CHANNELS];  // 0 if the channel is not defined
+    uint8_t     dr_range[REGION_CACHE_CHANNELS];
+    uint16_t    mask[6];
+    uint32_t    crc32;
+} region_session_t;
+
+
 extern struct nvm_parts nvm_parts;
+extern struct nvm_shadows nvm_shadows;
+extern part_journal_t nvm_journal;
 extern sysconf_t sysconf;
 extern bool sysconf_modified;
 extern uint16_t nvm_flags;
-extern user_nvm_t user_nvm;
 
 void nvm_init(void);
 
+// True if nvm_init has restored the NVM state kept by nvm_retain. The contents
+// of the parts are then known to be intact and need not be validated again.
+extern bool nvm_warm;
+
+// Keep the state of the opened parts (see nvm_parts, nvm_shadows, nvm_journal)
+// in RAM that survives a software reset, so that the next boot can skip the
+// validation of NVM. Nothing is kept if an NVM write is pending or in
+// progress. To be invoked right before NVIC_SystemReset.
+void nvm_retain(void);
+
 int nvm_erase(void);
 
+// Write the system configuration to NVM once SYSCONF_COMMIT_DELAY ms have
+// passed since it was modified, unless a transaction is open. To be invoked
+// from the main loop.
 void sysconf_process(void);
 
-void nvm_update_user_data(void);
+// Write the modified system configuration to NVM right away, e.g., before a
+// reset. Writes the configuration even if a transaction is open.
+void sysconf_flush(void);
+
+// Open a transaction. The modified system configuration is not written to NVM
+// until sysconf_commit (or sysconf_flush) is invoked.
+void sysconf_begin(void);
+
+// Close the transaction and write the modified system configuration to NVM
+void sysconf_commit(void);
+
+// Return true if the system configuration has been modified but not written
+// to NVM yet. Sets transaction to true if a transaction is open.
+bool sysconf_pending(bool *transaction);
+
+// Return a pointer to the USER_NVM_MAX_SIZE user data registers in NVM
+const uint8_t *nvm_user_data(void);
+
+bool nvm_write_user_data(size_t offset, const void *data, size_t length);
+
+// Write a snapshot of the NVM configuration through the output callback. The
+// secure element part (keys) is only included if keys is true.
+void nvm_snapshot_dump(void (*output)(const void *buffer, size_t length), bool keys);
+
+// Load a snapshot created by nvm_snapshot_dump chunk by chunk
+void nvm_snapshot_load_start(void);
+int nvm_snapshot_load(const void *data, size_t length);
+int nvm_snapshot_load_finish(void);
 
 #endif // _NVM_H_
@@ -0,0 +1,374 @@
+#include "p2p.h"
+#include <string.h>
+#include <loramac-node/src/radio/radio.h>
+#include <LoRaWAN/Utilities/timeServer.h>
+#include "lrw.h"
+#include "atci.h"
+#include "cmd.h"
+#include "lpuart.h"
+#include "nvm.h"
+#include "rtc.h"
+#include "irq.h"
+#include "system.h"
+#include "log.h"
+#include "pool.h"
+
+
+// The number of received packets kept until they have been written to the host.
+// The payload of each packet is kept in a block from the message pool.
+#ifndef P2P_RX_QUEUE_SIZE
+#define P2P_RX_QUEUE_SIZE 8
+#endif
+
+// A transmission that has not completed this many milliseconds after its time
+// on air is reported as timed out
+#define TX_TIMEOUT_MARGIN 1000
+
+// How long to wait for room in the LPUART TX FIFO before the next attempt to
+// write a received packet to the host (ms)
+#define RX_QUEUE_RETRY_INTERVAL 20
+
+// See radio.c
+void radio_set_events(const RadioEvents_t *events);
+extern uint32_t radio_rx_time;
+
+typedef struct {
+    uint32_t timestamp;  // RTC time in ms
+    int16_t rssi;
+    int8_t snr;
+    uint8_t length;
+    uint8_t *payload;    // NULL if empty
+} rx_packet_t;
+
+static p2p_config_t config = {
+    .frequency = 0,
+    .sf = 7,
+    .bandwidth = 0,
+    .coderate = 1,
+    .power = 14,
+    .preamble = 8
+};
+
+static struct {
+    rx_packet_t slot[P2P_RX_QUEUE_SIZE];
+    uint8_t head;
+    uint8_t count;
+    bool dropped;
+} rx_queue;
+
+static p2p_stats_t stats;
+static TimerEvent_t rx_queue_timer;
+
+static bool parked;
+static bool rx_enabled;
+static volatile bool tx_busy;
+
+// The events of another module that has claimed the parked radio, see p2p_claim
+static const RadioEvents_t *claimant;
+
+// The +EVENT=11 subtype of a completed transmission not reported yet, -1 if none
+static volatile int tx_status = -1;
+
+
+static void on_tx_done(void)
+{
+    tx_busy = false;
+    tx_status = CMD_P2P_TX_DONE;
+    system_post(SYSTEM_TASK_LORA);
+}
+
+
+static void on_tx_timeout(void)
+{
+    tx_busy = false;
+    tx_status = CMD_P2P_TX_TIMEOUT;
+    system_post(SYSTEM_TASK_LORA);
+}
+
+
+static void on_rx_done(uint8_t *payload, uint16_t size, int16_t rssi, int8_t snr)
+{
+    rx_packet_t *p;
+    uint8_t *block = NULL;
+
+    if (size > P2P_MAX_PAYLOAD) size = P2P_MAX_PAYLOAD;
+    if (size && rx_queue.count < P2P_RX_QUEUE_SIZE) block = pool_alloc(size, POOL_P2P);
+
+    if (rx_queue.count == P2P_RX_QUEUE_SIZE || (size && block == NULL)) {
+        stats.dropped++;
+        rx_queue.dropped = true;
+    } else {
+        p = &rx_queue.slot[(rx_queue.head + rx_queue.count) % P2P_RX_QUEUE_SIZE];
+        p->timestamp = rtc_tick2ms(radio_rx_time);
+        p->rssi = rssi;
+        p->snr = snr;
+        p->length = size;
+        p->payload = block;
+        memcpy(p->payload, payload, p->length);
+        rx_queue.count++;
+        stats.received++;
+    }
+    system_post(SYSTEM_TASK_LORA);
+}
+
+
+// The radio stays in the continuous receive mode after a CRC error
+static void on_rx_error(void)
+{
+    stats.errors++;
+}
+
+
+// Continuous reception does not time out, but restart it just in case
+static void on_rx_timeout(void)
+{
+    if (rx_enabled && !tx_busy) Radio.Rx(0);
+}
+
+
+static RadioEvents_t events = {
+    .TxDone = on_tx_done,
+    .TxTimeout = on_tx_timeout,
+    .RxDone = on_rx_done,
+    .RxTimeout = on_rx_timeout,
+    .RxError = on_rx_error
+};
+
+
+static void on_rx_queue_timer(void *ctx)
+{
+    (void)ctx;
+    system_post(SYSTEM_TASK_LORA);
+}
+
+
+static int park(void)
+{
+    LoRaMacStatus_t rc;
+
+    if (parked) return LORAMAC_STATUS_OK;
+
+    // In class B and C, LoRaMac would not reopen its receive windows after
+    // LoRaMacStart
+    if (lrw_get_class() != CLASS_A) return LORAMAC_STATUS_BUSY;
+
+    rc = LoRaMacStop();
+    if (rc != LORAMAC_STATUS_OK) return rc;
+
+    radio_set_events(&events);
+    Radio.SetPublicNetwork(false);
+    Radio.SetMaxPayloadLength(MODEM_LORA, P2P_MAX_PAYLOAD);
+    parked = true;
+    log_debug("P2P: LoRaMac parked");
+    return LORAMAC_STATUS_OK;
+}
+
+
+static void unpark(void)
+{
+    MibRequestConfirm_t r = { .Type = MIB_PUBLIC_NETWORK };
+
+    LoRaMacMibGetRequestConfirm(&r);
+    Radio.SetPublicNetwork(r.Param.EnablePublicNetwork);
+    Radio.Sleep();
+    radio_set_events(NULL);
+    parked = false;
+
+    LoRaMacStart();
+    log_debug("P2P: LoRaMac started");
+}
+
+
+static void start_rx(void)
+{
+    Radio.Standby();
+    Radio.SetChannel(config.frequency);
+    Radio.SetRxConfig(MODEM_LORA, config.bandwidth, config.sf, config.coderate, 0,
+        config.preamble, 0, false, 0, true, false, 0, false, true);
+    Radio.Rx(0);
+}
+
+
+void p2p_init(void)
+{
+    TimerInit(&rx_queue_timer, on_rx_queue_timer);
+}
+
+
+void p2p_get_config(p2p_config_t *dst)
+{
+    *dst = config;
+}
+
+
+int p2p_set_config(const p2p_config_t *src)
+{
+    if (src->sf < 7 || src->sf > 12) return LORAMAC_STATUS_PARAMETER_INVALID;
+    if (src->bandwidth > 2) return LORAMAC_STATUS_PARAMETER_INVALID;
+    if (src->coderate < 1 || src->coderate > 4) return LORAMAC_STATUS_PARAMETER_INVALID;
+    if (!Radio.CheckRfFrequency(src->frequency)) return LORAMAC_STATUS_FREQUENCY_INVALID;
+
+    config = *src;
+    if (parked && rx_enabled && !tx_busy) start_rx();
+    return LORAMAC_STATUS_OK;
+}
+
+
+int p2p_send(const void *buffer, size_t length)
+{
+    uint32_t toa;
+    int rc;
+
+    if (claimant) return LORAMAC_STATUS_BUSY;
+    if (config.frequency == 0) return LORAMAC_STATUS_PARAMETER_INVALID;
+    if (length == 0 || length > P2P_MAX_PAYLOAD) return LORAMAC_STATUS_LENGTH_ERROR;
+    if (tx_busy || tx_status >= 0) return LORAMAC_STATUS_BUSY;
+
+    rc = park();
+    if (rc != LORAMAC_STATUS_OK) return rc;
+
+    toa = Radio.TimeOnAir(MODEM_LORA, config.bandwidth, config.sf, config.coderate,
+        config.preamble, false, length, true);
+
+    Radio.Standby();
+    Radio.SetChannel(config.frequency);
+    Radio.SetTxConfig(MODEM_LORA, config.power, 0, config.bandwidth, config.sf,
+        config.coderate, config.preamble, false, true, false, 0, false,
+        toa + TX_TIMEOUT_MARGIN);
+
+    tx_busy = true;
+    Radio.Send((uint8_t *)buffer, length);
+    return LORAMAC_STATUS_OK;
+}
+
+
+int p2p_receive(bool enable)
+{
+    int rc;
+
+    if (!enable) {
+        rx_enabled = false;
+        if (parked && !claimant && !tx_busy) Radio.Sleep();
+        system_post(SYSTEM_TASK_LORA);
+        return LORAMAC_STATUS_OK;
+    }
+
+    if (claimant) return LORAMAC_STATUS_BUSY;
+    if (config.frequency == 0) return LORAMAC_STATUS_PARAMETER_INVALID;
+
+    rc = park();
+    if (rc != LORAMAC_STATUS_OK) return rc;
+
+    rx_enabled = true;
+    if (!tx_busy) start_rx();
+    return LORAMAC_STATUS_OK;
+}
+
+
+bool p2p_receiving(void)
+{
+    return rx_enabled;
+}
+
+
+int p2p_claim(const RadioEvents_t *owner)
+{
+    int rc;
+
+    if (claimant) return claimant == owner ? LORAMAC_STATUS_OK : LORAMAC_STATUS_BUSY;
+    if (rx_enabled || tx_busy || tx_status >= 0) return LORAMAC_STATUS_BUSY;
+
+    rc = park();
+    if (rc != LORAMAC_STATUS_OK) return rc;
+
+    Radio.Standby();
+    radio_set_events(owner);
+    claimant = owner;
+    return LORAMAC_STATUS_OK;
+}
+
+
+void p2p_release(void)
+{
+    if (!claimant) return;
+
+    Radio.Sleep();
+    radio_set_events(&events);
+    claimant = NULL;
+
+    // Have p2p_process return the radio to LoRaMac
+    system_post(SYSTEM_TASK_LORA);
+}
+
+
+void p2p_get_stats(p2p_stats_t *dst)
+{
+    uint32_t mask = disable_irq();
+    *dst = stats;
+    reenable_irq(mask);
+}
+
+
+static bool have_output_space(size_t length)
+{
+    if (atci_is_framed()) length = 2 * length + 8;
+    if (length > lpuart_tx_fifo.max_length) length = lpuart_tx_fifo.max_length;
+    return cbuf_space(&lpuart_tx_fifo) >= length;
+}
+
+
+static void drain_rx_queue(void)
+{
+    rx_packet_t *p;
+    uint32_t mask;
+
+    if (rx_queue.dropped) {
+        rx_queue.dropped = false;
+        cmd_event(CMD_EVENT_P2P, CMD_P2P_RX_DROPPED);
+    }
+
+    while (rx_queue.count) {
+        p = &rx_queue.slot[rx_queue.head];
+
+        // +P2PRX=lll,rssi,snr,timestamp, two blank lines, the payload, and CRLF
+        if (!have_output_space(36 + (sysconf.data_format ? 2 : 1) * p->length)) {
+            TimerStop(&rx_queue_timer);
+            TimerSetValue(&rx_queue_timer, RX_QUEUE_RETRY_INTERVAL);
+            TimerStart(&rx_queue_timer);
+            return;
+        }
+
+        atci_frame_open(0);
+        atci_printf("+P2PRX=%d,%d,%d,%lu\r\n\r\n", p->length, p->rssi, p->snr, p->timestamp);
+        if (sysconf.data_format) {
+            atci_print_buffer_as_hex(p->payload, p->length);
+        } else {
+            atci_write((const char *)p->payload, p->length);
+        }
+        atci_write("\r\n", 2);
+        atci_frame_close();
+
+        pool_free(p->payload);
+        mask = disable_irq();
+        rx_queue.head = (rx_queue.head + 1) % P2P_RX_QUEUE_SIZE;
+        rx_queue.count--;
+        reenable_irq(mask);
+    }
+}
+
+
+void p2p_process(void)
+{
+    int status = tx_status;
+
+    if (status >= 0) {
+        tx_status = -1;
+        cmd_event(CMD_EVENT_P2P, status);
+        if (rx_enabled) start_rx();
+    }
+
+    // Packets received before reception was stopped are still delivered
+    drain_rx_queue();
+
+    if (parked && !claimant && !rx_enabled && !tx_busy && tx_status < 0) unpark();
+}
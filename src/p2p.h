@@ -0,0 +1,99 @@
+#ifndef _P2P_H
+#define _P2P_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <loramac-node/src/radio/radio.h>
+
+//! @brief The largest payload of a raw LoRa packet
+#define P2P_MAX_PAYLOAD 255
+
+//! @brief Raw LoRa point-to-point link parameters
+typedef struct
+{
+    uint32_t frequency;  // Hz, 0 until configured
+    uint8_t sf;          // Spreading factor, 7-12
+    uint8_t bandwidth;   // 0: 125 kHz, 1: 250 kHz, 2: 500 kHz
+    uint8_t coderate;    // 1: 4/5, 2: 4/6, 3: 4/7, 4: 4/8
+    int8_t power;        // Transmission power in dBm
+    uint16_t preamble;   // Preamble length in symbols
+} p2p_config_t;
+
+//! @brief Reception statistics since boot
+typedef struct
+{
+    uint32_t received;   // Packets received with a valid CRC
+    uint32_t errors;     // Packets dropped by the radio due to a CRC error
+    uint32_t dropped;    // Packets dropped because the queue was full
+} p2p_stats_t;
+
+/*! @brief Point-to-point mode
+ *
+ * The P2P engine drives the radio directly with raw LoRa packets, without the
+ * LoRaWAN MAC layer. The first transmission or the start of reception parks
+ * LoRaMac with LoRaMacStop and takes over the radio events. Once reception has
+ * been stopped and the last transmission has completed, the radio is returned
+ * to LoRaMac and LoRaMac is started again. LoRaWAN commands fail with ERR_BUSY
+ * in the meantime.
+ *
+ * P2P packets use the private sync word and non-inverted IQ in both
+ * directions, so they are not picked up by LoRaWAN gateways. The engine does
+ * not enforce duty cycle limits; the host is responsible for complying with
+ * the regulations of the band it uses.
+ */
+
+//! @brief Initialize the P2P engine. Invoked from lrw_init.
+
+void p2p_init(void);
+
+//! @brief Get the link parameters
+//! @param[out] config Destination
+
+void p2p_get_config(p2p_config_t *config);
+
+//! @brief Set the link parameters. An ongoing reception is restarted with the
+//! new parameters.
+//! @return Zero on success, a @c LoRaMacStatus_t value on error
+
+int p2p_set_config(const p2p_config_t *config);
+
+//! @brief Transmit a packet. Completion is reported with +EVENT=11,0 (or
+//! +EVENT=11,1 on timeout). Reception, if enabled, resumes afterwards.
+//! @return Zero on success, a @c LoRaMacStatus_t value on error
+
+int p2p_send(const void *buffer, size_t length);
+
+//! @brief Start or stop continuous reception. Each received packet is queued
+//! and written to the host as +P2PRX from the main loop.
+//! @return Zero on success, a @c LoRaMacStatus_t value on error
+
+int p2p_receive(bool enable);
+
+//! @brief Return true if continuous reception is enabled
+
+bool p2p_receiving(void);
+
+//! @brief Get the reception statistics
+//! @param[out] stats Destination
+
+void p2p_get_stats(p2p_stats_t *stats);
+
+//! @brief Park LoRaMac and hand the radio events over to another module, e.g.,
+//! the FSK bulk transfer in bulk.c. P2P transmission and reception fail with
+//! LORAMAC_STATUS_BUSY until the radio is released with p2p_release.
+//! @param[in] owner Radio event handlers of the claiming module
+//! @return Zero on success, a @c LoRaMacStatus_t value on error
+
+int p2p_claim(const RadioEvents_t *owner);
+
+//! @brief Put the radio to sleep and return it to LoRaMac from p2p_process
+
+void p2p_release(void);
+
+//! @brief Report completed transmissions and received packets to the host and
+//! return the radio to LoRaMac once idle. Invoked from lrw_process.
+
+void p2p_process(void);
+
+#endif // _P2P_H
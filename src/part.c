@@ -1,5 +1,6 @@
 #include "part.h"
 #include <string.h>
+#include <LoRaWAN/Utilities/utilities.h>
 #include "log.h"
 
 #define PART_BLOCK_SIGNATURE ((uint32_t)0x1ABE11ED)
@@ -182,6 +183,189 @@ int part_create(part_t *part, const part_block_t *block, const char *label, size
 }
 
 
+/* Check in a single pass that the partition table of the block consists of
+ * exactly the parts of the given layout, in the given order, with the given
+ * sizes, and at the offsets part_create would have assigned to them. If so,
+ * all parts of the layout are resolved and 0 is returned. Otherwise, no part
+ * is modified and the caller needs to fall back to part_find and part_create,
+ * e.g., to migrate a table created by an older firmware version.
+ */
+int part_open_layout(const part_block_t *block, const part_layout_t *layout, unsigned int n)
+{
+    if (BLOCK_CLOSED(block)) return -1;
+
+    if (layout == NULL) return -2;
+
+    if (block->table->num_parts != n) return 1;
+
+    uint32_t start = PART_ALIGN(block->table->size);
+    for (unsigned int i = 0; i < n; i++) {
+        const part_dsc_t *d = block->parts + i;
+        size_t len = strlen(layout[i].label);
+
+        if (d->start != start || d->size != layout[i].size ||
+            d->start + d->size > block->size ||
+            len >= MAX_LABEL_SIZE || memcmp(d->label, layout[i].label, len + 1))
+            return 1;
+
+        start = PART_ALIGN(d->start + d->size);
+    }
+
+    for (unsigned int i = 0; i < n; i++) {
+        layout[i].part->block = block;
+        layout[i].part->dsc = block->parts + i;
+    }
+    return 0;
+}
+
+
+// Copy length bytes within the block from offset src to offset dst. The
+// ranges may overlap, the copy is performed in the direction that does not
+// overwrite source data before it has been copied.
+static bool move(const part_block_t *block, uint32_t dst, uint32_t src, size_t length)
+{
+    const uint8_t *p = block->mmap(src, length);
+    uint32_t v;
+    size_t i, n;
+
+    if (p == NULL) return false;
+    if (dst == src || length == 0) return true;
+
+    for (i = 0; i < length; i += sizeof(v)) {
+        // Walk backwards if the destination follows the source
+        size_t o = dst < src ? i : (length - 1) / sizeof(v) * sizeof(v) - i;
+        n = length - o < sizeof(v) ? length - o : sizeof(v);
+        memcpy(&v, p + o, n);
+        if (!block->write(dst + o, &v, n)) return false;
+    }
+    return true;
+}
+
+
+// Erase a range of the block. Uses the erase operation of the block if it has
+// one, otherwise the range is overwritten with 0xff bytes.
+static bool erase_range(const part_block_t *block, uint32_t start, size_t length)
+{
+    uint32_t v = EMPTY;
+
+    if (length == 0) return true;
+    if (block->erase != NULL) return block->erase(start, length);
+
+    for (size_t i = 0; i < length; i += sizeof(v)) {
+        if (!block->write(start + i, &v, length - i < sizeof(v) ? length - i : sizeof(v)))
+            return false;
+    }
+    return true;
+}
+
+
+/* Rebuild the partition table of the block so that it matches the given
+ * layout, preserving the data of the parts that exist both in the current
+ * table and in the layout (matched by label). Parts that grow are padded with
+ * erased bytes, parts that shrink are truncated, parts missing from the
+ * current table are created empty, and parts not in the layout are dropped.
+ *
+ * The data is moved within the block in place. Parts moving towards the start
+ * of the block are copied first in ascending order, parts moving towards the
+ * end then in descending order, so that no part overwrites data of another
+ * part that has not been moved yet. The table signature is invalidated before
+ * any data is moved and written again only after the new table is complete.
+ * If the migration is interrupted, the block thus has no valid partition table
+ * and will be formatted on the next boot, i.e., the result is never worse than
+ * erasing the block.
+ *
+ * On success, the block is reopened and all parts of the layout are resolved
+ * as with part_open_layout.
+ */
+int part_migrate_layout(part_block_t *block, const part_layout_t *layout, unsigned int n)
+{
+    struct {
+        uint32_t start;
+        size_t size;
+    } src[PART_MAX_LAYOUT], dst[PART_MAX_LAYOUT];
+    unsigned int i, j;
+    size_t len;
+
+    if (BLOCK_CLOSED(block)) return -1;
+
+    if (layout == NULL || n == 0 || n > PART_MAX_LAYOUT || block->write == NULL)
+        return -2;
+
+    uint32_t table_size = FIXED_PART_TABLE_SIZE + sizeof(part_dsc_t) * n;
+    uint32_t start = PART_ALIGN(table_size);
+
+    for (i = 0; i < n; i++) {
+        len = strlen(layout[i].label);
+        if (len >= MAX_LABEL_SIZE) return -3;
+
+        src[i].size = 0;
+        for (j = 0; j < block->table->num_parts; j++) {
+            const part_dsc_t *d = block->parts + j;
+            if (memcmp(d->label, layout[i].label, len + 1)) continue;
+            src[i].start = d->start;
+            src[i].size = d->size < layout[i].size ? d->size : layout[i].size;
+            break;
+        }
+
+        // The moves below rely on the parts keeping their relative order
+        for (j = i; src[i].size && j-- > 0;) {
+            if (src[j].size == 0) continue;
+            if (src[j].start > src[i].start) return -4;
+            break;
+        }
+
+        dst[i].start = start;
+        dst[i].size = layout[i].size;
+        if (start + dst[i].size > block->size) return -5;
+        start = PART_ALIGN(start + dst[i].size);
+    }
+
+    log_debug("part: Migrating block %p to a new layout with %d parts", (void *)block, n);
+
+    uint32_t sig = EMPTY;
+    if (!block->write(block->start, &sig, sizeof(sig))) return -6;
+
+    for (i = 0; i < n; i++) {
+        if (src[i].size == 0 || dst[i].start > src[i].start) continue;
+        if (!move(block, dst[i].start, src[i].start, src[i].size)) return -7;
+    }
+
+    for (i = n; i-- > 0;) {
+        if (src[i].size == 0 || dst[i].start <= src[i].start) continue;
+        if (!move(block, dst[i].start, src[i].start, src[i].size)) return -7;
+    }
+
+    // Erase the remainder of each part only after all data has been moved,
+    // since it may overlap the original location of a following part
+    for (i = 0; i < n; i++) {
+        if (!erase_range(block, dst[i].start + src[i].size, dst[i].size - src[i].size))
+            return -8;
+    }
+
+    for (i = 0; i < n; i++) {
+        part_dsc_t d = {
+            .start = dst[i].start,
+            .size = dst[i].size
+        };
+        memset(d.label, 0, sizeof(d.label));
+        memcpy(d.label, layout[i].label, strlen(layout[i].label) + 1);
+        if (!block->write(block->start + FIXED_PART_TABLE_SIZE + i * sizeof(d), &d, sizeof(d)))
+            return -9;
+    }
+
+    part_table_t table = {
+        .signature = PART_BLOCK_SIGNATURE,
+        .size = table_size,
+        .num_parts = n
+    };
+    if (!block->write(block->start, &table, sizeof(table))) return -10;
+
+    part_close_block(block);
+    if (part_open_block(block) != 0) return -11;
+    return part_open_layout(block, layout, n);
+}
+
+
 int part_dump_block(part_block_t *block)
 {
     if (BLOCK_CLOSED(block)) return -1;
@@ -207,20 +391,25 @@ bool part_write(const part_t *part, uint32_t address, const void *buffer, size_t
 }
 
 
-bool part_erase(const part_t *part)
+bool part_write_async(const part_t *part, uint32_t address, const void *buffer, size_t length)
 {
-    int rv = 1;
-    uint32_t v = EMPTY;
+    if (part == NULL || BLOCK_CLOSED(part->block)) return false;
+
+    if (address + length > part->dsc->size) return false;
+
+    if (part->block->write_async == NULL)
+        return part->block->write(part->dsc->start + address, buffer, length);
 
+    return part->block->write_async(part->dsc->start + address, buffer, length);
+}
+
+
+bool part_erase(const part_t *part)
+{
     if (part == NULL || BLOCK_CLOSED(part->block)) return false;
     log_debug("part: Erasing part %s", part->dsc->label);
 
-    for (unsigned int i = 0; i < part->dsc->size; i += sizeof(v)) {
-        rv &= part->block->write(part->dsc->start + i, &v,
-            (part->dsc->size - i) >= sizeof(v) ? sizeof(v) : (part->dsc->size - i));
-    }
-
-    return rv == 1;
+    return erase_range(part->block, part->dsc->start, part->dsc->size);
 }
 
 
@@ -231,3 +420,592 @@ const void *part_mmap(size_t *size, const part_t *part)
     *size = part->dsc->size;
     return part->block->mmap(part->dsc->start, part->dsc->size);
 }
+
+
+static uint32_t record_crc(uint32_t seq, const void *record, size_t size)
+{
+    uint32_t s = Crc32Init();
+    s = Crc32Update(s, (uint8_t *)&seq, sizeof(seq));
+    s = Crc32Update(s, (uint8_t *)record, size);
+    return Crc32Finalize(s);
+}
+
+
+int part_journal_open(part_journal_t *journal, const part_t *part, size_t record_size)
+{
+    size_t size;
+    uint32_t seq, crc;
+
+    if (journal == NULL) return -1;
+    memset(journal, 0, sizeof(*journal));
+
+    if (part == NULL || BLOCK_CLOSED(part->block)) return -2;
+    if (record_size == 0 || record_size > PART_JOURNAL_MAX_RECORD_SIZE) return -3;
+
+    const uint8_t *p = part_mmap(&size, part);
+    if (p == NULL) return -4;
+
+    journal->part = *part;
+    journal->record_size = record_size;
+    journal->slot_size = PART_JOURNAL_SLOT_SIZE(record_size);
+    journal->slots = size / journal->slot_size;
+
+    // A journal with a single slot would overwrite its only valid record
+    if (journal->slots < 2) return -5;
+
+    for (size_t i = 0; i < journal->slots; i++) {
+        const uint8_t *slot = p + i * journal->slot_size;
+
+        memcpy(&seq, slot, sizeof(seq));
+        if (seq == EMPTY) continue;
+
+        memcpy(&crc, slot + journal->slot_size - sizeof(crc), sizeof(crc));
+        if (record_crc(seq, slot + sizeof(seq), record_size) != crc) continue;
+
+        // Sequence numbers only grow, so the most recent record is the one
+        // with the highest sequence number.
+        if (!journal->valid || seq > journal->seq) {
+            journal->valid = true;
+            journal->seq = seq;
+            journal->latest = i;
+        }
+    }
+
+    log_debug("part: Opened journal in part '%s', %d slots, latest: %ld",
+        part->dsc->label, journal->slots, journal->valid ? (long)journal->latest : -1L);
+    return 0;
+}
+
+
+const void *part_journal_read(const part_journal_t *journal)
+{
+    size_t size;
+
+    if (journal == NULL || !journal->valid) return NULL;
+
+    const uint8_t *p = part_mmap(&size, &journal->part);
+    if (p == NULL) return NULL;
+
+    return p + journal->latest * journal->slot_size + sizeof(uint32_t);
+}
+
+
+// The slot is written with a single (possibly background) write from the
+// journal's image buffer. The caller must make sure that the previous write has
+// finished before the journal is appended to again.
+bool part_journal_append(part_journal_t *journal, const void *record)
+{
+    if (journal == NULL || journal->slots == 0) return false;
+
+    size_t slot = journal->valid ? (journal->latest + 1) % journal->slots : 0;
+    uint32_t seq = journal->valid ? journal->seq + 1 : 0;
+    uint32_t crc = record_crc(seq, record, journal->record_size);
+
+    // The checksum covers both the sequence number and the record. If the
+    // write below is interrupted, the slot will be ignored upon reboot and the
+    // previous record will be used instead.
+    memset(journal->image, 0, journal->slot_size);
+    memcpy(journal->image, &seq, sizeof(seq));
+    memcpy(journal->image + sizeof(seq), record, journal->record_size);
+    memcpy(journal->image + journal->slot_size - sizeof(crc), &crc, sizeof(crc));
+
+    if (!part_write_async(&journal->part, slot * journal->slot_size, journal->image,
+        journal->slot_size))
+        return false;
+
+    journal->valid = true;
+    journal->seq = seq;
+    journal->latest = slot;
+    return true;
+}
+
+
+// The trailer at the end of each bank of a shadow part holds the sequence
+// number and the checksum of the record in the bank
+#define SHADOW_TRAILER_SIZE (2 * sizeof(uint32_t))
+
+
+static bool shadow_check(const part_shadow_t *shadow, const uint8_t *p, unsigned int bank)
+{
+    uint32_t trailer[2];
+    const uint8_t *b = p + bank * shadow->bank_size;
+
+    memcpy(trailer, b + shadow->bank_size - SHADOW_TRAILER_SIZE, sizeof(trailer));
+    return record_crc(trailer[0], b, shadow->record_size) == trailer[1];
+}
+
+
+int part_shadow_open(part_shadow_t *shadow, const part_t *part, size_t record_size)
+{
+    size_t size;
+    uint32_t seq[2];
+    unsigned int newer;
+
+    if (shadow == NULL) return -1;
+    memset(shadow, 0, sizeof(*shadow));
+
+    if (part == NULL || BLOCK_CLOSED(part->block)) return -2;
+
+    const uint8_t *p = part_mmap(&size, part);
+    if (p == NULL) return -3;
+
+    shadow->part = *part;
+    shadow->record_size = record_size;
+    shadow->bank_size = size / 2 / PART_ALIGNMENT * PART_ALIGNMENT;
+
+    if (record_size == 0 || record_size + SHADOW_TRAILER_SIZE > shadow->bank_size) {
+        memset(shadow, 0, sizeof(*shadow));
+        return -4;
+    }
+
+    for (unsigned int i = 0; i < 2; i++)
+        memcpy(&seq[i], p + (i + 1) * shadow->bank_size - SHADOW_TRAILER_SIZE, sizeof(seq[i]));
+
+    // Sequence numbers only grow (modulo wrap-around), so a single comparison
+    // tells which bank holds the most recent record. Only that bank's checksum
+    // is verified. The other bank is only examined if the most recent commit
+    // was interrupted.
+    newer = (int32_t)(seq[1] - seq[0]) > 0;
+    if (shadow_check(shadow, p, newer)) {
+        shadow->valid = true;
+        shadow->latest = newer;
+    } else if (shadow_check(shadow, p, !newer)) {
+        shadow->valid = true;
+        shadow->latest = !newer;
+    }
+    shadow->seq = seq[shadow->latest];
+
+    log_debug("part: Opened shadow part '%s', latest bank: %c", part->dsc->label,
+        shadow->valid ? 'A' + shadow->latest : '-');
+    return 0;
+}
+
+
+// If neither bank holds a committed record, the record in bank A is returned.
+// Bank A starts at the beginning of the part and thus holds the data of a part
+// written before it had shadow copies, e.g., by an older firmware version. The
+// caller is expected to validate the record in that case.
+const void *part_shadow_read(const part_shadow_t *shadow)
+{
+    size_t size;
+
+    if (shadow == NULL || shadow->bank_size == 0) return NULL;
+
+    const uint8_t *p = part_mmap(&size, &shadow->part);
+    if (p == NULL) return NULL;
+
+    return p + shadow->latest * shadow->bank_size;
+}
+
+
+// The record is written into the bank that does not hold the most recent
+// record. Without a committed record, that is bank B, which leaves any data
+// written before the part had shadow copies in bank A intact.
+static bool shadow_write(part_shadow_t *shadow, const void *record, bool async)
+{
+    uint32_t address;
+
+    if (shadow == NULL || shadow->bank_size == 0) return false;
+
+    address = (shadow->latest ^ 1) * shadow->bank_size;
+
+    shadow->trailer[0] = shadow->seq + 1;
+    shadow->trailer[1] = record_crc(shadow->trailer[0], record, shadow->record_size);
+    shadow->pending = true;
+
+    return async ?
+        part_write_async(&shadow->part, address, record, shadow->record_size) :
+        part_write(&shadow->part, address, record, shadow->record_size);
+}
+
+
+// The trailer is written from the shadow structure, so that it remains valid
+// until a background write finishes. The checksum is its last word.
+static bool shadow_commit(part_shadow_t *shadow, bool async)
+{
+    unsigned int bank;
+    uint32_t address;
+    bool rv;
+
+    if (shadow == NULL || !shadow->pending) return false;
+
+    bank = shadow->latest ^ 1;
+    address = (bank + 1) * shadow->bank_size - SHADOW_TRAILER_SIZE;
+    shadow->pending = false;
+
+    rv = async ?
+        part_write_async(&shadow->part, address, shadow->trailer, sizeof(shadow->trailer)) :
+        part_write(&shadow->part, address, shadow->trailer, sizeof(shadow->trailer));
+    if (!rv) return false;
+
+    shadow->valid = true;
+    shadow->latest = bank;
+    shadow->seq = shadow->trailer[0];
+    return true;
+}
+
+
+bool part_shadow_write(part_shadow_t *shadow, const void *record)
+{
+    return shadow_write(shadow, record, false) && shadow_commit(shadow, false);
+}
+
+
+// Only one background write can be in progress at a time. The caller must
+// wait for the write of the record to finish before committing it with
+// part_shadow_commit.
+bool part_shadow_write_async(part_shadow_t *shadow, const void *record)
+{
+    return shadow_write(shadow, record, true);
+}
+
+
+bool part_shadow_commit(part_shadow_t *shadow)
+{
+    return shadow_commit(shadow, true);
+}
+
+
+// Each sector of a log starts with its sequence number. Each record consists of
+// a header with the length of the data and its complement (so that the header
+// of a record is never zero), a consumed flag, the data padded to alignment,
+// and a checksum over the header and the data.
+#define LOG_SECTOR_HEADER_SIZE sizeof(uint32_t)
+#define LOG_RECORD_HEADER(n) ((uint32_t)(n) | (~(uint32_t)(n) << 16))
+#define LOG_CONSUMED EMPTY
+
+
+static const uint8_t *log_sector(const part_log_t *log, unsigned int sector)
+{
+    size_t size;
+    const uint8_t *p = part_mmap(&size, &log->part);
+    if (p == NULL) return NULL;
+    return p + log->first + sector * log->sector_size;
+}
+
+
+static uint32_t log_sector_seq(const part_log_t *log, unsigned int sector)
+{
+    uint32_t seq;
+    memcpy(&seq, log_sector(log, sector), sizeof(seq));
+    return seq;
+}
+
+
+// Return the record at the given offset of the sector and its length, or NULL
+// if there is no valid record at the offset
+static const uint8_t *log_record(const part_log_t *log, unsigned int sector, size_t off, size_t *length)
+{
+    const uint8_t *r = log_sector(log, sector) + off;
+    uint32_t header, crc;
+    size_t n;
+
+    if (off + PART_LOG_RECORD_SIZE(0) > log->sector_size) return NULL;
+
+    memcpy(&header, r, sizeof(header));
+    n = header & 0xffff;
+    if (header == 0 || header != LOG_RECORD_HEADER(n)) return NULL;
+    if (off + PART_LOG_RECORD_SIZE(n) > log->sector_size) return NULL;
+
+    memcpy(&crc, r + PART_LOG_RECORD_SIZE(n) - sizeof(crc), sizeof(crc));
+    if (record_crc(header, r + 2 * sizeof(uint32_t), n) != crc) return NULL;
+
+    *length = n;
+    return r;
+}
+
+
+static bool log_consumed(const uint8_t *record)
+{
+    uint32_t flag;
+    memcpy(&flag, record + sizeof(uint32_t), sizeof(flag));
+    return flag != 0;
+}
+
+
+static bool log_erase_sector(part_log_t *log, unsigned int sector)
+{
+    return erase_range(log->part.block,
+        log->part.dsc->start + log->first + sector * log->sector_size, log->sector_size);
+}
+
+
+// Skip consumed records and erase the sectors preceding the head sector that
+// hold no more records. Returns the oldest record that has not been consumed.
+static const uint8_t *log_seek(part_log_t *log, size_t *length)
+{
+    const uint8_t *r;
+
+    if (log->seq == 0) return NULL;
+
+    while (1) {
+        r = log_record(log, log->tail, log->roff, length);
+        if (r != NULL) {
+            if (!log_consumed(r)) return r;
+            log->roff += PART_LOG_RECORD_SIZE(*length);
+            continue;
+        }
+
+        if (log->tail == log->head) return NULL;
+
+        if (!log_erase_sector(log, log->tail)) return NULL;
+        log->tail = (log->tail + 1) % log->sectors;
+        log->roff = LOG_SECTOR_HEADER_SIZE;
+    }
+}
+
+
+int part_log_open(part_log_t *log, const part_t *part, size_t sector_size)
+{
+    size_t size, n, off;
+    uint32_t seq, header;
+    unsigned int i, prev;
+    const uint8_t *r;
+
+    if (log == NULL) return -1;
+    memset(log, 0, sizeof(*log));
+
+    if (part == NULL || BLOCK_CLOSED(part->block)) return -2;
+
+    // Sectors are reused only after an erase, which must leave them reading as
+    // zero (an erased consumed flag)
+    if (part->block->erase == NULL) return -3;
+
+    if (sector_size % PART_ALIGNMENT || sector_size < LOG_SECTOR_HEADER_SIZE + PART_LOG_RECORD_SIZE(1))
+        return -4;
+
+    if (part_mmap(&size, part) == NULL) return -5;
+
+    // Align the sectors with the sector size within the block, so that each
+    // sector covers whole flash pages
+    log->part = *part;
+    log->sector_size = sector_size;
+    log->first = (sector_size - part->dsc->start % sector_size) % sector_size;
+    log->sectors = size > log->first ? (size - log->first) / sector_size : 0;
+
+    // The head sector is erased before it is reused, so a log needs at least
+    // one more sector than the ones with records
+    if (log->sectors < 2) {
+        memset(log, 0, sizeof(*log));
+        return -6;
+    }
+
+    // The head sector is the one with the highest sequence number. The tail
+    // sector is found by walking backwards from the head sector for as long as
+    // the sequence numbers are consecutive. Sectors outside of that range hold
+    // stale data and are erased before they are reused.
+    for (i = 0; i < log->sectors; i++) {
+        seq = log_sector_seq(log, i);
+        if (seq == 0) continue;
+        if (log->seq == 0 || (int32_t)(seq - log->seq) > 0) {
+            log->seq = seq;
+            log->head = i;
+        }
+    }
+
+    log->tail = log->head;
+    if (log->seq != 0) {
+        seq = log->seq;
+        while (1) {
+            prev = (log->tail + log->sectors - 1) % log->sectors;
+            if (prev == log->head) break;
+            if (--seq == 0) seq--;
+            if (log_sector_seq(log, prev) != seq) break;
+            log->tail = prev;
+        }
+    }
+
+    // Records are appended after the last valid record of the head sector. If
+    // a write was interrupted there, the rest of the sector cannot be written
+    // without an erase and the next record goes into a new sector.
+    off = LOG_SECTOR_HEADER_SIZE;
+    if (log->seq != 0) {
+        while ((r = log_record(log, log->head, off, &n)) != NULL)
+            off += PART_LOG_RECORD_SIZE(n);
+
+        if (off + sizeof(header) <= sector_size) {
+            memcpy(&header, log_sector(log, log->head) + off, sizeof(header));
+            if (header != 0) off = sector_size;
+        }
+    }
+    log->woff = off;
+
+    log->roff = LOG_SECTOR_HEADER_SIZE;
+    for (i = log->tail; log->seq != 0; i = (i + 1) % log->sectors) {
+        for (off = LOG_SECTOR_HEADER_SIZE; (r = log_record(log, i, off, &n)) != NULL;
+            off += PART_LOG_RECORD_SIZE(n))
+            if (!log_consumed(r)) log->count++;
+        if (i == log->head) break;
+    }
+
+    log_debug("part: Opened log in part '%s', %d sectors, %d records",
+        part->dsc->label, log->sectors, log->count);
+    return 0;
+}
+
+
+// Start a new head sector. The sector that follows the head sector is erased
+// and its sequence number written. Fails if that sector still has records.
+static bool log_next_sector(part_log_t *log)
+{
+    unsigned int next = log->head;
+    uint32_t seq;
+    size_t n;
+
+    if (log->seq != 0) {
+        log_seek(log, &n);
+        next = (log->head + 1) % log->sectors;
+        if (next == log->tail) return false;
+    }
+
+    seq = log->seq + 1;
+    if (seq == 0) seq++;
+
+    if (!log_erase_sector(log, next)) return false;
+    if (!part_write(&log->part, log->first + next * log->sector_size, &seq, sizeof(seq)))
+        return false;
+
+    if (log->seq == 0 || (log->tail == log->head && log->count == 0)) {
+        log->tail = next;
+        log->roff = LOG_SECTOR_HEADER_SIZE;
+    }
+    log->head = next;
+    log->seq = seq;
+    log->woff = LOG_SECTOR_HEADER_SIZE;
+    return true;
+}
+
+
+// The record is written in three steps: the header, the data, and the
+// checksum. If the write is interrupted, the checksum does not match and the
+// record is ignored upon reboot. Returns false if the log is full.
+bool part_log_append(part_log_t *log, const void *data, size_t length)
+{
+    uint32_t v[2];
+    uint32_t base;
+
+    if (log == NULL || log->sectors == 0) return false;
+
+    if (length > 0xffff ||
+        LOG_SECTOR_HEADER_SIZE + PART_LOG_RECORD_SIZE(length) > log->sector_size)
+        return false;
+
+    if (log->seq == 0 || log->woff + PART_LOG_RECORD_SIZE(length) > log->sector_size) {
+        if (!log_next_sector(log)) return false;
+    }
+
+    base = log->first + log->head * log->sector_size + log->woff;
+
+    v[0] = LOG_RECORD_HEADER(length);
+    v[1] = 0;
+    if (!part_write(&log->part, base, v, sizeof(v))) goto error;
+    if (!part_write(&log->part, base + sizeof(v), data, length)) goto error;
+
+    v[1] = record_crc(v[0], data, length);
+    if (!part_write(&log->part, base + PART_LOG_RECORD_SIZE(length) - sizeof(v[1]), &v[1],
+        sizeof(v[1])))
+        goto error;
+
+    log->woff += PART_LOG_RECORD_SIZE(length);
+    log->count++;
+    return true;
+
+error:
+    // Readers stop at the broken record, so the rest of the sector cannot be
+    // used anymore
+    log->woff = log->sector_size;
+    return false;
+}
+
+
+// Return the oldest record that has not been consumed yet, or NULL if the log
+// is empty. The returned pointer is valid until the record is consumed.
+const void *part_log_peek(part_log_t *log, size_t *length)
+{
+    const uint8_t *r;
+    size_t n;
+
+    if (log == NULL || log->sectors == 0) return NULL;
+
+    r = log_seek(log, &n);
+    if (r == NULL) return NULL;
+
+    if (length != NULL) *length = n;
+    return r + 2 * sizeof(uint32_t);
+}
+
+
+bool part_log_consume(part_log_t *log)
+{
+    uint32_t flag = LOG_CONSUMED;
+    size_t n;
+
+    if (log == NULL || log->sectors == 0) return false;
+
+    if (log_seek(log, &n) == NULL) return false;
+
+    if (!part_write(&log->part, log->first + log->tail * log->sector_size + log->roff +
+        sizeof(uint32_t), &flag, sizeof(flag)))
+        return false;
+
+    log->roff += PART_LOG_RECORD_SIZE(n);
+    if (log->count) log->count--;
+    return true;
+}
+
+
+// Position the cursor at the oldest record that has not been consumed yet
+void part_log_rewind(const part_log_t *log, part_log_cursor_t *cursor)
+{
+    cursor->done = log == NULL || log->sectors == 0 || log->seq == 0;
+    if (cursor->done) return;
+
+    cursor->sector = log->tail;
+    cursor->off = log->roff;
+}
+
+
+// Return the record at the cursor and advance the cursor past it, or NULL
+// once all records have been visited. Consumed records are skipped. Unlike
+// part_log_peek, this leaves the log untouched, so the records can be read
+// without consuming them. The cursor is invalidated by appends and consumes.
+const void *part_log_next(const part_log_t *log, part_log_cursor_t *cursor, size_t *length)
+{
+    const uint8_t *r;
+    size_t n;
+
+    while (!cursor->done) {
+        r = log_record(log, cursor->sector, cursor->off, &n);
+        if (r != NULL) {
+            cursor->off += PART_LOG_RECORD_SIZE(n);
+            if (log_consumed(r)) continue;
+
+            if (length != NULL) *length = n;
+            return r + 2 * sizeof(uint32_t);
+        }
+
+        if (cursor->sector == log->head) {
+            cursor->done = true;
+        } else {
+            cursor->sector = (cursor->sector + 1) % log->sectors;
+            cursor->off = LOG_SECTOR_HEADER_SIZE;
+        }
+    }
+    return NULL;
+}
+
+
+// Erase all sectors of the log
+bool part_log_clear(part_log_t *log)
+{
+    if (log == NULL || log->sectors == 0) return false;
+
+    for (unsigned int i = 0; i < log->sectors; i++)
+        if (!log_erase_sector(log, i)) return false;
+
+    log->head = log->tail = 0;
+    log->seq = 0;
+    log->woff = log->roff = LOG_SECTOR_HEADER_SIZE;
+    log->count = 0;
+    return true;
+}
@@ -14,6 +14,25 @@
 #define VARIABLE_PART_TABLE_SIZE(n) ((n) * PART_ALIGN(sizeof(part_dsc_t)))
 #define PART_TABLE_SIZE(n) (FIXED_PART_TABLE_SIZE + VARIABLE_PART_TABLE_SIZE((n)))
 
+// The maximum number of parts in a layout passed to part_migrate_layout
+#define PART_MAX_LAYOUT 16
+
+// The maximum size of a record that can be stored in a journal
+#define PART_JOURNAL_MAX_RECORD_SIZE 64
+
+// The size of a journal slot: a 32-bit sequence number, the record (padded to
+// alignment), and a CRC32 checksum over both
+#define PART_JOURNAL_SLOT_SIZE(n) (sizeof(uint32_t) + PART_ALIGN(n) + sizeof(uint32_t))
+
+// The size of a part that holds two shadow copies of a record of up to n bytes:
+// two banks, each with the record (padded to alignment) followed by a 32-bit
+// sequence number and a CRC32 checksum
+#define PART_SHADOW_SIZE(n) (2 * (PART_ALIGN(n) + 2 * sizeof(uint32_t)))
+
+// The space taken by a log record of n bytes: a header with the length, a
+// consumed flag, the data (padded to alignment), and a CRC32 checksum
+#define PART_LOG_RECORD_SIZE(n) (2 * sizeof(uint32_t) + PART_ALIGN(n) + sizeof(uint32_t))
+
 
 typedef struct part_dsc {
     uint32_t start;
@@ -28,6 +47,80 @@ typedef struct part {
 } part_t;
 
 
+/* A journal stores successive versions of a fixed-size record in a part. The
+ * part is divided into slots and each new version of the record is written
+ * into the slot following the most recent one, wrapping around at the end of
+ * the part. Each slot is thus written only once per N updates (where N is the
+ * number of slots), which spreads the wear of frequently updated records over
+ * the entire part. Each slot carries a sequence number and a CRC32 checksum,
+ * so that the most recent valid version can be found upon reboot, even if
+ * the last write was interrupted.
+ */
+typedef struct part_journal {
+    part_t part;
+    size_t record_size;  // The size of the record in bytes
+    size_t slot_size;    // The size of a slot, including the header and checksum
+    size_t slots;        // The number of slots in the part
+    size_t latest;       // The index of the slot with the most recent record
+    uint32_t seq;        // The sequence number of the most recent record
+    bool valid;          // True if the journal contains at least one valid record
+    uint8_t image[PART_JOURNAL_SLOT_SIZE(PART_JOURNAL_MAX_RECORD_SIZE)]; // The slot being written
+} part_journal_t;
+
+
+/* A shadow part keeps two copies (banks A and B) of a record. A new version of
+ * the record is written into the bank that does not hold the most recent
+ * version, and is committed by writing a trailer with the next sequence number
+ * and a CRC32 checksum over both at the end of the bank. The checksum is the
+ * last word written, so an interrupted write or commit leaves the previous
+ * version intact. Upon reboot, the bank with the more recent sequence number is
+ * used, provided that its checksum matches.
+ */
+typedef struct part_shadow {
+    part_t part;
+    size_t record_size;  // The size of the record in bytes
+    size_t bank_size;    // The size of a bank, including the trailer
+    unsigned int latest; // The bank with the most recent record
+    uint32_t seq;        // The sequence number of the most recent record
+    bool valid;          // True if one of the banks holds a committed record
+    bool pending;        // True if a record has been written but not committed yet
+    uint32_t trailer[2]; // The sequence number and checksum of the pending record
+} part_shadow_t;
+
+
+/* A log is a FIFO queue of variable-size records kept in a part of a block
+ * whose erase operation leaves the memory reading as zero, e.g., the program
+ * flash memory. The part is divided into sectors that are erased as a whole
+ * (one or more flash pages). Records are appended to the current sector and
+ * never span sectors. Each sector starts with a sequence number that
+ * determines the order of the sectors upon reboot. A consumed record is
+ * marked in place by programming its (erased) consumed flag, and a sector is
+ * erased only once all its records have been consumed and the space is needed
+ * again. Each record carries a CRC32 checksum, so that a record whose write
+ * was interrupted is ignored.
+ */
+typedef struct part_log {
+    part_t part;
+    uint32_t first;      // The offset of the first sector within the part
+    size_t sector_size;  // The size of a sector in bytes
+    size_t sectors;      // The number of sectors in the part
+    unsigned int head;   // The sector records are appended to
+    unsigned int tail;   // The oldest sector with records
+    uint32_t seq;        // The sequence number of the head sector, 0 if no sector is in use
+    size_t woff;         // The offset of the next record within the head sector
+    size_t roff;         // The offset of the oldest record within the tail sector
+    size_t count;        // The number of records that have not been consumed
+} part_log_t;
+
+
+// A position in a log for reading its records in order, see part_log_next
+typedef struct part_log_cursor {
+    unsigned int sector;
+    size_t off;
+    bool done;
+} part_log_cursor_t;
+
+
 typedef struct part_table {
     uint32_t signature;  //Well-known signature of the partition table
     size_t size;         // Size of the partition table, including signature and the parts array that follows the partition table
@@ -35,12 +128,25 @@ typedef struct part_table {
 } part_table_t;
 
 
+/* An entry of the expected layout of a partitioned block, see part_open_layout.
+ * The parts of the layout are expected in the order in which part_create
+ * creates them.
+ */
+typedef struct part_layout {
+    const char *label;
+    size_t size;
+    part_t *part;  // Set to the part if the layout matches
+} part_layout_t;
+
+
 typedef struct part_block {
     const uint32_t start;       // The first memory address of the partitioned memory block
     const size_t size;          // The size of the partitioned memory block in bytes
     const part_table_t *table;  // A mmaped pointer to the partition table
     const part_dsc_t *parts;    // A mmaped pointer to the partition array
     bool (*write)(uint32_t address, const void *buffer, size_t length);
+    bool (*write_async)(uint32_t address, const void *buffer, size_t length); // Optional
+    bool (*erase)(uint32_t address, size_t length); // Optional, erased memory need not read as 0xff
     const void *(*mmap)(uint32_t address, size_t length);
 } part_block_t;
 
@@ -52,11 +158,32 @@ void part_close_block(part_block_t *block);
 
 int part_find(part_t *part, const part_block_t *block, const char *label);
 int part_create(part_t *part, const part_block_t *block, const char *label, size_t size);
+int part_open_layout(const part_block_t *block, const part_layout_t *layout, unsigned int n);
+int part_migrate_layout(part_block_t *block, const part_layout_t *layout, unsigned int n);
 
 bool part_write(const part_t *part, uint32_t address, const void *buffer, size_t length);
+bool part_write_async(const part_t *part, uint32_t address, const void *buffer, size_t length);
 const void *part_mmap(size_t *size, const part_t *part);
 bool part_erase(const part_t *part);
 
+int part_journal_open(part_journal_t *journal, const part_t *part, size_t record_size);
+const void *part_journal_read(const part_journal_t *journal);
+bool part_journal_append(part_journal_t *journal, const void *record);
+
+int part_shadow_open(part_shadow_t *shadow, const part_t *part, size_t record_size);
+const void *part_shadow_read(const part_shadow_t *shadow);
+bool part_shadow_write(part_shadow_t *shadow, const void *record);
+bool part_shadow_write_async(part_shadow_t *shadow, const void *record);
+bool part_shadow_commit(part_shadow_t *shadow);
+
+int part_log_open(part_log_t *log, const part_t *part, size_t sector_size);
+bool part_log_append(part_log_t *log, const void *data, size_t length);
+const void *part_log_peek(part_log_t *log, size_t *length);
+bool part_log_consume(part_log_t *log);
+bool part_log_clear(part_log_t *log);
+void part_log_rewind(const part_log_t *log, part_log_cursor_t *cursor);
+const void *part_log_next(const part_log_t *log, part_log_cursor_t *cursor, size_t *length);
+
 int part_dump_block(part_block_t *block);
 
 #endif // _PART_H_
\ No newline at end of file
@@ -0,0 +1,662 @@
+#include "ping.h"
+#include <string.h>
+#include <loramac-node/src/radio/radio.h>
+#include <LoRaWAN/Utilities/timeServer.h>
+#include "p2p.h"
+#include "lrw.h"
+#include "atci.h"
+#include "cmd.h"
+#include "rtc.h"
+#include "irq.h"
+#include "system.h"
+#include "log.h"
+
+
+// The time the echo node may take to notice a ping in its main loop and turn
+// the radio around, on top of the time on air of the reply (ms)
+#define REPLY_MARGIN 100
+
+// A transmission that has not completed this many milliseconds after its time
+// on air is reported as timed out
+#define TX_TIMEOUT_MARGIN 1000
+
+// An echo node away from the base configuration returns to it after this many
+// round trips without a packet from the pinger, plus IDLE_MARGIN ms
+#define IDLE_ROUND_TRIPS 3
+#define IDLE_MARGIN 2000
+
+// Give up the sweep after this many unanswered switch packets in a row
+#define MAX_SWITCH_ATTEMPTS 4
+
+// The first byte of every packet, to tell pings from other P2P traffic
+#define MAGIC 0x9e
+
+enum packet_type {
+    PACKET_PING   = 0,
+    PACKET_SWITCH = 1,  // Carries the sf, bandwidth, and length of the next configuration
+    PACKET_END    = 2   // Return to the base configuration
+};
+
+// Set in the type of packets sent by the echo node
+#define PACKET_REPLY 0x80
+
+// Header fields. The four argument bytes carry the next configuration in
+// switch packets and the RSSI (16 bits) and SNR of the request at the echo
+// node in replies.
+enum header_field {
+    HDR_MAGIC   = 0,
+    HDR_TYPE    = 1,
+    HDR_SESSION = 2,
+    HDR_SEQ     = 3,
+    HDR_ARG     = 4
+};
+
+enum phase {
+    PHASE_SWITCH = 0,
+    PHASE_PING,
+    PHASE_END
+};
+
+enum radio_event {
+    EVENT_NONE = 0,
+    EVENT_TX_DONE,
+    EVENT_TX_TIMEOUT
+};
+
+// The link parameters configured with AT$P2P when the benchmark started
+static p2p_config_t base;
+
+static ping_sweep_t sweep;
+
+static struct {
+    bool active;
+    bool transmitting;
+    bool waiting;          // Listening for a reply
+    bool backoff;          // Waiting for the echo node to return to the base configuration
+    uint8_t phase;
+    uint8_t type;          // The type of the packet on air
+    uint8_t session;
+    uint8_t seq;
+    uint8_t attempts;
+    uint8_t sf;            // The configuration of the current step
+    uint8_t bandwidth;
+    uint8_t length_index;
+    uint8_t step;
+    uint8_t steps;
+    uint32_t idle;         // The time the echo node may stay in the last configuration (ms)
+    uint32_t tx_start;     // RTC time of the start of the last transmission in ticks
+    uint8_t received;
+    uint16_t rtt[PING_MAX_COUNT];
+    int32_t rssi, snr, remote_rssi, remote_snr;
+} pinger;
+
+static struct {
+    bool enabled;
+    bool transmitting;
+    bool away;             // Not in the base configuration
+    uint8_t apply;         // The type of the request being replied to
+    uint8_t sf;            // The configuration requested by the last switch packet
+    uint8_t bandwidth;
+    uint8_t length;
+    uint32_t echoed;
+} echo;
+
+// The last received packet, until the main loop has processed it
+static struct {
+    volatile bool full;
+    uint8_t length;
+    int16_t rssi;
+    int8_t snr;
+    uint32_t time;
+    uint8_t data[P2P_MAX_PAYLOAD];
+} rx;
+
+static TimerEvent_t timer;
+static volatile bool timer_expired;
+static volatile uint8_t radio_event;
+static bool listening;
+
+// See radio.c
+extern uint32_t radio_rx_time;
+
+
+static void on_tx_done(void)
+{
+    radio_event = EVENT_TX_DONE;
+    system_post(SYSTEM_TASK_LORA);
+}
+
+
+static void on_tx_timeout(void)
+{
+    radio_event = EVENT_TX_TIMEOUT;
+    system_post(SYSTEM_TASK_LORA);
+}
+
+
+static void on_rx_done(uint8_t *payload, uint16_t size, int16_t rssi, int8_t snr)
+{
+    if (rx.full || size < PING_MIN_LENGTH || payload[HDR_MAGIC] != MAGIC) return;
+    if (size > P2P_MAX_PAYLOAD) size = P2P_MAX_PAYLOAD;
+
+    memcpy(rx.data, payload, size);
+    rx.length = size;
+    rx.rssi = rssi;
+    rx.snr = snr;
+    rx.time = radio_rx_time;
+    rx.full = true;
+    system_post(SYSTEM_TASK_LORA);
+}
+
+
+// The radio stays in the continuous receive mode after a CRC error
+static void on_rx_error(void)
+{
+}
+
+
+// Continuous reception does not time out, but restart it just in case
+static void on_rx_timeout(void)
+{
+    if (listening) Radio.Rx(0);
+}
+
+
+static const RadioEvents_t events = {
+    .TxDone = on_tx_done,
+    .TxTimeout = on_tx_timeout,
+    .RxDone = on_rx_done,
+    .RxTimeout = on_rx_timeout,
+    .RxError = on_rx_error
+};
+
+
+static void on_timer(void *ctx)
+{
+    (void)ctx;
+    timer_expired = true;
+    system_post(SYSTEM_TASK_LORA);
+}
+
+
+static void start_timer(uint32_t ms)
+{
+    TimerStop(&timer);
+    timer_expired = false;
+    TimerSetValue(&timer, ms);
+    TimerStart(&timer);
+}
+
+
+static uint8_t take_event(void)
+{
+    uint32_t mask = disable_irq();
+    uint8_t ev = radio_event;
+    radio_event = EVENT_NONE;
+    reenable_irq(mask);
+    return ev;
+}
+
+
+static uint32_t time_on_air(uint8_t sf, uint8_t bandwidth, uint8_t length)
+{
+    return Radio.TimeOnAir(MODEM_LORA, bandwidth, sf, base.coderate, base.preamble, false,
+        length, true);
+}
+
+
+static uint32_t idle_timeout(uint8_t sf, uint8_t bandwidth, uint8_t length)
+{
+    return IDLE_ROUND_TRIPS * 2 * (time_on_air(sf, bandwidth, length) + REPLY_MARGIN)
+        + IDLE_MARGIN;
+}
+
+
+static void configure_radio(uint8_t sf, uint8_t bandwidth)
+{
+    listening = false;
+    Radio.Standby();
+    Radio.SetChannel(base.frequency);
+    Radio.SetTxConfig(MODEM_LORA, base.power, 0, bandwidth, sf, base.coderate,
+        base.preamble, false, true, false, 0, false,
+        time_on_air(sf, bandwidth, P2P_MAX_PAYLOAD) + TX_TIMEOUT_MARGIN);
+    Radio.SetRxConfig(MODEM_LORA, bandwidth, sf, base.coderate, 0, base.preamble, 0,
+        false, 0, true, false, 0, false, true);
+}
+
+
+static void listen(void)
+{
+    rx.full = false;
+    listening = true;
+    Radio.Rx(0);
+}
+
+
+static void stop_listening(void)
+{
+    listening = false;
+    Radio.Standby();
+}
+
+
+void ping_init(void)
+{
+    TimerInit(&timer, on_timer);
+}
+
+
+static int claim(void)
+{
+    int rc;
+
+    p2p_get_config(&base);
+    if (base.frequency == 0) return LORAMAC_STATUS_PARAMETER_INVALID;
+
+    rc = p2p_claim(&events);
+    if (rc != LORAMAC_STATUS_OK) return rc;
+
+    radio_event = EVENT_NONE;
+    timer_expired = false;
+    rx.full = false;
+    return LORAMAC_STATUS_OK;
+}
+
+
+static void release(void)
+{
+    TimerStop(&timer);
+    listening = false;
+    p2p_release();
+}
+
+
+static uint8_t current_length(void)
+{
+    return sweep.lengths[pinger.length_index];
+}
+
+
+static uint8_t first_bandwidth(uint8_t mask)
+{
+    uint8_t i = 0;
+    while (!(mask & (1 << i))) i++;
+    return i;
+}
+
+
+static void send_packet(uint8_t type)
+{
+    uint8_t packet[P2P_MAX_PAYLOAD];
+    uint8_t length = type == PACKET_PING ? current_length() : PING_MIN_LENGTH;
+
+    memset(packet, 0, length);
+    packet[HDR_MAGIC] = MAGIC;
+    packet[HDR_TYPE] = type;
+    packet[HDR_SESSION] = pinger.session;
+    packet[HDR_SEQ] = pinger.seq;
+    if (type == PACKET_SWITCH) {
+        packet[HDR_ARG] = pinger.sf;
+        packet[HDR_ARG + 1] = pinger.bandwidth;
+        packet[HDR_ARG + 2] = current_length();
+    }
+
+    pinger.type = type;
+    pinger.transmitting = true;
+    pinger.tx_start = rtc_get_timer_value();
+    Radio.Send(packet, length);
+}
+
+
+static void begin_step(void)
+{
+    pinger.phase = PHASE_SWITCH;
+    pinger.attempts = 0;
+    pinger.seq = 0;
+    pinger.received = 0;
+    pinger.rssi = pinger.snr = pinger.remote_rssi = pinger.remote_snr = 0;
+
+    configure_radio(base.sf, base.bandwidth);
+    send_packet(PACKET_SWITCH);
+}
+
+
+static bool next_step(void)
+{
+    pinger.step++;
+
+    if (++pinger.length_index < PING_MAX_LENGTHS && current_length()) return true;
+    pinger.length_index = 0;
+
+    do {
+        pinger.bandwidth++;
+    } while (pinger.bandwidth < 3 && !(sweep.bandwidths & (1 << pinger.bandwidth)));
+    if (pinger.bandwidth < 3) return true;
+    pinger.bandwidth = first_bandwidth(sweep.bandwidths);
+
+    return ++pinger.sf <= sweep.sf_max;
+}
+
+
+static void sort(uint16_t *v, unsigned int n)
+{
+    unsigned int i, j;
+    uint16_t x;
+
+    for (i = 1; i < n; i++) {
+        x = v[i];
+        for (j = i; j > 0 && v[j - 1] > x; j--) v[j] = v[j - 1];
+        v[j] = x;
+    }
+}
+
+
+static void report_step(void)
+{
+    unsigned int i, n = pinger.received;
+    uint32_t sum = 0;
+    int16_t rssi = 0, remote_rssi = 0;
+    int8_t snr = 0, remote_snr = 0;
+
+    sort(pinger.rtt, n);
+    for (i = 0; i < n; i++) sum += pinger.rtt[i];
+    if (n) {
+        rssi = pinger.rssi / (int32_t)n;
+        snr = pinger.snr / (int32_t)n;
+        remote_rssi = pinger.remote_rssi / (int32_t)n;
+        remote_snr = pinger.remote_snr / (int32_t)n;
+    }
+
+    atci_frame_open(0);
+    atci_printf("+PING=%d,%d,%d,%d,%d,%u,%u,%u,%u,%lu,%d,%d,%d,%d" ATCI_EOL,
+        pinger.sf, 125 << pinger.bandwidth, current_length(), sweep.count, n,
+        n ? pinger.rtt[0] : 0, n ? pinger.rtt[n / 2] : 0, n ? pinger.rtt[n * 9 / 10] : 0,
+        n ? pinger.rtt[n - 1] : 0, n ? sum / n : 0, rssi, snr, remote_rssi, remote_snr);
+    atci_frame_close();
+}
+
+
+static void finish(unsigned int status)
+{
+    pinger.active = false;
+    release();
+    log_debug("Ping: Sweep finished after %d of %d steps", pinger.step, pinger.steps);
+    cmd_event(CMD_EVENT_P2P, status);
+}
+
+
+static void record_reply(void)
+{
+    uint32_t rtt = rtc_tick2ms(rx.time - pinger.tx_start);
+
+    pinger.rtt[pinger.received++] = rtt > UINT16_MAX ? UINT16_MAX : rtt;
+    pinger.rssi += rx.rssi;
+    pinger.snr += rx.snr;
+    pinger.remote_rssi += (int16_t)(rx.data[HDR_ARG] | (rx.data[HDR_ARG + 1] << 8));
+    pinger.remote_snr += (int8_t)rx.data[HDR_ARG + 2];
+}
+
+
+// Move on once the reply to the last packet has arrived or has been given up on
+static void complete_round(bool replied)
+{
+    switch (pinger.phase) {
+        case PHASE_SWITCH:
+            if (replied) {
+                configure_radio(pinger.sf, pinger.bandwidth);
+                pinger.phase = PHASE_PING;
+                send_packet(PACKET_PING);
+            } else if (++pinger.attempts == MAX_SWITCH_ATTEMPTS) {
+                log_debug("Ping: No reply from the echo node");
+                finish(CMD_P2P_PING_FAILED);
+            } else {
+                // The echo node may have missed the end of the previous step
+                // and not returned to the base configuration yet
+                pinger.backoff = true;
+                start_timer(pinger.idle);
+            }
+            break;
+
+        case PHASE_PING:
+            if (++pinger.seq < sweep.count) {
+                send_packet(PACKET_PING);
+            } else {
+                pinger.phase = PHASE_END;
+                send_packet(PACKET_END);
+            }
+            break;
+
+        case PHASE_END:
+            report_step();
+            pinger.idle = idle_timeout(pinger.sf, pinger.bandwidth, current_length());
+            if (next_step()) begin_step();
+            else finish(CMD_P2P_PING_DONE);
+            break;
+
+        default:
+            break;
+    }
+}
+
+
+static bool is_reply(void)
+{
+    return rx.data[HDR_TYPE] == (pinger.type | PACKET_REPLY)
+        && rx.data[HDR_SESSION] == pinger.session
+        && rx.data[HDR_SEQ] == pinger.seq;
+}
+
+
+static void pinger_process(void)
+{
+    uint8_t ev = take_event();
+    uint8_t length;
+
+    if (ev != EVENT_NONE && pinger.transmitting) {
+        pinger.transmitting = false;
+        if (ev == EVENT_TX_DONE) {
+            length = pinger.type == PACKET_PING ? current_length() : PING_MIN_LENGTH;
+            pinger.waiting = true;
+            listen();
+            if (pinger.phase == PHASE_SWITCH) {
+                start_timer(time_on_air(base.sf, base.bandwidth, length) + REPLY_MARGIN);
+            } else {
+                start_timer(time_on_air(pinger.sf, pinger.bandwidth, length) + REPLY_MARGIN);
+            }
+        } else {
+            complete_round(false);
+        }
+    }
+
+    if (pinger.waiting && rx.full) {
+        if (is_reply()) {
+            TimerStop(&timer);
+            stop_listening();
+            pinger.waiting = false;
+            if (pinger.phase == PHASE_PING) record_reply();
+            rx.full = false;
+            complete_round(true);
+        } else {
+            // Not ours, keep listening
+            rx.full = false;
+        }
+    }
+
+    if (timer_expired) {
+        timer_expired = false;
+        if (pinger.waiting) {
+            stop_listening();
+            pinger.waiting = false;
+            complete_round(false);
+        } else if (pinger.backoff) {
+            pinger.backoff = false;
+            send_packet(PACKET_SWITCH);
+        }
+    }
+}
+
+
+static void return_to_base(void)
+{
+    configure_radio(base.sf, base.bandwidth);
+    echo.away = false;
+    TimerStop(&timer);
+    timer_expired = false;
+}
+
+
+static void echo_process(void)
+{
+    uint8_t type;
+
+    if (take_event() != EVENT_NONE && echo.transmitting) {
+        echo.transmitting = false;
+        if (echo.apply == PACKET_SWITCH) {
+            configure_radio(echo.sf, echo.bandwidth);
+            echo.away = true;
+            start_timer(idle_timeout(echo.sf, echo.bandwidth, echo.length));
+        } else if (echo.apply == PACKET_END) {
+            return_to_base();
+        }
+        listen();
+    }
+
+    // The pinger has gone quiet, wait for it in the base configuration
+    if (timer_expired && !echo.transmitting) {
+        log_debug("Ping: Echo returned to the base configuration");
+        return_to_base();
+        listen();
+    }
+
+    if (!rx.full || echo.transmitting) return;
+
+    type = rx.data[HDR_TYPE];
+    if (type > PACKET_END) {
+        rx.full = false;
+        return;
+    }
+
+    if (type == PACKET_SWITCH) {
+        echo.sf = rx.data[HDR_ARG];
+        echo.bandwidth = rx.data[HDR_ARG + 1];
+        echo.length = rx.data[HDR_ARG + 2];
+        if (echo.sf < 7 || echo.sf > 12 || echo.bandwidth > 2) {
+            rx.full = false;
+            return;
+        }
+    }
+    echo.apply = type;
+    if (echo.away) start_timer(idle_timeout(echo.sf, echo.bandwidth, echo.length));
+
+    rx.data[HDR_TYPE] = type | PACKET_REPLY;
+    rx.data[HDR_ARG] = (uint16_t)rx.rssi & 0xff;
+    rx.data[HDR_ARG + 1] = (uint16_t)rx.rssi >> 8;
+    rx.data[HDR_ARG + 2] = rx.snr;
+
+    listening = false;
+    echo.transmitting = true;
+    echo.echoed++;
+    Radio.Send(rx.data, rx.length);
+    rx.full = false;
+}
+
+
+int ping_start(const ping_sweep_t *s)
+{
+    unsigned int n;
+    int rc;
+
+    if (pinger.active || echo.enabled) return LORAMAC_STATUS_BUSY;
+    if (s->count == 0 || s->count > PING_MAX_COUNT) return LORAMAC_STATUS_PARAMETER_INVALID;
+    if (s->sf_min < 7 || s->sf_max > 12 || s->sf_min > s->sf_max)
+        return LORAMAC_STATUS_PARAMETER_INVALID;
+    if (s->bandwidths == 0 || s->bandwidths > 7) return LORAMAC_STATUS_PARAMETER_INVALID;
+
+    for (n = 0; n < PING_MAX_LENGTHS && s->lengths[n]; n++)
+        if (s->lengths[n] < PING_MIN_LENGTH) return LORAMAC_STATUS_LENGTH_ERROR;
+    if (n == 0) return LORAMAC_STATUS_LENGTH_ERROR;
+
+    rc = claim();
+    if (rc != LORAMAC_STATUS_OK) return rc;
+
+    memset(&pinger, 0, sizeof(pinger));
+    sweep = *s;
+
+    pinger.steps = s->sf_max - s->sf_min + 1;
+    pinger.steps *= ((s->bandwidths & 1) != 0) + ((s->bandwidths & 2) != 0)
+        + ((s->bandwidths & 4) != 0);
+    pinger.steps *= n;
+
+    // A random session number lets the pinger ignore late replies to an
+    // earlier sweep
+    pinger.session = Radio.Random();
+    pinger.sf = s->sf_min;
+    pinger.bandwidth = first_bandwidth(s->bandwidths);
+    pinger.idle = IDLE_MARGIN;
+    pinger.active = true;
+
+    log_debug("Ping: Sweep of %d steps started", pinger.steps);
+    begin_step();
+    return LORAMAC_STATUS_OK;
+}
+
+
+void ping_stop(void)
+{
+    if (!pinger.active) return;
+    pinger.active = false;
+    release();
+}
+
+
+int ping_echo(bool enable)
+{
+    int rc;
+
+    if (!enable) {
+        if (echo.enabled) {
+            echo.enabled = false;
+            release();
+        }
+        return LORAMAC_STATUS_OK;
+    }
+
+    if (echo.enabled) return LORAMAC_STATUS_OK;
+    if (pinger.active) return LORAMAC_STATUS_BUSY;
+
+    rc = claim();
+    if (rc != LORAMAC_STATUS_OK) return rc;
+
+    memset(&echo, 0, sizeof(echo));
+    echo.enabled = true;
+    return_to_base();
+    listen();
+    return LORAMAC_STATUS_OK;
+}
+
+
+bool ping_running(void)
+{
+    return pinger.active;
+}
+
+
+bool ping_echoing(void)
+{
+    return echo.enabled;
+}
+
+
+void ping_get_state(ping_state_t *dst)
+{
+    dst->step = pinger.step;
+    dst->steps = pinger.steps;
+    dst->echoed = echo.echoed;
+}
+
+
+void ping_process(void)
+{
+    if (pinger.active) pinger_process();
+    else if (echo.enabled) echo_process();
+}
@@ -0,0 +1,102 @@
+#ifndef _PING_H
+#define _PING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+//! @brief The largest number of payload lengths in a sweep
+#define PING_MAX_LENGTHS 4
+
+//! @brief The largest number of round trips per configuration
+#define PING_MAX_COUNT 100
+
+//! @brief The smallest payload length, the size of the ping header
+#define PING_MIN_LENGTH 8
+
+//! @brief Parameters of a ping-pong sweep
+typedef struct
+{
+    uint8_t count;        // Round trips per configuration, 1-PING_MAX_COUNT
+    uint8_t sf_min;       // Spreading factors 7-12
+    uint8_t sf_max;
+    uint8_t bandwidths;   // Bit mask of the bandwidth indices of p2p_config_t
+    uint8_t lengths[PING_MAX_LENGTHS];  // Payload lengths, zero if unused
+} ping_sweep_t;
+
+//! @brief Progress of the current or last sweep
+typedef struct
+{
+    uint8_t step;         // Configurations completed
+    uint8_t steps;        // Configurations in the sweep
+    uint32_t echoed;      // Packets returned by the echo node since AT$PONG=1
+} ping_state_t;
+
+/*! @brief P2P ping-pong benchmark
+ *
+ * Two modems measure the round-trip time, packet loss, and signal quality of
+ * the P2P LoRa link across a sweep of spreading factors, bandwidths, and
+ * payload lengths. One modem echoes every ping it receives (AT$PONG=1), the
+ * other sends the pings and collects the statistics (AT$PING). Both start
+ * from the link parameters configured with AT$P2P (the base configuration).
+ *
+ * Before each configuration of the sweep, the pinger announces it to the echo
+ * node with a switch packet sent with the base configuration, and both move to
+ * the new configuration once the echo node has replied. The configuration ends
+ * with an end packet that returns both to the base configuration. An echo node
+ * that misses the end packet returns to the base configuration once it has not
+ * heard from the pinger for several round trips.
+ *
+ * The round-trip time runs from the start of the transmission of a ping to the
+ * reception of the reply, so it includes the time on air of both packets and
+ * the turnaround of the echo node. Each reply carries the RSSI and SNR of the
+ * ping at the echo node. The results of each configuration are written to the
+ * host as:
+ *
+ *   +PING=<sf>,<bw kHz>,<length>,<sent>,<received>,<rtt min>,<rtt median>,
+ *         <rtt p90>,<rtt max>,<rtt avg>,<rssi>,<snr>,<remote rssi>,<remote snr>
+ *
+ * with the times in milliseconds and signal quality averaged over the
+ * received replies. The sweep completes with +EVENT=11,6, or with +EVENT=11,7
+ * if the echo node stopped responding to switch packets.
+ *
+ * Like the bulk transfer, the benchmark claims the radio from the P2P engine
+ * (see p2p_claim), so LoRaWAN and P2P LoRa are unavailable in the meantime.
+ */
+
+//! @brief Initialize the benchmark. Invoked from lrw_init.
+
+void ping_init(void);
+
+//! @brief Start a sweep as the pinger
+//! @return Zero on success, a @c LoRaMacStatus_t value on error
+
+int ping_start(const ping_sweep_t *sweep);
+
+//! @brief Abort the sweep in progress, if any, and release the radio
+
+void ping_stop(void);
+
+//! @brief Start or stop echoing pings
+//! @return Zero on success, a @c LoRaMacStatus_t value on error
+
+int ping_echo(bool enable);
+
+//! @brief Return true if a sweep is in progress
+
+bool ping_running(void);
+
+//! @brief Return true if the modem echoes pings
+
+bool ping_echoing(void);
+
+//! @brief Get the progress of the sweep and the number of echoed packets
+//! @param[out] state Destination
+
+void ping_get_state(ping_state_t *state);
+
+//! @brief Send pings, echo received packets, and report results. Invoked from
+//! lrw_process.
+
+void ping_process(void);
+
+#endif // _PING_H
@@ -0,0 +1,129 @@
+#include "pool.h"
+#include "irq.h"
+#include "halt.h"
+
+#if POOL_BLOCKS_32 > 32 || POOL_BLOCKS_64 > 32 || POOL_BLOCKS_128 > 32 || POOL_BLOCKS_256 > 32
+#error A pool size class can have at most 32 blocks
+#endif
+
+// The free blocks of each class are tracked in a 32-bit bitmap
+#define ALL_FREE(n) ((n) >= 32 ? UINT32_MAX : (1UL << (n)) - 1)
+
+typedef struct {
+    uint8_t *base;
+    uint16_t size;
+    uint8_t blocks;
+    uint8_t used;
+    uint8_t peak;
+    uint32_t free;
+    uint8_t *owner;
+} pool_class_t;
+
+// The arenas are declared as uint32_t arrays to keep the blocks word-aligned
+static uint32_t arena32[POOL_BLOCKS_32 * 32 / 4];
+static uint32_t arena64[POOL_BLOCKS_64 * 64 / 4];
+static uint32_t arena128[POOL_BLOCKS_128 * 128 / 4];
+static uint32_t arena256[POOL_BLOCKS_256 * 256 / 4];
+
+static uint8_t owner32[POOL_BLOCKS_32];
+static uint8_t owner64[POOL_BLOCKS_64];
+static uint8_t owner128[POOL_BLOCKS_128];
+static uint8_t owner256[POOL_BLOCKS_256];
+
+// Ordered by block size, smallest first
+static pool_class_t classes[POOL_CLASSES] = {
+    { (uint8_t *)arena32,  32,  POOL_BLOCKS_32,  0, 0, ALL_FREE(POOL_BLOCKS_32),  owner32 },
+    { (uint8_t *)arena64,  64,  POOL_BLOCKS_64,  0, 0, ALL_FREE(POOL_BLOCKS_64),  owner64 },
+    { (uint8_t *)arena128, 128, POOL_BLOCKS_128, 0, 0, ALL_FREE(POOL_BLOCKS_128), owner128 },
+    { (uint8_t *)arena256, 256, POOL_BLOCKS_256, 0, 0, ALL_FREE(POOL_BLOCKS_256), owner256 }
+};
+
+static uint8_t owned[POOL_OWNERS];
+static uint32_t failures;
+
+
+void *pool_alloc(size_t size, pool_owner_t owner)
+{
+    pool_class_t *c;
+    unsigned int i;
+    void *rv = NULL;
+
+    uint32_t mask = disable_irq();
+
+    for (c = classes; c < classes + POOL_CLASSES; c++) {
+        if (c->size < size || c->free == 0) continue;
+
+        i = __builtin_ctz(c->free);
+        c->free &= ~(1UL << i);
+        c->owner[i] = owner;
+        if (++c->used > c->peak) c->peak = c->used;
+        owned[owner]++;
+        rv = c->base + i * c->size;
+        break;
+    }
+
+    if (rv == NULL) failures++;
+
+    reenable_irq(mask);
+    return rv;
+}
+
+
+void pool_free(void *block)
+{
+    uint8_t *p = block;
+    pool_class_t *c;
+    unsigned int i;
+
+    if (p == NULL) return;
+
+    uint32_t mask = disable_irq();
+
+    for (c = classes; c < classes + POOL_CLASSES; c++) {
+        if (p < c->base || p >= c->base + c->blocks * c->size) continue;
+
+        i = (p - c->base) / c->size;
+        if (p != c->base + i * c->size || (c->free & (1UL << i)))
+            halt("Bug: Invalid block passed to pool_free");
+
+        c->free |= 1UL << i;
+        c->used--;
+        owned[c->owner[i]]--;
+        c->owner[i] = POOL_FREE;
+
+        reenable_irq(mask);
+        return;
+    }
+
+    halt("Bug: Invalid block passed to pool_free");
+}
+
+
+void pool_get_stats(pool_stats_t *stats)
+{
+    uint32_t mask = disable_irq();
+
+    for (unsigned int i = 0; i < POOL_CLASSES; i++) {
+        stats->cls[i].size = classes[i].size;
+        stats->cls[i].blocks = classes[i].blocks;
+        stats->cls[i].used = classes[i].used;
+        stats->cls[i].peak = classes[i].peak;
+    }
+    for (unsigned int i = 0; i < POOL_OWNERS; i++)
+        stats->owned[i] = owned[i];
+    stats->failures = failures;
+
+    reenable_irq(mask);
+}
+
+
+void pool_reset_stats(void)
+{
+    uint32_t mask = disable_irq();
+
+    for (unsigned int i = 0; i < POOL_CLASSES; i++)
+        classes[i].peak = classes[i].used;
+    failures = 0;
+
+    reenable_irq(mask);
+}
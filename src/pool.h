@@ -0,0 +1,84 @@
+#ifndef _POOL_H
+#define _POOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+//! @brief The number of blocks in each size class. The classes hold 32, 64,
+//! 128, and 256 bytes, and each has at most 32 blocks.
+#ifndef POOL_BLOCKS_32
+#define POOL_BLOCKS_32 8
+#endif
+#ifndef POOL_BLOCKS_64
+#define POOL_BLOCKS_64 8
+#endif
+#ifndef POOL_BLOCKS_128
+#define POOL_BLOCKS_128 4
+#endif
+#ifndef POOL_BLOCKS_256
+#define POOL_BLOCKS_256 6
+#endif
+
+#define POOL_CLASSES 4
+
+//! @brief The subsystem holding a block
+typedef enum
+{
+    POOL_FREE = 0,
+    POOL_LRW_TX,    // Uplink queue, see lrw_enqueue
+    POOL_LRW_RX,    // Downlink queue
+    POOL_P2P,       // P2P receive queue
+    POOL_OWNERS
+} pool_owner_t;
+
+//! @brief Usage of a single size class
+typedef struct
+{
+    uint16_t size;       // Block size in bytes
+    uint8_t blocks;      // Number of blocks
+    uint8_t used;        // Blocks currently allocated
+    uint8_t peak;        // Most blocks allocated at once since boot or reset
+} pool_class_stats_t;
+
+//! @brief Usage of the whole pool
+typedef struct
+{
+    pool_class_stats_t cls[POOL_CLASSES];
+    uint8_t owned[POOL_OWNERS];  // Blocks held by each owner, [0] is unused
+    uint32_t failures;           // Allocations that could not be satisfied
+} pool_stats_t;
+
+/*! @brief Fixed-block memory pool for message payloads
+ *
+ * Queued uplinks, queued downlinks, and received P2P packets keep their
+ * payload in blocks allocated from a shared pool rather than in fixed
+ * per-slot arrays sized for the largest possible message. Since most messages
+ * are short, the same RAM holds more messages in flight.
+ *
+ * A request is served from the smallest size class that fits and has a free
+ * block, falling back to the larger classes. Each block records its owner for
+ * the statistics reported with AT$MEM. The functions may be invoked from
+ * interrupt handlers.
+ */
+
+//! @brief Allocate a block of at least size bytes
+//! @param[in] size Requested size, at most 256 bytes
+//! @param[in] owner The subsystem that will hold the block
+//! @return Pointer to the block, NULL if the pool is exhausted
+
+void *pool_alloc(size_t size, pool_owner_t owner);
+
+//! @brief Return a block to the pool. Does nothing if block is NULL.
+
+void pool_free(void *block);
+
+//! @brief Get the pool statistics
+//! @param[out] stats Destination
+
+void pool_get_stats(pool_stats_t *stats);
+
+//! @brief Reset the peak usage and failure counters
+
+void pool_reset_stats(void);
+
+#endif // _POOL_H
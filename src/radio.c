@@ -1,16 +1,261 @@
+#define LOG_MODULE_THRESHOLD LOG_THRESHOLD_RADIO
 #include <loramac-node/src/radio/sx1276/sx1276.h>
+#include <loramac-node/src/radio/sx1276/sx1276Regs-Fsk.h>
+#include <LoRaWAN/Utilities/timeServer.h>
 #include "log.h"
+#include "lrw.h"
+#include "nvm.h"
+#include "sx1276-board.h"
+#include "trace.h"
+#include "energy.h"
+#include "rtc.h"
+#include "irq.h"
 
 
 int16_t radio_rssi;
 int8_t radio_snr;
 
+// The frequency and the RTC time (in ticks) of the most recently received
+// packet. Used to annotate downlinks with per-frame metadata.
+uint32_t radio_rx_frequency;
+uint32_t radio_rx_time;
+
+// Incremented on each completed transmission
+volatile uint32_t radio_tx_count;
+
+// The RTC time (in ticks) of the most recent TxDone, and the time on air (ms)
+// of the most recently received LoRa packet. The RX windows of class A open
+// relative to TxDone; the preamble of a downlink started radio_rx_airtime
+// before radio_rx_time.
+uint32_t radio_tx_time;
+uint32_t radio_rx_airtime;
+
+// Listen-before-talk statistics: the number of channel checks, the number of
+// checks that found the channel busy, and the highest RSSI (dBm), the number of
+// RSSI samples, and the duration (ms) of the most recent check.
+uint32_t radio_lbt_checks;
+uint32_t radio_lbt_busy;
+int16_t radio_lbt_rssi;
+uint32_t radio_lbt_samples;
+uint32_t radio_lbt_time;
+
+// CAD receive statistics: the number of channel activity detections run, the
+// number of detections that found a preamble, and the number of packets
+// received after a detection
+uint32_t radio_cad_cycles;
+uint32_t radio_cad_detections;
+uint32_t radio_cad_packets;
+
+// Idle policy statistics: the number of gaps before a class A receive window
+// bridged in standby, and the number of such gaps the radio slept through
+uint32_t radio_idle_holds;
+uint32_t radio_idle_sleeps;
+
+static uint32_t channel;
+
+// The LoRa parameters of the current RX configuration, see radio_rx_airtime
+static struct {
+    bool lora;
+    uint32_t bandwidth;
+    uint32_t datarate;
+    uint8_t coderate;
+    uint16_t preamble;
+} rx_config;
+
 // Below, we replace the RxDone callback given to us by LoRaMac-node with our
 // own version to save the RSSI and SNR if each received packet. The original
 // callback (the one from LoRaMac-node) is kept here.
 static void (*OrigRxDone)(uint8_t *payload, uint16_t size, int16_t rssi, int8_t snr);
+static void (*OrigTxDone)(void);
+static void (*OrigRxTimeout)(void);
+static void (*OrigRxError)(void);
+static void (*OrigTxTimeout)(void);
+
+// While the P2P engine (p2p.c) has parked LoRaMac, the radio events are
+// delivered to its callbacks instead of the original ones
+static const RadioEvents_t *override;
+
+// Duty-cycled continuous reception (class C). Instead of keeping the receiver
+// on, the radio sleeps and wakes up every cad.period ms to run channel activity
+// detection (CAD) with the current RX configuration. Only if a preamble is
+// detected is the receiver switched on, for at most cad.period +
+// CAD_RX_TIMEOUT ms. The sender must use a preamble longer than the period.
+// Requests for continuous reception (Rx with zero timeout) are served in this
+// mode while cad.period is non-zero. Any other radio operation ends it.
+#define CAD_RX_TIMEOUT 3000
+
+static enum {
+    CAD_OFF = 0,   // Not in use, the radio is controlled by LoRaMac
+    CAD_SLEEP,     // Waiting for the next detection
+    CAD_DETECT,    // Channel activity detection running
+    CAD_RECEIVE    // Preamble detected, receiving
+} cad_state;
+
+static uint32_t cad_period;
+static bool rx_continuous;
+static TimerEvent_t cad_timer;
+
+// Set on each transmission and cleared by the following reception so that the
+// energy profiler can tell the RX1 window from the RX2 window (and from class C
+// reception)
+static bool rx1_pending;
+
+// Gap-aware idle policy (sysconf.rx_standby). LoRaMac puts the radio to sleep
+// after each transmission and after an RX1 window that received nothing.
+// Waking it again powers up the TCXO and starts the crystal oscillator of the
+// SX1276, which takes several milliseconds and has to happen before the
+// window opens. Gaps shorter than RADIO_STANDBY_RATIO times the measured
+// wake-up time are instead bridged with the radio in standby and the TCXO on.
+// The default ratio bridges the 1 s gaps of class A with the ~5 ms TCXO
+// start-up and sleeps through the 5 s and 6 s join-accept delays.
+#ifndef RADIO_STANDBY_RATIO
+#define RADIO_STANDBY_RATIO 250
+#endif
+
+// A held radio is put to sleep this long (ms) after the window was due to
+// open, should LoRaMac not use it, e.g., because the MAC was reset
+#define RADIO_HOLD_GRACE 100
+
+static enum {
+    GAP_NONE = 0,  // No receive window expected
+    GAP_RX1,       // Transmitted, the RX1 window comes next
+    GAP_RX2        // RX1 closed without a packet, the RX2 window comes next
+} gap_state;
+
+// The RX1 and RX2 delays (ms) of the current request, see radio_set_rx_delays
+static uint32_t rx_delay[2];
+
+// The mean time (in 1/16 RTC ticks) it takes to wake the radio from sleep
+static uint32_t wakeup_time;
+
+static bool holding;
+static TimerEvent_t hold_timer;
+
+
+// Record the end of any radio phase in the energy profile
+static void energy_radio_idle(void)
+{
+    energy_mark(ENERGY_TX, false);
+    energy_mark(ENERGY_RX1, false);
+    energy_mark(ENERGY_RX2, false);
+}
+
+
+static void cad_sleep(void)
+{
+    SX1276SetSleep();
+    cad_state = CAD_SLEEP;
+    TimerSetValue(&cad_timer, cad_period);
+    TimerStart(&cad_timer);
+}
+
+
+static void cad_stop(void)
+{
+    TimerStop(&cad_timer);
+    cad_state = CAD_OFF;
+}
+
+
+static void hold_stop(void)
+{
+    TimerStop(&hold_timer);
+    holding = false;
+}
+
+
+static void on_hold_timer(void *ctx)
+{
+    (void)ctx;
+    if (!holding) return;
+
+    log_debug("radio: Receive window did not open, sleeping");
+    holding = false;
+    gap_state = GAP_NONE;
+    SX1276SetSleep();
+}
+
 
-#if DEBUG_LOG != 0
+// Returns true if the radio should wait in standby for the next receive
+// window of class A rather than sleep
+static bool hold_standby(void)
+{
+    uint32_t delay, threshold;
+    int32_t gap;
+
+    if (!sysconf.rx_standby) return false;
+
+    switch (gap_state) {
+        case GAP_RX1: delay = rx_delay[0]; break;
+        case GAP_RX2: delay = rx_delay[1]; break;
+        default: return false;
+    }
+    if (delay == 0) return false;
+
+    gap = (int32_t)(radio_tx_time + rtc_ms2tick(delay) - rtc_get_timer_value());
+    threshold = wakeup_time * RADIO_STANDBY_RATIO / 16;
+    if (gap > (int32_t)threshold) {
+        radio_idle_sleeps++;
+        return false;
+    }
+    if (gap < 0) gap = 0;
+
+    radio_idle_holds++;
+    TimerSetValue(&hold_timer, rtc_tick2ms(gap) + RADIO_HOLD_GRACE);
+    TimerStart(&hold_timer);
+    return true;
+}
+
+
+static void on_cad_timer(void *ctx)
+{
+    (void)ctx;
+    if (cad_state != CAD_SLEEP) return;
+    cad_state = CAD_DETECT;
+    SX1276StartCad();
+}
+
+
+static void CadDone(bool detected)
+{
+    if (cad_state != CAD_DETECT) return;
+
+    radio_cad_cycles++;
+    if (!detected) {
+        cad_sleep();
+        return;
+    }
+
+    radio_cad_detections++;
+    cad_state = CAD_RECEIVE;
+    SX1276SetRx(cad_period + CAD_RX_TIMEOUT);
+}
+
+
+void radio_cad_rx_set(uint32_t period)
+{
+    uint32_t mask = disable_irq();
+    cad_period = period;
+
+    // Apply the change to an ongoing continuous reception right away
+    if (rx_continuous) {
+        if (period && cad_state == CAD_OFF) {
+            cad_sleep();
+        } else if (!period && cad_state != CAD_OFF) {
+            cad_stop();
+            SX1276SetRx(0);
+        }
+    }
+    reenable_irq(mask);
+}
+
+
+uint32_t radio_cad_rx_get(void)
+{
+    return cad_period;
+}
+
+#if DEBUG_LOG != 0 && LOG_THRESHOLD_RADIO <= 1
 
 static const char *modem2str(RadioModems_t modem)
 {
@@ -71,17 +316,133 @@ static bool SX1276CheckRfFrequency(__attribute__((unused)) uint32_t frequency)
 
 static void SetChannel(uint32_t freq)
 {
-    log_debug("SX1276SetChannel: %.3f MHz", (float)freq / (float)1000000);
+    log_debug("SX1276SetChannel: %lu.%03lu MHz", freq / 1000000, freq / 1000 % 1000);
+    channel = freq;
     SX1276SetChannel(freq);
 }
 
 
+// FSK receiver bandwidths and their RegRxBw values, from sx1276.c
+static const struct {
+    uint32_t bandwidth;
+    uint8_t value;
+} fsk_bandwidths[] = {
+    {   2600, 0x17 }, {   3100, 0x0F }, {   3900, 0x07 }, {   5200, 0x16 },
+    {   6300, 0x0E }, {   7800, 0x06 }, {  10400, 0x15 }, {  12500, 0x0D },
+    {  15600, 0x05 }, {  20800, 0x14 }, {  25000, 0x0C }, {  31300, 0x04 },
+    {  41700, 0x13 }, {  50000, 0x0B }, {  62500, 0x03 }, {  83333, 0x12 },
+    { 100000, 0x0A }, { 125000, 0x02 }, { 166700, 0x11 }, { 200000, 0x09 },
+    { 250000, 0x01 }, { 300000, 0x00 }
+};
+
+
+static uint8_t fsk_bandwidth_value(uint32_t bandwidth)
+{
+    for (unsigned int i = 0; i < sizeof(fsk_bandwidths) / sizeof(fsk_bandwidths[0]) - 1; i++)
+        if (bandwidth >= fsk_bandwidths[i].bandwidth && bandwidth < fsk_bandwidths[i + 1].bandwidth)
+            return fsk_bandwidths[i].value;
+    return fsk_bandwidths[sizeof(fsk_bandwidths) / sizeof(fsk_bandwidths[0]) - 1].value;
+}
+
+
+// Carrier sense for listen-before-talk (AS923, KR920). Unlike the version in
+// sx1276.c, which waits a fixed millisecond for the receiver to start, this
+// version starts sampling as soon as the receiver reports RxReady, i.e., once
+// the first RSSI value is available. The RSSI register is then read back to
+// back. With the default smoothing of 8 samples, the register is updated
+// every 10 us at 200 kHz bandwidth, which is about the duration of one SPI
+// register read. The first sample above the threshold ends the check.
+static bool IsChannelFree(uint32_t freq, uint32_t rxBandwidth, int16_t rssiThresh,
+    uint32_t maxCarrierSenseTime)
+{
+    bool free = true;
+    int16_t rssi, max = INT16_MIN;
+    uint32_t samples = 0;
+    TimerTime_t start;
+
+    cad_stop();
+    hold_stop();
+    rx_continuous = false;
+    SX1276SetSleep();
+    SX1276SetModem(MODEM_FSK);
+    SetChannel(freq);
+    SX1276Write(REG_RXBW, fsk_bandwidth_value(rxBandwidth));
+    SX1276Write(REG_AFCBW, fsk_bandwidth_value(rxBandwidth));
+    SX1276SetOpMode(RF_OPMODE_RECEIVER);
+
+    // Wait for the receiver to start, but no more than a millisecond
+    start = TimerGetCurrentTime();
+    while ((SX1276Read(REG_IRQFLAGS1) & RF_IRQFLAGS1_RXREADY) == 0)
+        if (TimerGetElapsedTime(start) > 1) break;
+
+    start = TimerGetCurrentTime();
+    do {
+        rssi = SX1276ReadRssi(MODEM_FSK);
+        samples++;
+        if (rssi > max) max = rssi;
+        if (rssi > rssiThresh) {
+            free = false;
+            break;
+        }
+    } while (TimerGetElapsedTime(start) < maxCarrierSenseTime);
+
+    SX1276SetSleep();
+
+    radio_lbt_checks++;
+    if (!free) radio_lbt_busy++;
+    radio_lbt_rssi = max;
+    radio_lbt_samples = samples;
+    radio_lbt_time = TimerGetElapsedTime(start);
+    lrw_channel_noise(freq, max);
+
+    log_debug("LBT: %s rssi=%d samples=%ld", free ? "free" : "busy", max, samples);
+    return free;
+}
+
+
+// RSSI survey for AT$SCAN. The receiver is started the same way as in
+// IsChannelFree and the RSSI register is read back to back @p samples times.
+void radio_scan(uint32_t freq, uint32_t bandwidth, unsigned int samples,
+    int16_t *min, int16_t *avg, int16_t *max)
+{
+    int16_t rssi;
+    int32_t sum = 0;
+    TimerTime_t start;
+
+    cad_stop();
+    hold_stop();
+    rx_continuous = false;
+    SX1276SetSleep();
+    SX1276SetModem(MODEM_FSK);
+    SetChannel(freq);
+    SX1276Write(REG_RXBW, fsk_bandwidth_value(bandwidth));
+    SX1276Write(REG_AFCBW, fsk_bandwidth_value(bandwidth));
+    SX1276SetOpMode(RF_OPMODE_RECEIVER);
+
+    start = TimerGetCurrentTime();
+    while ((SX1276Read(REG_IRQFLAGS1) & RF_IRQFLAGS1_RXREADY) == 0)
+        if (TimerGetElapsedTime(start) > 1) break;
+
+    *min = INT16_MAX;
+    *max = INT16_MIN;
+    for (unsigned int i = 0; i < samples; i++) {
+        rssi = SX1276ReadRssi(MODEM_FSK);
+        sum += rssi;
+        if (rssi < *min) *min = rssi;
+        if (rssi > *max) *max = rssi;
+    }
+    *avg = samples ? sum / (int32_t)samples : 0;
+
+    SX1276SetSleep();
+}
+
+
 static void SetTxConfig(RadioModems_t modem, int8_t power, uint32_t fdev,
     uint32_t bandwidth, uint32_t datarate, uint8_t coderate,
     uint16_t preambleLen, bool fixLen, bool crcOn, bool freqHopOn,
     uint8_t hopPeriod, bool iqInverted, uint32_t timeout)
 {
-#if DEBUG_LOG != 0
+#if DEBUG_LOG != 0 && LOG_THRESHOLD_RADIO <= 1
     log_compose();
     log_debug("SX1276SetTxConfig: %d dBm", power);
     log_debug(" %s", modem2str(modem));
@@ -116,7 +477,15 @@ static void SetRxConfig(RadioModems_t modem, uint32_t bandwidth, uint32_t datara
     uint16_t symbTimeout, bool fixLen, uint8_t payloadLen, bool crcOn,
     bool freqHopOn, uint8_t hopPeriod, bool iqInverted, bool rxContinuous)
 {
-#if DEBUG_LOG != 0
+    trace(TRACE_RX_CONFIG);
+
+    rx_config.lora = modem == MODEM_LORA;
+    rx_config.bandwidth = bandwidth;
+    rx_config.datarate = datarate;
+    rx_config.coderate = coderate;
+    rx_config.preamble = preambleLen;
+
+#if DEBUG_LOG != 0 && LOG_THRESHOLD_RADIO <= 1
     log_compose();
     log_debug("SX1276SetRxConfig: %s", modem2str(modem));
 
@@ -156,37 +525,222 @@ static void SetRxConfig(RadioModems_t modem, uint32_t bandwidth, uint32_t datara
 // to the original callback.
 static void RxDone(uint8_t *payload, uint16_t size, int16_t rssi, int8_t snr)
 {
+    trace(TRACE_RX_DONE);
+    radio_rx_time = rtc_get_timer_value();
+    radio_rx_airtime = rx_config.lora ? SX1276GetTimeOnAir(MODEM_LORA, rx_config.bandwidth,
+        rx_config.datarate, rx_config.coderate, rx_config.preamble, false, size, false) : 0;
+    radio_rx_frequency = channel;
     radio_rssi = rssi;
     radio_snr = snr;
+    gap_state = GAP_NONE;
+    if (!rx_continuous) energy_radio_idle();
+
+    // Go back to CAD. The payload stays in the radio driver's buffer.
+    if (cad_state == CAD_RECEIVE) {
+        radio_cad_packets++;
+        cad_sleep();
+    }
+
+    if (override != NULL) {
+        if (override->RxDone != NULL) override->RxDone(payload, size, rssi, snr);
+        return;
+    }
     if (OrigRxDone != NULL) OrigRxDone(payload, size, rssi, snr);
 }
 
 
+static void RxTimeout(void)
+{
+    if (!rx_continuous) energy_radio_idle();
+
+    // A detected preamble that was not followed by a packet is not reported
+    // to LoRaMac, which expects continuous reception never to time out
+    if (cad_state == CAD_RECEIVE) {
+        cad_sleep();
+        return;
+    }
+    if (override != NULL) {
+        if (override->RxTimeout != NULL) override->RxTimeout();
+        return;
+    }
+    if (OrigRxTimeout != NULL) OrigRxTimeout();
+}
+
+
+static void RxError(void)
+{
+    if (!rx_continuous) energy_radio_idle();
+    if (cad_state == CAD_RECEIVE) cad_sleep();
+    if (override != NULL) {
+        if (override->RxError != NULL) override->RxError();
+        return;
+    }
+    if (OrigRxError != NULL) OrigRxError();
+}
+
+
+static void TxDone(void)
+{
+    trace(TRACE_TX_DONE);
+    radio_tx_time = rtc_get_timer_value();
+    radio_tx_count++;
+    gap_state = GAP_RX1;
+    energy_mark(ENERGY_TX, false);
+    if (override != NULL) {
+        if (override->TxDone != NULL) override->TxDone();
+        return;
+    }
+    if (OrigTxDone != NULL) OrigTxDone();
+}
+
+
+static void TxTimeout(void)
+{
+    energy_mark(ENERGY_TX, false);
+    gap_state = GAP_NONE;
+    if (override != NULL) {
+        if (override->TxTimeout != NULL) override->TxTimeout();
+        return;
+    }
+    if (OrigTxTimeout != NULL) OrigTxTimeout();
+}
+
+
+void radio_set_events(const RadioEvents_t *events)
+{
+    uint32_t mask = disable_irq();
+    override = events;
+    reenable_irq(mask);
+}
+
+
+static void Rx(uint32_t timeout)
+{
+    cad_stop();
+    hold_stop();
+    rx_continuous = timeout == 0;
+    gap_state = gap_state == GAP_RX1 && !rx_continuous ? GAP_RX2 : GAP_NONE;
+
+    if (rx_continuous && cad_period) {
+        cad_sleep();
+        return;
+    }
+
+    trace(TRACE_RX_START);
+    energy_mark(rx1_pending && !rx_continuous ? ENERGY_RX1 : ENERGY_RX2, true);
+    rx1_pending = false;
+    SX1276SetRx(timeout);
+}
+
+
+static void Sleep(void)
+{
+    cad_stop();
+    hold_stop();
+    rx_continuous = false;
+    energy_radio_idle();
+
+    if (hold_standby()) {
+        holding = true;
+        SX1276SetStby();
+        // Nothing happens on the radio until the window opens. Release the RF
+        // switch and let the MCU enter the Stop mode in the meantime.
+        SX1276SetAntSwLowPower(true);
+        return;
+    }
+    SX1276SetSleep();
+}
+
+
+static void Standby(void)
+{
+    uint32_t start;
+    bool asleep;
+
+    cad_stop();
+    hold_stop();
+    rx_continuous = false;
+    energy_radio_idle();
+
+    asleep = (SX1276Read(REG_OPMODE) & ~RF_OPMODE_MASK) == RF_OPMODE_SLEEP;
+    start = rtc_get_timer_value();
+    SX1276SetStby();
+
+    // Keep a running mean of the wake-up time, including the TCXO start-up
+    if (asleep)
+        wakeup_time += (rtc_get_timer_value() - start) * 2 - wakeup_time / 8;
+}
+
+
+static void Send(uint8_t *buffer, uint8_t size)
+{
+    cad_stop();
+    hold_stop();
+    gap_state = GAP_NONE;
+    rx_continuous = false;
+    energy_radio_idle();
+    energy_mark(ENERGY_TX, true);
+    rx1_pending = true;
+    SX1276Send(buffer, size);
+}
+
+
 static void Init(RadioEvents_t *events)
 {
     // Save the original RxDone callback and replace it with our own version
     OrigRxDone = events->RxDone;
     events->RxDone = RxDone;
+    OrigTxDone = events->TxDone;
+    events->TxDone = TxDone;
+    OrigRxTimeout = events->RxTimeout;
+    events->RxTimeout = RxTimeout;
+    OrigRxError = events->RxError;
+    events->RxError = RxError;
+    OrigTxTimeout = events->TxTimeout;
+    events->TxTimeout = TxTimeout;
+    events->CadDone = CadDone;
+    TimerInit(&cad_timer, on_cad_timer);
+    TimerInit(&hold_timer, on_hold_timer);
+    wakeup_time = rtc_ms2tick(SX1276GetWakeupTime()) * 16;
     SX1276Init(events);
 }
 
 
+void radio_set_rx_delays(uint32_t rx1, uint32_t rx2)
+{
+    rx_delay[0] = rx1;
+    rx_delay[1] = rx2;
+}
+
+
+uint32_t radio_wakeup_us(void)
+{
+    return rtc_tick2ms(wakeup_time * 1000 / 16);
+}
+
+
+uint32_t radio_standby_threshold(void)
+{
+    return rtc_tick2ms(wakeup_time * RADIO_STANDBY_RATIO / 16);
+}
+
+
 // Radio driver structure initialization
 const struct Radio_s Radio = {
     .Init = Init,
     .GetStatus = SX1276GetStatus,
     .SetModem = SX1276SetModem,
     .SetChannel = SetChannel,
-    .IsChannelFree = SX1276IsChannelFree,
+    .IsChannelFree = IsChannelFree,
     .Random = SX1276Random,
     .SetRxConfig = SetRxConfig,
     .SetTxConfig = SetTxConfig,
     .CheckRfFrequency = SX1276CheckRfFrequency,
     .TimeOnAir = SX1276GetTimeOnAir,
-    .Send = SX1276Send,
-    .Sleep = SX1276SetSleep,
-    .Standby = SX1276SetStby,
-    .Rx = SX1276SetRx,
+    .Send = Send,
+    .Sleep = Sleep,
+    .Standby = Standby,
+    .Rx = Rx,
     .StartCad = SX1276StartCad,
     .SetTxContinuousWave = SX1276SetTxContinuousWave,
     .Rssi = SX1276ReadRssi,
@@ -0,0 +1,90 @@
+#include "remote.h"
+
+#if REMOTE_ATCI == 1
+
+#include <string.h>
+#include <LoRaWAN/Utilities/timeServer.h>
+#include "atci.h"
+#include "lrw.h"
+#include "nvm.h"
+#include "system.h"
+#include "log.h"
+
+// The largest downlink payload
+#define MAX_REQUEST 242
+
+// Records beyond this many are not executed
+#define MAX_RESULTS 32
+
+
+// The request is kept until the main loop gets to it. The commands may call
+// into LoRaMac, which must not happen from mcps_indication.
+static struct {
+    uint8_t buf[MAX_REQUEST + 1];
+    uint8_t length;
+    bool pending;
+} request;
+
+
+void remote_process(const uint8_t *buffer, size_t length, bool multicast)
+{
+    if (multicast) {
+        log_warning("remote: Ignoring multicast request");
+        return;
+    }
+
+    if (length < 1 || length > MAX_REQUEST) return;
+
+    if (request.pending) {
+        log_warning("remote: Previous request still pending, dropping");
+        return;
+    }
+
+    memcpy(request.buf, buffer, length);
+    request.length = length;
+    request.pending = true;
+    system_post(SYSTEM_TASK_LORA);
+}
+
+
+void remote_poll(void)
+{
+    uint8_t ans[1 + MAX_RESULTS], *p, *end, *params, n, saved;
+    size_t len = 1;
+    int rc;
+
+    if (!request.pending) return;
+
+    ans[0] = request.buf[0];
+    p = request.buf + 1;
+    end = request.buf + request.length;
+
+    while (end - p >= 2 && len < sizeof(ans)) {
+        n = p[1];
+        params = p + 2;
+        if (n > end - params) {
+            log_debug("remote: Truncated record");
+            break;
+        }
+
+        // Setters may expect the parameters to be terminated. The byte
+        // following them belongs to the next record and is put back.
+        saved = params[n];
+        params[n] = 0;
+        rc = atci_execute(p[0], (char *)params, n);
+        params[n] = saved;
+
+        // Keep the request for the next pass once the host is done
+        if (rc == ATCI_EXEC_BUSY && len == 1) return;
+
+        ans[len++] = (int8_t)rc;
+        p = params + n;
+    }
+
+    request.pending = false;
+
+    if (lrw_enqueue(sysconf.remote_port, ans, len, false, NULL) < 0)
+        log_warning("remote: Transmit queue full, dropping results");
+}
+
+#endif // REMOTE_ATCI
@@ -0,0 +1,52 @@
+#ifndef _REMOTE_H
+#define _REMOTE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/*! @brief Remote execution of AT commands
+ *
+ * Downlinks on the port configured with AT$REMOTE carry AT command setters in
+ * a compact binary form, which the modem executes without involving the host.
+ * The network can thus change, e.g., the data rate, the TX power, or the
+ * channel mask of a device in the field without a host firmware update and
+ * without waking the host up.
+ *
+ * Downlink payload:
+ *
+ *   u8 token, followed by records of
+ *   u8 command, u8 length, char params[length]
+ *
+ * The command is the position of the command in the output of AT+CLAC
+ * (starting at 0) and the parameters are the text that would follow '=' on
+ * the command line, e.g., {17, 1, '3'}. Only setters can be executed.
+ *
+ * The results are sent in an unconfirmed uplink on the same port through the
+ * transmit queue: the token, followed by one signed byte per record, 0 if the
+ * command succeeded, the error number of its +ERR response otherwise. -128
+ * marks a command that has no setter, -127 a command that could not be run
+ * because the host was sending payload data at the time.
+ *
+ * Only unicast downlinks are accepted. Those are authenticated with the
+ * device's own session keys, whereas multicast keys are shared by a group.
+ */
+
+#if REMOTE_ATCI == 1
+
+//! @brief Process a downlink received on the remote execution port. The
+//! commands are executed later from remote_poll.
+//! @param[in] buffer Downlink payload
+//! @param[in] length Length of the payload
+//! @param[in] multicast True if the downlink was received on a multicast group
+
+void remote_process(const uint8_t *buffer, size_t length, bool multicast);
+
+//! @brief Execute the commands received with remote_process. Invoke from the
+//! main loop outside of LoRaMacProcess.
+
+void remote_poll(void);
+
+#endif // REMOTE_ATCI
+
+#endif // _REMOTE_H
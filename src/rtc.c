@@ -3,9 +3,12 @@
 #include <time.h>
 #include <LoRaWAN/Utilities/systime.h>
 #include <LoRaWAN/Utilities/utilities.h>
+#include <LoRaWAN/Utilities/timeServer.h>
 #include <stm/STM32L0xx_HAL_Driver/Inc/stm32l0xx_ll_rtc.h>
 #include "system.h"
 #include "irq.h"
+#include "log.h"
+#include "trace.h"
 
 typedef struct
 {
@@ -41,6 +44,16 @@ typedef struct
 #define CONV_NUMER (MSEC_NUMBER >> COMMON_FACTOR)
 #define CONV_DENOM (1 << (N_PREDIV_S - COMMON_FACTOR))
 
+/* Division by CONV_NUMER is implemented as a multiplication by its reciprocal
+ * ceil(2^38 / 125), which is exact for all 32-bit dividends. The Cortex-M0+ has
+ * neither a hardware divider nor a 32x32->64 multiplier, so this avoids the
+ * 64-bit division helpers from libgcc. */
+#if CONV_NUMER != 125
+#  error The reciprocal below must be recomputed for the new CONV_NUMER
+#endif
+#define CONV_RECIPROCAL 2199023256UL
+#define CONV_RECIPROCAL_SHIFT 6
+
 #define DAYS_IN_LEAP_YEAR ((uint32_t)366U)
 #define DAYS_IN_YEAR ((uint32_t)365U)
 #define SECONDS_IN_1DAY ((uint32_t)86400U)
@@ -52,11 +65,37 @@ typedef struct
 #define DAYS_IN_MONTH_CORRECTION_NORM ((uint32_t)0x99AAA0)
 #define DAYS_IN_MONTH_CORRECTION_LEAP ((uint32_t)0x445550)
 
+/* LPTIM1 alarm for short timeouts, see lptim_start. The counter starts about
+ * two cycles after SNGSTRT is written and ARRM is set on the cycle after CNT
+ * reaches ARR. The timer value read before arming lags the actual time by half
+ * a tick on average. */
+#define LPTIM_CYCLES_PER_TICK (32768 >> N_PREDIV_S)
+#define LPTIM_MAX_TIMEOUT 1024 /* in ticks, well within the 16-bit counter */
+#define LPTIM_MIN_ALARM_DELAY 1 /* in ticks */
+#define LPTIM_START_LATENCY (3 + LPTIM_CYCLES_PER_TICK / 2)
+
 #define DIVC(X, N) (((X) + (N)-1) / (N))
 
+/* Wakeup latency estimator: the gains of the exponentially weighted moving
+ * average of the latency and of its mean deviation (as powers of two), the
+ * number of samples needed before the estimate is used, and the largest sample
+ * accepted (anything longer is not a Stop-mode exit latency). */
+#define WAKE_UP_MEAN_SHIFT 3
+#define WAKE_UP_DEV_SHIFT 2
+#define WAKE_UP_MIN_SAMPLES 4
+#define WAKE_UP_MAX_SAMPLE 32 /* in ticks */
+
 static bool rtc_initalized = false;           // Indicates if the RTC is already Initalized or not
-static bool McuWakeUpTimeInitialized = false; // compensates MCU wakeup time
 static int16_t McuWakeUpTimeCal = 0;          // compensates MCU wakeup time
+static uint32_t AlarmTarget;                  // timer value at which the alarm fires
+
+// Running estimate of the MCU wakeup latency (Stop-mode exit until the clocks
+// are running again), in 1/16 ticks
+static struct {
+    uint32_t samples;
+    uint32_t mean;
+    uint32_t dev;
+} wake_up;
 // Number of days in each month on a normal year
 static const uint8_t DaysInMonth[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
 // Number of days in each month on a leap year
@@ -66,27 +105,63 @@ static RTC_HandleTypeDef RtcHandle = {0};
 static RTC_AlarmTypeDef RTC_AlarmStructure;
 static RtcTimerContext_t RtcTimerContext;
 
-static void HW_RTC_SetConfig(void);
+// The timer value in ms taken at the start of the current main loop iteration
+static TimerTime_t now_ms;
+
+// The tick count reached by the previous boot before a warm reset, see rtc_init
+static uint64_t previous_ticks;
+
+static void HW_RTC_SetConfig(bool reset_calendar);
+static void HW_RTC_ResetCalendar(void);
 static void rtc_set_alarmConfig(void);
 static void HW_RTC_StartWakeUpAlarm(uint32_t timeoutValue);
-static uint64_t HW_RTC_GetCalendarValue(RTC_DateTypeDef *RTC_DateStruct, RTC_TimeTypeDef *RTC_TimeStruct);
+static uint32_t HW_RTC_GetCalendarSeconds(RTC_DateTypeDef *RTC_DateStruct, RTC_TimeTypeDef *RTC_TimeStruct);
+static uint32_t HW_RTC_GetCalendarValue(RTC_DateTypeDef *RTC_DateStruct, RTC_TimeTypeDef *RTC_TimeStruct);
+static void read_calendar(uint32_t *ssr, uint32_t *tr, uint32_t *dr);
+static uint32_t day_start(uint32_t dr);
+static inline uint32_t time_of_day(uint32_t tr);
+#if LPTIM_ALARM == 1
+static void lptim_init(void);
+#endif
 
 void rtc_init(void)
 {
     if (rtc_initalized == false)
     {
-        HW_RTC_SetConfig();
+        /* After a watchdog, software, or NRST reset, the RTC has kept running
+         * since the previous boot. RTCEN is in the backup domain and is only
+         * clear after a power-on reset. Note how far the previous boot got
+         * before its calendar is reset. */
+        if (READ_BIT(RCC->CSR, RCC_CSR_RTCEN)) previous_ticks = rtc_get_ticks64();
+
+        HW_RTC_SetConfig(true);
         rtc_set_alarmConfig();
+#if LPTIM_ALARM == 1
+        lptim_init();
+#endif
         rtc_set_timer_context();
+        rtc_update_now();
         rtc_initalized = true;
     }
 }
 
-static void HW_RTC_SetConfig(void)
+void rtc_init_resume(void)
 {
-    RTC_TimeTypeDef RTC_TimeStruct;
-    RTC_DateTypeDef RTC_DateStruct;
+    if (rtc_initalized == false)
+    {
+        HW_RTC_SetConfig(false);
+        rtc_set_alarmConfig();
+#if LPTIM_ALARM == 1
+        lptim_init();
+#endif
+        rtc_set_timer_context();
+        rtc_update_now();
+        rtc_initalized = true;
+    }
+}
 
+static void HW_RTC_SetConfig(bool reset_calendar)
+{
     RtcHandle.Instance = RTC;
 
     RtcHandle.Init.HourFormat = RTC_HOURFORMAT_24;
@@ -98,6 +173,21 @@ static void HW_RTC_SetConfig(void)
 
     HAL_RTC_Init(&RtcHandle);
 
+    /* The calendar runs in the backup domain, which survives Standby */
+    if (reset_calendar)
+    {
+        HW_RTC_ResetCalendar();
+    }
+
+    /*Enable Direct Read of the calendar registers (not through Shadow) */
+    HAL_RTCEx_EnableBypassShadow(&RtcHandle);
+}
+
+static void HW_RTC_ResetCalendar(void)
+{
+    RTC_TimeTypeDef RTC_TimeStruct;
+    RTC_DateTypeDef RTC_DateStruct;
+
     /*Monday 1st January 2016*/
     RTC_DateStruct.Year = 0;
     RTC_DateStruct.Month = RTC_MONTH_JANUARY;
@@ -116,37 +206,38 @@ static void HW_RTC_SetConfig(void)
     RTC_TimeStruct.DayLightSaving = RTC_STOREOPERATION_RESET;
 
     HAL_RTC_SetTime(&RtcHandle, &RTC_TimeStruct, RTC_FORMAT_BIN);
-
-    /*Enable Direct Read of the calendar registers (not through Shadow) */
-    HAL_RTCEx_EnableBypassShadow(&RtcHandle);
 }
 
 void rtc_set_mcu_wake_up_time(void)
 {
-    RTC_TimeTypeDef RTC_TimeStruct;
-    RTC_DateTypeDef RTC_DateStruct;
+    uint32_t sample, diff;
+
+    // Only wakeups caused by the alarm tell us how late the MCU runs after the
+    // alarm time. This function is invoked right after a Stop-mode exit with
+    // interrupts disabled, so a pending alarm has not been serviced yet.
+#if LPTIM_ALARM == 1
+    if (HAL_NVIC_GetPendingIRQ(LPTIM1_IRQn) != 1 || !(LPTIM1->ISR & LPTIM_ISR_ARRM))
+#endif
+    {
+        if (HAL_NVIC_GetPendingIRQ(RTC_IRQn) != 1) return;
+        if (__HAL_RTC_ALARM_GET_FLAG(&RtcHandle, RTC_FLAG_ALRAF) == RESET) return;
+    }
 
-    TimerTime_t now, hit;
-    int16_t McuWakeUpTime;
+    sample = rtc_get_timer_value() - AlarmTarget;
+    if (sample > WAKE_UP_MAX_SAMPLE) return;
+    sample <<= 4;
 
-    if ((McuWakeUpTimeInitialized == false) &&
-        (HAL_NVIC_GetPendingIRQ(RTC_IRQn) == 1))
-    {
-        /* warning: works ok if now is below 30 days
-       it is ok since it's done once at first alarm wake-up*/
-        McuWakeUpTimeInitialized = true;
-        now = (uint32_t)HW_RTC_GetCalendarValue(&RTC_DateStruct, &RTC_TimeStruct);
-
-        HAL_RTC_GetAlarm(&RtcHandle, &RTC_AlarmStructure, RTC_ALARM_A, RTC_FORMAT_BIN);
-        hit = RTC_AlarmStructure.AlarmTime.Seconds +
-              60 * (RTC_AlarmStructure.AlarmTime.Minutes +
-                    60 * (RTC_AlarmStructure.AlarmTime.Hours +
-                          24 * (RTC_AlarmStructure.AlarmDateWeekDay)));
-        hit = (hit << N_PREDIV_S) + (PREDIV_S - RTC_AlarmStructure.AlarmTime.SubSeconds);
-
-        McuWakeUpTime = (int16_t)((now - hit));
-        McuWakeUpTimeCal += McuWakeUpTime;
+    if (wake_up.samples++ == 0) {
+        wake_up.mean = sample;
+        wake_up.dev = sample / 2;
+    } else {
+        diff = sample > wake_up.mean ? sample - wake_up.mean : wake_up.mean - sample;
+        wake_up.mean = wake_up.mean - (wake_up.mean >> WAKE_UP_MEAN_SHIFT) + (sample >> WAKE_UP_MEAN_SHIFT);
+        wake_up.dev = wake_up.dev - (wake_up.dev >> WAKE_UP_DEV_SHIFT) + (diff >> WAKE_UP_DEV_SHIFT);
     }
+
+    if (wake_up.samples >= WAKE_UP_MIN_SAMPLES)
+        McuWakeUpTimeCal = (wake_up.mean + 8) >> 4;
 }
 
 int16_t rtc_get_mcu_wake_up_time(void)
@@ -154,15 +245,109 @@ int16_t rtc_get_mcu_wake_up_time(void)
     return McuWakeUpTimeCal;
 }
 
+int32_t rtc_get_mcu_wake_up_error(void)
+{
+    if (wake_up.samples < WAKE_UP_MIN_SAMPLES) return -1;
+
+    // Four mean deviations cover nearly all samples. Round up to whole ticks.
+    return rtc_tick2ms((4 * wake_up.dev + 15) >> 4);
+}
+
+// The smooth calibration written to the RTC is the sum of the correction set
+// with rtc_set_calibration and the temperature compensation
+static int32_t calibration;
+static int32_t temperature_calibration;
+static bool temperature_compensated;
+
+static void apply_calibration(void)
+{
+    uint32_t plus = RTC_SMOOTHCALIB_PLUSPULSES_RESET;
+    int32_t pulses = calibration + temperature_calibration;
+
+    if (pulses < RTC_CALIBRATION_MIN) pulses = RTC_CALIBRATION_MIN;
+    if (pulses > RTC_CALIBRATION_MAX) pulses = RTC_CALIBRATION_MAX;
+
+    // CALP adds 512 pulses and CALM masks up to 511 of them
+    if (pulses > 0) {
+        plus = RTC_SMOOTHCALIB_PLUSPULSES_SET;
+        pulses -= 512;
+    }
+
+    if (HAL_RTCEx_SetSmoothCalib(&RtcHandle, RTC_SMOOTHCALIB_PERIOD_32SEC, plus, -pulses) != HAL_OK)
+        log_error("Error while setting RTC calibration");
+}
+
+void rtc_set_calibration(int32_t pulses)
+{
+    if (pulses < RTC_CALIBRATION_MIN) pulses = RTC_CALIBRATION_MIN;
+    if (pulses > RTC_CALIBRATION_MAX) pulses = RTC_CALIBRATION_MAX;
+    calibration = pulses;
+    apply_calibration();
+}
+
+int32_t rtc_get_calibration(void)
+{
+    return calibration;
+}
+
+int32_t rtc_compensate_temperature(float temperature)
+{
+    float interim = temperature - RTC_TEMP_TURNOVER;
+
+    // The crystal runs slow by k * (T - T0)^2 ppm. Add the same number of
+    // pulses in units of 2^-20 (0.954 ppm).
+    float ppm = RTC_TEMP_COEFFICIENT * interim * interim;
+    temperature_calibration = lroundf(-ppm * 1.048576f);
+    temperature_compensated = true;
+    apply_calibration();
+    return temperature_calibration;
+}
+
+void rtc_clear_temperature_compensation(void)
+{
+    temperature_calibration = 0;
+    temperature_compensated = false;
+    apply_calibration();
+}
+
+int32_t rtc_get_temperature_compensation(void)
+{
+    return temperature_calibration;
+}
+
 uint32_t rtc_get_min_timeout(void)
 {
+#if LPTIM_ALARM == 1
+    return LPTIM_MIN_ALARM_DELAY;
+#else
     return (MIN_ALARM_DELAY);
+#endif
+}
+
+// Return the upper 32 bits of the 64-bit product a * b using 16-bit halves
+static inline uint32_t mulhi(uint32_t a, uint32_t b)
+{
+    uint32_t al = a & 0xffff, ah = a >> 16;
+    uint32_t bl = b & 0xffff, bh = b >> 16;
+    uint32_t m1 = ah * bl, m2 = al * bh;
+    uint32_t mid = ((al * bl) >> 16) + (m1 & 0xffff) + (m2 & 0xffff);
+    return ah * bh + (m1 >> 16) + (m2 >> 16) + (mid >> 16);
+}
+
+static inline uint32_t div_conv_numer(uint32_t v)
+{
+    return mulhi(v, CONV_RECIPROCAL) >> CONV_RECIPROCAL_SHIFT;
 }
 
 uint32_t rtc_ms2tick(TimerTime_t timeMilliSec)
 {
     /*return( ( timeMicroSec / RTC_ALARM_TIME_BASE ) ); */
-    return (uint32_t)((((uint64_t)timeMilliSec) * CONV_DENOM) / CONV_NUMER);
+    // Split ms into q * CONV_NUMER + r so that the product with CONV_DENOM
+    // cannot overflow: ms * CONV_DENOM / CONV_NUMER = q * CONV_DENOM + r *
+    // CONV_DENOM / CONV_NUMER. The result is truncated to 32 bits as before.
+    uint32_t q = div_conv_numer(timeMilliSec);
+    uint32_t r = timeMilliSec - q * CONV_NUMER;
+    return q * CONV_DENOM + div_conv_numer(r * CONV_DENOM);
 }
 
 TimerTime_t rtc_tick2ms(uint32_t tick)
@@ -173,18 +358,107 @@ TimerTime_t rtc_tick2ms(uint32_t tick)
     return ((seconds * 1000) + ((tick * 1000) >> N_PREDIV_S));
 }
 
+#if LPTIM_ALARM == 1
+
+/* Timeouts of up to LPTIM_MAX_TIMEOUT ticks, i.e., the RX windows and the
+ * other short MAC and radio timers, are served by LPTIM1 rather than by the
+ * RTC alarm. LPTIM1 counts LSE cycles (32 per tick) in Stop mode and is armed
+ * with a few register writes instead of a calendar alarm. This lets the
+ * wakeup latency be compensated in 1/16 ticks rather than whole ticks, and
+ * lets timeouts down to LPTIM_MIN_ALARM_DELAY ticks be spent in Stop mode. */
+static void lptim_init(void)
+{
+    // Clock LPTIM1 from the LSE in Run, Sleep, and Stop modes
+    RCC->CCIPR |= RCC_CCIPR_LPTIM1SEL;
+    RCC->APB1ENR |= RCC_APB1ENR_LPTIM1EN;
+    RCC->APB1SMENR |= RCC_APB1SMENR_LPTIM1SMEN;
+
+    // CFGR and IER can only be written while the timer is disabled
+    LPTIM1->CR = 0;
+    LPTIM1->CFGR = 0;
+    LPTIM1->IER = LPTIM_IER_ARRMIE;
+
+    // EXTI line 29 wakes the MCU up from Stop mode
+    EXTI->IMR |= EXTI_IMR_IM29;
+
+    HAL_NVIC_SetPriority(LPTIM1_IRQn, IRQ_PRIORITY_RTC, 0);
+    HAL_NVIC_EnableIRQ(LPTIM1_IRQn);
+}
+
+static void lptim_stop(void)
+{
+    LPTIM1->CR = 0;
+    LPTIM1->ICR = LPTIM_ICR_ARRMCF | LPTIM_ICR_ARROKCF;
+}
+
+static void lptim_start(uint32_t timeout, uint32_t t)
+{
+    uint32_t cycles = LPTIM_START_LATENCY;
+
+    rtc_stop_alarm();
+
+    if (!system_stop_lock) {
+        timeout -= McuWakeUpTimeCal;
+        // wake_up.mean is in 1/16 ticks, i.e., two cycles
+        if (wake_up.samples >= WAKE_UP_MIN_SAMPLES) cycles += wake_up.mean * 2;
+    }
+    AlarmTarget = RtcTimerContext.Rtc_Time + timeout;
+
+    // An alarm that is already due fires after a single cycle
+    t *= LPTIM_CYCLES_PER_TICK;
+    cycles = t > cycles ? t - cycles : 1;
+
+    // ARR can only be written while the timer is enabled. The write takes a
+    // few cycles to complete, after which a single count can be started.
+    LPTIM1->CR = LPTIM_CR_ENABLE;
+    LPTIM1->ARR = cycles;
+    while (!(LPTIM1->ISR & LPTIM_ISR_ARROK));
+    LPTIM1->ICR = LPTIM_ICR_ARROKCF;
+    LPTIM1->CR = LPTIM_CR_ENABLE | LPTIM_CR_SNGSTRT;
+}
+
+RAMFUNC void LPTIM1_IRQHandler(void)
+{
+    uint32_t start = trace_irq_enter();
+#if TRACE_IRQ == 1
+    trace(TRACE_RTC_ALARM);
+#endif
+    system_unlock(&system_stop_lock, SYSTEM_MODULE_RTC);
+
+    if (LPTIM1->ISR & LPTIM_ISR_ARRM) {
+        lptim_stop();
+        TimerIrqHandler();
+    }
+    trace_irq_exit(TRACE_IRQ_RTC, start);
+}
+
+#endif
+
 void rtc_set_alarm(uint32_t timeout)
 {
     uint32_t t = timeout - rtc_get_timer_elapsed_time();
     uint32_t mask = disable_irq();
-
-    /* we don't go in Low Power mode for timeout below MIN_ALARM_DELAY */
-    if ((MIN_ALARM_DELAY + (uint32_t) McuWakeUpTimeCal) < t) {
-        system_stop_lock &= ~ SYSTEM_MODULE_RTC;
+    uint32_t min = MIN_ALARM_DELAY;
+#if LPTIM_ALARM == 1
+    bool lptim = t <= LPTIM_MAX_TIMEOUT;
+    if (lptim) min = LPTIM_MIN_ALARM_DELAY;
+#endif
+
+    /* we don't go in Low Power mode for timeout below the minimum delay */
+    if ((min + (uint32_t) McuWakeUpTimeCal) < t) {
+        system_unlock(&system_stop_lock, SYSTEM_MODULE_RTC);
     } else {
-        system_stop_lock |= SYSTEM_MODULE_RTC;
+        system_lock(&system_stop_lock, SYSTEM_MODULE_RTC);
     }
 
+#if LPTIM_ALARM == 1
+    if (lptim) {
+        lptim_start(timeout, t);
+        reenable_irq(mask);
+        return;
+    }
+#endif
+
     if (!system_stop_lock) {
         timeout = timeout - McuWakeUpTimeCal;
     }
@@ -195,22 +469,44 @@ void rtc_set_alarm(uint32_t timeout)
 
 uint32_t rtc_get_timer_elapsed_time(void)
 {
-    RTC_TimeTypeDef RTC_TimeStruct;
-    RTC_DateTypeDef RTC_DateStruct;
+    return rtc_get_timer_value() - RtcTimerContext.Rtc_Time;
+}
+
+/* The timer value is the low 32 bits of the 64-bit tick count */
+uint32_t rtc_get_timer_value(void)
+{
+    return (uint32_t)rtc_get_ticks64();
+}
+
+/* The calendar is only reset by rtc_init on a cold boot. Neither SysTimeSet nor
+ * the clock sync package writes it; they keep an offset in the backup
+ * registers instead. The tick count is therefore monotonic. */
+uint64_t rtc_get_ticks64(void)
+{
+    uint32_t ssr, tr, dr;
 
-    uint32_t CalendarValue = (uint32_t)HW_RTC_GetCalendarValue(&RTC_DateStruct, &RTC_TimeStruct);
+    read_calendar(&ssr, &tr, &dr);
+    return ((uint64_t)(day_start(dr) + time_of_day(tr)) << N_PREDIV_S) + (PREDIV_S - ssr);
+}
 
-    return ((uint32_t)(CalendarValue - RtcTimerContext.Rtc_Time));
+uint64_t rtc_previous_ticks(void)
+{
+    return previous_ticks;
 }
 
-uint32_t rtc_get_timer_value(void)
+uint64_t rtc_ticks64_to_ms(uint64_t ticks)
 {
-    RTC_TimeTypeDef RTC_TimeStruct;
-    RTC_DateTypeDef RTC_DateStruct;
+    return (ticks >> N_PREDIV_S) * 1000 + rtc_tick2ms((uint32_t)ticks & PREDIV_S);
+}
 
-    uint32_t CalendarValue = (uint32_t)HW_RTC_GetCalendarValue(&RTC_DateStruct, &RTC_TimeStruct);
+void rtc_update_now(void)
+{
+    now_ms = rtc_tick2ms(rtc_get_timer_value());
+}
 
-    return (CalendarValue);
+TimerTime_t rtc_now(void)
+{
+    return now_ms;
 }
 
 void rtc_stop_alarm(void)
@@ -221,6 +517,9 @@ void rtc_stop_alarm(void)
     __HAL_RTC_ALARM_CLEAR_FLAG(&RtcHandle, RTC_FLAG_ALRAF);
     /* Clear the EXTI's line Flag for RTC Alarm */
     __HAL_RTC_ALARM_EXTI_CLEAR_FLAG();
+#if LPTIM_ALARM == 1
+    lptim_stop();
+#endif
 }
 
 void rtc_delay_ms(uint32_t delay)
@@ -240,7 +539,7 @@ void rtc_delay_ms(uint32_t delay)
 
 uint32_t rtc_set_timer_context(void)
 {
-    RtcTimerContext.Rtc_Time = (uint32_t)HW_RTC_GetCalendarValue(&RtcTimerContext.RTC_Calndr_Date, &RtcTimerContext.RTC_Calndr_Time);
+    RtcTimerContext.Rtc_Time = HW_RTC_GetCalendarValue(&RtcTimerContext.RTC_Calndr_Date, &RtcTimerContext.RTC_Calndr_Time);
     return (uint32_t)RtcTimerContext.Rtc_Time;
 }
 
@@ -261,68 +560,36 @@ static void HW_RTC_StartWakeUpAlarm(uint32_t timeoutValue)
     uint16_t rtcAlarmMinutes = 0;
     uint16_t rtcAlarmHours = 0;
     uint16_t rtcAlarmDays = 0;
+    uint32_t seconds;
     RTC_TimeTypeDef RTC_TimeStruct = RtcTimerContext.RTC_Calndr_Time;
     RTC_DateTypeDef RTC_DateStruct = RtcTimerContext.RTC_Calndr_Date;
 
     rtc_stop_alarm();
+    AlarmTarget = RtcTimerContext.Rtc_Time + timeoutValue;
 
     /*reverse counter */
     rtcAlarmSubSeconds = PREDIV_S - RTC_TimeStruct.SubSeconds;
     rtcAlarmSubSeconds += (timeoutValue & PREDIV_S);
-    /* convert timeout  to seconds */
-    timeoutValue >>= N_PREDIV_S; /* convert timeout  in seconds */
 
-    /*convert microsecs to RTC format and add to 'Now' */
-    rtcAlarmDays = RTC_DateStruct.Date;
-    while (timeoutValue >= SECONDS_IN_1DAY)
-    {
-        timeoutValue -= SECONDS_IN_1DAY;
-        rtcAlarmDays++;
-    }
-
-    /* calc hours */
-    rtcAlarmHours = RTC_TimeStruct.Hours;
-    while (timeoutValue >= SECONDS_IN_1HOUR)
-    {
-        timeoutValue -= SECONDS_IN_1HOUR;
-        rtcAlarmHours++;
-    }
+    /* Fold the current time of day, the whole seconds of the timeout and the
+     * subsecond carry into a single number of seconds, then split it back
+     * into days, hours, minutes and seconds with one division per unit. The
+     * subsecond sum is at most 2 * PREDIV_S, so the carry is 0 or 1. */
+    seconds = (timeoutValue >> N_PREDIV_S) +
+              (rtcAlarmSubSeconds >> N_PREDIV_S) +
+              (uint32_t)RTC_TimeStruct.Seconds +
+              (uint32_t)RTC_TimeStruct.Minutes * SECONDS_IN_1MINUTE +
+              (uint32_t)RTC_TimeStruct.Hours * SECONDS_IN_1HOUR;
+    rtcAlarmSubSeconds &= PREDIV_S;
 
-    /* calc minutes */
-    rtcAlarmMinutes = RTC_TimeStruct.Minutes;
-    while (timeoutValue >= SECONDS_IN_1MINUTE)
-    {
-        timeoutValue -= SECONDS_IN_1MINUTE;
-        rtcAlarmMinutes++;
-    }
+    rtcAlarmDays = RTC_DateStruct.Date + seconds / SECONDS_IN_1DAY;
+    seconds %= SECONDS_IN_1DAY;
 
-    /* calc seconds */
-    rtcAlarmSeconds = RTC_TimeStruct.Seconds + timeoutValue;
+    rtcAlarmHours = seconds / SECONDS_IN_1HOUR;
+    seconds %= SECONDS_IN_1HOUR;
 
-    /***** correct for modulo********/
-    while (rtcAlarmSubSeconds >= (PREDIV_S + 1))
-    {
-        rtcAlarmSubSeconds -= (PREDIV_S + 1);
-        rtcAlarmSeconds++;
-    }
-
-    while (rtcAlarmSeconds >= SECONDS_IN_1MINUTE)
-    {
-        rtcAlarmSeconds -= SECONDS_IN_1MINUTE;
-        rtcAlarmMinutes++;
-    }
-
-    while (rtcAlarmMinutes >= MINUTES_IN_1HOUR)
-    {
-        rtcAlarmMinutes -= MINUTES_IN_1HOUR;
-        rtcAlarmHours++;
-    }
-
-    while (rtcAlarmHours >= HOURS_IN_1DAY)
-    {
-        rtcAlarmHours -= HOURS_IN_1DAY;
-        rtcAlarmDays++;
-    }
+    rtcAlarmMinutes = seconds / SECONDS_IN_1MINUTE;
+    rtcAlarmSeconds = seconds % SECONDS_IN_1MINUTE;
 
     if (RTC_DateStruct.Year % 4 == 0)
     {
@@ -357,44 +624,99 @@ static void HW_RTC_StartWakeUpAlarm(uint32_t timeoutValue)
     HAL_RTC_SetAlarm_IT(&RtcHandle, &RTC_AlarmStructure, RTC_FORMAT_BIN);
 }
 
-static uint64_t HW_RTC_GetCalendarValue(RTC_DateTypeDef *RTC_DateStruct, RTC_TimeTypeDef *RTC_TimeStruct)
+/* Read the subsecond, time, and date registers directly. The shadow registers
+ * are bypassed, so the three values are not latched together; repeat the reads
+ * until the subsecond counter has not changed in between. This replaces
+ * HAL_RTC_GetTime and HAL_RTC_GetDate, which convert every field whether it is
+ * needed or not. */
+static void read_calendar(uint32_t *ssr, uint32_t *tr, uint32_t *dr)
 {
-    uint64_t calendarValue = 0;
-    uint32_t first_read;
+    do
+    {
+        *ssr = RTC->SSR & RTC_SSR_SS;
+        *tr = RTC->TR & RTC_TR_RESERVED_MASK;
+        *dr = RTC->DR & RTC_DR_RESERVED_MASK;
+    } while (*ssr != (RTC->SSR & RTC_SSR_SS));
+}
+
+/* The number of seconds from the RTC epoch to the midnight that started the
+ * day in the date register value dr. The date changes once a day, so the
+ * result is cached. The cache is shared with interrupt handlers. */
+static uint32_t day_start(uint32_t dr)
+{
+    static uint32_t cached_dr = UINT32_MAX;
+    static uint32_t cached_seconds;
+    uint32_t year, month, date;
     uint32_t correction;
     uint32_t seconds;
+    uint32_t mask;
 
-    /* Get Time and Date*/
-    HAL_RTC_GetTime(&RtcHandle, RTC_TimeStruct, RTC_FORMAT_BIN);
-
-    /* make sure it is correct due to asynchronus nature of RTC*/
-    do
+    mask = disable_irq();
+    if (dr == cached_dr)
     {
-        first_read = LL_RTC_TIME_GetSubSecond(RTC);
-        HAL_RTC_GetDate(&RtcHandle, RTC_DateStruct, RTC_FORMAT_BIN);
-        HAL_RTC_GetTime(&RtcHandle, RTC_TimeStruct, RTC_FORMAT_BIN);
+        seconds = cached_seconds;
+        reenable_irq(mask);
+        return seconds;
+    }
+    reenable_irq(mask);
 
-    } while (first_read != LL_RTC_TIME_GetSubSecond(RTC));
+    year = __LL_RTC_CONVERT_BCD2BIN((dr & (RTC_DR_YT | RTC_DR_YU)) >> RTC_DR_YU_Pos);
+    month = __LL_RTC_CONVERT_BCD2BIN((dr & (RTC_DR_MT | RTC_DR_MU)) >> RTC_DR_MU_Pos);
+    date = __LL_RTC_CONVERT_BCD2BIN((dr & (RTC_DR_DT | RTC_DR_DU)) >> RTC_DR_DU_Pos);
 
     /* calculte amount of elapsed days since 01/01/2000 */
-    seconds = DIVC((DAYS_IN_YEAR * 3 + DAYS_IN_LEAP_YEAR) * RTC_DateStruct->Year, 4);
+    seconds = DIVC((DAYS_IN_YEAR * 3 + DAYS_IN_LEAP_YEAR) * year, 4);
 
-    correction = ((RTC_DateStruct->Year % 4) == 0) ? DAYS_IN_MONTH_CORRECTION_LEAP : DAYS_IN_MONTH_CORRECTION_NORM;
+    correction = ((year % 4) == 0) ? DAYS_IN_MONTH_CORRECTION_LEAP : DAYS_IN_MONTH_CORRECTION_NORM;
 
-    seconds += (DIVC((RTC_DateStruct->Month - 1) * (30 + 31), 2) - (((correction >> ((RTC_DateStruct->Month - 1) * 2)) & 0x3)));
+    seconds += (DIVC((month - 1) * (30 + 31), 2) - (((correction >> ((month - 1) * 2)) & 0x3)));
 
-    seconds += (RTC_DateStruct->Date - 1);
+    seconds += (date - 1);
 
     /* convert from days to seconds */
     seconds *= SECONDS_IN_1DAY;
 
-    seconds += ((uint32_t)RTC_TimeStruct->Seconds +
-                ((uint32_t)RTC_TimeStruct->Minutes * SECONDS_IN_1MINUTE) +
-                ((uint32_t)RTC_TimeStruct->Hours * SECONDS_IN_1HOUR));
+    mask = disable_irq();
+    cached_dr = dr;
+    cached_seconds = seconds;
+    reenable_irq(mask);
+    return seconds;
+}
 
-    calendarValue = (((uint64_t)seconds) << N_PREDIV_S) + (PREDIV_S - RTC_TimeStruct->SubSeconds);
+/* The number of seconds since midnight in the time register value tr */
+static inline uint32_t time_of_day(uint32_t tr)
+{
+    return __LL_RTC_CONVERT_BCD2BIN((tr & (RTC_TR_ST | RTC_TR_SU)) >> RTC_TR_SU_Pos) +
+           __LL_RTC_CONVERT_BCD2BIN((tr & (RTC_TR_MNT | RTC_TR_MNU)) >> RTC_TR_MNU_Pos) * SECONDS_IN_1MINUTE +
+           __LL_RTC_CONVERT_BCD2BIN((tr & (RTC_TR_HT | RTC_TR_HU)) >> RTC_TR_HU_Pos) * SECONDS_IN_1HOUR;
+}
+
+static uint32_t HW_RTC_GetCalendarSeconds(RTC_DateTypeDef *RTC_DateStruct, RTC_TimeTypeDef *RTC_TimeStruct)
+{
+    uint32_t ssr, tr, dr;
+
+    read_calendar(&ssr, &tr, &dr);
+
+    RTC_TimeStruct->SubSeconds = ssr;
+    RTC_TimeStruct->Seconds = __LL_RTC_CONVERT_BCD2BIN((tr & (RTC_TR_ST | RTC_TR_SU)) >> RTC_TR_SU_Pos);
+    RTC_TimeStruct->Minutes = __LL_RTC_CONVERT_BCD2BIN((tr & (RTC_TR_MNT | RTC_TR_MNU)) >> RTC_TR_MNU_Pos);
+    RTC_TimeStruct->Hours = __LL_RTC_CONVERT_BCD2BIN((tr & (RTC_TR_HT | RTC_TR_HU)) >> RTC_TR_HU_Pos);
+    RTC_TimeStruct->TimeFormat = (tr & RTC_TR_PM) >> RTC_TR_PM_Pos;
 
-    return (calendarValue);
+    RTC_DateStruct->Year = __LL_RTC_CONVERT_BCD2BIN((dr & (RTC_DR_YT | RTC_DR_YU)) >> RTC_DR_YU_Pos);
+    RTC_DateStruct->Month = __LL_RTC_CONVERT_BCD2BIN((dr & (RTC_DR_MT | RTC_DR_MU)) >> RTC_DR_MU_Pos);
+    RTC_DateStruct->Date = __LL_RTC_CONVERT_BCD2BIN((dr & (RTC_DR_DT | RTC_DR_DU)) >> RTC_DR_DU_Pos);
+    RTC_DateStruct->WeekDay = (dr & RTC_DR_WDU) >> RTC_DR_WDU_Pos;
+
+    return day_start(dr) + time_of_day(tr);
+}
+
+/* The timer value is the number of ticks since the RTC epoch truncated to 32
+ * bits, so the shift may discard the upper bits of the seconds. */
+static uint32_t HW_RTC_GetCalendarValue(RTC_DateTypeDef *RTC_DateStruct, RTC_TimeTypeDef *RTC_TimeStruct)
+{
+    uint32_t seconds = HW_RTC_GetCalendarSeconds(RTC_DateStruct, RTC_TimeStruct);
+    return (seconds << N_PREDIV_S) + (PREDIV_S - RTC_TimeStruct->SubSeconds);
 }
 
 uint32_t rtc_get_calendar_time(uint16_t *mSeconds)
@@ -403,11 +725,9 @@ uint32_t rtc_get_calendar_time(uint16_t *mSeconds)
     RTC_DateTypeDef RTC_DateStruct;
     uint32_t ticks;
 
-    uint64_t calendarValue = HW_RTC_GetCalendarValue(&RTC_DateStruct, &RTC_TimeStruct);
-
-    uint32_t seconds = (uint32_t)(calendarValue >> N_PREDIV_S);
+    uint32_t seconds = HW_RTC_GetCalendarSeconds(&RTC_DateStruct, &RTC_TimeStruct);
 
-    ticks = (uint32_t)calendarValue & PREDIV_S;
+    ticks = (PREDIV_S - RTC_TimeStruct.SubSeconds) & PREDIV_S;
 
     *mSeconds = rtc_tick2ms(ticks);
 
@@ -426,6 +746,23 @@ void rtc_read_backup_registers(uint32_t *Data0, uint32_t *Data1)
     *Data1 = HAL_RTCEx_BKUPRead(&RtcHandle, RTC_BKP_DR1);
 }
 
+void rtc_write_standby_token(uint32_t token, uint32_t entered)
+{
+    HAL_RTCEx_BKUPWrite(&RtcHandle, RTC_BKP_DR2, token);
+    HAL_RTCEx_BKUPWrite(&RtcHandle, RTC_BKP_DR3, entered);
+}
+
+void rtc_read_standby_token(uint32_t *token, uint32_t *entered)
+{
+    *token = HAL_RTCEx_BKUPRead(&RtcHandle, RTC_BKP_DR2);
+    *entered = HAL_RTCEx_BKUPRead(&RtcHandle, RTC_BKP_DR3);
+}
+
+void rtc_write_boot_token(uint32_t token)
+{
+    HAL_RTCEx_BKUPWrite(&RtcHandle, RTC_BKP_DR4, token);
+}
+
 TimerTime_t rtc_temperature_compensation(TimerTime_t period, float temperature)
 {
     float k = RTC_TEMP_COEFFICIENT;
@@ -435,6 +772,9 @@ TimerTime_t rtc_temperature_compensation(TimerTime_t period, float temperature)
     float interim = 0.0;
     float ppm = 0.0;
 
+    // The RTC frequency is already corrected in hardware
+    if (temperature_compensated) return period;
+
     if (k < 0.0f)
     {
         ppm = (k - kDev);
@@ -462,10 +802,14 @@ TimerTime_t rtc_temperature_compensation(TimerTime_t period, float temperature)
 }
 
 
-void RTC_IRQHandler(void)
+RAMFUNC void RTC_IRQHandler(void)
 {
     RTC_HandleTypeDef *hrtc = &RtcHandle;
-    system_stop_lock &= ~SYSTEM_MODULE_RTC;
+    uint32_t start = trace_irq_enter();
+#if TRACE_IRQ == 1
+    trace(TRACE_RTC_ALARM);
+#endif
+    system_unlock(&system_stop_lock, SYSTEM_MODULE_RTC);
 
     /* Clear the EXTI's line Flag for RTC Alarm */
     __HAL_RTC_ALARM_EXTI_CLEAR_FLAG();
@@ -482,4 +826,5 @@ void RTC_IRQHandler(void)
             HAL_RTC_AlarmAEventCallback(hrtc);
         }
     }
+    trace_irq_exit(TRACE_IRQ_RTC, start);
 }
@@ -25,6 +25,12 @@
 
 void rtc_init(void);
 
+//! @brief Initializes the RTC timer after a Standby exit
+//! @note Unlike rtc_init, the calendar is not reset, so the timer value keeps
+//! counting from where it was when the MCU entered Standby
+
+void rtc_init_resume(void);
+
 //! @param Stop the Alarm
 
 void rtc_stop_alarm(void);
@@ -49,6 +55,39 @@ uint32_t rtc_get_timer_elapsed_time(void);
 
 uint32_t rtc_get_timer_value(void);
 
+//! @brief Get the RTC tick count since the cold boot as a 64-bit value
+//! @note The ticks run at 1024 Hz and keep counting in Stop and Standby. Unlike
+//! rtc_get_timer_value, the value does not wrap after 48 days, and setting the
+//! GPS time does not change it.
+
+uint64_t rtc_get_ticks64(void);
+
+//! @brief Return the tick count the previous boot had reached when the MCU
+//! was reset, or 0 after a power-on reset or a wakeup from Standby
+//! @note The RTC keeps running through warm resets (watchdog, software, NRST).
+//! The calendar is then reset by rtc_init, so the timer of the previous boot
+//! and the current one start from zero at different points in time.
+
+uint64_t rtc_previous_ticks(void);
+
+//! @brief Convert a 64-bit tick count from rtc_get_ticks64 to milliseconds
+
+uint64_t rtc_ticks64_to_ms(uint64_t ticks);
+
+//! @brief Take the time snapshot returned by rtc_now
+//! @note Invoked by the main loop at the start of each iteration
+
+void rtc_update_now(void);
+
+//! @brief Return the RTC timer value in ms as of the start of the current main
+//! loop iteration
+//! @note For task handlers that compare against deadlines or timestamp
+//! statistics and can tolerate the time elapsed since the iteration started.
+//! The value lags behind, so a deadline is never seen to expire early. Use
+//! rtc_get_timer_value in interrupt handlers and polling loops.
+
+TimerTime_t rtc_now(void);
+
 //! @brief Set the RTC timer Reference
 //! @retval  Timer Reference Value in  Ticks
 
@@ -64,16 +103,57 @@ uint32_t rtc_get_timer_context(void);
 
 void rtc_delay_ms(uint32_t delay);
 
-//! @brief calculates the wake up time between wake up and mcu start
-//! @note resolution in RTC_ALARM_TIME_BASE
+//! @brief Measure the time between the alarm and the MCU running again
+//! @note Invoke right after each Stop-mode exit with interrupts disabled. The
+//! measurements are averaged and the average is subtracted from the alarm
+//! timeouts that are expected to wake the MCU up from the Stop mode.
 
 void rtc_set_mcu_wake_up_time(void);
 
-//! @brief returns the wake up time in us
+//! @brief returns the wake up time
 //! @retval wake up time in ticks
 
 int16_t rtc_get_mcu_wake_up_time(void);
 
+//! @brief Return the expected error of the compensated wake up time
+//! @retval Error in milliseconds or -1 if there are not enough measurements yet
+
+int32_t rtc_get_mcu_wake_up_error(void);
+
+//! @brief Range of the RTC smooth calibration in units of 2^-20 (0.954 ppm)
+#define RTC_CALIBRATION_MIN (-511)
+#define RTC_CALIBRATION_MAX 512
+
+//! @brief Adjust the frequency of the RTC with the smooth calibration circuit
+//! @param[in] pulses Number of RTCCLK pulses added (positive) or masked
+//! (negative) every 2^20 pulses (32 seconds), clamped to the supported range
+
+void rtc_set_calibration(int32_t pulses);
+
+//! @brief Return the RTC smooth calibration in units of 2^-20, without the
+//! temperature compensation
+
+int32_t rtc_get_calibration(void);
+
+//! @brief Compensate the temperature drift of the 32.768 kHz crystal
+//!
+//! Computes the frequency error of the crystal at the given temperature from
+//! its parabolic temperature curve (RTC_TEMP_COEFFICIENT, RTC_TEMP_TURNOVER)
+//! and adds the inverse to the RTC smooth calibration. While the compensation
+//! is active, rtc_temperature_compensation leaves time periods unchanged.
+//! @param[in] temperature Current temperature in degrees Celsius
+//! @retval Applied compensation in units of 2^-20
+
+int32_t rtc_compensate_temperature(float temperature);
+
+//! @brief Remove the temperature compensation from the RTC smooth calibration
+
+void rtc_clear_temperature_compensation(void);
+
+//! @brief Return the applied temperature compensation in units of 2^-20
+
+int32_t rtc_get_temperature_compensation(void);
+
 //! @brief converts time in ms to time in ticks
 //! @param [IN] time in milliseconds
 //! @retval returns time in timer ticks
@@ -111,4 +191,24 @@ void rtc_read_backup_registers(uint32_t *Data0, uint32_t *Data1);
 
 void rtc_write_backup_registers(uint32_t Data0, uint32_t Data1);
 
+//! @brief Read the Standby token and entry time from backup registers
+//! @param [OUT] token The token written with rtc_write_standby_token
+//! @param [OUT] entered The timer value at Standby entry
+
+void rtc_read_standby_token(uint32_t *token, uint32_t *entered);
+
+//! @brief Write the Standby token and entry time in backup registers. The
+//! registers are not used by systime, see rtc_write_backup_registers.
+//! @param [IN] token
+//! @param [IN] entered The timer value at Standby entry
+
+void rtc_write_standby_token(uint32_t token, uint32_t entered);
+
+//! @brief Write a token for the next boot in a backup register, see
+//! system_request_bootloader. The register is not used by systime or by the
+//! Standby token.
+//! @param [IN] token
+
+void rtc_write_boot_token(uint32_t token);
+
 #endif // _HW_RTC_H
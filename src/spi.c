@@ -1,41 +1,47 @@
 #include "spi.h"
+#include <string.h>
+#include <stm/STM32L0xx_HAL_Driver/Inc/stm32l0xx_ll_dma.h>
 #include "halt.h"
+#include "irq.h"
+#include "system.h"
 
 
 static uint32_t calc_divisor_for_frequency(uint32_t hz)
 {
-    uint32_t divisor = 0;
-    uint32_t SysClkTmp = SystemCoreClock;
-    uint32_t baudRate;
-
-    while (SysClkTmp > hz) {
-        divisor++;
-        SysClkTmp = (SysClkTmp >> 1);
-        if (divisor >= 7) break;
+    // The SPI clock is PCLK / 2^(BR + 1). Select the fastest clock that does
+    // not exceed the requested frequency.
+    uint32_t br = 0;
+    uint32_t clk = SystemCoreClock >> 1;
+
+    while (clk > hz && br < 7) {
+        br++;
+        clk >>= 1;
     }
 
-    baudRate = (((divisor & 0x4) == 0) ? 0x0 : SPI_CR1_BR_2) |
-               (((divisor & 0x2) == 0) ? 0x0 : SPI_CR1_BR_1) |
-               (((divisor & 0x1) == 0) ? 0x0 : SPI_CR1_BR_0);
+    return br << SPI_CR1_BR_Pos;
+}
+
 
-    return baudRate;
+// Recalculate the prescaler if the system clock has changed since the last
+// transfer, e.g., when the MCU runs from HSI16 after a Stop exit. This keeps
+// the SPI clock as close to the requested frequency as possible regardless of
+// the system clock source.
+static void update_speed(Spi_t *spi)
+{
+    uint32_t br = calc_divisor_for_frequency(spi->hz);
+
+    CLEAR_BIT(spi->port->CR1, SPI_CR1_SPE);
+    MODIFY_REG(spi->port->CR1, SPI_CR1_BR, br);
+    spi->clock = SystemCoreClock;
 }
 
 
 void spi_init(Spi_t *spi, uint32_t speed)
 {
-    spi->hspi.Instance = SPI1;
+    spi->port = SPI1;
 
-    spi->hspi.Init.BaudRatePrescaler = calc_divisor_for_frequency(speed);
-    spi->hspi.Init.Direction = SPI_DIRECTION_2LINES;
-    spi->hspi.Init.Mode = SPI_MODE_MASTER;
-    spi->hspi.Init.CLKPolarity = SPI_POLARITY_LOW;
-    spi->hspi.Init.CLKPhase = SPI_PHASE_1EDGE;
-    spi->hspi.Init.DataSize = SPI_DATASIZE_8BIT;
-    spi->hspi.Init.CRCCalculation = SPI_CRCCALCULATION_DISABLE;
-    spi->hspi.Init.FirstBit = SPI_FIRSTBIT_MSB;
-    spi->hspi.Init.NSS = SPI_NSS_SOFT;
-    spi->hspi.Init.TIMode = SPI_TIMODE_DISABLE;
+    spi->hz = speed;
+    spi->clock = SystemCoreClock;
 
     spi->Nss.port = GPIOA;
     spi->Nss.pinIndex = GPIO_PIN_15;
@@ -51,8 +57,13 @@ void spi_init(Spi_t *spi, uint32_t speed)
 
     __HAL_RCC_SPI1_CLK_ENABLE();
 
-    if (HAL_SPI_Init(&spi->hspi) != HAL_OK)
-        halt("Error while initializing SPI subsystem");
+    // Full-duplex master with software NSS, 8-bit MSB-first frames, clock
+    // idle low and data sampled on the first edge, no CRC. The peripheral is
+    // enabled on the first transfer.
+    WRITE_REG(spi->port->CR1, SPI_CR1_MSTR | SPI_CR1_SSI | SPI_CR1_SSM |
+        calc_divisor_for_frequency(speed));
+    WRITE_REG(spi->port->CR2, 0);
+    CLEAR_BIT(spi->port->I2SCFGR, SPI_I2SCFGR_I2SMOD);
 
     spi_io_init(spi);
 
@@ -61,7 +72,7 @@ void spi_init(Spi_t *spi, uint32_t speed)
 
 void spi_deinit(Spi_t *spi)
 {
-    HAL_SPI_DeInit(&spi->hspi);
+    CLEAR_BIT(spi->port->CR1, SPI_CR1_SPE);
 
     // Reset peripherals
     __HAL_RCC_SPI1_FORCE_RESET();
@@ -71,7 +82,7 @@ void spi_deinit(Spi_t *spi)
 }
 
 
-void spi_io_init(Spi_t *spi)
+static void init_bus_io(Spi_t *spi)
 {
     GPIO_InitTypeDef cfg = {
         .Mode = GPIO_MODE_AF_PP,
@@ -85,6 +96,18 @@ void spi_io_init(Spi_t *spi)
 
     cfg.Pull = GPIO_PULLDOWN;
     gpio_init(spi->miso.port, spi->miso.pinIndex, &cfg);
+}
+
+
+void spi_io_init(Spi_t *spi)
+{
+    GPIO_InitTypeDef cfg = {
+        .Pull = GPIO_NOPULL,
+        .Speed = GPIO_SPEED_HIGH
+    };
+
+    init_bus_io(spi);
+    spi->generation = system_stop_generation;
 
     cfg.Mode = GPIO_MODE_OUTPUT_PP;
     cfg.Pull = GPIO_NOPULL;
@@ -116,9 +139,292 @@ void spi_io_deinit(Spi_t *spi)
 }
 
 
+bool spi_io_active(Spi_t *spi)
+{
+    return spi->generation == system_stop_generation;
+}
+
+
+static void resume(Spi_t *spi)
+{
+    uint32_t mask = disable_irq();
+
+    if (!spi_io_active(spi)) {
+        // spi_io_deinit leaves NSS configured as an output. The caller has
+        // already pulled it low to start the transfer, so only the bus pins
+        // need to be reconfigured here.
+        init_bus_io(spi);
+        spi->generation = system_stop_generation;
+        spi_on_resume(spi);
+    }
+
+    reenable_irq(mask);
+}
+
+
+static uint16_t transfer(Spi_t *obj, uint16_t outData)
+{
+    SPI_TypeDef *spi = obj->port;
+
+    if (!spi_io_active(obj)) resume(obj);
+    if (obj->clock != SystemCoreClock) update_speed(obj);
+
+    // The radio driver transfers one byte at a time, mostly to access
+    // registers. Talk to the peripheral directly; the per-call overhead of
+    // HAL_SPI_TransmitReceive exceeds the time it takes to clock out a byte.
+    if (!(spi->CR1 & SPI_CR1_SPE)) SET_BIT(spi->CR1, SPI_CR1_SPE);
+
+    while (!(spi->SR & SPI_SR_TXE)) continue;
+    *(volatile uint8_t *)&spi->DR = outData;
+    while (!(spi->SR & SPI_SR_RXNE)) continue;
+    return *(volatile uint8_t *)&spi->DR;
+}
+
+
+// The device with a register shadow. LoRaMac-node selects the device with
+// GpioWrite on its NSS pin, so the pin has to be mapped back to the device.
+static Spi_t *shadowed;
+
+enum shadow_state {
+    SHADOW_IDLE = 0,  // NSS high
+    SHADOW_ADDR,      // NSS low, waiting for the address byte
+    SHADOW_DATA       // Address received, data bytes follow
+};
+
+#define SHADOW_BIT(map, reg) ((map)[(reg) >> 3] & (1 << ((reg) & 7)))
+
+
+void spi_shadow_init(Spi_t *spi, spi_shadow_t *shadow)
+{
+    spi->shadow = shadow;
+    shadowed = spi;
+    spi_shadow_invalidate(spi);
+}
+
+
+void spi_shadow_invalidate(Spi_t *spi)
+{
+    if (spi->shadow == NULL) return;
+    memset(spi->shadow->valid, 0, sizeof(spi->shadow->valid));
+}
+
+
+// Drive NSS low and send the address of the current register, unless already
+// done in this transaction
+static void shadow_open(Spi_t *spi)
+{
+    spi_shadow_t *sh = spi->shadow;
+
+    if (sh->open) return;
+    gpio_write(spi->Nss.port, spi->Nss.pinIndex, 0);
+    transfer(spi, sh->write ? sh->reg | 0x80 : sh->reg);
+    sh->open = true;
+}
+
+
+static bool shadow_cacheable(spi_shadow_t *sh, uint8_t reg)
+{
+    return SHADOW_BIT(sh->cacheable[sh->mode], reg);
+}
+
+
+static void shadow_store(spi_shadow_t *sh, uint8_t reg, uint8_t value)
+{
+    if (reg == sh->mode_reg) {
+        uint8_t mode = (value & sh->mode_mask) ? 1 : 0;
+
+        // The other register map has different registers at the same
+        // addresses
+        if (mode != sh->mode) memset(sh->valid, 0, sizeof(sh->valid));
+        sh->mode = mode;
+    }
+
+    if (!shadow_cacheable(sh, reg)) return;
+    sh->value[reg] = value;
+    sh->valid[reg >> 3] |= 1 << (reg & 7);
+}
+
+
+static uint16_t shadow_inout(Spi_t *spi, uint16_t data)
+{
+    spi_shadow_t *sh = spi->shadow;
+    uint8_t reg, v;
+    bool hit;
+
+    // A transfer outside of NSS low, do not interpret it
+    if (sh->state == SHADOW_IDLE) return transfer(spi, data);
+
+    if (sh->state == SHADOW_ADDR) {
+        sh->write = (data & 0x80) != 0;
+        sh->reg = data & 0x7f;
+        sh->state = SHADOW_DATA;
+
+        // Writes wait for the data byte to decide whether the bus is needed.
+        // Reads of registers that are not shadowed start on the bus right away
+        // so that the device samples volatile registers as usual.
+        if (!sh->write && (!shadow_cacheable(sh, sh->reg) || !SHADOW_BIT(sh->valid, sh->reg)))
+            shadow_open(spi);
+        return 0;
+    }
+
+    reg = sh->reg;
+    hit = shadow_cacheable(sh, reg) && SHADOW_BIT(sh->valid, reg);
+
+    // The address auto-increments in burst mode, except for the FIFO
+    if (reg != 0) sh->reg = (reg + 1) & 0x7f;
+
+    if (sh->write) {
+        if (hit && sh->value[reg] == data) {
+            // Skipping a register in the middle of a burst ends the burst on
+            // the bus. The next register that needs writing starts a new one.
+            if (sh->open) {
+                gpio_write(spi->Nss.port, spi->Nss.pinIndex, 1);
+                sh->open = false;
+            }
+            return 0;
+        }
+
+        if (!sh->open) {
+            sh->reg = reg;
+            shadow_open(spi);
+            if (reg != 0) sh->reg = (reg + 1) & 0x7f;
+        }
+        v = transfer(spi, data);
+        shadow_store(sh, reg, data);
+        return v;
+    }
+
+    if (hit && !sh->open) return sh->value[reg];
+
+    if (!sh->open) {
+        sh->reg = reg;
+        shadow_open(spi);
+        if (reg != 0) sh->reg = (reg + 1) & 0x7f;
+    }
+    v = transfer(spi, data);
+    shadow_store(sh, reg, v);
+    return v;
+}
+
+
+bool spi_shadow_nss(Gpio_t *nss, uint32_t value)
+{
+    spi_shadow_t *sh;
+
+    if (shadowed == NULL || nss != &shadowed->Nss) return false;
+    sh = shadowed->shadow;
+
+    if (value == 0) {
+        // Defer driving NSS low until there is something to transfer
+        sh->state = SHADOW_ADDR;
+        sh->open = false;
+        return true;
+    }
+
+    if (sh->open) gpio_write(nss->port, nss->pinIndex, 1);
+    sh->state = SHADOW_IDLE;
+    sh->open = false;
+    return true;
+}
+
+
 uint16_t SpiInOut(Spi_t *obj, uint16_t outData)
 {
-    uint8_t rx, tx = outData;
-    HAL_SPI_TransmitReceive(&obj->hspi, &tx, &rx, 1, HAL_MAX_DELAY);
-    return rx;
+    if (obj->shadow != NULL) return shadow_inout(obj, outData);
+    return transfer(obj, outData);
+}
+
+
+// Transfers shorter than this are not worth setting up the DMA for
+#ifndef SPI_DMA_MIN_LENGTH
+#define SPI_DMA_MIN_LENGTH 8
+#endif
+
+// SPI1 is served by DMA1 channel 2 (RX) and channel 3 (TX), request 1
+#define SPI_DMA_RX LL_DMA_CHANNEL_2
+#define SPI_DMA_TX LL_DMA_CHANNEL_3
+
+
+void spi_transfer(Spi_t *spi, const uint8_t *tx, uint8_t *rx, size_t length)
+{
+    static uint8_t dummy;
+    uint32_t mode;
+
+    // Short transfers, e.g., single register accesses, go through the
+    // register shadow
+    if (length < SPI_DMA_MIN_LENGTH) {
+        for (size_t i = 0; i < length; i++) {
+            uint8_t v = SpiInOut(spi, tx ? tx[i] : 0);
+            if (rx) rx[i] = v;
+        }
+        return;
+    }
+
+    if (!spi_io_active(spi)) resume(spi);
+    if (spi->clock != SystemCoreClock) update_speed(spi);
+
+    // Block transfers are not shadowed. Make sure the device is selected. A
+    // burst over registers other than the FIFO leaves the shadow stale.
+    if (spi->shadow != NULL && spi->shadow->state == SHADOW_DATA) {
+        shadow_open(spi);
+        if (spi->shadow->reg != 0) spi_shadow_invalidate(spi);
+    }
+
+    __HAL_RCC_DMA1_CLK_ENABLE();
+    SET_BIT(spi->port->CR1, SPI_CR1_SPE);
+
+    mode = LL_DMA_PRIORITY_HIGH | LL_DMA_MODE_NORMAL | LL_DMA_PERIPH_NOINCREMENT |
+        LL_DMA_PDATAALIGN_BYTE | LL_DMA_MDATAALIGN_BYTE;
+
+    // The RX channel always runs so that the data register is drained. If the
+    // caller does not want the data, it is written to a dummy byte. Likewise,
+    // zeroes are transmitted if there is no TX buffer.
+    dummy = 0;
+    LL_DMA_SetPeriphRequest(DMA1, SPI_DMA_RX, LL_DMA_REQUEST_1);
+    LL_DMA_ConfigTransfer(DMA1, SPI_DMA_RX, mode | LL_DMA_DIRECTION_PERIPH_TO_MEMORY |
+        (rx ? LL_DMA_MEMORY_INCREMENT : LL_DMA_MEMORY_NOINCREMENT));
+    LL_DMA_ConfigAddresses(DMA1, SPI_DMA_RX, (uint32_t)&spi->port->DR,
+        (uint32_t)(rx ? rx : &dummy), LL_DMA_DIRECTION_PERIPH_TO_MEMORY);
+    LL_DMA_SetDataLength(DMA1, SPI_DMA_RX, length);
+
+    LL_DMA_SetPeriphRequest(DMA1, SPI_DMA_TX, LL_DMA_REQUEST_1);
+    LL_DMA_ConfigTransfer(DMA1, SPI_DMA_TX, mode | LL_DMA_DIRECTION_MEMORY_TO_PERIPH |
+        (tx ? LL_DMA_MEMORY_INCREMENT : LL_DMA_MEMORY_NOINCREMENT));
+    LL_DMA_ConfigAddresses(DMA1, SPI_DMA_TX, (uint32_t)(tx ? tx : &dummy),
+        (uint32_t)&spi->port->DR, LL_DMA_DIRECTION_MEMORY_TO_PERIPH);
+    LL_DMA_SetDataLength(DMA1, SPI_DMA_TX, length);
+
+    // The transfer may be started from an ISR (e.g., when the radio driver
+    // reads the FIFO from a DIO interrupt), so we cannot rely on the DMA
+    // interrupt handler. The DMA interrupt stays disabled in the NVIC. With
+    // SEVONPEND, its pending bit still generates an event that wakes WFE up,
+    // so the CPU sleeps while the DMA moves the data.
+    LL_DMA_EnableIT_TC(DMA1, SPI_DMA_RX);
+    SET_BIT(SCB->SCR, SCB_SCR_SEVONPEND_Msk);
+
+    // Enable the RX request before the TX request as per the reference manual
+    LL_DMA_EnableChannel(DMA1, SPI_DMA_RX);
+    SET_BIT(spi->port->CR2, SPI_CR2_RXDMAEN);
+    LL_DMA_EnableChannel(DMA1, SPI_DMA_TX);
+    SET_BIT(spi->port->CR2, SPI_CR2_TXDMAEN);
+
+    while (!LL_DMA_IsActiveFlag_TC2(DMA1)) __WFE();
+
+    CLEAR_BIT(spi->port->CR2, SPI_CR2_TXDMAEN | SPI_CR2_RXDMAEN);
+    LL_DMA_DisableChannel(DMA1, SPI_DMA_TX);
+    LL_DMA_DisableChannel(DMA1, SPI_DMA_RX);
+    LL_DMA_DisableIT_TC(DMA1, SPI_DMA_RX);
+    LL_DMA_ClearFlag_GI2(DMA1);
+    LL_DMA_ClearFlag_GI3(DMA1);
+    CLEAR_BIT(SCB->SCR, SCB_SCR_SEVONPEND_Msk);
+    NVIC_ClearPendingIRQ(DMA1_Channel2_3_IRQn);
+
+    // The last byte has been received, so the bus is idle
+    while (spi->port->SR & SPI_SR_BSY) continue;
+}
+
+
+__weak void spi_on_resume(Spi_t *spi)
+{
+    (void)spi;
 }
@@ -1,17 +1,46 @@
 #ifndef _HW_SPI_H
 #define _HW_SPI_H
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stm/STM32L0xx_HAL_Driver/Inc/stm32l0xx_hal.h>
 #include "gpio.h"
 
 
+//! @brief Write-through shadow of the registers of an SPI device that uses
+//! single-byte register addresses with the MSB set for writes, e.g., SX1276.
+//! Writes that would not change a shadowed register and reads of valid
+//! shadowed registers do not reach the bus. The device has two register maps
+//! selected by a bit in a mode register, each with its own bitmap of the
+//! registers that only change when written (configuration registers).
 typedef struct
 {
-    SPI_HandleTypeDef hspi;
+    const uint8_t *cacheable[2];  // Bitmaps of shadowed registers per mode (128 bits)
+    uint8_t mode_reg;             // The register that selects the register map
+    uint8_t mode_mask;            // The bit in mode_reg that selects the map
+    uint8_t mode;                 // Current map, 0 or 1
+    uint8_t valid[16];            // Bitmap of shadowed registers with a known value
+    uint8_t value[128];
+
+    // State of the current transaction within NSS low
+    uint8_t state;
+    uint8_t reg;                  // Register accessed by the next data byte
+    bool write;
+    bool open;                    // NSS has been driven low and the address sent
+} spi_shadow_t;
+
+
+typedef struct
+{
+    SPI_TypeDef *port;
     Gpio_t Nss;   // First character is upper-case for compatiblity with LoRaMac-node
     Gpio_t mosi;
     Gpio_t miso;
     Gpio_t sclk;
+    uint32_t generation;  // Value of system_stop_generation when the IOs were initialized
+    uint32_t hz;          // Requested SPI clock frequency
+    uint32_t clock;       // Value of SystemCoreClock the prescaler was calculated for
+    spi_shadow_t *shadow; // Register shadow or NULL
 } Spi_t;
 
 
@@ -32,7 +61,41 @@ void spi_io_init(Spi_t *spi);
 
 void spi_io_deinit(Spi_t *spi);
 
+//! @brief Return true if the SPI IOs have been initialized since the last Stop
+
+bool spi_io_active(Spi_t *spi);
+
+//! @brief This function is called when the SPI IOs are initialized again on
+//! the first transfer after Stop (weak)
+
+void spi_on_resume(Spi_t *spi);
+
 
 uint16_t SpiInOut(Spi_t *obj, uint16_t outData);
 
+//! @brief Attach a register shadow to the SPI device. The shadow starts out
+//! empty. Only one device can have a shadow.
+//! @param[in] shadow Shadow with the cacheable bitmaps and the mode register
+//! filled in
+
+void spi_shadow_init(Spi_t *spi, spi_shadow_t *shadow);
+
+//! @brief Forget all shadowed register values, e.g., after a device reset
+
+void spi_shadow_invalidate(Spi_t *spi);
+
+//! @brief Handle a write to the NSS pin of the device with a register shadow.
+//! Invoked by GpioWrite.
+//! @retval true if the pin belongs to the device and has been handled
+
+bool spi_shadow_nss(Gpio_t *nss, uint32_t value);
+
+//! @brief Transfer a block of data, e.g., the SX1276 FIFO. Longer transfers
+//! are performed by DMA while the CPU sleeps. The caller controls NSS.
+//! @param[in] tx Data to transmit, or NULL to transmit zeroes
+//! @param[out] rx Destination buffer for the received data, or NULL
+//! @param[in] length Number of bytes to transfer
+
+void spi_transfer(Spi_t *spi, const uint8_t *tx, uint8_t *rx, size_t length);
+
 #endif // _HW_SPI_H
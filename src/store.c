@@ -0,0 +1,77 @@
+#include "store.h"
+#include <assert.h>
+#include <stm/STM32L0xx_HAL_Driver/Inc/stm32l0xx_hal.h>
+#include "flash.h"
+#include "log.h"
+
+#define STORE_START (FLASH_END + 1 - STORE_SIZE)
+
+static_assert(STORE_SIZE % FLASH_PAGE_SIZE == 0, "STORE_SIZE must be a multiple of the flash page size");
+
+
+static bool store_write(uint32_t address, const void *buffer, size_t length);
+static bool store_erase(uint32_t address, size_t length);
+static const void *store_mmap(uint32_t address, size_t length);
+
+static part_block_t store = {
+    .size = STORE_SIZE,
+    .mmap = store_mmap,
+    .write = store_write,
+    .erase = store_erase
+};
+
+static bool store_ok;
+
+
+static bool store_write(uint32_t address, const void *buffer, size_t length)
+{
+    if (address + length > STORE_SIZE) return false;
+    return flash_write(STORE_START + address, buffer, length);
+}
+
+
+static bool store_erase(uint32_t address, size_t length)
+{
+    if (address + length > STORE_SIZE) return false;
+    return flash_erase(STORE_START + address, length);
+}
+
+
+static const void *store_mmap(uint32_t address, size_t length)
+{
+    if (address + length > STORE_SIZE) return NULL;
+    return (const void *)(STORE_START + address);
+}
+
+
+void store_init(void)
+{
+    if (flash_get_firmware_end() > STORE_START) {
+        log_error("store: Firmware overlaps with the store");
+        return;
+    }
+
+    if (part_open_block(&store) != 0) {
+        log_debug("store: Formatting the store");
+        if (part_format_block(&store, STORE_MAX_PARTS) != 0 || part_open_block(&store) != 0) {
+            log_error("store: Could not format the store");
+            return;
+        }
+    }
+
+    store_ok = true;
+}
+
+
+int store_open(part_t *part, const char *label, size_t size)
+{
+    if (!store_ok) return -1;
+
+    if (part_find(part, &store, label) == 0) return 0;
+
+    if (part_create(part, &store, label, size) != 0) {
+        log_error("store: Could not create part '%s' (%d B)", label, size);
+        return -2;
+    }
+    return 0;
+}
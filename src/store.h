@@ -0,0 +1,49 @@
+#ifndef _STORE_H
+#define _STORE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "part.h"
+#include "frag.h"
+
+//! @brief Size of the flash memory area at the end of flash that holds the
+//! flash-backed part block (the store), must be a multiple of the flash page
+//! size. With FUOTA, the store also holds the fragments of a data block.
+#ifndef STORE_SIZE
+#  if FUOTA == 1
+#    define STORE_SIZE (FRAG_STORE_SIZE + 16384)
+#  else
+#    define STORE_SIZE 16384
+#  endif
+#endif
+
+//! @brief Maximum number of parts in the store
+#define STORE_MAX_PARTS 8
+
+//! @brief Size of a log sector in the store, see part_log_open
+#define STORE_SECTOR_SIZE 1024
+
+//! @brief Initialize the store
+//!
+//! The store is a part block in the program flash memory past the firmware
+//! image, accessed with the part_* functions like the NVM in the EEPROM. It
+//! holds data too large for the EEPROM. The store is formatted if it does not
+//! contain a partition table yet. If the firmware image extends into the
+//! store, the store remains unavailable.
+
+void store_init(void);
+
+//! @brief Find a part in the store, or create it if it does not exist
+//!
+//! Parts are created in the free space following the existing parts. A part
+//! found with a different size is used as is.
+//! @param[out] part The part
+//! @param[in] label The label of the part
+//! @param[in] size The size of the part to be created in bytes
+//! @return 0 On success
+//! @return negative value On failure, e.g., if the store is not available
+
+int store_open(part_t *part, const char *label, size_t size);
+
+#endif // _STORE_H
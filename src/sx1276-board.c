@@ -1,13 +1,18 @@
+#define LOG_MODULE_THRESHOLD LOG_THRESHOLD_RADIO
 #include "sx1276-board.h"
+#include <string.h>
 #include <loramac-node/src/radio/radio.h>
 #include <loramac-node/src/radio/sx1276/sx1276.h>
 #include <stm/STM32L0xx_HAL_Driver/Inc/stm32l0xx_hal.h>
+#include <LoRaWAN/Utilities/timeServer.h>
 #include "gpio.h"
 #include "rtc.h"
 #include "system.h"
 #include "log.h"
 #include "radio.h"
 #include "irq.h"
+#include "trace.h"
+#include "energy.h"
 
 #if !defined(TCXO_PIN)
 #  error TCXO_PIN is undefined
@@ -26,21 +31,177 @@
 #  error Unsupported TCXO_PIN value
 #endif
 
-#define ANT_SWITCH_PORT_RX       GPIOA //CRF1
-#define ANT_SWITCH_PIN_RX        GPIO_PIN_1
+// The RF front-end of the Murata TypeABZ module: three antenna switch control
+// lines driven by the MCU. The B-L072Z-LRWAN1, Arduino MKRWAN1310, and
+// Hardwario Chester boards all use the module's internal switch, so they share
+// this profile and only differ in TCXO control (see TCXO_PIN above). The
+// switch settles in well under a microsecond, so no transition delays are
+// needed.
+typedef enum {
+    RF_OFF = 0,
+    RF_RX,
+    RF_TX_RFO,
+    RF_TX_BOOST,
+    RF_STATE_COUNT
+} rf_state_t;
+
+static const struct {
+    GPIO_TypeDef *port;
+    uint16_t pin;
+    bool active_high;
+    rf_state_t state;   // The state in which the line is active
+} rf_lines[] = {
+    { GPIOA, GPIO_PIN_1, true, RF_RX       }, // CRF1
+    { GPIOC, GPIO_PIN_2, true, RF_TX_RFO   }, // CRF2
+    { GPIOC, GPIO_PIN_1, true, RF_TX_BOOST }  // CRF3
+};
+
+#define RF_LINE_COUNT (sizeof(rf_lines) / sizeof(rf_lines[0]))
+
+// Switch line register values per GPIO port, precomputed by init_rf_frontend
+// so that every transition is a single register write per port
+static struct {
+    GPIO_TypeDef *port;
+    uint32_t moder_mask;  // MODER bits of the lines (all ones is analog mode)
+    uint32_t moder_out;   // MODER bits of the lines in output mode
+    uint32_t bsrr[RF_STATE_COUNT];
+} rf_ports[RF_LINE_COUNT];
+
+static unsigned rf_port_count;
 
-#define ANT_SWITCH_PORT_TX_BOOST GPIOC //CRF3
-#define ANT_SWITCH_PIN_TX_BOOST  GPIO_PIN_1
+#define TCXO_WAKEUP_TIME 5
 
-#define ANT_SWITCH_PORT_TX_RFO   GPIOC //CRF2
-#define ANT_SWITCH_PIN_TX_RFO    GPIO_PIN_2
+// A TCXO powered up in advance with sx1276_tcxo_prepare is switched off again
+// if the radio does not use it within this many milliseconds
+#define TCXO_PREPARE_TIMEOUT 50
 
 
-#define IRQ_PRIORITY  0
-#define TCXO_WAKEUP_TIME 5
+static bool radio_is_active = false;
 
+// A reset pulse started during boot ahead of SX1276Reset, see
+// sx1276_reset_begin and sx1276_reset_release
+static enum {
+    EARLY_RESET_NONE = 0,
+    EARLY_RESET_ASSERTED,
+    EARLY_RESET_RELEASED
+} early_reset;
+
+// The RTC timer value of the last change of the RESET pin
+static uint32_t reset_time;
+
+// Configuration registers of the SX1276 that only change when written. These
+// are shadowed by the SPI driver so that LoRaMac-node's repeated writes of an
+// unchanged configuration before each TX and RX window do not reach the bus.
+// FrfLsb is left out because writing it applies the new frequency. Registers
+// with trigger bits (RegRxConfig, RegOsc, RegSeqConfig1, RegImageCal, ...)
+// and status registers are left out too.
+static const uint8_t fsk_shadowed[] = {
+    REG_BITRATEMSB, REG_BITRATELSB, REG_FDEVMSB, REG_FDEVLSB, REG_FRFMSB,
+    REG_FRFMID, REG_PACONFIG, REG_PARAMP, REG_OCP, REG_LNA, REG_RSSICONFIG,
+    REG_RSSICOLLISION, REG_RSSITHRESH, REG_RXBW, REG_AFCBW, REG_OOKPEAK,
+    REG_OOKFIX, REG_OOKAVG, REG_PREAMBLEDETECT, REG_RXTIMEOUT1, REG_RXTIMEOUT2,
+    REG_RXTIMEOUT3, REG_RXDELAY, REG_PREAMBLEMSB, REG_PREAMBLELSB,
+    REG_SYNCCONFIG, REG_SYNCVALUE1, REG_SYNCVALUE2, REG_SYNCVALUE3,
+    REG_SYNCVALUE4, REG_SYNCVALUE5, REG_SYNCVALUE6, REG_SYNCVALUE7,
+    REG_SYNCVALUE8, REG_PACKETCONFIG1, REG_PACKETCONFIG2, REG_PAYLOADLENGTH,
+    REG_NODEADRS, REG_BROADCASTADRS, REG_FIFOTHRESH, REG_SEQCONFIG2,
+    REG_TIMERRESOL, REG_TIMER1COEF, REG_TIMER2COEF, REG_DIOMAPPING1,
+    REG_DIOMAPPING2, REG_TCXO, REG_PADAC
+};
+
+static const uint8_t lora_shadowed[] = {
+    REG_LR_FRFMSB, REG_LR_FRFMID, REG_LR_PACONFIG, REG_LR_PARAMP, REG_LR_OCP,
+    REG_LR_LNA, REG_LR_FIFOTXBASEADDR, REG_LR_FIFORXBASEADDR,
+    REG_LR_IRQFLAGSMASK, REG_LR_MODEMCONFIG1, REG_LR_MODEMCONFIG2,
+    REG_LR_SYMBTIMEOUTLSB, REG_LR_PREAMBLEMSB, REG_LR_PREAMBLELSB,
+    REG_LR_PAYLOADLENGTH, REG_LR_PAYLOADMAXLENGTH, REG_LR_HOPPERIOD,
+    REG_LR_MODEMCONFIG3, REG_LR_DETECTOPTIMIZE, REG_LR_INVERTIQ,
+    REG_LR_DETECTIONTHRESHOLD, REG_LR_SYNCWORD, REG_LR_INVERTIQ2,
+    REG_LR_DIOMAPPING1, REG_LR_DIOMAPPING2, REG_LR_TCXO, REG_LR_PADAC
+};
+
+static uint8_t fsk_map[16], lora_map[16];
+
+static spi_shadow_t shadow = {
+    .cacheable = { fsk_map, lora_map },
+    .mode_reg = REG_OPMODE,
+    .mode_mask = RFLR_OPMODE_LONGRANGEMODE_ON
+};
+
+
+static void init_shadow(void)
+{
+    for (unsigned int i = 0; i < sizeof(fsk_shadowed); i++)
+        fsk_map[fsk_shadowed[i] >> 3] |= 1 << (fsk_shadowed[i] & 7);
 
-static bool radio_is_active = false;
+    for (unsigned int i = 0; i < sizeof(lora_shadowed); i++)
+        lora_map[lora_shadowed[i] >> 3] |= 1 << (lora_shadowed[i] & 7);
+
+    spi_shadow_init(&SX1276.Spi, &shadow);
+}
+
+
+static void init_rf_frontend(void)
+{
+    GPIO_InitTypeDef cfg = {
+        .Mode = GPIO_MODE_ANALOG,
+        .Pull = GPIO_NOPULL,
+        .Speed = GPIO_SPEED_HIGH
+    };
+    unsigned i, j;
+    rf_state_t st;
+
+    rf_port_count = 0;
+    memset(rf_ports, 0, sizeof(rf_ports));
+
+    for (i = 0; i < RF_LINE_COUNT; i++) {
+        // Configures the output type and speed of the line and enables the
+        // clock of the port. Only MODER is changed afterwards.
+        gpio_init(rf_lines[i].port, rf_lines[i].pin, &cfg);
+
+        for (j = 0; j < rf_port_count; j++)
+            if (rf_ports[j].port == rf_lines[i].port) break;
+        if (j == rf_port_count) rf_ports[rf_port_count++].port = rf_lines[i].port;
+
+        uint32_t pos = POSITION_VAL(rf_lines[i].pin);
+        rf_ports[j].moder_mask |= GPIO_MODER_MODE0 << (pos * 2);
+        rf_ports[j].moder_out |= GPIO_MODE_OUTPUT_PP << (pos * 2);
+
+        for (st = RF_OFF; st < RF_STATE_COUNT; st++) {
+            bool high = (st == rf_lines[i].state) == rf_lines[i].active_high;
+            rf_ports[j].bsrr[st] |= high ? rf_lines[i].pin : (uint32_t)rf_lines[i].pin << 16;
+        }
+    }
+}
+
+
+static inline void set_rf_state(rf_state_t state)
+{
+    for (unsigned i = 0; i < rf_port_count; i++)
+        rf_ports[i].port->BSRR = rf_ports[i].bsrr[state];
+}
+
+
+// Configure the TCXO power pin, once. It may already have been configured
+// and the TCXO powered up by sx1276_reset_begin.
+static void init_tcxo(void)
+{
+#ifdef TCXO_CONTROL_ENABLED
+    static bool initialized = false;
+    GPIO_InitTypeDef cfg = {
+        .Mode = GPIO_MODE_OUTPUT_PP,
+        .Pull = GPIO_NOPULL,
+        .Speed = GPIO_SPEED_HIGH
+    };
+
+    if (initialized) return;
+
+    // RADIO_TCXO_POWER
+    gpio_write(TCXO_VCC_PORT, TCXO_VCC_PIN, 0);
+    gpio_init(TCXO_VCC_PORT, TCXO_VCC_PIN, &cfg);
+    initialized = true;
+#endif
+}
 
 
 void SX1276IoInit(void)
@@ -59,17 +220,12 @@ void SX1276IoInit(void)
     gpio_init(SX1276.DIO3.port, SX1276.DIO3.pinIndex, &cfg);
     gpio_init(SX1276.DIO4.port, SX1276.DIO4.pinIndex, &cfg);
 
-#ifdef TCXO_CONTROL_ENABLED
-    // RADIO_TCXO_POWER
     static bool initialized = false;
     if (!initialized) {
-        cfg.Mode = GPIO_MODE_OUTPUT_PP;
-        cfg.Pull = GPIO_NOPULL;
-        gpio_write(TCXO_VCC_PORT, TCXO_VCC_PIN, 0);
-        gpio_init(TCXO_VCC_PORT, TCXO_VCC_PIN, &cfg);
+        init_rf_frontend();
+        init_tcxo();
         initialized = true;
     }
-#endif
 }
 
 
@@ -89,22 +245,45 @@ void SX1276IoDeInit(void)
 }
 
 
+// The DIO0 and DIO1 handlers are wrapped so that the radio IRQs can be traced
+static DioIrqHandler *dio_irq[2];
+
+
+static void dio0_irq(void *context)
+{
+    trace(TRACE_DIO0);
+    dio_irq[0](context);
+}
+
+
+static void dio1_irq(void *context)
+{
+    trace(TRACE_DIO1);
+    dio_irq[1](context);
+}
+
+
 void SX1276IoIrqInit(DioIrqHandler **irq)
 {
-    gpio_set_irq(SX1276.DIO0.port, SX1276.DIO0.pinIndex, IRQ_PRIORITY, irq[0]);
-    gpio_set_irq(SX1276.DIO1.port, SX1276.DIO1.pinIndex, IRQ_PRIORITY, irq[1]);
-    gpio_set_irq(SX1276.DIO2.port, SX1276.DIO2.pinIndex, IRQ_PRIORITY, irq[2]);
-    gpio_set_irq(SX1276.DIO3.port, SX1276.DIO3.pinIndex, IRQ_PRIORITY, irq[3]);
-    gpio_set_irq(SX1276.DIO4.port, SX1276.DIO4.pinIndex, IRQ_PRIORITY, irq[4]);
+    dio_irq[0] = irq[0];
+    dio_irq[1] = irq[1];
+    gpio_set_irq(SX1276.DIO0.port, SX1276.DIO0.pinIndex, IRQ_PRIORITY_EXTI, irq[0] ? dio0_irq : NULL);
+    gpio_set_irq(SX1276.DIO1.port, SX1276.DIO1.pinIndex, IRQ_PRIORITY_EXTI, irq[1] ? dio1_irq : NULL);
+    gpio_set_irq(SX1276.DIO2.port, SX1276.DIO2.pinIndex, IRQ_PRIORITY_EXTI, irq[2]);
+    gpio_set_irq(SX1276.DIO3.port, SX1276.DIO3.pinIndex, IRQ_PRIORITY_EXTI, irq[3]);
+    gpio_set_irq(SX1276.DIO4.port, SX1276.DIO4.pinIndex, IRQ_PRIORITY_EXTI, irq[4]);
 }
 
 
-void SX1276Reset(void)
+static void wait_since(uint32_t start, uint32_t ms)
 {
-    // Enables the TCXO if available on the board design
-    SX1276SetBoardTcxo(true);
+    uint32_t ticks = rtc_ms2tick(ms);
+    while (rtc_get_timer_value() - start < ticks) continue;
+}
 
-    // Set RESET pin to 0
+
+static void assert_reset(void)
+{
     GPIO_InitTypeDef cfg = {
         .Mode = GPIO_MODE_OUTPUT_PP,
         .Pull = GPIO_NOPULL,
@@ -113,14 +292,113 @@ void SX1276Reset(void)
 
     gpio_write(SX1276.Reset.port, SX1276.Reset.pinIndex, 0);
     gpio_init(SX1276.Reset.port, SX1276.Reset.pinIndex, &cfg);
+    reset_time = rtc_get_timer_value();
+}
+
 
-    rtc_delay_ms(1);
+// Hold RESET low for at least 1 ms, then configure it as input
+static void release_reset(void)
+{
+    GPIO_InitTypeDef cfg = {
+        .Mode = GPIO_MODE_ANALOG,
+        .Pull = GPIO_NOPULL,
+        .Speed = GPIO_SPEED_HIGH
+    };
 
-    // Configure RESET as input
-    cfg.Mode = GPIO_MODE_ANALOG;
+    wait_since(reset_time, 1);
     gpio_init(SX1276.Reset.port, SX1276.Reset.pinIndex, &cfg);
+    reset_time = rtc_get_timer_value();
+}
+
+
+void sx1276_reset_begin(void)
+{
+    init_tcxo();
+    sx1276_tcxo_prepare();
+    assert_reset();
+    early_reset = EARLY_RESET_ASSERTED;
+}
+
+
+void sx1276_reset_release(void)
+{
+    if (early_reset != EARLY_RESET_ASSERTED) return;
 
-    rtc_delay_ms(6);
+    // Keep the order of SX1276Reset: the TCXO is up before the chip leaves
+    // reset. Only the remainder of the TCXO startup time is waited for.
+    SX1276SetBoardTcxo(true);
+    release_reset();
+    early_reset = EARLY_RESET_RELEASED;
+}
+
+
+void SX1276Reset(void)
+{
+    // Enables the TCXO if available on the board design
+    SX1276SetBoardTcxo(true);
+
+    // The registers return to their defaults, starting in the FSK map
+    if (SX1276.Spi.shadow == NULL) init_shadow();
+    spi_shadow_invalidate(&SX1276.Spi);
+    shadow.mode = 0;
+
+    // A pulse started by sx1276_reset_begin is completed rather than
+    // repeated, and only the part of the 6 ms that has not elapsed since
+    // sx1276_reset_release is waited for
+    if (early_reset == EARLY_RESET_NONE) assert_reset();
+    if (early_reset != EARLY_RESET_RELEASED) release_reset();
+    early_reset = EARLY_RESET_NONE;
+
+    wait_since(reset_time, 6);
+}
+
+
+#ifdef TCXO_CONTROL_ENABLED
+
+// The RTC timer value when the TCXO was powered up
+static uint32_t tcxo_on_time;
+static bool tcxo_prepared;
+static TimerEvent_t tcxo_timer;
+
+
+static void tcxo_on(void)
+{
+    gpio_write(TCXO_VCC_PORT, TCXO_VCC_PIN, 1);
+    tcxo_on_time = rtc_get_timer_value();
+    energy_mark(ENERGY_TCXO, true);
+}
+
+
+static void on_tcxo_timer(void *ctx)
+{
+    (void)ctx;
+    if (!tcxo_prepared) return;
+
+    log_debug("TCXO not used, powering down");
+    tcxo_prepared = false;
+    gpio_write(TCXO_VCC_PORT, TCXO_VCC_PIN, 0);
+    energy_mark(ENERGY_TCXO, false);
+}
+
+#endif
+
+
+void sx1276_tcxo_prepare(void)
+{
+#ifdef TCXO_CONTROL_ENABLED
+    uint32_t mask = disable_irq();
+
+    if (gpio_read(TCXO_VCC_PORT, TCXO_VCC_PIN) == 0) {
+        tcxo_on();
+        tcxo_prepared = true;
+
+        if (tcxo_timer.Callback == NULL) TimerInit(&tcxo_timer, on_tcxo_timer);
+        TimerSetValue(&tcxo_timer, TCXO_PREPARE_TIMEOUT);
+        TimerStart(&tcxo_timer);
+    }
+
+    reenable_irq(mask);
+#endif
 }
 
 
@@ -128,17 +406,36 @@ void SX1276SetBoardTcxo(uint8_t state)
 {
 #ifdef TCXO_CONTROL_ENABLED
     if (state) {
+        uint32_t mask = disable_irq();
+        if (tcxo_prepared) {
+            tcxo_prepared = false;
+            TimerStop(&tcxo_timer);
+        }
+
         // if TCXO OFF power it up.
         if (gpio_read(TCXO_VCC_PORT, TCXO_VCC_PIN) == 0) {
             // Power ON the TCXO
             log_debug("SX1276SetBoardTcxo: %d", state);
-            gpio_write(TCXO_VCC_PORT, TCXO_VCC_PIN, 1);
-            DelayMs(TCXO_WAKEUP_TIME);
+            tcxo_on();
         }
+        reenable_irq(mask);
+
+        // Only wait for the part of the startup time that has not elapsed
+        // yet, e.g., while LoRaMac was building and encrypting the frame
+        // after sx1276_tcxo_prepare
+        uint32_t wakeup = rtc_ms2tick(TCXO_WAKEUP_TIME);
+        while (rtc_get_timer_value() - tcxo_on_time < wakeup) continue;
     } else {
         // Power OFF the TCXO
         log_debug("SX1276SetBoardTcxo: %d", state);
+        uint32_t mask = disable_irq();
+        if (tcxo_prepared) {
+            tcxo_prepared = false;
+            TimerStop(&tcxo_timer);
+        }
         gpio_write(TCXO_VCC_PORT, TCXO_VCC_PIN, 0);
+        energy_mark(ENERGY_TCXO, false);
+        reenable_irq(mask);
     }
 #else
     (void)state;
@@ -181,67 +478,49 @@ void SX1276SetRfTxPower(int8_t power)
     }
     SX1276Write(REG_PACONFIG, paconfig);
     SX1276Write(REG_PADAC, paDac);
+    energy_tx_power(power);
 }
 
 
 void SX1276SetAntSwLowPower(bool status)
 {
     uint32_t mask;
+    unsigned i;
     if (radio_is_active == status) return;
 
     log_debug("SX1276SetAntSwLowPower: %d", status);
     radio_is_active = status;
 
-    GPIO_InitTypeDef cfg = {
-        .Pull = GPIO_NOPULL,
-        .Speed = GPIO_SPEED_HIGH
-    };
-
+    mask = disable_irq();
     if (status == false) {
-        cfg.Mode = GPIO_MODE_OUTPUT_PP;
-
-        gpio_write(ANT_SWITCH_PORT_RX, ANT_SWITCH_PIN_RX, 0);
-        gpio_init(ANT_SWITCH_PORT_RX, ANT_SWITCH_PIN_RX, &cfg);
-
-        gpio_write(ANT_SWITCH_PORT_TX_BOOST, ANT_SWITCH_PIN_TX_BOOST, 0);
-        gpio_init(ANT_SWITCH_PORT_TX_BOOST, ANT_SWITCH_PIN_TX_BOOST, &cfg);
-
-        gpio_write(ANT_SWITCH_PORT_TX_RFO, ANT_SWITCH_PIN_TX_RFO, 0);
-        gpio_init(ANT_SWITCH_PORT_TX_RFO, ANT_SWITCH_PIN_TX_RFO, &cfg);
-
-        mask = disable_irq();
-        system_stop_lock |= SYSTEM_MODULE_RADIO;
-        reenable_irq(mask);
+        // Drive all lines inactive before switching them to outputs
+        set_rf_state(RF_OFF);
+        for (i = 0; i < rf_port_count; i++) {
+            GPIO_TypeDef *port = rf_ports[i].port;
+            port->MODER = (port->MODER & ~rf_ports[i].moder_mask) | rf_ports[i].moder_out;
+        }
+        system_lock(&system_stop_lock, SYSTEM_MODULE_RADIO);
     } else {
-        mask = disable_irq();
-        system_stop_lock &= ~SYSTEM_MODULE_RADIO;
-        reenable_irq(mask);
-
-        cfg.Mode = GPIO_MODE_ANALOG;
-
-        gpio_write(ANT_SWITCH_PORT_RX, ANT_SWITCH_PIN_RX, 0);
-        gpio_init(ANT_SWITCH_PORT_RX, ANT_SWITCH_PIN_RX, &cfg);
-
-        gpio_write(ANT_SWITCH_PORT_TX_BOOST, ANT_SWITCH_PIN_TX_BOOST, 0);
-        gpio_init(ANT_SWITCH_PORT_TX_BOOST, ANT_SWITCH_PIN_TX_BOOST, &cfg);
-
-        gpio_write(ANT_SWITCH_PORT_TX_RFO, ANT_SWITCH_PIN_TX_RFO, 0);
-        gpio_init(ANT_SWITCH_PORT_TX_RFO, ANT_SWITCH_PIN_TX_RFO, &cfg);
+        system_unlock(&system_stop_lock, SYSTEM_MODULE_RADIO);
+        set_rf_state(RF_OFF);
+        for (i = 0; i < rf_port_count; i++)
+            rf_ports[i].port->MODER |= rf_ports[i].moder_mask;
     }
+    reenable_irq(mask);
 }
 
 
 void SX1276SetAntSw(uint8_t op_mode)
 {
-    uint8_t paconfig = SX1276Read(REG_PACONFIG);
+    uint8_t paconfig;
+
     switch(op_mode) {
     case RFLR_OPMODE_TRANSMITTER:
+        paconfig = SX1276Read(REG_PACONFIG);
         if ((paconfig & RF_PACONFIG_PASELECT_PABOOST) == RF_PACONFIG_PASELECT_PABOOST) {
-            // GpioWrite( &AntSwitchTxBoost, 1 );
-            gpio_write(ANT_SWITCH_PORT_TX_BOOST, ANT_SWITCH_PIN_TX_BOOST, 1);
+            set_rf_state(RF_TX_BOOST);
         } else {
-            // GpioWrite( &AntSwitchTxRfo, 1 );
-            gpio_write(ANT_SWITCH_PORT_TX_RFO, ANT_SWITCH_PIN_TX_RFO, 1);
+            set_rf_state(RF_TX_RFO);
         }
         break;
 
@@ -249,8 +528,7 @@ void SX1276SetAntSw(uint8_t op_mode)
     case RFLR_OPMODE_RECEIVER_SINGLE:
     case RFLR_OPMODE_CAD:
     default:
-        // GpioWrite( &AntSwitchRx, 1 );
-        gpio_write(ANT_SWITCH_PORT_RX, ANT_SWITCH_PIN_RX, 1);
+        set_rf_state(RF_RX);
         break;
     }
 }
@@ -266,3 +544,25 @@ uint32_t SX1276GetDio1PinState(void)
 {
     return gpio_read(SX1276.DIO1.port, SX1276.DIO1.pinIndex);
 }
+
+
+// Replace the driver's accessors, see sx1276-board.h. The address byte goes
+// through SpiInOut so that the register shadow sees it. Single register
+// accesses stay on SpiInOut within spi_transfer, FIFO blocks of
+// SPI_DMA_MIN_LENGTH bytes or more are moved by DMA.
+void SX1276WriteBuffer(uint32_t addr, uint8_t *buffer, uint8_t size)
+{
+    GpioWrite(&SX1276.Spi.Nss, 0);
+    SpiInOut(&SX1276.Spi, addr | 0x80);
+    spi_transfer(&SX1276.Spi, buffer, NULL, size);
+    GpioWrite(&SX1276.Spi.Nss, 1);
+}
+
+
+void SX1276ReadBuffer(uint32_t addr, uint8_t *buffer, uint8_t size)
+{
+    GpioWrite(&SX1276.Spi.Nss, 0);
+    SpiInOut(&SX1276.Spi, addr & 0x7f);
+    spi_transfer(&SX1276.Spi, NULL, buffer, size);
+    GpioWrite(&SX1276.Spi.Nss, 1);
+}
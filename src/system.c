@@ -1,4 +1,6 @@
 #include "system.h"
+#include <stdbool.h>
+#include <string.h>
 #include <stm/STM32L0xx_HAL_Driver/Inc/stm32l0xx_hal.h>
 #include <stm/STM32L0xx_HAL_Driver/Inc/stm32l0xx_ll_pwr.h>
 #include <stm/STM32L0xx_HAL_Driver/Inc/stm32l0xx_ll_rcc.h>
@@ -9,6 +11,8 @@
 #include "nvm.h"
 #include "lrw.h"
 #include "cmd.h"
+#include "energy.h"
+#include "lpuart.h"
 
 
 // Unique Devices IDs register set ( STM32L0xxx )
@@ -19,6 +23,205 @@
 
 volatile unsigned system_stop_lock;
 volatile unsigned system_sleep_lock;
+volatile unsigned system_tasks;
+volatile uint32_t system_stop_generation;
+bool system_resumed;
+uint8_t system_reset_flags;
+
+// The token written to the backup registers on Standby entry. A Standby exit
+// without the token (e.g., a wakeup after a firmware update) takes the regular
+// boot path.
+#define STANDBY_TOKEN 0x5b7a4e01
+
+static uint32_t standby_ticks;
+
+#if DFU == 1
+// The token written to RTC backup register 4 by system_request_bootloader.
+// The register survives the system reset that follows.
+#define BOOTLOADER_TOKEN 0xdf0b0071
+
+// The STM32L072 system bootloader in system memory
+#define SYSTEM_MEMORY_BASE 0x1FF00000UL
+#endif
+
+// Linker symbols, see cfg/STM32L072CZEx_FLASH.ld. There is no heap, so the
+// stack may grow down to the end of the static data.
+extern uint32_t _sdata, _edata, _sbss, _ebss, _end, _estack;
+
+// The pattern written into the unused stack area at boot. The deepest word
+// that no longer holds it marks the stack high-water mark.
+#define STACK_PAINT 0xa5a5a5a5
+
+// The number of words below the current stack pointer left unpainted to
+// protect the frame of the painting function
+#define STACK_PAINT_MARGIN 16
+
+// The MCU runs at one of two operating points while awake:
+//
+//   fast - SYSCLK from PLL(HSI16) at 32 MHz, voltage range 1 (1.8 V)
+//   slow - SYSCLK from HSI16 at 16 MHz, voltage range 2 (1.5 V)
+//
+// The fast point is used whenever the LoRaMac stack, the radio, or the debug
+// USART may need it (see system_enable_pll). The MCU drops to the slow point
+// before entering the Stop mode, and also before sleeping if the only work in
+// progress is I/O bound (SYSTEM_IO_MODULES), e.g., an LPUART DMA transfer.
+// Dropping to the slow point only switches SYSCLK and the regulator. Going
+// back waits for the regulator to settle and for the PLL to lock. The time
+// spent at the slow point and the number of switches are reported by
+// AT$PWRSTAT, which together with a current measurement of both points gives
+// the savings of a particular workload.
+static volatile bool pll_disabled;
+
+#define SYSTEM_IO_MODULES (SYSTEM_MODULE_LPUART_RX | SYSTEM_MODULE_LPUART_TX | \
+    SYSTEM_MODULE_ATCI | SYSTEM_MODULE_NVM)
+
+// The SYSCLK frequency in Low-power sleep mode, MSI range 1. The regulator can
+// only run in low-power mode up to 131 kHz.
+#define LP_SLEEP_CLOCK 131072
+
+
+// Power residency statistics. All times are kept in RTC ticks (1/1024 s) and
+// are converted to milliseconds only when reported. The 32-bit RTC timer wraps
+// around after about 48.5 days, thus the totals are 64 bits wide and are
+// accumulated from timer differences taken on every lock transition and every
+// wakeup from idle (see account_locks). The per-module counters are updated on
+// every lock transition, i.e., a module holds a lock from the moment it sets
+// its bit in either system_sleep_lock or system_stop_lock until it clears the
+// bit in both.
+static struct {
+    bool running;
+    uint32_t last;
+    unsigned held;
+    uint64_t total;
+    uint64_t sleep;
+    uint64_t stop;
+    uint64_t lp_sleep;
+    uint64_t slow;
+    uint32_t slow_since;
+    uint32_t clock_switches;
+    uint64_t module_time[SYSTEM_MODULE_COUNT];
+    uint32_t module_count[SYSTEM_MODULE_COUNT];
+} pwrstat;
+
+
+// The result saturates at UINT32_MAX (about 49.7 days)
+static inline uint32_t ticks2ms(uint64_t ticks)
+{
+    uint64_t ms = (ticks * 1000) >> 10;
+    return ms > UINT32_MAX ? UINT32_MAX : (uint32_t)ms;
+}
+
+
+// Note: this function must be called with interrupts disabled
+static void account_locks(void)
+{
+    unsigned held = system_sleep_lock | system_stop_lock;
+
+    if (pwrstat.running) {
+        uint32_t now = rtc_get_timer_value();
+        uint32_t delta = now - pwrstat.last;
+
+        pwrstat.total += delta;
+        for (int i = 0; i < SYSTEM_MODULE_COUNT; i++) {
+            if (pwrstat.held & (1 << i)) pwrstat.module_time[i] += delta;
+            if (held & ~pwrstat.held & (1 << i)) pwrstat.module_count[i]++;
+        }
+        pwrstat.last = now;
+    }
+
+#if ENERGY_PROFILE == 1 || ENERGY_METER == 1
+    unsigned changed = held ^ pwrstat.held;
+    if (changed & SYSTEM_MODULE_NVM)
+        energy_mark(ENERGY_EEPROM, held & SYSTEM_MODULE_NVM);
+    if (changed & SYSTEM_MODULE_LPUART_TX)
+        energy_mark(ENERGY_UART_TX, held & SYSTEM_MODULE_LPUART_TX);
+#endif
+    pwrstat.held = held;
+}
+
+
+void system_lock(volatile unsigned *lock, unsigned module)
+{
+    uint32_t mask = disable_irq();
+    *lock |= module;
+    account_locks();
+    reenable_irq(mask);
+}
+
+
+void system_unlock(volatile unsigned *lock, unsigned module)
+{
+    uint32_t mask = disable_irq();
+    *lock &= ~module;
+    account_locks();
+    reenable_irq(mask);
+}
+
+
+void system_post(unsigned tasks)
+{
+    uint32_t mask = disable_irq();
+    system_tasks |= tasks;
+    reenable_irq(mask);
+}
+
+
+unsigned system_take_tasks(void)
+{
+    uint32_t mask = disable_irq();
+    unsigned tasks = system_tasks;
+    system_tasks = 0;
+    reenable_irq(mask);
+    return tasks;
+}
+
+
+// Note: this function must be called with interrupts disabled, before the
+// operating point changes
+static void account_clock(void)
+{
+    uint32_t now = rtc_get_timer_value();
+    if (pll_disabled) pwrstat.slow += now - pwrstat.slow_since;
+    pwrstat.slow_since = now;
+}
+
+
+void system_reset_pwrstat(void)
+{
+    uint32_t mask = disable_irq();
+    memset(&pwrstat, 0, sizeof(pwrstat));
+    pwrstat.last = pwrstat.slow_since = rtc_get_timer_value();
+    pwrstat.held = system_sleep_lock | system_stop_lock;
+    pwrstat.running = true;
+    reenable_irq(mask);
+}
+
+
+void system_get_pwrstat(system_pwrstat_t *stat)
+{
+    uint32_t mask = disable_irq();
+
+    // Close the current accounting interval so that locks held right now are
+    // included in the report
+    account_locks();
+    account_clock();
+
+    uint64_t idle = pwrstat.sleep + pwrstat.stop;
+    stat->total = ticks2ms(pwrstat.total);
+    stat->sleep = ticks2ms(pwrstat.sleep);
+    stat->stop = ticks2ms(pwrstat.stop);
+    stat->run = ticks2ms(pwrstat.total > idle ? pwrstat.total - idle : 0);
+    stat->slow = ticks2ms(pwrstat.slow);
+    stat->clock_switches = pwrstat.clock_switches;
+    stat->lp_sleep = ticks2ms(pwrstat.lp_sleep);
+
+    for (int i = 0; i < SYSTEM_MODULE_COUNT; i++) {
+        stat->module_time[i] = ticks2ms(pwrstat.module_time[i]);
+        stat->module_count[i] = pwrstat.module_count[i];
+    }
+
+    reenable_irq(mask);
+}
 
 
 uint32_t system_get_random_seed(void)
@@ -46,46 +249,237 @@ void system_wait_hsi(void)
 }
 
 
+// Note: this function must be called with interrupts disabled
+static void set_voltage_range(uint32_t range)
+{
+    int pwr_disabled = __HAL_RCC_PWR_IS_CLK_DISABLED();
+    if (pwr_disabled) __HAL_RCC_PWR_CLK_ENABLE();
+
+    __HAL_PWR_VOLTAGESCALING_CONFIG(range);
+    while (__HAL_PWR_GET_FLAG(PWR_FLAG_VOS) != RESET) continue;
+
+    if (pwr_disabled) __HAL_RCC_PWR_CLK_DISABLE();
+}
+
+
+// Switch to the slow operating point. Note: this function must be called with
+// interrupts disabled.
+static void disable_pll(void)
+{
+    if (pll_disabled) return;
+    account_clock();
+
+    __HAL_RCC_SYSCLK_CONFIG(RCC_SYSCLKSOURCE_HSI);
+    while (__HAL_RCC_GET_SYSCLK_SOURCE() != RCC_SYSCLKSOURCE_STATUS_HSI)
+        continue;
+    __HAL_RCC_PLL_DISABLE();
+    SystemCoreClock = 16000000;
+
+    // Range 2 supports up to 16 MHz with the one wait state configured by
+    // init_clock
+    set_voltage_range(PWR_REGULATOR_VOLTAGE_SCALE2);
+
+    pll_disabled = true;
+    pwrstat.clock_switches++;
+}
+
+
+void system_enable_pll(void)
+{
+    uint32_t mask = disable_irq();
+
+    if (pll_disabled) {
+        account_clock();
+
+        // The core voltage must be raised before the frequency
+        set_voltage_range(PWR_REGULATOR_VOLTAGE_SCALE1);
+
+        __HAL_RCC_PLL_ENABLE();
+        while (__HAL_RCC_GET_FLAG(RCC_FLAG_PLLRDY) == RESET) continue;
+
+        __HAL_RCC_SYSCLK_CONFIG(RCC_SYSCLKSOURCE_PLLCLK);
+        while (__HAL_RCC_GET_SYSCLK_SOURCE() != RCC_SYSCLKSOURCE_STATUS_PLLCLK)
+            continue;
+
+        SystemCoreClock = 32000000;
+        pll_disabled = false;
+        pwrstat.clock_switches++;
+    }
+
+    reenable_irq(mask);
+}
+
+
+// Sleep with SYSCLK from MSI at 131 kHz, the regulator in low-power mode, and
+// the flash memory powered down. This is used while LPUART1 transmits from its
+// FIFO with DMA and nothing else is going on, e.g., while the modem prints a
+// long response. The DMA controller needs very few AHB cycles per character at
+// the baud rates where LPUART1 runs from the LSE, and HSI16 can be switched off
+// entirely. The MCU must be at the slow operating point (voltage range 2).
+// Note: this function must be called with interrupts disabled.
+static void enter_lp_sleep(void)
+{
+    int pwr_disabled;
+
+    __HAL_RCC_MSI_RANGE_CONFIG(RCC_MSIRANGE_1);
+    __HAL_RCC_MSI_ENABLE();
+    while (__HAL_RCC_GET_FLAG(RCC_FLAG_MSIRDY) == RESET) continue;
+
+    __HAL_RCC_SYSCLK_CONFIG(RCC_SYSCLKSOURCE_MSI);
+    while (__HAL_RCC_GET_SYSCLK_SOURCE() != RCC_SYSCLKSOURCE_STATUS_MSI)
+        continue;
+    __HAL_RCC_HSI_DISABLE();
+    SystemCoreClock = LP_SLEEP_CLOCK;
+
+    pwr_disabled = __HAL_RCC_PWR_IS_CLK_DISABLED();
+    if (pwr_disabled) __HAL_RCC_PWR_CLK_ENABLE();
+    SET_BIT(FLASH->ACR, FLASH_ACR_SLEEP_PD);
+
+    energy_mark(ENERGY_LP_SLEEP, true);
+    HAL_PWR_EnterSLEEPMode(PWR_LOWPOWERREGULATOR_ON, PWR_SLEEPENTRY_WFI);
+    energy_mark(ENERGY_LP_SLEEP, false);
+
+    // Interrupts are disabled, so no handler runs before the clock has been
+    // restored. The regulator returns to main mode upon wakeup.
+    CLEAR_BIT(FLASH->ACR, FLASH_ACR_SLEEP_PD);
+    CLEAR_BIT(PWR->CR, PWR_CR_LPSDSR);
+    if (pwr_disabled) __HAL_RCC_PWR_CLK_DISABLE();
+
+    __HAL_RCC_HSI_ENABLE();
+    while (__HAL_RCC_GET_FLAG(RCC_FLAG_HSIRDY) == RESET) continue;
+    __HAL_RCC_SYSCLK_CONFIG(RCC_SYSCLKSOURCE_HSI);
+    while (__HAL_RCC_GET_SYSCLK_SOURCE() != RCC_SYSCLKSOURCE_STATUS_HSI)
+        continue;
+    __HAL_RCC_MSI_DISABLE();
+    SystemCoreClock = 16000000;
+}
+
+
+// The Standby mode loses the contents of SRAM and of most peripheral
+// registers. Only the backup domain (the LSE, the RTC, and its backup
+// registers) and the EEPROM survive. The MCU leaves Standby through a reset,
+// caused by NRST or, if enabled with STANDBY_WAKEUP_PIN, by a rising edge on
+// WKUP1 (PA0). LPUART1 cannot wake the MCU up, so the host must use one of
+// those before it sends an AT command. Note: this function must be called
+// with interrupts disabled and does not return.
+static void enter_standby(void)
+{
+    system_before_stop();
+    rtc_write_standby_token(STANDBY_TOKEN, rtc_get_timer_value());
+
+    __HAL_RCC_PWR_CLK_ENABLE();
+
+    // Switch VREFINT off in Standby and do not wait for it on wakeup
+    HAL_PWREx_EnableUltraLowPower();
+    HAL_PWREx_EnableFastWakeUp();
+
+#if STANDBY_WAKEUP_PIN == 1
+    HAL_PWR_EnableWakeUpPin(PWR_WAKEUP_PIN1);
+#endif
+    __HAL_PWR_CLEAR_FLAG(PWR_FLAG_WU);
+
+    HAL_PWR_EnterSTANDBYMode();
+    halt("Standby mode exited");
+}
+
+
+unsigned int system_coalesce_window(void)
+{
+    if (!sysconf.sleep) return sysconf.uart_coalesce;
+
+    switch (sysconf.power_profile) {
+    case SYSTEM_POWER_ULTRA_LOW:
+        return sysconf.uart_coalesce < SYSTEM_ULP_COALESCE
+            ? SYSTEM_ULP_COALESCE : sysconf.uart_coalesce;
+    case SYSTEM_POWER_LOW_LATENCY:
+        return 0;
+    default:
+        return sysconf.uart_coalesce;
+    }
+}
+
+
 // Note: this function must be called with interrupts disabled
 void system_idle(void)
 {
     int pwr_disabled;
+    uint32_t entered;
 
     // Do nothing if low-power operation is disabled entirely
     if (!sysconf.sleep) return;
 
-    // Do nothing if sleeping is prevented by a subsystem
-    if (system_sleep_lock) return;
+    // Do nothing if sleeping is prevented by a subsystem or if there is work
+    // to be done in the main loop
+    if (system_sleep_lock || system_tasks) return;
+
+    entered = rtc_get_timer_value();
+
+    if (sysconf.power_profile == SYSTEM_POWER_LOW_LATENCY) {
+        // Keep the operating point. An interrupt resumes the main loop within
+        // a few cycles, without relocking the PLL or restoring peripherals.
+        HAL_PWR_EnterSLEEPMode(PWR_MAINREGULATOR_ON, PWR_SLEEPENTRY_WFI);
+        pwrstat.sleep += rtc_get_timer_value() - entered;
+        energy_mcu(ENERGY_MCU_SLEEP, rtc_get_timer_value() - entered);
+        account_locks();
+        return;
+    }
 
     if (system_stop_lock) {
         // If Stop mode is prevented by a subsystem, enter the low-power sleep
-        // mode only.
-        HAL_PWR_EnterSLEEPMode(PWR_MAINREGULATOR_ON, PWR_SLEEPENTRY_WFI);
+        // mode only. If the subsystems only wait for I/O, they do not need
+        // the full clock speed until the next wakeup.
+        if (!(system_stop_lock & ~SYSTEM_IO_MODULES)) disable_pll();
+
+        // If the only thing going on is an LPUART1 transmission that does not
+        // depend on HSI16, sleep with the low-power regulator
+        if (system_stop_lock == SYSTEM_MODULE_LPUART_TX && lpuart_uses_lse()) {
+            enter_lp_sleep();
+            pwrstat.lp_sleep += rtc_get_timer_value() - entered;
+            energy_mcu(ENERGY_MCU_LP_SLEEP, rtc_get_timer_value() - entered);
+        } else {
+            HAL_PWR_EnterSLEEPMode(PWR_MAINREGULATOR_ON, PWR_SLEEPENTRY_WFI);
+            energy_mcu(ENERGY_MCU_SLEEP, rtc_get_timer_value() - entered);
+        }
+        pwrstat.sleep += rtc_get_timer_value() - entered;
     } else {
-        // Enter the low-power Stop mode
+        // Enter the low-power Stop mode. Switch to the slow operating point
+        // first. The MCU wakes up with HSI16 and the regulator keeps the
+        // voltage range, so the switch is made once rather than on every
+        // wakeup.
+
+        disable_pll();
+
+        if (sysconf.standby && system_can_standby()) enter_standby();
 
         system_before_stop();
 
         pwr_disabled = __HAL_RCC_PWR_IS_CLK_DISABLED();
         if (pwr_disabled) __HAL_RCC_PWR_CLK_ENABLE();
         SET_BIT(PWR->CR, PWR_CR_CWUF);
+        energy_mark(ENERGY_STOP, true);
         HAL_PWR_EnterSTOPMode(PWR_LOWPOWERREGULATOR_ON, PWR_STOPENTRY_WFI);
+        energy_mark(ENERGY_STOP, false);
         if (pwr_disabled) __HAL_RCC_PWR_CLK_DISABLE();
 
         // We configured the MCU to wake up from Stop with HSI16 enabled, thus
         // there is no need to reenable the HSI oscillator and disable the MSI
         // oscillator here.
         while (__HAL_RCC_GET_FLAG(RCC_FLAG_HSIRDY) == RESET) continue;
-
-        __HAL_RCC_PLL_ENABLE();
-        while (__HAL_RCC_GET_FLAG(RCC_FLAG_PLLRDY) == RESET) continue;
-
-        __HAL_RCC_SYSCLK_CONFIG(RCC_SYSCLKSOURCE_PLLCLK);
-        while (__HAL_RCC_GET_SYSCLK_SOURCE() != RCC_SYSCLKSOURCE_STATUS_PLLCLK)
-            continue;
-
+        rtc_set_mcu_wake_up_time();
+
+        // Keep running from HSI16. Most wakeups (RTC ticks, UART input) are
+        // short and do not need the full clock speed. The PLL is relocked
+        // with system_enable_pll once the radio or the LoRaMac stack needs
+        // it. LPUART1 is clocked from HSI16 or LSE directly and is not
+        // affected.
+        system_stop_generation++;
+
+        pwrstat.stop += rtc_get_timer_value() - entered;
+        energy_mcu(ENERGY_MCU_STOP, rtc_get_timer_value() - entered);
+        pwrstat.slow_since = rtc_get_timer_value();
         system_after_stop();
     }
+    account_locks();
 }
 
 
@@ -261,7 +655,7 @@ static void init_facnew_gpio(void)
         .Speed = GPIO_SPEED_HIGH,
     };
     gpio_init(facnew_pin.port, facnew_pin.pinIndex, &gpio);
-    gpio_set_irq(facnew_pin.port, facnew_pin.pinIndex, 0, facnew_isr);
+    gpio_set_irq(facnew_pin.port, facnew_pin.pinIndex, IRQ_PRIORITY_EXTI, facnew_isr);
 }
 
 #endif // FACTORY_RESET_PIN
@@ -322,8 +716,104 @@ static void init_clock(void)
 }
 
 
+// Fast path after the Standby mode: the LSE and the RTC kept running, so the
+// calendar is not reset. This keeps the timer value, and with it the network
+// time maintained by systime, continuous across Standby.
+static void init_rtc(void)
+{
+    uint32_t token, entered;
+
+    __HAL_RCC_PWR_CLK_ENABLE();
+    system_resumed = __HAL_PWR_GET_FLAG(PWR_FLAG_SB) != RESET;
+    __HAL_PWR_CLEAR_FLAG(PWR_FLAG_SB);
+#if STANDBY_WAKEUP_PIN == 1
+    HAL_PWR_DisableWakeUpPin(PWR_WAKEUP_PIN1);
+#endif
+    __HAL_RCC_PWR_CLK_DISABLE();
+
+    if (!system_resumed) {
+        rtc_init();
+        return;
+    }
+
+    rtc_init_resume();
+    rtc_read_standby_token(&token, &entered);
+    rtc_write_standby_token(0, 0);
+
+    if (token == STANDBY_TOKEN) {
+        standby_ticks = rtc_get_timer_value() - entered;
+    } else {
+        system_resumed = false;
+    }
+}
+
+
+static void paint_stack(void)
+{
+    uint32_t *p = &_end;
+    uint32_t *sp = (uint32_t *)__get_MSP() - STACK_PAINT_MARGIN;
+
+    while (p < sp) *p++ = STACK_PAINT;
+}
+
+
+void system_get_ram(system_ram_t *ram)
+{
+    const uint32_t *p = &_end;
+
+    while (p < &_estack && *p == STACK_PAINT) p++;
+
+    ram->data = (uintptr_t)&_edata - (uintptr_t)&_sdata;
+    ram->bss = (uintptr_t)&_ebss - (uintptr_t)&_sbss;
+    ram->stack = (uintptr_t)&_estack - (uintptr_t)&_end;
+    ram->stack_peak = (uintptr_t)&_estack - (uintptr_t)p;
+}
+
+
+#if DFU == 1
+// Checked first thing on boot while the MCU still runs from MSI in its reset
+// state, which is what the system bootloader expects. The bootloader is
+// entered with its vector table mapped at address 0 and never returns.
+static void start_bootloader(void)
+{
+    const uint32_t *vectors = (const uint32_t *)SYSTEM_MEMORY_BASE;
+
+    // rtc_init has not run yet, but the RTC registers keep their content
+    // across the system reset and can be read directly
+    if (RTC->BKP4R != BOOTLOADER_TOKEN) return;
+
+    // Clear the token so that the next reset starts the firmware again
+    __HAL_RCC_PWR_CLK_ENABLE();
+    HAL_PWR_EnableBkUpAccess();
+    RTC->BKP4R = 0;
+    HAL_PWR_DisableBkUpAccess();
+    __HAL_RCC_PWR_CLK_DISABLE();
+
+    __HAL_RCC_SYSCFG_CLK_ENABLE();
+    __HAL_SYSCFG_REMAPMEMORY_SYSTEMFLASH();
+
+    __set_MSP(vectors[0]);
+    ((void (*)(void))vectors[1])();
+}
+
+
+void system_request_bootloader(void)
+{
+    rtc_write_boot_token(BOOTLOADER_TOKEN);
+}
+#endif
+
+
 void system_init(void)
 {
+#if DFU == 1
+    start_bootloader();
+#endif
+    paint_stack();
+
+    system_reset_flags = RCC->CSR >> 24;
+    RCC->CSR |= RCC_CSR_RMVF;
+
     HAL_Init();
     init_flash();
     init_gpio();
@@ -343,7 +833,14 @@ void system_init(void)
     init_dbgmcu();
 #endif
     init_clock();
-    rtc_init();
+    init_rtc();
+    system_reset_pwrstat();
+}
+
+
+uint32_t system_standby_time(void)
+{
+    return standby_ticks >> 10;
 }
 
 
@@ -359,3 +856,12 @@ __weak void system_before_stop(void)
 __weak void system_after_stop(void)
 {
 }
+
+__weak bool system_can_standby(void)
+{
+    return false;
+}
+
+__weak void system_yield(void)
+{
+}
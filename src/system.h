@@ -2,14 +2,50 @@
 #define _SYSTEM_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
 extern volatile unsigned system_stop_lock;
 extern volatile unsigned system_sleep_lock;
+extern volatile unsigned system_tasks;
 
-//! @brief System init
+//! @brief Incremented on every exit from the Stop mode. Peripherals that are
+//! initialized on first use record the value at initialization time and
+//! initialize again when it changes.
+extern volatile uint32_t system_stop_generation;
+
+//! @brief Set by system_init if the MCU has resumed from the Standby mode
+//! entered by system_idle, rather than from a reset or power-up.
+extern bool system_resumed;
+
+//! @brief The reset flags of RCC_CSR (bits 24-31: LPWRRSTF, WWDGRSTF, IWDGRSTF,
+//! SFTRSTF, PORRSTF, PINRSTF, OBLRSTF, FWRSTF), set by system_init. The flags
+//! are cleared in RCC_CSR, so each boot sees only the cause of its own reset.
+extern uint8_t system_reset_flags;
+
+//! @brief RAM usage
+typedef struct
+{
+    uint32_t data;        // Size of initialized static data (.data) in bytes
+    uint32_t bss;         // Size of zero-initialized static data (.bss) in bytes
+    uint32_t stack;       // RAM left for the stack above the static data
+    uint32_t stack_peak;  // Deepest stack usage since boot
+} system_ram_t;
+
+//! @brief System init. Paints the unused stack area first so that the stack
+//! high-water mark can be determined with system_get_ram.
 
 void system_init(void);
 
+//! @brief Get the static RAM usage and the stack high-water mark
+//! @param[out] ram Destination
+
+void system_get_ram(system_ram_t *ram);
+
+//! @brief Return the time (in seconds) the MCU has spent in the Standby mode
+//! before system_init. Only meaningful if system_resumed is true.
+
+uint32_t system_standby_time(void);
+
 //! @brief Get a pseudo-random seed generated using the MCU Unique ID
 
 uint32_t system_get_random_seed(void);
@@ -23,6 +59,38 @@ void system_get_unique_id(uint8_t *id);
 
 void system_wait_hsi(void);
 
+//! @brief Switch the system clock back to PLL (32 MHz) if it still runs from
+//! HSI16 after a Stop exit. Can be invoked from the ISR context.
+
+void system_enable_pll(void);
+
+//! @brief Power/latency profiles selected with AT$PWRMODE
+typedef enum
+{
+    // Stop mode whenever possible, NVM writes and notifications as configured
+    // with AT$NVMPOLICY and AT$COALESCE
+    SYSTEM_POWER_BALANCED = 0,
+
+    // Like balanced, but NVM writes are deferred by at least
+    // SYSTEM_ULP_NVM_WINDOW seconds and notifications coalesced for at least
+    // SYSTEM_ULP_COALESCE milliseconds
+    SYSTEM_POWER_ULTRA_LOW,
+
+    // Sleep mode only, with the PLL kept running, so that wakeups skip the
+    // Stop mode exit. Notifications are written right away.
+    SYSTEM_POWER_LOW_LATENCY,
+
+    SYSTEM_POWER_PROFILES
+} system_power_profile_t;
+
+#define SYSTEM_ULP_NVM_WINDOW 60
+#define SYSTEM_ULP_COALESCE   500
+
+//! @brief Return the notification coalescing window (ms) in effect, i.e.,
+//! sysconf.uart_coalesce adjusted by the power profile
+
+unsigned int system_coalesce_window(void);
+
 //! @brief Sleep lock and Stop mode mask
 typedef enum
 {
@@ -36,6 +104,70 @@ typedef enum
     SYSTEM_MODULE_LORA      = (1 << 7)
 } system_module_t;
 
+#define SYSTEM_MODULE_COUNT 8
+
+//! @brief Main loop tasks posted with system_post
+typedef enum
+{
+    SYSTEM_TASK_ATCI = (1 << 0),
+    SYSTEM_TASK_LORA = (1 << 1),
+    SYSTEM_TASK_NVM  = (1 << 2)
+} system_task_t;
+
+#define SYSTEM_TASK_ALL (SYSTEM_TASK_ATCI | SYSTEM_TASK_LORA | SYSTEM_TASK_NVM)
+
+//! @brief Request that the main loop runs the handler of the given task(s).
+//! Can be invoked from the ISR context. The MCU does not enter a low-power mode
+//! while there are pending tasks.
+//! @param[in] tasks A bitmask of SYSTEM_TASK_* values
+
+void system_post(unsigned tasks);
+
+//! @brief Atomically fetch and clear the bitmask of pending tasks
+
+unsigned system_take_tasks(void);
+
+//! @brief Power residency statistics, all times in milliseconds
+typedef struct
+{
+    uint32_t total;
+    uint32_t run;
+    uint32_t sleep;
+    uint32_t stop;
+    uint32_t slow;            // Run and sleep time at 16 MHz, see system_idle
+    uint32_t clock_switches;  // Number of operating point switches
+    uint32_t lp_sleep;        // Part of sleep spent in Low-power sleep mode
+    uint32_t module_time[SYSTEM_MODULE_COUNT];
+    uint32_t module_count[SYSTEM_MODULE_COUNT];
+} system_pwrstat_t;
+
+//! @brief Set a module's bit in system_sleep_lock or system_stop_lock
+//! @param[in] lock Pointer to system_sleep_lock or system_stop_lock
+//! @param[in] module One of SYSTEM_MODULE_*
+
+void system_lock(volatile unsigned *lock, unsigned module);
+
+//! @brief Clear a module's bit in system_sleep_lock or system_stop_lock
+//! @param[in] lock Pointer to system_sleep_lock or system_stop_lock
+//! @param[in] module One of SYSTEM_MODULE_*
+
+void system_unlock(volatile unsigned *lock, unsigned module);
+
+//! @brief Reset the power residency statistics
+
+void system_reset_pwrstat(void);
+
+//! @brief Get the power residency statistics accumulated since the last reset
+//! @param[out] stat Pointer to the destination structure
+
+void system_get_pwrstat(system_pwrstat_t *stat);
+
+
+//! @brief Start the STM32 system bootloader instead of the firmware after the
+//! next system reset. The bootloader talks on the same UART pins as the AT
+//! command interface. Only available if the firmware was built with DFU=1.
+
+void system_request_bootloader(void);
 
 //! @brief Go to low power, sleep mode, or stop mode. The function must be
 //! invoked with interrupts disabled.
@@ -50,4 +182,18 @@ void system_before_stop(void);
 
 void system_after_stop(void);
 
+//! @brief Return true if nothing kept in SRAM would be lost in the Standby
+//! mode (weak, returns false). Invoked by system_idle with interrupts
+//! disabled if Standby has been enabled with AT$STANDBY.
+
+bool system_can_standby(void);
+
+//! @brief Invoked repeatedly by code that waits in the main context for a
+//! slow peripheral, such as lpuart_wait_for_space while the host drains the
+//! TX FIFO, so that time-critical work does not wait with it (weak, does
+//! nothing). The caller may have interrupts disabled or may itself be part of
+//! the work the override would run; the override has to check for both.
+
+void system_yield(void);
+
 #endif
@@ -0,0 +1,130 @@
+#include "tpl.h"
+#include <string.h>
+#include <LoRaWAN/Utilities/timeServer.h>
+#include "lrw.h"
+#include "adc.h"
+#include "rtc.h"
+
+static tpl_t slots[TPL_SLOTS];
+
+
+static size_t field_size(tpl_field_type_t type)
+{
+    switch (type) {
+        case TPL_FIELD_BATTERY:     return 1;
+        case TPL_FIELD_UPTIME:      return 4;
+        case TPL_FIELD_TEMPERATURE: return 2;
+        case TPL_FIELD_COUNTER:     return 2;
+        default:                    return 0;
+    }
+}
+
+
+static void put_le(uint8_t *dst, uint32_t v, size_t n)
+{
+    for (size_t i = 0; i < n; i++, v >>= 8) dst[i] = v & 0xff;
+}
+
+
+int tpl_define(unsigned int slot, uint8_t port, bool confirmed, const void *payload, size_t length)
+{
+    tpl_t *t;
+
+    if (slot >= TPL_SLOTS || length > TPL_MAX_SIZE) return -1;
+    t = &slots[slot];
+
+    memset(t, 0, sizeof(*t));
+    if (port == 0) return 0;
+
+    // LoRaMac cannot reliably send an empty payload on a non-zero port, see
+    // transmit in cmd.c
+    if (length == 0) return -1;
+
+    t->port = port;
+    t->confirmed = confirmed;
+    t->length = length;
+    memcpy(t->payload, payload, length);
+    return 0;
+}
+
+
+int tpl_set_field(unsigned int slot, uint8_t offset, tpl_field_type_t type)
+{
+    tpl_field_t *f, *unused = NULL;
+    const tpl_t *t = tpl_get(slot);
+
+    if (t == NULL || type >= TPL_FIELD_TYPES) return -1;
+    if (type != TPL_FIELD_NONE && offset + field_size(type) > t->length) return -1;
+
+    for (f = slots[slot].field; f < slots[slot].field + TPL_MAX_FIELDS; f++) {
+        if (f->type != TPL_FIELD_NONE && f->offset == offset) break;
+        if (unused == NULL && f->type == TPL_FIELD_NONE) unused = f;
+    }
+
+    if (f == slots[slot].field + TPL_MAX_FIELDS) {
+        if (type == TPL_FIELD_NONE) return 0;
+        if (unused == NULL) return -1;
+        f = unused;
+    }
+
+    f->offset = offset;
+    f->type = type;
+    return 0;
+}
+
+
+int tpl_patch(unsigned int slot, uint8_t offset, const void *data, size_t length)
+{
+    const tpl_t *t = tpl_get(slot);
+
+    if (t == NULL || offset + length > t->length) return -1;
+    memcpy(slots[slot].payload + offset, data, length);
+    return 0;
+}
+
+
+const tpl_t *tpl_get(unsigned int slot)
+{
+    if (slot >= TPL_SLOTS || slots[slot].port == 0) return NULL;
+    return &slots[slot];
+}
+
+
+size_t tpl_build(unsigned int slot, uint8_t *buffer)
+{
+    tpl_t *t;
+    const tpl_field_t *f;
+    uint8_t *dst;
+
+    if (tpl_get(slot) == NULL) return 0;
+    t = &slots[slot];
+
+    memcpy(buffer, t->payload, t->length);
+
+    for (f = t->field; f < t->field + TPL_MAX_FIELDS; f++) {
+        dst = buffer + f->offset;
+        switch (f->type) {
+            case TPL_FIELD_BATTERY:
+                *dst = lrw_battery_get(NULL, NULL, NULL);
+                break;
+
+            case TPL_FIELD_UPTIME:
+                put_le(dst, rtc_get_ticks64() >> 10, 4);
+                break;
+
+            case TPL_FIELD_TEMPERATURE:
+                put_le(dst, (uint16_t)(int16_t)(adc_get_temperature_celsius() * 10), 2);
+                break;
+
+            case TPL_FIELD_COUNTER:
+                put_le(dst, t->count, 2);
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    t->count++;
+    return t->length;
+}
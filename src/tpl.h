@@ -0,0 +1,85 @@
+#ifndef _TPL_H
+#define _TPL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+//! @brief The number of template slots
+#ifndef TPL_SLOTS
+#define TPL_SLOTS 4
+#endif
+
+//! @brief The largest template payload in bytes
+#ifndef TPL_MAX_SIZE
+#define TPL_MAX_SIZE 64
+#endif
+
+//! @brief The number of auto-filled fields per template
+#define TPL_MAX_FIELDS 4
+
+//! @brief Values the modem fills in when a template is sent. All multi-byte
+//! values are little-endian.
+typedef enum {
+    TPL_FIELD_NONE = 0,
+    TPL_FIELD_BATTERY,      // Battery level as in DevStatusAns, 1 byte
+    TPL_FIELD_UPTIME,       // Seconds since cold boot, 4 bytes
+    TPL_FIELD_TEMPERATURE,  // MCU temperature in 0.1 degrees Celsius, signed, 2 bytes
+    TPL_FIELD_COUNTER,      // Uplinks submitted from the template since it was defined, 2 bytes
+    TPL_FIELD_TYPES
+} tpl_field_type_t;
+
+typedef struct {
+    uint8_t offset;
+    uint8_t type;           // tpl_field_type_t
+} tpl_field_t;
+
+typedef struct {
+    uint8_t port;           // LoRaWAN port, 0 if the slot is empty
+    bool confirmed;
+    uint8_t length;
+    uint16_t count;         // See TPL_FIELD_COUNTER
+    tpl_field_t field[TPL_MAX_FIELDS];
+    uint8_t payload[TPL_MAX_SIZE];
+} tpl_t;
+
+/*! @brief Uplink payload templates
+ *
+ * Hosts that send status frames whose bytes mostly stay the same can define
+ * the frame once with AT$TPL and then only submit the bytes that changed with
+ * AT$TPLTX. Patches are kept in the template, so each uplink carries the most
+ * recent value of every byte. Fields configured with AT$TPLFIELD, such as the
+ * battery level or the uptime, are filled in by the modem when the uplink is
+ * built. The templates are kept in RAM and need to be defined again after a
+ * reset.
+ */
+
+//! @brief Define or, with port 0, delete a template
+//! @return 0 on success, -1 on invalid parameters
+
+int tpl_define(unsigned int slot, uint8_t port, bool confirmed, const void *payload, size_t length);
+
+//! @brief Set the auto-filled field at an offset of the template. The type
+//! TPL_FIELD_NONE removes the field.
+//! @return 0 on success, -1 if the slot is empty, the field does not fit into
+//! the payload, or all fields are taken
+
+int tpl_set_field(unsigned int slot, uint8_t offset, tpl_field_type_t type);
+
+//! @brief Overwrite bytes of the template's payload
+//! @return 0 on success, -1 if the slot is empty or the bytes do not fit
+
+int tpl_patch(unsigned int slot, uint8_t offset, const void *data, size_t length);
+
+//! @brief Return the template in a slot, NULL if the slot is empty or invalid
+
+const tpl_t *tpl_get(unsigned int slot);
+
+//! @brief Build the payload of an uplink from the template, with the
+//! auto-filled fields filled in, and count it for TPL_FIELD_COUNTER
+//! @param[out] buffer Destination with room for TPL_MAX_SIZE bytes
+//! @return The length of the payload, 0 if the slot is empty
+
+size_t tpl_build(unsigned int slot, uint8_t *buffer);
+
+#endif // _TPL_H
@@ -0,0 +1,98 @@
+#include "trace.h"
+#include <string.h>
+
+#if TRACE == 1
+
+// The RTC runs with a synchronous prescaler of 1023, see rtc.c
+#define TRACE_PREDIV_S 1023
+#define TRACE_N_PREDIV_S 10
+
+trace_entry_t trace_buffer[TRACE_BUFFER_SIZE];
+uint32_t trace_index;
+
+static const char *event_names[TRACE_EVENT_COUNT] = {
+    [TRACE_TX_DONE]         = "TXDONE",
+    [TRACE_RX_CONFIG]       = "RXCONF",
+    [TRACE_RX_START]        = "RXSTART",
+    [TRACE_DIO0]            = "DIO0",
+    [TRACE_DIO1]            = "DIO1",
+    [TRACE_RX_DONE]         = "RXDONE",
+    [TRACE_LRW_PROCESS]     = "PROCESS",
+    [TRACE_MCPS_INDICATION] = "MCPSIND",
+    [TRACE_BOOT]            = "BOOT",
+    [TRACE_READY]           = "READY",
+    [TRACE_EXTI]            = "EXTI",
+    [TRACE_BOOT_NVM]        = "BOOTNVM",
+    [TRACE_BOOT_ATCI]       = "BOOTATCI",
+    [TRACE_RTC_ALARM]       = "RTC"
+};
+
+
+unsigned trace_take(trace_entry_t *dst)
+{
+    uint32_t mask = disable_irq();
+    unsigned n = trace_index < TRACE_BUFFER_SIZE ? trace_index : TRACE_BUFFER_SIZE;
+    unsigned first = (trace_index - n) & (TRACE_BUFFER_SIZE - 1);
+
+    // Unroll the ring so that the oldest entry comes first
+    memcpy(dst, &trace_buffer[first], (TRACE_BUFFER_SIZE - first) * sizeof(*dst));
+    memcpy(dst + TRACE_BUFFER_SIZE - first, trace_buffer, first * sizeof(*dst));
+    trace_index = 0;
+    reenable_irq(mask);
+    return n;
+}
+
+
+static inline uint32_t bcd2bin(uint32_t v)
+{
+    return (v >> 4) * 10 + (v & 0x0f);
+}
+
+
+uint32_t trace_ticks(const trace_entry_t *entry)
+{
+    uint32_t tr = entry->tr, seconds;
+
+    seconds = bcd2bin((tr & (RTC_TR_HT | RTC_TR_HU)) >> RTC_TR_HU_Pos) * 3600;
+    seconds += bcd2bin((tr & (RTC_TR_MNT | RTC_TR_MNU)) >> RTC_TR_MNU_Pos) * 60;
+    seconds += bcd2bin((tr & (RTC_TR_ST | RTC_TR_SU)) >> RTC_TR_SU_Pos);
+
+    return (seconds << TRACE_N_PREDIV_S) + (TRACE_PREDIV_S - entry->ssr);
+}
+
+
+const char *trace_event_name(unsigned event)
+{
+    if (event >= TRACE_EVENT_COUNT) return "?";
+    return event_names[event];
+}
+
+
+#if TRACE_IRQ == 1
+
+uint32_t trace_irq_max[TRACE_IRQ_COUNT];
+
+
+void trace_irq_init(void)
+{
+    SysTick->LOAD = SysTick_LOAD_RELOAD_Msk;
+    SysTick->VAL = 0;
+    SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_ENABLE_Msk;
+}
+
+
+void trace_irq_take(uint32_t *dst)
+{
+    uint32_t mhz = SystemCoreClock / 1000000;
+
+    uint32_t mask = disable_irq();
+    for (unsigned i = 0; i < TRACE_IRQ_COUNT; i++) {
+        dst[i] = (trace_irq_max[i] + mhz - 1) / mhz;
+        trace_irq_max[i] = 0;
+    }
+    reenable_irq(mask);
+}
+
+#endif // TRACE_IRQ
+
+#endif // TRACE
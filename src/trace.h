@@ -0,0 +1,139 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdint.h>
+#include <stm/STM32L0xx_HAL_Driver/Inc/stm32l0xx_hal.h>
+#include "irq.h"
+
+//! @brief Number of entries kept in the trace buffer, must be a power of two
+#ifndef TRACE_BUFFER_SIZE
+#define TRACE_BUFFER_SIZE 32
+#endif
+
+#if (TRACE_BUFFER_SIZE & (TRACE_BUFFER_SIZE - 1)) != 0
+#  error TRACE_BUFFER_SIZE must be a power of two
+#endif
+
+//! @brief Trace points on the LoRaWAN hot path
+typedef enum
+{
+    TRACE_TX_DONE = 0,      // Radio TxDone callback
+    TRACE_RX_CONFIG,        // Radio RX configuration at the start of an RX window
+    TRACE_RX_START,         // Radio switched to RX mode (RX window opened)
+    TRACE_DIO0,             // SX1276 DIO0 IRQ (TxDone, RxDone)
+    TRACE_DIO1,             // SX1276 DIO1 IRQ (RxTimeout)
+    TRACE_RX_DONE,          // Radio RxDone callback
+    TRACE_LRW_PROCESS,      // lrw_process invoked from the main loop
+    TRACE_MCPS_INDICATION,  // Downlink delivered by the MAC
+    TRACE_BOOT,             // RTC initialized after reset
+    TRACE_READY,            // LoRaMac started
+    TRACE_EXTI,             // EXTI interrupt entry, before the DIO handlers
+    TRACE_BOOT_NVM,         // Configuration loaded from NVM during boot
+    TRACE_BOOT_ATCI,        // ATCI up and the boot event sent
+    TRACE_RTC_ALARM,        // RTC alarm IRQ entry, recorded with TRACE_IRQ only
+    TRACE_EVENT_COUNT
+} trace_event_t;
+
+//! @brief A raw trace entry. The RTC registers are stored as they were read
+//! and are only converted to ticks when the trace is retrieved.
+typedef struct
+{
+    uint32_t tr;
+    uint16_t ssr;
+    uint8_t event;
+} trace_entry_t;
+
+#if TRACE == 1
+
+extern trace_entry_t trace_buffer[TRACE_BUFFER_SIZE];
+extern uint32_t trace_index;
+
+//! @brief Record a trace point. Can be invoked from the ISR context.
+//! @param[in] event Trace point identifier
+
+__STATIC_FORCEINLINE void trace(trace_event_t event)
+{
+    uint32_t mask = disable_irq();
+    trace_entry_t *e = &trace_buffer[trace_index++ & (TRACE_BUFFER_SIZE - 1)];
+    // Reading SSR locks the shadow TR and DR registers until DR is read
+    e->ssr = RTC->SSR;
+    e->tr = RTC->TR;
+    (void)RTC->DR;
+    e->event = event;
+    reenable_irq(mask);
+}
+
+//! @brief Copy the trace entries, oldest first, and clear the trace buffer
+//! @param[out] dst Destination buffer with room for TRACE_BUFFER_SIZE entries
+//! @retval Number of entries written to dst
+
+unsigned trace_take(trace_entry_t *dst);
+
+//! @brief Convert the time of a trace entry to RTC ticks (1/1024 s) since
+//! midnight of the RTC calendar
+
+uint32_t trace_ticks(const trace_entry_t *entry);
+
+//! @brief Return the name of a trace point
+
+const char *trace_event_name(unsigned event);
+
+#else
+
+#define trace(event) ((void)0)
+
+#endif // TRACE
+
+#if TRACE_IRQ == 1 && TRACE == 0
+#  error TRACE_IRQ requires TRACE=1
+#endif
+
+//! @brief Interrupt handlers whose run time is measured with TRACE_IRQ
+typedef enum
+{
+    TRACE_IRQ_RTC = 0,  // RTC alarm (timer server)
+    TRACE_IRQ_EXTI,     // EXTI, SX1276 DIO lines
+    TRACE_IRQ_LPUART,   // LPUART1 (ATCI)
+    TRACE_IRQ_DMA,      // LPUART1 DMA channels
+    TRACE_IRQ_LOG,      // Debug USART
+    TRACE_IRQ_COUNT
+} trace_irq_t;
+
+#if TRACE_IRQ == 1
+
+// The Cortex-M0+ has no DWT cycle counter. SysTick is not used by the firmware
+// (see HAL_InitTick), so it runs as a free-running 24-bit down counter clocked
+// from HCLK, as in bench.c. The longest run time of each handler, including
+// the handlers that preempted it, is kept in trace_irq_max in HCLK cycles.
+extern uint32_t trace_irq_max[TRACE_IRQ_COUNT];
+
+__STATIC_FORCEINLINE uint32_t trace_irq_enter(void)
+{
+    return SysTick->VAL;
+}
+
+__STATIC_FORCEINLINE void trace_irq_exit(trace_irq_t irq, uint32_t start)
+{
+    uint32_t d = (start - SysTick->VAL) & SysTick_LOAD_RELOAD_Msk;
+    if (d > trace_irq_max[irq]) trace_irq_max[irq] = d;
+}
+
+//! @brief Start the SysTick counter used to measure the handler run times
+
+void trace_irq_init(void);
+
+//! @brief Copy the longest run time of each handler in microseconds and clear
+//! the measurements
+//! @param[out] dst Destination buffer with room for TRACE_IRQ_COUNT entries
+
+void trace_irq_take(uint32_t *dst);
+
+#else
+
+#define trace_irq_init() ((void)0)
+#define trace_irq_enter() 0
+#define trace_irq_exit(irq, start) ((void)(start))
+
+#endif // TRACE_IRQ
+
+#endif // _TRACE_H
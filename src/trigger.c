@@ -0,0 +1,153 @@
+#include "trigger.h"
+
+#if TRIGGER_PIN == 1
+
+#include <LoRaWAN/Utilities/timeServer.h>
+#include "gpio.h"
+#include "irq.h"
+#include "lrw.h"
+#include "rtc.h"
+#include "system.h"
+#include "tpl.h"
+#include "log.h"
+
+static Gpio_t pin = {
+    .port     = GPIOB,
+    .pinIndex = GPIO_PIN_2
+};
+
+static trigger_config_t config = {
+    .edge = TRIGGER_OFF,
+    .slot = 0,
+    .debounce = 50,
+    .interval = 10
+};
+
+static trigger_stats_t stats;
+static TimerEvent_t debounce_timer;
+static volatile bool pending;
+
+// RTC time of the last triggered uplink (ms), valid once sent is nonzero
+static uint32_t last;
+
+
+// The level the pin settles at after a triggering edge
+static bool active_level(void)
+{
+    return config.edge == TRIGGER_RISING;
+}
+
+
+static void on_debounce_timer(void *ctx)
+{
+    (void)ctx;
+    if (gpio_read(pin.port, pin.pinIndex) != active_level()) return;
+
+    pending = true;
+    system_post(SYSTEM_TASK_LORA);
+}
+
+
+static void trigger_isr(void *ctx)
+{
+    (void)ctx;
+
+    // Bounces restart the debounce period
+    TimerStop(&debounce_timer);
+    TimerSetValue(&debounce_timer, config.debounce ? config.debounce : 1);
+    TimerStart(&debounce_timer);
+}
+
+
+static void configure_pin(void)
+{
+    GPIO_InitTypeDef gpio = {
+        .Speed = GPIO_SPEED_LOW
+    };
+
+    TimerStop(&debounce_timer);
+    pending = false;
+
+    if (config.edge == TRIGGER_OFF) {
+        // Analog mode without the pull resistor draws the least current
+        HAL_GPIO_DeInit(pin.port, pin.pinIndex);
+        return;
+    }
+
+    __GPIOB_CLK_ENABLE();
+    if (config.edge == TRIGGER_FALLING) {
+        gpio.Mode = GPIO_MODE_IT_FALLING;
+        gpio.Pull = GPIO_PULLUP;
+    } else {
+        gpio.Mode = GPIO_MODE_IT_RISING;
+        gpio.Pull = GPIO_PULLDOWN;
+    }
+    gpio_init(pin.port, pin.pinIndex, &gpio);
+    gpio_set_irq(pin.port, pin.pinIndex, IRQ_PRIORITY_EXTI, trigger_isr);
+}
+
+
+void trigger_init(void)
+{
+    TimerInit(&debounce_timer, on_debounce_timer);
+    configure_pin();
+}
+
+
+void trigger_get_config(trigger_config_t *dst)
+{
+    *dst = config;
+}
+
+
+int trigger_set_config(const trigger_config_t *src)
+{
+    if (src->edge >= TRIGGER_EDGES || src->slot >= TPL_SLOTS) return -1;
+
+    config = *src;
+    configure_pin();
+    return 0;
+}
+
+
+void trigger_get_stats(trigger_stats_t *dst)
+{
+    *dst = stats;
+}
+
+
+void trigger_poll(void)
+{
+    uint8_t buf[TPL_MAX_SIZE];
+    const tpl_t *t;
+    uint32_t now;
+    size_t len;
+
+    if (!pending) return;
+    pending = false;
+
+    now = rtc_tick2ms(rtc_get_timer_value());
+    if (stats.sent && now - last < config.interval * 1000UL) {
+        stats.suppressed++;
+        log_debug("trigger: Suppressed, last uplink %lu ms ago", now - last);
+        return;
+    }
+
+    if ((t = tpl_get(config.slot)) == NULL) {
+        stats.failed++;
+        log_warning("trigger: Template %d is empty", config.slot);
+        return;
+    }
+
+    len = tpl_build(config.slot, buf);
+    if (lrw_enqueue(t->port, buf, len, t->confirmed, NULL) < 0) {
+        stats.failed++;
+        log_warning("trigger: Transmit queue full, dropping uplink");
+        return;
+    }
+
+    stats.sent++;
+    last = now;
+}
+
+#endif // TRIGGER_PIN
@@ -0,0 +1,60 @@
+#ifndef _TRIGGER_H
+#define _TRIGGER_H
+
+#include <stdint.h>
+
+/*! @brief Instant uplinks triggered by a GPIO edge
+ *
+ * An edge on the trigger pin (PB2) sends the payload template selected with
+ * AT$TRIGGER (see tpl.h) through the transmit queue, with the port and the
+ * confirmation setting of the template. The pin raises an EXTI interrupt,
+ * which also wakes the modem from the Stop mode, so a button or a sensor
+ * alarm output produces an uplink without the host being involved or even
+ * powered.
+ *
+ * The level on the pin has to persist for the debounce time after the edge,
+ * otherwise the edge is ignored. Edges that arrive sooner than the minimum
+ * interval after the last triggered uplink are counted but do not send
+ * anything. Like the templates, the configuration is kept in RAM.
+ */
+
+typedef enum {
+    TRIGGER_OFF = 0,
+    TRIGGER_FALLING,    // The pin is pulled up, the uplink is sent when it is pulled down
+    TRIGGER_RISING,     // The pin is pulled down, the uplink is sent when it is pulled up
+    TRIGGER_EDGES
+} trigger_edge_t;
+
+typedef struct {
+    uint8_t edge;       // trigger_edge_t
+    uint8_t slot;       // Payload template slot
+    uint16_t debounce;  // ms
+    uint16_t interval;  // Minimum interval between triggered uplinks (s)
+} trigger_config_t;
+
+typedef struct {
+    uint32_t sent;        // Uplinks submitted to the transmit queue
+    uint32_t suppressed;  // Edges ignored because of the minimum interval
+    uint32_t failed;      // Empty template or full transmit queue
+} trigger_stats_t;
+
+#if TRIGGER_PIN == 1
+
+void trigger_init(void);
+
+void trigger_get_config(trigger_config_t *dst);
+
+//! @brief Configure the pin and the template to send
+//! @return 0 on success, -1 on invalid parameters
+
+int trigger_set_config(const trigger_config_t *src);
+
+void trigger_get_stats(trigger_stats_t *dst);
+
+//! @brief Send the uplink of a debounced edge. Invoke from the main loop.
+
+void trigger_poll(void);
+
+#endif // TRIGGER_PIN
+
+#endif // _TRIGGER_H
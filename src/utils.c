@@ -2,6 +2,99 @@
 #include <stdint.h>
 #include <string.h>
 #include <LoRaWAN/Utilities/utilities.h>
+#if CRC_HW == 1
+#include <stm/STM32L0xx_HAL_Driver/Inc/stm32l0xx_hal.h>
+#endif
+
+
+#if CRC_HW == 1
+
+// Blocks of at least this many words are fed to the CRC unit by DMA channel 1
+// (memory-to-memory mode), shorter blocks and the unaligned head and tail of a
+// block are written by the CPU.
+#define CRC_DMA_MIN_WORDS 32
+
+#define REV_IN_BYTE (CRC_CR_REV_IN_0)
+#define REV_IN_WORD (CRC_CR_REV_IN_0 | CRC_CR_REV_IN_1)
+
+
+static void crc_dma(const uint32_t *ptr, size_t words)
+{
+    uint32_t enabled = RCC->AHBENR & RCC_AHBENR_DMAEN;
+
+    RCC->AHBENR |= RCC_AHBENR_DMAEN;
+
+    DMA1_Channel1->CCR = 0;
+    DMA1_Channel1->CPAR = (uint32_t)&CRC->DR;
+    DMA1_Channel1->CMAR = (uint32_t)ptr;
+    DMA1_Channel1->CNDTR = words;
+    DMA1->IFCR = DMA_IFCR_CGIF1;
+    DMA1_Channel1->CCR = DMA_CCR_MEM2MEM | DMA_CCR_DIR | DMA_CCR_MINC |
+        DMA_CCR_MSIZE_1 | DMA_CCR_PSIZE_1 | DMA_CCR_EN;
+
+    while (!(DMA1->ISR & (DMA_ISR_TCIF1 | DMA_ISR_TEIF1)));
+
+    DMA1_Channel1->CCR = 0;
+    DMA1->IFCR = DMA_IFCR_CGIF1;
+    if (!enabled) RCC->AHBENR &= ~RCC_AHBENR_DMAEN;
+}
+
+
+// Compute the CRC32 used by LoRaMac-node (Crc32 in utilities.c) with the CRC
+// unit. The unit implements the same polynomial MSB-first. Reversing the bits
+// of each input byte and of the result turns it into the reflected variant.
+// Little-endian words need to be bit-reversed as a whole to be processed
+// first byte first.
+static uint32_t block_crc(const void *ptr, size_t len)
+{
+    const uint8_t *p = ptr;
+    size_t words;
+
+    RCC->AHBENR |= RCC_AHBENR_CRCEN;
+    CRC->INIT = 0xffffffff;
+    CRC->POL = 0x04c11db7;
+    CRC->CR = REV_IN_BYTE | CRC_CR_REV_OUT | CRC_CR_RESET;
+
+    for (; len && ((uintptr_t)p & 3); len--)
+        *(__IO uint8_t *)&CRC->DR = *p++;
+
+    words = len / 4;
+    CRC->CR = REV_IN_WORD | CRC_CR_REV_OUT;
+    if (words >= CRC_DMA_MIN_WORDS) {
+        crc_dma((const uint32_t *)p, words);
+    } else {
+        for (size_t i = 0; i < words; i++)
+            CRC->DR = ((const uint32_t *)p)[i];
+    }
+    p += words * 4;
+    len -= words * 4;
+
+    CRC->CR = REV_IN_BYTE | CRC_CR_REV_OUT;
+    for (; len; len--)
+        *(__IO uint8_t *)&CRC->DR = *p++;
+
+    uint32_t crc = ~CRC->DR;
+    RCC->AHBENR &= ~RCC_AHBENR_CRCEN;
+    return crc;
+}
+
+#else
+
+static uint32_t block_crc(const void *ptr, size_t len)
+{
+    uint32_t s = Crc32Init();
+    size_t n;
+
+    for (size_t i = 0; i < len; i += n) {
+        // Crc32Update only accepts blocks up to UINT16_MAX
+        n = (len - i) > UINT16_MAX ? UINT16_MAX : len - i;
+        s = Crc32Update(s, (uint8_t *)ptr + i, n);
+    }
+
+    return Crc32Finalize(s);
+}
+
+#endif // CRC_HW
 
 
 bool check_block_crc(const void *ptr, size_t size)
@@ -16,15 +109,7 @@ bool check_block_crc(const void *ptr, size_t size)
     // isn't properly aligned.
     memcpy(&crc, (uint8_t *)ptr + len, sizeof(crc));
 
-    uint32_t s = Crc32Init();
-
-    for (unsigned int i = 0; i < len;) {
-        // Crc32Update only accepts blocks up to UINT16_MAX
-        s = Crc32Update(s, (uint8_t *)ptr + i, (len - i) > UINT16_MAX ? UINT16_MAX : len);
-        i += (len - i) > UINT16_MAX ? UINT16_MAX : len;
-    }
-
-    return Crc32Finalize(s) == crc;
+    return block_crc(ptr, len) == crc;
 }
 
 
@@ -38,15 +123,7 @@ bool update_block_crc(const void *ptr, size_t size)
 
     memcpy(&old, (uint8_t *)ptr + len, sizeof(old));
 
-    uint32_t s = Crc32Init();
-
-    for (unsigned int i = 0; i < len;) {
-        // Crc32Update only accepts blocks up to UINT16_MAX
-        s = Crc32Update(s, (uint8_t *)ptr + i, (len - i) > UINT16_MAX ? UINT16_MAX : len);
-        i += (len - i) > UINT16_MAX ? UINT16_MAX : len;
-    }
-
-    new = Crc32Finalize(s);
+    new = block_crc(ptr, len);
 
     if (old != new) {
         memcpy((uint8_t *)ptr + len, &new, sizeof(new));
@@ -0,0 +1,164 @@
+#!/usr/bin/env python3
+#
+# Attribute the energy measured by a power analyzer to the phases recorded by
+# a modem built with ENERGY_PROFILE=1 and to the individual uplinks.
+#
+# The profile is the output of one or more AT$ENERGY? commands saved to a
+# text file (every line that starts with +OK= is parsed). The analyzer trace
+# is a CSV file with the time in seconds, the current in amperes, and
+# optionally the logic level of the marker GPIO (PB14). The modem toggles the
+# marker on every recorded phase transition, so with a marker column, the n-th
+# marker edge is matched to the n-th transition and the RTC time base is
+# fitted to the analyzer's. Without a marker column, --offset gives the
+# analyzer time of RTC tick zero.
+#
+# Overlapping phases are resolved by priority (TX, RX1, RX2, EEPROM, UARTTX,
+# TCXO, STOP); time when no phase is active is reported as RUN. Uplinks start
+# at each TX phase and last until the next one.
+#
+# Usage:
+#
+#   tools/energy-profile.py profile.txt trace.csv [--voltage 3.3]
+#       [--time-col 0] [--current-col 1] [--marker-col 2] [--offset 0]
+#
+import sys
+import csv
+import argparse
+
+TICKS_PER_SECOND = 1024
+PHASES = ['TX', 'RX1', 'RX2', 'EEPROM', 'UARTTX', 'TCXO', 'STOP']
+IDLE = 'RUN'
+
+
+def load_profile(filename):
+    '''Return a list of (phase, active, ticks) transitions, oldest first'''
+    transitions = []
+    lost = 0
+    with open(filename) as f:
+        for line in f:
+            line = line.strip()
+            if not line.startswith('+OK='):
+                continue
+            fields = line[4:].split(';')
+            lost += int(fields[0].split(',')[1])
+            for entry in fields[1:]:
+                phase, active, ticks = entry.split(',')
+                transitions.append((phase, active == '1', int(ticks)))
+    if lost:
+        print(f'Warning: {lost} transitions were lost to overflow, marker alignment will be wrong', file=sys.stderr)
+    return transitions
+
+
+def load_trace(filename, time_col, current_col, marker_col):
+    '''Return lists of sample times, currents, and marker levels'''
+    times, currents, markers = [], [], []
+    with open(filename) as f:
+        for row in csv.reader(f):
+            try:
+                t = float(row[time_col])
+                i = float(row[current_col])
+                m = float(row[marker_col]) > 0.5 if marker_col is not None else None
+            except (ValueError, IndexError):
+                # Skip the header and malformed rows
+                continue
+            times.append(t)
+            currents.append(i)
+            markers.append(m)
+    return times, currents, markers
+
+
+def marker_edges(times, markers):
+    return [times[i] for i in range(1, len(markers)) if markers[i] != markers[i - 1]]
+
+
+def fit(ticks, edges):
+    '''Least-squares fit of analyzer time = a * ticks + b'''
+    n = len(ticks)
+    if n == 1:
+        return 1 / TICKS_PER_SECOND, edges[0] - ticks[0] / TICKS_PER_SECOND
+    mx = sum(ticks) / n
+    my = sum(edges) / n
+    sxx = sum((x - mx) ** 2 for x in ticks)
+    sxy = sum((x - mx) * (y - my) for x, y in zip(ticks, edges))
+    a = sxy / sxx if sxx else 1 / TICKS_PER_SECOND
+    return a, my - a * mx
+
+
+def attribute(times, currents, voltage, events):
+    '''Integrate the power over the samples, return per-phase energy (J) and
+    time (s) and a list of uplinks, each a dict of per-phase energy'''
+    energy = {p: 0.0 for p in PHASES + [IDLE]}
+    duration = {p: 0.0 for p in PHASES + [IDLE]}
+    uplinks = []
+    active = set()
+    k = 0
+
+    for i in range(len(times) - 1):
+        t, dt = times[i], times[i + 1] - times[i]
+        while k < len(events) and events[k][0] <= t:
+            _, phase, on = events[k]
+            if on:
+                active.add(phase)
+                if phase == 'TX':
+                    uplinks.append({p: 0.0 for p in PHASES + [IDLE]})
+            else:
+                active.discard(phase)
+            k += 1
+
+        phase = next((p for p in PHASES if p in active), IDLE)
+        e = voltage * currents[i] * dt
+        energy[phase] += e
+        duration[phase] += dt
+        if uplinks:
+            uplinks[-1][phase] += e
+
+    return energy, duration, uplinks
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Attribute measured energy to modem phases and uplinks')
+    parser.add_argument('profile', help='File with the output of AT$ENERGY?')
+    parser.add_argument('trace', help='Power analyzer trace in CSV format')
+    parser.add_argument('--voltage', type=float, default=3.3, help='Supply voltage in volts')
+    parser.add_argument('--time-col', type=int, default=0, help='Column with the time in seconds')
+    parser.add_argument('--current-col', type=int, default=1, help='Column with the current in amperes')
+    parser.add_argument('--marker-col', type=int, default=None, help='Column with the marker GPIO level')
+    parser.add_argument('--offset', type=float, default=0.0, help='Analyzer time of RTC tick 0 without a marker column')
+    args = parser.parse_args()
+
+    transitions = load_profile(args.profile)
+    times, currents, markers = load_trace(args.trace, args.time_col, args.current_col, args.marker_col)
+    if not transitions or len(times) < 2:
+        sys.exit('Error: empty profile or trace')
+
+    ticks = [v[2] for v in transitions]
+    if args.marker_col is not None:
+        edges = marker_edges(times, markers)
+        n = min(len(edges), len(ticks))
+        if n == 0:
+            sys.exit('Error: no marker edges found in the trace')
+        if len(edges) != len(ticks):
+            print(f'Warning: {len(edges)} marker edges but {len(ticks)} transitions, using the first {n}', file=sys.stderr)
+        a, b = fit(ticks[:n], edges[:n])
+    else:
+        a, b = 1 / TICKS_PER_SECOND, args.offset
+
+    events = [(a * t + b, phase, on) for phase, on, t in transitions]
+    energy, duration, uplinks = attribute(times, currents, args.voltage, events)
+
+    print(f'{"phase":>8} {"time (ms)":>12} {"energy (uJ)":>13}')
+    for p in PHASES + [IDLE]:
+        print(f'{p:>8} {duration[p] * 1e3:>12.3f} {energy[p] * 1e6:>13.1f}')
+    print(f'{"total":>8} {sum(duration.values()) * 1e3:>12.3f} {sum(energy.values()) * 1e6:>13.1f}')
+
+    if uplinks:
+        print()
+        print(f'{"uplink":>6} {"total (uJ)":>11} {"TX":>9} {"RX1":>9} {"RX2":>9} {"other":>9}')
+        for i, u in enumerate(uplinks, 1):
+            total = sum(u.values())
+            other = total - u['TX'] - u['RX1'] - u['RX2']
+            print(f'{i:>6} {total * 1e6:>11.1f} {u["TX"] * 1e6:>9.1f} {u["RX1"] * 1e6:>9.1f} {u["RX2"] * 1e6:>9.1f} {other * 1e6:>9.1f}')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,152 @@
+#!/usr/bin/env python3
+#
+# Decode binary debug log messages produced by firmware built with LOG_BINARY=1.
+#
+# The firmware does not format log messages. Instead, it sends records with the
+# offset of the format string in the ELF section .log_fmt, a timestamp, and the
+# raw 32-bit arguments. The section is extracted into a .logfmt file by the
+# build. This script reads records from a serial port or a file and formats them
+# on the host.
+#
+# Usage:
+#
+#   tools/log-decode.py [--bin firmware.bin] [--baudrate 115200] firmware.logfmt <port|file|->
+#
+import argparse
+import re
+import struct
+import sys
+
+RECORD_MESSAGE = 0xa5
+RECORD_DATA = 0xa6
+
+FLASH_BASE = 0x08000000
+RTC_TICKS_PER_SECOND = 1024
+
+LEVELS = {0: 'X', 1: 'D', 2: 'I', 3: 'W', 4: 'E'}
+
+CONVERSION = re.compile(r'%([-+ #0]*)(\d*)(?:\.(\d+))?(hh|h|ll|l|z|t)?([diouxXcsp%])')
+
+
+class Flash:
+    def __init__(self, filename=None):
+        self.data = b''
+        if filename is not None:
+            with open(filename, 'rb') as f:
+                self.data = f.read()
+
+    def string(self, addr):
+        offset = addr - FLASH_BASE
+        if offset < 0 or offset >= len(self.data):
+            return f'<0x{addr:08x}>'
+        end = self.data.find(b'\0', offset)
+        if end < 0:
+            end = len(self.data)
+        return self.data[offset:end].decode('utf-8', errors='replace')
+
+
+def format_message(fmt, args, flash):
+    args = list(args)
+
+    def convert(m):
+        flags, width, precision, _, conv = m.groups()
+        if conv == '%':
+            return '%'
+        v = args.pop(0) if args else 0
+        if conv in 'di':
+            v = struct.unpack('<i', struct.pack('<I', v))[0]
+        elif conv == 's':
+            v = flash.string(v)
+            conv = 's'
+        elif conv == 'p':
+            flags, conv = '#', 'x'
+        elif conv == 'c':
+            v = v & 0xff
+        elif conv == 'u':
+            conv = 'd'
+        spec = '%' + flags + width + ('.' + precision if precision else '') + conv
+        return spec % v
+
+    return CONVERSION.sub(convert, fmt)
+
+
+def load_formats(filename):
+    with open(filename, 'rb') as f:
+        return f.read()
+
+
+def get_format(formats, offset):
+    end = formats.find(b'\0', offset)
+    if offset >= len(formats) or end < 0:
+        return f'<unknown format string 0x{offset:04x}>'
+    return formats[offset:end].decode('utf-8', errors='replace')
+
+
+def read_exactly(stream, n):
+    data = b''
+    while len(data) < n:
+        chunk = stream.read(n - len(data))
+        if not chunk:
+            raise EOFError()
+        data += chunk
+    return data
+
+
+def decode(stream, formats, flash, out):
+    line = False
+    while True:
+        magic = read_exactly(stream, 1)[0]
+        if magic == RECORD_MESSAGE:
+            header, offset, ticks = struct.unpack('<BHI', read_exactly(stream, 7))
+            nargs = header & 0x0f
+            args = struct.unpack(f'<{nargs}I', read_exactly(stream, 4 * nargs))
+            text = format_message(get_format(formats, offset), args, flash)
+
+            if header & 0x80:
+                out.write(text)
+            else:
+                if line:
+                    out.write('\n')
+                level = LEVELS.get((header >> 4) & 0x07, '?')
+                out.write(f'{ticks / RTC_TICKS_PER_SECOND:.3f} {level}: {text}')
+            line = True
+        elif magic == RECORD_DATA:
+            length = read_exactly(stream, 1)[0]
+            out.write(' ' + read_exactly(stream, length).hex())
+        else:
+            # Skip bytes that do not belong to any record, e.g., output produced
+            # before the log was initialized.
+            continue
+        out.flush()
+
+
+def open_input(name, baudrate):
+    if name == '-':
+        return sys.stdin.buffer
+    if name.startswith('/dev/') or name.upper().startswith('COM'):
+        import serial
+        return serial.Serial(name, baudrate)
+    return open(name, 'rb')
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Decode binary debug log messages')
+    parser.add_argument('--bin', help='Firmware binary used to resolve %%s arguments')
+    parser.add_argument('--baudrate', type=int, default=115200, help='Serial port baud rate')
+    parser.add_argument('logfmt', help='The .logfmt file created by the build')
+    parser.add_argument('input', help='Serial port, file, or - for standard input')
+    args = parser.parse_args()
+
+    formats = load_formats(args.logfmt)
+    flash = Flash(args.bin)
+    stream = open_input(args.input, args.baudrate)
+
+    try:
+        decode(stream, formats, flash, sys.stdout)
+    except (EOFError, KeyboardInterrupt):
+        pass
+    print()
+
+
+if __name__ == '__main__':
+    main()
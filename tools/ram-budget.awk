@@ -0,0 +1,51 @@
+#!/usr/bin/awk -f
+#
+# Print the static RAM (.data, .bss and COMMON) used by each object file, as
+# recorded in the GNU ld map file given on the command line. Objects extracted
+# from archives are accounted to the archive. Usage:
+#
+#   awk -f tools/ram-budget.awk build/release/lora-modem-abz.map
+#
+
+function hex(s,    i, c, v) {
+    v = 0
+    s = tolower(s)
+    sub(/^0x/, "", s)
+    for (i = 1; i <= length(s); i++) {
+        c = index("0123456789abcdef", substr(s, i, 1))
+        if (c == 0) break
+        v = v * 16 + c - 1
+    }
+    return v
+}
+
+function add(size, file) {
+    sub(/\(.*\)$/, "", file)
+    sub(/.*\//, "", file)
+    ram[file] += hex(size)
+    total += hex(size)
+}
+
+# Skip the list of discarded input sections at the beginning of the map file
+/^Linker script and memory map/ { inmap = 1; next }
+!inmap { next }
+
+# Input sections with long names are followed by the address, size and file
+# name on the next line.
+pending {
+    pending = 0
+    if (NF >= 3 && $1 ~ /^0x/) add($2, $3)
+    next
+}
+
+/^ (\.data|\.bss|COMMON)/ {
+    if (NF == 1) pending = 1
+    else if (NF >= 4) add($3, $4)
+}
+
+END {
+    for (file in ram)
+        if (ram[file] > 0) printf "%8d %s\n", ram[file], file | "sort -rn"
+    close("sort -rn")
+    printf "%8d total\n", total
+}
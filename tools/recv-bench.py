@@ -0,0 +1,89 @@
+#!/usr/bin/env python3
+#
+# Measure the throughput of the Python library's ATCI stream parser in +RECV
+# messages per second. The script generates a simulated serial stream with
+# downlinks interleaved with +EVENT lines, in both binary and hexadecimal data
+# formats and with or without extended metadata (AT$RECVEXT), and feeds it to
+# the parser in chunks of random size, as a serial port would deliver it.
+#
+# Usage:
+#
+#   tools/recv-bench.py [--messages 100000] [--size 51] [--chunk 64]
+#
+import os
+import sys
+import time
+import random
+import argparse
+import binascii
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'python'))
+from lora import ATCIStream, recv_handler # noqa: E402
+
+
+def generate(messages, size, hex_payload, ext):
+    out = bytearray()
+    payloads = []
+    for i in range(messages):
+        payload = bytes(random.getrandbits(8) for _ in range(size))
+        payloads.append(payload)
+        if ext:
+            out += b'+RECV=%d,%d,-87,9,5,868100000,%d,0,%d,-1\r\n\r\n' % (1 + i % 223, size, i, i * 1000)
+        else:
+            out += b'+RECV=%d,%d\r\n\r\n' % (1 + i % 223, size)
+        out += binascii.hexlify(payload).upper() if hex_payload else payload
+        out += b'\r\n'
+        if i % 10 == 0:
+            out += b'+EVENT=2,2\r\n'
+    return bytes(out), payloads
+
+
+def run(args, hex_payload, ext):
+    data, payloads = generate(args.messages, args.size, hex_payload, ext)
+    received = []
+    stream: ATCIStream
+
+    def emit(event, *params):
+        if event == 'message':
+            received.append(params[1])
+
+    def on_line(line):
+        if line.startswith(b'+RECV'):
+            stream.expect_payload(*recv_handler(emit, line, hex_payload))
+
+    stream = ATCIStream(on_line)
+
+    chunks = []
+    i = 0
+    while i < len(data):
+        n = random.randint(1, args.chunk)
+        chunks.append(data[i:i + n])
+        i += n
+
+    start = time.perf_counter()
+    for chunk in chunks:
+        stream.feed(chunk)
+    elapsed = time.perf_counter() - start
+
+    if received != payloads:
+        raise Exception('Parser output does not match the simulated stream')
+
+    mode = ('hex' if hex_payload else 'binary') + (', extended' if ext else '')
+    print(f'{mode:>18}: {args.messages / elapsed:10.0f} messages/s, {len(data) / elapsed / 1e6:6.2f} MB/s')
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Benchmark +RECV parsing in the Python library')
+    parser.add_argument('--messages', type=int, default=100000, help='Number of simulated downlinks')
+    parser.add_argument('--size', type=int, default=51, help='Payload size in bytes')
+    parser.add_argument('--chunk', type=int, default=64, help='Maximum size of a serial read in bytes')
+    args = parser.parse_args()
+
+    random.seed(1)
+    for hex_payload in (False, True):
+        for ext in (False, True):
+            run(args, hex_payload, ext)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,139 @@
+#!/usr/bin/env python3
+#
+# Compare the code and data size of two firmware ELF files, typically a
+# regular release build and a release build with link-time optimization (see
+# "make size-diff"). The script prints the difference per section group
+# (flash and RAM), per object file, and per symbol.
+#
+# Link-time optimization generates the code in temporary objects, so the
+# symbols of the second file cannot be attributed to object files directly.
+# Instead, both files are attributed using the map file of the first build,
+# which records the object file of each function and data section (the
+# firmware is compiled with -ffunction-sections and -fdata-sections). Symbols
+# that only exist in the second file, e.g., LTO-private clones, are accounted
+# to the object of the symbol they were derived from if it can be found, and
+# to "?" otherwise.
+#
+# Usage:
+#
+#   tools/size-diff.py [--nm arm-none-eabi-nm] [--map base.map] [--top 30] base.elf new.elf
+#
+import re
+import argparse
+import subprocess
+from collections import defaultdict
+
+# nm symbol types stored in the flash memory and in the RAM (.data is in both)
+FLASH_TYPES = set('tTrRdD')
+RAM_TYPES = set('dDbBsS')
+
+
+def load_symbols(nm, elf):
+    '''Return a dict mapping symbol names to (type, size)'''
+    out = subprocess.run([nm, '--print-size', '--size-sort', elf], check=True,
+        capture_output=True, text=True).stdout
+    symbols = {}
+    for line in out.splitlines():
+        fields = line.split()
+        if len(fields) != 4:
+            continue
+        _, size, kind, name = fields
+        prev = symbols.get(name)
+        size = int(size, 16)
+        # Static symbols with the same name in several objects are summed
+        symbols[name] = (kind, size + (prev[1] if prev else 0))
+    return symbols
+
+
+def load_map(filename):
+    '''Return a dict mapping symbol names to the object file that defines them'''
+    objects = {}
+    section = None
+    with open(filename) as f:
+        for line in f:
+            m = re.match(r'^ \.(?:text|rodata|data|bss)(?:\.startup|\.unlikely|\.hot)?\.(\S+)(?:\s+0x[0-9a-f]+\s+0x[0-9a-f]+\s+(\S+))?', line)
+            if m:
+                if m.group(2):
+                    objects.setdefault(m.group(1), base_object(m.group(2)))
+                    section = None
+                else:
+                    # Long section names continue on the next line
+                    section = m.group(1)
+                continue
+            if section:
+                m = re.match(r'^\s+0x[0-9a-f]+\s+0x[0-9a-f]+\s+(\S+)', line)
+                if m: objects.setdefault(section, base_object(m.group(1)))
+                section = None
+    return objects
+
+
+def base_object(path):
+    # Objects extracted from archives are accounted to the archive
+    path = re.sub(r'\(.*\)$', '', path)
+    return path.rsplit('/', 1)[-1]
+
+
+def object_of(name, objects):
+    if name in objects:
+        return objects[name]
+    # GCC clones (foo.constprop.0, foo.isra.0, foo.lto_priv.0, ...)
+    return objects.get(name.split('.', 1)[0], '?')
+
+
+def totals(symbols):
+    flash = sum(s for k, s in symbols.values() if k in FLASH_TYPES)
+    ram = sum(s for k, s in symbols.values() if k in RAM_TYPES)
+    return flash, ram
+
+
+def delta(a, b):
+    return f'{b - a:+d}' if a != b else '0'
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Compare the sizes of two firmware ELF files')
+    parser.add_argument('--nm', default='arm-none-eabi-nm', help='The nm binary of the toolchain')
+    parser.add_argument('--map', help='Map file of the first build, used to attribute symbols to objects')
+    parser.add_argument('--top', type=int, default=30, help='The number of symbols with the largest change to print')
+    parser.add_argument('base', help='The ELF file to compare against')
+    parser.add_argument('new', help='The new ELF file')
+    args = parser.parse_args()
+
+    base = load_symbols(args.nm, args.base)
+    new = load_symbols(args.nm, args.new)
+
+    bf, br = totals(base)
+    nf, nr = totals(new)
+    print(f'{"":>8} {"base":>9} {"new":>9} {"delta":>8}')
+    print(f'{"flash":>8} {bf:>9} {nf:>9} {delta(bf, nf):>8}')
+    print(f'{"ram":>8} {br:>9} {nr:>9} {delta(br, nr):>8}')
+
+    if args.map:
+        objects = load_map(args.map)
+        per_object = defaultdict(lambda: [0, 0])
+        for i, symbols in enumerate((base, new)):
+            for name, (kind, size) in symbols.items():
+                per_object[object_of(name, objects)][i] += size
+
+        print()
+        print(f'{"object":>32} {"base":>9} {"new":>9} {"delta":>8}')
+        for obj, (a, b) in sorted(per_object.items(), key=lambda v: v[1][1] - v[1][0]):
+            if a != b:
+                print(f'{obj:>32} {a:>9} {b:>9} {delta(a, b):>8}')
+
+    changes = []
+    for name in set(base) | set(new):
+        a = base[name][1] if name in base else 0
+        b = new[name][1] if name in new else 0
+        if a != b:
+            changes.append((b - a, name, a, b))
+    changes.sort(key=lambda v: -abs(v[0]))
+
+    print()
+    print(f'{"symbol":>32} {"base":>9} {"new":>9} {"delta":>8}')
+    for _, name, a, b in changes[:args.top]:
+        print(f'{name[:32]:>32} {a:>9} {b:>9} {delta(a, b):>8}')
+
+
+if __name__ == '__main__':
+    main()